@@ -0,0 +1,197 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    apdu.c
+ * @brief   Command and response APDU descriptors shared by the ultra-light library and the PKCS#11 module.
+ */
+
+#include <string.h>
+#include "apdu.h"
+
+
+
+/**
+ * Start the descriptor of a command without data and Le
+ */
+void apdu_init(struct apdu *apdu, unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2)
+{
+	memset(apdu, 0, sizeof(*apdu));
+	apdu->cla = cla;
+	apdu->ins = ins;
+	apdu->p1 = p1;
+	apdu->p2 = p2;
+}
+
+
+
+/**
+ * Append a part to the command data. The part is not copied and must stay valid until the
+ * command is sent.
+ *
+ * @return 0 or -1 if there are APDU_MAX_PARTS parts already
+ */
+int apdu_add(struct apdu *apdu, const unsigned char *base, size_t len)
+{
+	if (len == 0)
+		return 0;
+	if (apdu->parts >= APDU_MAX_PARTS)
+		return -1;
+	apdu->body[apdu->parts].base = base;
+	apdu->body[apdu->parts].len = len;
+	apdu->parts++;
+	return 0;
+}
+
+
+
+/**
+ * Length of the command data
+ */
+size_t apdu_nc(const struct apdu *apdu)
+{
+	size_t nc = 0;
+	int i;
+
+	for (i = 0; i < apdu->parts; i++)
+		nc += apdu->body[i].len;
+	return nc;
+}
+
+
+
+static int isShort(const struct apdu *apdu, size_t nc)
+{
+	return !apdu->extended && (nc <= 255) && (apdu->ne <= 256);
+}
+
+
+
+/**
+ * Length of the encoded command APDU
+ */
+size_t apdu_length(const struct apdu *apdu)
+{
+	size_t nc = apdu_nc(apdu), len = APDU_HEADER_LENGTH + nc;
+
+	if (isShort(apdu, nc))
+		return len + (nc ? 1 : 0) + (apdu->ne ? 1 : 0);
+	return len + (nc ? 3 : 0) + (apdu->ne ? (nc ? 2 : 3) : 0);
+}
+
+
+
+/**
+ * Encode the command APDU, gathering the parts of the command data
+ *
+ * @param apdu the command
+ * @param buf buffer receiving the encoded APDU
+ * @param size size of buf
+ * @return the length of the encoded APDU or -1 if buf is too small or Nc or Ne are out of range
+ */
+int apdu_encode(const struct apdu *apdu, unsigned char *buf, size_t size)
+{
+	size_t nc = apdu_nc(apdu), ne = apdu->ne;
+	unsigned char *p = buf;
+	int i, sh;
+
+	if ((nc > 65535) || (ne > 65536) || (apdu_length(apdu) > size))
+		return -1;
+
+	sh = isShort(apdu, nc);
+
+	*p++ = apdu->cla;
+	*p++ = apdu->ins;
+	*p++ = apdu->p1;
+	*p++ = apdu->p2;
+
+	if (nc) {
+		if (sh) {                               /* Case 3s or 4s */
+			*p++ = (unsigned char)nc;
+		} else {                                /* Case 3e or 4e */
+			*p++ = 0;
+			*p++ = (unsigned char)(nc >> 8);
+			*p++ = (unsigned char)nc;
+		}
+		for (i = 0; i < apdu->parts; i++) {
+			memcpy(p, apdu->body[i].base, apdu->body[i].len);
+			p += apdu->body[i].len;
+		}
+	}
+
+	if (ne) {
+		if (sh) {                               /* Case 2s or 4s, 256 is 00 */
+			*p++ = (unsigned char)ne;
+		} else {                                /* Case 2e or 4e, 65536 is 00 00 */
+			if (!nc)
+				*p++ = 0;
+			*p++ = (unsigned char)(ne >> 8);
+			*p++ = (unsigned char)ne;
+		}
+	}
+
+	return (int)(p - buf);
+}
+
+
+
+/**
+ * Return 1 if the longest response to the command fits with SW1SW2 into the caller buffer
+ */
+int apdu_in_place(const struct apdu *apdu)
+{
+	return apdu->data && (apdu->size >= apdu->ne + 2);
+}
+
+
+
+/**
+ * Take SW1SW2 and the data of a response APDU. The data is copied to the caller buffer, as far
+ * as it fits, unless the response was received there.
+ *
+ * @param apdu the command
+ * @param rapdu the response APDU
+ * @param rapdu_len length of the response APDU
+ * @return the length of the response data or -1 if SW1SW2 is missing
+ */
+int apdu_response(struct apdu *apdu, const unsigned char *rapdu, size_t rapdu_len)
+{
+	size_t n;
+
+	if (rapdu_len < 2)
+		return -1;
+
+	apdu->len = rapdu_len - 2;
+	apdu->sw1sw2 = (rapdu[apdu->len] << 8) | rapdu[apdu->len + 1];
+
+	if (apdu->data && (rapdu != apdu->data)) {
+		n = apdu->len < apdu->size ? apdu->len : apdu->size;
+		memcpy(apdu->data, rapdu, n);
+	}
+
+	return (int)apdu->len;
+}
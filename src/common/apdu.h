@@ -0,0 +1,77 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    apdu.h
+ * @brief   Command and response APDU descriptors shared by the ultra-light library and the PKCS#11 module.
+ */
+
+#ifndef ___APDU_H_INC___
+#define ___APDU_H_INC___
+
+#include <stddef.h>
+
+/*
+	A struct apdu describes one command and receives its response.
+
+	The command data is given in parts, e.g. a data object header followed by the caller's data,
+	which apdu_encode() gathers straight into the buffer the transport sends. The response data
+	is returned in the caller's buffer apdu.data and SW1SW2 in apdu.sw1sw2. A transport that needs
+	one buffer for data and SW1SW2 receives into apdu.data if it has room for Ne bytes and SW1SW2
+	(apdu_in_place()), and only otherwise into a buffer of its own.
+*/
+
+#define APDU_MAX_PARTS          4
+#define APDU_HEADER_LENGTH      4
+#define APDU_MAX_OVERHEAD       (APDU_HEADER_LENGTH + 3 + 3)    /* header, extended Lc and Le */
+
+struct apdu_iov {
+	const unsigned char *base;
+	size_t len;
+};
+
+struct apdu {
+	unsigned char cla, ins, p1, p2;
+	struct apdu_iov body[APDU_MAX_PARTS];   /* command data in parts */
+	int parts;
+	size_t ne;                  /* expected response length, 0 without Le, 256 or 65536 for all */
+	int extended;               /* use extended length fields even if Nc and Ne fit in short ones */
+	unsigned char *data;        /* caller buffer for the response data, NULL if none */
+	size_t size;                /* size of data */
+	size_t len;                 /* length of the response data, can exceed size if truncated */
+	unsigned short sw1sw2;
+};
+
+void apdu_init(struct apdu *apdu, unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2);
+int apdu_add(struct apdu *apdu, const unsigned char *base, size_t len);
+size_t apdu_nc(const struct apdu *apdu);
+size_t apdu_length(const struct apdu *apdu);
+int apdu_encode(const struct apdu *apdu, unsigned char *buf, size_t size);
+int apdu_in_place(const struct apdu *apdu);
+int apdu_response(struct apdu *apdu, const unsigned char *rapdu, size_t rapdu_len);
+
+#endif /* ___APDU_H_INC___ */
@@ -0,0 +1,747 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    emulator.c
+ * @brief   In-process SmartCard-HSM emulator for tests and benchmarks without hardware.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "mutex.h"
+#include "emulator.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#else
+#include <Windows.h>
+#endif
+
+/* ISO 7816-4 status words */
+#define SW_OK                   0x9000
+#define SW_WRONG_LENGTH         0x6700
+#define SW_NOT_AUTHENTICATED    0x6982
+#define SW_PIN_BLOCKED          0x6983
+#define SW_WRONG_DATA           0x6A80
+#define SW_FILE_NOT_FOUND       0x6A82
+#define SW_NO_MEMORY            0x6A84
+#define SW_WRONG_P1P2           0x6A86
+#define SW_KEY_NOT_FOUND        0x6A88
+#define SW_WRONG_OFFSET         0x6B00
+#define SW_INS_NOT_SUPPORTED    0x6D00
+#define SW_PIN_RETRIES          0x63C0
+
+#define PIN_RETRIES             3
+
+#define KEY_NONE                0
+#define KEY_RSA                 1
+#define KEY_EC                  2
+
+/* SmartCard-HSM answer to reset, as checked by the PKCS#11 module */
+const unsigned char emu_atr[] = {
+	0x3B, 0xFE, 0x18, 0x00, 0x00, 0x81, 0x31, 0xFE,
+	0x45, 0x80, 0x31, 0x81, 0x54, 0x48, 0x53, 0x4D,
+	0x31, 0x73, 0x80, 0x21, 0x40, 0x81, 0x07, 0xFA
+};
+const size_t emu_atr_len = sizeof(emu_atr);
+
+static const unsigned char aid[] = { 0xE8, 0x2B, 0x06, 0x01, 0x04, 0x01, 0x81, 0xC3, 0x1F, 0x02, 0x01 };
+
+struct emu_file {
+	unsigned short fid;
+	int keyType;                    /* KEY_NONE for an elementary file */
+	int keyBits;
+	size_t len;
+	unsigned char *data;
+};
+
+struct emu_card {
+	MUTEX lock;                     /* one command at a time */
+	int authenticated;
+	int retries;
+	unsigned int seed;              /* GET CHALLENGE */
+	int files;
+	struct emu_file file[EMU_MAX_FILES];
+};
+
+struct emu_apdu {
+	unsigned char cla, ins, p1, p2;
+	size_t nc;
+	const unsigned char *data;
+	size_t ne;                      /* 0 if Le is absent */
+};
+
+static int emu_state = -1;          /* -1 until emu_active() is called first, then 0 or 1 */
+static int emu_count;
+static struct emu_card *emu_card;
+static char emu_pin[17];
+static unsigned long emu_latency[256];
+
+#ifndef _WIN32
+static pthread_once_t emu_once = PTHREAD_ONCE_INIT;
+#else
+static INIT_ONCE emu_once = INIT_ONCE_STATIC_INIT;
+#endif
+
+
+
+/**
+ * Add a file from the emulator directory to the first card
+ */
+static void loadFile(const char *dir, const char *name)
+{
+	struct emu_card *card = &emu_card[0];
+	struct emu_file *file;
+	char path[1024], text[32];
+	unsigned int fid;
+	long len;
+	int i;
+	FILE *fp;
+
+	for (i = 0; i < 4; i++) {
+		if (!isxdigit((unsigned char)name[i]))
+			return;
+	}
+
+	if (name[4] || (card->files >= EMU_MAX_FILES) || (sscanf(name, "%x", &fid) != 1))
+		return;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))
+		return;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return;
+
+	file = &card->file[card->files];
+	memset(file, 0, sizeof(*file));
+	file->fid = (unsigned short)fid;
+
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if ((fid >> 8) == 0xCC) {
+		len = (long)fread(text, 1, sizeof(text) - 1, fp);
+		text[len > 0 ? len : 0] = 0;
+		if (sscanf(text, "rsa %d", &file->keyBits) == 1)
+			file->keyType = KEY_RSA;
+		else if (sscanf(text, "ec %d", &file->keyBits) == 1)
+			file->keyType = KEY_EC;
+		if ((file->keyType != KEY_NONE) && (file->keyBits > 0) && (file->keyBits <= 4096))
+			card->files++;
+	} else if (len >= 0) {
+		file->data = (unsigned char *)malloc(len ? len : 1);
+		if (file->data && ((long)fread(file->data, 1, len, fp) == len)) {
+			file->len = len;
+			card->files++;
+		} else {
+			free(file->data);
+		}
+	}
+
+	fclose(fp);
+}
+
+
+
+/**
+ * Read the files of the emulator directory
+ */
+static void loadDirectory(const char *dir)
+{
+#ifndef _WIN32
+	DIR *d;
+	struct dirent *e;
+
+	d = opendir(dir);
+	if (d == NULL)
+		return;
+
+	while ((e = readdir(d)) != NULL)
+		loadFile(dir, e->d_name);
+
+	closedir(d);
+#else
+	WIN32_FIND_DATAA fd;
+	HANDLE h;
+	char pattern[1024];
+
+	if (snprintf(pattern, sizeof(pattern), "%s\\*", dir) >= (int)sizeof(pattern))
+		return;
+
+	h = FindFirstFileA(pattern, &fd);
+	if (h == INVALID_HANDLE_VALUE)
+		return;
+
+	do {
+		loadFile(dir, fd.cFileName);
+	} while (FindNextFileA(h, &fd));
+
+	FindClose(h);
+#endif
+}
+
+
+
+/**
+ * Parse SC_HSM_EMULATOR_LATENCY, e.g. "68:100000,*:2000"
+ */
+static void parseLatency(const char *s)
+{
+	unsigned char given[256];
+	unsigned int ins;
+	unsigned long us, other = 0;
+	int i;
+
+	memset(given, 0, sizeof(given));
+
+	while (s && *s) {
+		if ((s[0] == '*') && (sscanf(s + 1, ":%lu", &us) == 1)) {
+			other = us;
+		} else if ((sscanf(s, "%x:%lu", &ins, &us) == 2) && (ins < 256)) {
+			emu_latency[ins] = us;
+			given[ins] = 1;
+		} else {
+			break;
+		}
+		s = strchr(s, ',');
+		if (s)
+			s++;
+	}
+
+	for (i = 0; i < 256; i++)
+		if (!given[i])
+			emu_latency[i] = other;
+}
+
+
+
+/**
+ * Set up the cards from the environment, once
+ */
+#ifndef _WIN32
+static void emu_init(void)
+#else
+static BOOL CALLBACK emu_init(PINIT_ONCE once, PVOID param, PVOID *context)
+#endif
+{
+	const char *dir, *s;
+	int i, j;
+
+	emu_state = 0;
+	dir = getenv("SC_HSM_EMULATOR");
+	if (dir == NULL || *dir == 0)
+		goto done;
+
+	s = getenv("SC_HSM_EMULATOR_READERS");
+	emu_count = s ? atoi(s) : 1;
+	if (emu_count < 1)
+		emu_count = 1;
+	if (emu_count > EMU_MAX_READERS)
+		emu_count = EMU_MAX_READERS;
+
+	s = getenv("SC_HSM_EMULATOR_PIN");
+	strncpy(emu_pin, s ? s : "648219", sizeof(emu_pin) - 1);
+
+	parseLatency(getenv("SC_HSM_EMULATOR_LATENCY"));
+
+	emu_card = (struct emu_card *)calloc(emu_count, sizeof(struct emu_card));
+	if (emu_card == NULL)
+		goto done;
+
+	loadDirectory(dir);
+
+	for (i = 0; i < emu_count; i++) {
+		if (i > 0) {
+			emu_card[i].files = emu_card[0].files;
+			for (j = 0; j < emu_card[0].files; j++) {
+				emu_card[i].file[j] = emu_card[0].file[j];
+				if (emu_card[0].file[j].data) {
+					emu_card[i].file[j].data = (unsigned char *)malloc(emu_card[0].file[j].len + 1);
+					if (emu_card[i].file[j].data == NULL)
+						emu_card[i].file[j].len = 0;
+					else
+						memcpy(emu_card[i].file[j].data, emu_card[0].file[j].data, emu_card[0].file[j].len);
+				}
+			}
+		}
+		mutex_init(&emu_card[i].lock);
+		emu_card[i].retries = PIN_RETRIES;
+		emu_card[i].seed = 0x5C45A000 + i;
+	}
+
+	emu_state = 1;
+
+done:
+#ifdef _WIN32
+	return TRUE;
+#else
+	return;
+#endif
+}
+
+
+
+/**
+ * Return 1 if SC_HSM_EMULATOR replaces the readers, 0 otherwise
+ */
+int emu_active(void)
+{
+	if (emu_state < 0) {
+#ifndef _WIN32
+		pthread_once(&emu_once, emu_init);
+#else
+		InitOnceExecuteOnce(&emu_once, emu_init, NULL, NULL);
+#endif
+	}
+	return emu_state;
+}
+
+
+
+/**
+ * Number of virtual readers
+ */
+int emu_readers(void)
+{
+	return emu_active() ? emu_count : 0;
+}
+
+
+
+/**
+ * Power the card of a reader up again, which drops the PIN authentication
+ *
+ * @param reader Index of the reader, 0 .. emu_readers() - 1
+ * @return 0 or -1 if there is no such reader
+ */
+int emu_reset(int reader)
+{
+	if ((reader < 0) || (reader >= emu_readers()))
+		return -1;
+
+	mutex_lock(&emu_card[reader].lock);
+	emu_card[reader].authenticated = 0;
+	mutex_unlock(&emu_card[reader].lock);
+	return 0;
+}
+
+
+
+static struct emu_file *findFile(struct emu_card *card, unsigned short fid)
+{
+	int i;
+
+	for (i = 0; i < card->files; i++)
+		if (card->file[i].fid == fid)
+			return &card->file[i];
+	return NULL;
+}
+
+
+
+/**
+ * Deterministic filler for signatures and challenges
+ */
+static unsigned char nextByte(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (unsigned char)(*seed >> 16);
+}
+
+
+
+static int verify(struct emu_card *card, struct emu_apdu *c)
+{
+	if (c->p1 != 0x00 || c->p2 != 0x81)
+		return SW_WRONG_P1P2;
+
+	if (c->nc == 0) {
+		if (card->authenticated)
+			return SW_OK;
+		return card->retries ? SW_PIN_RETRIES | card->retries : SW_PIN_BLOCKED;
+	}
+
+	if (card->retries == 0)
+		return SW_PIN_BLOCKED;
+
+	if (c->nc < 6 || c->nc > 16)
+		return SW_WRONG_LENGTH;
+
+	if ((c->nc == strlen(emu_pin)) && !memcmp(c->data, emu_pin, c->nc)) {
+		card->authenticated = 1;
+		card->retries = PIN_RETRIES;
+		return SW_OK;
+	}
+
+	card->authenticated = 0;
+	card->retries--;
+	return card->retries ? SW_PIN_RETRIES | card->retries : SW_PIN_BLOCKED;
+}
+
+
+
+static int enumerateObjects(struct emu_card *card, struct emu_apdu *c, unsigned char *r, size_t *rlen)
+{
+	int i;
+
+	if ((size_t)card->files * 2 > *rlen)
+		return SW_WRONG_LENGTH;
+
+	for (i = 0; i < card->files; i++) {
+		r[i * 2] = card->file[i].fid >> 8;
+		r[i * 2 + 1] = card->file[i].fid & 0xFF;
+	}
+	*rlen = card->files * 2;
+	return SW_OK;
+}
+
+
+
+/**
+ * Decode the offset DO 54 02 of READ BINARY and UPDATE BINARY
+ */
+static int decodeOffset(struct emu_apdu *c, size_t *off)
+{
+	if (c->nc < 4 || c->data[0] != 0x54 || c->data[1] != 0x02)
+		return -1;
+	*off = (c->data[2] << 8) | c->data[3];
+	return 0;
+}
+
+
+
+static int readBinary(struct emu_card *card, struct emu_apdu *c, unsigned char *r, size_t *rlen)
+{
+	struct emu_file *file;
+	size_t off, n;
+
+	file = findFile(card, (c->p1 << 8) | c->p2);
+	if (file == NULL)
+		return SW_FILE_NOT_FOUND;
+
+	if (file->keyType != KEY_NONE)
+		return SW_NOT_AUTHENTICATED;
+
+	if ((c->p1 == 0xCD) && !card->authenticated)
+		return SW_NOT_AUTHENTICATED;
+
+	if (decodeOffset(c, &off) < 0)
+		return SW_WRONG_DATA;
+
+	if (off > file->len)
+		return SW_WRONG_OFFSET;
+
+	n = file->len - off;
+	if (n > c->ne)
+		n = c->ne;
+
+	/* like a reader the caller truncates, *rlen is the length sent by the card */
+	memcpy(r, file->data + off, n < *rlen ? n : *rlen);
+	*rlen = n;
+	return SW_OK;
+}
+
+
+
+static int updateBinary(struct emu_card *card, struct emu_apdu *c)
+{
+	struct emu_file *file;
+	const unsigned char *p, *end;
+	unsigned char *data;
+	size_t off, n;
+
+	if (decodeOffset(c, &off) < 0)
+		return SW_WRONG_DATA;
+
+	p = c->data + 4;
+	end = c->data + c->nc;
+
+	/* 53 with a length, or 53 00 for the rest of the command data */
+	if (p + 2 > end || *p++ != 0x53)
+		return SW_WRONG_DATA;
+
+	n = *p++;
+	if (n == 0x81 && p < end) {
+		n = *p++;
+	} else if (n == 0x82 && p + 1 < end) {
+		n = (p[0] << 8) | p[1];
+		p += 2;
+	} else if (n == 0) {
+		n = end - p;
+	} else if (n > 0x80) {
+		return SW_WRONG_DATA;
+	}
+
+	if (n > (size_t)(end - p))
+		return SW_WRONG_LENGTH;
+
+	file = findFile(card, (c->p1 << 8) | c->p2);
+	if (file == NULL) {
+		if (card->files >= EMU_MAX_FILES)
+			return SW_NO_MEMORY;
+		file = &card->file[card->files++];
+		memset(file, 0, sizeof(*file));
+		file->fid = (c->p1 << 8) | c->p2;
+	}
+
+	if (file->keyType != KEY_NONE)
+		return SW_NOT_AUTHENTICATED;
+
+	if (off + n > file->len) {
+		data = (unsigned char *)realloc(file->data, off + n);
+		if (data == NULL)
+			return SW_NO_MEMORY;
+		if (off > file->len)
+			memset(data + file->len, 0, off - file->len);
+		file->data = data;
+		file->len = off + n;
+	}
+
+	memcpy(file->data + off, p, n);
+	return SW_OK;
+}
+
+
+
+/**
+ * Append a DER INTEGER of n bytes derived from the input to r
+ */
+static unsigned char *encodeInteger(unsigned char *r, size_t n, struct emu_apdu *c, unsigned int *seed)
+{
+	size_t i;
+
+	*r++ = 0x02;
+	*r++ = (unsigned char)n;
+	for (i = 0; i < n; i++)
+		*r++ = c->nc ? c->data[i % c->nc] ^ nextByte(seed) : nextByte(seed);
+	r[-(int)n] = (r[-(int)n] & 0x7F) | 0x01;       /* positive without leading 00 */
+	return r;
+}
+
+
+
+static int sign(struct emu_card *card, struct emu_apdu *c, unsigned char *r, size_t *rlen)
+{
+	struct emu_file *file;
+	unsigned int seed = 0x5C45;
+	size_t n, i, seqlen;
+	int ecdsa;
+
+	file = findFile(card, 0xCC00 | c->p1);
+	if (file == NULL || file->keyType == KEY_NONE)
+		return SW_KEY_NOT_FOUND;
+
+	if (!card->authenticated)
+		return SW_NOT_AUTHENTICATED;
+
+	ecdsa = (c->p2 & 0xF0) == 0x70;
+	if (ecdsa != (file->keyType == KEY_EC))
+		return SW_WRONG_DATA;
+
+	n = (file->keyBits + 7) >> 3;
+
+	if (!ecdsa) {
+		if ((c->p2 == 0x20) && (c->nc != n))
+			return SW_WRONG_LENGTH;
+		if (n > *rlen)
+			return SW_WRONG_LENGTH;
+		for (i = 0; i < n; i++)
+			r[i] = c->nc ? c->data[i % c->nc] ^ nextByte(&seed) : nextByte(&seed);
+		r[0] &= 0x7F;                           /* below the modulus */
+		*rlen = n;
+		return SW_OK;
+	}
+
+	seqlen = 2 * (2 + n);
+	if (seqlen + 3 > *rlen)
+		return SW_WRONG_LENGTH;
+
+	*r++ = 0x30;
+	if (seqlen > 0x7F)
+		*r++ = 0x81;
+	*r++ = (unsigned char)seqlen;
+	r = encodeInteger(r, n, c, &seed);
+	encodeInteger(r, n, c, &seed);
+	*rlen = seqlen + (seqlen > 0x7F ? 3 : 2);
+	return SW_OK;
+}
+
+
+
+static int decipher(struct emu_card *card, struct emu_apdu *c, unsigned char *r, size_t *rlen)
+{
+	struct emu_file *file;
+
+	file = findFile(card, 0xCC00 | c->p1);
+	if (file == NULL || file->keyType == KEY_NONE)
+		return SW_KEY_NOT_FOUND;
+
+	if (!card->authenticated)
+		return SW_NOT_AUTHENTICATED;
+
+	if (file->keyType != KEY_RSA)
+		return SW_WRONG_DATA;
+
+	if (c->nc != (size_t)((file->keyBits + 7) >> 3) || c->nc > *rlen)
+		return SW_WRONG_LENGTH;
+
+	memcpy(r, c->data, c->nc);
+	*rlen = c->nc;
+	return SW_OK;
+}
+
+
+
+static int getChallenge(struct emu_card *card, struct emu_apdu *c, unsigned char *r, size_t *rlen)
+{
+	size_t i;
+
+	if (c->ne == 0 || c->ne > *rlen)
+		return SW_WRONG_LENGTH;
+
+	for (i = 0; i < c->ne; i++)
+		r[i] = nextByte(&card->seed);
+	*rlen = c->ne;
+	return SW_OK;
+}
+
+
+
+static void delay(unsigned long us)
+{
+#ifndef _WIN32
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+#else
+	Sleep((us + 999) / 1000);
+#endif
+}
+
+
+
+/**
+ * Process a command with the card of a virtual reader. The response data is written straight
+ * into apdu->data.
+ *
+ * @param reader     Index of the reader, 0 .. emu_readers() - 1
+ * @param apdu       Command, receives the response
+ * @return Length of the response data or -1 on error
+ */
+int emu_transmit(int reader, struct apdu *apdu)
+{
+	struct emu_card *card;
+	struct emu_apdu c;
+	unsigned char *gathered = NULL, *r;
+	size_t rlen;
+	int sw, i;
+
+	if ((reader < 0) || (reader >= emu_readers()))
+		return -1;
+
+	c.cla = apdu->cla;
+	c.ins = apdu->ins;
+	c.p1 = apdu->p1;
+	c.p2 = apdu->p2;
+	c.nc = apdu_nc(apdu);
+	c.ne = apdu->ne;
+	c.data = apdu->parts ? apdu->body[0].base : NULL;
+
+	if (apdu->parts > 1) {
+		gathered = (unsigned char *)malloc(c.nc);
+		if (gathered == NULL)
+			return -1;
+		for (rlen = 0, i = 0; i < apdu->parts; i++) {
+			memcpy(gathered + rlen, apdu->body[i].base, apdu->body[i].len);
+			rlen += apdu->body[i].len;
+		}
+		c.data = gathered;
+	}
+
+	r = apdu->data;
+	rlen = apdu->data ? apdu->size : 0;
+
+	card = &emu_card[reader];
+	mutex_lock(&card->lock);
+
+	switch (c.ins) {
+	case 0xA4:                                  /* SELECT */
+		if (c.p1 == 0x04 && c.nc == sizeof(aid) && !memcmp(c.data, aid, sizeof(aid)))
+			sw = SW_OK;
+		else
+			sw = SW_FILE_NOT_FOUND;
+		rlen = 0;
+		break;
+	case 0x20:                                  /* VERIFY */
+		sw = verify(card, &c);
+		rlen = 0;
+		break;
+	case 0x58:                                  /* ENUMERATE OBJECTS */
+		sw = enumerateObjects(card, &c, r, &rlen);
+		break;
+	case 0xB1:                                  /* READ BINARY */
+		sw = readBinary(card, &c, r, &rlen);
+		break;
+	case 0xD7:                                  /* UPDATE BINARY */
+		sw = updateBinary(card, &c);
+		rlen = 0;
+		break;
+	case 0x68:                                  /* SIGN */
+		sw = sign(card, &c, r, &rlen);
+		break;
+	case 0x62:                                  /* DECIPHER */
+		sw = decipher(card, &c, r, &rlen);
+		break;
+	case 0x84:                                  /* GET CHALLENGE */
+		sw = getChallenge(card, &c, r, &rlen);
+		break;
+	default:
+		sw = SW_INS_NOT_SUPPORTED;
+		break;
+	}
+	if (sw != SW_OK)
+		rlen = 0;
+
+	if (emu_latency[c.ins])
+		delay(emu_latency[c.ins]);
+
+	mutex_unlock(&card->lock);
+
+	free(gathered);
+
+	apdu->len = rlen;
+	apdu->sw1sw2 = (unsigned short)sw;
+	return (int)rlen;
+}
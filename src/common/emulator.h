@@ -0,0 +1,74 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    emulator.h
+ * @brief   In-process SmartCard-HSM emulator for tests and benchmarks without hardware.
+ */
+
+#ifndef ___EMULATOR_H_INC___
+#define ___EMULATOR_H_INC___
+
+#include <stddef.h>
+#include "apdu.h"
+
+/*
+	The emulator is enabled by the environment variable SC_HSM_EMULATOR naming a directory with
+	the content of the emulated token. It replaces the PC/SC or CT-API readers of the PKCS#11
+	module and of the ultra-light library by SC_HSM_EMULATOR_READERS (default 1) virtual readers
+	named "SmartCard-HSM Emulator <n>", each with a card holding its own copy of the token.
+
+	Each file of the directory whose name consists of 4 hex digits is an elementary file with that
+	file identifier, e.g. C401 for the PRKD and CE01 for the certificate of key 1. Key files CCxx
+	contain the text "rsa <bits>" or "ec <bits>" instead of a key. Keys never leave the emulator,
+	so READ BINARY of a key file fails like on the card.
+
+	The emulator implements SELECT of the SmartCard-HSM application, VERIFY against the user PIN
+	SC_HSM_EMULATOR_PIN (default 648219, 3 retries), ENUMERATE OBJECTS, READ BINARY, UPDATE BINARY,
+	SIGN, DECIPHER and GET CHALLENGE. Signatures have the length and the encoding of the key, but
+	are derived from the input and can not be verified. They serve to measure the host side, not
+	as cryptography.
+
+	SC_HSM_EMULATOR_LATENCY adds a fixed delay per command as a comma separated list of
+	<INS>:<microseconds> with INS in hex or * for all other instructions, e.g. "68:100000,*:2000".
+	Commands to the same card are processed one at a time, like on a reader.
+*/
+
+#define EMU_MAX_READERS     16
+#define EMU_MAX_FILES       256
+#define EMU_READER_NAME     "SmartCard-HSM Emulator"
+
+/* answer to reset of the emulated card */
+extern const unsigned char emu_atr[];
+extern const size_t emu_atr_len;
+
+int emu_active(void);
+int emu_readers(void);
+int emu_reset(int reader);
+int emu_transmit(int reader, struct apdu *apdu);
+
+#endif /* ___EMULATOR_H_INC___ */
@@ -33,6 +33,7 @@
 
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 #include "mutex.h"
 
 /*
@@ -98,6 +99,115 @@ int mutex_unlock(MUTEX *pmutex)
 	return pthread_mutex_unlock(&pmutex->mutex);
 }
 
+int rwlock_init(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return ENOMEM;
+	return pthread_rwlock_init(plock, NULL);
+}
+
+int rwlock_destroy(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return EINVAL;
+	return pthread_rwlock_destroy(plock);
+}
+
+int rwlock_rdlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return EINVAL;
+	return pthread_rwlock_rdlock(plock);
+}
+
+int rwlock_rdunlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return EINVAL;
+	return pthread_rwlock_unlock(plock);
+}
+
+int rwlock_wrlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return EINVAL;
+	return pthread_rwlock_wrlock(plock);
+}
+
+int rwlock_wrunlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return EINVAL;
+	return pthread_rwlock_unlock(plock);
+}
+
+int condvar_init(CONDVAR *pcond)
+{
+	int rc;
+	if (pcond == NULL)
+		return ENOMEM;
+	rc = pthread_mutex_init(&pcond->mutex, NULL);
+	if (rc)
+		return rc;
+	rc = pthread_cond_init(&pcond->cond, NULL);
+	if (rc)
+		pthread_mutex_destroy(&pcond->mutex);
+	return rc;
+}
+
+int condvar_destroy(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return EINVAL;
+	pthread_cond_destroy(&pcond->cond);
+	return pthread_mutex_destroy(&pcond->mutex);
+}
+
+int condvar_lock(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return EINVAL;
+	return pthread_mutex_lock(&pcond->mutex);
+}
+
+int condvar_unlock(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return EINVAL;
+	return pthread_mutex_unlock(&pcond->mutex);
+}
+
+int condvar_wait(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return EINVAL;
+	return pthread_cond_wait(&pcond->cond, &pcond->mutex);
+}
+
+int condvar_timedwait(CONDVAR *pcond, int ms)
+{
+	struct timespec ts;
+	int rc;
+	if (pcond == NULL || ms < 0)
+		return EINVAL;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	rc = pthread_cond_timedwait(&pcond->cond, &pcond->mutex, &ts);
+	return rc == ETIMEDOUT ? 0 : rc;
+}
+
+int condvar_broadcast(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return EINVAL;
+	return pthread_cond_broadcast(&pcond->cond);
+}
+
 #else /* _WIN32 */
 #include <windows.h>
 
@@ -151,6 +261,113 @@ int mutex_unlock(MUTEX *pmutex)
 	return 0;
 }
 
+/* slim reader-writer locks need no cleanup */
+int rwlock_init(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	InitializeSRWLock(plock);
+	return 0;
+}
+
+int rwlock_destroy(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	return 0;
+}
+
+int rwlock_rdlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	AcquireSRWLockShared(plock);
+	return 0;
+}
+
+int rwlock_rdunlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	ReleaseSRWLockShared(plock);
+	return 0;
+}
+
+int rwlock_wrlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	AcquireSRWLockExclusive(plock);
+	return 0;
+}
+
+int rwlock_wrunlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	ReleaseSRWLockExclusive(plock);
+	return 0;
+}
+
+/* condition variables and slim reader-writer locks need no cleanup */
+int condvar_init(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return E_POINTER;
+	InitializeSRWLock(&pcond->lock);
+	InitializeConditionVariable(&pcond->cond);
+	return 0;
+}
+
+int condvar_destroy(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return E_POINTER;
+	return 0;
+}
+
+int condvar_lock(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return E_POINTER;
+	AcquireSRWLockExclusive(&pcond->lock);
+	return 0;
+}
+
+int condvar_unlock(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return E_POINTER;
+	ReleaseSRWLockExclusive(&pcond->lock);
+	return 0;
+}
+
+int condvar_wait(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return E_POINTER;
+	if (!SleepConditionVariableSRW(&pcond->cond, &pcond->lock, INFINITE, 0))
+		return GetLastError();
+	return 0;
+}
+
+int condvar_timedwait(CONDVAR *pcond, int ms)
+{
+	if (pcond == NULL || ms < 0)
+		return E_POINTER;
+	if (!SleepConditionVariableSRW(&pcond->cond, &pcond->lock, ms, 0) && GetLastError() != ERROR_TIMEOUT)
+		return GetLastError();
+	return 0;
+}
+
+int condvar_broadcast(CONDVAR *pcond)
+{
+	if (pcond == NULL)
+		return E_POINTER;
+	WakeAllConditionVariable(&pcond->cond);
+	return 0;
+}
+
 #endif /* _WIN32 */
 #else /* DUMMY_MUTEX */
 
@@ -159,5 +376,18 @@ int mutex_init(MUTEX *pmutex)    { return !pmutex; }
 int mutex_destroy(MUTEX *pmutex) { return !pmutex; }
 int mutex_lock(MUTEX *pmutex)    { return !pmutex; }
 int mutex_unlock(MUTEX *pmutex)  { return !pmutex; }
+int rwlock_init(RWLOCK *plock)     { return !plock; }
+int rwlock_destroy(RWLOCK *plock)  { return !plock; }
+int rwlock_rdlock(RWLOCK *plock)   { return !plock; }
+int rwlock_rdunlock(RWLOCK *plock) { return !plock; }
+int rwlock_wrlock(RWLOCK *plock)   { return !plock; }
+int rwlock_wrunlock(RWLOCK *plock) { return !plock; }
+int condvar_init(CONDVAR *pcond)      { return !pcond; }
+int condvar_destroy(CONDVAR *pcond)   { return !pcond; }
+int condvar_lock(CONDVAR *pcond)      { return !pcond; }
+int condvar_unlock(CONDVAR *pcond)    { return !pcond; }
+int condvar_wait(CONDVAR *pcond)      { return !pcond; }
+int condvar_timedwait(CONDVAR *pcond, int ms) { return !pcond; }
+int condvar_broadcast(CONDVAR *pcond) { return !pcond; }
 
 #endif /* DUMMY_MUTEX */
@@ -73,10 +73,60 @@
 	typedef int MUTEX;
 #endif /* DUMMY_MUTEX */
 
+/*
+	Reader-writer locks for read-mostly data: any number of threads can own the lock shared
+	(rwlock_rdlock), a writer owns it exclusively (rwlock_wrlock). The locks are not recursive
+	and each lock function has its unlock counterpart.
+*/
+#ifndef DUMMY_MUTEX
+	#ifndef _WIN32
+		typedef pthread_rwlock_t RWLOCK;
+	#else /* _WIN32 */
+		typedef SRWLOCK RWLOCK;
+	#endif
+#else
+	typedef int RWLOCK;
+#endif /* DUMMY_MUTEX */
+
+/*
+	Condition variables with their own lock, for threads that wait for a state change made by
+	another thread: condvar_wait releases the lock while waiting and owns it again on return.
+	condvar_timedwait also returns after ms milliseconds, the caller checks the state again.
+	The lock is not recursive.
+*/
+#ifndef DUMMY_MUTEX
+	#ifndef _WIN32
+		typedef struct {
+			pthread_mutex_t mutex;
+			pthread_cond_t cond;
+		} CONDVAR;
+	#else /* _WIN32 */
+		typedef struct {
+			SRWLOCK lock;
+			CONDITION_VARIABLE cond;
+		} CONDVAR;
+	#endif
+#else
+	typedef int CONDVAR;
+#endif /* DUMMY_MUTEX */
+
 int mutex_init(MUTEX *pmutex);
 int mutex_destroy(MUTEX *pmutex);
 int mutex_lock(MUTEX *pmutex);
 int mutex_unlock(MUTEX *pmutex);
+int rwlock_init(RWLOCK *plock);
+int rwlock_destroy(RWLOCK *plock);
+int rwlock_rdlock(RWLOCK *plock);
+int rwlock_rdunlock(RWLOCK *plock);
+int rwlock_wrlock(RWLOCK *plock);
+int rwlock_wrunlock(RWLOCK *plock);
+int condvar_init(CONDVAR *pcond);
+int condvar_destroy(CONDVAR *pcond);
+int condvar_lock(CONDVAR *pcond);
+int condvar_unlock(CONDVAR *pcond);
+int condvar_wait(CONDVAR *pcond);
+int condvar_timedwait(CONDVAR *pcond, int ms);
+int condvar_broadcast(CONDVAR *pcond);
 #define mutex_owner(pmutex) ((pmutex)->owner)
 
 #endif /* ___MUTEX_H_INC___ */
@@ -0,0 +1,415 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    trace.c
+ * @brief   Binary event trace with per-thread ring buffers, enabled at runtime.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/time.h>
+#define BARRIER() __sync_synchronize()
+#define CAS_PTR(ptr, old, val) __sync_bool_compare_and_swap((ptr), (old), (val))
+#define CAS_INT(ptr, old, val) __sync_bool_compare_and_swap((ptr), (old), (val))
+#else
+#include <Windows.h>
+#define BARRIER() MemoryBarrier()
+#define CAS_PTR(ptr, old, val) (InterlockedCompareExchangePointer((PVOID volatile *)(ptr), (val), (old)) == (old))
+#define CAS_INT(ptr, old, val) (InterlockedCompareExchange((LONG volatile *)(ptr), (val), (old)) == (old))
+#endif
+
+/* states of a ring */
+#define RING_USED       0   /* owned by a thread */
+#define RING_EXITED     1   /* owner terminated, not yet drained */
+#define RING_FREE       2   /* drained, can be taken by a new thread */
+
+struct trace_rec {
+	uint64_t ts;
+	int id;
+	intptr_t a[4];
+};
+
+/*
+	Single producer (the owning thread), single consumer (the writer holding trace_lock).
+	The producer fills rec[head % TRACE_RING] before it advances head, the consumer reads
+	up to head before it advances tail.
+*/
+struct trace_ring {
+	struct trace_ring *next;
+	volatile unsigned int head;
+	volatile unsigned int tail;
+	volatile int state;
+	unsigned long tid;
+	unsigned long dropped;          /* written by the producer */
+	unsigned long reported;         /* dropped events already written by the consumer */
+	struct trace_rec rec[TRACE_RING];
+};
+
+volatile int trace_state = -1;
+
+static struct trace_ring * volatile rings;
+static FILE *trace_fp;
+static uint64_t trace_base;
+static volatile int trace_stop;
+
+#ifndef _WIN32
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t trace_thread;
+#else
+static INIT_ONCE trace_once = INIT_ONCE_STATIC_INIT;
+static DWORD trace_key;
+static CRITICAL_SECTION trace_lock;
+static HANDLE trace_wake;
+#endif
+
+
+
+/**
+ * Monotonic time in ns
+ */
+uint64_t trace_now(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart * 1000000000
+		+ count.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+#endif
+}
+
+
+
+static void format(struct trace_ring *ring, struct trace_rec *rec)
+{
+	uint64_t ts = rec->ts - trace_base;
+	intptr_t *a = rec->a;
+
+	fprintf(trace_fp, "%5u.%06u %8lx ", (unsigned int)(ts / 1000000000), (unsigned int)(ts % 1000000000 / 1000), ring->tid);
+
+	switch(rec->id) {
+	case TRACE_P11_CALLED:
+		fprintf(trace_fp, "%s called\n", (const char *)a[0]);
+		break;
+	case TRACE_P11_RETURNS:
+		fprintf(trace_fp, "%s returns rc=%lx\n", (const char *)a[0], (unsigned long)a[1]);
+		break;
+	case TRACE_P11_FAILS:
+		fprintf(trace_fp, "%s fails rc=%lx \"%s\"\n", (const char *)a[0], (unsigned long)a[1], (const char *)a[2]);
+		break;
+	case TRACE_CT_DATA:
+		fprintf(trace_fp, "CT_data ctn=%d lc=%d lr=%d rc=%d\n", (int)a[0], (int)a[1], (int)a[2], (int)a[3]);
+		break;
+	case TRACE_USB_WRITE:
+		fprintf(trace_fp, "USB write type=%02X len=%d rc=%d %dus\n", (int)a[0], (int)a[1], (int)a[2], (int)a[3]);
+		break;
+	case TRACE_USB_READ:
+		fprintf(trace_fp, "USB read  type=%02X len=%d status=%02X %dus\n", (int)a[0], (int)a[1], (int)a[2], (int)a[3]);
+		break;
+	case TRACE_T1_SEND:
+		fprintf(trace_fp, "T1 send    NAD=%02X PCB=%02X LEN=%d\n", (int)a[0], (int)a[1], (int)a[2]);
+		break;
+	case TRACE_T1_RECEIVE:
+		fprintf(trace_fp, "T1 receive NAD=%02X PCB=%02X LEN=%d rc=%d\n", (int)a[0], (int)a[1], (int)a[2], (int)a[3]);
+		break;
+	default:
+		fprintf(trace_fp, "event %d %lx %lx %lx %lx\n", rec->id, (unsigned long)a[0], (unsigned long)a[1], (unsigned long)a[2], (unsigned long)a[3]);
+		break;
+	}
+}
+
+
+
+/**
+ * Write the pending events of all rings, called with trace_lock held
+ */
+static void drain(void)
+{
+	struct trace_ring *ring;
+	unsigned int head, dropped;
+	int state;
+
+	for (ring = rings; ring; ring = ring->next) {
+		state = ring->state;
+		if (state == RING_FREE)
+			continue;
+
+		head = ring->head;
+		BARRIER();
+		while (ring->tail != head) {
+			format(ring, &ring->rec[ring->tail % TRACE_RING]);
+			ring->tail++;
+		}
+		BARRIER();
+
+		dropped = ring->dropped - ring->reported;
+		if (dropped) {
+			fprintf(trace_fp, "%21lx %u events dropped\n", ring->tid, dropped);
+			ring->reported += dropped;
+		}
+
+		if (state == RING_EXITED && ring->tail == ring->head)
+			ring->state = RING_FREE;
+	}
+	fflush(trace_fp);
+}
+
+
+
+/**
+ * Mark the ring of a terminating thread for reuse once it is drained
+ */
+#ifndef _WIN32
+static void release(void *p)
+#else
+static void WINAPI release(void *p)
+#endif
+{
+	if (p)
+		((struct trace_ring *)p)->state = RING_EXITED;
+}
+
+
+
+/**
+ * Get the ring of the calling thread, reusing the ring of a terminated thread if possible
+ */
+static struct trace_ring *ring_get(void)
+{
+	struct trace_ring *ring, *top;
+
+#ifndef _WIN32
+	ring = pthread_getspecific(trace_key);
+#else
+	ring = FlsGetValue(trace_key);
+#endif
+	if (ring)
+		return ring;
+
+	for (ring = rings; ring; ring = ring->next) {
+		if (ring->state == RING_FREE && CAS_INT(&ring->state, RING_FREE, RING_USED))
+			break;
+	}
+
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring));
+		if (!ring)
+			return NULL;
+		do {
+			top = rings;
+			ring->next = top;
+		} while (!CAS_PTR(&rings, top, ring));
+	}
+
+#ifndef _WIN32
+	ring->tid = (unsigned long)pthread_self();
+	pthread_setspecific(trace_key, ring);
+#else
+	ring->tid = GetCurrentThreadId();
+	FlsSetValue(trace_key, ring);
+#endif
+	return ring;
+}
+
+
+
+/**
+ * Final drain at exit or when the shared library is unloaded
+ */
+static void trace_exit(void)
+{
+#ifndef _WIN32
+	pthread_mutex_lock(&trace_lock);
+	trace_state = 0;
+	trace_stop = 1;
+	drain();
+	pthread_cond_signal(&trace_wake);
+	pthread_mutex_unlock(&trace_lock);
+	pthread_join(trace_thread, NULL);
+	pthread_key_delete(trace_key);
+#else
+	/* Waiting for the writer could dead lock in DLL_PROCESS_DETACH, it stops at the next wakeup */
+	EnterCriticalSection(&trace_lock);
+	trace_state = 0;
+	trace_stop = 1;
+	drain();
+	LeaveCriticalSection(&trace_lock);
+	SetEvent(trace_wake);
+#endif
+}
+
+
+
+#ifndef _WIN32
+static void *writer(void *arg)
+{
+	struct timespec ts;
+	struct timeval tv;
+
+	pthread_mutex_lock(&trace_lock);
+	while (!trace_stop) {
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = tv.tv_usec * 1000 + TRACE_FLUSH_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&trace_wake, &trace_lock, &ts);
+		if (!trace_stop)
+			drain();
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return NULL;
+}
+#else
+static DWORD WINAPI writer(LPVOID arg)
+{
+	while (WaitForSingleObject(trace_wake, TRACE_FLUSH_MS) == WAIT_TIMEOUT) {
+		EnterCriticalSection(&trace_lock);
+		if (!trace_stop)
+			drain();
+		LeaveCriticalSection(&trace_lock);
+	}
+	return 0;
+}
+#endif
+
+
+
+/**
+ * Open the file named by SC_HSM_TRACE and start the writer
+ */
+#ifndef _WIN32
+static void trace_init(void)
+#else
+static BOOL CALLBACK trace_init(PINIT_ONCE once, PVOID param, PVOID *context)
+#endif
+{
+	const char *path;
+	time_t t;
+	int state = 0;
+
+	path = getenv("SC_HSM_TRACE");
+	if (path && *path) {
+		trace_fp = fopen(path, "a");
+	}
+
+	if (trace_fp) {
+		trace_base = trace_now();
+		time(&t);
+		fprintf(trace_fp, "# trace started %s", ctime(&t));
+		fflush(trace_fp);
+#ifndef _WIN32
+		if (!pthread_key_create(&trace_key, release)) {
+			if (!pthread_create(&trace_thread, NULL, writer, NULL))
+				state = 1;
+			else
+				pthread_key_delete(trace_key);
+		}
+#else
+		InitializeCriticalSection(&trace_lock);
+		trace_key = FlsAlloc(release);
+		trace_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (trace_key != FLS_OUT_OF_INDEXES && trace_wake &&
+			CreateThread(NULL, 0, writer, NULL, 0, NULL))
+			state = 1;
+#endif
+		if (state)
+			atexit(trace_exit);
+		else
+			fclose(trace_fp);
+	}
+
+	trace_state = state;
+#ifdef _WIN32
+	return TRUE;
+#endif
+}
+
+
+
+/**
+ * Record an event in the ring of the calling thread. Called through \ref TRACE
+ *
+ * @param id Event id, one of \ref trace_id
+ * @param a0 First argument
+ * @param a1 Second argument
+ * @param a2 Third argument
+ * @param a3 Fourth argument
+ */
+void trace_event(int id, intptr_t a0, intptr_t a1, intptr_t a2, intptr_t a3)
+{
+	struct trace_ring *ring;
+	struct trace_rec *rec;
+	unsigned int head;
+
+	if (trace_state < 0) {
+#ifndef _WIN32
+		pthread_once(&trace_once, trace_init);
+#else
+		InitOnceExecuteOnce(&trace_once, trace_init, NULL, NULL);
+#endif
+	}
+
+	if (trace_state <= 0)
+		return;
+
+	ring = ring_get();
+	if (!ring)
+		return;
+
+	head = ring->head;
+	if (head - ring->tail >= TRACE_RING) {
+		ring->dropped++;
+		return;
+	}
+
+	rec = &ring->rec[head % TRACE_RING];
+	rec->ts = trace_now();
+	rec->id = id;
+	rec->a[0] = a0;
+	rec->a[1] = a1;
+	rec->a[2] = a2;
+	rec->a[3] = a3;
+	BARRIER();
+	ring->head = head + 1;
+}
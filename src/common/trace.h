@@ -0,0 +1,84 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    trace.h
+ * @brief   Binary event trace with per-thread ring buffers, enabled at runtime.
+ */
+
+#ifndef ___TRACE_H_INC___
+#define ___TRACE_H_INC___
+
+#include <stdint.h>
+
+/*
+	The trace is enabled by the environment variable SC_HSM_TRACE naming the output file.
+
+	Each thread records its events into its own ring buffer of TRACE_RING events: a monotonic
+	timestamp, the event id and up to four integer arguments. Recording takes no lock and does
+	no formatting or I/O, so tracing can stay on under load. If the ring is full the event is
+	dropped and counted. A background thread drains the rings every TRACE_FLUSH_MS and writes one
+	text line per event. String arguments are only stored as pointers and must be static,
+	e.g. __FUNCTION__ or literals.
+
+	Without SC_HSM_TRACE a TRACE costs one test of trace_state.
+*/
+
+#define TRACE_RING      4096    /* events per thread */
+#define TRACE_FLUSH_MS  100
+
+/* event ids, the arguments are listed in the comment */
+enum trace_id {
+	TRACE_P11_CALLED = 1,   /* function */
+	TRACE_P11_RETURNS,      /* function, rc */
+	TRACE_P11_FAILS,        /* function, rc, message */
+	TRACE_CT_DATA,          /* ctn, lc, lr, rc */
+	TRACE_USB_WRITE,        /* CCID message type, length, rc, us */
+	TRACE_USB_READ,         /* CCID message type, length, status, us */
+	TRACE_T1_SEND,          /* NAD, PCB, LEN */
+	TRACE_T1_RECEIVE,       /* NAD, PCB, LEN, rc */
+	TRACE_USER              /* first id for events of the application */
+};
+
+/* -1 until the first event, then 1 with SC_HSM_TRACE and 0 without */
+extern volatile int trace_state;
+
+void trace_event(int id, intptr_t a0, intptr_t a1, intptr_t a2, intptr_t a3);
+uint64_t trace_now(void);
+
+#define TRACE(id, a0, a1, a2, a3) do { \
+	if (trace_state) \
+		trace_event((id), (intptr_t)(a0), (intptr_t)(a1), (intptr_t)(a2), (intptr_t)(a3)); \
+} while (0)
+
+/* start of a measured interval, 0 without trace */
+#define TRACE_START() (trace_state > 0 ? trace_now() : 0)
+
+/* microseconds since TRACE_START */
+#define TRACE_US(start) ((start) ? (intptr_t)((trace_now() - (start)) / 1000) : 0)
+
+#endif /* ___TRACE_H_INC___ */
@@ -45,7 +45,12 @@
 
 
 /**
- * Process a APDU using the CCID APDU transfer mode
+ * Process a APDU using the CCID extended APDU level exchange
+ *
+ * The reader does the T=1 framing. A command APDU longer than one block is split
+ * into blocks with the level parameter, the reader acknowledges each but the last
+ * block with an empty data block. A response longer than one block is indicated by
+ * the chain parameter, each further block is requested with an empty block.
  *
  * @param ctx Reader context
  * @param lc Length of command APDU
@@ -62,23 +67,23 @@ static int ccidAPDUProcess (struct scr *ctx,
 {
 	int rc,r,maxlr;
 	unsigned int len;
-	unsigned char buf[BUFFMAX],*po,status,error,chain;
-	unsigned short level = 0;
+	unsigned char buf[BLOCKMAX],*po,status,error,chain;
+	unsigned short level = XFR_LEVEL_SINGLE;
 
 	maxlr = *lr;
 	*lr = 0;
 	po = cmd;
 	while (lc > 0) {
 		len = lc;
-		if (lc > BUFFMAX) {
+		if (lc > ctx->MaxBlock) {
 			if (level)
-				level = 3;			// Intermediate extended command
+				level = XFR_LEVEL_CONTINUE;	// Intermediate extended command
 			else
-				level = 1;			// First extended command
-			len = BUFFMAX;
+				level = XFR_LEVEL_BEGIN;	// First extended command
+			len = ctx->MaxBlock;
 		} else {
 			if (level)
-				level = 2;			// Final extended command
+				level = XFR_LEVEL_END;		// Final extended command
 		}
 
 		rc = PC_to_RDR_XfrBlock(ctx, len, po, (unsigned char)level);
@@ -88,10 +93,24 @@ static int ccidAPDUProcess (struct scr *ctx,
 		lc -= len;
 		po += len;
 
-		len = BUFFMAX;
+		len = sizeof(buf);
 		rc = RDR_to_PC_DataBlock(ctx, &len, buf, &status, &error, &chain);
 		if (rc < 0)
 			return -1;
+
+		if (status & CMD_STATUS_MASK) {
+#ifdef DEBUG
+			ctccid_debug("XfrBlock failed with status %02X, error %02X\n", status, error);
+#endif
+			return -1;
+		}
+
+#ifdef DEBUG
+		/* The reader should request the next block of the command APDU */
+		if (lc > 0 && chain != XFR_LEVEL_EMPTY) {
+			ctccid_debug("XfrBlock level %d acknowledged with chain %02X\n", level, chain);
+		}
+#endif
 	}
 
 	r = 0;
@@ -106,14 +125,20 @@ static int ccidAPDUProcess (struct scr *ctx,
 		maxlr -= len;
 		*lr += len;
 
-		if ((chain == 1) || (chain == 3)) {
-			rc = PC_to_RDR_XfrBlock(ctx, 0, NULL, 0x10);
+		if ((chain == XFR_LEVEL_BEGIN) || (chain == XFR_LEVEL_CONTINUE)) {
+			rc = PC_to_RDR_XfrBlock(ctx, 0, NULL, XFR_LEVEL_EMPTY);
 			if (rc < 0)
 				return -1;
-			len = BUFFMAX;
+			len = sizeof(buf);
 			rc = RDR_to_PC_DataBlock(ctx, &len, buf, &status, &error, &chain);
 			if (rc < 0)
 				return -1;
+			if (status & CMD_STATUS_MASK) {
+#ifdef DEBUG
+				ctccid_debug("XfrBlock failed with status %02X, error %02X\n", status, error);
+#endif
+				return -1;
+			}
 			continue;
 		}
 		break;
@@ -125,13 +150,14 @@ static int ccidAPDUProcess (struct scr *ctx,
 
 
 /**
- * Initialize T=1 protocol driver module
+ * Initialize APDU level exchange driver module
  *
  * @param ctx Reader context
  */
 int ccidAPDUInit (struct scr *ctx)
 {
 	ctx->CTModFunc = (CTModFunc_t) ccidAPDUProcess;
+	ctx->MaxBlock = RDR_MaxBlockLength(ctx);
 
 	return 0;
 }
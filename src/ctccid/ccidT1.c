@@ -41,6 +41,7 @@
 #include "ccidT1.h"
 #include "ccid_usb.h"
 #include "ctccid_debug.h"
+#include <common/trace.h>
 
 
 /**
@@ -53,6 +54,7 @@ void ccidT1InitProtocol(scr_t *ctx)
 	ctx->t1->BlockWaitTime = 200 + (1 << ctx->BWI) * 100 + 11000 / ctx->Baud;
 	ctx->t1->WorkBWT = ctx->t1->BlockWaitTime;
 	ctx->t1->IFSC = ctx->IFSC;
+	ctx->t1->IFSD = 32;
 	ctx->t1->SSequenz = 0;
 	ctx->t1->RSequenz = 0;
 }
@@ -150,6 +152,10 @@ int ccidT1ReceiveBlock(scr_t *ctx)
 	len = BUFFMAX;
 	rc = RDR_to_PC_DataBlock(ctx, &len, buf, NULL, NULL, NULL);
 
+	TRACE(TRACE_T1_RECEIVE, len > 0 ? buf[0] : 0, len > 1 ? buf[1] : 0, len > 2 ? buf[2] : 0, rc);
+
+	ctx->Blocks++;
+
 	if (rc < 0) {
 		return -1;
 	}
@@ -223,6 +229,10 @@ int ccidT1SendBlock(scr_t *ctx,
 
 	*ptr = lrc;
 
+	TRACE(TRACE_T1_SEND, Nad, Pcb, BuffLen, 0);
+
+	ctx->Blocks++;
+
 	rc = PC_to_RDR_XfrBlock(ctx, BuffLen + 4, sndbuf, 0);
 
 	if (rc < 0) {
@@ -239,6 +249,53 @@ int ccidT1SendBlock(scr_t *ctx,
 
 
 
+/**
+ * Announce the maximum length of the INF field the host receives with S(IFS request),
+ * so the card sends large responses in fewer chained blocks. Without response the
+ * default of 32 bytes stays in effect.
+ *
+ * @param ctx Reader context
+ * @param SrcNode Source node
+ * @param DestNode Destination node
+ * @return 0 on success, -1 on error
+ */
+int ccidT1SetIFSD(scr_t *ctx, int SrcNode, int DestNode)
+{
+	int ret,retry;
+	unsigned char ifsd = IFSDMAX;
+
+	retry = RETRY;
+
+	while (retry--) {
+		ret = ccidT1SendBlock(ctx,
+							  CODENAD(SrcNode, DestNode),
+							  CODESBLOCK(IFSREQ),
+							  &ifsd, 1);
+
+		if (ret < 0) {
+			return -1;
+		}
+
+		ret = ccidT1ReceiveBlock(ctx);
+
+		if (!ret &&
+				ISSBLOCK(ctx->t1->Pcb) &&
+				(SBLOCKFUNC(ctx->t1->Pcb) == IFSRES) &&
+				(ctx->t1->InBuffLength == 1) &&
+				(ctx->t1->InBuff[0] == ifsd)) {
+			ctx->t1->IFSD = ifsd;
+#ifdef DEBUG
+			ctccid_debug("New IFSD: %d unsigned chars.\n", ctx->t1->IFSD);
+#endif
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+
 /**
  * Synchronize sequence counter in both sender and receiver after a transmission error has occurred
  *
@@ -269,6 +326,8 @@ int ccidT1Resynch(scr_t *ctx, int SrcNode, int DestNode)
 				ISSBLOCK(ctx->t1->Pcb) &&
 				(SBLOCKFUNC(ctx->t1->Pcb) == RESYNCHRES)) {
 			ccidT1InitProtocol(ctx);
+			/* RESYNCH resets IFSD to the default */
+			ccidT1SetIFSD(ctx, SrcNode, DestNode);
 			return 0;
 		}
 	}
@@ -389,13 +448,15 @@ int ccidT1GetBlock(scr_t *ctx, int SrcNode, int DestNode)
 				break;
 
 			case WTXREQ :                   /* Request to extend timeout         */
+				/* before the response, which waits for the next block with WorkBWT */
+				ctx->t1->WorkBWT = ctx->t1->BlockWaitTime *
+								   MAX((int)ctx->t1->InBuff[0], 1);
+				ctx->Wtx++;
 				ccidT1SendBlock(ctx,
 								CODENAD(SrcNode, DestNode),
 								CODESBLOCK(WTXRES),
 								ctx->t1->InBuff,
 								1);
-				ctx->t1->WorkBWT = ctx->t1->BlockWaitTime *
-								   (int)ctx->t1->InBuff[0];
 
 #ifdef DEBUG
 				ctccid_debug("New BWT value %ld ms.\n",ctx->t1->WorkBWT);
@@ -412,6 +473,8 @@ int ccidT1GetBlock(scr_t *ctx, int SrcNode, int DestNode)
 		}
 	}
 
+	/* the extension only applies to the block requested */
+	ctx->t1->WorkBWT = ctx->t1->BlockWaitTime;
 	return 0;
 }
 
@@ -699,5 +762,8 @@ int ccidT1Init (struct scr *ctx)
 
 	ccidT1InitProtocol(ctx);
 
+	/* Request large response blocks now that the PPS is done */
+	ccidT1SetIFSD(ctx, 0, 0);
+
 	return 0;
 }
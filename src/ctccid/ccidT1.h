@@ -42,6 +42,12 @@
  */
 #define BUFFMAX    261
 
+/**
+ * Maximum length of INF field the host receives, requested with S(IFS request)
+ * after the PPS. A block with IFSDMAX bytes (NAD, PCB, LEN, INF, EDC) fits into BUFFMAX.
+ */
+#define IFSDMAX    254
+
 /**
  * Data structure encapsulating all data needed for T=1 protocol
  */
@@ -54,6 +60,8 @@ typedef struct ccidT1 {
 	long             WorkBWT;
 	/** Maximum length of INF field       */
 	unsigned char   IFSC;
+	/** Maximum length of INF field received, 32 until negotiated */
+	unsigned char   IFSD;
 	/** Receiver sequence number          */
 	int              RSequenz;
 	/** Transmitter sequence number       */
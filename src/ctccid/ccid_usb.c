@@ -33,6 +33,7 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef DEBUG
@@ -40,12 +41,29 @@
 #include "ctccid_debug.h"
 #endif
 
+#include "ctapi.h"
 #include "ccid_usb.h"
-#include "scr.h"
+#include "ccidT1.h"
+#include <common/trace.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
 int FTable[]  = { 372, 372, 558, 744, 1116, 1488, 1860, -1, -1, 512, 768, 1024, 1536, 2048, -1, -1};
 int DTable[]  = { -1, 1, 2, 4, 8, 16, 32, -1, 12, 20, -1, -1, -1, -1, -1, -1};
 
+/* Maximum clock frequency in kHz for FI */
+static int FMaxTable[] = { 4000, 5000, 6000, 8000, 12000, 16000, 20000, 0, 0, 5000, 7500, 10000, 15000, 20000, 0, 0};
+
+/* DI values tried in the PPS, fastest first */
+static unsigned char DOrder[] = { 6, 9, 5, 8, 4, 3, 2, 1 };
+
+#define DEFAULT_CLOCK	3580	/* kHz, assumed without CCID descriptor */
+#define DEFAULT_FIDI	0x11	/* Fd = 372, Dd = 1 */
+#define MAX_RATES		32		/* of GET_CLOCK_FREQUENCIES and GET_DATA_RATES */
+#define MAX_PARAMS		(sizeof(DOrder) + 1)
+
 #ifdef DEBUG
 
 /**
@@ -81,6 +99,12 @@ void CCIDDump(unsigned char *mem, int len)
         case MSG_TYPE_RDR_to_PC_Parameters:
                 ctccid_debug("CCID RDR_to_PC_Parameters\n");
                 break;
+        case MSG_TYPE_RDR_to_PC_NotifySlotChange:
+                ctccid_debug("CCID RDR_to_PC_NotifySlotChange\n");
+                break;
+        case MSG_TYPE_RDR_to_PC_HardwareError:
+                ctccid_debug("CCID RDR_to_PC_HardwareError\n");
+                break;
         default:
                 ctccid_debug("Unknown message type\n");
                 break;
@@ -92,13 +116,443 @@ void CCIDDump(unsigned char *mem, int len)
 
 
 
+/*
+ * Readers opened, by port. Changed by RDR_Open and RDR_Close only, which are called with
+ * the global mutex of ctapi.c held
+ */
+static ccid_reader_t *readers;
+
+
+
+/*
+ * Slot changed according to a message of the interrupt endpoint: the changed bit of the slot
+ * in bmSlotICCState of RDR_to_PC_NotifySlotChange or bSlot of RDR_to_PC_HardwareError
+ */
+static int SlotChanged(unsigned char *data, unsigned int length, int slot)
+{
+	if (data[0] == MSG_TYPE_RDR_to_PC_HardwareError) {
+		return length < 2 || data[1] == slot;
+	}
+
+	return length < 2 + (unsigned int)slot / 4 || (data[1 + slot / 4] >> (2 * (slot % 4) + 1) & 1);
+}
+
+
+
+/*
+ * Message of the interrupt endpoint, called in the USB event thread. For a single slot
+ * reader every RDR_to_PC_NotifySlotChange or RDR_to_PC_HardwareError counts as a slot
+ * change, the waiters query the slot status then. A multi-slot reader reports the slots
+ * changed in the message.
+ */
+static void NotifySlotChange(unsigned char *data, unsigned int length, void *arg)
+{
+	ccid_reader_t *reader = (ccid_reader_t *)arg;
+	scr_t *ctx;
+	int i, change;
+
+#ifdef DEBUG
+	if (length > 0) {
+		CCIDDump(data, length);
+	}
+#endif
+
+	change = length > 0 && (data[0] == MSG_TYPE_RDR_to_PC_NotifySlotChange || data[0] == MSG_TYPE_RDR_to_PC_HardwareError);
+
+	/* the slots are removed with the lock of the reader held, see RDR_Close */
+	condvar_lock(&reader->cond);
+
+	if (length == 0) {
+		reader->notifying = 0; /* transfer ended, poll the slot status again */
+	}
+
+	for (i = 0; i < reader->slots; i++) {
+		ctx = reader->slot[i];
+
+		if (!ctx) {
+			continue;
+		}
+
+		condvar_lock(&ctx->notify);
+
+		if (length == 0) {
+			ctx->Notifying = 0;
+		} else if (change && (reader->slots == 1 || SlotChanged(data, length, i))) {
+			ctx->SlotChanges++;
+		}
+
+		condvar_broadcast(&ctx->notify);
+		condvar_unlock(&ctx->notify);
+	}
+
+	condvar_unlock(&reader->cond);
+}
+
+
+
+/**
+ * Open the slot CT_SLOT(pn) of the reader at port CT_PORT(pn). The USB device is opened
+ * with the first slot of the reader and shared by the slots opened later. Slot changes
+ * are notified on the interrupt endpoint of the reader, without interrupt endpoint the
+ * slot status is polled.
+ *
+ * @param ctx Reader context of the slot
+ * @param pn Port number
+ * @return Status code \ref USB_OK, \ref ERR_NO_READER (also for a slot the reader has not
+ *         or which is open), \ref ERR_USB
+ */
+int RDR_Open(scr_t *ctx, unsigned short pn)
+{
+	ccid_reader_t *reader;
+	unsigned char const *desc;
+	int length, rc, slot = CT_SLOT(pn);
+
+	for (reader = readers; reader && reader->port != CT_PORT(pn); reader = reader->next)
+		;
+
+	if (!reader) {
+		reader = (ccid_reader_t *)calloc(1, sizeof(ccid_reader_t));
+
+		if (!reader) {
+			return ERR_USB;
+		}
+
+		rc = USB_Open(CT_PORT(pn), &reader->device);
+
+		if (rc != USB_OK) {
+			free(reader);
+			return rc;
+		}
+
+		if (condvar_init(&reader->cond) != 0) {
+			USB_Close(&reader->device);
+			free(reader);
+			return ERR_USB;
+		}
+
+		if (mutex_init(&reader->write) != 0) {
+			condvar_destroy(&reader->cond);
+			USB_Close(&reader->device);
+			free(reader);
+			return ERR_USB;
+		}
+
+		reader->port = CT_PORT(pn);
+		reader->slots = 1;
+		reader->maxBusy = 1;
+
+		USB_GetCCIDDescriptor(reader->device, &desc, &length);
+
+		if (length == 54) {
+			reader->slots = desc[4] + 1 < CCID_MAX_SLOTS ? desc[4] + 1 : CCID_MAX_SLOTS;
+			reader->maxBusy = desc[53] < 1 ? 1 : desc[53] < reader->slots ? desc[53] : reader->slots;
+		}
+
+		reader->notifying = USB_StartInterrupt(reader->device, NotifySlotChange, reader) == USB_OK;
+
+#ifdef DEBUG
+		ctccid_debug("Reader at port %i with %i slot(s), %i busy, slot changes %s\n", reader->port,
+			reader->slots, reader->maxBusy, reader->notifying ? "notified" : "polled");
+#endif
+
+		reader->next = readers;
+		readers = reader;
+	}
+
+	if (slot >= reader->slots || reader->slot[slot]) {
+		rc = ERR_NO_READER;
+	} else if (condvar_init(&ctx->notify) != 0) {
+		rc = ERR_USB;
+	} else if (reader->slots > 1 && (ctx->Response = (unsigned char *)malloc(10 + BLOCKMAX)) == NULL) {
+		condvar_destroy(&ctx->notify);
+		rc = ERR_USB;
+	} else {
+		ctx->reader = reader;
+		ctx->device = reader->device;
+		ctx->Slot = (unsigned char)slot;
+		ctx->CachedStatus = -1;
+
+		condvar_lock(&reader->cond);
+		ctx->Notifying = reader->notifying;
+		reader->slot[slot] = ctx;
+		reader->refs++;
+		condvar_unlock(&reader->cond);
+
+		return USB_OK;
+	}
+
+	if (reader->refs == 0) {
+		ctx->reader = reader;
+		RDR_Close(ctx);
+	}
+
+	return rc;
+}
+
+
+
+/**
+ * Close the slot opened with \ref RDR_Open, the last slot of the reader closes the USB device
+ *
+ * @param ctx Reader context of the slot
+ */
+void RDR_Close(scr_t *ctx)
+{
+	ccid_reader_t *reader = ctx->reader, **pp;
+
+	if (reader->slot[ctx->Slot] == ctx) {
+		/* no notification for the slot after the lock */
+		condvar_lock(&reader->cond);
+		reader->slot[ctx->Slot] = NULL;
+		reader->refs--;
+		condvar_unlock(&reader->cond);
+
+		condvar_destroy(&ctx->notify);
+		free(ctx->Response);
+		ctx->Response = NULL;
+	}
+
+	ctx->reader = NULL;
+	ctx->device = NULL;
+
+	if (reader->refs > 0) {
+		return;
+	}
+
+	for (pp = &readers; *pp != reader; pp = &(*pp)->next)
+		;
+
+	*pp = reader->next;
+
+	/* stops the interrupt transfer, no more notifications */
+	USB_Close(&reader->device);
+
+	mutex_destroy(&reader->write);
+	condvar_destroy(&reader->cond);
+	free(reader);
+}
+
+
+
+/*
+ * Release the response outstanding of a slot of a multi-slot reader, called with the lock held
+ */
+static void ReleaseSlot(scr_t *ctx)
+{
+	ccid_reader_t *reader = ctx->reader;
+
+	if (ctx->Pending) {
+		ctx->Pending = 0;
+		ctx->ResponseLen = 0;
+		reader->busy--;
+		condvar_broadcast(&reader->cond);
+	}
+}
+
+
+
+/*
+ * Hand the message in the buffer of the reader to the slot it is addressed to, called with
+ * the lock held. Responses of a slot which does not wait anymore (e.g. after a timeout) are
+ * dropped. A time extension request waiting to be taken is superseded by the next message.
+ */
+static void DeliverMessage(ccid_reader_t *reader, unsigned int length)
+{
+	unsigned char *msg = reader->buffer;
+	scr_t *ctx;
+
+	if (length < 10 || msg[5] >= reader->slots) {
+		return;
+	}
+
+	ctx = reader->slot[msg[5]];
+
+	if (!ctx || !ctx->Pending || msg[6] != ctx->Seq) {
+#ifdef DEBUG
+		ctccid_debug("Response of slot %i dropped, bSeq %i\n", msg[5], msg[6]);
+#endif
+		return;
+	}
+
+	if (ctx->ResponseLen > 0 && (ctx->Response[7] & CMD_STATUS_MASK) != 0x80) {
+		return;
+	}
+
+	memcpy(ctx->Response, msg, length);
+	ctx->ResponseLen = length;
+	condvar_broadcast(&reader->cond);
+}
+
+
+
+/*
+ * Send a message to the slot, with bSlot and a new bSeq filled in
+ *
+ * With timeout the bulk in transfer of a single slot reader is posted before the message
+ * and the response is due within timeout ms, see RDR_ResponseTimeout. Otherwise the
+ * response is due within USB_READ_TIMEOUT. A slot of a multi-slot reader waits until
+ * the reader accepts another command.
+ */
+static int WriteMessage(scr_t *ctx, unsigned int length, unsigned char *msg, unsigned int timeout)
+{
+	ccid_reader_t *reader = ctx->reader;
+	int rc;
+
+	msg[5] = ctx->Slot;
+
+	if (reader->slots == 1) {
+		msg[6] = ctx->Seq;
+
+		if (timeout) {
+			USB_PostRead(ctx->device, 10 + BLOCKMAX, timeout);
+		}
+
+		return USB_Write(ctx->device, length, msg);
+	}
+
+	condvar_lock(&reader->cond);
+
+	while (reader->busy >= reader->maxBusy) {
+		condvar_wait(&reader->cond);
+	}
+
+	reader->busy++;
+	msg[6] = ctx->Seq = reader->seq++;
+	ctx->Pending = 1;
+	ctx->ResponseLen = 0;
+	ctx->Deadline = trace_now() + (uint64_t)(timeout ? timeout : USB_READ_TIMEOUT) * 1000000;
+
+	condvar_unlock(&reader->cond);
+
+	mutex_lock(&reader->write);
+	rc = USB_Write(ctx->device, length, msg);
+	mutex_unlock(&reader->write);
+
+	if (rc < 0) {
+		condvar_lock(&reader->cond);
+		ReleaseSlot(ctx);
+		condvar_unlock(&reader->cond);
+	}
+
+	return rc;
+}
+
+
+
+/*
+ * The response of the slot is due within timeout ms from now, after a time extension
+ */
+static void ExtendTimeout(scr_t *ctx, unsigned int timeout)
+{
+	ccid_reader_t *reader = ctx->reader;
+
+	if (reader->slots == 1) {
+		USB_PostRead(ctx->device, 10 + BLOCKMAX, timeout);
+		return;
+	}
+
+	condvar_lock(&reader->cond);
+	ctx->Deadline = trace_now() + (uint64_t)timeout * 1000000;
+	condvar_unlock(&reader->cond);
+}
+
+
+
+/*
+ * Receive the response to the last message sent to the slot, see WriteMessage
+ *
+ * A slot of a multi-slot reader takes its response from the thread that read it or,
+ * if no other thread reads the bulk in endpoint, reads the responses itself until its
+ * own arrived. A time extension request leaves the response outstanding.
+ *
+ * @return 0 on success, -1 if the message is not addressed to the slot, \ref ERR_USB
+ */
+static int ReadMessage(scr_t *ctx, unsigned int *length, unsigned char *msg)
+{
+	ccid_reader_t *reader = ctx->reader;
+	unsigned int len;
+	uint64_t now;
+	int rc = USB_OK;
+
+	if (reader->slots == 1) {
+		rc = USB_Read(ctx->device, length, msg);
+
+		if (rc < 0) {
+			return rc;
+		}
+
+		if (*length < 10 || msg[5] != ctx->Slot || msg[6] != ctx->Seq) {
+			return -1;
+		}
+
+		return 0;
+	}
+
+	condvar_lock(&reader->cond);
+
+	while (ctx->ResponseLen == 0) {
+		now = trace_now();
+
+		if (!ctx->Pending || now >= ctx->Deadline) {
+			rc = ERR_USB;
+			break;
+		}
+
+		if (reader->receiving) {
+			condvar_timedwait(&reader->cond, (int)((ctx->Deadline - now) / 1000000) + 1);
+			continue;
+		}
+
+		reader->receiving = 1;
+		condvar_unlock(&reader->cond);
+
+		len = sizeof(reader->buffer);
+		rc = USB_ReadTimeout(reader->device, &len, reader->buffer, (unsigned int)((ctx->Deadline - now) / 1000000) + 1);
+
+		condvar_lock(&reader->cond);
+		reader->receiving = 0;
+		condvar_broadcast(&reader->cond);
+
+		if (rc < 0) {
+			break;
+		}
+
+#ifdef DEBUG
+		CCIDDump(reader->buffer, len);
+#endif
+		DeliverMessage(reader, len);
+	}
+
+	if (ctx->ResponseLen > 0) {
+		if (ctx->ResponseLen > *length) {
+			rc = ERR_USB;
+		} else {
+			rc = USB_OK;
+			*length = ctx->ResponseLen;
+			memcpy(msg, ctx->Response, *length);
+		}
+
+		ctx->ResponseLen = 0;
+	}
+
+	if (rc < 0 || (msg[7] & CMD_STATUS_MASK) != 0x80) {
+		ReleaseSlot(ctx);
+	}
+
+	condvar_unlock(&reader->cond);
+
+	return rc;
+}
+
+
+
 /**
- * Power on the ICC in the reader and set the ATR and the communication parameters as specified
+ * Power on the ICC in the reader and decode the ATR
  *
  * @param ctx Reader context
  * @return 0 on success, negative value otherwise
  */
-int PC_to_RDR_IccPowerOn(scr_t *ctx)
+static int IccPowerOn(scr_t *ctx)
 {
 
         int rc;
@@ -112,13 +566,13 @@ int PC_to_RDR_IccPowerOn(scr_t *ctx)
         CCIDDump(msg, 10);
 #endif
 
-        rc = USB_Write(ctx->device, 10, msg);
+        rc = WriteMessage(ctx, 10, msg, 0);
 
         if (rc < 0) {
                 return rc;
         }
 
-        rc = USB_Read(ctx->device, &l, msg);
+        rc = ReadMessage(ctx, &l, msg);
 
         if (rc < 0) {
                 return rc;
@@ -128,8 +582,8 @@ int PC_to_RDR_IccPowerOn(scr_t *ctx)
         CCIDDump(msg, l);
 #endif
 
-        /* check length, message type, slot and sequence number */
-        if (l < 10 || msg[0] != MSG_TYPE_RDR_to_PC_DataBlock || msg[5] != 0x00 || msg[6] != 0x00) {
+        /* check message type, ReadMessage checked length, slot and sequence number */
+        if (msg[0] != MSG_TYPE_RDR_to_PC_DataBlock) {
                 return -1;
         }
 
@@ -145,12 +599,6 @@ int PC_to_RDR_IccPowerOn(scr_t *ctx)
                 return rc;
         }
 
-        rc = PC_to_RDR_SetParameters(ctx);
-
-        if (rc < 0) {
-                return rc;
-        }
-
         return 0;
 }
 
@@ -204,6 +652,7 @@ int DecodeATRValues(scr_t *ctx)
 
         ctx->FI = 1;
         ctx->DI = 1;
+        ctx->SpecificMode = 0;
 
         ctx->IFSC = 32;              /* T=1: information field size TA(i)*/
         ctx->CWI = 13;               /* T=1: Char waiting time indx TB(i)*/
@@ -234,6 +683,16 @@ int DecodeATRValues(scr_t *ctx)
                                 ctx->DI = temp & 0xF;
                         }
 
+                        if (i == 2) { /* TA(2) present, specific mode */
+                                temp = ctx->ATR[atrp++];
+                                ctx->SpecificMode = 1;
+
+                                if (temp & 0x10) { /* implicit values, not TA(1) */
+                                        ctx->FI = 1;
+                                        ctx->DI = 1;
+                                }
+                        }
+
                         if (i > 2) {
                                 temp = ctx->ATR[atrp++];
                                 ctx->IFSC = temp;
@@ -285,14 +744,42 @@ int RDR_APDUTransferMode(scr_t *ctx)
 
 	USB_GetCCIDDescriptor(ctx->device, &desc, &length);
 
+	/* Only readers with extended APDU level exchange are used at APDU level,
+	   short APDU level readers run T=1, which also chains extended APDUs */
 	if (length == 54)
-		apdu_transfer = desc[42] & 0x04;
+		apdu_transfer = desc[42] & FEATURE_EXTENDED_APDU;
 
 	return apdu_transfer;
 }
 
 
 
+/**
+ * Determine the maximum data length of one XfrBlock from dwMaxCCIDMessageLength
+ *
+ * @param ctx Reader context
+ * @return Maximum data length, at least BUFFMAX and at most BLOCKMAX
+ */
+int RDR_MaxBlockLength(scr_t *ctx)
+{
+	unsigned char const *desc;
+	int length, max = BUFFMAX;
+
+	USB_GetCCIDDescriptor(ctx->device, &desc, &length);
+
+	if (length == 54)
+		max = (desc[44] | desc[45] << 8 | desc[46] << 16 | desc[47] << 24) - 10;
+
+	if (max > BLOCKMAX)
+		max = BLOCKMAX;
+	if (max < BUFFMAX)
+		max = BUFFMAX;
+
+	return max;
+}
+
+
+
 /**
  * Set communication protocol parameters (guard time, FI, DI, IFSC)
  *
@@ -323,14 +810,14 @@ int PC_to_RDR_SetParameters(scr_t *ctx)
         CCIDDump(msg, 17);
 #endif
 
-        rc = USB_Write(ctx->device, 17, msg);
+        rc = WriteMessage(ctx, 17, msg, 0);
 
         if (rc < 0) {
                 return rc;
         }
 
         len = 17;
-        rc = USB_Read(ctx->device, &len, msg);
+        rc = ReadMessage(ctx, &len, msg);
 
         if (rc < 0) {
                 return rc;
@@ -340,11 +827,258 @@ int PC_to_RDR_SetParameters(scr_t *ctx)
         CCIDDump(msg, len);
 #endif
 
+        /* check message type and command status, ReadMessage checked slot and sequence number */
+        if (msg[0] != MSG_TYPE_RDR_to_PC_Parameters || (msg[7] & CMD_STATUS_MASK)) {
+                return -1;
+        }
+
         return 0;
 }
 
 
 
+static int GetDWord(unsigned char const *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+}
+
+
+
+/**
+ * Read the list of clock frequencies or data rates supported by the reader
+ *
+ * @param ctx Reader context
+ * @param request REQUEST_GET_CLOCK_FREQUENCIES or REQUEST_GET_DATA_RATES
+ * @param num Number of entries announced in the CCID descriptor
+ * @param list Array of MAX_RATES entries
+ * @return Number of entries read, 0 if the reader has no list or does not answer
+ */
+static int GetReaderList(scr_t *ctx, unsigned char request, int num, int *list)
+{
+	unsigned char buf[4 * MAX_RATES];
+	unsigned int len, i;
+
+	if (num > MAX_RATES)
+		num = MAX_RATES;
+
+	len = 4 * num;
+
+	if (num == 0 || USB_ControlIn(ctx->device, request, &len, buf) < 0)
+		return 0;
+
+	for (i = 0; i < len / 4; i++)
+		list[i] = GetDWord(buf + 4 * i);
+
+	return len / 4;
+}
+
+
+
+/**
+ * Determine the FI/DI values for the PPS, fastest first
+ *
+ * The card announces in TA(1) Fi and the maximum Di. Di is lowered until the
+ * resulting baudrate is one of the reader (GET_DATA_RATES or up to dwMaxDataRate).
+ * The reader clocks the card with dwDefaultClock or, if it changes the clock
+ * automatically, with its fastest clock within fmax of Fi. The default
+ * values always end the list. Without CCID descriptor the values of TA(1) are
+ * taken as they are.
+ *
+ * @param ctx Reader context with decoded ATR
+ * @param fidi Array of MAX_PARAMS receiving FI/DI as in PPS1
+ * @param baud Array of MAX_PARAMS receiving the resulting baudrates
+ * @return Number of entries
+ */
+static int SelectParameters(scr_t *ctx, unsigned char *fidi, int *baud)
+{
+	unsigned char const *desc;
+	int clocks[MAX_RATES], rates[MAX_RATES];
+	int length, numclocks = 0, numrates = 0, defclock = DEFAULT_CLOCK, clock, maxrate = 0;
+	int F, D, i, j, n = 0, rate;
+
+	USB_GetCCIDDescriptor(ctx->device, &desc, &length);
+
+	if (length == 54) {
+		if (GetDWord(desc + 10) > 0) {
+			defclock = GetDWord(desc + 10);
+		}
+
+		maxrate = GetDWord(desc + 23);
+
+		if (desc[40] & FEATURE_AUTO_CLOCK) {
+			numclocks = GetReaderList(ctx, REQUEST_GET_CLOCK_FREQUENCIES, desc[18], clocks);
+
+			if (numclocks == 0) {
+				clocks[0] = GetDWord(desc + 14);
+				numclocks = 1;
+			}
+		}
+
+		numrates = GetReaderList(ctx, REQUEST_GET_DATA_RATES, desc[27], rates);
+	}
+
+	clock = defclock;
+	F = FTable[ctx->FI];
+
+	if (F > 0 && FMaxTable[ctx->FI] > 0) {
+		for (i = 0; i < numclocks; i++) {
+			if (clocks[i] > clock && clocks[i] <= FMaxTable[ctx->FI]) {
+				clock = clocks[i];
+			}
+		}
+
+		for (i = 0; i < sizeof(DOrder); i++) {
+			D = DTable[DOrder[i]];
+
+			if (D > DTable[ctx->DI] || (F == 372 && D == 1)) {
+				continue;
+			}
+
+			rate = clock * 1000 / F * D;
+
+			if (length == 54) {
+				if (numrates == 0 && rate > maxrate + maxrate / 20) {
+					continue;
+				}
+
+				for (j = 0; j < numrates && !MATCH(rate, rates[j]); j++)
+					;
+
+				if (numrates > 0 && j == numrates) {
+					continue;
+				}
+			} else if (DOrder[i] != ctx->DI) {
+				continue;
+			}
+
+			fidi[n] = (ctx->FI << 4) | DOrder[i];
+			baud[n++] = rate;
+		}
+	}
+
+	fidi[n] = DEFAULT_FIDI;
+	baud[n++] = defclock * 1000 / 372;
+
+	return n;
+}
+
+
+
+/**
+ * Perform the PPS exchange with the card for readers that do not do it themselves
+ *
+ * @param ctx Reader context
+ * @param fidi FI/DI as in PPS1
+ * @return 0 on success, negative value otherwise
+ */
+static int PPSExchange(scr_t *ctx, unsigned char fidi)
+{
+	unsigned char const *desc;
+	unsigned char pps[4], rsp[4];
+	unsigned int len = sizeof(rsp);
+	int length, rc;
+
+	USB_GetCCIDDescriptor(ctx->device, &desc, &length);
+
+	if (fidi == DEFAULT_FIDI || ctx->SpecificMode ||
+		(length == 54 && (desc[40] & (FEATURE_AUTO_PARAMETERS | FEATURE_AUTO_PPS)))) {
+		return 0;
+	}
+
+	pps[0] = 0xFF;  /* PPSS */
+	pps[1] = 0x11;  /* PPS0: PPS1 follows, T=1 */
+	pps[2] = fidi;  /* PPS1 */
+	pps[3] = pps[0] ^ pps[1] ^ pps[2]; /* PCK */
+
+	rc = PC_to_RDR_XfrBlock(ctx, sizeof(pps), pps, XFR_LEVEL_SINGLE);
+
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = RDR_to_PC_DataBlock(ctx, &len, rsp, NULL, NULL, NULL);
+
+	if (rc < 0) {
+		return rc;
+	}
+
+	/* the card confirms by echoing the request */
+	if (len != sizeof(pps) || memcmp(rsp, pps, sizeof(pps))) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/**
+ * Power on the ICC in the reader, set the ATR and negotiate the fastest
+ * communication parameters supported by card and reader
+ *
+ * If the PPS or SetParameters fails, the card is powered on again and the
+ * next slower values are tried, down to the default values.
+ *
+ * @param ctx Reader context
+ * @return 0 on success, negative value otherwise
+ */
+int PC_to_RDR_IccPowerOn(scr_t *ctx)
+{
+	unsigned char fidi[MAX_PARAMS];
+	int baud[MAX_PARAMS];
+	int n, i, rc;
+
+	ctx->CachedStatus = -1;
+	ctx->CachedChanges = RDR_SlotChanges(ctx);
+
+	rc = IccPowerOn(ctx);
+
+	if (rc < 0) {
+		return rc;
+	}
+
+	n = SelectParameters(ctx, fidi, baud);
+
+	for (i = 0; i < n; i++) {
+		if (i > 0) {
+			/* a failed PPS leaves the card mute, start over with a fresh ATR */
+			PC_to_RDR_IccPowerOff(ctx);
+
+			rc = IccPowerOn(ctx);
+
+			if (rc < 0) {
+				return rc;
+			}
+		}
+
+		ctx->FI = fidi[i] >> 4;
+		ctx->DI = fidi[i] & 0x0F;
+
+		rc = PPSExchange(ctx, fidi[i]);
+
+		if (rc == 0) {
+			rc = PC_to_RDR_SetParameters(ctx);
+		}
+
+		if (rc == 0) {
+			ctx->Baud = baud[i];
+			ctx->CachedStatus = ICC_PRESENT_AND_ACTIVE;
+#ifdef DEBUG
+			ctccid_debug("FI/DI %02X, %d baud\n", fidi[i], ctx->Baud);
+#endif
+			return 0;
+		}
+
+#ifdef DEBUG
+		ctccid_debug("FI/DI %02X rejected\n", fidi[i]);
+#endif
+	}
+
+	return rc;
+}
+
+
+
 /**
  * Get the current state of the reader slot
  *
@@ -366,13 +1100,13 @@ int PC_to_RDR_GetSlotStatus(scr_t *ctx)
         CCIDDump(msg, 10);
 #endif
 
-        rc = USB_Write(ctx->device, 10, msg);
+        rc = WriteMessage(ctx, 10, msg, 0);
 
         if (rc < 0) {
                 return rc;
         }
 
-        rc = USB_Read(ctx->device, &len, buf);
+        rc = ReadMessage(ctx, &len, buf);
 
         if (rc < 0) {
                 return rc;
@@ -382,8 +1116,8 @@ int PC_to_RDR_GetSlotStatus(scr_t *ctx)
         CCIDDump(buf, len);
 #endif
 
-        /* check length, message type, slot and sequence number */
-        if (len != 10 || buf[0] != MSG_TYPE_RDR_to_PC_SlotStatus || buf[5] != 0x00 || buf[6] != 0x00) {
+        /* check length and message type, ReadMessage checked slot and sequence number */
+        if (len != 10 || buf[0] != MSG_TYPE_RDR_to_PC_SlotStatus) {
                 return -1;
         }
 
@@ -394,6 +1128,98 @@ int PC_to_RDR_GetSlotStatus(scr_t *ctx)
 
 
 
+/**
+ * Number of slot changes notified so far, for \ref RDR_WaitSlotChange
+ *
+ * @param ctx Reader context
+ * @return Counter of slot changes
+ */
+unsigned long RDR_SlotChanges(scr_t *ctx)
+{
+	unsigned long changes;
+
+	condvar_lock(&ctx->notify);
+	changes = ctx->SlotChanges;
+	condvar_unlock(&ctx->notify);
+
+	return changes;
+}
+
+
+
+/**
+ * Wait until a slot change after the ones counted in changes is notified, at most ms
+ * milliseconds. Without notifications one polling step of up to 250 ms is waited.
+ *
+ * @param ctx Reader context
+ * @param changes Counter of \ref RDR_SlotChanges, updated to the current counter
+ * @param ms Maximum time to wait
+ * @return Milliseconds waited
+ */
+int RDR_WaitSlotChange(scr_t *ctx, unsigned long *changes, int ms)
+{
+	uint64_t start = trace_now();
+	int waited = 0;
+
+	condvar_lock(&ctx->notify);
+
+	if (!ctx->Notifying) {
+		condvar_unlock(&ctx->notify);
+
+		if (ms > 250) {
+			ms = 250;
+		}
+
+		usleep(ms * 1000);
+		return ms;
+	}
+
+	while (ctx->Notifying && ctx->SlotChanges == *changes && waited < ms) {
+		condvar_timedwait(&ctx->notify, ms - waited);
+		waited = (int)((trace_now() - start) / 1000000);
+	}
+
+	*changes = ctx->SlotChanges;
+
+	condvar_unlock(&ctx->notify);
+
+	return waited;
+}
+
+
+
+/**
+ * Get the state of the reader slot. While slot changes are notified, the state of the
+ * last query, power on or power off is returned without a round trip to the reader
+ * until the next slot change.
+ *
+ * @param ctx Reader context
+ * @return \ref ICC_PRESENT_AND_INACTIVE, \ref ICC_PRESENT_AND_ACTIVE, \ref NO_ICC_PRESENT or -1 on error
+ */
+int RDR_SlotStatus(scr_t *ctx)
+{
+	unsigned long changes;
+	int notifying, status;
+
+	condvar_lock(&ctx->notify);
+	notifying = ctx->Notifying;
+	changes = ctx->SlotChanges;
+	condvar_unlock(&ctx->notify);
+
+	if (notifying && ctx->CachedStatus >= 0 && ctx->CachedChanges == changes) {
+		return ctx->CachedStatus;
+	}
+
+	status = PC_to_RDR_GetSlotStatus(ctx);
+
+	ctx->CachedStatus = status < 0 ? -1 : status;
+	ctx->CachedChanges = changes;
+
+	return status;
+}
+
+
+
 /**
  * Power off the ICC in the reader
  *
@@ -408,6 +1234,8 @@ int PC_to_RDR_IccPowerOff(scr_t *ctx)
         unsigned int len = 10;
         int rc;
 
+        ctx->CachedStatus = -1;
+
         memset(msg, 0, 10);
         msg[0] = MSG_TYPE_PC_to_RDR_IccPowerOff;
 
@@ -415,13 +1243,13 @@ int PC_to_RDR_IccPowerOff(scr_t *ctx)
         CCIDDump(msg, 10);
 #endif
 
-        rc = USB_Write(ctx->device, 10, msg);
+        rc = WriteMessage(ctx, 10, msg, 0);
 
         if (rc < 0) {
                 return rc;
         }
 
-        rc = USB_Read(ctx->device, &len, buf);
+        rc = ReadMessage(ctx, &len, buf);
 
         if (rc < 0) {
                 return rc;
@@ -431,8 +1259,8 @@ int PC_to_RDR_IccPowerOff(scr_t *ctx)
         CCIDDump(buf, len);
 #endif
 
-        /* check length, message type, slot and sequence number */
-        if (len != 10 || buf[0] != MSG_TYPE_RDR_to_PC_SlotStatus || buf[5] != 0x00 || buf[6] != 0x00) {
+        /* check length and message type, ReadMessage checked slot and sequence number */
+        if (len != 10 || buf[0] != MSG_TYPE_RDR_to_PC_SlotStatus) {
                 return -1;
         }
 
@@ -441,6 +1269,71 @@ int PC_to_RDR_IccPowerOff(scr_t *ctx)
 
 
 
+/**
+ * Margin in ms for the reader and USB in \ref RDR_ResponseTimeout
+ */
+#define RESPONSE_MARGIN 300
+
+/**
+ * Turnaround in ms of a T=1 block the reader exchanges without processing by the card
+ */
+#define BLOCK_TURNAROUND 20
+
+/**
+ * Timeout of the response to a block sent to the card, derived from the parameters of the ATR
+ *
+ * The card must answer within the block waiting time (BWI) or request a waiting time extension,
+ * the characters of a block take 12 etu at the negotiated baud rate, plus at most one character
+ * waiting time (CWI) per block for a pause. With the T=1 protocol of the driver the reader exchanges one block each way, the
+ * block waiting time (ccidT1_t WorkBWT) includes a waiting time extension. With the APDU level
+ * exchange the reader splits the command into blocks of IFSC bytes and receives the response in
+ * blocks of up to 254 bytes, the card processes the command once.
+ *
+ * The timeout is at least twice the slowest response observed from the card, in case the
+ * card or reader does not keep the announced times. So a wedged reader is detected after the
+ * worst case processing time of the card instead of a fixed time of seconds.
+ *
+ * @param ctx Reader context
+ * @param outlen Length of the block sent
+ * @param wtx Multiplier of the block waiting time requested by the card, 0 for none
+ * @return Timeout in ms
+ */
+unsigned int RDR_ResponseTimeout(scr_t *ctx, unsigned int outlen, unsigned int wtx)
+{
+	unsigned long bwt, cwt, etu, blocks, chars, ms;
+	unsigned int ifsc = ctx->IFSC ? ctx->IFSC : 32;
+	unsigned int inlen = ctx->MaxBlock && ctx->MaxBlock < BLOCKMAX ? ctx->MaxBlock : BLOCKMAX;
+	int baud = ctx->Baud > 9600 ? ctx->Baud : 9600;
+
+	if (ctx->t1) {
+		bwt = ctx->t1->WorkBWT;
+		blocks = 1;
+		chars = outlen + BUFFMAX;
+	} else {
+		bwt = 200 + (1 << ctx->BWI) * 100 + 11000 / baud;
+		blocks = (outlen + ifsc - 1) / ifsc + (inlen + 253) / 254;
+		chars = outlen + inlen + blocks * 4;
+	}
+
+	if (wtx > 1) {
+		bwt *= wtx;
+	}
+
+	/* in us */
+	etu = 1000000UL / baud;
+	cwt = (11 + (1UL << ctx->CWI)) * etu;
+
+	ms = bwt + blocks * (BLOCK_TURNAROUND + cwt / 1000) + chars * 12 * etu / 1000 + RESPONSE_MARGIN;
+
+	if (ms < 2UL * ctx->SlowestResponse) {
+		ms = 2UL * ctx->SlowestResponse;
+	}
+
+	return (unsigned int)ms;
+}
+
+
+
 /**
  * Exchange data block between PC and reader
  *
@@ -454,11 +1347,11 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
 {
 
         int rc;
-        unsigned char msg[10 + BUFFMAX];
+        unsigned char msg[10 + BLOCKMAX];
 
-        if (outlen > BUFFMAX) {
+        if (outlen > BLOCKMAX) {
 #ifdef DEBUG
-                ctccid_debug("PC_to_RDR_XfrBlock outlen > BUFFMAX\n");
+                ctccid_debug("PC_to_RDR_XfrBlock outlen > BLOCKMAX\n");
 #endif
                 return -1;
         }
@@ -476,12 +1369,18 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
 #ifdef DEBUG
         CCIDDump(msg, (10 + outlen));
 #endif
-        rc = USB_Write(ctx->device, (10 + outlen), msg);
+        /* The response is due within the response timeout (see RDR_to_PC_DataBlock), a single
+           slot reader posts the read before the command, the reader answers as soon as the card is done */
+        ctx->XfrStart = trace_now();
+
+        rc = WriteMessage(ctx, (10 + outlen), msg, RDR_ResponseTimeout(ctx, outlen, 0));
 
         if (rc < 0) {
                 return rc;
         }
 
+        ctx->Bytes += outlen;
+
         return 0;
 }
 
@@ -498,20 +1397,20 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
 int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, unsigned char *status, unsigned char *error, unsigned char *chain)
 {
 
-        unsigned int l;
-        unsigned char msg[10 + BUFFMAX];
+        unsigned int l, ms;
+        unsigned char msg[10 + BLOCKMAX];
         int rc;
 
-        if (*inlen > BUFFMAX) {
+        if (*inlen > BLOCKMAX) {
 #ifdef DEBUG
-                ctccid_debug("RDR_to_PC_DataBlock *inlen > BUFFMAX\n");
+                ctccid_debug("RDR_to_PC_DataBlock *inlen > BLOCKMAX\n");
 #endif
                 return -1;
         }
 
         while (1) {
                 l = sizeof(msg);
-                rc = USB_Read(ctx->device, &l, msg);
+                rc = ReadMessage(ctx, &l, msg);
 
                 if (rc < 0) {
                         *inlen = 0;
@@ -522,18 +1421,27 @@ int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, u
                 CCIDDump(msg, l);
 #endif
 
-                /* check length, message type, slot and sequence number */
-                if (l < 10 || msg[0] != MSG_TYPE_RDR_to_PC_DataBlock || msg[5] != 0x00 || msg[6] != 0x00) {
+                /* check length and message type, ReadMessage checked slot and sequence number */
+                if (l - 10 > *inlen || msg[0] != MSG_TYPE_RDR_to_PC_DataBlock) {
                         *inlen = 0;
                         return -1;
                 }
 
                 if (msg[7] & 0x80) {			// Card requests waiting time extension
+                        /* the deadline is extended by bError times the block waiting time */
+                        ctx->Wtx++;
+                        ctx->XfrStart = trace_now();
+                        ExtendTimeout(ctx, RDR_ResponseTimeout(ctx, 0, msg[8]));
                         continue;
                 }
                 break;
         }
 
+        ms = (unsigned int)((trace_now() - ctx->XfrStart) / 1000000);
+        if (ms > ctx->SlowestResponse) {
+                ctx->SlowestResponse = ms;
+        }
+
         if (status)
                 *status = msg[7];
         if (error)
@@ -541,10 +1449,11 @@ int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, u
         if (chain)
                 *chain = msg[9];
 #ifdef DEBUG
-        memset(inbuf, 0x00, BUFFMAX);
+        memset(inbuf, 0x00, *inlen);
 #endif
 
         *inlen = (l - 10);
+        ctx->Bytes += *inlen;
 
         memcpy(inbuf, msg + 10, *inlen);
 
@@ -42,6 +42,16 @@
  */
 #define BUFFMAX    261
 
+/**
+ * Maximum size of a data block in extended APDU level exchange (see RDR_MaxBlockLength)
+ */
+#define BLOCKMAX   4096
+
+/**
+ * Maximum number of slots used of one reader (bMaxSlotCount + 1)
+ */
+#define CCID_MAX_SLOTS  16
+
 #define ERR_ICC_MUTE				0xFE
 #define ERR_XFR_OVERRUN				0xFC
 #define ERR_HW_ERROR				0xFB
@@ -54,6 +64,32 @@
 #define MSG_TYPE_RDR_to_PC_DataBlock		0x80
 #define MSG_TYPE_RDR_to_PC_SlotStatus		0x81
 #define MSG_TYPE_RDR_to_PC_Parameters		0x82
+#define MSG_TYPE_RDR_to_PC_NotifySlotChange	0x50
+#define MSG_TYPE_RDR_to_PC_HardwareError	0x51
+
+/* wLevelParameter of PC_to_RDR_XfrBlock and bChainParameter of RDR_to_PC_DataBlock */
+#define XFR_LEVEL_SINGLE			0x00	/* APDU begins and ends with this block */
+#define XFR_LEVEL_BEGIN				0x01	/* APDU begins with this block, continues */
+#define XFR_LEVEL_END				0x02	/* APDU ends with this block            */
+#define XFR_LEVEL_CONTINUE			0x03	/* APDU continues with this block       */
+#define XFR_LEVEL_EMPTY				0x10	/* empty block, requests the next block */
+
+/* bmCommandStatus in bStatus of RDR_to_PC messages */
+#define CMD_STATUS_FAILED			0x40
+#define CMD_STATUS_MASK				0xC0
+
+/* Class specific requests */
+#define REQUEST_GET_CLOCK_FREQUENCIES	0x02
+#define REQUEST_GET_DATA_RATES			0x03
+
+/* dwFeatures byte 0 of the CCID class descriptor */
+#define FEATURE_AUTO_CLOCK			0x10	/* Automatic ICC clock frequency change */
+#define FEATURE_AUTO_PARAMETERS		0x40	/* Automatic parameters negotiation made by the CCID */
+#define FEATURE_AUTO_PPS			0x80	/* Automatic PPS made by the CCID according to the active parameters */
+
+/* dwFeatures byte 2 of the CCID class descriptor */
+#define FEATURE_SHORT_APDU			0x02	/* Short APDU level exchange            */
+#define FEATURE_EXTENDED_APDU		0x04	/* Short and extended APDU level exchange */
 
 #define ICC_PRESENT_AND_ACTIVE		0x00
 #define ICC_PRESENT_AND_INACTIVE	0x01
@@ -62,12 +98,59 @@
 
 #define MATCH(x,y) ((x >= (y - y / 20)) && (x <= (y + y / 20)))
 
+/**
+ * USB connection of a reader, shared by the scr_t of its slots
+ *
+ * The messages of a single slot reader are exchanged one after the other, each
+ * response is read by the thread which sent the command. The slots of a multi-slot
+ * reader have up to bMaxCCIDBusySlots commands outstanding at the same time, each
+ * message with its own bSeq. One of the threads waiting for a response reads the
+ * bulk in endpoint and hands each response to the slot it is addressed to, the thread
+ * of that slot continues without a transfer of its own.
+ */
+typedef struct ccid_reader {
+	/** Port number of the USB device */
+	unsigned short port;
+	/** Slots opened */
+	int refs;
+	/** Context structure for USB device */
+	usb_device_t *device;
+	/** bMaxSlotCount + 1, at most CCID_MAX_SLOTS */
+	int slots;
+	/** bMaxCCIDBusySlots, commands outstanding at the same time */
+	int maxBusy;
+	/** Protects the fields below and the responses of the slots, signalled by each change */
+	CONDVAR cond;
+	/** Serializes the bulk out transfers of the slots */
+	MUTEX write;
+	/** Slots opened, receive the notifications and responses */
+	scr_t *slot[CCID_MAX_SLOTS];
+	/** The interrupt in transfer notifies slot changes */
+	int notifying;
+	/** Commands outstanding */
+	int busy;
+	/** bSeq of the next message */
+	unsigned char seq;
+	/** A thread reads the bulk in endpoint into buffer */
+	int receiving;
+	unsigned char buffer[10 + BLOCKMAX];
+	struct ccid_reader *next;
+} ccid_reader_t;
+
+int RDR_Open(scr_t *ctx, unsigned short pn);
+
+void RDR_Close(scr_t *ctx);
+
 int PC_to_RDR_IccPowerOn(scr_t *ctx);
 
 int PC_to_RDR_IccPowerOff(scr_t *ctx);
 
 int RDR_APDUTransferMode(scr_t *ctx);
 
+int RDR_MaxBlockLength(scr_t *ctx);
+
+unsigned int RDR_ResponseTimeout(scr_t *ctx, unsigned int outlen, unsigned int wtx);
+
 int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, unsigned char level);
 
 int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, unsigned char *status, unsigned char *error, unsigned char *chain);
@@ -80,4 +163,10 @@ int DecodeATRValues(scr_t *ctx);
 
 int PC_to_RDR_SetParameters(scr_t *ctx);
 
+unsigned long RDR_SlotChanges(scr_t *ctx);
+
+int RDR_WaitSlotChange(scr_t *ctx, unsigned long *changes, int ms);
+
+int RDR_SlotStatus(scr_t *ctx);
+
 #endif
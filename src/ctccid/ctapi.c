@@ -38,32 +38,48 @@
 #include "ctapi.h"
 #include "ctbcs.h"
 #include "scr.h"
+#include "ccid_usb.h"
+#include <common/trace.h>
 
 extern int ccidT1Term (struct scr *ctx);
 
 static MUTEX globalmutex;
 static int mutexInitialized = 0;
 
-/* Handle up to 8 USB CCID readers */
+/*
+ * Table of active readers indexed by the card terminal number. The pages are
+ * allocated on demand and not moved, so CT_data locates its reader in constant
+ * time without the global mutex, whatever the number of readers.
+ */
 
-scr_t *readerTable[MAX_READER] = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+static scr_t **readerTable[READER_PAGES];
 
 /*
  * Locate matching card terminal number in table of active readers.
  *
  */
 
-static int LookupReader(unsigned short ctn)
+static scr_t *LookupReader(unsigned short ctn)
+{
+	scr_t **page = readerTable[ctn / READER_PAGE];
+
+	return page ? page[ctn % READER_PAGE] : NULL;
+}
+
+
+
+/*
+ * Release the pages of the reader table, called when the last reader is closed
+ */
+
+static void FreeReaderTable(void)
 {
 	int i;
 
-	for (i = 0; i < MAX_READER; i++) {
-		if (readerTable[i] && (readerTable[i]->ctn == ctn)) {
-			return i;
-		}
+	for (i = 0; i < READER_PAGES; i++) {
+		free(readerTable[i]);
+		readerTable[i] = NULL;
 	}
-
-	return -1;
 }
 
 
@@ -78,8 +94,8 @@ static int LookupReader(unsigned short ctn)
  */
 signed char CT_init(unsigned short ctn, unsigned short pn)
 {
-	int rc, indx;
-	scr_t *ctx;
+	int rc;
+	scr_t *ctx, ***page;
 
 	if (!mutexInitialized) {
 		if (mutex_init(&globalmutex) != 0) {
@@ -93,21 +109,22 @@ signed char CT_init(unsigned short ctn, unsigned short pn)
 		return ERR_CT;
 	}
 
-	rc = LookupReader(ctn);
-
-	if (rc < 0) {
+	if (!LookupReader(ctn)) {
 
 		/*
-		 * Determine next free position in reader list
+		 * Allocate the page of the reader table on first use
 		 */
-		for (indx = 0; (indx < MAX_READER) && readerTable[indx]; indx++) {
-			;
+		page = &readerTable[ctn / READER_PAGE];
+
+		if (!*page) {
+			*page = (scr_t **)calloc(READER_PAGE, sizeof(scr_t *));
 		}
 
-		if (indx == MAX_READER) {
+		if (!*page) {
 			mutexInitialized--;
 			mutex_unlock(&globalmutex);
 			if (!mutexInitialized) {
+				FreeReaderTable();
 				mutex_destroy(&globalmutex);
 			}
 			return ERR_MEMORY;
@@ -119,15 +136,17 @@ signed char CT_init(unsigned short ctn, unsigned short pn)
 			mutexInitialized--;
 			mutex_unlock(&globalmutex);
 			if (!mutexInitialized) {
+				FreeReaderTable();
 				mutex_destroy(&globalmutex);
 			}
 			return ERR_MEMORY;
 		}
 
 		/*
-		 * No active reader yet - try to find one
+		 * No active reader yet - try to find one. Card insertion and removal
+		 * come from the interrupt endpoint of the reader
 		 */
-		rc = USB_Open(pn, &(ctx->device));
+		rc = RDR_Open(ctx, pn);
 
 		if (rc != USB_OK) {
 			free(ctx);
@@ -136,6 +155,7 @@ signed char CT_init(unsigned short ctn, unsigned short pn)
 				mutexInitialized--;
 				mutex_unlock(&globalmutex);
 				if (!mutexInitialized) {
+					FreeReaderTable();
 					mutex_destroy(&globalmutex);
 				}
 				return ERR_CT;
@@ -143,6 +163,7 @@ signed char CT_init(unsigned short ctn, unsigned short pn)
 				mutexInitialized--;
 				mutex_unlock(&globalmutex);
 				if (!mutexInitialized) {
+					FreeReaderTable();
 					mutex_destroy(&globalmutex);
 				}
 				return ERR_HOST; /* USB transmission error */
@@ -153,11 +174,12 @@ signed char CT_init(unsigned short ctn, unsigned short pn)
 		ctx->pn = pn;
 
 		if (mutex_init(&ctx->mutex) != 0) {
+			RDR_Close(ctx);
 			free(ctx);
 			return ERR_CT;
 		}
 
-		readerTable[indx] = ctx;
+		(*page)[ctn % READER_PAGE] = ctx;
 	}
 
 	if (mutex_unlock(&globalmutex) != 0) {
@@ -178,21 +200,13 @@ signed char CT_init(unsigned short ctn, unsigned short pn)
 signed char CT_close(unsigned short ctn)
 {
 
-	int rc;
 	scr_t *ctx;
 
 	if (mutex_lock(&globalmutex) != 0) {
 		return ERR_CT;
 	}
 
-	rc = LookupReader(ctn);
-
-	if (rc < 0) {
-		mutex_unlock(&globalmutex);
-		return ERR_CT;
-	}
-
-	ctx = readerTable[rc];
+	ctx = LookupReader(ctn);
 
 	if (!ctx) {
 		mutex_unlock(&globalmutex);
@@ -203,12 +217,12 @@ signed char CT_close(unsigned short ctn)
 		ccidT1Term(ctx);
 	}
 
-	USB_Close(&ctx->device);
+	RDR_Close(ctx);
 
 	mutex_destroy(&ctx->mutex);
 
 	free(ctx);
-	readerTable[rc] = NULL;
+	readerTable[ctn / READER_PAGE][ctn % READER_PAGE] = NULL;
 
 	if (mutex_unlock(&globalmutex) != 0) {
 		return ERR_CT;	
@@ -216,6 +230,7 @@ signed char CT_close(unsigned short ctn)
 
 	mutexInitialized--;
 	if (!mutexInitialized) {
+		FreeReaderTable();
 		mutex_destroy(&globalmutex);
 	}
 
@@ -245,13 +260,7 @@ signed char CT_data(unsigned short ctn, unsigned char *dad, unsigned char *sad,
 	unsigned int ilr;
 	scr_t *ctx;
 
-	rc = LookupReader(ctn);
-
-	if (rc < 0) {
-		return ERR_CT;
-	}
-
-	ctx = readerTable[rc];
+	ctx = LookupReader(ctn);
 
 	if (!ctx) {
 		return ERR_CT;
@@ -313,9 +322,11 @@ signed char CT_data(unsigned short ctn, unsigned char *dad, unsigned char *sad,
 		*dad = 2; /* Destination Host */
 
 		if (ctx->CTModFunc) {
+			ctx->Apdus++;
 			rc = (*ctx->CTModFunc)(ctx, lc, cmd, &ilr, rsp);
 
 			if (rc < 0) {
+				ctx->CachedStatus = -1; /* e.g. card deactivated by the reader */
 				rc = ERR_TRANS;
 			}
 		} else {
@@ -339,6 +350,119 @@ signed char CT_data(unsigned short ctn, unsigned char *dad, unsigned char *sad,
 		return ERR_CT;
 	}
 
+	TRACE(TRACE_CT_DATA, ctn, lc, ilr, rc);
+
 	return rc;
 }
 
+
+
+/**
+ * List the ports of the readers attached, e.g. to call CT_init for each of them
+ * instead of probing port numbers. A multi-slot reader has a port number for each
+ * slot, CT_PN(port, slot).
+ *
+ * @param pn Array receiving the port numbers in ascending order of the reader
+ * @param count Size of the array on entry, number of ports returned on exit
+ * @return Status code \ref OK, \ref ERR_HOST
+ */
+signed char CT_ports(unsigned short *pn, unsigned short *count)
+{
+	unsigned short ports[READER_PAGE];
+	int rc, i, slot, slots, n = 0;
+
+	rc = USB_ListPorts(ports, READER_PAGE);
+
+	if (rc < 0) {
+		*count = 0;
+		return ERR_HOST;
+	}
+
+	for (i = 0; i < rc && i < READER_PAGE && n < *count; i++) {
+		slots = USB_SlotCount(ports[i]);
+
+		for (slot = 0; slot < slots && n < *count; slot++) {
+			pn[n++] = CT_PN(ports[i], slot);
+		}
+	}
+
+	*count = (unsigned short)n;
+
+	return OK;
+}
+
+
+
+/**
+ * Add a listener for readers attached or detached. The listener is called from
+ * the USB event thread, it must not block and must not call CT_data.
+ *
+ * @param listener Function to call with the port number
+ * @param arg Argument passed to the listener
+ * @return Status code \ref OK, \ref ERR_HOST without hotplug support
+ */
+signed char CT_watch(CT_event_t listener, void *arg)
+{
+	if (USB_AddHotplugListener((usb_hotplug_t)listener, arg) != USB_OK) {
+		return ERR_HOST;
+	}
+
+	return OK;
+}
+
+
+
+/**
+ * Remove a listener added with CT_watch, it is not called anymore after the return
+ *
+ * @param listener Function passed to CT_watch
+ * @param arg Argument passed to CT_watch
+ * @return Status code \ref OK
+ */
+signed char CT_unwatch(CT_event_t listener, void *arg)
+{
+	USB_RemoveHotplugListener((usb_hotplug_t)listener, arg);
+
+	return OK;
+}
+
+
+
+/**
+ * Get the transport counters of a card terminal, which are cumulative since CT_init.
+ * Benchmarks take the difference of two calls.
+ *
+ * @param ctn Card terminal number
+ * @param stats Counters returned
+ * @return Status code \ref OK, \ref ERR_CT
+ */
+signed char CT_stats(unsigned short ctn, CT_stats_t *stats)
+{
+	scr_t *ctx;
+
+	ctx = LookupReader(ctn);
+
+	if (!ctx) {
+		return ERR_CT;
+	}
+
+	if (mutex_lock(&ctx->mutex) != 0) {
+		return ERR_CT;
+	}
+
+	stats->apdus = ctx->Apdus;
+	stats->transfers = ctx->device->transfers;
+	stats->write_us = ctx->device->write_us;
+	stats->read_us = ctx->device->read_us;
+	stats->blocks = ctx->Blocks;
+	stats->bytes = ctx->Bytes;
+	stats->wtx = ctx->Wtx;
+	stats->baud = ctx->Baud;
+	stats->apdu_level = RDR_APDUTransferMode(ctx) != 0;
+
+	if (mutex_unlock(&ctx->mutex) != 0) {
+		return ERR_CT;
+	}
+
+	return OK;
+}
@@ -60,6 +60,54 @@ extern "C" {
 		unsigned char  *rsp                /* Response APDU buffer              */
 	);
 
+	/* Extensions to the MKT specification                                      */
+
+	/** Port numbers of CT_init: the reader in the low byte, the slot of a
+	    multi-slot reader in the high byte, see CT_ports */
+#define CT_PN(port, slot)   ((unsigned short)((port) | (slot) << 8))
+#define CT_PORT(pn)         ((pn) & 0xFF)
+#define CT_SLOT(pn)         ((pn) >> 8)
+
+	/** Listener for readers attached or detached, see CT_watch */
+	typedef void (*CT_event_t)(
+		unsigned short pn,                  /* Port of the reader                */
+		int            attached,            /* Nonzero attached, zero detached   */
+		void           *arg                 /* Argument passed to CT_watch       */
+	);
+
+	signed char CT_ports(
+		unsigned short *pn,                 /* Ports of the readers attached     */
+		unsigned short *count               /* Size of pn/number of readers      */
+	);
+
+	signed char CT_watch(
+		CT_event_t     listener,            /* Called from the USB event thread  */
+		void           *arg                 /* Argument passed to the listener   */
+	);
+
+	signed char CT_unwatch(
+		CT_event_t     listener,            /* Listener passed to CT_watch       */
+		void           *arg                 /* Argument passed to CT_watch       */
+	);
+
+	/** Transport counters of a card terminal, see CT_stats */
+	typedef struct {
+		unsigned long      apdus;           /* Commands sent to the card         */
+		unsigned long      transfers;       /* USB bulk transfers                */
+		unsigned long long write_us;        /* Time in bulk OUT transfers        */
+		unsigned long long read_us;         /* Time waiting for bulk IN, includes the card */
+		unsigned long      blocks;          /* T=1 blocks sent and received      */
+		unsigned long      bytes;           /* Data of XfrBlock/DataBlock messages */
+		unsigned long      wtx;             /* Waiting time extensions requested */
+		int                baud;            /* Baudrate negotiated with the card */
+		int                apdu_level;      /* Nonzero for APDU level exchange   */
+	} CT_stats_t;
+
+	signed char CT_stats(
+		unsigned short ctn,                 /* Number assigned to terminal       */
+		CT_stats_t     *stats               /* Counters since CT_init            */
+	);
+
 	/* CTAPI - response codes                                                   */
 
 	/** Successful completion            */
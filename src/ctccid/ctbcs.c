@@ -152,6 +152,7 @@ int RequestICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 			   unsigned int *lr, unsigned char *rsp)
 {
 	int status, timeout;
+	unsigned long changes;
 
 	if ((lc > 4) && (cmd[4] == 1)) {
 		timeout = cmd[5];
@@ -159,20 +160,14 @@ int RequestICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 		timeout = 0;
 	}
 
-	status = PC_to_RDR_GetSlotStatus(ctx);
+	timeout *= 1000; /* ms */
 
-	if (status < 0) {
-		rsp[0] = HIGH(NOT_SUCCESSFUL);
-		rsp[1] = LOW(NOT_SUCCESSFUL);
-		*lr = 2;
-		return ERR_CT;
-	}
-
-	timeout *= 4;
+	/* woken by the card insertion if the reader notifies slot changes, polled otherwise */
+	changes = RDR_SlotChanges(ctx);
 
-	do {
+	for (;;) {
 
-		status = PC_to_RDR_GetSlotStatus(ctx);
+		status = RDR_SlotStatus(ctx);
 
 		if (status < 0) {
 			rsp[0] = HIGH(NOT_SUCCESSFUL);
@@ -181,15 +176,14 @@ int RequestICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 			return ERR_CT;
 		}
 
-		if ((status == ICC_PRESENT_AND_INACTIVE) || !timeout) {
+		if ((status == ICC_PRESENT_AND_INACTIVE) || (timeout <= 0)) {
 			break;
 		}
 
-		usleep(250000);
-		timeout--;
-	} while (timeout);
+		timeout -= RDR_WaitSlotChange(ctx, &changes, timeout);
+	}
 
-	if (!timeout && (status == NO_ICC_PRESENT)) {
+	if (status == NO_ICC_PRESENT) {
 		rsp[0] = HIGH(W_NO_CARD_PRESENTED);
 		rsp[1] = LOW(W_NO_CARD_PRESENTED);
 		*lr = 2;
@@ -218,8 +212,8 @@ int RequestICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 int EjectICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 			 unsigned int *lr, unsigned char *rsp)
 {
-	int status;
-	unsigned char save_timeout;
+	int status, remaining;
+	unsigned long changes;
 	unsigned char timeout;
 
 	/* Reader has no display or other goodies, so check for correct P2 parameter */
@@ -238,8 +232,6 @@ int EjectICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 		timeout = 0;
 	}
 
-	save_timeout = timeout;
-
 	status = PC_to_RDR_IccPowerOff(ctx);
 
 	if (status < 0) {
@@ -253,47 +245,45 @@ int EjectICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 	ctx->LenOfATR = 0;
 	ctx->NumOfHB = 0;
 
-	save_timeout *= 4;
-
-	if (save_timeout > 0) {
-		do {
+	if (timeout == 0) { /* Command OK,no timeout specified   */
+		rsp[0] = HIGH(SMARTCARD_SUCCESS);
+		rsp[1] = LOW(SMARTCARD_SUCCESS);
+		*lr = 2;
+		return OK;
+	}
 
-			status = PC_to_RDR_GetSlotStatus(ctx);
+	remaining = timeout * 1000; /* ms */
+	changes = RDR_SlotChanges(ctx);
 
-			if (status < 0) {
-				rsp[0] = HIGH(NOT_SUCCESSFUL);
-				rsp[1] = LOW(NOT_SUCCESSFUL);
-				*lr = 2;
-				return ERR_CT;
-			}
+	for (;;) {
 
-			if (status == ICC_PRESENT_AND_INACTIVE || status == NO_ICC_PRESENT) {
-				break;
-			}
+		status = RDR_SlotStatus(ctx);
 
-			usleep(250000);
+		if (status < 0) {
+			rsp[0] = HIGH(NOT_SUCCESSFUL);
+			rsp[1] = LOW(NOT_SUCCESSFUL);
+			*lr = 2;
+			return ERR_CT;
+		}
 
-		} while (--save_timeout);
+		if (status == ICC_PRESENT_AND_INACTIVE || status == NO_ICC_PRESENT || remaining <= 0) {
+			break;
+		}
 
-	} else { /* Command OK,no timeout specified   */
-		rsp[0] = HIGH(SMARTCARD_SUCCESS);
-		rsp[1] = LOW(SMARTCARD_SUCCESS);
-		*lr = 2;
-		return OK;
+		remaining -= RDR_WaitSlotChange(ctx, &changes, remaining);
 	}
 
-	if (save_timeout) { /* Command OK, card removed          */
+	if (status == ICC_PRESENT_AND_INACTIVE || status == NO_ICC_PRESENT) { /* Command OK, card removed */
 		rsp[0] = HIGH(SMARTCARD_SUCCESS);
 		rsp[1] = LOW(SMARTCARD_SUCCESS);
 		*lr = 2;
 		return OK;
 	}
 
-	if ((!save_timeout) && (timeout > 0)) { /* warning: card not removed */
-		rsp[0] = HIGH(W_NO_CARD_PRESENTED);
-		rsp[1] = LOW(W_NO_CARD_PRESENTED);
-		*lr = 2;
-	}
+	/* warning: card not removed */
+	rsp[0] = HIGH(W_NO_CARD_PRESENTED);
+	rsp[1] = LOW(W_NO_CARD_PRESENTED);
+	*lr = 2;
 
 	return OK;
 }
@@ -312,7 +302,8 @@ int GetICCStatus(struct scr *ctx, unsigned int *lr, unsigned char *rsp)
 {
 	int status;
 
-	status = PC_to_RDR_GetSlotStatus(ctx);
+	/* no round trip while the reader notifies no slot change */
+	status = RDR_SlotStatus(ctx);
 
 	if (status < 0) {
 		rsp[0] = HIGH(NOT_SUCCESSFUL);
@@ -346,6 +337,36 @@ int GetICCStatus(struct scr *ctx, unsigned int *lr, unsigned char *rsp)
 
 
 
+/**
+ * Get the communication parameters negotiated with the ICC
+ *
+ * @param ctx Reader context
+ * @param lr Length of response
+ * @param rsp Response buffer
+ * @return \ref OK, \ref ERR_MEMORY
+ */
+int GetICCParameters(struct scr *ctx, unsigned int *lr, unsigned char *rsp)
+{
+	if (*lr < 9) {
+		return ERR_MEMORY;
+	}
+
+	rsp[0] = CTBCS_DO_ICC_PARAMETERS;
+	rsp[1] = 0x05;
+	rsp[2] = (ctx->FI << 4) | (ctx->DI & 0x0F);
+	rsp[3] = (ctx->Baud >> 24) & 0xFF;
+	rsp[4] = (ctx->Baud >> 16) & 0xFF;
+	rsp[5] = (ctx->Baud >> 8) & 0xFF;
+	rsp[6] = ctx->Baud & 0xFF;
+	rsp[7] = HIGH(SMARTCARD_SUCCESS);
+	rsp[8] = LOW(SMARTCARD_SUCCESS);
+	*lr = 9;
+
+	return OK;
+}
+
+
+
 /**
  * CT-BCS Get Status command
  *
@@ -405,6 +426,10 @@ int GetStatus(struct scr *ctx, unsigned char *cmd, unsigned int *lr,
 			break;
 		}
 
+	} else if (what == CTBCS_DO_ICC_PARAMETERS) {
+		if ((response = GetICCParameters(ctx, lr, rsp)) < 0) {
+			return response;
+		}
 	} else {
 		if ((response = GetICCStatus(ctx, lr, rsp)) < 0) {
 			return response;
@@ -38,6 +38,9 @@
 
 #define CTBCS_DATA_STATUS_CARD 4
 
+/* Proprietary GetStatus DO with FI/DI (as in PPS1) and the baudrate (4 bytes, MSB first) negotiated with the ICC */
+#define CTBCS_DO_ICC_PARAMETERS 0x90
+
 int ResetTerminal(struct scr *ctx, unsigned int *lr, unsigned char *rsp);
 
 int ResetCard(struct scr *ctx, unsigned int lc, unsigned char *cmd,
@@ -43,9 +43,11 @@
 #include "usb_device.h"
 
 /**
- * Maximum number of readers
+ * The readers are looked up by ctn in READER_PAGES pages of READER_PAGE entries,
+ * which covers all card terminal numbers
  */
-#define MAX_READER  8
+#define READER_PAGE   256
+#define READER_PAGES  256
 
 /**
  * Maximum size of ATR
@@ -80,8 +82,22 @@ struct scr {
 	/** Card terminal specific mutex */
 	MUTEX mutex;
 
-	/** Context structure for USB device */
+	/** USB connection of the reader, shared by its slots, see RDR_Open */
+	struct ccid_reader	*reader;
+	/** Context structure for USB device, the one of reader */
 	struct usb_device	*device;
+	/** Slot of the reader addressed by the messages (bSlot) */
+	unsigned char     Slot;
+	/** bSeq of the last message sent, the response carries the same */
+	unsigned char     Seq;
+
+	/** Multi-slot readers only, protected by the lock of reader: a response is outstanding */
+	int               Pending;
+	/** Response received for Seq, 0 if none yet */
+	unsigned int      ResponseLen;
+	unsigned char     *Response;
+	/** Time the response is due, trace_now() */
+	unsigned long long Deadline;
 
 	/** Last ATR received from the card    */
 	unsigned char     ATR[MAX_ATR];
@@ -103,8 +119,36 @@ struct scr {
 	unsigned char     EXTRA_GUARD_TIME;
 	/** Maximum length of INF field        */
 	unsigned char     IFSC;
-	/** Current baudrate                   */
+	/** Card in specific mode (TA2), no PPS */
+	unsigned char     SpecificMode;
+	/** Baudrate negotiated with the card  */
 	int               Baud;
+	/** Maximum data length of one XfrBlock in APDU level exchange */
+	unsigned int      MaxBlock;
+
+	/** Commands to the card, see CT_stats */
+	unsigned long     Apdus;
+	/** T=1 blocks sent and received       */
+	unsigned long     Blocks;
+	/** Data bytes of XfrBlock and DataBlock messages */
+	unsigned long     Bytes;
+	/** Waiting time extensions requested by the card */
+	unsigned long     Wtx;
+
+	/** Slowest response to a block in ms, see RDR_ResponseTimeout */
+	unsigned int      SlowestResponse;
+	/** Start of the wait for the response to the last block sent, trace_now() */
+	unsigned long long XfrStart;
+
+	/** Slot change notifications, protects Notifying and SlotChanges */
+	CONDVAR           notify;
+	/** RDR_to_PC_NotifySlotChange messages are received on the interrupt endpoint */
+	int               Notifying;
+	/** Number of slot changes notified, waiters compare it */
+	unsigned long     SlotChanges;
+	/** Slot status as of SlotChanges == CachedChanges, -1 if unknown, see RDR_SlotStatus */
+	int               CachedStatus;
+	unsigned long     CachedChanges;
 
 	CTModFunc_t       CTModFunc; /* response */
 
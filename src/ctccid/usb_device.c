@@ -34,10 +34,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include <libusb-1.0/libusb.h>
 
 #include "usb_device.h"
+#include <common/mutex.h>
+#include <common/trace.h>
 
 #ifdef DEBUG
 
@@ -108,11 +112,373 @@ static libusb_context *context = NULL;
  */
 static int refcnt = 0;
 
+/*
+ * Protects context, refcnt and the start and stop of the event thread in USB_Init and
+ * USB_Release, which are reached from CT_init as well as from USB_ListPorts, USB_SlotCount
+ * and USB_AddHotplugListener without the CT-API lock
+ */
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * All transfers are submitted asynchronously and completed by a dedicated event thread,
+ * so requests to different readers are in flight at the same time without one event loop
+ * per calling thread. USB_Write and USB_Read wait for the completion of their transfer.
+ * Each transfer has its own condition variable, a completion only wakes the thread
+ * waiting for it, not the threads of all other readers.
+ */
+struct usb_transfer {
+	struct libusb_transfer *transfer;
+	usb_callback_t callback;
+	void *arg;
+	pthread_mutex_t lock;	/* without callback only */
+	pthread_cond_t cond;
+	int done;
+};
+
+/*
+ * The interrupt in transfer is submitted again by its completion until USB_StopInterrupt
+ */
+#define USB_INTERRUPT_SIZE 64
+
+struct usb_interrupt {
+	struct libusb_transfer *transfer;
+	usb_message_t callback;
+	void *arg;
+	pthread_mutex_t lock;	/* protects stop and done */
+	pthread_cond_t cond;
+	int stop;
+	int done;
+	unsigned char buffer[USB_INTERRUPT_SIZE];
+};
+
+static pthread_t event_thread;
+static volatile int event_stop;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000100)
+#define USB_HOTPLUG
+#endif
+
+#ifdef USB_HOTPLUG
+/*
+ * Registry of the attached readers, maintained by the hotplug callback. The port number
+ * is the index in the registry. USB_Open takes the device from the registry instead of
+ * enumerating the bus, USB_Close leaves the handle and configuration descriptor in the
+ * registry for the next USB_Open. Without hotplug support (e.g. libusb on Windows) the
+ * bus is enumerated on every USB_Open.
+ */
+#define USB_MAX_READERS 64
+#define USB_MAX_LISTENERS 8
+
+static struct {
+	libusb_device *dev;                       /* NULL for a free port */
+	libusb_device_handle *handle;             /* cached while not opened */
+	struct libusb_config_descriptor *config;  /* cached while not opened */
+} registry[USB_MAX_READERS];
+
+static struct {
+	usb_hotplug_t listener;
+	void *arg;
+} listeners[USB_MAX_LISTENERS];
+
+static int hotplug_registered = 0;
+static libusb_hotplug_callback_handle hotplug_handle;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t listener_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+
+/*
+ * Handle the libusb events until the last device is closed
+ */
+static void *USB_EventThread(void *arg)
+{
+	while (!event_stop) {
+		struct timeval tv = { 0, 100000 };	/* check event_stop at least every 100 ms */
+		libusb_handle_events_timeout_completed(context, &tv, NULL);
+	}
+	return NULL;
+}
+
+
+
+#ifdef USB_HOTPLUG
+/*
+ * Hotplug event, called from the event thread and during the initial enumeration
+ * by libusb_hotplug_register_callback. An attached reader takes the first free
+ * port, so the initial enumeration assigns the ports in bus order like USB_Scan,
+ * and keeps it until it is detached.
+ */
+static int LIBUSB_CALL USB_Hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	int pn, i;
+
+	pthread_mutex_lock(&registry_lock);
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		for (pn = 0; pn < USB_MAX_READERS && registry[pn].dev; pn++)
+			;
+
+		if (pn < USB_MAX_READERS) {
+			registry[pn].dev = libusb_ref_device(dev);
+		}
+	} else {
+		for (pn = 0; pn < USB_MAX_READERS && registry[pn].dev != dev; pn++)
+			;
+
+		if (pn < USB_MAX_READERS) {
+			/* an open device keeps its own reference and handle until USB_Close */
+			if (registry[pn].config) {
+				libusb_free_config_descriptor(registry[pn].config);
+			}
+
+			if (registry[pn].handle) {
+				libusb_close(registry[pn].handle);
+			}
+
+			libusb_unref_device(registry[pn].dev);
+			memset(&registry[pn], 0, sizeof(registry[pn]));
+		}
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+
+	if (pn == USB_MAX_READERS) {
+		return 0;
+	}
+
+#ifdef DEBUG
+	ctccid_debug("Reader %s at port %i\n", event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? "attached" : "detached", pn);
+#endif
+
+	pthread_mutex_lock(&listener_lock);
+
+	for (i = 0; i < USB_MAX_LISTENERS; i++) {
+		if (listeners[i].listener) {
+			listeners[i].listener(pn, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, listeners[i].arg);
+		}
+	}
+
+	pthread_mutex_unlock(&listener_lock);
+
+	return 0;
+}
+#endif
+
+
+
+/*
+ * Drop a reference to the context, the last one stops the event thread and releases the context
+ */
+static void USB_Release(void)
+{
+	pthread_mutex_lock(&context_lock);
+
+	refcnt--;
+	if (refcnt == 0) {
+		event_stop = 1;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+		libusb_interrupt_event_handler(context);
+#endif
+		pthread_join(event_thread, NULL);
+		libusb_exit(context);
+		context = NULL;
+	}
+
+	pthread_mutex_unlock(&context_lock);
+}
+
+
+
+/*
+ * Completion of a transfer, called in the event thread
+ */
+static void LIBUSB_CALL USB_Completed(struct libusb_transfer *transfer)
+{
+	usb_transfer_t *xfer = (usb_transfer_t *)transfer->user_data;
+
+	if (xfer->callback) {
+		xfer->callback(xfer, transfer->status == LIBUSB_TRANSFER_COMPLETED ? USB_OK : ERR_USB,
+				transfer->actual_length, xfer->arg);
+		libusb_free_transfer(transfer);
+		free(xfer);
+		return;
+	}
+
+	pthread_mutex_lock(&xfer->lock);
+	xfer->done = 1;
+	pthread_cond_signal(&xfer->cond);
+	pthread_mutex_unlock(&xfer->lock);
+}
+
+
+
+/*
+ * Initialize the context and the event thread on first use and take a reference
+ */
+static int USB_Init(void)
+{
+	int rc;
+
+	/*
+	 * We implement our own context handling to avoid a bug in the default context implementation
+	 * of the libusbx library version <= 1.0.15
+	 *
+	 * See https://github.com/libusbx/libusbx/commit/ce75e9af3f9242ec328b0dc2336b69ff24287a3c#libusb/core.c
+	 */
+	pthread_mutex_lock(&context_lock);
+
+	if (!context) {
+		rc = libusb_init(&context);
+
+		if (rc != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+			ctccid_debug("libusb_init failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+			context = NULL;
+			pthread_mutex_unlock(&context_lock);
+			return ERR_USB;
+		}
+
+		event_stop = 0;
+		if (pthread_create(&event_thread, NULL, USB_EventThread, NULL) != 0) {
+#ifdef DEBUG
+			ctccid_debug("pthread_create failed for the USB event thread\n");
+#endif
+			libusb_exit(context);
+			context = NULL;
+			pthread_mutex_unlock(&context_lock);
+			return ERR_USB;
+		}
+	}
+
+	refcnt++;
+
+#ifdef DEBUG
+	libusb_set_debug(context, 3);
+#endif
+
+#ifdef USB_HOTPLUG
+	if (!hotplug_registered && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		/* the initial enumeration calls USB_Hotplug for the readers already attached */
+		rc = libusb_hotplug_register_callback(context,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_ENUMERATE, SCM_VENDOR_ID, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+				USB_Hotplug, NULL, &hotplug_handle);
+
+		if (rc == LIBUSB_SUCCESS) {
+			hotplug_registered = 1;
+			refcnt++; /* the registry keeps the context and the event thread */
+		}
+#ifdef DEBUG
+		else {
+			ctccid_debug("libusb_hotplug_register_callback failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+		}
+#endif
+	}
+#endif
+
+	pthread_mutex_unlock(&context_lock);
+
+	return USB_OK;
+}
+
+
+
+/*
+ * Enumerate the bus for the readers, the port number is the index among the readers found.
+ * Used without hotplug support. Returns the number of readers, the device at port pn is
+ * returned referenced in *dev if dev is not NULL.
+ */
+static int USB_Scan(unsigned short pn, libusb_device **dev)
+{
+	libusb_device **devs;
+	int rc, cnt, i;
+
+	if (dev) {
+		*dev = NULL;
+	}
+
+	cnt = (int)libusb_get_device_list(context, &devs);
+
+	if (cnt < 0) {
+		return ERR_NO_READER;
+	}
+
+	/* Iterate through all devices to find a reader */
+	cnt = 0;
+
+	for (i = 0; devs[i] != NULL; i++) {
+		struct libusb_device_descriptor desc;
+
+		rc = libusb_get_device_descriptor(devs[i], &desc);
+
+		if (rc < 0 || desc.idVendor != SCM_VENDOR_ID) {
+			continue;
+		}
+
+#ifdef DEBUG
+		if ((desc.idProduct == SCM_SCR_35XX_DEVICE_ID_1) || (desc.idProduct == SCM_SCR_35XX_DEVICE_ID_2)) {
+			ctccid_debug("Found reader SCR_35XX (%04X:%04X)\n", desc.idVendor,
+				   desc.idProduct);
+		}
+
+		if (desc.idProduct == SCM_SCR_3310_DEVICE_ID) {
+			ctccid_debug("Found reader SCR_3310 (%04X:%04X)\n", desc.idVendor,
+				   desc.idProduct);
+		}
+#endif
+
+		/*
+		 * Found the desired reader?
+		 */
+		if (dev && cnt == pn) {
+#ifdef DEBUG
+			ctccid_debug("Reader index (%i) and requested port number (%i) match.\n", cnt, pn);
+#endif
+			*dev = libusb_ref_device(devs[i]);
+		}
+
+		cnt++;
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	return cnt;
+}
+
+
+
+/*
+ * Release the resources of a device that is not or no longer opened
+ */
+static void USB_Free(usb_device_t *device)
+{
+	if (device->configuration_descriptor) {
+		libusb_free_config_descriptor(device->configuration_descriptor);
+	}
+
+	if (device->handle) {
+		libusb_close(device->handle);
+	}
+
+	if (device->dev) {
+		libusb_unref_device(device->dev);
+	}
+
+	free(device->posted_buffer);
+	free(device);
+}
+
 
 
 /**
  * Open USB device at the specified port and allocate necessary resources
  *
+ * With hotplug support the device is taken from the reader registry, the handle
+ * and configuration descriptor of a previous open are reused. Otherwise the bus is
+ * enumerated and the port number is the index among the readers found.
+ *
  * @param pn Port number
  * @param device Structure holding device specific data
  * @return Status code \ref USB_OK, \ref ERR_NO_READER, \ref ERR_USB
@@ -120,242 +486,596 @@ static int refcnt = 0;
 int USB_Open(unsigned short pn, usb_device_t **device)
 {
 
-	int rc, cnt, i;
-	libusb_device **devs, *dev;
+	int rc, i;
+	libusb_device *dev = NULL;
+	usb_device_t *dv;
+
+	rc = USB_Init();
+
+	if (rc != USB_OK) {
+		return rc;
+	}
+
+	dv = calloc(1, sizeof(usb_device_t));
+
+	if (dv == NULL) {
+		USB_Release();
+		return ERR_USB;
+	}
+
+#ifdef USB_HOTPLUG
+	if (hotplug_registered) {
+		pthread_mutex_lock(&registry_lock);
+
+		if (pn < USB_MAX_READERS && registry[pn].dev) {
+			dev = libusb_ref_device(registry[pn].dev);
+			dv->handle = registry[pn].handle;
+			dv->configuration_descriptor = registry[pn].config;
+			registry[pn].handle = NULL;
+			registry[pn].config = NULL;
+		}
+
+		pthread_mutex_unlock(&registry_lock);
+	} else
+#endif
+	{
+		USB_Scan(pn, &dev);
+	}
+
+	if (dev == NULL) { /* no reader found */
+		USB_Free(dv);
+		USB_Release();
+		return ERR_NO_READER;
+	}
+
+	dv->dev = dev;
+	dv->pn = pn;
+
+	if (dv->handle == NULL) {
+		rc = libusb_open(dev, &(dv->handle));
+
+		if (rc != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+			ctccid_debug("libusb_open failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+			dv->handle = NULL;
+			USB_Free(dv);
+			USB_Release();
+			return ERR_USB;
+		}
+	}
+
+	if (dv->configuration_descriptor == NULL) {
+		rc = libusb_get_active_config_descriptor(dev, &(dv->configuration_descriptor));
+
+		if (rc != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+			ctccid_debug("libusb_get_active_config_descriptor failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+			dv->configuration_descriptor = NULL;
+			USB_Free(dv);
+			USB_Release();
+			return ERR_USB;
+		}
+	}
+
+	rc = libusb_claim_interface(dv->handle, dv->configuration_descriptor->interface->altsetting->bInterfaceNumber);
+
+	if (rc != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+		ctccid_debug("libusb_claim_interface failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+		USB_Free(dv);
+		USB_Release();
+		return ERR_USB;
+	}
 
 	/*
-	 * We implement our own context handling to avoid a bug in the default context implementation
-	 * of the libusbx library version <= 1.0.15
-	 *
-	 * See https://github.com/libusbx/libusbx/commit/ce75e9af3f9242ec328b0dc2336b69ff24287a3c#libusb/core.c
+	 * Search for the bulk in/out endpoints
 	 */
-	if (!context) {
-		rc = libusb_init(&context);
+	for (i = 0; i < dv->configuration_descriptor->interface->altsetting->bNumEndpoints; i++) {
+
+		uint8_t bEndpointAddress;
+
+		if (dv->configuration_descriptor->interface->altsetting->endpoint[i].bmAttributes
+				== LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+			/*
+			 * Interrupt endpoint for RDR_to_PC_NotifySlotChange, see USB_StartInterrupt
+			 */
+			bEndpointAddress = dv->configuration_descriptor->interface->altsetting->endpoint[i].bEndpointAddress;
+
+			if ((bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+				dv->interrupt_in = bEndpointAddress;
+			}
+			continue;
+		}
+
+		if ((dv->configuration_descriptor->interface->altsetting->endpoint[i].bmAttributes
+				& LIBUSB_TRANSFER_TYPE_BULK) != LIBUSB_TRANSFER_TYPE_BULK) {
+			/*
+			 * No bulk endpoint - try the next one
+			 */
+			continue;
+		}
+
+		bEndpointAddress = dv->configuration_descriptor->interface->altsetting->endpoint[i].bEndpointAddress;
+
+		if ((bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+			dv->bulk_in = bEndpointAddress;
+		}
+
+		if ((bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+			dv->bulk_out = bEndpointAddress;
+		}
+	}
+
+	*device = dv;
+
+	return USB_OK;
+}
+
+
+
+/**
+ * List the port numbers of the readers attached
+ *
+ * @param ports Array receiving the port numbers in ascending order
+ * @param max Size of the array
+ * @return Number of readers attached (may exceed max), \ref ERR_USB
+ */
+int USB_ListPorts(unsigned short *ports, int max)
+{
+	int rc, cnt = 0, i;
+
+	rc = USB_Init();
+
+	if (rc != USB_OK) {
+		return rc;
+	}
+
+#ifdef USB_HOTPLUG
+	if (hotplug_registered) {
+		pthread_mutex_lock(&registry_lock);
+
+		for (i = 0; i < USB_MAX_READERS; i++) {
+			if (registry[i].dev) {
+				if (cnt < max) {
+					ports[cnt] = i;
+				}
+				cnt++;
+			}
+		}
+
+		pthread_mutex_unlock(&registry_lock);
+	} else
+#endif
+	{
+		cnt = USB_Scan(0, NULL);
+
+		for (i = 0; i < cnt && i < max; i++) {
+			ports[i] = i;
+		}
+	}
+
+	USB_Release();
+
+	return cnt < 0 ? 0 : cnt;
+}
+
+
+
+/*
+ * Slots of the reader in bMaxSlotCount of the CCID descriptor of the configuration
+ */
+static int SlotCount(struct libusb_config_descriptor const *config)
+{
+	if (config->bNumInterfaces < 1 || config->interface->num_altsetting < 1
+		|| config->interface->altsetting->extra_length != 54) {
+		return 1;
+	}
+
+	return config->interface->altsetting->extra[4] + 1;
+}
+
+
+
+/**
+ * Number of slots of the reader at the port, without opening the reader
+ *
+ * @param pn Port number
+ * @return Number of slots, 1 if the reader has no CCID descriptor or is not found
+ */
+int USB_SlotCount(unsigned short pn)
+{
+	struct libusb_config_descriptor *config;
+	libusb_device *dev = NULL;
+	int slots = 1;
+
+	if (USB_Init() != USB_OK) {
+		return 1;
+	}
+
+#ifdef USB_HOTPLUG
+	if (hotplug_registered) {
+		pthread_mutex_lock(&registry_lock);
+
+		if (pn < USB_MAX_READERS && registry[pn].dev) {
+			if (registry[pn].config) {
+				slots = SlotCount(registry[pn].config);
+			} else {
+				dev = libusb_ref_device(registry[pn].dev);
+			}
+		}
+
+		pthread_mutex_unlock(&registry_lock);
+	} else
+#endif
+	{
+		USB_Scan(pn, &dev);
+	}
+
+	if (dev) {
+		if (libusb_get_active_config_descriptor(dev, &config) == LIBUSB_SUCCESS) {
+			slots = SlotCount(config);
+			libusb_free_config_descriptor(config);
+		}
+
+		libusb_unref_device(dev);
+	}
+
+	USB_Release();
+
+	return slots;
+}
+
+
+
+/**
+ * Add a listener for readers attached or detached
+ *
+ * The listener is called from the event thread with the port number and a nonzero attached
+ * for a new reader, zero for a reader removed. It must not block and must not exchange data
+ * with a reader, the transfers are completed by the same thread.
+ *
+ * @param listener Function to call
+ * @param arg Argument passed to the listener
+ * @return Status code \ref USB_OK, \ref ERR_USB without hotplug support or too many listeners
+ */
+int USB_AddHotplugListener(usb_hotplug_t listener, void *arg)
+{
+#ifdef USB_HOTPLUG
+	int rc, i;
+
+	rc = USB_Init();
+
+	if (rc != USB_OK) {
+		return rc;
+	}
+
+	rc = ERR_USB;
+
+	if (hotplug_registered) {
+		pthread_mutex_lock(&listener_lock);
+
+		for (i = 0; i < USB_MAX_LISTENERS && listeners[i].listener; i++)
+			;
+
+		if (i < USB_MAX_LISTENERS) {
+			listeners[i].listener = listener;
+			listeners[i].arg = arg;
+			rc = USB_OK;
+		}
+
+		pthread_mutex_unlock(&listener_lock);
+	}
+
+	USB_Release();
+
+	return rc;
+#else
+	return ERR_USB;
+#endif
+}
+
+
+
+/**
+ * Remove a listener added with \ref USB_AddHotplugListener. The listener is not running and
+ * not called again after the function returned.
+ *
+ * @param listener Function passed to \ref USB_AddHotplugListener
+ * @param arg Argument passed to \ref USB_AddHotplugListener
+ */
+void USB_RemoveHotplugListener(usb_hotplug_t listener, void *arg)
+{
+#ifdef USB_HOTPLUG
+	int i;
+
+	pthread_mutex_lock(&listener_lock);
+
+	for (i = 0; i < USB_MAX_LISTENERS; i++) {
+		if (listeners[i].listener == listener && listeners[i].arg == arg) {
+			listeners[i].listener = NULL;
+			listeners[i].arg = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&listener_lock);
+#endif
+}
+
+
+
+/**
+ * Return the 54 byte CCID Descriptor
+ *
+ * @param device Structure with device specific data
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+void USB_GetCCIDDescriptor(usb_device_t *device, unsigned char const **desc, int *length)
+{
+	if (length)
+		*length = device->configuration_descriptor->interface->altsetting->extra_length;
+	if (desc)
+		*desc = device->configuration_descriptor->interface->altsetting->extra;
+}
+
+
+
+/**
+ * Issue a class specific request to the CCID interface and read the returned data
+ *
+ * @param device Structure with device specific data
+ * @param request bRequest, e.g. GET_DATA_RATES
+ * @param length Size of the buffer on entry, number of bytes returned on exit
+ * @param buffer Buffer for the returned data
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+int USB_ControlIn(usb_device_t *device, unsigned char request, unsigned int *length, unsigned char *buffer)
+{
+	int rc;
+
+	rc = libusb_control_transfer(device->handle,
+			LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, request, 0,
+			device->configuration_descriptor->interface->altsetting->bInterfaceNumber,
+			buffer, (uint16_t)*length, USB_READ_TIMEOUT);
+
+	if (rc < 0) {
+#ifdef DEBUG
+		ctccid_debug("libusb_control_transfer failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+		return ERR_USB;
+	}
+
+	*length = rc;
+
+	return USB_OK;
+}
+
+
+
+/**
+ * Close USB device and free allocated resources
+ *
+ * @param device Structure with device specific data
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+int USB_Close(usb_device_t **device)
+{
 
-		if (rc != LIBUSB_SUCCESS) {
-#ifdef DEBUG
-			ctccid_debug("libusb_init failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
-#endif
-			return ERR_USB;
-		}
+	int rc;
+
+	USB_StopInterrupt(*device);
+
+	if ((*device)->posted_read) {
+		USB_Cancel((*device)->posted_read);
+		(*device)->posted_read = NULL;
 	}
 
-	refcnt++;
+	rc = libusb_release_interface((*device)->handle,
+								  (*device)->configuration_descriptor->interface->altsetting->bInterfaceNumber);
 
+	if (rc != LIBUSB_SUCCESS) {
 #ifdef DEBUG
-	libusb_set_debug(context, 3);
+		ctccid_debug("libusb_release_interface failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
 #endif
+		return ERR_USB;
+	}
 
-	cnt = (int)libusb_get_device_list(context, &devs);
+#ifdef USB_HOTPLUG
+	/* keep handle and descriptor for the next USB_Open while the reader is attached */
+	pthread_mutex_lock(&registry_lock);
 
-	if (cnt < 0) {
-		refcnt--;
-		return ERR_NO_READER;
+	if (hotplug_registered && (*device)->pn < USB_MAX_READERS
+		&& registry[(*device)->pn].dev == (*device)->dev && registry[(*device)->pn].handle == NULL) {
+		registry[(*device)->pn].handle = (*device)->handle;
+		registry[(*device)->pn].config = (*device)->configuration_descriptor;
+		(*device)->handle = NULL;
+		(*device)->configuration_descriptor = NULL;
 	}
 
-	/* Iterate through all devices to find a reader */
-	i = 0;
-	cnt = 0;
+	pthread_mutex_unlock(&registry_lock);
+#endif
 
-	while ((dev = devs[i++]) != NULL ) {
-		struct libusb_device_descriptor desc;
+	USB_Free(*device);
+	*device = NULL;
 
-		rc = libusb_get_device_descriptor(dev, &desc);
+	USB_Release();
 
-		if (rc < 0) {
-			/* error */
-			continue;
-		}
+	return USB_OK;
+}
 
-		if (desc.idVendor == SCM_VENDOR_ID) {
 
-#ifdef DEBUG
 
-			if ((desc.idProduct == SCM_SCR_35XX_DEVICE_ID_1) || (desc.idProduct == SCM_SCR_35XX_DEVICE_ID_2)) {
-				ctccid_debug("Found reader SCR_35XX (%04X:%04X)\n", desc.idVendor,
-					   desc.idProduct);
-			}
+/**
+ * Submit an asynchronous bulk transfer with the specified timeout in ms, see \ref USB_Submit
+ */
+static int SubmitTransfer(usb_device_t *device, int in, unsigned int length, unsigned char *buffer,
+		usb_callback_t callback, void *arg, unsigned int timeout, usb_transfer_t **transfer)
+{
+	usb_transfer_t *xfer;
+	int rc;
 
-			if (desc.idProduct == SCM_SCR_3310_DEVICE_ID) {
-				ctccid_debug("Found reader SCR_3310 (%04X:%04X)\n", desc.idVendor,
-					   desc.idProduct);
-			}
+	xfer = calloc(1, sizeof(usb_transfer_t));
 
-#endif
+	if (xfer == NULL) {
+		return ERR_USB;
+	}
 
-			/*
-			 * Found the desired reader?
-			 */
-			if (cnt == pn) {
-#ifdef DEBUG
-				ctccid_debug("Reader index (%i) and requested port number (%i) match.\n", cnt, pn);
-#endif
-				*device = calloc(1, sizeof(usb_device_t));
-				break;
-			} else {
-#ifdef DEBUG
-				ctccid_debug("Reader index (%i) and requested port number (%i) do not match.\n", cnt, pn);
-#endif
-				cnt++;
-			}
-		}
+	xfer->transfer = libusb_alloc_transfer(0);
+
+	if (xfer->transfer == NULL) {
+		free(xfer);
+		return ERR_USB;
 	}
 
-	if (dev != NULL ) { /* reader found */
-		rc = libusb_open(dev, &((*device)->handle));
+	xfer->callback = callback;
+	xfer->arg = arg;
 
-		if (rc != LIBUSB_SUCCESS) {
-#ifdef DEBUG
-			ctccid_debug("libusb_open failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
-#endif
-			free(*device);
-			libusb_free_device_list(devs, 1);
-			refcnt--;
-			if (refcnt == 0) {
-				libusb_exit(context);
-				context = NULL;
-			}
-			return ERR_USB;
-		}
+	if (callback == NULL) {
+		pthread_mutex_init(&xfer->lock, NULL);
+		pthread_cond_init(&xfer->cond, NULL);
+	}
 
-		rc = libusb_get_active_config_descriptor(dev, &((*device)->configuration_descriptor));
+	libusb_fill_bulk_transfer(xfer->transfer, device->handle, in ? device->bulk_in : device->bulk_out,
+			buffer, length, USB_Completed, xfer, timeout);
 
-		if (rc != LIBUSB_SUCCESS) {
-#ifdef DEBUG
-			ctccid_debug("libusb_get_active_config_descriptor failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
-#endif
-			libusb_close((*device)->handle);
-			free(*device);
-			libusb_free_device_list(devs, 1);
-			refcnt--;
-			if (refcnt == 0) {
-				libusb_exit(context);
-				context = NULL;
-			}
-			return ERR_USB;
-		}
+	if (transfer) {
+		*transfer = xfer;
+	}
 
-		rc = libusb_claim_interface((*device)->handle, (*device)->configuration_descriptor->interface->altsetting->bInterfaceNumber);
+	rc = libusb_submit_transfer(xfer->transfer);
 
-		if (rc != LIBUSB_SUCCESS) {
+	if (rc != LIBUSB_SUCCESS) {
 #ifdef DEBUG
-			ctccid_debug("libusb_claim_interface failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+		ctccid_debug("libusb_submit_transfer (%s) failed. rc = %i (%s)\n", in ? "read" : "write", rc, libusb_error_to_string(rc));
 #endif
-			libusb_close((*device)->handle);
-			free(*device);
-			libusb_free_device_list(devs, 1);
-			refcnt--;
-			if (refcnt == 0) {
-				libusb_exit(context);
-				context = NULL;
-			}
-			return ERR_USB;
+		if (transfer) {
+			*transfer = NULL;
 		}
+		if (callback == NULL) {
+			pthread_cond_destroy(&xfer->cond);
+			pthread_mutex_destroy(&xfer->lock);
+		}
+		libusb_free_transfer(xfer->transfer);
+		free(xfer);
+		return ERR_USB;
+	}
 
-		/*
-		 * Search for the bulk in/out endpoints
-		 */
-		for (i = 0; i < (*device)->configuration_descriptor->interface->altsetting->bNumEndpoints; i++) {
-
-			uint8_t bEndpointAddress;
+	return USB_OK;
+}
 
-			if ((*device)->configuration_descriptor->interface->altsetting->endpoint[i].bmAttributes
-					== LIBUSB_TRANSFER_TYPE_INTERRUPT) {
-				/*
-				 * Ignore the interrupt endpoint
-				 */
-				continue;
-			}
 
-			if (((*device)->configuration_descriptor->interface->altsetting->endpoint[i].bmAttributes
-					& LIBUSB_TRANSFER_TYPE_BULK) != LIBUSB_TRANSFER_TYPE_BULK) {
-				/*
-				 * No bulk endpoint - try the next one
-				 */
-				continue;
-			}
 
-			bEndpointAddress = (*device)->configuration_descriptor->interface->altsetting->endpoint[i].bEndpointAddress;
+/**
+ * Submit an asynchronous bulk transfer
+ *
+ * Without callback the transfer must be completed with \ref USB_Wait, which also releases it.
+ * With callback the callback is called on completion and the transfer is released afterwards.
+ *
+ * @param device Device specific data
+ * @param in Nonzero for bulk in (read), zero for bulk out (write)
+ * @param length Length of data to write/size of the data buffer
+ * @param buffer Data buffer, must stay valid until the transfer is complete
+ * @param callback Completion callback or NULL
+ * @param arg Argument passed to the callback
+ * @param transfer The transfer for \ref USB_Wait or \ref USB_Cancel, may be NULL with callback
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+int USB_Submit(usb_device_t *device, int in, unsigned int length, unsigned char *buffer,
+		usb_callback_t callback, void *arg, usb_transfer_t **transfer)
+{
+	return SubmitTransfer(device, in, length, buffer, callback, arg,
+			in ? USB_READ_TIMEOUT : USB_WRITE_TIMEOUT, transfer);
+}
 
-			if ((bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
-				(*device)->bulk_in = bEndpointAddress;
-			}
 
-			if ((bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
-				(*device)->bulk_out = bEndpointAddress;
-			}
-		}
 
-		rc = USB_OK;
+/**
+ * Wait for the completion of a transfer submitted without callback and release it
+ *
+ * @param transfer The transfer returned by \ref USB_Submit
+ * @param length Number of bytes transferred, may be NULL
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+int USB_Wait(usb_transfer_t *transfer, unsigned int *length)
+{
+	int rc;
 
-	} else { /* no reader found */
-		rc = ERR_NO_READER;
+	pthread_mutex_lock(&transfer->lock);
+	while (!transfer->done) {
+		pthread_cond_wait(&transfer->cond, &transfer->lock);
 	}
+	pthread_mutex_unlock(&transfer->lock);
 
-	libusb_free_device_list(devs, 1);
+	pthread_cond_destroy(&transfer->cond);
+	pthread_mutex_destroy(&transfer->lock);
 
-	if (rc == ERR_NO_READER) {
-		refcnt--;
-		if (refcnt == 0) {
-			libusb_exit(context);
-			context = NULL;
-		}
+	rc = USB_OK;
+
+	if (transfer->transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+#ifdef DEBUG
+		ctccid_debug("bulk transfer failed. status = %i\n", transfer->transfer->status);
+#endif
+		rc = ERR_USB;
+	}
+
+	if (length) {
+		*length = transfer->transfer->actual_length;
 	}
 
+	libusb_free_transfer(transfer->transfer);
+	free(transfer);
+
 	return rc;
 }
 
 
 
 /**
- * Return the 54 byte CCID Descriptor
+ * Cancel a transfer submitted without callback, wait for its completion and release it
  *
- * @param device Structure with device specific data
- * @return Status code \ref USB_OK, \ref ERR_USB
+ * @param transfer The transfer returned by \ref USB_Submit
  */
-void USB_GetCCIDDescriptor(usb_device_t *device, unsigned char const **desc, int *length)
+void USB_Cancel(usb_transfer_t *transfer)
 {
-	if (length)
-		*length = device->configuration_descriptor->interface->altsetting->extra_length;
-	if (desc)
-		*desc = device->configuration_descriptor->interface->altsetting->extra;
+	libusb_cancel_transfer(transfer->transfer);
+	USB_Wait(transfer, NULL);
 }
 
 
 
 /**
- * Close USB device and free allocated resources
+ * Post the bulk in transfer for the response to the next command before the command is written,
+ * so the reader can deliver the response as soon as it is available. The next \ref USB_Read
+ * completes the posted transfer.
  *
- * @param device Structure with device specific data
+ * The timeout starts with the post and covers the command, the processing by the card
+ * and the response, see RDR_ResponseTimeout.
+ *
+ * @param device Device specific data
+ * @param length Maximum length of the response
+ * @param timeout Timeout in ms
  * @return Status code \ref USB_OK, \ref ERR_USB
  */
-int USB_Close(usb_device_t **device)
+int USB_PostRead(usb_device_t *device, unsigned int length, unsigned int timeout)
 {
-
-	int rc;
-
-	rc = libusb_release_interface((*device)->handle,
-								  (*device)->configuration_descriptor->interface->altsetting->bInterfaceNumber);
-
-	if (rc != LIBUSB_SUCCESS) {
-#ifdef DEBUG
-		ctccid_debug("libusb_release_interface failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
-#endif
-		return ERR_USB;
+	if (device->posted_read) {
+		return USB_OK;
 	}
 
-	libusb_free_config_descriptor((*device)->configuration_descriptor);
-	libusb_close((*device)->handle);
-	free(*device);
-	*device = NULL;
+	if (device->posted_size < length) {
+		unsigned char *buffer = realloc(device->posted_buffer, length);
 
-	refcnt--;
-	if (refcnt == 0) {
-		libusb_exit(context);
-		context = NULL;
+		if (buffer == NULL) {
+			return ERR_USB;
+		}
+
+		device->posted_buffer = buffer;
+		device->posted_size = length;
 	}
 
-	return USB_OK;
+	return SubmitTransfer(device, 1, length, device->posted_buffer, NULL, NULL, timeout, &device->posted_read);
 }
 
 
@@ -370,15 +1090,32 @@ int USB_Close(usb_device_t **device)
  */
 int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer)
 {
+	usb_transfer_t *xfer;
+	unsigned int send = 0;
+	uint64_t start = trace_now();
 	int rc;
-	int send;
 
-	rc = libusb_bulk_transfer(device->handle, device->bulk_out, buffer, length, &send, USB_WRITE_TIMEOUT);
+	rc = USB_Submit(device, 0, length, buffer, NULL, NULL, &xfer);
+
+	if (rc == USB_OK) {
+		rc = USB_Wait(xfer, &send);
+	}
+
+	start = (trace_now() - start) / 1000;
+	InterlockedIncrement(&device->transfers);
+	device->write_us += start;
+
+	TRACE(TRACE_USB_WRITE, length ? buffer[0] : 0, send, rc, start);
 
-	if (rc != LIBUSB_SUCCESS || (send != length)) {
+	if (rc != USB_OK || (send != length)) {
 #ifdef DEBUG
-		ctccid_debug("libusb_bulk_transfer (write) failed. rc = %i (%s), send=%i, length=%i\n", rc, libusb_error_to_string(rc), send, length);
+		ctccid_debug("bulk transfer (write) failed. rc = %i, send=%i, length=%i\n", rc, send, length);
 #endif
+		/* No response will follow */
+		if (device->posted_read) {
+			USB_Cancel(device->posted_read);
+			device->posted_read = NULL;
+		}
 		return ERR_USB;
 	}
 
@@ -389,6 +1126,7 @@ int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer)
 
 /**
  * Read data block from specified USB device using bulk transfer
+ * or complete the transfer posted by \ref USB_PostRead
  *
  * @param device Device specific data
  * @param length Length of data buffer
@@ -397,15 +1135,43 @@ int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer)
  */
 int USB_Read(usb_device_t *device, unsigned int *length, unsigned char *buffer)
 {
+	usb_transfer_t *xfer;
+	unsigned int read = 0;
+	uint64_t start = trace_now();
 	int rc;
-	int read;
 
-	rc = libusb_bulk_transfer(device->handle, device->bulk_in, buffer, *length, &read, USB_READ_TIMEOUT);
+	if (device->posted_read) {
+		rc = USB_Wait(device->posted_read, &read);
+		device->posted_read = NULL;
 
-	if (rc != LIBUSB_SUCCESS) {
+		if (rc == USB_OK && read > *length) {
+#ifdef DEBUG
+			ctccid_debug("posted read of %i bytes exceeds the buffer of %i bytes\n", read, *length);
+#endif
+			rc = ERR_USB;
+		}
+
+		if (rc == USB_OK) {
+			memcpy(buffer, device->posted_buffer, read);
+		}
+	} else {
+		rc = USB_Submit(device, 1, *length, buffer, NULL, NULL, &xfer);
+
+		if (rc == USB_OK) {
+			rc = USB_Wait(xfer, &read);
+		}
+	}
+
+	start = (trace_now() - start) / 1000;
+	InterlockedIncrement(&device->transfers);
+	device->read_us += start;
+
+	TRACE(TRACE_USB_READ, read && rc == USB_OK ? buffer[0] : 0, read, read >= 10 && rc == USB_OK ? buffer[7] : 0, start);
+
+	if (rc != USB_OK) {
 		*length = 0;
 #ifdef DEBUG
-		ctccid_debug("libusb_bulk_transfer (read) failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+		ctccid_debug("bulk transfer (read) failed. rc = %i\n", rc);
 #endif
 		return ERR_USB;
 	}
@@ -414,3 +1180,185 @@ int USB_Read(usb_device_t *device, unsigned int *length, unsigned char *buffer)
 
 	return USB_OK;
 }
+
+
+
+/**
+ * Read the next data block from the specified USB device with its own bulk transfer, not
+ * the one posted by \ref USB_PostRead. Used for the responses of a multi-slot reader,
+ * which arrive for any of its slots.
+ *
+ * @param device Device specific data
+ * @param length Length of data buffer on entry, number of bytes read on exit
+ * @param buffer Data buffer
+ * @param timeout Timeout in ms
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+int USB_ReadTimeout(usb_device_t *device, unsigned int *length, unsigned char *buffer, unsigned int timeout)
+{
+	usb_transfer_t *xfer;
+	unsigned int read = 0;
+	uint64_t start = trace_now();
+	int rc;
+
+	rc = SubmitTransfer(device, 1, *length, buffer, NULL, NULL, timeout, &xfer);
+
+	if (rc == USB_OK) {
+		rc = USB_Wait(xfer, &read);
+	}
+
+	start = (trace_now() - start) / 1000;
+	InterlockedIncrement(&device->transfers);
+	device->read_us += start;
+
+	TRACE(TRACE_USB_READ, read && rc == USB_OK ? buffer[0] : 0, read, read >= 10 && rc == USB_OK ? buffer[7] : 0, start);
+
+	if (rc != USB_OK) {
+		*length = 0;
+		return ERR_USB;
+	}
+
+	*length = read;
+
+	return USB_OK;
+}
+
+
+
+/*
+ * Completion of the interrupt in transfer, called in the event thread
+ */
+static void LIBUSB_CALL USB_InterruptCompleted(struct libusb_transfer *transfer)
+{
+	usb_interrupt_t *intr = (usb_interrupt_t *)transfer->user_data;
+	int ended;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length > 0) {
+		intr->callback(intr->buffer, transfer->actual_length, intr->arg);
+	}
+
+	pthread_mutex_lock(&intr->lock);
+
+	if (!intr->stop
+		&& (transfer->status == LIBUSB_TRANSFER_COMPLETED || transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+		&& libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
+		pthread_mutex_unlock(&intr->lock);
+		return;
+	}
+
+	ended = !intr->stop;
+	pthread_mutex_unlock(&intr->lock);
+
+	/* before done, USB_StopInterrupt waits for it */
+	if (ended) {
+#ifdef DEBUG
+		ctccid_debug("interrupt transfer ended. status = %i\n", transfer->status);
+#endif
+		intr->callback(intr->buffer, 0, intr->arg);
+	}
+
+	pthread_mutex_lock(&intr->lock);
+	intr->done = 1;
+	pthread_cond_signal(&intr->cond);
+	pthread_mutex_unlock(&intr->lock);
+}
+
+
+
+/**
+ * Listen on the interrupt in endpoint, e.g. for RDR_to_PC_NotifySlotChange
+ *
+ * The callback is called in the event thread for each message until \ref USB_StopInterrupt
+ * or \ref USB_Close, or with length 0 once if the transfer ends on its own.
+ *
+ * @param device Device specific data
+ * @param callback Function to call with each message
+ * @param arg Argument passed to the callback
+ * @return Status code \ref USB_OK, \ref ERR_USB if the reader has no interrupt in endpoint
+ */
+int USB_StartInterrupt(usb_device_t *device, usb_message_t callback, void *arg)
+{
+	usb_interrupt_t *intr;
+	int rc;
+
+	if (device->interrupt_in == 0 || device->interrupt) {
+		return ERR_USB;
+	}
+
+	intr = calloc(1, sizeof(usb_interrupt_t));
+
+	if (intr == NULL) {
+		return ERR_USB;
+	}
+
+	intr->transfer = libusb_alloc_transfer(0);
+
+	if (intr->transfer == NULL) {
+		free(intr);
+		return ERR_USB;
+	}
+
+	intr->callback = callback;
+	intr->arg = arg;
+	pthread_mutex_init(&intr->lock, NULL);
+	pthread_cond_init(&intr->cond, NULL);
+
+	/* no timeout, a message is only sent by the reader on a slot change or hardware error */
+	libusb_fill_interrupt_transfer(intr->transfer, device->handle, device->interrupt_in,
+			intr->buffer, sizeof(intr->buffer), USB_InterruptCompleted, intr, 0);
+
+	rc = libusb_submit_transfer(intr->transfer);
+
+	if (rc != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+		ctccid_debug("libusb_submit_transfer (interrupt) failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+		pthread_cond_destroy(&intr->cond);
+		pthread_mutex_destroy(&intr->lock);
+		libusb_free_transfer(intr->transfer);
+		free(intr);
+		return ERR_USB;
+	}
+
+	device->interrupt = intr;
+
+	return USB_OK;
+}
+
+
+
+/**
+ * Stop listening on the interrupt in endpoint. The callback is not running and not called
+ * again after the function returned.
+ *
+ * @param device Device specific data
+ */
+void USB_StopInterrupt(usb_device_t *device)
+{
+	usb_interrupt_t *intr = device->interrupt;
+
+	if (intr == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&intr->lock);
+
+	intr->stop = 1;
+
+	if (!intr->done) {
+		libusb_cancel_transfer(intr->transfer);
+	}
+
+	while (!intr->done) {
+		pthread_cond_wait(&intr->cond, &intr->lock);
+	}
+
+	pthread_mutex_unlock(&intr->lock);
+
+	pthread_cond_destroy(&intr->cond);
+	pthread_mutex_destroy(&intr->lock);
+	libusb_free_transfer(intr->transfer);
+	free(intr);
+
+	device->interrupt = NULL;
+}
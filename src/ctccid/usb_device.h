@@ -53,12 +53,13 @@
 #define SCM_SCR_3310_DEVICE_ID 0x5116
 
 /**
- * Timeout value for writing data
+ * Timeout value for writing data, the reader accepts a message at once unless it is wedged
  */
-#define USB_WRITE_TIMEOUT (5 * 1000)
+#define USB_WRITE_TIMEOUT (1 * 1000)
 
 /**
- * Timeout value for reading data
+ * Timeout value for reading data, except for the response to a block sent to the card
+ * (see USB_PostRead)
  */
 #define USB_READ_TIMEOUT  (3 * 1000)
 
@@ -66,6 +67,37 @@
 #define ERR_NO_READER       -1             /* Invalid parameter or value      */
 #define ERR_USB             -2             /* USB error                       */
 
+/**
+ * Asynchronous bulk transfer, see USB_Submit
+ */
+typedef struct usb_transfer usb_transfer_t;
+
+/**
+ * Completion callback of an asynchronous transfer, called from the event thread.
+ * Must not block, the transfer is released after the callback returned.
+ *
+ * rc is \ref USB_OK or \ref ERR_USB, length the number of bytes transferred
+ */
+typedef void (*usb_callback_t)(usb_transfer_t *transfer, int rc, unsigned int length, void *arg);
+
+/**
+ * Listener for readers attached (attached nonzero) or detached at port pn, called from the
+ * event thread. Must not block, see \ref USB_AddHotplugListener
+ */
+typedef void (*usb_hotplug_t)(unsigned short pn, int attached, void *arg);
+
+/**
+ * Interrupt in transfer listening for messages of the reader, see USB_StartInterrupt
+ */
+typedef struct usb_interrupt usb_interrupt_t;
+
+/**
+ * Message received on the interrupt in endpoint, called from the event thread. Length 0
+ * reports the end of the transfer (e.g. device detached), no call follows.
+ * Must not block and must not exchange data with the reader
+ */
+typedef void (*usb_message_t)(unsigned char *data, unsigned int length, void *arg);
+
 /**
  * Data structure encapsulating all information necessary
  * to perform USB communication with a device, e.g. device handles,
@@ -73,6 +105,12 @@
  */
 typedef struct usb_device {
 
+        /**
+         * Libusb device (referenced) and port number
+         */
+        struct libusb_device *dev;
+        unsigned short pn;
+
         /**
          * Libusb device handle
          */
@@ -92,13 +130,55 @@ typedef struct usb_device {
          */
         uint8_t bulk_out;
 
+        /**
+         * ID of interrupt in, 0 if the reader has none
+         */
+        uint8_t interrupt_in;
+
+        /**
+         * Interrupt in transfer started by USB_StartInterrupt, stopped by USB_Close
+         */
+        usb_interrupt_t *interrupt;
+
+        /**
+         * Bulk in transfer posted by USB_PostRead, completed by the next USB_Read
+         */
+        usb_transfer_t *posted_read;
+
+        /**
+         * Buffer of the posted read
+         */
+        unsigned char *posted_buffer;
+        unsigned int posted_size;
+
+        /**
+         * Bulk transfers of USB_Write and USB_Read and the time spent in them, shared
+         * by the slots of a multi-slot reader
+         */
+        unsigned long transfers;
+        unsigned long long write_us;
+        unsigned long long read_us;
+
 } usb_device_t;
 
 int USB_Open(unsigned short pn, usb_device_t **device);
 int USB_Close(usb_device_t **device);
+int USB_ListPorts(unsigned short *ports, int max);
+int USB_SlotCount(unsigned short pn);
+int USB_AddHotplugListener(usb_hotplug_t listener, void *arg);
+void USB_RemoveHotplugListener(usb_hotplug_t listener, void *arg);
 void USB_GetCCIDDescriptor(usb_device_t *device, unsigned char const **desc, int *length);
+int USB_ControlIn(usb_device_t *device, unsigned char request, unsigned int *length, unsigned char *buffer);
 int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer);
 int USB_Read(usb_device_t *device, unsigned int *length, unsigned char *buffer);
+int USB_PostRead(usb_device_t *device, unsigned int length, unsigned int timeout);
+int USB_ReadTimeout(usb_device_t *device, unsigned int *length, unsigned char *buffer, unsigned int timeout);
+int USB_Submit(usb_device_t *device, int in, unsigned int length, unsigned char *buffer,
+		usb_callback_t callback, void *arg, usb_transfer_t **transfer);
+int USB_Wait(usb_transfer_t *transfer, unsigned int *length);
+void USB_Cancel(usb_transfer_t *transfer);
+int USB_StartInterrupt(usb_device_t *device, usb_message_t callback, void *arg);
+void USB_StopInterrupt(usb_device_t *device);
 
 #endif
 
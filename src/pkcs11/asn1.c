@@ -443,6 +443,190 @@ int asn1DecodeInteger(unsigned char *data, size_t length, int *value)
 
 
 
+/**
+ * Decode a subjectPublicKeyInfo structure
+ *
+ * Updates the spki, params, modulus and exponent fields of cert. The modulus and exponent are
+ * only set if the public key is a sequence of two integers, as it is for RSA keys.
+ *
+ * @param spki the first tag byte of the subjectPublicKeyInfo
+ * @param length the length of the subjectPublicKeyInfo
+ * @param cert the structure receiving the location of the decoded fields
+ * @return 0 if decoded, -1 if the structure is malformed
+ */
+int asn1DecodeSubjectPublicKeyInfo(unsigned char *spki, size_t length, struct asn1Certificate *cert)
+{
+	int tag, len, buflen, alglen, keylen;
+	unsigned char *value, *cursor, *obj, *alg, *key;
+
+	cert->spki = NULL;
+	cert->spkiLen = 0;
+	cert->params = NULL;
+	cert->paramsLen = 0;
+	cert->modulus = NULL;
+	cert->modulusLen = 0;
+	cert->exponent = NULL;
+	cert->exponentLen = 0;
+
+	cursor = spki;
+	buflen = (int)length;
+
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value) || (tag != ASN1_SEQUENCE)) {
+		return -1;
+	}
+
+	cert->spki = spki;
+	cert->spkiLen = (int)(cursor - spki);
+
+	cursor = value;
+	buflen = len;
+
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value) || (tag != ASN1_SEQUENCE)) {	// algorithm
+		return -1;
+	}
+	alg = value;
+	alglen = len;
+
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value) || (tag != ASN1_BIT_STRING)) {	// subjectPublicKey
+		return -1;
+	}
+	key = value;
+	keylen = len;
+
+	cursor = alg;
+	buflen = alglen;
+
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value) || (tag != ASN1_OBJECT_IDENTIFIER)) {
+		return -1;
+	}
+
+	obj = cursor;
+	if (asn1Next(&cursor, &buflen, &tag, &len, &value)) {		// parameters
+		cert->params = obj;
+		cert->paramsLen = (int)(cursor - obj);
+	}
+
+	if ((keylen < 6) || (*(key + 1) != ASN1_SEQUENCE)) {		// not a RSA public key
+		return 0;
+	}
+
+	cursor = key + 1;				// Skip unused bits
+	buflen = keylen - 1;
+
+	if (asn1Validate(cursor, buflen)) {
+		return -1;
+	}
+
+	asn1Next(&cursor, &buflen, &tag, &len, &value);
+	cursor = value;
+	buflen = len;
+
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value) || (tag != ASN1_INTEGER)) {
+		return -1;
+	}
+	cert->modulus = value;
+	cert->modulusLen = len;
+
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value) || (tag != ASN1_INTEGER)) {
+		cert->modulus = NULL;
+		cert->modulusLen = 0;
+		return -1;
+	}
+	cert->exponent = value;
+	cert->exponentLen = len;
+
+	return 0;
+}
+
+
+
+/**
+ * Decode a X.509 certificate in a single pass
+ *
+ * The certificate is validated and the location of serial number, issuer, subject and
+ * public key fields is stored in cert. No data is copied, so the fields remain valid as
+ * long as the buffer does.
+ *
+ * @param data the first tag byte of the certificate
+ * @param length the length of the buffer
+ * @param cert the structure receiving the location of the decoded fields
+ * @return 0 if decoded, -1 if the certificate is malformed
+ */
+int asn1DecodeCertificate(unsigned char *data, size_t length, struct asn1Certificate *cert)
+{
+	int tag, len, buflen;
+	unsigned char *value, *cursor, *obj;
+
+	memset(cert, 0, sizeof(*cert));
+
+	if (asn1Validate(data, length)) {
+		return -1;
+	}
+
+	cursor = data;
+	buflen = (int)length;
+
+	// Outer SEQUENCE
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value) || (tag != ASN1_SEQUENCE)) {
+		return -1;
+	}
+
+	cursor = value;
+	buflen = len;
+
+	// TBS SEQUENCE
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value) || (tag != ASN1_SEQUENCE)) {
+		return -1;
+	}
+
+	cursor = value;
+	buflen = len;
+
+	obj = cursor;
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value)) {
+		return -1;
+	}
+
+	if (tag == 0xA0) {				// Skip optional version
+		obj = cursor;
+		if (!asn1Next(&cursor, &buflen, &tag, &len, &value)) {
+			return -1;
+		}
+	}
+
+	if (tag != ASN1_INTEGER) {
+		return -1;
+	}
+	cert->serial = obj;
+	cert->serialLen = (int)(cursor - obj);
+
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value)) {	// Skip SignatureAlgorithm
+		return -1;
+	}
+
+	obj = cursor;
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value) || (tag != ASN1_SEQUENCE)) {	// Issuer
+		return -1;
+	}
+	cert->issuer = obj;
+	cert->issuerLen = (int)(cursor - obj);
+
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value)) {	// Skip validity dates
+		return -1;
+	}
+
+	obj = cursor;
+	if (!asn1Next(&cursor, &buflen, &tag, &len, &value) || (tag != ASN1_SEQUENCE)) {	// Subject
+		return -1;
+	}
+	cert->subject = obj;
+	cert->subjectLen = (int)(cursor - obj);
+
+	return asn1DecodeSubjectPublicKeyInfo(cursor, buflen, cert);
+}
+
+
+
 /**
  * Internal selftest
  */
@@ -49,6 +49,29 @@ extern "C" {
 #define ASN1_UTF8String         0x0C
 #define ASN1_SEQUENCE           0x30
 
+/**
+ * Fields of a X.509 certificate located by asn1DecodeCertificate()
+ *
+ * All fields point into the decoded buffer and cover the complete TLV object, except
+ * modulus and exponent which cover the value of the INTEGER. Fields not found are NULL.
+ */
+struct asn1Certificate {
+	unsigned char  *serial;             /**< serialNumber                                  */
+	int             serialLen;
+	unsigned char  *issuer;             /**< issuer Name                                   */
+	int             issuerLen;
+	unsigned char  *subject;            /**< subject Name                                  */
+	int             subjectLen;
+	unsigned char  *spki;               /**< subjectPublicKeyInfo                          */
+	int             spkiLen;
+	unsigned char  *params;             /**< Algorithm parameters, EC domain parameters    */
+	int             paramsLen;
+	unsigned char  *modulus;            /**< RSA modulus                                   */
+	int             modulusLen;
+	unsigned char  *exponent;           /**< RSA public exponent                           */
+	int             exponentLen;
+};
+
 unsigned int    asn1Tag(unsigned char **Ref);
 int             asn1Length(unsigned char **Ref);
 void            asn1StoreTag(unsigned char **Ref, unsigned short Tag);
@@ -59,6 +82,8 @@ int             asn1Validate(unsigned char *data, size_t length);
 int             asn1Next(unsigned char **ref, int *reflen, int *tag, int *length, unsigned char **value);
 void            asn1DecodeFlags(unsigned char *data, size_t length, unsigned long *flags);
 int             asn1DecodeInteger(unsigned char *data, size_t length, int *value);
+int             asn1DecodeSubjectPublicKeyInfo(unsigned char *spki, size_t length, struct asn1Certificate *cert);
+int             asn1DecodeCertificate(unsigned char *data, size_t length, struct asn1Certificate *cert);
 
 /* Support for C++ compiler ----------------------------------------------- */
 
@@ -95,103 +95,56 @@ int createCertificateObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct
 
 
 /**
- * Populate the attribute CKA_ISSUER, CKA_SUBJECT and CKA_SERIAL from certificate
+ * Decode the certificate in CKA_VALUE
+ *
+ * @param object    The certificate object
+ * @param cert      The structure receiving the location of the certificate fields in CKA_VALUE
+ * @return          0 or -1 if the object has no value or the certificate can not be decoded
  */
-int populateIssuerSubjectSerial(struct p11Object_t *object)
+int decodeCertificateObject(struct p11Object_t *object, struct asn1Certificate *cert)
 {
 	CK_ATTRIBUTE attr = { CKA_VALUE, NULL, 0 };
 	struct p11Attribute_t *pattr;
-	int tag, length, buflen;
-	unsigned char *value, *cursor, *obj;
 
-	attr.type = CKA_VALUE;
 	if (findAttribute(object, &attr, &pattr) < 0) {
 		return -1;
 	}
 
-	cursor = pattr->attrData.pValue;
-	buflen = pattr->attrData.ulValueLen;
-
-	if (asn1Validate(cursor, buflen)) {
-		return -1;
-	}
-
-	// Outer SEQUENCE
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	cursor = value;
-	buflen = length;
-
-	// TBS SEQUENCE
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	cursor = value;
-	buflen = length;
-
-	obj = cursor;
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag == 0xA0) {				// Skip optional cert type
-		obj = cursor;
-		if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-			return -1;
-		}
-	}
-
-	if (tag != ASN1_INTEGER) {
-		return -1;
-	}
+	return asn1DecodeCertificate(pattr->attrData.pValue, pattr->attrData.ulValueLen, cert);
+}
 
-	attr.type = CKA_SERIAL_NUMBER;
-	attr.pValue = obj;
-	attr.ulValueLen = (CK_ULONG)(cursor - obj);
 
-	addAttribute(object, &attr);
 
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip SignatureAlgorithm
-		return -1;
-	}
+/**
+ * Populate the attribute CKA_ISSUER, CKA_SUBJECT and CKA_SERIAL from the decoded certificate
+ */
+int populateIssuerSubjectSerial(struct p11Object_t *object, struct asn1Certificate *cert)
+{
+	CK_ATTRIBUTE attr = { CKA_SERIAL_NUMBER, NULL, 0 };
 
-	obj = cursor;
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Decode Issuer
-		return -1;
-	}
+	attr.pValue = cert->serial;
+	attr.ulValueLen = cert->serialLen;
 
-	if (tag != ASN1_SEQUENCE) {
+	if (addAttribute(object, &attr) < 0) {
 		return -1;
 	}
 
 	attr.type = CKA_ISSUER;
-	attr.pValue = obj;
-	attr.ulValueLen = (CK_ULONG)(cursor - obj);
-
-	addAttribute(object, &attr);
+	attr.pValue = cert->issuer;
+	attr.ulValueLen = cert->issuerLen;
 
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip validity dates
+	if (addAttribute(object, &attr) < 0) {
 		return -1;
 	}
 
-	obj = cursor;
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Decode Subject
-		return -1;
-	}
+	attr.type = CKA_SUBJECT;
+	attr.pValue = cert->subject;
+	attr.ulValueLen = cert->subjectLen;
 
-	if (tag != ASN1_SEQUENCE) {
+	if (addAttribute(object, &attr) < 0) {
 		return -1;
 	}
 
-	attr.type = CKA_SUBJECT;
-	attr.pValue = obj;
-	attr.ulValueLen = (CK_ULONG)(cursor - obj);
-
-	addAttribute(object, &attr);
-
 	return 0;
 }
 
@@ -199,76 +152,27 @@ int populateIssuerSubjectSerial(struct p11Object_t *object)
 
 int getSubjectPublicKeyInfo(struct p11Object_t *object, unsigned char **spki)
 {
-	CK_ATTRIBUTE attr = { CKA_VALUE, NULL, 0 };
-	struct p11Attribute_t *pattr;
-	int tag, length, buflen;
-	unsigned char *value, *cursor;
-
-	attr.type = CKA_VALUE;
-	if (findAttribute(object, &attr, &pattr) < 0) {
-		return -1;
-	}
-
-	cursor = pattr->attrData.pValue;
-	buflen = pattr->attrData.ulValueLen;
-
-	if (asn1Validate(cursor, buflen)) {
-		return -1;
-	}
-
-	// Outer SEQUENCE
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	cursor = value;
-	buflen = length;
-
-	// TBS SEQUENCE
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	cursor = value;
-	buflen = length;
-
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag == 0xA0) {				// Skip optional cert type
-		if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-			return -1;
-		}
-	}
+	struct asn1Certificate cert;
 
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip SignatureAlgorithm
+	if (decodeCertificateObject(object, &cert) < 0) {
 		return -1;
 	}
 
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip Issuer
-		return -1;
-	}
-
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip validity dates
-		return -1;
-	}
+	*spki = cert.spki;
+	return 0;
+}
 
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip Subject
-		return -1;
-	}
 
-	*spki =cursor;
 
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip SubjectPublicKeyInfo
-		return -1;
-	}
+static int decodeSPKI(unsigned char *spki, struct asn1Certificate *cert)
+{
+	unsigned char *cursor = spki;	// spk is ASN.1 validated before, not need to check again
+	int length;
 
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
+	asn1Tag(&cursor);
+	length = asn1Length(&cursor);
 
-	return 0;
+	return asn1DecodeSubjectPublicKeyInfo(spki, (size_t)(cursor - spki) + length, cert);
 }
 
 
@@ -277,86 +181,19 @@ int decodeModulusExponentFromSPKI(unsigned char *spki,
                                  CK_ATTRIBUTE_PTR modulus,
                                  CK_ATTRIBUTE_PTR exponent)
 {
-	int tag, length, buflen;
-	unsigned char *value, *cursor;
-
-	cursor = spki;				// spk is ASN.1 validated before, not need to check again
-
-	// subjectPublicKeyInfo
-	tag = asn1Tag(&cursor);
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	buflen = asn1Length(&cursor);
-
-	// algorithm
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	// subjectPublicKey
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_BIT_STRING) {
-		return -1;
-	}
-
-	if (length < 6) {
-		return -1;
-	}
-
-	cursor = value + 1;
-	buflen = length - 1;
-
-	if (asn1Validate(cursor, buflen) != 0) {
-		return -1;
-	}
-
-	// Outer SEQUENCE
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	cursor = value;
-	buflen = length;
+	struct asn1Certificate cert;
 
-	// Modulus
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_INTEGER) {
+	if ((decodeSPKI(spki, &cert) < 0) || (cert.modulus == NULL)) {
 		return -1;
 	}
 
 	modulus->type = CKA_MODULUS;
-	modulus->pValue = value;
-	modulus->ulValueLen = length;
-
-	// Exponent
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_INTEGER) {
-		return -1;
-	}
+	modulus->pValue = cert.modulus;
+	modulus->ulValueLen = cert.modulusLen;
 
 	exponent->type = CKA_PUBLIC_EXPONENT;
-	exponent->pValue = value;
-	exponent->ulValueLen = length;
+	exponent->pValue = cert.exponent;
+	exponent->ulValueLen = cert.exponentLen;
 
 	return 0;
 }
@@ -366,50 +203,15 @@ int decodeModulusExponentFromSPKI(unsigned char *spki,
 int decodeECParamsFromSPKI(unsigned char *spki,
                            CK_ATTRIBUTE_PTR ecparams)
 {
-	int tag, length, buflen;
-	unsigned char *value, *cursor;
-
-	cursor = spki;				// spk is ASN.1 validated before, not need to check again
-
-	// subjectPublicKeyInfo
-	tag = asn1Tag(&cursor);
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	buflen = asn1Length(&cursor);
+	struct asn1Certificate cert;
 
-	// algorithm
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	cursor = value;
-	buflen = length;
-
-	// algorithm
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_OBJECT_IDENTIFIER) {
+	if ((decodeSPKI(spki, &cert) < 0) || (cert.params == NULL)) {
 		return -1;
 	}
 
 	ecparams->type = CKA_EC_PARAMS;
-	ecparams->pValue = cursor;
-
-	// parameters
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	ecparams->ulValueLen = (CK_ULONG)(cursor - (unsigned char *)ecparams->pValue);
+	ecparams->pValue = cert.params;
+	ecparams->ulValueLen = cert.paramsLen;
 
 	return 0;
 }
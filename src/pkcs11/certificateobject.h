@@ -39,9 +39,11 @@
 #include <pkcs11/session.h>
 #include <pkcs11/cryptoki.h>
 #include <pkcs11/object.h>
+#include <pkcs11/asn1.h>
 
 int createCertificateObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
-int populateIssuerSubjectSerial(struct p11Object_t *object);
+int decodeCertificateObject(struct p11Object_t *object, struct asn1Certificate *cert);
+int populateIssuerSubjectSerial(struct p11Object_t *object, struct asn1Certificate *cert);
 int getSubjectPublicKeyInfo(struct p11Object_t *object, unsigned char **spki);
 int decodeModulusExponentFromSPKI(unsigned char *spki, CK_ATTRIBUTE_PTR modulus, CK_ATTRIBUTE_PTR exponent);
 int decodeECParamsFromSPKI(unsigned char *spki, CK_ATTRIBUTE_PTR ecparams);
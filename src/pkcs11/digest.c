@@ -0,0 +1,224 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    digest.c
+ * @brief   Host-side digest for hash-and-sign mechanisms
+ */
+
+/*
+	For the hash-and-sign mechanisms listed below the data is hashed on the host and only the
+	hash is sent to the token, signed with the raw mechanism: the DigestInfo with CKM_RSA_PKCS
+	and the hash, truncated to the key size, with CKM_ECDSA. Memory use of a multi-part
+	operation does not depend on the length of the data.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkcs11/digest.h>
+#include <ultralite/sc-hsm-ultralite.h>
+
+struct hostDigest_t {
+	CK_MECHANISM_TYPE mech;          /* hash-and-sign mechanism */
+	CK_MECHANISM_TYPE signMech;      /* raw mechanism the hash is signed with */
+	int hashLen;
+	const unsigned char *prefix;     /* DigestInfo up to the hash, NULL for ECDSA */
+	int prefixLen;
+};
+
+static const unsigned char prefixSHA256[] = {
+	0x30,0x31,0x30,0x0D,0x06,0x09,0x60,0x86,0x48,0x01,0x65,0x03,0x04,0x02,0x01,0x05,0x00,0x04,0x20 };
+static const unsigned char prefixSHA384[] = {
+	0x30,0x41,0x30,0x0D,0x06,0x09,0x60,0x86,0x48,0x01,0x65,0x03,0x04,0x02,0x02,0x05,0x00,0x04,0x30 };
+static const unsigned char prefixSHA512[] = {
+	0x30,0x51,0x30,0x0D,0x06,0x09,0x60,0x86,0x48,0x01,0x65,0x03,0x04,0x02,0x03,0x05,0x00,0x04,0x40 };
+
+static const struct hostDigest_t hostDigests[] = {
+	{ CKM_SHA256_RSA_PKCS, CKM_RSA_PKCS, 32, prefixSHA256, sizeof(prefixSHA256) },
+	{ CKM_SHA384_RSA_PKCS, CKM_RSA_PKCS, 48, prefixSHA384, sizeof(prefixSHA384) },
+	{ CKM_SHA512_RSA_PKCS, CKM_RSA_PKCS, 64, prefixSHA512, sizeof(prefixSHA512) },
+	{ CKM_ECDSA_SHA256, CKM_ECDSA, 32, NULL, 0 },
+	{ CKM_ECDSA_SHA384, CKM_ECDSA, 48, NULL, 0 },
+	{ CKM_ECDSA_SHA512, CKM_ECDSA, 64, NULL, 0 }
+};
+
+struct p11Digest_t {
+	const struct hostDigest_t *mech;
+	union {
+		sha256_context sha256;
+		sha512_context sha512;
+	} ctx;
+};
+
+
+
+static const struct hostDigest_t *findHostDigest(CK_MECHANISM_TYPE mech)
+{
+	int i;
+
+	for (i = 0; i < sizeof(hostDigests) / sizeof(*hostDigests); i++) {
+		if (hostDigests[i].mech == mech) {
+			return &hostDigests[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+
+/**
+ * Determine if the mechanism is hashed on the host
+ *
+ * @param mech the hash-and-sign mechanism
+ * @param signMech the raw mechanism the hash is signed with
+ * @return 1 if hashed on the host, 0 if not
+ */
+int getHostDigestSignMechanism(CK_MECHANISM_TYPE mech, CK_MECHANISM_TYPE *signMech)
+{
+	const struct hostDigest_t *hd = findHostDigest(mech);
+
+	if (hd == NULL) {
+		return 0;
+	}
+
+	*signMech = hd->signMech;
+	return 1;
+}
+
+
+
+/**
+ * Start a digest for a hash-and-sign mechanism
+ *
+ * @param mech the hash-and-sign mechanism
+ * @return the digest or NULL if the mechanism is not hashed on the host or out of memory
+ */
+struct p11Digest_t *newHostDigest(CK_MECHANISM_TYPE mech)
+{
+	const struct hostDigest_t *hd = findHostDigest(mech);
+	struct p11Digest_t *digest;
+
+	if (hd == NULL) {
+		return NULL;
+	}
+
+	digest = (struct p11Digest_t *)calloc(1, sizeof(struct p11Digest_t));
+
+	if (digest == NULL) {
+		return NULL;
+	}
+
+	digest->mech = hd;
+
+	switch(hd->hashLen) {
+	case 32:
+		sha256_starts(&digest->ctx.sha256);
+		break;
+	case 48:
+		sha384_starts(&digest->ctx.sha512);
+		break;
+	default:
+		sha512_starts(&digest->ctx.sha512);
+		break;
+	}
+
+	return digest;
+}
+
+
+
+void updateHostDigest(struct p11Digest_t *digest, CK_BYTE_PTR data, CK_ULONG len)
+{
+	unsigned int n;
+
+	/* the hash functions take unsigned int lengths */
+	while (len > 0) {
+		n = len > 0x40000000 ? 0x40000000 : (unsigned int)len;
+
+		if (digest->mech->hashLen == 32) {
+			sha256_update(&digest->ctx.sha256, data, n);
+		} else {
+			sha512_update(&digest->ctx.sha512, data, n);
+		}
+
+		data += n;
+		len -= n;
+	}
+}
+
+
+
+/**
+ * Produce the input for the raw signature mechanism
+ *
+ * The digest is not changed, so the function can be called again after a signature length query.
+ *
+ * @param digest the digest
+ * @param keysize the key size in bits, ECDSA hashes longer than the key are truncated
+ * @param out buffer of MAX_DIGEST_INPUT bytes
+ * @return the length of the signature input
+ */
+int finishHostDigest(struct p11Digest_t *digest, int keysize, unsigned char *out)
+{
+	const struct hostDigest_t *hd = digest->mech;
+	unsigned char hash[64];
+	struct p11Digest_t copy = *digest;
+	int len;
+
+	if (hd->hashLen == 32) {
+		sha256_finish(&copy.ctx.sha256, hash);
+	} else {
+		sha512_finish(&copy.ctx.sha512, hash);
+	}
+
+	len = hd->hashLen;
+
+	if (hd->prefix == NULL) {
+		if ((keysize > 0) && (len > (keysize + 7) >> 3)) {
+			len = (keysize + 7) >> 3;
+		}
+		memcpy(out, hash, len);
+		return len;
+	}
+
+	memcpy(out, hd->prefix, hd->prefixLen);
+	memcpy(out + hd->prefixLen, hash, len);
+
+	return hd->prefixLen + len;
+}
+
+
+
+void freeHostDigest(struct p11Digest_t *digest)
+{
+	if (digest) {
+		memset(digest, 0, sizeof(*digest));
+		free(digest);
+	}
+}
@@ -0,0 +1,49 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    digest.h
+ * @brief   Host-side digest for hash-and-sign mechanisms
+ */
+
+#ifndef ___DIGEST_H_INC___
+#define ___DIGEST_H_INC___
+
+#include <pkcs11/cryptoki.h>
+
+/* largest signature input produced by finishHostDigest(), a SHA-512 DigestInfo */
+#define MAX_DIGEST_INPUT	83
+
+struct p11Digest_t;
+
+int getHostDigestSignMechanism(CK_MECHANISM_TYPE mech, CK_MECHANISM_TYPE *signMech);
+struct p11Digest_t *newHostDigest(CK_MECHANISM_TYPE mech);
+void updateHostDigest(struct p11Digest_t *digest, CK_BYTE_PTR data, CK_ULONG len);
+int finishHostDigest(struct p11Digest_t *digest, int keysize, unsigned char *out);
+void freeHostDigest(struct p11Digest_t *digest);
+
+#endif /* ___DIGEST_H_INC___ */
@@ -572,32 +572,110 @@ int isValidPtr(void *ptr)
 
 
 
-int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
+/**
+ * Allocate memory for an attribute value from the value arena of the object
+ *
+ * @param object the object
+ * @param len the length of the value
+ * @return the memory or NULL if out of memory
+ */
+static void *allocateAttributeValue(struct p11Object_t *object, size_t len)
 {
-	struct p11Attribute_t *attr, **ppAttr;
+	struct p11AttributeArena_t *arena;
+	size_t size;
+	void *value;
 
-	attr = (struct p11Attribute_t *)calloc (1, sizeof(struct p11Attribute_t));
+	/* keep values aligned for the CK_ULONG and CK_BBOOL casts of the callers */
+	len = (len + sizeof(CK_ULONG) - 1) & ~(sizeof(CK_ULONG) - 1);
 
-	if (attr == NULL) {
-		return -1;
+	arena = object->arena;
+
+	if ((arena == NULL) || (arena->size - arena->used < len)) {
+		size = len > ATTRIBUTE_ARENA_SIZE ? len : ATTRIBUTE_ARENA_SIZE;
+
+		arena = (struct p11AttributeArena_t *)malloc(sizeof(struct p11AttributeArena_t) + size);
+
+		if (arena == NULL) {
+			return NULL;
+		}
+
+		arena->size = size;
+		arena->used = 0;
+		arena->next = object->arena;
+		object->arena = arena;
 	}
 
-	attr->attrData = *pTemplate;
+	value = arena->data + arena->used;
+	arena->used += len;
+
+	return value;
+}
 
-	attr->attrData.pValue = calloc(attr->attrData.ulValueLen, 1);
 
-	if (attr->attrData.pValue == NULL) {
-		free(attr);
+
+/**
+ * Return the index of the first attribute with a type not below the given type
+ */
+static int lowerBoundAttribute(struct p11Object_t *object, CK_ATTRIBUTE_TYPE type)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = object->attributeCount;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (object->attributes[mid].attrData.type < type) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+
+
+int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
+{
+	struct p11Attribute_t *attr;
+	void *value;
+	int space, pos;
+
+	if (object->attributeCount == object->attributeSpace) {
+		space = object->attributeSpace ? object->attributeSpace * 2 : ATTRIBUTE_SPACE;
+
+		attr = (struct p11Attribute_t *)realloc(object->attributes, space * sizeof(struct p11Attribute_t));
+
+		if (attr == NULL) {
+			return -1;
+		}
+
+		object->attributes = attr;
+		object->attributeSpace = space;
+	}
+
+	value = allocateAttributeValue(object, pTemplate->ulValueLen);
+
+	if (value == NULL) {
 		return -1;
 	}
 
-	memcpy(attr->attrData.pValue, pTemplate->pValue, attr->attrData.ulValueLen);
+	memcpy(value, pTemplate->pValue, pTemplate->ulValueLen);
 
-	FOR_EACH_REF(ppAttr, object->attrList) {
-		/* until points to the next field of the last element */
+	/* insert behind attributes of the same type, so that the first one added is found */
+	pos = lowerBoundAttribute(object, pTemplate->type);
+	while ((pos < object->attributeCount) && (object->attributes[pos].attrData.type == pTemplate->type)) {
+		pos++;
 	}
 
-	*ppAttr = attr;
+	attr = object->attributes + pos;
+	memmove(attr + 1, attr, (object->attributeCount - pos) * sizeof(struct p11Attribute_t));
+	object->attributeCount++;
+
+	attr->attrData = *pTemplate;
+	attr->attrData.pValue = value;
 
 	return CKR_OK;
 }
@@ -606,18 +684,13 @@ int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 
 int findAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate, struct p11Attribute_t **ppAttr)
 {
-	struct p11Attribute_t *attr;
-	int pos;            /* remember the current position in the list */
-
-	pos = 0;
-	FOR_EACH(attr, object->attrList) {
+	int pos;
 
-		if (attr->attrData.type == pTemplate->type) {
-			*ppAttr = attr;
-			return pos;
-		}
+	pos = lowerBoundAttribute(object, pTemplate->type);
 
-		pos++;
+	if ((pos < object->attributeCount) && (object->attributes[pos].attrData.type == pTemplate->type)) {
+		*ppAttr = object->attributes + pos;
+		return pos;
 	}
 
 	*ppAttr = NULL;
@@ -626,6 +699,38 @@ int findAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate, struct
 
 
 
+/**
+ * Replace the value of an attribute found with findAttribute()
+ *
+ * The old value remains in the arena if the new value does not fit.
+ *
+ * @param object the object
+ * @param attribute the attribute of the object
+ * @param pTemplate the new value
+ * @return CKR_OK or -1 if out of memory
+ */
+int setAttributeValue(struct p11Object_t *object, struct p11Attribute_t *attribute, CK_ATTRIBUTE_PTR pTemplate)
+{
+	void *value;
+
+	if (pTemplate->ulValueLen > attribute->attrData.ulValueLen) {
+		value = allocateAttributeValue(object, pTemplate->ulValueLen);
+
+		if (value == NULL) {
+			return -1;
+		}
+
+		attribute->attrData.pValue = value;
+	}
+
+	attribute->attrData.ulValueLen = pTemplate->ulValueLen;
+	memcpy(attribute->attrData.pValue, pTemplate->pValue, pTemplate->ulValueLen);
+
+	return CKR_OK;
+}
+
+
+
 int findAttributeInTemplate(CK_ATTRIBUTE_TYPE attributeType, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
 {
 	int i;
@@ -642,39 +747,45 @@ int findAttributeInTemplate(CK_ATTRIBUTE_TYPE attributeType, CK_ATTRIBUTE_PTR pT
 
 
 
+/**
+ * Remove an attribute from the object
+ *
+ * The value remains in the arena until removeAllAttributes() is called.
+ */
 int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 {
-	struct p11Attribute_t **ppAttr;
 	struct p11Attribute_t *attr;
+	int pos;
 
-	FOR_EACH_REF(ppAttr, object->attrList) {
-
-		if ((*ppAttr)->attrData.type == pTemplate->type) {
-
-			attr = *ppAttr;
-			*ppAttr = attr->next;
-
-			free(attr->attrData.pValue);
-			free(attr);
-
-			return CKR_OK;
-		}
+	pos = findAttribute(object, pTemplate, &attr);
 
+	if (pos < 0) {
+		return CKR_ARGUMENTS_BAD;
 	}
 
-	return CKR_ARGUMENTS_BAD;
+	object->attributeCount--;
+	memmove(attr, attr + 1, (object->attributeCount - pos) * sizeof(struct p11Attribute_t));
 
+	return CKR_OK;
 }
 
 
 
 int removeAllAttributes(struct p11Object_t *object)
 {
-	while(object->attrList) {
-		if (removeAttribute(object, &object->attrList->attrData) != CKR_OK)
-			return CKR_GENERAL_ERROR;
+	struct p11AttributeArena_t *arena;
+
+	while (object->arena) {
+		arena = object->arena;
+		object->arena = arena->next;
+		free(arena);
 	}
 
+	free(object->attributes);
+	object->attributes = NULL;
+	object->attributeCount = 0;
+	object->attributeSpace = 0;
+
 	return CKR_OK;
 }
 
@@ -741,17 +852,185 @@ void removeAllObjectsFromList(struct p11Object_t **ppList)
 
 
 
+/**
+ * Add a PKCS11 object to a handle index of OBJECT_BUCKETS buckets
+ *
+ * @param index the buckets of the index
+ * @param object the object to be added
+ */
+void addObjectToIndex(struct p11Object_t **index, struct p11Object_t *object)
+{
+	index += object->handle & (OBJECT_BUCKETS - 1);
+	object->nextInBucket = *index;
+	*index = object;
+}
+
+
+
+/**
+ * Remove a PKCS11 object from a handle index, the object is not freed
+ *
+ * @param index the buckets of the index
+ * @param object the object to be removed
+ */
+void removeObjectFromIndex(struct p11Object_t **index, struct p11Object_t *object)
+{
+	for (index += object->handle & (OBJECT_BUCKETS - 1); *index; index = &(*index)->nextInBucket) {
+		if (*index == object) {
+			*index = object->nextInBucket;
+			break;
+		}
+	}
+}
+
+
+
+/**
+ * Find a PKCS11 object in a handle index
+ *
+ * @param index the buckets of the index
+ * @param handle the handle of the object
+ * @return the object or NULL if not found
+ */
+struct p11Object_t *findObjectInIndex(struct p11Object_t **index, CK_OBJECT_HANDLE handle)
+{
+	struct p11Object_t *object;
+
+	for (object = index[handle & (OBJECT_BUCKETS - 1)]; object; object = object->nextInBucket) {
+		if (object->handle == handle)
+			break;
+	}
+
+	return object;
+}
+
+
+
+/**
+ * Indexed attributes, ordered by the expected selectivity in a search template
+ */
+static const CK_ATTRIBUTE_TYPE indexedAttributes[INDEXED_ATTRIBUTES] = { CKA_ID, CKA_LABEL, CKA_KEY_TYPE, CKA_CLASS };
+
+
+
+/**
+ * Map attribute value to bucket of attribute index (FNV-1a hash)
+ */
+static int attributeBucket(CK_ATTRIBUTE_PTR attr)
+{
+	unsigned char *p = (unsigned char *)attr->pValue;
+	unsigned int hash = 2166136261u;
+	CK_ULONG i;
+
+	for (i = 0; i < attr->ulValueLen; i++) {
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+
+	return (int)(hash & (ATTRIBUTE_BUCKETS - 1));
+}
+
+
+
+/**
+ * Add a PKCS11 object to the attribute indexes for CKA_ID, CKA_LABEL, CKA_KEY_TYPE and CKA_CLASS
+ *
+ * The object must be removed and added again if the value of an indexed attribute changes.
+ *
+ * @param index the INDEXED_ATTRIBUTES indexes of ATTRIBUTE_BUCKETS buckets
+ * @param object the object to be added
+ */
+void addObjectToAttributeIndex(struct p11Object_t *index[][ATTRIBUTE_BUCKETS], struct p11Object_t *object)
+{
+	CK_ATTRIBUTE template = { 0, NULL, 0 };
+	struct p11Attribute_t *attr;
+	int i, bucket;
+
+	for (i = 0; i < INDEXED_ATTRIBUTES; i++) {
+		template.type = indexedAttributes[i];
+
+		if (findAttribute(object, &template, &attr) < 0) {
+			object->attributeBucket[i] = -1;
+			continue;
+		}
+
+		bucket = attributeBucket(&attr->attrData);
+		object->attributeBucket[i] = bucket;
+		object->nextInAttributeIndex[i] = index[i][bucket];
+		index[i][bucket] = object;
+	}
+}
+
+
+
+/**
+ * Remove a PKCS11 object from the attribute indexes, the object is not freed
+ *
+ * @param index the INDEXED_ATTRIBUTES indexes of ATTRIBUTE_BUCKETS buckets
+ * @param object the object to be removed
+ */
+void removeObjectFromAttributeIndex(struct p11Object_t *index[][ATTRIBUTE_BUCKETS], struct p11Object_t *object)
+{
+	struct p11Object_t **ppObject;
+	int i;
+
+	for (i = 0; i < INDEXED_ATTRIBUTES; i++) {
+		if (object->attributeBucket[i] < 0) {
+			continue;
+		}
+
+		for (ppObject = &index[i][object->attributeBucket[i]]; *ppObject; ppObject = &(*ppObject)->nextInAttributeIndex[i]) {
+			if (*ppObject == object) {
+				*ppObject = object->nextInAttributeIndex[i];
+				break;
+			}
+		}
+
+		object->attributeBucket[i] = -1;
+	}
+}
+
+
+
+/**
+ * Select the attribute index to search for objects matching the template
+ *
+ * The objects in the selected bucket, chained by nextInAttributeIndex[], are candidates that
+ * still need to be matched against the full template.
+ *
+ * @param pTemplate the search template
+ * @param ulCount the number of attributes in the template
+ * @param bucket the bucket in the selected index
+ * @return the index in nextInAttributeIndex[] or -1 if the template contains no indexed attribute
+ */
+int selectAttributeIndex(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int *bucket)
+{
+	int i, pos;
+
+	for (i = 0; i < INDEXED_ATTRIBUTES; i++) {
+		pos = findAttributeInTemplate(indexedAttributes[i], pTemplate, ulCount);
+
+		if (pos >= 0) {
+			*bucket = attributeBucket(&pTemplate[pos]);
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+
 #ifdef DEBUG
 
 int dumpAttributeList(struct p11Object_t *object)
 {
-	struct p11Attribute_t *attr;
+	int i;
 
 	debug("\n******** attribute list for object ********\n");
 
-	FOR_EACH(attr,  object->attrList) {
+	for (i = 0; i < object->attributeCount; i++) {
 
-		dumpAttribute(&attr->attrData);
+		dumpAttribute(&object->attributes[i].attrData);
 
 	}
 
@@ -867,6 +1146,47 @@ int createKeyObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Obje
 
 
 
+/**
+ * Create an object that only has the attributes in the template. The remaining
+ * attributes are read by the loadAttributes method, which the caller sets, when
+ * the object is first used.
+ *
+ * @param pTemplate the attributes known without reading the object from the token
+ * @param ulCount the number of attributes
+ * @return the object or NULL if out of memory
+ */
+struct p11Object_t *createStubObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct p11Object_t *object;
+	CK_ULONG i;
+
+	object = (struct p11Object_t *)calloc(1, sizeof(struct p11Object_t));
+
+	if (object == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < ulCount; i++) {
+		if (addAttribute(object, &pTemplate[i]) != CKR_OK) {
+			removeAllAttributes(object);
+			free(object);
+			return NULL;
+		}
+
+		if ((pTemplate[i].type == CKA_PRIVATE) && (*(CK_BBOOL *)pTemplate[i].pValue == CK_FALSE)) {
+			object->publicObj = TRUE;
+		}
+
+		if ((pTemplate[i].type == CKA_TOKEN) && (*(CK_BBOOL *)pTemplate[i].pValue == CK_TRUE)) {
+			object->tokenObj = TRUE;
+		}
+	}
+
+	return object;
+}
+
+
+
 /**
  * Serialize all attributes of the object to an unsigned char array
  * The returned pBuffer must be freed by the caller.
@@ -879,7 +1199,7 @@ int serializeObject(struct p11Object_t *object, unsigned char **pBuffer, unsigne
 
 	/* Determine the size of the object */
 	len = 0;
-	FOR_EACH(attr, object->attrList) {
+	for (attr = object->attributes; attr < object->attributes + object->attributeCount; attr++) {
 
 		len += sizeof(CK_ATTRIBUTE);
 		len += attr->attrData.ulValueLen;
@@ -898,7 +1218,7 @@ int serializeObject(struct p11Object_t *object, unsigned char **pBuffer, unsigne
 
 	/* Fill the buffer */
 	i = 0;
-	FOR_EACH(attr, object->attrList) {
+	for (attr = object->attributes; attr < object->attributes + object->attributeCount; attr++) {
 
 		memcpy(buf + i, &attr->attrData, sizeof(CK_ATTRIBUTE));
 		i += sizeof(CK_ATTRIBUTE);
@@ -41,13 +41,32 @@
 /**
  * Internal structure to store information about an attribute.
  *
+ * The attributes of an object are kept in an array sorted by type. The
+ * values are stored in the value arena of the object and stay in place until
+ * removeAllAttributes() is called, so pValue can be used while further
+ * attributes are added. A pointer to a p11Attribute_t however is only valid
+ * until the next call to addAttribute() or removeAttribute().
  */
 
 struct p11Attribute_t {
 
     CK_ATTRIBUTE attrData;          /**< The attribute data                   */
+};
+
+#define ATTRIBUTE_SPACE         16      /**< Initial size of the attribute array */
+#define ATTRIBUTE_ARENA_SIZE    1024    /**< Default size of an arena chunk      */
 
-    struct p11Attribute_t *next;    /**< Pointer to next attribute            */
+/**
+ * Chunk of the value arena of an object. Values are allocated from the last
+ * chunk and a new chunk is linked in front if the remaining space is too small.
+ */
+
+struct p11AttributeArena_t {
+
+    struct p11AttributeArena_t *next; /**< Previously allocated chunk         */
+    size_t size;                      /**< Size of data                       */
+    size_t used;                      /**< Bytes used in data                 */
+    unsigned char data[1];            /**< Values                             */
 };
 
 
@@ -89,8 +108,16 @@ struct p11Object_t {
     int (*C_SignUpdate)   (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
     int (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
-    struct p11Attribute_t *attrList; /**< The list of attributes              */
+    int (*loadAttributes)(struct p11Object_t *); /**< Loads the attributes of a stub object, NULL once loaded */
+
+    struct p11Attribute_t *attributes; /**< Attributes sorted by type        */
+    int attributeCount;                /**< Number of entries in attributes  */
+    int attributeSpace;                /**< Allocated entries in attributes  */
+    struct p11AttributeArena_t *arena; /**< Storage of the attribute values  */
     struct p11Object_t *next;        /**< Pointer to next object              */
+    struct p11Object_t *nextInBucket;/**< Pointer to next object in the index */
+    struct p11Object_t *nextInAttributeIndex[INDEXED_ATTRIBUTES]; /**< Next object in the attribute index buckets */
+    int attributeBucket[INDEXED_ATTRIBUTES]; /**< Bucket in the attribute index or -1 */
 
 };
 
@@ -112,15 +139,23 @@ char *id2name(struct id2name_t *p, unsigned long id, unsigned long *attr, char s
 int isValidPtr(void *ptr);
 int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate);
 int findAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTemplate, struct p11Attribute_t **attribute);
+int setAttributeValue(struct p11Object_t *object, struct p11Attribute_t *attribute, CK_ATTRIBUTE_PTR pTemplate);
 int findAttributeInTemplate(CK_ATTRIBUTE_TYPE attributeType, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
 int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTemplate);
 int removeAllAttributes(struct p11Object_t *object);
 void addObjectToList(struct p11Object_t **ppObject, struct p11Object_t *object);
 int removeObjectFromList(struct p11Object_t **ppObject, CK_OBJECT_HANDLE handle);
 void removeAllObjectsFromList(struct p11Object_t **ppObject);
+void addObjectToIndex(struct p11Object_t **index, struct p11Object_t *object);
+void removeObjectFromIndex(struct p11Object_t **index, struct p11Object_t *object);
+struct p11Object_t *findObjectInIndex(struct p11Object_t **index, CK_OBJECT_HANDLE handle);
+void addObjectToAttributeIndex(struct p11Object_t *index[][ATTRIBUTE_BUCKETS], struct p11Object_t *object);
+void removeObjectFromAttributeIndex(struct p11Object_t *index[][ATTRIBUTE_BUCKETS], struct p11Object_t *object);
+int selectAttributeIndex(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int *bucket);
 int createObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
 int createStorageObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
 int createKeyObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
+struct p11Object_t *createStubObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
 int serializeObject(struct p11Object_t *object, unsigned char **pBuffer, unsigned int *bufLength);
 void dumpAttribute(CK_ATTRIBUTE_PTR attr);
 
@@ -0,0 +1,350 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    objectcache.c
+ * @brief   Cache of token objects in files shared by processes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+
+#include <pkcs11/objectcache.h>
+
+#ifdef DEBUG
+#include <pkcs11/debug.h>
+#endif
+
+
+
+/*
+	File layout, in host byte order:
+
+	struct objectCacheHeader_t
+	key[keylen]
+	for each object:
+		struct objectCacheRecord_t
+		attributes as produced by serializeObject(), a CK_ATTRIBUTE followed by the value
+*/
+
+struct objectCacheHeader_t {
+	char magic[8];
+	unsigned int attributeSize;     /* sizeof(CK_ATTRIBUTE), rejects files of another ABI */
+	unsigned int keylen;
+	unsigned int objects;
+};
+
+struct objectCacheRecord_t {
+	int tokenid;
+	int keysize;
+	unsigned int attributes;
+	unsigned int length;
+};
+
+
+
+int isObjectCacheEnabled(void)
+{
+	return getenv("SC_HSM_CACHE") != NULL;
+}
+
+
+
+static int getCachePath(const char *name, const char *suffix, char *path, size_t len)
+{
+	const char *dir = getenv("SC_HSM_CACHE");
+	int rc;
+
+	if (dir == NULL) {
+		return -1;
+	}
+
+	rc = snprintf(path, len, "%s/%s%s", dir, name, suffix);
+
+	return (rc < 0 || (size_t)rc >= len) ? -1 : 0;
+}
+
+
+
+/**
+ * Decode the objects following the header
+ */
+static int decodeObjects(unsigned char *p, unsigned char *end, unsigned int objects, struct p11Object_t **ppList)
+{
+	struct objectCacheRecord_t rec;
+	struct p11Object_t *object;
+	CK_ATTRIBUTE_PTR template;
+	unsigned char *last;
+	unsigned int i;
+
+	while (objects--) {
+		if ((size_t)(end - p) < sizeof(rec)) {
+			return -1;
+		}
+
+		memcpy(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+
+		if (((size_t)(end - p) < rec.length) || (rec.attributes > rec.length / sizeof(CK_ATTRIBUTE))) {
+			return -1;
+		}
+
+		template = (CK_ATTRIBUTE_PTR)calloc(rec.attributes + 1, sizeof(CK_ATTRIBUTE));
+
+		if (template == NULL) {
+			return -1;
+		}
+
+		last = p + rec.length;
+
+		for (i = 0; i < rec.attributes; i++) {
+			if ((size_t)(last - p) < sizeof(CK_ATTRIBUTE)) {
+				break;
+			}
+
+			memcpy(&template[i], p, sizeof(CK_ATTRIBUTE));
+			p += sizeof(CK_ATTRIBUTE);
+
+			if ((CK_ULONG)(last - p) < template[i].ulValueLen) {
+				break;
+			}
+
+			template[i].pValue = p;
+			p += template[i].ulValueLen;
+		}
+
+		if ((i < rec.attributes) || (p != last)) {
+			free(template);
+			return -1;
+		}
+
+		object = createStubObject(template, rec.attributes);
+		free(template);
+
+		if (object == NULL) {
+			return -1;
+		}
+
+		object->tokenid = rec.tokenid;
+		object->keysize = rec.keysize;
+		addObjectToList(ppList, object);
+	}
+
+	return p == end ? 0 : -1;
+}
+
+
+
+/**
+ * Read the objects from a cache file
+ *
+ * @param name the name of the file in the cache directory
+ * @param key the key the objects must have been stored with
+ * @param keylen the length of the key
+ * @param ppList the list to which the objects are added
+ * @return the number of objects or -1 if the cache is not available or does not match the key
+ */
+int readObjectCache(const char *name, unsigned char *key, size_t keylen, struct p11Object_t **ppList)
+{
+	struct objectCacheHeader_t hdr;
+	struct p11Object_t *list = NULL;
+	unsigned char *buf;
+	char path[FILENAME_MAX];
+	FILE *fp;
+	long size;
+	int rc;
+
+	if (getCachePath(name, "", path, sizeof(path)) < 0) {
+		return -1;
+	}
+
+	fp = fopen(path, "rb");
+
+	if (fp == NULL) {
+		return -1;
+	}
+
+	if (fseek(fp, 0, SEEK_END) || ((size = ftell(fp)) < (long)(sizeof(hdr) + keylen)) || fseek(fp, 0, SEEK_SET)) {
+		fclose(fp);
+		return -1;
+	}
+
+	buf = (unsigned char *)malloc(size);
+
+	if (buf == NULL) {
+		fclose(fp);
+		return -1;
+	}
+
+	rc = (fread(buf, 1, size, fp) == (size_t)size) ? 0 : -1;
+	fclose(fp);
+
+	if (rc == 0) {
+		memcpy(&hdr, buf, sizeof(hdr));
+
+		if (memcmp(hdr.magic, OBJECT_CACHE_MAGIC, sizeof(hdr.magic)) ||
+				(hdr.attributeSize != sizeof(CK_ATTRIBUTE)) ||
+				(hdr.keylen != keylen) ||
+				memcmp(buf + sizeof(hdr), key, keylen)) {
+			rc = -1;
+		}
+	}
+
+	if (rc == 0) {
+		rc = decodeObjects(buf + sizeof(hdr) + keylen, buf + size, hdr.objects, &list);
+
+		if (rc < 0) {
+			removeAllObjectsFromList(&list);
+		}
+	}
+
+	free(buf);
+
+	if (rc < 0) {
+#ifdef DEBUG
+		debug("Object cache %s outdated or invalid\n", path);
+#endif
+		return -1;
+	}
+
+	/* hand over the objects only if the whole file was valid, restoring the file order */
+	while (list) {
+		struct p11Object_t *object = list;
+		list = object->next;
+		addObjectToList(ppList, object);
+	}
+
+	return (int)hdr.objects;
+}
+
+
+
+/**
+ * Write the objects to a cache file, replacing a previous file
+ *
+ * The file is written under a temporary name and renamed, so that concurrent readers
+ * either see the old or the new content. Lists containing stub objects are not written.
+ *
+ * @param name the name of the file in the cache directory
+ * @param key the key the objects are valid for
+ * @param keylen the length of the key
+ * @param list the objects
+ * @return 0 or -1 if the cache could not be written
+ */
+int writeObjectCache(const char *name, unsigned char *key, size_t keylen, struct p11Object_t *list)
+{
+	struct objectCacheHeader_t hdr;
+	struct objectCacheRecord_t rec;
+	struct p11Object_t *object;
+	char path[FILENAME_MAX], tmp[FILENAME_MAX], suffix[32];
+	unsigned char *buf;
+	unsigned int len;
+	FILE *fp;
+	int rc;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, OBJECT_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.attributeSize = sizeof(CK_ATTRIBUTE);
+	hdr.keylen = (unsigned int)keylen;
+
+	FOR_EACH(object, list) {
+		if (object->loadAttributes) {
+			return -1;
+		}
+		hdr.objects++;
+	}
+
+	sprintf(suffix, ".%d", (int)getpid());
+
+	if ((getCachePath(name, "", path, sizeof(path)) < 0) || (getCachePath(name, suffix, tmp, sizeof(tmp)) < 0)) {
+		return -1;
+	}
+
+#ifndef _WIN32
+	{
+		/* the cache may contain the attributes of private objects */
+		int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+		fp = fd < 0 ? NULL : fdopen(fd, "wb");
+		if ((fp == NULL) && (fd >= 0)) {
+			close(fd);
+		}
+	}
+#else
+	fp = fopen(tmp, "wb");
+#endif
+
+	if (fp == NULL) {
+		return -1;
+	}
+
+	rc = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1) && (fwrite(key, 1, keylen, fp) == keylen) ? 0 : -1;
+
+	for (object = list; object && (rc == 0); object = object->next) {
+		if (serializeObject(object, &buf, &len) < 0) {
+			rc = -1;
+			break;
+		}
+
+		rec.tokenid = object->tokenid;
+		rec.keysize = object->keysize;
+		rec.attributes = (unsigned int)object->attributeCount;
+		rec.length = len;
+
+		if ((fwrite(&rec, sizeof(rec), 1, fp) != 1) || (fwrite(buf, 1, len, fp) != len)) {
+			rc = -1;
+		}
+
+		free(buf);
+	}
+
+	if (fclose(fp) || rc) {
+		remove(tmp);
+		return -1;
+	}
+
+#ifdef _WIN32
+	remove(path);
+#endif
+
+	if (rename(tmp, path)) {
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}
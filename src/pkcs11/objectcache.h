@@ -0,0 +1,54 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    objectcache.h
+ * @brief   Cache of token objects in files shared by processes
+ */
+
+#ifndef ___OBJECTCACHE_H_INC___
+#define ___OBJECTCACHE_H_INC___
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/object.h>
+
+/*
+	The cache is enabled by the environment variable SC_HSM_CACHE naming a directory.
+
+	A cache file holds the attributes of a list of objects together with the key the
+	list is valid for, typically the identity of the token plus the list of files on it.
+	The file is only used if the key matches exactly, otherwise the objects are read
+	from the token and the file is written again.
+*/
+
+#define OBJECT_CACHE_MAGIC	"SCHSMOC1"
+
+int isObjectCacheEnabled(void);
+int readObjectCache(const char *name, unsigned char *key, size_t keylen, struct p11Object_t **ppList);
+int writeObjectCache(const char *name, unsigned char *key, size_t keylen, struct p11Object_t *list);
+
+#endif /* ___OBJECTCACHE_H_INC___ */
@@ -36,8 +36,11 @@
 #include <pkcs11/cryptoki.h>
 
 #include <pkcs11/p11generic.h>
+#include <pkcs11/p11vendor.h>
 #include <pkcs11/session.h>
+#include <pkcs11/slot.h>
 #include <pkcs11/slotpool.h>
+#include <pkcs11/stats.h>
 #include <pkcs11/strbpcpy.h>
 
 #ifdef DEBUG
@@ -130,6 +133,18 @@ CK_FUNCTION_LIST pkcs11_function_list = {
 
 
 
+/*
+ * Initialize the vendor function list.
+ *
+ */
+CK_VENDOR_FUNCTION_LIST vendor_function_list = {
+		{ 1, 1 },
+		C_SignBatch,
+		C_GetSlotStatistics
+};
+
+
+
 /**
  * C_Initialize initializes the Cryptoki library.
  *
@@ -183,6 +198,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_Initialize)
 
 		initSlotPool(&context->slotPool);
 
+		if (!pInitArgs || !(((CK_C_INITIALIZE_ARGS_PTR)pInitArgs)->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS)) {
+			startSlotMonitor(&context->slotPool);
+			startStatsDump(&context->slotPool);
+		}
+
 		FUNC_RETURNS(CKR_OK);
 	}
 }
@@ -203,6 +223,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_Finalize)
 
 	if (context != NULL) {
 
+		stopSlotMonitor(&context->slotPool);
+
+		stopStatsDump();
+
 		terminateSessionPool(&context->sessionPool);
 
 		terminateSlotPool(&context->slotPool);
@@ -289,3 +313,25 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetFunctionList)
 
 	FUNC_RETURNS(CKR_OK);
 }
+
+
+
+/**
+ * C_GetVendorFunctionList returns the list of vendor extensions.
+ *
+ */
+CK_DECLARE_FUNCTION(CK_RV, C_GetVendorFunctionList)
+(
+		CK_VENDOR_FUNCTION_LIST_PTR_PTR ppFunctionList
+)
+{
+	FUNC_CALLED();
+
+	if (!isValidPtr(ppFunctionList)) {
+		FUNC_RETURNS(CKR_ARGUMENTS_BAD);
+	}
+
+	*ppFunctionList = &vendor_function_list;
+
+	FUNC_RETURNS(CKR_OK);
+}
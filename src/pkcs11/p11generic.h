@@ -39,8 +39,18 @@
 #include <assert.h>
 
 #include <common/mutex.h>
+#include <common/trace.h>
+
+/**
+ * Token objects are also indexed by the value of CKA_ID, CKA_LABEL, CKA_KEY_TYPE and CKA_CLASS,
+ * each index having ATTRIBUTE_BUCKETS buckets, a power of 2. Defined ahead of object.h, which
+ * sizes the index links of an object with it.
+ */
+#define INDEXED_ATTRIBUTES  4
+#define ATTRIBUTE_BUCKETS   64
 
 #include <pkcs11/cryptoki.h>
+#include <pkcs11/p11vendor.h>
 #include <pkcs11/object.h>
 
 #ifndef _MAX_PATH
@@ -64,12 +74,14 @@
 #define FUNC_CALLED() MUTEX *_pmutex_ = 0; \
 do { \
 	debug("Function %s called.\n", __FUNCTION__); \
+	TRACE(TRACE_P11_CALLED, __FUNCTION__, 0, 0, 0); \
 } while (0)
 
 
 #define FUNC_RETURNS(rc) do { \
 	CK_RV _rc_ = rc; \
 	debug("Function %s completes with rc=%d.\n", __FUNCTION__, _rc_); \
+	TRACE(TRACE_P11_RETURNS, __FUNCTION__, _rc_, 0, 0); \
 	if (_pmutex_) MUTEX_UNLOCK(_pmutex_); \
 	return _rc_; \
 } while (0)
@@ -78,6 +90,7 @@ do { \
 #define FUNC_FAILS(rc, msg) do { \
 	CK_RV _rc_ = rc; \
 	debug("Function %s fails with rc=%d \"%s\"\n", __FUNCTION__, _rc_, (msg)); \
+	TRACE(TRACE_P11_FAILS, __FUNCTION__, _rc_, (msg), 0); \
 	if (_pmutex_) MUTEX_UNLOCK(_pmutex_); \
 	return _rc_; \
 } while (0)
@@ -86,16 +99,21 @@ do { \
 #else /* no debug */
 
 
-#define FUNC_CALLED() MUTEX *_pmutex_ = 0 
+#define FUNC_CALLED() MUTEX *_pmutex_ = 0; \
+	TRACE(TRACE_P11_CALLED, __FUNCTION__, 0, 0, 0)
 
 #define FUNC_RETURNS(rc) do { \
+	CK_RV _rc_ = rc; \
+	TRACE(TRACE_P11_RETURNS, __FUNCTION__, _rc_, 0, 0); \
 	if (_pmutex_) MUTEX_UNLOCK(_pmutex_); \
-	return (rc); \
+	return _rc_; \
 } while (0)
 
 #define FUNC_FAILS(rc, msg) do { \
+	CK_RV _rc_ = rc; \
+	TRACE(TRACE_P11_FAILS, __FUNCTION__, _rc_, (msg), 0); \
 	if (_pmutex_) MUTEX_UNLOCK(_pmutex_); \
-	return (rc); \
+	return _rc_; \
 } while (0)
 
 #endif
@@ -147,10 +165,21 @@ do { \
  * @param handle       The handle of the session.
  * @param ppSession    Pointer the the session pointer which receives the found session.
  */
-#define FUNC_FIND_SESSION_AND_LOCK_SLOT(handle, ppSession, ppSlot) { \
+#define FUNC_FIND_SESSION_AND_LOCK_SLOT(handle, ppSession, ppSlot) \
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(handle, ppSession, ppSlot, SLOT_PRIORITY_NORMAL)
+
+
+/**
+ * Same as FUNC_FIND_SESSION_AND_LOCK_SLOT, but waits for the slot in the given priority class.
+ *
+ * @param handle       The handle of the session.
+ * @param ppSession    Pointer the the session pointer which receives the found session.
+ * @param priority     One of the SLOT_PRIORITY_ values.
+ */
+#define FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(handle, ppSession, ppSlot, priority) { \
 	int rc; \
 	assert(!_pmutex_); \
-	rc = safeFindSessionAndLockSlot(&context->sessionPool, &context->slotPool, handle, ppSession, ppSlot); \
+	rc = safeFindSessionAndLockSlot(&context->sessionPool, &context->slotPool, handle, ppSession, ppSlot, priority); \
 	if (rc) FUNC_RETURNS(rc); \
 	_pmutex_ = &(*ppSlot)->mutex; \
 } while (0);
@@ -177,6 +206,43 @@ do { \
 } while (0);
 
 
+/**
+ * Finds the session and the key of the active sign or decrypt operation and locks the slot
+ * that runs it. For a session on the virtual slot this is the least loaded member holding the
+ * key, see slotpool.c. Fails with CKR_OPERATION_NOT_INITIALIZED if no operation is active.
+ *
+ * @param handle       The handle of the session.
+ * @param ppSession    Pointer the the session pointer which receives the found session.
+ * @param ppSlot       Pointer the the slot pointer which receives the locked slot.
+ * @param ppObject     Pointer the the object pointer which receives the key.
+ * @param pDispatch    The slots used for the operation, for FUNC_FAILOVER_KEY_SLOT.
+ */
+#define FUNC_FIND_SESSION_AND_LOCK_KEY_SLOT(handle, ppSession, ppSlot, ppObject, pDispatch) { \
+	int rc; \
+	assert(!_pmutex_); \
+	rc = safeFindSessionAndLockKeySlot(&context->sessionPool, &context->slotPool, handle, ppSession, ppSlot, ppObject, pDispatch); \
+	if (rc) FUNC_RETURNS(rc); \
+	_pmutex_ = &(*ppSlot)->mutex; \
+} while (0);
+
+
+/**
+ * Moves an operation of a session on the virtual slot that failed with a device error to the
+ * next member holding the key. Evaluates to TRUE if the slot and key were replaced. Otherwise
+ * the slot is still locked, unless *ppSlot was set to NULL because no other member was left.
+ *
+ * @param session      The session.
+ * @param rv           The result of the operation.
+ * @param ppSlot       Pointer the the slot pointer of FUNC_FIND_SESSION_AND_LOCK_KEY_SLOT.
+ * @param ppObject     Pointer the the object pointer of FUNC_FIND_SESSION_AND_LOCK_KEY_SLOT.
+ * @param pDispatch    The slots used for the operation.
+ */
+#define FUNC_FAILOVER_KEY_SLOT(session, rv, ppSlot, ppObject, pDispatch) \
+	(failoverKeySlot(&context->slotPool, session, rv, ppSlot, ppObject, pDispatch) ? \
+		(_pmutex_ = &(*(ppSlot))->mutex, 1) : \
+		(_pmutex_ = *(ppSlot) ? &(*(ppSlot))->mutex : 0, 0))
+
+
 /**
  * Mutex macros. All of them are protected by assert. If the system runs out of mutexes we have
  * a serious problem and the only option is to terminate the process.
@@ -188,6 +254,31 @@ do { \
 #define MUTEX_LOCK(pmutex) assert(!mutex_lock(pmutex))
 #define MUTEX_UNLOCK(pmutex) assert(!mutex_unlock(pmutex))
 
+/**
+ * Reader-writer lock macros for the session and slot pool. Lookups share the lock, adding
+ * and removing sessions or slots takes it exclusively.
+ *
+ * @param plock     Pointer to a reader-writer lock.
+ */
+#define RWLOCK_INIT(plock) assert(!rwlock_init(plock))
+#define RWLOCK_DESTROY(plock) assert(!rwlock_destroy(plock))
+#define RWLOCK_RDLOCK(plock) assert(!rwlock_rdlock(plock))
+#define RWLOCK_RDUNLOCK(plock) assert(!rwlock_rdunlock(plock))
+#define RWLOCK_WRLOCK(plock) assert(!rwlock_wrlock(plock))
+#define RWLOCK_WRUNLOCK(plock) assert(!rwlock_wrunlock(plock))
+
+/**
+ * Condition variable macros for the slot scheduler.
+ *
+ * @param pcond     Pointer to a condition variable.
+ */
+#define CONDVAR_INIT(pcond) assert(!condvar_init(pcond))
+#define CONDVAR_DESTROY(pcond) assert(!condvar_destroy(pcond))
+#define CONDVAR_LOCK(pcond) assert(!condvar_lock(pcond))
+#define CONDVAR_UNLOCK(pcond) assert(!condvar_unlock(pcond))
+#define CONDVAR_WAIT(pcond) assert(!condvar_wait(pcond))
+#define CONDVAR_BROADCAST(pcond) assert(!condvar_broadcast(pcond))
+
 #ifdef mutex_owner
 #define VERIFY_MUTEXOWNER(pmutex) assert(mutex_owner(pmutex) == GetCurrentThreadId())
 #define VERIFY_NOT_MUTEXOWNER(pmutex) assert(mutex_owner(pmutex) != GetCurrentThreadId())
@@ -231,6 +322,78 @@ do { \
 		for ((pp) = &(list); *(pp); (pp) = &(*(pp))->next)
 
 
+/**
+ * Number of buckets of the session handle, slot id and object handle index, a power of 2.
+ * Handles and ids are assigned sequentially and map to consecutive buckets.
+ */
+#define SESSION_BUCKETS 1024
+#define SLOT_BUCKETS    64
+#define OBJECT_BUCKETS  64
+
+/**
+ * Number of closed sessions kept for reuse by C_OpenSession
+ */
+#define SESSION_CACHE_SIZE  64
+
+/**
+ * Priority classes of threads waiting for a slot. Lower values are served first,
+ * threads in the same class are served in the order they arrived.
+ */
+#define SLOT_PRIORITY_INTERACTIVE  0       /**< Sign, decrypt and encrypt operations         */
+#define SLOT_PRIORITY_NORMAL       1       /**< All other slot and session functions         */
+#define SLOT_PRIORITY_BACKGROUND   2       /**< Object searches that may load the token      */
+#define SLOT_PRIORITIES            3
+
+/**
+ * Snapshots of a slot kept for C_GetSlotInfo and C_GetTokenInfo, see slot.c
+ */
+#define INFO_CACHED_SLOT           1
+#define INFO_CACHED_TOKEN          2
+
+/**
+ * Identity of a key for the virtual slot: CKA_ID and the SHA-256 hash of the subject public
+ * key info in the certificate with the same CKA_ID, see slotpool.c
+ */
+#define MAX_KEY_ID                 64
+
+struct p11KeyIdentity_t
+{
+	CK_ULONG idLen;                        /**< Length of id, 0 if the key has no identity   */
+	CK_BYTE id[MAX_KEY_ID];                /**< CKA_ID of the key                            */
+	unsigned char hash[32];                /**< Hash of the public key                       */
+};
+
+/**
+ * Statistics of a slot, see stats.c. Same content as CK_SC_HSM_SLOT_STATISTICS, but naturally
+ * aligned for the lock free updates.
+ */
+struct p11Latency_t
+{
+	unsigned long long count;
+	unsigned long long totalUs;
+	unsigned long long maxUs;
+	unsigned long long histogram[CK_SC_HSM_LATENCY_BUCKETS];
+};
+
+struct p11MechanismStats_t
+{
+	CK_MECHANISM_TYPE mechanism;
+	unsigned long long calls;
+	unsigned long long errors;
+	struct p11Latency_t latency;
+};
+
+struct p11SlotStats_t
+{
+	unsigned long long apdus;
+	unsigned long long bytesOut;
+	unsigned long long bytesIn;
+	struct p11Latency_t card;
+	struct p11Latency_t lockWait;
+	int mechanismCount;                    /**< Only incremented by the slot mutex owner     */
+	struct p11MechanismStats_t mechanism[CK_SC_HSM_STATS_MECHANISMS];
+};
+
 /**
  * Internal structure to store information about a slot.
  *
@@ -240,19 +403,37 @@ struct p11Slot_t
 	CK_SLOT_ID id;                         /**< The id of the slot                           */
 	CK_SLOT_INFO info;                     /**< General information about the slot           */
 	unsigned long hasFeatureVerifyPINDirect;
+	int emuReader;                         /**< Reader index if SC_HSM_EMULATOR is active    */
 #ifndef CTAPI
 	char readerName[MAX_READERNAME];       /**< The slot name                                */
 	SCARDCONTEXT context;                  /**< Card manager context for slot                */
 	SCARDHANDLE card;                      /**< Handle to card                               */
+	DWORD readerState;                     /**< Reader state last reported by the slot monitor */
+	unsigned cardChanges;                  /**< Card events seen by the slot monitor         */
+	unsigned tokenCardChanges;             /**< cardChanges when the token was last checked  */
+	int monitored;                         /**< readerState is kept by the slot monitor      */
+	unsigned long readerHash;              /**< Hash of readerName, set by updatePCSCSlots   */
+	struct p11Slot_t *nextWithName;        /**< Next slot with the same reader name hash     */
 #endif
 	unsigned queuing;                      /**< Used to preventing slot deletion             */
 	MUTEX mutex;                           /**< mutex used for slot synchronisation          */
+	CONDVAR schedule;                      /**< Protects and signals the fields below        */
+	unsigned long nextTicket[SLOT_PRIORITIES];   /**< Ticket for the next arriving thread    */
+	unsigned long servedTicket[SLOT_PRIORITIES]; /**< Ticket of the next thread to be served */
+	int handingOver;                       /**< A served thread is waiting for the mutex     */
+	int infoCached;                        /**< INFO_CACHED_xxx bits valid in the snapshots  */
+	unsigned infoCardChanges;              /**< cardChanges when the snapshots were taken    */
+	CK_SLOT_INFO cachedSlotInfo;           /**< Snapshot for C_GetSlotInfo, see slot.c       */
+	CK_TOKEN_INFO cachedTokenInfo;         /**< Snapshot for C_GetTokenInfo, see slot.c      */
 	int sessionCount;                      /**< Number of sessions                           */
 	int readOnlySessionCount;              /**< Number of read only sessions                 */
 	int present;                           /**< Used in saveUpdateSlots                      */
 	int closed;                            /**< Slot ready for delete                        */
+	int virtualMember;                     /**< Logged in for the virtual slot, see slotpool.c */
+	struct p11SlotStats_t stats;           /**< Always on counters, see stats.c              */
 	struct p11Token_t *token;              /**< Pointer to token in the slot                 */
 	struct p11Slot_t *next;                /**< Pointer to next slot, NULL if last           */
+	struct p11Slot_t *nextInBucket;        /**< Pointer to next slot in the id index bucket  */
 };
 
 /**
@@ -270,6 +451,10 @@ struct p11Token_t
 	struct p11Object_t *pubObjectList;     /**< Pointer to first object in pool              */
 	CK_ULONG privObjectCount;              /**< The number of private objects in this token  */
 	struct p11Object_t *privObjectList;    /**< Pointer to the first object in pool          */
+	struct p11Object_t *pubObjectIndex[OBJECT_BUCKETS];  /**< Public objects by handle       */
+	struct p11Object_t *privObjectIndex[OBJECT_BUCKETS]; /**< Private objects by handle      */
+	struct p11Object_t *pubAttributeIndex[INDEXED_ATTRIBUTES][ATTRIBUTE_BUCKETS];  /**< Public objects by attribute value */
+	struct p11Object_t *privAttributeIndex[INDEXED_ATTRIBUTES][ATTRIBUTE_BUCKETS]; /**< Private objects by attribute value */
 };
 
 /**
@@ -280,9 +465,13 @@ struct p11Token_t
 struct p11SessionPool_t
 {
 	CK_SESSION_HANDLE nextHandle;          /**< Value of next assigned session handle        */
-	MUTEX mutex;                           /**< mutex for thread safe access                 */
+	RWLOCK lock;                           /**< shared for lookups, exclusive for changes    */
 	CK_ULONG count;                        /**< Number of active sessions                    */
 	struct p11Session_t *list;             /**< Pointer to first session in pool             */
+	struct p11Session_t *bucket[SESSION_BUCKETS]; /**< Sessions indexed by handle            */
+	MUTEX cacheLock;                       /**< Protects the fields below                    */
+	CK_ULONG cacheCount;                   /**< Number of sessions in cache                  */
+	struct p11Session_t *cache;            /**< Closed sessions ready for reuse              */
 };
 
 
@@ -293,9 +482,12 @@ struct p11SessionPool_t
 struct p11SlotPool_t
 {
 	CK_SLOT_ID nextID;                     /**< The next assigned slot ID value              */
-	MUTEX mutex;                           /**< mutex for thread safe access                 */
+	RWLOCK lock;                           /**< shared for lookups, exclusive for changes    */
 	CK_ULONG count;                        /**< Number of slots in the pool                  */
 	struct p11Slot_t *list;                /**< Pointer to first slot in pool                */
+	struct p11Slot_t *bucket[SLOT_BUCKETS]; /**< Slots indexed by id                         */
+	int virtualSlot;                       /**< Offer the virtual slot, see slotpool.c       */
+	unsigned virtualSessionCount;          /**< Number of sessions on the virtual slot       */
 };
 
 
@@ -32,9 +32,11 @@
  */
 
 #include <pkcs11/p11generic.h>
+#include <pkcs11/p11vendor.h>
 #include <pkcs11/session.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/slotpool.h>
+#include <pkcs11/stats.h>
 #include <pkcs11/token.h>
 #include <pkcs11/debug.h>
 
@@ -61,7 +63,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
 
 	if (session->activeObjectHandle != CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_ACTIVE, "Operation is already active");
@@ -109,7 +111,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -153,7 +155,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -194,7 +196,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -240,7 +242,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptInit)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
 
 	if (session->activeObjectHandle != CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_ACTIVE, "Operation is already active");
@@ -261,6 +263,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptInit)(
 	if (!rv) {
 		session->activeObjectHandle = object->handle;
 		session->activeMechanism = pMechanism->mechanism;
+		setActiveKey(session, slot, object);
 		rv = CKR_OK;
 	}
 
@@ -282,6 +285,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	struct p11KeyDispatch_t dispatch;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -289,28 +294,24 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
-
-	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
-		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
-	}
-
-	rv = findSlotObject(slot, session->activeObjectHandle, &object, FALSE);
-
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
+	FUNC_FIND_SESSION_AND_LOCK_KEY_SLOT(hSession, &session, &slot, &object, &dispatch);
 
 	if (pData != NULL) {
 		session->activeObjectHandle = CK_INVALID_HANDLE;
 	}
 
-	if (object->C_Decrypt != NULL) {
-		rv = object->C_Decrypt(object, session->activeMechanism, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
-	} else {
+	if (object->C_Decrypt == NULL) {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
+	do {
+		start = statsNow();
+		rv = object->C_Decrypt(object, session->activeMechanism, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+		if (pData != NULL) {
+			statsAddOperation(slot, session->activeMechanism, rv, start);
+		}
+	} while (FUNC_FAILOVER_KEY_SLOT(session, rv, &slot, &object, &dispatch));
+
 	FUNC_RETURNS(rv);
 }
 
@@ -337,7 +338,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -371,6 +372,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -378,7 +380,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -391,7 +393,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 	}
 
 	if (object->C_DecryptFinal != NULL) {
+		start = statsNow();
 		rv = object->C_DecryptFinal(object, session->activeMechanism, pLastPart, pulLastPartLen);
+		if (pLastPart != NULL) {
+			statsAddOperation(slot, session->activeMechanism, rv, start);
+		}
 	} else {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
@@ -520,6 +526,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	CK_MECHANISM mech;
 
 	FUNC_CALLED();
 
@@ -527,7 +534,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
 
 	if (session->activeObjectHandle != CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_ACTIVE, "Operation is already active");
@@ -539,15 +546,29 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 		FUNC_RETURNS(rv);
 	}
 
+	/* hash-and-sign mechanisms hashed on the host are initialized as the raw mechanism */
+	mech = *pMechanism;
+	getHostDigestSignMechanism(pMechanism->mechanism, &mech.mechanism);
+
 	if (object->C_SignInit != NULL) {
-		rv = object->C_SignInit(object, pMechanism);
+		rv = object->C_SignInit(object, &mech);
 	} else {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
 	if (!rv) {
+		clearCryptoBuffer(session);
+
+		if (mech.mechanism != pMechanism->mechanism) {
+			session->digest = newHostDigest(pMechanism->mechanism);
+			if (session->digest == NULL) {
+				FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+			}
+		}
+
 		session->activeObjectHandle = object->handle;
 		session->activeMechanism = pMechanism->mechanism;
+		setActiveKey(session, slot, object);
 		rv = CKR_OK;
 	}
 
@@ -556,6 +577,23 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 
 
 
+/**
+ * Sign the host digest with the raw mechanism of the hash-and-sign mechanism
+ */
+static int signHostDigest(struct p11Object_t *object, CK_MECHANISM_TYPE mech, struct p11Digest_t *digest, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	unsigned char input[MAX_DIGEST_INPUT];
+	CK_MECHANISM_TYPE signMech;
+	int len;
+
+	getHostDigestSignMechanism(mech, &signMech);
+	len = finishHostDigest(digest, object->keysize, input);
+
+	return object->C_Sign(object, signMech, input, len, pSignature, pulSignatureLen);
+}
+
+
+
 /*  C_Sign signs data in a single part, where the signature is an appendix to the data. */
 CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 		CK_SESSION_HANDLE hSession,
@@ -569,6 +607,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	struct p11KeyDispatch_t dispatch;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -576,28 +616,43 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
-
-	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
-		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
-	}
-
-	rv = findSlotObject(slot, session->activeObjectHandle, &object, FALSE);
-
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
+	FUNC_FIND_SESSION_AND_LOCK_KEY_SLOT(hSession, &session, &slot, &object, &dispatch);
 
 	if (pSignature != NULL) {
 		session->activeObjectHandle = CK_INVALID_HANDLE;
 	}
 
-	if (object->C_Sign != NULL) {
-		rv = object->C_Sign(object, session->activeMechanism, pData, ulDataLen, pSignature, pulSignatureLen);
-	} else {
+	if (object->C_Sign == NULL) {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
+	do {
+		start = statsNow();
+
+		if (session->digest != NULL) {
+			/* a length query leaves the digest unchanged, so start again from the initial state */
+			struct p11Digest_t *digest = newHostDigest(session->activeMechanism);
+
+			if (digest == NULL) {
+				FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+			}
+
+			updateHostDigest(digest, pData, ulDataLen);
+			rv = signHostDigest(object, session->activeMechanism, digest, pSignature, pulSignatureLen);
+			freeHostDigest(digest);
+		} else {
+			rv = object->C_Sign(object, session->activeMechanism, pData, ulDataLen, pSignature, pulSignatureLen);
+		}
+
+		if (pSignature != NULL) {
+			statsAddOperation(slot, session->activeMechanism, rv, start);
+		}
+	} while (FUNC_FAILOVER_KEY_SLOT(session, rv, &slot, &object, &dispatch));
+
+	if ((pSignature != NULL) && (session->digest != NULL)) {
+		clearCryptoBuffer(session);
+	}
+
 	FUNC_RETURNS(rv);
 }
 
@@ -622,7 +677,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -634,7 +689,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (object->C_SignUpdate != NULL) {
+	if (session->digest != NULL) {
+		updateHostDigest(session->digest, pPart, ulPartLen);
+		rv = CKR_OK;
+	} else if (object->C_SignUpdate != NULL) {
 		rv = object->C_SignUpdate(object, session->activeMechanism, pPart, ulPartLen);
 	} else {
 		rv = appendToCryptoBuffer(session, pPart, ulPartLen);
@@ -656,6 +714,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -663,7 +722,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -679,7 +738,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 		session->activeObjectHandle = CK_INVALID_HANDLE;
 	}
 
-	if (object->C_SignFinal != NULL) {
+	start = statsNow();
+
+	if ((session->digest != NULL) && (object->C_Sign != NULL)) {
+		rv = signHostDigest(object, session->activeMechanism, session->digest, pSignature, pulSignatureLen);
+	} else if (object->C_SignFinal != NULL) {
 		rv = object->C_SignFinal(object, session->activeMechanism, pSignature, pulSignatureLen);
 	} else if (object->C_Sign != NULL) {
 		rv = object->C_Sign(object, session->activeMechanism, session->cryptoBuffer, session->cryptoBufferSize, pSignature, pulSignatureLen);
@@ -688,6 +751,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 	}
 
 	if (pSignature != NULL) {
+		statsAddOperation(slot, session->activeMechanism, rv, start);
 		clearCryptoBuffer(session);
 	}
 
@@ -696,6 +760,99 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 
 
 
+/*  C_SignBatch signs a list of data items with one key, holding the slot lock for the whole batch. */
+CK_DECLARE_FUNCTION(CK_RV, C_SignBatch)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey,
+		CK_ULONG ulCount,
+		CK_BYTE_PTR CK_PTR ppData,
+		CK_ULONG_PTR pulDataLen,
+		CK_BYTE_PTR CK_PTR ppSignature,
+		CK_ULONG_PTR pulSignatureLen
+)
+{
+	int rv;
+	CK_ULONG i;
+	unsigned long long start;
+	struct p11Object_t *object;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+	struct p11Digest_t *digest;
+	CK_MECHANISM mech;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pMechanism)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid mechanism");
+	}
+
+	if ((ulCount > 0) && (!isValidPtr(ppData) || !isValidPtr(pulDataLen) || !isValidPtr(pulSignatureLen))) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid batch arrays");
+	}
+
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
+
+	if (session->activeObjectHandle != CK_INVALID_HANDLE) {
+		FUNC_FAILS(CKR_OPERATION_ACTIVE, "Operation is already active");
+	}
+
+	rv = findSlotObject(slot, hKey, &object, FALSE);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if ((object->C_SignInit == NULL) || (object->C_Sign == NULL)) {
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+	}
+
+	mech = *pMechanism;
+	getHostDigestSignMechanism(pMechanism->mechanism, &mech.mechanism);
+
+	rv = object->C_SignInit(object, &mech);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	for (i = 0; i < ulCount; i++) {
+		start = statsNow();
+
+		if (ppSignature == NULL) {
+			/* the raw mechanism has the same signature length */
+			rv = object->C_Sign(object, mech.mechanism, ppData[i], pulDataLen[i], NULL, &pulSignatureLen[i]);
+		} else if (mech.mechanism != pMechanism->mechanism) {
+			digest = newHostDigest(pMechanism->mechanism);
+			if (digest == NULL) {
+				FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+			}
+
+			updateHostDigest(digest, ppData[i], pulDataLen[i]);
+			rv = signHostDigest(object, pMechanism->mechanism, digest, ppSignature[i], &pulSignatureLen[i]);
+			freeHostDigest(digest);
+		} else {
+			rv = object->C_Sign(object, mech.mechanism, ppData[i], pulDataLen[i], ppSignature[i], &pulSignatureLen[i]);
+		}
+
+		if (ppSignature != NULL) {
+			statsAddOperation(slot, pMechanism->mechanism, rv, start);
+		}
+
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Signing batch item failed");
+		}
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 /*  C_SignRecoverInit initializes a signature operation, where the data
     can be recovered from the signature. */
 CK_DECLARE_FUNCTION(CK_RV, C_SignRecoverInit)(
@@ -1089,7 +1246,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_SeedRandom)(
 		CK_ULONG ulSeedLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
 
@@ -1097,7 +1255,14 @@ CK_DECLARE_FUNCTION(CK_RV, C_SeedRandom)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_RETURNS(rv);
+	if (pSeed == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pSeed must not be NULL");
+	}
+
+	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+
+	/* The generator of the SmartCard-HSM does not accept seed material */
+	FUNC_RETURNS(CKR_RANDOM_SEED_NOT_SUPPORTED);
 }
 
 
@@ -1109,7 +1274,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateRandom)(
 		CK_ULONG ulRandomLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	int rv;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
 
@@ -1117,6 +1284,18 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateRandom)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if ((pRandomData == NULL) && (ulRandomLen > 0)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pRandomData must not be NULL");
+	}
+
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_INTERACTIVE);
+
+	if (ulRandomLen == 0) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	rv = generateRandom(slot, pRandomData, ulRandomLen);
+
 	FUNC_RETURNS(rv);
 }
 
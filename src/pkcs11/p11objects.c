@@ -348,12 +348,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 
 	for (i = 0; i < ulCount; i++) {
 
-		FOR_EACH(attribute, object->attrList) {
-			if (attribute->attrData.type == pTemplate[i].type)
-				break;
-		}
-
-		if (!attribute) {
+		if (findAttribute(object, pTemplate + i, &attribute) < 0) {
 			pTemplate[i].ulValueLen = (CK_LONG) -1;
 			rv = CKR_ATTRIBUTE_TYPE_INVALID;
 			continue;
@@ -398,6 +393,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
 	struct p11Attribute_t *attribute;
+	struct p11Object_t *(*index)[ATTRIBUTE_BUCKETS];
 
 	FUNC_CALLED();
 
@@ -416,6 +412,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 	}
 
 	rv = findSessionObject(session, hObject, &object);
+	index = NULL;
 
 	/* only session objects can be modified without user authentication */
 
@@ -426,10 +423,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 
 		/* public token objects */
 		rv = findTokenObject(slot->token, hObject, &object, TRUE);
+		index = slot->token->pubAttributeIndex;
 
 		if (rv < 0) {
 			/* private token objects */
 			rv = findTokenObject(slot->token, hObject, &object, FALSE);
+			index = slot->token->privAttributeIndex;
 
 			if (rv < 0) {
 				FUNC_FAILS(CKR_OBJECT_HANDLE_INVALID, "Object not found as token object");
@@ -439,12 +438,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 
 	for (i = 0; i < ulCount; i++) {
 
-		FOR_EACH(attribute, object->attrList) {
-			if (attribute->attrData.type == pTemplate[i].type)
-				break;
-		}
-
-		if (!attribute) {
+		if (findAttribute(object, pTemplate + i, &attribute) < 0) {
 			FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "We do not allow manufacturer specific attributes");
 		}
 
@@ -485,13 +479,20 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 				}
 			}
 		} else {
-			if (pTemplate[i].ulValueLen > attribute->attrData.ulValueLen) {
-				free(attribute->attrData.pValue);
-				attribute->attrData.pValue = malloc(pTemplate[i].ulValueLen);
+			/* the attribute index of token objects refers to the value */
+			if (index != NULL) {
+				removeObjectFromAttributeIndex(index, object);
 			}
 
-			attribute->attrData.ulValueLen = pTemplate[i].ulValueLen;
-			memcpy(attribute->attrData.pValue, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+			rv = setAttributeValue(object, attribute, pTemplate + i);
+
+			if (index != NULL) {
+				addObjectToAttributeIndex(index, object);
+			}
+
+			if (rv < 0) {
+				FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+			}
 
 			object->dirtyFlag = 1;
 
@@ -531,6 +532,34 @@ static int isMatchingObject(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTempla
 
 
 
+/**
+ * Add token objects matching the template to the search result
+ *
+ * Only the objects in the bucket for the most selective indexed attribute of the template are
+ * matched, the full list is only searched if the template contains no indexed attribute.
+ */
+static int findMatchingTokenObjects(struct p11Session_t *session, struct p11Object_t *list,
+		struct p11Object_t *index[][ATTRIBUTE_BUCKETS], CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct p11Object_t *object;
+	int i, bucket, rv;
+
+	i = selectAttributeIndex(pTemplate, ulCount, &bucket);
+
+	for (object = (i < 0) ? list : index[i][bucket]; object; object = (i < 0) ? object->next : object->nextInAttributeIndex[i]) {
+		if (isMatchingObject(object, pTemplate, ulCount)) {
+			rv = addObjectToSearchList(session, object);
+			if (rv != CKR_OK) {
+				return rv;
+			}
+		}
+	}
+
+	return CKR_OK;
+}
+
+
+
 /*  C_FindObjectsInit initializes a search for token and session objects
     that match a template. */
 CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
@@ -543,6 +572,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
 	CK_STATE state;
+	int rv;
 
 	FUNC_CALLED();
 
@@ -554,11 +584,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
 		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_LOCK_SLOT_PRIORITY(hSession, &session, &slot, SLOT_PRIORITY_BACKGROUND);
 
-	if (session->searchObj.searchList != NULL) {
-		C_FindObjectsFinal(hSession);
-	}
+	clearSearchList(session);
 
 	if (slot->token == NULL) {
 		FUNC_FAILS(CKR_DEVICE_REMOVED, "device removed");
@@ -567,25 +595,28 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
 	/* session objects */
 	FOR_EACH(object, session->objectList) {
 		if (isMatchingObject(object, pTemplate, ulCount)) {
-			addObjectToSearchList(session, object);
+			rv = addObjectToSearchList(session, object);
+			if (rv != CKR_OK) {
+				clearSearchList(session);
+				FUNC_FAILS(rv, "Out of memory");
+			}
 		}
 	}
 
 	/* public token objects */
-	FOR_EACH(object, slot->token->pubObjectList) {
-		if (isMatchingObject(object, pTemplate, ulCount)) {
-			addObjectToSearchList(session, object);
-		}
-	}
+	loadTokenObjectsForTemplate(slot->token, pTemplate, ulCount, TRUE);
+	rv = findMatchingTokenObjects(session, slot->token->pubObjectList, slot->token->pubAttributeIndex, pTemplate, ulCount);
 
 	/* private token objects */
 	state = getSessionState(session, slot);
-	if (state == CKS_RW_USER_FUNCTIONS || state == CKS_RO_USER_FUNCTIONS) {
-		FOR_EACH(object, slot->token->privObjectList) {
-			if (isMatchingObject(object, pTemplate, ulCount)) {
-				addObjectToSearchList(session, object);
-			}
-		}
+	if (rv == CKR_OK && (state == CKS_RW_USER_FUNCTIONS || state == CKS_RO_USER_FUNCTIONS)) {
+		loadTokenObjectsForTemplate(slot->token, pTemplate, ulCount, FALSE);
+		rv = findMatchingTokenObjects(session, slot->token->privObjectList, slot->token->privAttributeIndex, pTemplate, ulCount);
+	}
+
+	if (rv != CKR_OK) {
+		clearSearchList(session);
+		FUNC_FAILS(rv, "Out of memory");
 	}
 
 	FUNC_RETURNS(CKR_OK);
@@ -601,10 +632,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjects)(
 		CK_ULONG_PTR pulObjectCount
 )
 {
-	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
-	int i = 0, cnt;
+	int cnt;
 
 	FUNC_CALLED();
 
@@ -627,23 +657,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjects)(
 		FUNC_RETURNS(CKR_OK);
 	}
 
-	/* Move object to the first uncollected element */
-	object = session->searchObj.searchList;
-	/* canonical reverse loop */
-	for (i = session->searchObj.objectCollected; --i >= 0; ) {
-		object = object->next;
-		assert(object);
-	}
-
 	cnt = session->searchObj.objectCount - session->searchObj.objectCollected;
 	if (cnt > ulMaxObjectCount) {
 		cnt = ulMaxObjectCount;
 	}
 
-	for (i = 0; i < cnt; i++) {
-		*phObject++ = object->handle;
-		object = object->next;
-	}
+	memcpy(phObject, session->searchObj.handles + session->searchObj.objectCollected, cnt * sizeof(CK_OBJECT_HANDLE));
 
 	*pulObjectCount = cnt;
 	session->searchObj.objectCollected += cnt;
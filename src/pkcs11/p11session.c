@@ -89,13 +89,14 @@ CK_DECLARE_FUNCTION(CK_RV, C_OpenSession)(
 		FUNC_FAILS(CKR_SESSION_READ_WRITE_SO_EXISTS, "Can not open an R/O session if SO is logged in");
 	}
 
-	session = (struct p11Session_t *)calloc(1, sizeof(struct p11Session_t));
+	session = newSession(&context->sessionPool);
 
 	if (session == NULL) {
 		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
 	}
 
-	session->slotID = slot->id;
+	session->slotID = slotID;
+	session->homeSlotID = slot->id;
 	session->flags = flags;
 	session->activeObjectHandle = CK_INVALID_HANDLE;
 
@@ -106,6 +107,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_OpenSession)(
 
 	FUNC_UNLOCK(&slot->mutex);
 
+	if (slotID == VIRTUAL_SLOT_ID) {
+		InterlockedIncrement(&context->slotPool.virtualSessionCount);
+	}
+
 	safeAddSession(&context->sessionPool, session);
 	*phSession = session->handle; /* we got a valid handle by calling addSession() */
 
@@ -119,7 +124,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_CloseSession)(
 		CK_SESSION_HANDLE hSession
 )
 {
-	struct p11Session_t **ppSession, *session;
+	struct p11Session_t *session;
 	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
@@ -128,40 +133,38 @@ CK_DECLARE_FUNCTION(CK_RV, C_CloseSession)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_LOCK(&context->sessionPool.mutex);
+	RWLOCK_WRLOCK(&context->sessionPool.lock);
 
-	session = NULL;
-	FOR_EACH_REF(ppSession, context->sessionPool.list) {
-		if ((*ppSession)->handle == hSession) {
-			session = *ppSession;
-			break;
-		}
-	}
+	session = findSession(&context->sessionPool, hSession);
 
 	if (session == NULL) {
+		RWLOCK_WRUNLOCK(&context->sessionPool.lock);
 		FUNC_RETURNS(CKR_SESSION_HANDLE_INVALID);
 	}
 
 	if (session->queuing) {
 		/* another thread using this seesion is waiting for the slot mutex */
+		RWLOCK_WRUNLOCK(&context->sessionPool.lock);
 		FUNC_RETURNS(CKR_FUNCTION_FAILED);
 	}
 
 	/* remove seesion from session pool */
-	*ppSession = session->next; /* unlink */
-	context->sessionPool.count--;
+	unlinkSession(&context->sessionPool, session);
 
-	MUTEX_LOCK(&context->slotPool.mutex);
-	FOR_EACH(slot, context->slotPool.list) {
-		if (slot->id == session->slotID)
-			break;
-	}
-	MUTEX_UNLOCK(&context->slotPool.mutex);
+	RWLOCK_RDLOCK(&context->slotPool.lock);
+	slot = findSlot(&context->slotPool, session->homeSlotID);
+	RWLOCK_RDUNLOCK(&context->slotPool.lock);
 
-	/* Now we have exclusive access to the session and can give up the session pool mutex. */
-	FUNC_UNLOCK(&context->sessionPool.mutex);
+	/* Now we have exclusive access to the session and can give up the session pool lock. */
+	RWLOCK_WRUNLOCK(&context->sessionPool.lock);
+
+	if (session->slotID == VIRTUAL_SLOT_ID) {
+		/* wait for operations of the session running on other members of the virtual slot */
+		safeReleaseVirtualMembers(&context->slotPool, InterlockedDecrement(&context->slotPool.virtualSessionCount) == 0);
+	}
 
 	if (slot == NULL) {
+		releaseSession(&context->sessionPool, session);
 		FUNC_RETURNS(CKR_OK);
 	}
 	/* Wait for the owning thread and all already queued threads. We must hold the slot mutex
@@ -181,7 +184,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_CloseSession)(
 		logOut(slot);
 	}
 
-	freeSession(session);
+	releaseSession(&context->sessionPool, session);
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -240,7 +243,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSessionInfo)(
 		FUNC_RETURNS(rv);
 	}
 
-	pInfo->slotID = slot->id;
+	pInfo->slotID = session->slotID;
 	pInfo->flags = session->flags;
 	pInfo->ulDeviceError = 0;
 	pInfo->state = getSessionState(session, slot);
@@ -352,6 +355,17 @@ CK_DECLARE_FUNCTION(CK_RV, C_Login)(
 
 	token->userType = userType;
 
+	if ((session->slotID == VIRTUAL_SLOT_ID) && (userType == CKU_USER) && (pPin != NULL)) {
+		struct p11KeyIdentity_t keys[MAX_VIRTUAL_KEYS];
+		CK_SLOT_ID homeSlotID = slot->id;
+		int count;
+
+		count = getVirtualKeys(slot, keys, MAX_VIRTUAL_KEYS);
+		FUNC_UNLOCK(&slot->mutex);
+
+		safeLogInVirtualMembers(&context->slotPool, homeSlotID, keys, count, pPin, ulPinLen);
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -389,5 +403,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_Logout)(
 
 	rv = logOut(slot);
 
+	if (session->slotID == VIRTUAL_SLOT_ID) {
+		FUNC_UNLOCK(&slot->mutex);
+		safeReleaseVirtualMembers(&context->slotPool, TRUE);
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
@@ -37,6 +37,8 @@
 #include <pkcs11/session.h>
 #include <pkcs11/slotpool.h>
 #include <pkcs11/slot.h>
+#include <pkcs11/stats.h>
+#include <pkcs11/strbpcpy.h>
 #include <pkcs11/debug.h>
 
 extern struct p11Context_t *context;
@@ -47,10 +49,15 @@ static const CK_MECHANISM_TYPE p11MechanismList[] = {
 		CKM_RSA_PKCS,
 		CKM_SHA1_RSA_PKCS,
 		CKM_SHA256_RSA_PKCS,
+		CKM_SHA384_RSA_PKCS,
+		CKM_SHA512_RSA_PKCS,
 		CKM_SHA1_RSA_PKCS_PSS,
 		CKM_SHA256_RSA_PKCS_PSS,
 		CKM_ECDSA,
-		CKM_ECDSA_SHA1
+		CKM_ECDSA_SHA1,
+		CKM_ECDSA_SHA256,
+		CKM_ECDSA_SHA384,
+		CKM_ECDSA_SHA512
 };
 
 
@@ -90,7 +97,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotList)(
 		FUNC_RETURNS(rv);
 	}
 
-	MUTEX_LOCK(&context->slotPool.mutex);
+	RWLOCK_RDLOCK(&context->slotPool.lock);
 
 	cnt = 0;
 	FOR_EACH(slot, context->slotPool.list) {
@@ -112,7 +119,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotList)(
 		}
 	}
 
-	MUTEX_UNLOCK(&context->slotPool.mutex);
+	/* the virtual slot follows the readers, if there is a reader or token to serve it */
+	if (context->slotPool.virtualSlot && (cnt > 0)) {
+		if (pSlotList && cnt < *pulCount) {
+			pSlotList[cnt] = VIRTUAL_SLOT_ID;
+		}
+		cnt++;
+	}
+
+	RWLOCK_RDUNLOCK(&context->slotPool.lock);
 
 	if (pSlotList) {
 		if (cnt > *pulCount) {
@@ -156,17 +171,56 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotInfo)(
 		FUNC_RETURNS(rv);
 	}
 
+	if (getCachedSlotInfo(&context->slotPool, slotID, pInfo, NULL)) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
 	FUNC_FIND_AND_LOCK_SLOT(slotID, &slot);
 
 	getToken(slot, &token);
 
 	*pInfo = slot->info;
 
+	cacheSlotInfo(slot);
+
+	if (slotID == VIRTUAL_SLOT_ID) {
+		strbpcpy(pInfo->slotDescription, VIRTUAL_SLOT_NAME, sizeof(pInfo->slotDescription));
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/*  C_GetSlotStatistics obtains the counters and latency histograms of a slot and optionally resets them. */
+CK_DECLARE_FUNCTION(CK_RV, C_GetSlotStatistics)(
+		CK_SLOT_ID slotID,
+		CK_SC_HSM_SLOT_STATISTICS_PTR pStatistics,
+		CK_BBOOL bReset
+)
+{
+	struct p11Slot_t *slot;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pStatistics)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	FUNC_FIND_AND_LOCK_SLOT(slotID, &slot);
+
+	getSlotStatistics(slot, pStatistics, bReset == CK_TRUE);
+
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
+
 /*  C_GetTokenInfo obtains information about a particular token in the system. */
 CK_DECLARE_FUNCTION(CK_RV, C_GetTokenInfo)(
 		CK_SLOT_ID slotID,
@@ -190,6 +244,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetTokenInfo)(
 	/* caller should never get garbage */
 	memset(pInfo, 0, sizeof(*pInfo));
 
+	/* no need to wait for operations in progress as long as nothing changed */
+	if (getCachedSlotInfo(&context->slotPool, slotID, NULL, pInfo)) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
 	FUNC_FIND_AND_LOCK_SLOT(slotID, &slot);
 
 	rv = getToken(slot, &token);
@@ -200,6 +259,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetTokenInfo)(
 
 	*pInfo = slot->token->info;
 
+	cacheSlotInfo(slot);
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -212,7 +273,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_WaitForSlotEvent)(
 		CK_VOID_PTR pReserved
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
 
 	FUNC_CALLED();
 
@@ -220,6 +281,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_WaitForSlotEvent)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (!isValidPtr(slot) || (pReserved != NULL)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = waitForSlotEvent(&context->slotPool, flags, slot);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -314,6 +381,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismInfo)(
 	case CKM_RSA_PKCS:
 	case CKM_SHA1_RSA_PKCS:
 	case CKM_SHA256_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS:
 	case CKM_SHA1_RSA_PKCS_PSS:
 	case CKM_SHA256_RSA_PKCS_PSS:
 		pInfo->flags = CKF_SIGN;
@@ -324,6 +393,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismInfo)(
 
 	case CKM_ECDSA:
 	case CKM_ECDSA_SHA1:
+	case CKM_ECDSA_SHA256:
+	case CKM_ECDSA_SHA384:
+	case CKM_ECDSA_SHA512:
 		pInfo->flags = CKF_SIGN;
 		pInfo->flags |= CKF_HW|CKF_VERIFY|CKF_GENERATE_KEY_PAIR; // Quick fix for Peter Gutmann's cryptlib
 		pInfo->ulMinKeySize = 192;
@@ -0,0 +1,167 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    p11vendor.h
+ * @brief   Vendor extensions to the PKCS#11 interface
+ */
+
+#ifndef ___P11VENDOR_H_INC___
+#define ___P11VENDOR_H_INC___
+
+#include <pkcs11/cryptoki.h>
+
+#ifdef WIN32
+#pragma pack(push, cryptoki, 1)
+#endif
+
+/**
+ * C_SignBatch signs ulCount data items with the key hKey and the mechanism pMechanism,
+ * as a C_SignInit / C_Sign pair would for each item. The slot is locked once for the
+ * whole batch and the signing commands are sent back to back.
+ *
+ * ppData[i] and pulDataLen[i] describe item i, the signature is written to ppSignature[i]
+ * which has room for pulSignatureLen[i] bytes. pulSignatureLen[i] receives the length of
+ * the signature. If ppSignature is NULL only the signature lengths are returned.
+ *
+ * The batch stops at the first failing item. Signatures of the items before are valid.
+ * No operation must be active in the session, the batch does not change its state.
+ */
+CK_DECLARE_FUNCTION(CK_RV, C_SignBatch)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey,
+		CK_ULONG ulCount,
+		CK_BYTE_PTR CK_PTR ppData,
+		CK_ULONG_PTR pulDataLen,
+		CK_BYTE_PTR CK_PTR ppSignature,
+		CK_ULONG_PTR pulSignatureLen
+);
+
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_SignBatch)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey,
+		CK_ULONG ulCount,
+		CK_BYTE_PTR CK_PTR ppData,
+		CK_ULONG_PTR pulDataLen,
+		CK_BYTE_PTR CK_PTR ppSignature,
+		CK_ULONG_PTR pulSignatureLen
+);
+
+/**
+ * Buckets of a latency histogram: bucket 0 counts durations below 8 us, bucket b > 0 the
+ * durations from (4 + m) << (e - 2) up to (5 + m) << (e - 2) us, with e = 3 + (b - 1) / 4 and
+ * m = (b - 1) % 4, i.e. four buckets per power of 2 with a resolution of 25%. The last bucket
+ * also counts all longer durations.
+ */
+#define CK_SC_HSM_LATENCY_BUCKETS   96
+
+/**
+ * Mechanisms counted per slot. Further mechanisms are counted as CKM_VENDOR_DEFINED.
+ */
+#define CK_SC_HSM_STATS_MECHANISMS  16
+
+typedef struct CK_SC_HSM_LATENCY {
+	unsigned long long count;
+	unsigned long long totalUs;
+	unsigned long long maxUs;
+	unsigned long long histogram[CK_SC_HSM_LATENCY_BUCKETS];
+} CK_SC_HSM_LATENCY;
+
+/**
+ * Signature and decryption operations of one mechanism, length queries are not counted.
+ * The latency is the time of the operation once the slot is locked.
+ */
+typedef struct CK_SC_HSM_MECHANISM_STATISTICS {
+	CK_MECHANISM_TYPE mechanism;
+	unsigned long long calls;
+	unsigned long long errors;
+	CK_SC_HSM_LATENCY latency;
+} CK_SC_HSM_MECHANISM_STATISTICS;
+
+/**
+ * Statistics of a slot since the slot was added or the statistics were reset.
+ * card is the time of each APDU exchange, lockWait the time a thread waited for the slot.
+ */
+typedef struct CK_SC_HSM_SLOT_STATISTICS {
+	unsigned long long apdus;
+	unsigned long long bytesOut;           /* command APDUs */
+	unsigned long long bytesIn;            /* response APDUs including SW1/SW2 */
+	CK_SC_HSM_LATENCY card;
+	CK_SC_HSM_LATENCY lockWait;
+	CK_ULONG mechanismCount;
+	CK_SC_HSM_MECHANISM_STATISTICS mechanism[CK_SC_HSM_STATS_MECHANISMS];
+} CK_SC_HSM_SLOT_STATISTICS;
+
+typedef CK_SC_HSM_SLOT_STATISTICS CK_PTR CK_SC_HSM_SLOT_STATISTICS_PTR;
+
+/**
+ * C_GetSlotStatistics copies the statistics of slot slotID to pStatistics and resets
+ * them if bReset is CK_TRUE. The counters are always maintained. With the environment
+ * variable SC_HSM_STATS naming a file the statistics of all slots are also written
+ * to that file every SC_HSM_STATS_INTERVAL seconds (default 10) and at C_Finalize.
+ */
+CK_DECLARE_FUNCTION(CK_RV, C_GetSlotStatistics)(
+		CK_SLOT_ID slotID,
+		CK_SC_HSM_SLOT_STATISTICS_PTR pStatistics,
+		CK_BBOOL bReset
+);
+
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_GetSlotStatistics)(
+		CK_SLOT_ID slotID,
+		CK_SC_HSM_SLOT_STATISTICS_PTR pStatistics,
+		CK_BBOOL bReset
+);
+
+/**
+ * The vendor function list, returned by C_GetVendorFunctionList. Applications
+ * loading the module dynamically look up C_GetVendorFunctionList next to
+ * C_GetFunctionList. New functions are added at the end and increase the minor version.
+ */
+typedef struct CK_VENDOR_FUNCTION_LIST {
+	CK_VERSION version;
+	CK_C_SignBatch C_SignBatch;
+	CK_C_GetSlotStatistics C_GetSlotStatistics;   /* since 1.1 */
+} CK_VENDOR_FUNCTION_LIST;
+
+typedef CK_VENDOR_FUNCTION_LIST CK_PTR CK_VENDOR_FUNCTION_LIST_PTR;
+typedef CK_VENDOR_FUNCTION_LIST_PTR CK_PTR CK_VENDOR_FUNCTION_LIST_PTR_PTR;
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetVendorFunctionList)(
+		CK_VENDOR_FUNCTION_LIST_PTR_PTR ppFunctionList
+);
+
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_GetVendorFunctionList)(
+		CK_VENDOR_FUNCTION_LIST_PTR_PTR ppFunctionList
+);
+
+#ifdef WIN32
+#pragma pack(pop, cryptoki)
+#endif
+
+#endif /* ___P11VENDOR_H_INC___ */
@@ -37,6 +37,8 @@
 #include <assert.h>
 
 #include <pkcs11/session.h>
+#include <pkcs11/slotpool.h>
+#include <pkcs11/slot.h>
 #include <common/mutex.h>
 
 /**
@@ -50,8 +52,12 @@ void initSessionPool(struct p11SessionPool_t *sessionPool)
 	sessionPool->nextHandle = 1; /* Set initial value of session handles to 1 */
 	                             /* Valid handles have a non-zero value       */
 	sessionPool->count = 0;
+	memset(sessionPool->bucket, 0, sizeof(sessionPool->bucket));
+	sessionPool->cacheCount = 0;
+	sessionPool->cache = NULL;
 
-	MUTEX_INIT(&sessionPool->mutex);
+	RWLOCK_INIT(&sessionPool->lock);
+	MUTEX_INIT(&sessionPool->cacheLock);
 }
 
 
@@ -69,7 +75,95 @@ void terminateSessionPool(struct p11SessionPool_t *sessionPool)
 		freeSession(session);
 	}
 
-	mutex_destroy(&sessionPool->mutex);
+	FOR_EACH_WITH_NEXT(session, next, sessionPool->cache) {
+		freeSession(session);
+	}
+
+	rwlock_destroy(&sessionPool->lock);
+	MUTEX_DESTROY(&sessionPool->cacheLock);
+}
+
+
+
+/**
+ * Allocate a new session, reusing a closed session from the cache if available
+ *
+ * Buffers allocated by the previous user of a cached session are kept, so that a
+ * session opened for a single operation does not need to allocate memory again.
+ *
+ * @param pool      Pointer to session-pool structure
+ * @return          The initialized session or NULL if out of memory
+ */
+struct p11Session_t *newSession(struct p11SessionPool_t *sessionPool)
+{
+	struct p11Session_t *session;
+	CK_BYTE_PTR cryptoBuffer;
+	CK_ULONG cryptoBufferMax;
+	struct p11ObjectSearch_t searchObj;
+
+	MUTEX_LOCK(&sessionPool->cacheLock);
+	session = sessionPool->cache;
+	if (session) {
+		sessionPool->cache = session->next;
+		sessionPool->cacheCount--;
+	}
+	MUTEX_UNLOCK(&sessionPool->cacheLock);
+
+	if (session == NULL) {
+		return (struct p11Session_t *)calloc(1, sizeof(struct p11Session_t));
+	}
+
+	cryptoBuffer = session->cryptoBuffer;
+	cryptoBufferMax = session->cryptoBufferMax;
+	searchObj = session->searchObj;
+
+	memset(session, 0, sizeof(struct p11Session_t));
+
+	session->cryptoBuffer = cryptoBuffer;
+	session->cryptoBufferMax = cryptoBufferMax;
+	session->searchObj = searchObj;
+
+	return session;
+}
+
+
+
+/**
+ * Release a session removed from the session-pool, keeping it for reuse if the cache is not full
+ *
+ * Session objects, the host digest and the content of the crypto buffer are released
+ * immediately.
+ *
+ * @param pool      Pointer to session-pool structure
+ * @param session   Pointer to session structure
+ */
+void releaseSession(struct p11SessionPool_t *sessionPool, struct p11Session_t *session)
+{
+	clearSearchList(session);
+	clearCryptoBuffer(session);
+
+	while (session->objectList) {
+		if (removeSessionObject(session, session->objectList->handle) != CKR_OK) {
+			assert(0);
+			return;
+		}
+	}
+
+	freeHostDigest(session->digest);
+	session->digest = NULL;
+
+	MUTEX_LOCK(&sessionPool->cacheLock);
+	if (sessionPool->cacheCount < SESSION_CACHE_SIZE) {
+		session->next = sessionPool->cache;
+		sessionPool->cache = session;
+		sessionPool->cacheCount++;
+		session = NULL;
+	}
+	MUTEX_UNLOCK(&sessionPool->cacheLock);
+
+	if (session) {
+		freeSession(session);
+	}
 }
 
 
@@ -88,7 +182,7 @@ void safeAddSession(struct p11SessionPool_t *sessionPool, struct p11Session_t *s
 
 	session->next = NULL;
 	
-	MUTEX_LOCK(&sessionPool->mutex);
+	RWLOCK_WRLOCK(&sessionPool->lock);
 
 	FOR_EACH_REF(ppSession, sessionPool->list) {
 		/* until points to the next field of the last element */
@@ -101,7 +195,61 @@ void safeAddSession(struct p11SessionPool_t *sessionPool, struct p11Session_t *s
 		sessionPool->nextHandle = 1;
 	sessionPool->count++;
 
-	MUTEX_UNLOCK(&sessionPool->mutex);
+	ppSession = &sessionPool->bucket[session->handle & (SESSION_BUCKETS - 1)];
+	session->nextInBucket = *ppSession;
+	*ppSession = session;
+
+	RWLOCK_WRUNLOCK(&sessionPool->lock);
+}
+
+
+
+/**
+ * Find a session by it's handle in the session index. The caller must hold the session-pool lock.
+ *
+ * @param pool      Pointer to session-pool structure
+ * @param handle    The handle of the session
+ * @return          The session or NULL if not found
+ */
+struct p11Session_t *findSession(struct p11SessionPool_t *sessionPool, CK_SESSION_HANDLE handle)
+{
+	struct p11Session_t *session;
+
+	for (session = sessionPool->bucket[handle & (SESSION_BUCKETS - 1)]; session; session = session->nextInBucket) {
+		if (session->handle == handle)
+			break;
+	}
+
+	return session;
+}
+
+
+
+/**
+ * Remove a session from the session list and the index. The caller must hold the session-pool
+ * lock exclusively.
+ *
+ * @param pool      Pointer to session-pool structure
+ * @param session   Pointer to session structure
+ */
+void unlinkSession(struct p11SessionPool_t *sessionPool, struct p11Session_t *session)
+{
+	struct p11Session_t **ppSession;
+
+	FOR_EACH_REF(ppSession, sessionPool->list) {
+		if (*ppSession == session) {
+			*ppSession = session->next;
+			sessionPool->count--;
+			break;
+		}
+	}
+
+	for (ppSession = &sessionPool->bucket[session->handle & (SESSION_BUCKETS - 1)]; *ppSession; ppSession = &(*ppSession)->nextInBucket) {
+		if (*ppSession == session) {
+			*ppSession = session->nextInBucket;
+			break;
+		}
+	}
 }
 
 
@@ -118,10 +266,11 @@ void safeAddSession(struct p11SessionPool_t *sessionPool, struct p11Session_t *s
  * @param handle       The handle of the session.
  * @param ppSession    Pointer to a session structure pointer.
  *                     If the session is found, it is returned in this pointer.
+ * @param priority     The priority class in which to wait for the slot, see lockSlot().
  * @return CKR_OK or CKR_SESSION_HANDLE_INVALID or CKR_OPERATION_ACTIVE
  */
 int safeFindSessionAndLockSlot(struct p11SessionPool_t *sessionPool, struct p11SlotPool_t *slotPool,
-	CK_SESSION_HANDLE handle, struct p11Session_t **ppSession, struct p11Slot_t **ppSlot)
+	CK_SESSION_HANDLE handle, struct p11Session_t **ppSession, struct p11Slot_t **ppSlot, int priority)
 {
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
@@ -134,29 +283,25 @@ int safeFindSessionAndLockSlot(struct p11SessionPool_t *sessionPool, struct p11S
 	}
 
 	/* lookup session */
-	MUTEX_LOCK(&sessionPool->mutex);
-	FOR_EACH(session, sessionPool->list) {
-		if (session->handle == handle) {
-			/* prevent deletion of session */
-			InterlockedIncrement(&session->queuing);
-			break;
-		}
+	RWLOCK_RDLOCK(&sessionPool->lock);
+	session = findSession(sessionPool, handle);
+	if (session) {
+		/* prevent deletion of session */
+		InterlockedIncrement(&session->queuing);
 	}
-	MUTEX_UNLOCK(&sessionPool->mutex);
+	RWLOCK_RDUNLOCK(&sessionPool->lock);
 	if (session == NULL) {
 		return CKR_SESSION_HANDLE_INVALID;
 	}
 
 	/* lookup slot */
-	MUTEX_LOCK(&slotPool->mutex);
-	FOR_EACH(slot, slotPool->list) {
-		if (slot->id == session->slotID) {
-			/* prevent deletion of slot */
-			InterlockedIncrement(&slot->queuing);
-			break;
-		}
+	RWLOCK_RDLOCK(&slotPool->lock);
+	slot = findSlot(slotPool, session->homeSlotID);
+	if (slot) {
+		/* prevent deletion of slot */
+		InterlockedIncrement(&slot->queuing);
 	}
-	MUTEX_UNLOCK(&slotPool->mutex);
+	RWLOCK_RDUNLOCK(&slotPool->lock);
 	if (slot == NULL) {
 		InterlockedDecrement(&session->queuing);
 		return CKR_DEVICE_REMOVED;
@@ -169,15 +314,15 @@ int safeFindSessionAndLockSlot(struct p11SessionPool_t *sessionPool, struct p11S
 
 	/* Unprotected area here. We must ensure that the session and slot pointer is still valid after
 	   obtaining the slot mutex. This is handled by incrementing session->queuing while
-	   holding the session pool mutex, and decrement after possessing the slot mutex.
-	   The deletion function must check session->queuing when holding the session pool mutex
+	   holding the session pool lock, and decrement after possessing the slot mutex.
+	   The deletion function must check session->queuing when holding the session pool lock
 	   and unlink the session immediately. If session->queuing > 0 deletion must be cancelled.
 	   Otherwise another thread could get a session pointer which points to freed memory.
 	   Same applies to the slot.
-	   Acquire the slot mutex while owning the slot pool mutex is a performace killer. */
+	   Acquire the slot mutex while owning the slot pool lock is a performace killer. */
 
 	/* Acquire the slot mutex */
-	MUTEX_LOCK(&slot->mutex);
+	lockSlot(slot, priority);
 
 	InterlockedDecrement(&slot->queuing);
 	InterlockedDecrement(&session->queuing);
@@ -220,17 +365,17 @@ int safeFindFirstSessionBySlotID(struct p11SessionPool_t *sessionPool, CK_SLOT_I
 {
 	struct p11Session_t *session;
 
-	MUTEX_LOCK(&sessionPool->mutex);
+	RWLOCK_RDLOCK(&sessionPool->lock);
 
 	FOR_EACH(session, sessionPool->list) {
 		if (session->slotID == slotID) {
-			MUTEX_UNLOCK(&sessionPool->mutex);
+			RWLOCK_RDUNLOCK(&sessionPool->lock);
 			*phSession = session->handle;
 			return CKR_OK;
 		}
 	}
 
-	MUTEX_UNLOCK(&sessionPool->mutex);
+	RWLOCK_RDUNLOCK(&sessionPool->lock);
 
 	*phSession = CK_INVALID_HANDLE;
 	return CKR_FUNCTION_FAILED;
@@ -256,6 +401,9 @@ void freeSession(struct p11Session_t *session)
 		session->cryptoBufferSize = 0;
 	}
 
+	free(session->searchObj.handles);
+
+	freeHostDigest(session->digest);
 	free(session);
 }
 
@@ -306,6 +454,7 @@ void addSessionObject(struct p11Session_t *session, struct p11Object_t *object)
 	object->dirtyFlag = 0;
 
 	addObjectToList(&session->objectList, object);
+	addObjectToIndex(session->objectIndex, object);
 
 	session->objectCount++;
 }
@@ -317,20 +466,9 @@ void addSessionObject(struct p11Session_t *session, struct p11Object_t *object)
  */
 int findSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle, struct p11Object_t **ppObject)
 {
-	struct p11Object_t *object;
-	int pos;  /* remember the current position in the list */
-
-	pos = 0;
-	FOR_EACH(object, session->objectList) {
-		if (object->handle == handle) {
-			*ppObject = object;
-			return pos;
-		}
-		pos++;
-	}
+	*ppObject = findObjectInIndex(session->objectIndex, handle);
 
-	*ppObject = NULL;
-	return -1;
+	return *ppObject ? 0 : -1;
 }
 
 
@@ -340,8 +478,16 @@ int findSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle, str
  */
 int removeSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle)
 {
+	struct p11Object_t *object;
 	int rc;
 
+	object = findObjectInIndex(session->objectIndex, handle);
+
+	if (object == NULL)
+		return CKR_OBJECT_HANDLE_INVALID;
+
+	removeObjectFromIndex(session->objectIndex, object);
+
 	rc = removeObjectFromList(&session->objectList, handle);
 
 	if (rc != CKR_OK)
@@ -355,28 +501,28 @@ int removeSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle)
 
 
 /**
- * Add an object to the search list by make a shallow copy of the object
+ * Add the handle of an object to the search result
  */
 int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *object)
 {
-	struct p11Object_t **ppObject;
-	struct p11Object_t *pNewObject;
+	struct p11ObjectSearch_t *search = &session->searchObj;
+	CK_OBJECT_HANDLE *handles;
+	int space;
 
-	pNewObject = (struct p11Object_t *)calloc(1, sizeof(struct p11Object_t));
+	if (search->objectCount == search->objectSpace) {
+		space = search->objectSpace ? search->objectSpace * 2 : 16;
 
-	if (pNewObject == NULL) {
-		return CKR_HOST_MEMORY;
-	}
+		handles = (CK_OBJECT_HANDLE *)realloc(search->handles, space * sizeof(CK_OBJECT_HANDLE));
 
-	*pNewObject = *object;
-	pNewObject->next = NULL;
+		if (handles == NULL) {
+			return CKR_HOST_MEMORY;
+		}
 
-	FOR_EACH_REF(ppObject, session->searchObj.searchList) {
-		/* until points to the next field of the last element */
+		search->handles = handles;
+		search->objectSpace = space;
 	}
 
-	*ppObject = pNewObject;
-	session->searchObj.objectCount++;
+	search->handles[search->objectCount++] = object->handle;
 
 	return CKR_OK;
 }
@@ -384,21 +530,12 @@ int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *obje
 
 
 /**
- * Clear the search results list
+ * Clear the search result, keeping the allocated space for the next search
  */
 void clearSearchList(struct p11Session_t *session)
 {
-	struct p11Object_t *object, *pNext;
-
-	// Objects on the search list are not a deep copy of the actual object
-	// thats why we don't use removeAllObjectsFromList() here
-	FOR_EACH_WITH_NEXT(object, pNext, session->searchObj.searchList) {
-		free(object);
-	}
-
 	session->searchObj.objectCount = 0;
 	session->searchObj.objectCollected = 0;
-	session->searchObj.searchList = NULL;
 }
 
 
@@ -450,4 +587,7 @@ void clearCryptoBuffer(struct p11Session_t *session)
 		memset(session->cryptoBuffer, 0, session->cryptoBufferMax);
 		session->cryptoBufferSize = 0;
 	}
+
+	freeHostDigest(session->digest);
+	session->digest = NULL;
 }
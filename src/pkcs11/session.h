@@ -37,13 +37,15 @@
 #include <pkcs11/p11generic.h>
 #include <pkcs11/cryptoki.h>
 #include <pkcs11/object.h>
+#include <pkcs11/digest.h>
 
 
 struct p11ObjectSearch_t
 {
 	int objectCount;
 	int objectCollected; /* so far */
-	struct p11Object_t *searchList;
+	int objectSpace;     /* allocated entries in handles */
+	CK_OBJECT_HANDLE *handles;
 };
 
 
@@ -56,18 +58,23 @@ struct p11Session_t
 {
 	CK_FLAGS flags;                     /**< The flags of this session                 */
 	CK_SLOT_ID slotID;                  /**< The the slot for this session             */
+	CK_SLOT_ID homeSlotID;              /**< The slot serving the session, see slotpool.c */
 	CK_SESSION_HANDLE handle;           /**< The handle of the session                 */
 	unsigned queuing;                   /**< Used to preventing session deletion       */
 	int activeObjectHandle;             /**< active object or CK_INVALID_HANDLE        */
 	CK_MECHANISM_TYPE activeMechanism;  /**< The currently active mechanism            */
+	struct p11KeyIdentity_t activeKey;  /**< Identity of the active key, see slotpool.c */
 	CK_BYTE_PTR cryptoBuffer;           /**< Buffer storing intermediate results       */
 	CK_ULONG cryptoBufferSize;          /**< Current content of crypto buffer          */
 	CK_ULONG cryptoBufferMax;           /**< Current size of crypto buffer             */
+	struct p11Digest_t *digest;         /**< Host digest of a hash-and-sign operation  */
 	struct p11ObjectSearch_t searchObj; /**< Store the result of a search operation    */
 	CK_LONG nextSessionObjHandle;       /**< Value of next assigned object handle      */
 	int objectCount;                    /**< The number of objects in this session     */
 	struct p11Object_t *objectList;     /**< Pointer to first object in pool           */
+	struct p11Object_t *objectIndex[OBJECT_BUCKETS]; /**< Session objects by handle    */
 	struct p11Session_t *next;          /**< Pointer to next active session, NULL else */
+	struct p11Session_t *nextInBucket;  /**< Pointer to next session in the index bucket */
 };
 
 /* function prototypes */
@@ -75,9 +82,13 @@ struct p11Session_t
 void initSessionPool(struct p11SessionPool_t *pool);
 void terminateSessionPool(struct p11SessionPool_t *pool);
 void freeSession(struct p11Session_t *session);
+struct p11Session_t *newSession(struct p11SessionPool_t *pool);
+void releaseSession(struct p11SessionPool_t *pool, struct p11Session_t *session);
 void safeAddSession(struct p11SessionPool_t *pool, struct p11Session_t *session);
+struct p11Session_t *findSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle);
+void unlinkSession(struct p11SessionPool_t *pool, struct p11Session_t *session);
 int safeFindSessionAndLockSlot(struct p11SessionPool_t *sessionPool, struct p11SlotPool_t *slotPool,
-	CK_SESSION_HANDLE handle, struct p11Session_t **ppSession, struct p11Slot_t **ppSlot);
+	CK_SESSION_HANDLE handle, struct p11Session_t **ppSession, struct p11Slot_t **ppSlot, int priority);
 int safeFindFirstSessionBySlotID(struct p11SessionPool_t *pool, CK_SLOT_ID slotID, CK_SESSION_HANDLE *phSession);
 CK_STATE getSessionState(struct p11Session_t *session, struct p11Slot_t *slot);
 void addSessionObject(struct p11Session_t *session, struct p11Object_t *object);
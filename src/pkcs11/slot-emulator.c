@@ -0,0 +1,164 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    slot-emulator.c
+ * @brief   Slot implementation for the readers of the SmartCard-HSM emulator
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkcs11/slot.h>
+#include <pkcs11/token.h>
+#include <pkcs11/slotpool.h>
+#include <pkcs11/slot-emulator.h>
+
+#include <pkcs11/strbpcpy.h>
+
+#ifdef DEBUG
+#include <pkcs11/debug.h>
+#endif
+
+extern struct p11Context_t *context;
+
+
+
+/**
+ * Transmit APDU to the emulated card of the slot, which needs no encoding
+ *
+ * @param slot the slot to use for communication
+ * @param apdu the command, receives the response
+ * @return -1 for error or length of the response data
+ */
+int transmitAPDUviaEmulator(struct p11Slot_t *slot, struct apdu *apdu)
+{
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = emu_transmit(slot->emuReader, apdu);
+
+	if (rc < 0) {
+		FUNC_FAILS(-1, "emu_transmit failed");
+	}
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * The emulated card is always present, create the token when the slot is used first
+ *
+ * @param slot       Pointer to slot structure.
+ * @param token      Pointer to pointer updated with the token of the slot.
+ */
+int getEmulatorToken(struct p11Slot_t *slot, struct p11Token_t **token)
+{
+	struct p11Token_t *ptoken;
+	int rc;
+
+	FUNC_CALLED();
+
+	if (!slot->token) {
+		emu_reset(slot->emuReader);
+
+		rc = newToken(slot, &ptoken);
+
+		if (rc != CKR_OK) {
+			*token = NULL;
+			FUNC_FAILS(rc, "newToken() failed");
+		}
+
+		addToken(slot, ptoken);
+	}
+
+	*token = slot->token;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Add a slot for each reader of the emulator, the readers are never removed
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ */
+int updateEmulatorSlots(struct p11SlotPool_t *slotPool)
+{
+	struct p11Slot_t *slot;
+	char scr[64];
+
+	FUNC_CALLED();
+
+	for (slot = slotPool->list; slot; slot = slot->next) {
+		slot->present = TRUE;
+		slot->closed = FALSE;
+	}
+
+	while ((slotPool->count < emu_readers()) && (slotPool->count < MAX_SLOTS)) {
+		slot = (struct p11Slot_t *) calloc(1, sizeof(struct p11Slot_t));
+
+		if (slot == NULL) {
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
+
+		slot->emuReader = slotPool->count;
+		slot->present = TRUE;
+		slot->closed = FALSE;
+
+		sprintf(scr, "%s %d", EMU_READER_NAME, slot->emuReader);
+#ifndef CTAPI
+		strcpy(slot->readerName, scr);
+#endif
+		strbpcpy(slot->info.slotDescription,
+				scr,
+				sizeof(slot->info.slotDescription));
+
+		strbpcpy(slot->info.manufacturerID,
+				"CardContact",
+				sizeof(slot->info.manufacturerID));
+
+		slot->info.flags = CKF_REMOVABLE_DEVICE;
+		addSlot(&context->slotPool, slot);
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+int closeEmulatorSlot(struct p11Slot_t *slot)
+{
+	FUNC_CALLED();
+
+	slot->closed = TRUE;
+
+	FUNC_RETURNS(CKR_OK);
+}
@@ -39,6 +39,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
 
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
@@ -547,9 +549,465 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 
 
 
+/*
+ * The slot monitor is a thread waiting in SCardGetStatusChange() for card events in all
+ * readers and reader changes reported for the PnP notification pseudo reader. It records
+ * the reader state in the slot, so that getPCSCToken() needs no SCardStatus() round trip
+ * while the card stays in the reader, and queues slot events for C_WaitForSlotEvent().
+ */
+#define PNP_NOTIFICATION        "\\\\?PnP?\\Notification"
+#define MONITOR_TIMEOUT_MS      1000    /* bounds the time stopPCSCSlotMonitor() waits    */
+#define MONITOR_RETRY_MS        2000    /* delay before reconnecting to the PC/SC manager */
+#define PNP_SLOT_ID             ((CK_SLOT_ID)~0)  /* slot id of the PnP notification entry */
+
+/* reader state bits that indicate a card insertion, removal or a card that can't be used */
+#define CARD_STATE_MASK         (SCARD_STATE_EMPTY | SCARD_STATE_PRESENT | SCARD_STATE_MUTE | SCARD_STATE_UNAVAILABLE)
+
+static struct {
+	SCARDCONTEXT context;                  /* context of the monitor thread, for SCardCancel */
+	int running;                           /* monitor thread was started                     */
+	volatile int stop;                     /* monitor thread shall terminate                 */
+	volatile int watching;                 /* monitor thread receives events                 */
+	volatile int pnp;                      /* PnP notification supported by the manager      */
+	volatile int readersChanged;           /* reader list changed since the last update      */
+	int eventCount;                        /* number of queued slot events                   */
+	CK_SLOT_ID events[MAX_SLOTS];          /* slots with an event, oldest first              */
+} monitor;
+
+#ifndef _WIN32
+static pthread_t monitorThread;
+static pthread_mutex_t monitorLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t monitorCond = PTHREAD_COND_INITIALIZER;
+#define MONITOR_LOCK()          pthread_mutex_lock(&monitorLock)
+#define MONITOR_UNLOCK()        pthread_mutex_unlock(&monitorLock)
+#define MONITOR_WAIT()          pthread_cond_wait(&monitorCond, &monitorLock)
+#define MONITOR_BROADCAST()     pthread_cond_broadcast(&monitorCond)
+#else
+static HANDLE monitorThread;
+static SRWLOCK monitorLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE monitorCond = CONDITION_VARIABLE_INIT;
+#define MONITOR_LOCK()          AcquireSRWLockExclusive(&monitorLock)
+#define MONITOR_UNLOCK()        ReleaseSRWLockExclusive(&monitorLock)
+#define MONITOR_WAIT()          SleepConditionVariableSRW(&monitorCond, &monitorLock, INFINITE, 0)
+#define MONITOR_BROADCAST()     WakeAllConditionVariable(&monitorCond)
+#endif
+
+
+
+/**
+ * Wait up to ms milliseconds or until the monitor is stopped
+ */
+static void monitorDelay(int ms)
+{
+#ifndef _WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+#endif
+
+	MONITOR_LOCK();
+	if (!monitor.stop) {
+#ifndef _WIN32
+		pthread_cond_timedwait(&monitorCond, &monitorLock, &ts);
+#else
+		SleepConditionVariableSRW(&monitorCond, &monitorLock, ms, 0);
+#endif
+	}
+	MONITOR_UNLOCK();
+}
+
+
+
+/**
+ * Interrupt SCardGetStatusChange() in the monitor thread, e.g. to watch a new slot
+ */
+static void wakeMonitor(void)
+{
+	MONITOR_LOCK();
+	if (monitor.context) {
+		SCardCancel(monitor.context);
+	}
+	MONITOR_UNLOCK();
+}
+
+
+
+/**
+ * Queue an event for the slot, unless one is already pending
+ */
+static void postSlotEvent(CK_SLOT_ID id)
+{
+	int i;
+
+	MONITOR_LOCK();
+	for (i = 0; (i < monitor.eventCount) && (monitor.events[i] != id); i++);
+
+	if ((i == monitor.eventCount) && (i < MAX_SLOTS)) {
+		monitor.events[monitor.eventCount++] = id;
+	}
+	MONITOR_BROADCAST();
+	MONITOR_UNLOCK();
+}
+
+
+
+/**
+ * Record the reader state reported for a slot.
+ *
+ * Any card event increments cardChanges, which makes getPCSCToken() check the card again.
+ * So does the first report for a slot, as the token may have been added before the slot
+ * was monitored.
+ *
+ * @param pool       Pointer to slot-pool structure.
+ * @param id         The slot id
+ * @param state      The event state reported by SCardGetStatusChange()
+ * @param added      The slot was added while the monitor was running
+ */
+static void updateReaderState(struct p11SlotPool_t *pool, CK_SLOT_ID id, DWORD state, int added)
+{
+	struct p11Slot_t *slot;
+	int event = FALSE;
+
+	RWLOCK_RDLOCK(&pool->lock);
+
+	slot = findSlot(pool, id);
+	if (slot) {
+		if (!slot->monitored) {
+			slot->cardChanges++;
+			event = added;
+		} else if (((slot->readerState ^ state) & CARD_STATE_MASK) || ((slot->readerState >> 16) != (state >> 16))) {
+			/* the upper 16 bit count the card events in the reader */
+			slot->cardChanges++;
+			event = TRUE;
+		}
+		slot->readerState = state;
+		slot->monitored = TRUE;
+	}
+
+	RWLOCK_RDUNLOCK(&pool->lock);
+
+	if (event) {
+		postSlotEvent(id);
+	}
+}
+
+
+
+/**
+ * Fall back to SCardStatus() for all slots after the monitor lost the PC/SC manager
+ */
+static void forgetReaderStates(struct p11SlotPool_t *pool)
+{
+	struct p11Slot_t *slot;
+
+	RWLOCK_RDLOCK(&pool->lock);
+	FOR_EACH(slot, pool->list) {
+		slot->monitored = FALSE;
+	}
+	RWLOCK_RDUNLOCK(&pool->lock);
+}
+
+
+
+/**
+ * Fill the reader state list with the PnP notification and the open slots
+ *
+ * @return           The number of entries
+ */
+static DWORD listMonitoredSlots(struct p11SlotPool_t *pool, SCARD_READERSTATE *states, CK_SLOT_ID *ids, char names[][MAX_READERNAME])
+{
+	struct p11Slot_t *slot;
+	DWORD count = 0;
+
+	memset(states, 0, sizeof(SCARD_READERSTATE) * (MAX_SLOTS + 1));
+
+	if (monitor.pnp) {
+		states[count].szReader = PNP_NOTIFICATION;
+		states[count].dwCurrentState = SCARD_STATE_UNAWARE;
+		ids[count] = PNP_SLOT_ID;
+		count++;
+	}
+
+	RWLOCK_RDLOCK(&pool->lock);
+	FOR_EACH(slot, pool->list) {
+		if (slot->closed || (count > MAX_SLOTS)) {
+			continue;
+		}
+		strcpy(names[count], slot->readerName);
+		states[count].szReader = names[count];
+		states[count].dwCurrentState = SCARD_STATE_UNAWARE;
+		ids[count] = slot->id;
+		count++;
+	}
+	RWLOCK_RDUNLOCK(&pool->lock);
+
+	return count;
+}
+
+
+
+/**
+ * Wait for reader and card events until the monitor is stopped or the context becomes invalid
+ */
+static void watchReaders(struct p11SlotPool_t *pool, SCARDCONTEXT hContext)
+{
+	SCARD_READERSTATE states[MAX_SLOTS + 1];
+	CK_SLOT_ID ids[MAX_SLOTS + 1], known[MAX_SLOTS + 1];
+	char names[MAX_SLOTS + 1][MAX_READERNAME];
+	DWORD count = 0, knownCount = 0, i, j;
+	int rebuild = TRUE, first = TRUE, added;
+	LONG rc = SCARD_S_SUCCESS;
+
+	while (!monitor.stop) {
+		if (rebuild) {
+			if (monitor.readersChanged) {
+				safeUpdateSlots(pool);
+			}
+			count = listMonitoredSlots(pool, states, ids, names);
+			rebuild = FALSE;
+		}
+
+		rc = SCardGetStatusChange(hContext, MONITOR_TIMEOUT_MS, states, count);
+
+		if (rc == SCARD_E_TIMEOUT) {
+			continue;
+		}
+
+		if (rc == SCARD_E_CANCELLED) {
+			/* woken up by wakeMonitor() or stopPCSCSlotMonitor() */
+			rebuild = TRUE;
+			continue;
+		}
+
+		if ((rc == SCARD_E_UNKNOWN_READER) && monitor.pnp) {
+			/* manager does not know the PnP notification reader */
+			monitor.pnp = FALSE;
+			rebuild = TRUE;
+			continue;
+		}
+
+		if (rc != SCARD_S_SUCCESS) {
+			break;
+		}
+
+		monitor.watching = TRUE;
+
+		for (i = 0; i < count; i++) {
+			if (!(states[i].dwEventState & SCARD_STATE_CHANGED)) {
+				continue;
+			}
+
+			if (ids[i] == PNP_SLOT_ID) {
+				if (states[i].dwEventState & SCARD_STATE_UNKNOWN) {
+					monitor.pnp = FALSE;
+					rebuild = TRUE;
+				} else if (states[i].dwCurrentState != SCARD_STATE_UNAWARE) {
+					monitor.readersChanged = TRUE;
+					rebuild = TRUE;
+				}
+			} else {
+				added = FALSE;
+				if ((states[i].dwCurrentState == SCARD_STATE_UNAWARE) && !first) {
+					for (j = 0; (j < knownCount) && (known[j] != ids[i]); j++);
+					added = (j == knownCount);
+				}
+
+				updateReaderState(pool, ids[i], states[i].dwEventState, added);
+
+				if (states[i].dwEventState & (SCARD_STATE_UNKNOWN | SCARD_STATE_IGNORE)) {
+					/* reader was removed */
+					monitor.readersChanged = TRUE;
+					rebuild = TRUE;
+				}
+			}
+			states[i].dwCurrentState = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+		}
+
+		/* slots reported so far, later slots are new */
+		memcpy(known, ids, sizeof(CK_SLOT_ID) * count);
+		knownCount = count;
+		first = FALSE;
+	}
+
+	monitor.watching = FALSE;
+
+#ifdef DEBUG
+	debug("Slot monitor leaves SCardGetStatusChange with %lx\n", (unsigned long)rc);
+#endif
+}
+
+
+
+#ifndef _WIN32
+static void *slotMonitor(void *arg)
+#else
+static DWORD WINAPI slotMonitor(LPVOID arg)
+#endif
+{
+	struct p11SlotPool_t *pool = (struct p11SlotPool_t *)arg;
+	SCARDCONTEXT hContext;
+	LONG rc;
+
+	while (!monitor.stop) {
+		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+
+		if (rc == SCARD_S_SUCCESS) {
+			MONITOR_LOCK();
+			monitor.context = hContext;
+			MONITOR_UNLOCK();
+
+			watchReaders(pool, hContext);
+
+			MONITOR_LOCK();
+			monitor.context = 0;
+			MONITOR_UNLOCK();
+
+			SCardReleaseContext(hContext);
+
+			forgetReaderStates(pool);
+			monitor.readersChanged = TRUE;
+		}
+
+		if (!monitor.stop) {
+			/* the PC/SC manager is not running or was restarted */
+			monitorDelay(MONITOR_RETRY_MS);
+		}
+	}
+
+	return 0;
+}
+
+
+
+/**
+ * Start the slot monitor thread.
+ *
+ * The module keeps polling the readers if the thread can not be created.
+ *
+ * @param pool       Pointer to slot-pool structure.
+ * @return           CKR_OK or CKR_FUNCTION_FAILED
+ */
+int startPCSCSlotMonitor(struct p11SlotPool_t *pool)
+{
+	FUNC_CALLED();
+
+	monitor.stop = FALSE;
+	monitor.watching = FALSE;
+	monitor.pnp = TRUE;
+	monitor.readersChanged = TRUE;
+	monitor.eventCount = 0;
+
+#ifndef _WIN32
+	monitor.running = (pthread_create(&monitorThread, NULL, slotMonitor, pool) == 0);
+#else
+	monitorThread = CreateThread(NULL, 0, slotMonitor, pool, 0, NULL);
+	monitor.running = (monitorThread != NULL);
+#endif
+
+	if (!monitor.running) {
+		FUNC_FAILS(CKR_FUNCTION_FAILED, "Could not create slot monitor thread");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Stop the slot monitor thread and release threads waiting in waitForPCSCSlotEvent()
+ *
+ * @param pool       Pointer to slot-pool structure.
+ */
+void stopPCSCSlotMonitor(struct p11SlotPool_t *pool)
+{
+	if (!monitor.running) {
+		return;
+	}
+
+	MONITOR_LOCK();
+	monitor.stop = TRUE;
+	if (monitor.context) {
+		SCardCancel(monitor.context);
+	}
+	MONITOR_BROADCAST();
+	MONITOR_UNLOCK();
+
+#ifndef _WIN32
+	pthread_join(monitorThread, NULL);
+#else
+	WaitForSingleObject(monitorThread, INFINITE);
+	CloseHandle(monitorThread);
+#endif
+	monitor.running = FALSE;
+}
+
+
+
+/**
+ * Wait for a slot event queued by the slot monitor
+ *
+ * @param pool       Pointer to slot-pool structure.
+ * @param flags      CKF_DONT_BLOCK to return immediately
+ * @param pSlot      Receives the slot id
+ * @return           CKR_OK, CKR_NO_EVENT, CKR_CRYPTOKI_NOT_INITIALIZED or CKR_FUNCTION_NOT_SUPPORTED
+ */
+int waitForPCSCSlotEvent(struct p11SlotPool_t *pool, CK_FLAGS flags, CK_SLOT_ID_PTR pSlot)
+{
+	int rc;
+
+	if (!monitor.running) {
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	}
+
+	MONITOR_LOCK();
+
+	while (!monitor.eventCount && !monitor.stop && !(flags & CKF_DONT_BLOCK)) {
+		MONITOR_WAIT();
+	}
+
+	if (monitor.stop) {
+		rc = CKR_CRYPTOKI_NOT_INITIALIZED;
+	} else if (monitor.eventCount) {
+		*pSlot = monitor.events[0];
+		monitor.eventCount--;
+		memmove(monitor.events, monitor.events + 1, sizeof(CK_SLOT_ID) * monitor.eventCount);
+		rc = CKR_OK;
+	} else {
+		rc = CKR_NO_EVENT;
+	}
+
+	MONITOR_UNLOCK();
+
+	return rc;
+}
+
+
+
 int getPCSCToken(struct p11Slot_t *slot, struct p11Token_t **ppToken)
 {
 	int rc;
+	unsigned changes;
+
+	if (slot->monitored) {
+		/* no SCardStatus() as long as the monitor reports no card event */
+		if (slot->token && (slot->tokenCardChanges == slot->cardChanges)) {
+			*ppToken = slot->token;
+			return CKR_OK;
+		}
+
+		if (!slot->token && !(slot->readerState & SCARD_STATE_PRESENT)) {
+			*ppToken = NULL;
+			return CKR_TOKEN_NOT_PRESENT;
+		}
+	}
+
+	changes = slot->cardChanges;
 
 	if (slot->token) {
 		rc = checkForRemovedPCSCToken(slot);
@@ -557,19 +1015,152 @@ int getPCSCToken(struct p11Slot_t *slot, struct p11Token_t **ppToken)
 		rc = checkForNewPCSCToken(slot);
 	}
 
+	if (rc == CKR_OK) {
+		slot->tokenCardChanges = changes;
+	}
+
 	*ppToken = slot->token;
 	return rc;
 }
 
 
 
+/*
+ * Context and reader list for updatePCSCSlots(), kept from one update to the next. Both are
+ * protected by the slot-pool lock, which updatePCSCSlots() is called with.
+ */
+static SCARDCONTEXT listContext;
+static char *readerBuffer;                 /* reader list read by listReaders()          */
+static DWORD readerBufferSize;
+static char *lastReaders;                  /* reader list of the last full update        */
+static DWORD lastReadersLength;            /* length of lastReaders, 0 if there is none  */
+
+
+
+/**
+ * Return a valid context for listing the readers, establishing a new one if required
+ */
+static LONG getListContext(SCARDCONTEXT *phContext)
+{
+	LONG rc;
+
+	if (listContext && (SCardIsValidContext(listContext) == SCARD_S_SUCCESS)) {
+		*phContext = listContext;
+		return SCARD_S_SUCCESS;
+	}
+
+	if (listContext) {
+		SCardReleaseContext(listContext);
+		listContext = 0;
+	}
+
+	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &listContext);
+
+	if (rc != SCARD_S_SUCCESS) {
+		listContext = 0;
+		return rc;
+	}
+
+	*phContext = listContext;
+	return SCARD_S_SUCCESS;
+}
+
+
+
+/**
+ * Read the reader names into readerBuffer, growing the buffer as required
+ *
+ * @param hContext   The context to use
+ * @param len        Receives the length of the multi-string in readerBuffer
+ */
+static LONG listReaders(SCARDCONTEXT hContext, DWORD *len)
+{
+	LONG rc;
+	char *p;
+
+	for (;;) {
+		if (readerBuffer == NULL) {
+			readerBuffer = malloc(256);
+			if (readerBuffer == NULL) {
+				return SCARD_E_NO_MEMORY;
+			}
+			readerBufferSize = 256;
+		}
+
+		*len = readerBufferSize;
+		rc = SCardListReaders(hContext, NULL, readerBuffer, len);
+
+		if (rc == SCARD_E_NO_READERS_AVAILABLE) {
+			readerBuffer[0] = '\0';
+			*len = 1;
+			return SCARD_S_SUCCESS;
+		}
+
+		if (rc != SCARD_E_INSUFFICIENT_BUFFER) {
+			return rc;
+		}
+
+		rc = SCardListReaders(hContext, NULL, NULL, len);
+
+		if (rc != SCARD_S_SUCCESS) {
+			return rc;
+		}
+
+		p = realloc(readerBuffer, *len);
+		if (p == NULL) {
+			return SCARD_E_NO_MEMORY;
+		}
+		readerBuffer = p;
+		readerBufferSize = *len;
+	}
+}
+
+
+
+static int hasClosedSlots(struct p11SlotPool_t *slotPool)
+{
+	struct p11Slot_t *slot;
+
+	FOR_EACH(slot, slotPool->list) {
+		if (slot->closed) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+
+
+static unsigned long hashReaderName(const char *name)
+{
+	unsigned long h = 2166136261UL;
+
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * 16777619UL;
+	}
+	return h & 0xFFFFFFFFUL;
+}
+
+
+
+/**
+ * updatePCSCSlots adds a slot for each new reader and marks the slots of attached readers present.
+ *
+ * The reader list is compared with the list of the last update first, so that the slot list
+ * is only changed if readers were attached or detached. New readers are matched against the
+ * open slots by the hash of the reader name.
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ */
 int updatePCSCSlots(struct p11SlotPool_t *slotPool)
 {
 	struct p11Slot_t *slot;
-	LPTSTR readers = NULL, reader;
-	DWORD cch = SCARD_AUTOALLOCATE;
+	struct p11Slot_t *nameBucket[SLOT_BUCKETS];
+	char *reader, *p;
+	DWORD len;
 	LONG rc;
-	int match;
+	unsigned long hash;
+	int added;
 	SCARDCONTEXT hContext;
 #ifdef DEBUG
 	char str75[_75];
@@ -578,55 +1169,100 @@ int updatePCSCSlots(struct p11SlotPool_t *slotPool)
 	FUNC_CALLED();
 
 	/*
-	 * Keeping a global context causes problems if pcscd is restarted
+	 * The slot monitor reports reader changes, so the list is only read if the monitor saw one.
+	 * Closed slots are replaced with a new slot by a full update.
 	 */
-	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+	if (monitor.watching && monitor.pnp && !monitor.readersChanged && !hasClosedSlots(slotPool)) {
+		FOR_EACH(slot, slotPool->list) {
+			slot->present = TRUE;
+		}
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	monitor.readersChanged = FALSE;
+	added = FALSE;
+
+	rc = getListContext(&hContext);
 
 #ifdef DEBUG
-	debug("SCardEstablishContext: %s\n", pcsc_error_to_string(rc, str75));
+	debug("getListContext: %s\n", pcsc_error_to_string(rc, str75));
 #endif
 
 	if (rc != SCARD_S_SUCCESS) {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not establish context to PC/SC manager");
 	}
 
-	rc = SCardListReaders(hContext, NULL, (LPTSTR)&readers, &cch);
+	rc = listReaders(hContext, &len);
+
+	if ((rc == SCARD_E_NO_SERVICE) || (rc == SCARD_E_SERVICE_STOPPED) ||
+		(rc == SCARD_E_INVALID_HANDLE) || (rc == SCARD_F_COMM_ERROR)) {
+		/* the PC/SC manager was restarted, the context kept is gone */
+		SCardReleaseContext(listContext);
+		listContext = 0;
+
+		rc = getListContext(&hContext);
+
+		if (rc == SCARD_S_SUCCESS) {
+			rc = listReaders(hContext, &len);
+		}
+	}
 
 #ifdef DEBUG
 	debug("SCardListReaders: %s\n", pcsc_error_to_string(rc, str75));
 #endif
 
+	if (rc == SCARD_E_NO_MEMORY) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
 	if (rc != SCARD_S_SUCCESS) {
-		SCardReleaseContext(hContext);
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error listing PC/SC card terminals");
 	}
 
-	/* Determine the total number of readers */	
-	for (reader = readers; *reader != '\0'; reader += 1 + strlen(reader)) {
+	/* Same readers as in the last update, so each open slot still has its reader */
+	if ((len == lastReadersLength) && !memcmp(readerBuffer, lastReaders, len) && !hasClosedSlots(slotPool)) {
+		FOR_EACH(slot, slotPool->list) {
+			slot->present = TRUE;
+		}
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	memset(nameBucket, 0, sizeof(nameBucket));
+	FOR_EACH(slot, slotPool->list) {
+		if (!slot->closed) {
+			slot->readerHash = hashReaderName(slot->readerName);
+			slot->nextWithName = nameBucket[slot->readerHash & (SLOT_BUCKETS - 1)];
+			nameBucket[slot->readerHash & (SLOT_BUCKETS - 1)] = slot;
+		}
+	}
+
+	for (reader = readerBuffer; *reader != '\0'; reader += 1 + strlen(reader)) {
 #ifdef DEBUG
 		debug("%s\n", reader);
 #endif
 
 		/* Check if the already have a slot for the reader */
-		match = FALSE;
-		FOR_EACH(slot, slotPool->list) {
-			if (!slot->closed && strcmp(slot->readerName, reader) == 0) {
-				match = TRUE;
-				slot->present = TRUE; /* this value is protected by the slot pool mutex */
+		hash = hashReaderName(reader);
+		for (slot = nameBucket[hash & (SLOT_BUCKETS - 1)]; slot; slot = slot->nextWithName) {
+			if ((slot->readerHash == hash) && (strcmp(slot->readerName, reader) == 0)) {
 				break;
 			}
 		}
 
 		/* Skip the reader as we already have a slot for it */
-		if (match) {
+		if (slot) {
+			slot->present = TRUE; /* this value is protected by the slot pool mutex */
+			continue;
+		}
+
+		if (strlen(reader) >= sizeof(slot->readerName)) {
 			continue;
 		}
 
 		slot = (struct p11Slot_t *)calloc(1, sizeof(struct p11Slot_t));
 
 		if (slot == NULL) {
-			SCardFreeMemory(hContext, readers);
-			SCardReleaseContext(hContext);
+			lastReadersLength = 0;
 			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
 		}
 
@@ -638,8 +1274,7 @@ int updatePCSCSlots(struct p11SlotPool_t *slotPool)
 
 		if (rc != SCARD_S_SUCCESS) {
 			free(slot);
-			SCardFreeMemory(hContext, readers);
-			SCardReleaseContext(hContext);
+			lastReadersLength = 0;
 			FUNC_FAILS(CKR_DEVICE_ERROR, "Cannot establish context to PC/SC manager");
 		}
 
@@ -663,35 +1298,58 @@ int updatePCSCSlots(struct p11SlotPool_t *slotPool)
 		slot->info.firmwareVersion.major = 0;
 
 		slot->info.flags = CKF_REMOVABLE_DEVICE | CKF_HW_SLOT;
-		
+
+		/* a reader appearing twice in the list gets one slot */
+		slot->readerHash = hash;
+		slot->nextWithName = nameBucket[hash & (SLOT_BUCKETS - 1)];
+		nameBucket[hash & (SLOT_BUCKETS - 1)] = slot;
+
 		addSlot(&context->slotPool, slot);
+		added = TRUE;
 
 #ifdef DEBUG
 		debug("Added slot (%lu, %s) - slot counter is %i\n", slot->id, slot->readerName, context->slotPool.count);
 #endif
 	}
 
-	rc = SCardFreeMemory(hContext, readers);
-
-#ifdef DEBUG
-	debug("SCardFreeMemory: %s\n", pcsc_error_to_string(rc, str75));
-#endif
+	if (len > lastReadersLength) {
+		p = realloc(lastReaders, len);
+		if (p == NULL) {
+			lastReadersLength = 0;
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
+		lastReaders = p;
+	}
+	memcpy(lastReaders, readerBuffer, len);
+	lastReadersLength = len;
 
-	if (rc != SCARD_S_SUCCESS) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error freeing memory");
+	if (added) {
+		/* let the monitor watch the new slots */
+		wakeMonitor();
 	}
 
-	rc = SCardReleaseContext(hContext);
+	FUNC_RETURNS(CKR_OK);
+}
 
-	if (rc != SCARD_S_SUCCESS) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error release context");
+
+
+/**
+ * Release the context and reader lists kept by updatePCSCSlots()
+ */
+void terminatePCSCSlots(void)
+{
+	if (listContext) {
+		SCardReleaseContext(listContext);
+		listContext = 0;
 	}
 
-#ifdef DEBUG
-	debug("SCardReleaseContext: %s\n", pcsc_error_to_string(rc, str75));
-#endif
+	free(readerBuffer);
+	readerBuffer = NULL;
+	readerBufferSize = 0;
 
-	FUNC_RETURNS(CKR_OK);
+	free(lastReaders);
+	lastReaders = NULL;
+	lastReadersLength = 0;
 }
 
 
@@ -113,6 +113,10 @@ int transmitAPDUviaPCSC(struct p11Slot_t *slot,
 int getPCSCToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int updatePCSCSlots(struct p11SlotPool_t *pool);
 int closePCSCSlot(struct p11Slot_t *slot);
+void terminatePCSCSlots(void);
+int startPCSCSlotMonitor(struct p11SlotPool_t *pool);
+void stopPCSCSlotMonitor(struct p11SlotPool_t *pool);
+int waitForPCSCSlotEvent(struct p11SlotPool_t *pool, CK_FLAGS flags, CK_SLOT_ID_PTR pSlot);
 
 #endif
 
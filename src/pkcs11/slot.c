@@ -28,7 +28,7 @@
  *
  * @file    slot.c
  * @author  Frank Thater
- * @brief   Slot implementation dispatching for PC/SC or CT-API reader
+ * @brief   Slot implementation dispatching for PC/SC, CT-API or emulator reader
  */
 
 #include <string.h>
@@ -37,6 +37,7 @@
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
 #include <pkcs11/slotpool.h>
+#include <pkcs11/stats.h>
 
 #ifdef DEBUG
 #include <pkcs11/debug.h>
@@ -47,6 +48,7 @@
 #else
 #include "slot-pcsc.h"
 #endif
+#include "slot-emulator.h"
 
 /**
  * addToken adds a token to the specified slot.
@@ -75,6 +77,8 @@ void addToken(struct p11Slot_t *slot, struct p11Token_t *token)
 
 	slot->token = token;                    /* Add token to slot                */
 	slot->info.flags |= CKF_TOKEN_PRESENT;  /* indicate the presence of a token */
+
+	invalidateSlotInfo(slot);
 }
 
 
@@ -107,6 +111,8 @@ int removeToken(struct p11Slot_t *slot)
 
 	slot->info.flags &= ~CKF_TOKEN_PRESENT;
 
+	invalidateSlotInfo(slot);
+
 	freeToken(slot);
 
 	return CKR_TOKEN_NOT_PRESENT;
@@ -115,19 +121,48 @@ int removeToken(struct p11Slot_t *slot)
 
 
 /**
- * Encode APDU using either short or extended notation
+ * Describe a command APDU, using either short or extended notation
  *
+ * @param apdu the descriptor to set up
  * @param CLA the instruction class
  * @param INS the instruction code
  * @param P1 the first parameter
  * @param P2 the second parameter
  * @param Nc number of outgoing bytes
- * @param OutData outgoing command data
+ * @param OutData outgoing command data, not copied
  * @param Ne number of bytes expected from card,
  *           -1 for none,
  *           0 for all in short mode,
  *           > 255 in extended mode,
  *           >= 65536 all in extended mode
+ */
+void initCommandAPDU(struct apdu *apdu,
+		unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2,
+		size_t Nc, unsigned char *OutData, int Ne)
+{
+	apdu_init(apdu, CLA, INS, P1, P2);
+	apdu_add(apdu, OutData, OutData ? Nc : 0);
+
+	if (Ne == 0) {
+		apdu->ne = Nc > 255 ? 65536 : 256;
+	} else if (Ne > 0) {
+		apdu->ne = Ne < 65536 ? Ne : 65536;
+		apdu->extended = Ne > 255;
+	}
+}
+
+
+
+/**
+ * Encode APDU using either short or extended notation
+ *
+ * @param CLA the instruction class
+ * @param INS the instruction code
+ * @param P1 the first parameter
+ * @param P2 the second parameter
+ * @param Nc number of outgoing bytes
+ * @param OutData outgoing command data
+ * @param Ne number of bytes expected from card, see initCommandAPDU()
  * @param apdu buffer receiving the encoded APDU
  * @param apdu_len length of provided buffer
  * @return -1 for error or the length of the encoded APDU otherwise
@@ -137,53 +172,25 @@ int encodeCommandAPDU(
 		size_t Nc, unsigned char *OutData, int Ne,
 		unsigned char *apdu, size_t apdu_len)
 {
-	unsigned char *po;
+	struct apdu cmd;
+	int rc;
 
 	FUNC_CALLED();
 
 	if (apdu == NULL)
 		FUNC_FAILS(-1, "Output buffer not defined");
 
-	if (Nc + 9 > apdu_len)
-		FUNC_FAILS(-1, "Nc larger than output buffer");
-
 	if (Nc && (OutData == NULL))
 		FUNC_FAILS(-1, "OutData not defined for Nc > 0");
 
-	apdu[0] = CLA;
-	apdu[1] = INS;
-	apdu[2] = P1;
-	apdu[3] = P2;
-	po = apdu + 4;
-
-	if (OutData && Nc) {
-		if ((Nc <= 255) && (Ne <= 255)) {		// Case 3s or 4s
-			*po++ = (unsigned char)Nc;
-		} else {
-			*po++ = 0;							// Case 3e or 3e
-			*po++ = (unsigned char)(Nc >> 8);
-			*po++ = (unsigned char)(Nc & 0xFF);
-		}
-		memcpy(po, OutData, Nc);
-		po += Nc;
-	}
-
-	if (Ne >= 0) {								// Case 2 or 4
-		if ((Ne <= 255) && (Nc <= 255)) {		// Case 2s or 4s
-			*po++ = (unsigned char)Ne;
-		} else {
-			if (Ne >= 65536)					// Request all for extended APDU
-				Ne = 0;
+	initCommandAPDU(&cmd, CLA, INS, P1, P2, Nc, OutData, Ne);
 
-			if (!OutData)						// Case 4e
-				*po++ = 0;
+	rc = apdu_encode(&cmd, apdu, apdu_len);
 
-			*po++ = (unsigned char)(Ne >> 8);
-			*po++ = (unsigned char)(Ne & 0xFF);
-		}
-	}
+	if (rc < 0)
+		FUNC_FAILS(-1, "Nc larger than output buffer");
 
-	FUNC_RETURNS((CK_RV)(po - apdu));
+	FUNC_RETURNS(rc);
 }
 
 
@@ -202,6 +209,9 @@ int encodeCommandAPDU(
  *  InSize  : buffer size
  *  SW1SW2  : Address of short integer to receive SW1SW2
  *
+ *  The response is received straight into InData if InSize leaves room for InLen bytes
+ *  and SW1SW2, otherwise it is copied from a buffer of the transport.
+ *
  *  Returns : < 0 Error > 0 Bytes read
  */
 int transmitAPDU(struct p11Slot_t *slot,
@@ -210,7 +220,10 @@ int transmitAPDU(struct p11Slot_t *slot,
 		int InLen, unsigned char *InData, int InSize, unsigned short *SW1SW2)
 {
 	int rc;
-	unsigned char apdu[4098];
+	struct apdu cmd;
+	unsigned char apdu[4098], *rapdu;
+	size_t rapdu_len;
+	unsigned long long start;
 #ifdef DEBUG
 	char scr[4196], *po;
 #endif
@@ -244,32 +257,58 @@ int transmitAPDU(struct p11Slot_t *slot,
 	debug("%s\n", scr);
 #endif
 
-	rc = encodeCommandAPDU(CLA, INS, P1, P2,
-			OutLen, OutData, InData ? InLen : -1,
-			apdu, sizeof(apdu));
+	if (OutLen && (OutData == NULL))
+		FUNC_FAILS(-1, "OutData not defined for Nc > 0");
 
-	if (rc < 0)
-		FUNC_FAILS(rc, "Encoding APDU failed");
+	initCommandAPDU(&cmd, CLA, INS, P1, P2,
+			OutLen, OutData, InData ? InLen : -1);
+
+	if (InData && InSize) {
+		cmd.data = InData;
+		cmd.size = InSize;
+	}
+
+	start = statsNow();
+
+	if (emu_active()) {
+		rc = transmitAPDUviaEmulator(slot, &cmd);
+	} else {
+		rc = apdu_encode(&cmd, apdu, sizeof(apdu));
+
+		if (rc < 0)
+			FUNC_FAILS(rc, "Encoding APDU failed");
+
+		if (apdu_in_place(&cmd)) {
+			rapdu = cmd.data;
+			rapdu_len = cmd.size;
+		} else {
+			rapdu = apdu;
+			rapdu_len = sizeof(apdu);
+		}
 
 #ifdef CTAPI
-	rc = transmitAPDUviaCTAPI(slot, 0,
-			apdu, rc,
-			apdu, sizeof(apdu));
+		rc = transmitAPDUviaCTAPI(slot, 0,
+				apdu, rc,
+				rapdu, rapdu_len);
 #else
-	rc = transmitAPDUviaPCSC(slot,
-			apdu, rc,
-			apdu, sizeof(apdu));
+		rc = transmitAPDUviaPCSC(slot,
+				apdu, rc,
+				rapdu, rapdu_len);
 #endif
 
-	if (rc >= 2) {
-		*SW1SW2 = (apdu[rc - 2] << 8) | apdu[rc - 1];
-		rc -= 2;
+		if (rc >= 0)
+			rc = apdu_response(&cmd, rapdu, rc);
+	}
+
+	if (rc >= 0) {
+		*SW1SW2 = cmd.sw1sw2;
+
+		statsAddAPDU(slot, (int)apdu_length(&cmd), rc + 2, start);
 
 		if (InData && InSize) {
 			if (rc > InSize) {		// Never return more than caller allocated a buffer for
 				rc = InSize;
 			}
-			memcpy(InData, apdu, rc);
 		}
 	} else {
 		rc = -1;
@@ -356,6 +395,67 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 
 
 
+/**
+ * Acquire the slot mutex through the slot scheduler.
+ *
+ * Threads pass the scheduler one at a time: a thread is served when no thread of a more
+ * urgent priority class is waiting and all threads of its own class that arrived earlier
+ * have been served. The served thread then waits for the mutex while the next one stays in
+ * the scheduler, so a slot operation waits at most for the operation currently running and
+ * the one already handed the slot, never for a queue of background work. Running operations
+ * are not interrupted. A thread that already owns the slot mutex locks it again directly.
+ *
+ * The caller must make sure the slot is not deleted while waiting, see slot->queuing.
+ *
+ * @param slot       The slot to lock.
+ * @param priority   One of the SLOT_PRIORITY_ values.
+ */
+void lockSlot(struct p11Slot_t *slot, int priority)
+{
+	unsigned long ticket;
+	unsigned long long start;
+	int i;
+
+	assert(priority >= 0 && priority < SLOT_PRIORITIES);
+
+#ifdef mutex_owner
+	if (mutex_owner(&slot->mutex) == GetCurrentThreadId()) {
+		MUTEX_LOCK(&slot->mutex);
+		return;
+	}
+#endif
+
+	start = statsNow();
+
+	CONDVAR_LOCK(&slot->schedule);
+
+	ticket = slot->nextTicket[priority]++;
+
+	for (;;) {
+		if (!slot->handingOver && (ticket == slot->servedTicket[priority])) {
+			for (i = 0; (i < priority) && (slot->nextTicket[i] == slot->servedTicket[i]); i++);
+			if (i == priority)
+				break;
+		}
+		CONDVAR_WAIT(&slot->schedule);
+	}
+
+	slot->servedTicket[priority]++;
+	slot->handingOver = TRUE;
+	CONDVAR_UNLOCK(&slot->schedule);
+
+	MUTEX_LOCK(&slot->mutex);
+
+	statsAddLockWait(slot, start);
+
+	CONDVAR_LOCK(&slot->schedule);
+	slot->handingOver = FALSE;
+	CONDVAR_BROADCAST(&slot->schedule);
+	CONDVAR_UNLOCK(&slot->schedule);
+}
+
+
+
 /**
  * safeFindAndLockSlot finds a slot in the slot-pool.
  * The slot is specified by its slotID.
@@ -385,33 +485,37 @@ int safeFindAndLockSlot(struct p11SlotPool_t *slotPool, CK_SLOT_ID slotID, struc
 
 	FUNC_CALLED();
 
-	MUTEX_LOCK(&slotPool->mutex);
+	if ((slotID == VIRTUAL_SLOT_ID) && slotPool->virtualSlot) {
+		rc = safeLockVirtualHome(slotPool, ppSlot);
+		FUNC_RETURNS(rc);
+	}
 
-	FOR_EACH(slot, slotPool->list) {
+	RWLOCK_RDLOCK(&slotPool->lock);
+
+	slot = findSlot(slotPool, slotID);
+
+	if (slot) {
 		VERIFY_NOT_MUTEXOWNER(&slot->mutex);
-		if (slot->id == slotID) {
-			if (slot->closed) {
-				rc = CKR_DEVICE_ERROR;
-				break;
-			}
+		if (!slot->closed) {
 			*ppSlot = slot;
 			/* prevent deletion of slot */
 			InterlockedIncrement(&slot->queuing);
-			MUTEX_UNLOCK(&slotPool->mutex);
+			RWLOCK_RDUNLOCK(&slotPool->lock);
 			/* Unprotected area here. We must ensure that the slot pointer is still valid after
 			   obtaining the slot mutex. This is handled by incrementing slot->queuing while
-			   holding the slot pool mutex, and decrement after possessing the slot mutex.
-			   The delete function must check slot->queuing when holding the slot pool mutex
+			   holding the slot pool lock, and decrement after possessing the slot mutex.
+			   The delete function must check slot->queuing when holding the slot pool lock
 			   and unlink the slot immediately. If slot->queuing > 0 deletion must be cancelled.
 			   Otherwise another thread could get a slot pointer which points to freed memory.
-			   Acquire the slot mutex while owning the slot pool mutex is a performace killer. */
-			MUTEX_LOCK(&slot->mutex);
+			   Acquire the slot mutex while owning the slot pool lock is a performace killer. */
+			lockSlot(slot, SLOT_PRIORITY_NORMAL);
 			InterlockedDecrement(&slot->queuing);
 			FUNC_RETURNS(CKR_OK);
 		}
+		rc = CKR_DEVICE_ERROR;
 	}
 
-	MUTEX_UNLOCK(&slotPool->mutex);
+	RWLOCK_RDUNLOCK(&slotPool->lock);
 
 	*ppSlot = NULL;
 	FUNC_RETURNS(rc);
@@ -419,6 +523,98 @@ int safeFindAndLockSlot(struct p11SlotPool_t *slotPool, CK_SLOT_ID slotID, struc
 
 
 
+/**
+ * Take a snapshot of the slot and token information for getCachedSlotInfo().
+ *
+ * The snapshots are taken by the slot mutex owner after getToken() and are dropped with
+ * invalidateSlotInfo() whenever the slot or token information is changed. They are only
+ * used for slots whose card events are reported, i.e. PC/SC slots watched by the slot
+ * monitor and emulator slots.
+ *
+ * @param slot      Pointer to slot structure.
+ */
+void cacheSlotInfo(struct p11Slot_t *slot)
+{
+	VERIFY_MUTEXOWNER(&slot->mutex);
+
+	CONDVAR_LOCK(&slot->schedule);
+	slot->cachedSlotInfo = slot->info;
+	slot->infoCached = INFO_CACHED_SLOT;
+	if (slot->token) {
+		slot->cachedTokenInfo = slot->token->info;
+		slot->infoCached |= INFO_CACHED_TOKEN;
+	}
+#ifndef CTAPI
+	slot->infoCardChanges = slot->tokenCardChanges;
+#endif
+	CONDVAR_UNLOCK(&slot->schedule);
+}
+
+
+
+/**
+ * Drop the snapshots taken by cacheSlotInfo().
+ *
+ * @param slot      Pointer to slot structure.
+ */
+void invalidateSlotInfo(struct p11Slot_t *slot)
+{
+	CONDVAR_LOCK(&slot->schedule);
+	slot->infoCached = 0;
+	CONDVAR_UNLOCK(&slot->schedule);
+}
+
+
+
+/**
+ * Copy the slot or token information from the snapshot, without waiting for the slot mutex.
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ * @param slotID     The id of the slot.
+ * @param pSlotInfo  Receives the slot information, or NULL.
+ * @param pTokenInfo Receives the token information, or NULL.
+ *
+ * @return           TRUE if the information was copied, FALSE if the caller must query the slot
+ */
+int getCachedSlotInfo(struct p11SlotPool_t *slotPool, CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pSlotInfo, CK_TOKEN_INFO_PTR pTokenInfo)
+{
+	struct p11Slot_t *slot;
+	int need, hit = FALSE;
+
+	need = (pSlotInfo ? INFO_CACHED_SLOT : 0) | (pTokenInfo ? INFO_CACHED_TOKEN : 0);
+
+	RWLOCK_RDLOCK(&slotPool->lock);
+
+	slot = findSlot(slotPool, slotID);
+
+	if (slot && !slot->closed) {
+		CONDVAR_LOCK(&slot->schedule);
+		if ((slot->infoCached & need) == need) {
+			if (emu_active()) {
+				hit = TRUE;
+			} else {
+#ifndef CTAPI
+				/* a card event seen by the monitor makes the snapshot stale */
+				hit = slot->monitored && (slot->infoCardChanges == slot->cardChanges);
+#endif
+			}
+		}
+		if (hit) {
+			if (pSlotInfo)
+				*pSlotInfo = slot->cachedSlotInfo;
+			if (pTokenInfo)
+				*pTokenInfo = slot->cachedTokenInfo;
+		}
+		CONDVAR_UNLOCK(&slot->schedule);
+	}
+
+	RWLOCK_RDUNLOCK(&slotPool->lock);
+
+	return hit;
+}
+
+
+
 int getToken(struct p11Slot_t *slot, struct p11Token_t **ppToken)
 {
 	int rc;
@@ -430,11 +626,15 @@ int getToken(struct p11Slot_t *slot, struct p11Token_t **ppToken)
 
 	VERIFY_MUTEXOWNER(&slot->mutex);
 
+	if (emu_active()) {
+		rc = getEmulatorToken(slot, ppToken);
+	} else {
 #ifdef CTAPI
-	rc = getCTAPIToken(slot, ppToken);
+		rc = getCTAPIToken(slot, ppToken);
 #else
-	rc = getPCSCToken(slot, ppToken);
+		rc = getPCSCToken(slot, ppToken);
 #endif
+	}
 
 	return rc;
 }
@@ -474,7 +674,7 @@ int safeUpdateSlots(struct p11SlotPool_t *slotPool)
 	FUNC_CALLED();
 
 	wasBusy = BUSY;
-	MUTEX_LOCK(&slotPool->mutex);
+	RWLOCK_WRLOCK(&slotPool->lock);
 
 	/* skip if another thread did the job while waiting */
 	if (!wasBusy) {
@@ -485,11 +685,15 @@ int safeUpdateSlots(struct p11SlotPool_t *slotPool)
 		FOR_EACH(slot, slotPool->list) {
 			slot->present = FALSE;
 		}
+		if (emu_active()) {
+			rc = updateEmulatorSlots(slotPool);
+		} else {
 #ifdef CTAPI
-		rc = updateCTAPISlots(slotPool);
+			rc = updateCTAPISlots(slotPool);
 #else
-		rc = updatePCSCSlots(slotPool);
+			rc = updatePCSCSlots(slotPool);
 #endif
+		}
 		/* check for slot removal, can't use FOR_EACH here */
 		for (ppSlot = &slotPool->list; *ppSlot; ) {
 			slot = *ppSlot; /* for convenience */
@@ -504,6 +708,8 @@ int safeUpdateSlots(struct p11SlotPool_t *slotPool)
 				freeToken(slot);
 				MUTEX_UNLOCK(&slot->mutex);
 				MUTEX_DESTROY(&slot->mutex);
+				CONDVAR_DESTROY(&slot->schedule);
+				unindexSlot(slotPool, slot);
 				*ppSlot = slot->next; /* unlink */
 				slotPool->count--;
 				free(slot);
@@ -514,13 +720,73 @@ int safeUpdateSlots(struct p11SlotPool_t *slotPool)
 		BUSY = 0;
 	}
 
-	MUTEX_UNLOCK(&slotPool->mutex);
+	RWLOCK_WRUNLOCK(&slotPool->lock);
 
 	FUNC_RETURNS(rc);
 }
 
 
 
+/**
+ * Release resources the reader interface keeps from one slot update to the next
+ *
+ * @param pool       Pointer to slot-pool structure.
+ */
+void terminateSlots(struct p11SlotPool_t *slotPool)
+{
+#ifndef CTAPI
+	if (!emu_active()) {
+		terminatePCSCSlots();
+	}
+#endif
+}
+
+
+
+/**
+ * Start watching the readers for slot events, if the reader interface supports it
+ *
+ * @param pool       Pointer to slot-pool structure.
+ */
+int startSlotMonitor(struct p11SlotPool_t *slotPool)
+{
+#ifdef CTAPI
+	return CKR_OK;
+#else
+	if (emu_active()) {
+		return CKR_OK;
+	}
+	return startPCSCSlotMonitor(slotPool);
+#endif
+}
+
+
+
+void stopSlotMonitor(struct p11SlotPool_t *slotPool)
+{
+#ifndef CTAPI
+	if (!emu_active()) {
+		stopPCSCSlotMonitor(slotPool);
+	}
+#endif
+}
+
+
+
+int waitForSlotEvent(struct p11SlotPool_t *slotPool, CK_FLAGS flags, CK_SLOT_ID_PTR pSlot)
+{
+#ifdef CTAPI
+	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	if (emu_active()) {
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	}
+	return waitForPCSCSlotEvent(slotPool, flags, pSlot);
+#endif
+}
+
+
+
 int closeSlot(struct p11Slot_t *slot)
 {
 	int rc;
@@ -531,11 +797,15 @@ int closeSlot(struct p11Slot_t *slot)
 
 	slot->closed = TRUE;
 
+	if (emu_active()) {
+		rc = closeEmulatorSlot(slot);
+	} else {
 #ifdef CTAPI
-	rc = closeCTAPISlot(slot);
+		rc = closeCTAPISlot(slot);
 #else
-	rc = closePCSCSlot(slot);
+		rc = closePCSCSlot(slot);
 #endif
+	}
 
 	FUNC_RETURNS(rc);
 }
@@ -36,11 +36,16 @@
 
 #include <pkcs11/cryptoki.h>
 #include <pkcs11/p11generic.h>
+#include <common/apdu.h>
 
 void addToken(struct p11Slot_t *slot, struct p11Token_t *token);
 
 int removeToken(struct p11Slot_t *slot);
 
+void initCommandAPDU(struct apdu *apdu,
+		unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2,
+		size_t Nc, unsigned char *OutData, int Ne);
+
 int encodeCommandAPDU(
 		unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2,
 		size_t Nc, unsigned char *OutData, int Ne,
@@ -56,10 +61,18 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 		unsigned char pinformat, unsigned char minpinsize, unsigned char maxpinsize,
 		unsigned char pinblockstring, unsigned char pinlengthformat);
 int getToken(struct p11Slot_t *slot, struct p11Token_t **token);
+void cacheSlotInfo(struct p11Slot_t *slot);
+void invalidateSlotInfo(struct p11Slot_t *slot);
+int getCachedSlotInfo(struct p11SlotPool_t *pool, CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pSlotInfo, CK_TOKEN_INFO_PTR pTokenInfo);
 int findSlotObject(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject);
 int safeUpdateSlots(struct p11SlotPool_t *pool);
 int safeFindAndLockSlot(struct p11SlotPool_t *pool, CK_SLOT_ID slotID, struct p11Slot_t **slot);
+void lockSlot(struct p11Slot_t *slot, int priority);
 int closeSlot(struct p11Slot_t *slot);
+void terminateSlots(struct p11SlotPool_t *pool);
+int startSlotMonitor(struct p11SlotPool_t *pool);
+void stopSlotMonitor(struct p11SlotPool_t *pool);
+int waitForSlotEvent(struct p11SlotPool_t *pool, CK_FLAGS flags, CK_SLOT_ID_PTR pSlot);
 void addToken(struct p11Slot_t *slot, struct p11Token_t *token);
 int removeToken(struct p11Slot_t *slot);
 
@@ -33,12 +33,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <pkcs11/p11generic.h>
 #include <pkcs11/slotpool.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
+#include <pkcs11/session.h>
+#include <pkcs11/certificateobject.h>
 #include <pkcs11/debug.h>
+#include <ultralite/sc-hsm-ultralite.h>
 #include <assert.h>
 
 extern struct p11Context_t *context;
@@ -84,7 +88,10 @@ void initSlotPool(struct p11SlotPool_t *slotPool)
 	slotPool->list = NULL;
 	slotPool->count = 0;
 	slotPool->nextID = 0;
-	MUTEX_INIT(&slotPool->mutex);
+	memset(slotPool->bucket, 0, sizeof(slotPool->bucket));
+	slotPool->virtualSlot = getenv("SC_HSM_VIRTUAL_SLOT") != NULL;
+	slotPool->virtualSessionCount = 0;
+	RWLOCK_INIT(&slotPool->lock);
 }
 
 
@@ -101,10 +108,13 @@ void terminateSlotPool(struct p11SlotPool_t *slotPool)
 		closeSlot(slot);
 		MUTEX_UNLOCK(&slot->mutex);
 		MUTEX_DESTROY(&slot->mutex);
+		CONDVAR_DESTROY(&slot->schedule);
 		free(slot);
 	}
 
-	MUTEX_DESTROY(&slotPool->mutex);
+	terminateSlots(slotPool);
+
+	RWLOCK_DESTROY(&slotPool->lock);
 }
 
 
@@ -120,11 +130,10 @@ void addSlot(struct p11SlotPool_t *slotPool, struct p11Slot_t *slot)
 {
 	struct p11Slot_t **ppSlot;
 
-	VERIFY_MUTEXOWNER(&slotPool->mutex);
-
 	slot->next = NULL;
 
 	MUTEX_INIT(&slot->mutex);
+	CONDVAR_INIT(&slot->schedule);
 
 	FOR_EACH_REF(ppSlot, slotPool->list) {
 		/* until points to the next field of the last element */
@@ -134,5 +143,661 @@ void addSlot(struct p11SlotPool_t *slotPool, struct p11Slot_t *slot)
 
 	slot->id = slotPool->nextID++;
 
+	ppSlot = &slotPool->bucket[slot->id & (SLOT_BUCKETS - 1)];
+	slot->nextInBucket = *ppSlot;
+	*ppSlot = slot;
+
 	slotPool->count++;
 }
+
+
+
+/**
+ * Find a slot by it's id in the slot index. The caller must hold the slot-pool lock.
+ *
+ * @param pool       Pointer to slot-pool structure.
+ * @param slotID     The slot identifier
+ * @return           The slot or NULL if not found
+ */
+struct p11Slot_t *findSlot(struct p11SlotPool_t *slotPool, CK_SLOT_ID slotID)
+{
+	struct p11Slot_t *slot;
+
+	for (slot = slotPool->bucket[slotID & (SLOT_BUCKETS - 1)]; slot; slot = slot->nextInBucket) {
+		if (slot->id == slotID)
+			break;
+	}
+
+	return slot;
+}
+
+
+
+/**
+ * Remove a slot from the slot index before it is unlinked from the list.
+ * The caller must hold the slot-pool lock exclusively.
+ *
+ * @param pool       Pointer to slot-pool structure.
+ * @param slot       Pointer to slot structure.
+ */
+void unindexSlot(struct p11SlotPool_t *slotPool, struct p11Slot_t *slot)
+{
+	struct p11Slot_t **ppSlot;
+
+	for (ppSlot = &slotPool->bucket[slot->id & (SLOT_BUCKETS - 1)]; *ppSlot; ppSlot = &(*ppSlot)->nextInBucket) {
+		if (*ppSlot == slot) {
+			*ppSlot = slot->nextInBucket;
+			break;
+		}
+	}
+}
+
+
+
+/*
+ * The virtual slot
+ *
+ * If SC_HSM_VIRTUAL_SLOT is set the pool offers an additional slot with id VIRTUAL_SLOT_ID
+ * for tokens holding the same keys, e.g. SmartCard-HSMs with keys imported from the same
+ * DKEK share. A session on the virtual slot is served by its home slot, the first slot with
+ * a token when the session was opened. Object handles are those of the home token.
+ *
+ * C_Login on the virtual slot logs in the home token and then all other tokens with a
+ * certificate of the same CKA_ID and subject public key info as a certificate on the home
+ * token, using the same PIN. These become the members of the virtual slot until C_Logout or
+ * the last session on the virtual slot is closed.
+ *
+ * C_SignInit and C_DecryptInit record the identity of the key. C_Sign and C_Decrypt then run
+ * on the member with the fewest threads waiting for or owning its slot that holds a private
+ * key of that identity, so unmodified applications get the throughput of all tokens. An
+ * operation failing with a device error is repeated on the next member.
+ *
+ * A thread running an operation on another member does not own the mutex of the home slot.
+ * C_CloseSession therefore locks all members once before the session is released.
+ */
+
+
+
+/**
+ * Collect the open slots of the pool, preventing their deletion with slot->queuing.
+ *
+ * The caller locks each slot with lockSlot() and decrements slot->queuing afterwards.
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ * @param slots      Receives up to MAX_SLOTS slots.
+ * @param members    TRUE to collect only the members of the virtual slot.
+ * @return           The number of slots
+ */
+static int collectSlots(struct p11SlotPool_t *slotPool, struct p11Slot_t **slots, int members)
+{
+	struct p11Slot_t *slot;
+	int count = 0;
+
+	RWLOCK_RDLOCK(&slotPool->lock);
+
+	FOR_EACH(slot, slotPool->list) {
+		if ((slot->closed && !members) || (members && !slot->virtualMember) || (count >= MAX_SLOTS)) {
+			continue;
+		}
+		InterlockedIncrement(&slot->queuing);
+		slots[count++] = slot;
+	}
+
+	RWLOCK_RDUNLOCK(&slotPool->lock);
+
+	return count;
+}
+
+
+
+/**
+ * Lock the first slot with a token, which becomes the home slot of a session on the virtual slot.
+ *
+ * If no slot has a token, the first slot is locked, so that C_GetSlotInfo still succeeds.
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ * @param ppSlot     Receives the locked slot.
+ * @return           CKR_OK or CKR_DEVICE_REMOVED if the pool has no slots
+ */
+int safeLockVirtualHome(struct p11SlotPool_t *slotPool, struct p11Slot_t **ppSlot)
+{
+	struct p11Slot_t *slots[MAX_SLOTS];
+	struct p11Slot_t *home = NULL;
+	struct p11Token_t *token;
+	int count, i;
+
+	count = collectSlots(slotPool, slots, FALSE);
+
+	for (i = 0; (i < count) && (home == NULL); i++) {
+		lockSlot(slots[i], SLOT_PRIORITY_NORMAL);
+		if (getToken(slots[i], &token) == CKR_OK) {
+			home = slots[i];
+		} else {
+			MUTEX_UNLOCK(&slots[i]->mutex);
+		}
+	}
+
+	if ((home == NULL) && (count > 0)) {
+		home = slots[0];
+		lockSlot(home, SLOT_PRIORITY_NORMAL);
+	}
+
+	for (i = 0; i < count; i++) {
+		InterlockedDecrement(&slots[i]->queuing);
+	}
+
+	*ppSlot = home;
+	return home ? CKR_OK : CKR_DEVICE_REMOVED;
+}
+
+
+
+/**
+ * Compare an attribute of an object with a template attribute
+ */
+static int hasAttributeValue(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
+{
+	struct p11Attribute_t *attr;
+
+	if (findAttribute(object, pTemplate, &attr) < 0) {
+		return FALSE;
+	}
+
+	return (attr->attrData.ulValueLen == pTemplate->ulValueLen) &&
+			!memcmp(attr->attrData.pValue, pTemplate->pValue, pTemplate->ulValueLen);
+}
+
+
+
+/**
+ * Find the certificate with the given CKA_ID and hash its subject public key info.
+ *
+ * If several certificates share the CKA_ID, the one stored under the same token id as
+ * the key is preferred.
+ *
+ * @param token      The token, the caller must own the slot mutex.
+ * @param key        The key or certificate the identity is determined for.
+ * @param identity   The identity with id set, receives the hash.
+ * @return           0 or -1 if there is no certificate with the id
+ */
+static int hashPublicKey(struct p11Token_t *token, struct p11Object_t *key, struct p11KeyIdentity_t *identity)
+{
+	CK_OBJECT_CLASS class = CKO_CERTIFICATE;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_ID, identity->id, identity->idLen }
+	};
+	struct p11Object_t *object, *next;
+	struct asn1Certificate cert;
+	sha256_context ctx;
+	int i, bucket, found = FALSE;
+
+	loadTokenObjectsForTemplate(token, template, 2, TRUE);
+
+	i = selectAttributeIndex(template, 2, &bucket);
+
+	for (object = token->pubAttributeIndex[i][bucket]; object; object = next) {
+		next = object->nextInAttributeIndex[i];
+
+		if (!hasAttributeValue(object, &template[0]) || !hasAttributeValue(object, &template[1])) {
+			continue;
+		}
+
+		if (object->loadAttributes && (loadTokenObject(token, object, TRUE) != CKR_OK)) {
+			continue;
+		}
+
+		if ((found && (object->tokenid != key->tokenid)) || (decodeCertificateObject(object, &cert) != 0)) {
+			continue;
+		}
+
+		sha256_starts(&ctx);
+		sha256_update(&ctx, cert.spki, cert.spkiLen);
+		sha256_finish(&ctx, identity->hash);
+		found = TRUE;
+
+		if (object->tokenid == key->tokenid) {
+			break;
+		}
+	}
+
+	return found ? 0 : -1;
+}
+
+
+
+/**
+ * Determine the identity of a key or certificate.
+ *
+ * @param token      The token, the caller must own the slot mutex.
+ * @param object     The key or certificate.
+ * @param identity   Receives the identity.
+ * @return           0 or -1 if the object has no CKA_ID or no certificate
+ */
+static int getKeyIdentity(struct p11Token_t *token, struct p11Object_t *object, struct p11KeyIdentity_t *identity)
+{
+	CK_ATTRIBUTE template = { CKA_ID, NULL, 0 };
+	struct p11Attribute_t *attr;
+
+	identity->idLen = 0;
+
+	if ((findAttribute(object, &template, &attr) < 0) ||
+			(attr->attrData.ulValueLen == 0) || (attr->attrData.ulValueLen > MAX_KEY_ID)) {
+		return -1;
+	}
+
+	memcpy(identity->id, attr->attrData.pValue, attr->attrData.ulValueLen);
+	identity->idLen = attr->attrData.ulValueLen;
+
+	if (hashPublicKey(token, object, identity) < 0) {
+		identity->idLen = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/**
+ * Find the object of a class with the given identity on a token.
+ *
+ * @param token      The token, the caller must own the slot mutex.
+ * @param class      CKO_PRIVATE_KEY or CKO_CERTIFICATE.
+ * @param identity   The identity.
+ * @return           The object or NULL
+ */
+static struct p11Object_t *findKeyByIdentity(struct p11Token_t *token, CK_OBJECT_CLASS class, struct p11KeyIdentity_t *identity)
+{
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_ID, identity->id, identity->idLen }
+	};
+	struct p11KeyIdentity_t found;
+	struct p11Object_t *(*index)[ATTRIBUTE_BUCKETS];
+	struct p11Object_t *object, *next;
+	int publicObject = (class == CKO_CERTIFICATE);
+	int i, bucket;
+
+	loadTokenObjectsForTemplate(token, template, 2, publicObject);
+
+	index = publicObject ? token->pubAttributeIndex : token->privAttributeIndex;
+	i = selectAttributeIndex(template, 2, &bucket);
+
+	for (object = index[i][bucket]; object; object = next) {
+		next = object->nextInAttributeIndex[i];
+
+		if (!hasAttributeValue(object, &template[0]) || !hasAttributeValue(object, &template[1])) {
+			continue;
+		}
+
+		if (object->loadAttributes && (loadTokenObject(token, object, publicObject) != CKR_OK)) {
+			continue;
+		}
+
+		if ((getKeyIdentity(token, object, &found) == 0) && !memcmp(found.hash, identity->hash, sizeof(found.hash))) {
+			return object;
+		}
+	}
+
+	return NULL;
+}
+
+
+
+/**
+ * Record the identity of the key of a sign or decrypt operation started on the virtual slot.
+ *
+ * The operation is not dispatched to other members if the key has no identity.
+ *
+ * @param session    The session, the caller must own the mutex of its home slot.
+ * @param slot       The home slot.
+ * @param object     The key.
+ */
+void setActiveKey(struct p11Session_t *session, struct p11Slot_t *slot, struct p11Object_t *object)
+{
+	session->activeKey.idLen = 0;
+
+	if (session->slotID == VIRTUAL_SLOT_ID) {
+		getKeyIdentity(slot->token, object, &session->activeKey);
+	}
+}
+
+
+
+/**
+ * Number of threads waiting for or owning the slot.
+ */
+static unsigned long slotLoad(struct p11Slot_t *slot)
+{
+	unsigned long load = 0;
+	int i;
+
+	CONDVAR_LOCK(&slot->schedule);
+	for (i = 0; i < SLOT_PRIORITIES; i++) {
+		load += slot->nextTicket[i] - slot->servedTicket[i];
+	}
+	load += slot->handingOver;
+	CONDVAR_UNLOCK(&slot->schedule);
+
+#ifdef mutex_owner
+	if (mutex_owner(&slot->mutex)) {
+		load++;
+	}
+#endif
+
+	return load;
+}
+
+
+
+/**
+ * Select the least loaded slot for an operation on the virtual slot that is the home slot
+ * or a member and has not been tried yet. slot->queuing of the slot is incremented.
+ */
+static struct p11Slot_t *selectKeySlot(struct p11SlotPool_t *slotPool, struct p11Session_t *session, struct p11KeyDispatch_t *dispatch)
+{
+	struct p11Slot_t *slot, *best = NULL;
+	unsigned long load, bestLoad = 0;
+	int i;
+
+	RWLOCK_RDLOCK(&slotPool->lock);
+
+	FOR_EACH(slot, slotPool->list) {
+		if (slot->closed || ((slot->id != session->homeSlotID) && !slot->virtualMember)) {
+			continue;
+		}
+
+		for (i = 0; (i < dispatch->tried) && (dispatch->triedID[i] != slot->id); i++);
+		if (i < dispatch->tried) {
+			continue;
+		}
+
+		load = slotLoad(slot);
+		if ((best == NULL) || (load < bestLoad)) {
+			best = slot;
+			bestLoad = load;
+		}
+	}
+
+	if (best) {
+		InterlockedIncrement(&best->queuing);
+	}
+
+	RWLOCK_RDUNLOCK(&slotPool->lock);
+
+	return best;
+}
+
+
+
+/**
+ * Lock the least loaded slot not tried yet that holds the active key of a session on the
+ * virtual slot. The caller prevents the deletion of the session.
+ */
+static int lockKeySlot(struct p11SlotPool_t *slotPool, struct p11Session_t *session, struct p11KeyDispatch_t *dispatch,
+		struct p11Slot_t **ppSlot, struct p11Object_t **ppObject)
+{
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	int rc, homerc = CKR_DEVICE_REMOVED;
+
+	while ((dispatch->tried < MAX_SLOTS) && (slot = selectKeySlot(slotPool, session, dispatch)) != NULL) {
+		dispatch->triedID[dispatch->tried++] = slot->id;
+
+		lockSlot(slot, SLOT_PRIORITY_INTERACTIVE);
+		InterlockedDecrement(&slot->queuing);
+
+		if (slot->id == session->homeSlotID) {
+			rc = findSlotObject(slot, dispatch->handle, ppObject, FALSE);
+			if (rc != CKR_OK) {
+				homerc = rc;
+			}
+		} else {
+			rc = getToken(slot, &token);
+			if ((rc == CKR_OK) && (token->userType != CKU_USER)) {
+				rc = CKR_USER_NOT_LOGGED_IN;
+			}
+			if ((rc == CKR_OK) && ((*ppObject = findKeyByIdentity(token, CKO_PRIVATE_KEY, &session->activeKey)) == NULL)) {
+				rc = CKR_KEY_HANDLE_INVALID;
+			}
+		}
+
+		if (rc == CKR_OK) {
+			*ppSlot = slot;
+			return CKR_OK;
+		}
+
+#ifdef DEBUG
+		debug("Slot %lu can not run the operation, rc=%d\n", (unsigned long)slot->id, rc);
+#endif
+		MUTEX_UNLOCK(&slot->mutex);
+	}
+
+	*ppSlot = NULL;
+	return homerc;
+}
+
+
+
+/**
+ * Find the session and the key of the active sign or decrypt operation and lock the slot
+ * to run it, see FUNC_FIND_SESSION_AND_LOCK_KEY_SLOT.
+ *
+ * @param sessionPool Pointer to session-pool structure.
+ * @param slotPool   Pointer to slot-pool structure.
+ * @param handle     The session handle.
+ * @param ppSession  Receives the session.
+ * @param ppSlot     Receives the locked slot.
+ * @param ppObject   Receives the key.
+ * @param dispatch   Receives the slots tried, for failoverKeySlot().
+ * @return           CKR_OK or any other Cryptoki error code, no slot is locked in that case
+ */
+int safeFindSessionAndLockKeySlot(struct p11SessionPool_t *sessionPool, struct p11SlotPool_t *slotPool,
+	CK_SESSION_HANDLE handle, struct p11Session_t **ppSession, struct p11Slot_t **ppSlot,
+	struct p11Object_t **ppObject, struct p11KeyDispatch_t *dispatch)
+{
+	struct p11Session_t *session;
+	int rc;
+
+	dispatch->tried = 0;
+	*ppObject = NULL;
+
+	if (slotPool->virtualSlot && (handle != CK_INVALID_HANDLE)) {
+		RWLOCK_RDLOCK(&sessionPool->lock);
+		session = findSession(sessionPool, handle);
+		if (session) {
+			/* prevent deletion of session */
+			InterlockedIncrement(&session->queuing);
+		}
+		RWLOCK_RDUNLOCK(&sessionPool->lock);
+
+		if (session && (session->slotID == VIRTUAL_SLOT_ID) && session->activeKey.idLen &&
+				(session->activeObjectHandle != CK_INVALID_HANDLE)) {
+			dispatch->handle = session->activeObjectHandle;
+			rc = lockKeySlot(slotPool, session, dispatch, ppSlot, ppObject);
+			InterlockedDecrement(&session->queuing);
+			*ppSession = session;
+			return rc;
+		}
+
+		if (session) {
+			InterlockedDecrement(&session->queuing);
+		}
+	}
+
+	rc = safeFindSessionAndLockSlot(sessionPool, slotPool, handle, ppSession, ppSlot, SLOT_PRIORITY_INTERACTIVE);
+
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	if ((*ppSession)->activeObjectHandle == CK_INVALID_HANDLE) {
+		rc = CKR_OPERATION_NOT_INITIALIZED;
+	} else {
+		rc = findSlotObject(*ppSlot, (*ppSession)->activeObjectHandle, ppObject, FALSE);
+	}
+
+	if (rc != CKR_OK) {
+		MUTEX_UNLOCK(&(*ppSlot)->mutex);
+		*ppSlot = NULL;
+	}
+
+	return rc;
+}
+
+
+
+/**
+ * Repeat an operation on the virtual slot that failed with a device error on the next slot
+ * holding the key, see FUNC_FAILOVER_KEY_SLOT.
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ * @param session    The session.
+ * @param rv         The result of the operation.
+ * @param ppSlot     The locked slot, receives the next slot or NULL.
+ * @param ppObject   The key, receives the key on the next slot.
+ * @param dispatch   The slots tried so far.
+ * @return           TRUE if the operation shall be repeated on *ppSlot
+ */
+int failoverKeySlot(struct p11SlotPool_t *slotPool, struct p11Session_t *session, int rv,
+	struct p11Slot_t **ppSlot, struct p11Object_t **ppObject, struct p11KeyDispatch_t *dispatch)
+{
+	int rc;
+
+	if ((dispatch->tried == 0) || ((rv >= 0) && (rv != CKR_DEVICE_ERROR) && (rv != CKR_DEVICE_REMOVED) &&
+			(rv != CKR_TOKEN_NOT_PRESENT) && (rv != CKR_FUNCTION_FAILED) && (rv != CKR_GENERAL_ERROR))) {
+		return FALSE;
+	}
+
+#ifdef DEBUG
+	debug("Operation failed on slot %lu with rc=%d, trying the next member\n", (unsigned long)(*ppSlot)->id, rv);
+#endif
+
+	/* the slot mutex protects the session until the next slot is locked */
+	InterlockedIncrement(&session->queuing);
+	MUTEX_UNLOCK(&(*ppSlot)->mutex);
+
+	rc = lockKeySlot(slotPool, session, dispatch, ppSlot, ppObject);
+
+	InterlockedDecrement(&session->queuing);
+
+	return rc == CKR_OK;
+}
+
+
+
+/**
+ * Collect the identities of the certificates on the home token that select the members
+ * of the virtual slot in safeLogInVirtualMembers().
+ *
+ * @param slot       The home slot, the caller must own the slot mutex.
+ * @param keys       Receives the identities.
+ * @param max        The number of entries in keys.
+ * @return           The number of identities
+ */
+int getVirtualKeys(struct p11Slot_t *slot, struct p11KeyIdentity_t *keys, int max)
+{
+	struct p11Object_t *object, *next;
+	CK_OBJECT_CLASS class = CKO_CERTIFICATE;
+	CK_ATTRIBUTE template = { CKA_CLASS, &class, sizeof(class) };
+	int count = 0;
+
+	FOR_EACH_WITH_NEXT(object, next, slot->token->pubObjectList) {
+		if (count >= max) {
+			break;
+		}
+		if (!hasAttributeValue(object, &template)) {
+			continue;
+		}
+		if (object->loadAttributes && (loadTokenObject(slot->token, object, TRUE) != CKR_OK)) {
+			continue;
+		}
+		if (getKeyIdentity(slot->token, object, &keys[count]) == 0) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+
+
+/**
+ * Log in the tokens sharing a key with the home token and make them members of the virtual slot.
+ *
+ * Tokens already logged in by the user become members without PIN verification.
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ * @param homeSlotID The home slot, which is not locked by the caller.
+ * @param keys       The identities returned by getVirtualKeys() for the home slot.
+ * @param count      The number of identities.
+ * @param pPin       The PIN verified on the home token.
+ * @param ulPinLen   The length of the PIN.
+ */
+void safeLogInVirtualMembers(struct p11SlotPool_t *slotPool, CK_SLOT_ID homeSlotID,
+	struct p11KeyIdentity_t *keys, int count, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+	struct p11Slot_t *slots[MAX_SLOTS];
+	struct p11Token_t *token;
+	int n, i, k;
+
+	n = collectSlots(slotPool, slots, FALSE);
+
+	for (i = 0; i < n; i++) {
+		lockSlot(slots[i], SLOT_PRIORITY_NORMAL);
+		InterlockedDecrement(&slots[i]->queuing);
+
+		if ((slots[i]->id != homeSlotID) && (getToken(slots[i], &token) == CKR_OK)) {
+			for (k = 0; (k < count) && !findKeyByIdentity(token, CKO_CERTIFICATE, &keys[k]); k++);
+
+			if ((k < count) && (token->userType != CKU_USER) && (token->userType != CKU_SO) &&
+					(token->info.flags & CKF_USER_PIN_INITIALIZED) &&
+					(logIn(slots[i], CKU_USER, pPin, ulPinLen) == CKR_OK)) {
+				token->userType = CKU_USER;
+			}
+
+			if ((k < count) && (token->userType == CKU_USER)) {
+#ifdef DEBUG
+				debug("Slot %lu is a member of the virtual slot\n", (unsigned long)slots[i]->id);
+#endif
+				slots[i]->virtualMember = TRUE;
+			}
+		}
+
+		MUTEX_UNLOCK(&slots[i]->mutex);
+	}
+}
+
+
+
+/**
+ * Wait for the operations running on the members of the virtual slot and optionally end
+ * the membership, logging out the tokens without sessions of their own.
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ * @param logout     TRUE to end the membership.
+ */
+void safeReleaseVirtualMembers(struct p11SlotPool_t *slotPool, int logout)
+{
+	struct p11Slot_t *slots[MAX_SLOTS];
+	int n, i;
+
+	n = collectSlots(slotPool, slots, TRUE);
+
+	for (i = 0; i < n; i++) {
+		lockSlot(slots[i], SLOT_PRIORITY_NORMAL);
+		InterlockedDecrement(&slots[i]->queuing);
+
+		if (logout) {
+			slots[i]->virtualMember = FALSE;
+
+			if ((slots[i]->sessionCount == 0) && slots[i]->token && (slots[i]->token->userType == CKU_USER)) {
+				slots[i]->token->userType = 0xFF;
+				logOut(slots[i]);
+			}
+		}
+
+		MUTEX_UNLOCK(&slots[i]->mutex);
+	}
+}
@@ -34,13 +34,49 @@
 #ifndef ___SLOTPOOL_H_INC___
 #define ___SLOTPOOL_H_INC___
 
-#define MAX_SLOTS 8
+#define MAX_SLOTS 64
 
 #include <pkcs11/p11generic.h>
 #include <pkcs11/cryptoki.h>
+#include <pkcs11/session.h>
+
+/**
+ * The virtual slot offered if SC_HSM_VIRTUAL_SLOT is set. It is not in the slot list and
+ * has an id never assigned to a reader.
+ */
+#define VIRTUAL_SLOT_ID     0x7FFFFFFF
+#define VIRTUAL_SLOT_NAME   "SmartCard-HSM Virtual Slot"
+
+/**
+ * Number of certificates compared to find the tokens with the same keys as the home slot
+ */
+#define MAX_VIRTUAL_KEYS    16
+
+/**
+ * The slots a sign or decrypt operation on the virtual slot already used
+ */
+struct p11KeyDispatch_t
+{
+	CK_OBJECT_HANDLE handle;               /**< The key on the home slot of the session       */
+	int tried;                             /**< Number of entries in triedID, 0 if not virtual */
+	CK_SLOT_ID triedID[MAX_SLOTS];         /**< Slots locked for the operation so far         */
+};
 
 void initSlotPool(struct p11SlotPool_t *pool);
 void terminateSlotPool(struct p11SlotPool_t *pool);
 void addSlot(struct p11SlotPool_t *pool, struct p11Slot_t *slot);
+struct p11Slot_t *findSlot(struct p11SlotPool_t *pool, CK_SLOT_ID slotID);
+void unindexSlot(struct p11SlotPool_t *pool, struct p11Slot_t *slot);
+int safeLockVirtualHome(struct p11SlotPool_t *pool, struct p11Slot_t **slot);
+void setActiveKey(struct p11Session_t *session, struct p11Slot_t *slot, struct p11Object_t *object);
+int safeFindSessionAndLockKeySlot(struct p11SessionPool_t *sessionPool, struct p11SlotPool_t *pool,
+	CK_SESSION_HANDLE handle, struct p11Session_t **ppSession, struct p11Slot_t **ppSlot,
+	struct p11Object_t **ppObject, struct p11KeyDispatch_t *dispatch);
+int failoverKeySlot(struct p11SlotPool_t *pool, struct p11Session_t *session, int rv,
+	struct p11Slot_t **ppSlot, struct p11Object_t **ppObject, struct p11KeyDispatch_t *dispatch);
+int getVirtualKeys(struct p11Slot_t *slot, struct p11KeyIdentity_t *keys, int max);
+void safeLogInVirtualMembers(struct p11SlotPool_t *pool, CK_SLOT_ID homeSlotID,
+	struct p11KeyIdentity_t *keys, int count, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen);
+void safeReleaseVirtualMembers(struct p11SlotPool_t *pool, int logout);
 
 #endif /* ___SLOTPOOL_H_INC___ */
@@ -0,0 +1,433 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    stats.c
+ * @brief   Always on statistics of the slots
+ */
+
+/*
+	Each slot counts its APDUs and bytes, the time of each APDU exchange (card), the time threads
+	wait for the slot mutex (lockWait) and calls, errors and latency of the signature and decryption
+	operations per mechanism. The counters are updated lock free, so a snapshot taken while the slot
+	is in use may combine a count with the time of the previous update. New mechanisms are only added
+	by the owner of the slot mutex.
+
+	With SC_HSM_STATS naming a file a background thread rewrites the file with the statistics of
+	all slots every SC_HSM_STATS_INTERVAL seconds (default 10) and at C_Finalize.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#else
+#include <windows.h>
+#endif
+
+#include <pkcs11/stats.h>
+
+#if defined(_WIN32)
+#define STATS_ADD(ptr, val) InterlockedExchangeAdd64((volatile LONGLONG*)(ptr), (LONGLONG)(val))
+#define STATS_CAS(ptr, old, val) (InterlockedCompareExchange64((volatile LONGLONG*)(ptr), (LONGLONG)(val), (LONGLONG)(old)) == (LONGLONG)(old))
+#elif defined(HAVE_SYNC_ADD_AND_FETCH)
+#define STATS_ADD(ptr, val) __sync_add_and_fetch((ptr), (val))
+#define STATS_CAS(ptr, old, val) __sync_bool_compare_and_swap((ptr), (old), (val))
+#else /* not thread-safe */
+#define STATS_ADD(ptr, val) (*(ptr) += (val))
+#define STATS_CAS(ptr, old, val) (*(ptr) = (val), 1)
+#endif
+
+#define STATS_INTERVAL 10       /* seconds between two dumps without SC_HSM_STATS_INTERVAL */
+
+static struct {
+	char *path;
+	unsigned long interval;
+	struct p11SlotPool_t *pool;
+	volatile int stop;
+	int running;
+} dump;
+
+#ifndef _WIN32
+static pthread_t dumpThread;
+#else
+static HANDLE dumpThread;
+#endif
+
+
+
+/**
+ * Monotonic time in microseconds
+ */
+unsigned long long statsNow(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (unsigned long long)(count.QuadPart / freq.QuadPart * 1000000
+		+ count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+
+
+/**
+ * Histogram bucket of a duration, see CK_SC_HSM_LATENCY_BUCKETS
+ */
+static int bucketOf(unsigned long long us)
+{
+	int e = 3, b;
+
+	if (us < 8) {
+		return 0;
+	}
+
+	while ((us >> e) > 1) {
+		e++;
+	}
+
+	b = 1 + (e - 3) * 4 + (int)((us >> (e - 2)) & 3);
+	return b < CK_SC_HSM_LATENCY_BUCKETS ? b : CK_SC_HSM_LATENCY_BUCKETS - 1;
+}
+
+
+
+/**
+ * Upper limit in microseconds of the durations counted in bucket b
+ */
+static unsigned long long bucketLimit(int b)
+{
+	int e, m;
+
+	if (b == 0) {
+		return 8;
+	}
+
+	e = 3 + (b - 1) / 4;
+	m = (b - 1) % 4;
+	return (unsigned long long)(5 + m) << (e - 2);
+}
+
+
+
+static void addLatency(struct p11Latency_t *l, unsigned long long us)
+{
+	unsigned long long max;
+
+	STATS_ADD(&l->count, 1);
+	STATS_ADD(&l->totalUs, us);
+	STATS_ADD(&l->histogram[bucketOf(us)], 1);
+	do {
+		max = l->maxUs;
+	} while ((us > max) && !STATS_CAS(&l->maxUs, max, us));
+}
+
+
+
+/**
+ * Account one APDU exchange of the slot, started at start (see statsNow)
+ */
+void statsAddAPDU(struct p11Slot_t *slot, int bytesOut, int bytesIn, unsigned long long start)
+{
+	STATS_ADD(&slot->stats.apdus, 1);
+	STATS_ADD(&slot->stats.bytesOut, bytesOut);
+	STATS_ADD(&slot->stats.bytesIn, bytesIn);
+	addLatency(&slot->stats.card, statsNow() - start);
+}
+
+
+
+/**
+ * Account the wait for the slot mutex since start
+ */
+void statsAddLockWait(struct p11Slot_t *slot, unsigned long long start)
+{
+	addLatency(&slot->stats.lockWait, statsNow() - start);
+}
+
+
+
+/**
+ * Account a signature or decryption operation with mechanism mech, started at start.
+ * The caller must own the slot mutex.
+ */
+void statsAddOperation(struct p11Slot_t *slot, CK_MECHANISM_TYPE mech, CK_RV rv, unsigned long long start)
+{
+	struct p11SlotStats_t *stats = &slot->stats;
+	struct p11MechanismStats_t *m;
+	unsigned long long us = statsNow() - start;
+	int i;
+
+	for (i = 0; (i < stats->mechanismCount) && (stats->mechanism[i].mechanism != mech); i++);
+
+	if (i == stats->mechanismCount) {
+		if (i == CK_SC_HSM_STATS_MECHANISMS) {
+			/* table full, the last entry collects the remaining mechanisms */
+			i--;
+			stats->mechanism[i].mechanism = CKM_VENDOR_DEFINED;
+		} else {
+			stats->mechanism[i].mechanism = mech;
+			stats->mechanismCount++;
+		}
+	}
+
+	m = &stats->mechanism[i];
+	STATS_ADD(&m->calls, 1);
+	if (rv != CKR_OK) {
+		STATS_ADD(&m->errors, 1);
+	}
+	addLatency(&m->latency, us);
+}
+
+
+
+static void copyLatency(CK_SC_HSM_LATENCY *dst, struct p11Latency_t *src)
+{
+	int i;
+
+	dst->count = src->count;
+	dst->totalUs = src->totalUs;
+	dst->maxUs = src->maxUs;
+	for (i = 0; i < CK_SC_HSM_LATENCY_BUCKETS; i++) {
+		dst->histogram[i] = src->histogram[i];
+	}
+}
+
+
+
+/**
+ * Copy the statistics of the slot and optionally reset them. The caller must own the slot mutex.
+ */
+void getSlotStatistics(struct p11Slot_t *slot, CK_SC_HSM_SLOT_STATISTICS_PTR pStatistics, int reset)
+{
+	struct p11SlotStats_t *stats = &slot->stats;
+	int i;
+
+	memset(pStatistics, 0, sizeof(*pStatistics));
+	pStatistics->apdus = stats->apdus;
+	pStatistics->bytesOut = stats->bytesOut;
+	pStatistics->bytesIn = stats->bytesIn;
+	copyLatency(&pStatistics->card, &stats->card);
+	copyLatency(&pStatistics->lockWait, &stats->lockWait);
+	pStatistics->mechanismCount = stats->mechanismCount;
+	for (i = 0; i < stats->mechanismCount; i++) {
+		pStatistics->mechanism[i].mechanism = stats->mechanism[i].mechanism;
+		pStatistics->mechanism[i].calls = stats->mechanism[i].calls;
+		pStatistics->mechanism[i].errors = stats->mechanism[i].errors;
+		copyLatency(&pStatistics->mechanism[i].latency, &stats->mechanism[i].latency);
+	}
+
+	if (reset) {
+		memset(stats, 0, sizeof(*stats));
+	}
+}
+
+
+
+/**
+ * Duration below which the fraction p of the counted durations lies, 0 if none counted
+ */
+static unsigned long long percentile(struct p11Latency_t *l, double p)
+{
+	unsigned long long n = 0, total = 0;
+	int i;
+
+	for (i = 0; i < CK_SC_HSM_LATENCY_BUCKETS; i++) {
+		total += l->histogram[i];
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < CK_SC_HSM_LATENCY_BUCKETS - 1; i++) {
+		n += l->histogram[i];
+		if (n >= total * p) {
+			break;
+		}
+	}
+
+	return bucketLimit(i) < l->maxUs ? bucketLimit(i) : l->maxUs;
+}
+
+
+
+static void dumpLatency(FILE *fp, const char *name, struct p11Latency_t *l)
+{
+	fprintf(fp, "  %-20s count %llu avg %llu p50 %llu p90 %llu p99 %llu max %llu us\n", name,
+			l->count, l->count ? l->totalUs / l->count : 0,
+			percentile(l, 0.5), percentile(l, 0.9), percentile(l, 0.99), l->maxUs);
+}
+
+
+
+/**
+ * Rewrite the dump file with the statistics of all slots
+ */
+static void dumpSlots(struct p11SlotPool_t *pool)
+{
+	struct p11Slot_t *slot;
+	char name[20];
+	time_t t;
+	int i, len;
+	FILE *fp;
+
+	fp = fopen(dump.path, "w");
+	if (fp == NULL) {
+		return;
+	}
+
+	time(&t);
+	fprintf(fp, "# slot statistics %s", ctime(&t));
+
+	RWLOCK_RDLOCK(&pool->lock);
+
+	FOR_EACH(slot, pool->list) {
+		for (len = sizeof(slot->info.slotDescription); (len > 0) && (slot->info.slotDescription[len - 1] == ' '); len--);
+		fprintf(fp, "slot %lu \"%.*s\" apdus %llu out %llu in %llu bytes\n", (unsigned long)slot->id,
+				len, (char *)slot->info.slotDescription,
+				slot->stats.apdus, slot->stats.bytesOut, slot->stats.bytesIn);
+		dumpLatency(fp, "card", &slot->stats.card);
+		dumpLatency(fp, "lock-wait", &slot->stats.lockWait);
+		for (i = 0; i < slot->stats.mechanismCount; i++) {
+			struct p11MechanismStats_t *m = &slot->stats.mechanism[i];
+			sprintf(name, "mech 0x%08lx", (unsigned long)m->mechanism);
+			dumpLatency(fp, name, &m->latency);
+			fprintf(fp, "  %-20s calls %llu errors %llu\n", "", m->calls, m->errors);
+		}
+	}
+
+	RWLOCK_RDUNLOCK(&pool->lock);
+
+	fclose(fp);
+}
+
+
+
+#ifndef _WIN32
+static void *dumpWriter(void *arg)
+#else
+static DWORD WINAPI dumpWriter(LPVOID arg)
+#endif
+{
+	unsigned long ticks = 0;
+
+	/* wake up every 100 ms to notice stopStatsDump */
+	while (!dump.stop) {
+#ifndef _WIN32
+		struct timespec ts = { 0, 100000000 };
+		nanosleep(&ts, NULL);
+#else
+		Sleep(100);
+#endif
+		if (++ticks >= dump.interval * 10) {
+			ticks = 0;
+			dumpSlots(dump.pool);
+		}
+	}
+
+	return 0;
+}
+
+
+
+/**
+ * Start the thread writing the file named by SC_HSM_STATS, if set
+ *
+ * @param pool       Pointer to slot-pool structure.
+ */
+void startStatsDump(struct p11SlotPool_t *pool)
+{
+	const char *path, *interval;
+
+	path = getenv("SC_HSM_STATS");
+	if ((path == NULL) || (*path == 0) || dump.running) {
+		return;
+	}
+
+	interval = getenv("SC_HSM_STATS_INTERVAL");
+	dump.interval = interval ? strtoul(interval, NULL, 10) : 0;
+	if (dump.interval == 0) {
+		dump.interval = STATS_INTERVAL;
+	}
+
+	dump.path = (char *)malloc(strlen(path) + 1);
+	if (dump.path == NULL) {
+		return;
+	}
+	strcpy(dump.path, path);
+
+	dump.pool = pool;
+	dump.stop = 0;
+
+#ifndef _WIN32
+	dump.running = (pthread_create(&dumpThread, NULL, dumpWriter, NULL) == 0);
+#else
+	dumpThread = CreateThread(NULL, 0, dumpWriter, NULL, 0, NULL);
+	dump.running = (dumpThread != NULL);
+#endif
+
+	if (!dump.running) {
+		free(dump.path);
+		dump.path = NULL;
+	}
+}
+
+
+
+/**
+ * Stop the dump thread and write the final statistics
+ */
+void stopStatsDump(void)
+{
+	if (!dump.running) {
+		return;
+	}
+
+	dump.stop = 1;
+
+#ifndef _WIN32
+	pthread_join(dumpThread, NULL);
+#else
+	WaitForSingleObject(dumpThread, INFINITE);
+	CloseHandle(dumpThread);
+#endif
+
+	dumpSlots(dump.pool);
+
+	dump.running = 0;
+	free(dump.path);
+	dump.path = NULL;
+}
@@ -38,6 +38,7 @@
 #include <pkcs11/slot.h>
 #include <pkcs11/object.h>
 #include <pkcs11/token.h>
+#include <pkcs11/objectcache.h>
 #include <pkcs11/certificateobject.h>
 #include <pkcs11/privatekeyobject.h>
 #include <pkcs11/strbpcpy.h>
@@ -145,8 +146,13 @@ static int readEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *con
 
 
 
-static int addEECertificateObject(struct p11Token_t *token, unsigned char id)
+/**
+ * Read and decode the certificate of a stub object added by addEECertificateObject()
+ */
+static int loadEECertificateObject(struct p11Object_t *object)
 {
+	struct p11Token_t *token = object->token;
+	unsigned char id = (unsigned char)object->tokenid;
 	CK_OBJECT_CLASS class = CKO_CERTIFICATE;
 	CK_CERTIFICATE_TYPE certType = CKC_X_509;
 	CK_UTF8CHAR label[10];
@@ -162,10 +168,10 @@ static int addEECertificateObject(struct p11Token_t *token, unsigned char id)
 			{ CKA_ID, &id, sizeof(id) },
 			{ CKA_VALUE, certValue, sizeof(certValue) }
 	};
-	struct p11Object_t *object;
 	token_sc_hsm_t *sc;
 	struct p15PrivateKeyDescription *p15 = NULL;
-	unsigned char prkd[MAX_P15_SIZE], *spk;
+	struct asn1Certificate cert;
+	unsigned char prkd[MAX_P15_SIZE];
 	int rc;
 
 	FUNC_CALLED();
@@ -190,15 +196,12 @@ static int addEECertificateObject(struct p11Token_t *token, unsigned char id)
 	template[6].ulValueLen = rc;
 
 	if (certValue[0] != ASN1_SEQUENCE) {
+		freePrivateKeyDescription(&p15);
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error not a certificate");
 	}
 
-	object = calloc(sizeof(struct p11Object_t), 1);
-
-	if (object == NULL) {
-		freePrivateKeyDescription(&p15);
-		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
-	}
+	/* replace the attributes of the stub */
+	removeAllAttributes(object);
 
 	if (p15->coa.label) {
 		template[4].pValue = p15->coa.label;
@@ -216,28 +219,59 @@ static int addEECertificateObject(struct p11Token_t *token, unsigned char id)
 
 	if (rc != CKR_OK) {
 		freePrivateKeyDescription(&p15);
-		free(object);
 		FUNC_FAILS(rc, "Could not create certificate key object");
 	}
 
-	rc = populateIssuerSubjectSerial(object);
+	/* decode the copy in CKA_VALUE, so that the public key stays valid with the object */
+	rc = decodeCertificateObject(object, &cert);
+
+	if (rc == CKR_OK) {
+		rc = populateIssuerSubjectSerial(object, &cert);
+		sc = getPrivateData(token);
+		sc->publickeys[id] = cert.spki;
+	}
 
 	if (rc != CKR_OK) {
 #ifdef DEBUG
-		debug("populateIssuerSubjectSerial() failed\n");
+		debug("Decoding certificate failed\n");
 #endif
 	}
 
-	if (getSubjectPublicKeyInfo(object, &spk) == CKR_OK) {
-		sc = getPrivateData(token);
-		sc->publickeys[id] = spk;
+	object->keysize = p15->keysize;
+
+	freePrivateKeyDescription(&p15);
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Add certificate object as stub, which is loaded with loadEECertificateObject() on first use
+ */
+static int addEECertificateObject(struct p11Token_t *token, unsigned char id)
+{
+	CK_OBJECT_CLASS class = CKO_CERTIFICATE;
+	CK_BBOOL true = CK_TRUE;
+	CK_BBOOL false = CK_FALSE;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_TOKEN, &true, sizeof(true) },
+			{ CKA_PRIVATE, &false, sizeof(false) }
+	};
+	struct p11Object_t *object;
+
+	FUNC_CALLED();
+
+	object = createStubObject(template, sizeof(template) / sizeof(CK_ATTRIBUTE));
+
+	if (object == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
 	}
 
 	object->tokenid = (int)id;
-	object->keysize = p15->keysize;
+	object->loadAttributes = loadEECertificateObject;
 
 	addTokenObject(token, object, TRUE);
-	freePrivateKeyDescription(&p15);
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -562,8 +596,13 @@ static int sc_hsm_C_Decrypt(struct p11Object_t *object, CK_MECHANISM_TYPE mech,
 
 
 
-static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
+/**
+ * Read and decode the private key description of a stub object added by addPrivateKeyObject()
+ */
+static int loadPrivateKeyObject(struct p11Object_t *object)
 {
+	struct p11Token_t *token = object->token;
+	unsigned char id = (unsigned char)object->tokenid;
 	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
 	CK_KEY_TYPE keyType = CKK_RSA;
 	CK_UTF8CHAR label[10];
@@ -591,7 +630,7 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 			{ 0, NULL, 0 }
 	};
 	token_sc_hsm_t *sc;
-	struct p11Object_t *object;
+	struct p11Object_t *cert;
 	struct p15PrivateKeyDescription *p15 = NULL;
 	unsigned char prkd[MAX_P15_SIZE];
 	int rc,attributes;
@@ -610,13 +649,20 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding private key description");
 	}
 
-	object = calloc(sizeof(struct p11Object_t), 1);
-
-	if (object == NULL) {
-		freePrivateKeyDescription(&p15);
-		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	/* the public key is taken from the certificate, which may not be loaded yet */
+	sc = getPrivateData(token);
+	if (sc->publickeys[id] == NULL) {
+		FOR_EACH(cert, token->pubObjectList) {
+			if (cert->tokenid == id && cert->loadAttributes) {
+				loadTokenObject(token, cert, TRUE);
+				break;
+			}
+		}
 	}
 
+	/* replace the attributes of the stub */
+	removeAllAttributes(object);
+
 	if (p15->coa.label) {
 		template[4].pValue = p15->coa.label;
 	} else {
@@ -638,7 +684,6 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 	switch(p15->keytype) {
 	case P15_KEYTYPE_RSA:
 		keyType = CKK_RSA;
-		sc = getPrivateData(token);
 		if (sc->publickeys[id]) {
 			decodeModulusExponentFromSPKI(sc->publickeys[id], &template[attributes], &template[attributes + 1]);
 			attributes += 2;
@@ -646,7 +691,6 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 		break;
 	case P15_KEYTYPE_ECC:
 		keyType = CKK_ECDSA;
-		sc = getPrivateData(token);
 		if (sc->publickeys[id]) {
 			decodeECParamsFromSPKI(sc->publickeys[id], &template[attributes]);
 			attributes += 1;
@@ -654,7 +698,6 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 		break;
 	default:
 		freePrivateKeyDescription(&p15);
-		free(object);
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Unknown key type in PRKD");
 	}
 
@@ -664,30 +707,135 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 
 	if (rc != CKR_OK) {
 		freePrivateKeyDescription(&p15);
-		free(object);
 		FUNC_FAILS(rc, "Could not create private key object");
 	}
 
+	object->keysize = p15->keysize;
+
+	freePrivateKeyDescription(&p15);
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Add private key object as stub, which is loaded with loadPrivateKeyObject() on first use
+ */
+static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_BBOOL true = CK_TRUE;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_TOKEN, &true, sizeof(true) },
+			{ CKA_PRIVATE, &true, sizeof(true) }
+	};
+	struct p11Object_t *object;
+
+	FUNC_CALLED();
+
+	object = createStubObject(template, sizeof(template) / sizeof(CK_ATTRIBUTE));
+
+	if (object == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
 	object->C_SignInit = sc_hsm_C_SignInit;
 	object->C_Sign = sc_hsm_C_Sign;
 	object->C_DecryptInit = sc_hsm_C_DecryptInit;
 	object->C_Decrypt = sc_hsm_C_Decrypt;
 
 	object->tokenid = (int)id;
-	object->keysize = p15->keysize;
-	addTokenObject(token, object, FALSE);
+	object->loadAttributes = loadPrivateKeyObject;
 
-	freePrivateKeyDescription(&p15);
+	addTokenObject(token, object, FALSE);
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
+/**
+ * Build the key of the object cache from the device authentication certificate and the file list
+ *
+ * @return the length of the key or -1 if the token can not be identified
+ */
+static int getCacheKey(struct p11Token_t *token, unsigned char *filelist, int listlen, unsigned char *key, char *name, int publicObjects)
+{
+	token_sc_hsm_t *sc = getPrivateData(token);
+	unsigned long long hash = 14695981039346656037ULL;
+	int i;
+
+	if (sc->devAutCertLen == 0) {
+		sc->devAutCertLen = readEF(token->slot, DEVAUT_FID, sc->devAutCert, sizeof(sc->devAutCert));
+		if (sc->devAutCertLen <= 0) {
+			sc->devAutCertLen = -1;
+		}
+	}
+
+	if (sc->devAutCertLen < 0) {
+		return -1;
+	}
+
+	/* FNV-1a of the certificate names the file, the full certificate is compared */
+	for (i = 0; i < sc->devAutCertLen; i++) {
+		hash = (hash ^ sc->devAutCert[i]) * 1099511628211ULL;
+	}
+
+	sprintf(name, "sc-hsm-%08lx%08lx-%s.cache", (unsigned long)(hash >> 32), (unsigned long)(hash & 0xFFFFFFFF),
+		publicObjects ? "public" : "private");
+
+	memcpy(key, sc->devAutCert, sc->devAutCertLen);
+	memcpy(key + sc->devAutCertLen, filelist, listlen);
+
+	return sc->devAutCertLen + listlen;
+}
+
+
+
+/**
+ * Add the objects from the object cache to the token
+ */
+static int loadCachedObjects(struct p11Token_t *token, char *name, unsigned char *key, int keylen, int publicObjects)
+{
+	token_sc_hsm_t *sc = getPrivateData(token);
+	struct p11Object_t *list = NULL, *object;
+	unsigned char *spk;
+
+	if (readObjectCache(name, key, keylen, &list) < 0) {
+		return -1;
+	}
+
+	while (list) {
+		object = list;
+		list = object->next;
+
+		if (publicObjects) {
+			if (getSubjectPublicKeyInfo(object, &spk) == CKR_OK) {
+				sc->publickeys[object->tokenid & 0xFF] = spk;
+			}
+		} else {
+			object->C_SignInit = sc_hsm_C_SignInit;
+			object->C_Sign = sc_hsm_C_Sign;
+			object->C_DecryptInit = sc_hsm_C_DecryptInit;
+			object->C_Decrypt = sc_hsm_C_Decrypt;
+		}
+
+		addTokenObject(token, object, publicObjects);
+	}
+
+	return 0;
+}
+
+
+
 static int sc_hsm_loadObjects(struct p11Token_t *token, int publicObjects)
 {
 	unsigned char filelist[MAX_FILES * 2];
+	unsigned char key[MAX_DEVAUT_SIZE + sizeof(filelist)];
+	char name[64];
 	struct p11Slot_t *slot = token->slot;
-	int rc,listlen,i,id,prefix;
+	struct p11Object_t *object, *pNext;
+	int rc,listlen,keylen,i,id,prefix;
 
 	FUNC_CALLED();
 
@@ -697,6 +845,16 @@ static int sc_hsm_loadObjects(struct p11Token_t *token, int publicObjects)
 	}
 
 	listlen = rc;
+
+	keylen = -1;
+	if (isObjectCacheEnabled()) {
+		keylen = getCacheKey(token, filelist, listlen, key, name, publicObjects);
+
+		if ((keylen > 0) && (loadCachedObjects(token, name, key, keylen, publicObjects) == 0)) {
+			FUNC_RETURNS(CKR_OK);
+		}
+	}
+
 	for (i = 0; i < listlen; i += 2) {
 		prefix = filelist[i];
 		id = filelist[i + 1];
@@ -729,6 +887,20 @@ static int sc_hsm_loadObjects(struct p11Token_t *token, int publicObjects)
 			}
 		}
 	}
+
+	/* the cache is only written with all objects loaded */
+	if (keylen > 0) {
+		FOR_EACH_WITH_NEXT(object, pNext, publicObjects ? token->pubObjectList : token->privObjectList) {
+			loadTokenObject(token, object, publicObjects);
+		}
+
+		if (writeObjectCache(name, key, keylen, publicObjects ? token->pubObjectList : token->privObjectList) < 0) {
+#ifdef DEBUG
+			debug("Could not write object cache %s\n", name);
+#endif
+		}
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -770,6 +942,8 @@ static int updatePinStatus(struct p11Token_t *token, int pinstatus)
 		rc = CKR_PIN_INCORRECT;
 		break;
 	}
+
+	invalidateSlotInfo(token->slot);
 	return rc;
 }
 
@@ -857,6 +1031,118 @@ int sc_hsm_logout(struct p11Slot_t *slot)
 
 
 
+/**
+ * Read random bytes from the token using GET CHALLENGE
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param data      The buffer receiving the random bytes
+ * @param len       The number of bytes to read, at most MAX_EXT_APDU_LENGTH
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int getChallenge(struct p11Slot_t *slot, unsigned char *data, int len)
+{
+	int rc;
+	unsigned short SW1SW2;
+	FUNC_CALLED();
+
+	rc = transmitAPDU(slot, 0x00, 0x84, 0x00, 0x00,
+			0, NULL,
+			len, data, len, &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	if ((SW1SW2 != 0x9000) || (rc != len)) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "GET CHALLENGE failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Fill the random pool of the token to its full size
+ *
+ * @param slot      The slot in which the token is inserted
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int refillRandomPool(struct p11Slot_t *slot)
+{
+	token_sc_hsm_t *sc = getPrivateData(slot->token);
+	int rc, len;
+
+	while (sc->randomPoolLen < RANDOM_POOL_SIZE) {
+		len = RANDOM_POOL_SIZE - sc->randomPoolLen;
+		if (len > MAX_EXT_APDU_LENGTH)
+			len = MAX_EXT_APDU_LENGTH;
+
+		rc = getChallenge(slot, sc->randomPool + sc->randomPoolLen, len);
+		if (rc != CKR_OK)
+			return rc;
+
+		sc->randomPoolLen += len;
+	}
+	return CKR_OK;
+}
+
+
+
+/**
+ * Generate random bytes with the random number generator of the token
+ *
+ * Requests up to RANDOM_STREAM_SIZE bytes are served from a pool, which is filled with
+ * GET CHALLENGE commands of maximum length whenever it falls below RANDOM_LOW_WATER.
+ * Bytes are removed from the pool when returned, so no value is handed out twice.
+ * Larger requests are read from the token directly.
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param data      The buffer receiving the random bytes
+ * @param len       The number of bytes to generate
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int sc_hsm_generateRandom(struct p11Slot_t *slot, unsigned char *data, size_t len)
+{
+	token_sc_hsm_t *sc = getPrivateData(slot->token);
+	int rc, chunk;
+
+	FUNC_CALLED();
+
+	if (len > RANDOM_STREAM_SIZE) {
+		while (len > 0) {
+			chunk = len > MAX_EXT_APDU_LENGTH ? MAX_EXT_APDU_LENGTH : (int)len;
+			rc = getChallenge(slot, data, chunk);
+			if (rc != CKR_OK) {
+				FUNC_FAILS(rc, "Reading random bytes from token failed");
+			}
+			data += chunk;
+			len -= chunk;
+		}
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (sc->randomPoolLen < (int)len) {
+		rc = refillRandomPool(slot);
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Filling the random pool failed");
+		}
+	}
+
+	sc->randomPoolLen -= (int)len;
+	memcpy(data, sc->randomPool + sc->randomPoolLen, len);
+	memset(sc->randomPool + sc->randomPoolLen, 0, len);
+
+	if (sc->randomPoolLen < RANDOM_LOW_WATER) {
+		/* A failed refill is retried with the next request, the caller already has its data */
+		refillRandomPool(slot);
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 /**
  * Create a new SmartCard-HSM token if token detection and initialization is successful
  *
@@ -911,7 +1197,7 @@ int newSmartCardHSMToken(struct p11Slot_t *slot, struct p11Token_t **pptoken)
 	token->info.ulMaxRwSessionCount = CK_EFFECTIVELY_INFINITE;
 	token->info.ulSessionCount = CK_UNAVAILABLE_INFORMATION;
 
-	token->info.flags = CKF_WRITE_PROTECTED | CKF_LOGIN_REQUIRED;
+	token->info.flags = CKF_WRITE_PROTECTED | CKF_LOGIN_REQUIRED | CKF_RNG;
 	token->userType = 0xFF;
 
 	updatePinStatus(token, pinstatus);
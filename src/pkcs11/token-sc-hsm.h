@@ -42,6 +42,13 @@
 #define MAX_FILES				128
 #define MAX_CERTIFICATE_SIZE	4096
 #define MAX_P15_SIZE			1024
+#define MAX_DEVAUT_SIZE			1024
+
+#define RANDOM_POOL_SIZE		1024		/* Random bytes buffered on the host per token */
+#define RANDOM_LOW_WATER		256			/* Refill the pool when it falls below this level */
+#define RANDOM_STREAM_SIZE		512			/* Larger requests bypass the pool */
+
+#define DEVAUT_FID				0x2F02		/* EF.C_DevAut, the device authentication certificate */
 
 #define PRKD_PREFIX				0xC4		/* Hi byte in file identifier for PKCS#15 PRKD objects */
 #define CD_PREFIX				0xC8		/* Hi byte in file identifier for PKCS#15 CD objects */
@@ -72,10 +79,15 @@
 
 typedef struct token_sc_hsm {
 	unsigned char *publickeys[256];
+	int devAutCertLen;                          /* 0 if not read and -1 if not available */
+	unsigned char devAutCert[MAX_DEVAUT_SIZE];  /* identifies the token in the object cache */
+	int randomPoolLen;                          /* Unused bytes at the start of randomPool */
+	unsigned char randomPool[RANDOM_POOL_SIZE]; /* Output of GET CHALLENGE not yet returned */
 } token_sc_hsm_t;
 
 int newSmartCardHSMToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int sc_hsm_login(struct p11Slot_t *slot, int userType, unsigned char *pin, int pinlen);
 int sc_hsm_logout(struct p11Slot_t *slot);
+int sc_hsm_generateRandom(struct p11Slot_t *slot, unsigned char *data, size_t len);
 
 #endif /* ___TOKEN_SC_HSM_H_INC___ */
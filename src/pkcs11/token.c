@@ -33,6 +33,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -74,9 +75,13 @@ int addTokenObject(struct p11Token_t *token, struct p11Object_t *object, int pub
 
 	if (publicObject) {
 		addObjectToList(&token->pubObjectList, object);
+		addObjectToIndex(token->pubObjectIndex, object);
+		addObjectToAttributeIndex(token->pubAttributeIndex, object);
 		token->pubObjectCount++;
 	} else {
 		addObjectToList(&token->privObjectList, object);
+		addObjectToIndex(token->privObjectIndex, object);
+		addObjectToAttributeIndex(token->privAttributeIndex, object);
 		token->privObjectCount++;
 	}
 
@@ -95,22 +100,105 @@ int addTokenObject(struct p11Token_t *token, struct p11Object_t *object, int pub
  */
 int findTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p11Object_t **ppObject, int publicObject)
 {
-	struct p11Object_t *object;
-	int pos;
-
 	VERIFY_MUTEXOWNER(&token->slot->mutex);
 
-	pos = 0;
-	FOR_EACH(object, publicObject ? token->pubObjectList : token->privObjectList) {
-		if (object->handle == handle) {
-			*ppObject = object;
-			return pos;
+	*ppObject = findObjectInIndex(publicObject ? token->pubObjectIndex : token->privObjectIndex, handle);
+
+	if (*ppObject && (*ppObject)->loadAttributes) {
+		if (loadTokenObject(token, *ppObject, publicObject) != CKR_OK) {
+			*ppObject = NULL;
 		}
-		pos++;
 	}
 
-	*ppObject = NULL;
-	return -1;
+	return *ppObject ? 0 : -1;
+}
+
+
+
+/**
+ * Load the attributes of a token object that was added as stub
+ *
+ * The object is removed from the token if the attributes can not be loaded.
+ *
+ * @param token     The token containing the object
+ * @param object    The object
+ * @param publicObject true for a public object, false for a private object
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int loadTokenObject(struct p11Token_t *token, struct p11Object_t *object, int publicObject)
+{
+	struct p11Object_t *(*index)[ATTRIBUTE_BUCKETS];
+	int (*load)(struct p11Object_t *);
+	int rc;
+
+	VERIFY_MUTEXOWNER(&token->slot->mutex);
+
+	load = object->loadAttributes;
+
+	if (load == NULL) {
+		return CKR_OK;
+	}
+
+	object->loadAttributes = NULL;
+
+	index = publicObject ? token->pubAttributeIndex : token->privAttributeIndex;
+	removeObjectFromAttributeIndex(index, object);
+
+	rc = load(object);
+
+	if (rc != CKR_OK) {
+		removeTokenObject(token, object->handle, publicObject);
+		return rc;
+	}
+
+	addObjectToAttributeIndex(index, object);
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Load the stub objects that may match a search template
+ *
+ * A stub object is loaded if the attributes it has match the template and the template
+ * contains attributes it has not. Stub objects not loaded can be matched with the
+ * attributes they have.
+ *
+ * @param token     The token
+ * @param pTemplate The search template
+ * @param ulCount   The number of attributes in the template
+ * @param publicObject true for public objects, false for private objects
+ */
+void loadTokenObjectsForTemplate(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int publicObject)
+{
+	struct p11Object_t *object, *pNext;
+	struct p11Attribute_t *attr;
+	CK_ULONG i;
+	int missing;
+
+	VERIFY_MUTEXOWNER(&token->slot->mutex);
+
+	FOR_EACH_WITH_NEXT(object, pNext, publicObject ? token->pubObjectList : token->privObjectList) {
+		if (object->loadAttributes == NULL) {
+			continue;
+		}
+
+		missing = 0;
+		for (i = 0; i < ulCount; i++) {
+			if (findAttribute(object, pTemplate + i, &attr) < 0) {
+				missing = 1;
+			} else if ((attr->attrData.ulValueLen != pTemplate[i].ulValueLen) ||
+					memcmp(attr->attrData.pValue, pTemplate[i].pValue, pTemplate[i].ulValueLen)) {
+				break;
+			}
+		}
+
+		if ((i == ulCount) && missing) {
+			loadTokenObject(token, object, publicObject);
+		}
+	}
 }
 
 
@@ -126,8 +214,19 @@ int findTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p1
  */
 int removeTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject)
 {
+	struct p11Object_t **index, *object;
+
 	VERIFY_MUTEXOWNER(&token->slot->mutex);
 
+	index = publicObject ? token->pubObjectIndex : token->privObjectIndex;
+	object = findObjectInIndex(index, handle);
+
+	if (object == NULL)
+		return CKR_OBJECT_HANDLE_INVALID;
+
+	removeObjectFromIndex(index, object);
+	removeObjectFromAttributeIndex(publicObject ? token->pubAttributeIndex : token->privAttributeIndex, object);
+
 	if (publicObject) {
 		int rc = removeObjectFromList(&token->pubObjectList, handle);
 		if (rc != CKR_OK)
@@ -157,6 +256,8 @@ static void removePrivateObjects(struct p11Token_t *token)
 	VERIFY_MUTEXOWNER(&token->slot->mutex);
 
 	removeAllObjectsFromList(&token->privObjectList);
+	memset(token->privObjectIndex, 0, sizeof(token->privObjectIndex));
+	memset(token->privAttributeIndex, 0, sizeof(token->privAttributeIndex));
 	token->privObjectCount = 0;
 }
 
@@ -174,6 +275,8 @@ static void removePublicObjects(struct p11Token_t *token)
 	VERIFY_MUTEXOWNER(&token->slot->mutex);
 
 	removeAllObjectsFromList(&token->pubObjectList);
+	memset(token->pubObjectIndex, 0, sizeof(token->pubObjectIndex));
+	memset(token->pubAttributeIndex, 0, sizeof(token->pubAttributeIndex));
 	token->pubObjectCount = 0;
 }
 
@@ -193,6 +296,8 @@ int removeTokenObjectLeavingAttributes(struct p11Token_t *token, CK_OBJECT_HANDL
 		if ((*ppObject)->handle == handle) {
 			object = *ppObject;
 			*ppObject = object->next;
+			removeObjectFromIndex(publicObject ? token->pubObjectIndex : token->privObjectIndex, object);
+			removeObjectFromAttributeIndex(publicObject ? token->pubAttributeIndex : token->privAttributeIndex, object);
 			free(object);
 			token->pubObjectCount--;
 			return CKR_OK;
@@ -278,6 +383,26 @@ int logOut(struct p11Slot_t *slot)
 
 
 
+/**
+ * Generate random data with the random number generator of the token
+ *
+ * This token method is called from the C_GenerateRandom function at the PKCS#11 interface
+ *
+ * @param slot          The slot in which the token is inserted
+ * @param pRandomData   The buffer receiving the random data
+ * @param ulRandomLen   The number of bytes to generate
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int generateRandom(struct p11Slot_t *slot, CK_BYTE_PTR pRandomData, CK_ULONG ulRandomLen)
+{
+	VERIFY_MUTEXOWNER(&slot->mutex);
+
+	return sc_hsm_generateRandom(slot, pRandomData, ulRandomLen);
+}
+
+
+
 /**
  * Detect a newly inserted token in the designated slot
  *
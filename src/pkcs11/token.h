@@ -49,7 +49,10 @@ int addTokenObject(struct p11Token_t *token, struct p11Object_t *object, int pub
 int findTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject);
 int removeTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject);
 int removeTokenObjectLeavingAttributes(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject);
+int loadTokenObject(struct p11Token_t *token, struct p11Object_t *object, int publicObject);
+void loadTokenObjectsForTemplate(struct p11Token_t *token, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int publicObject);
 int destroyObject(struct p11Slot_t *slot, struct p11Object_t *object);
 int synchronizeToken(struct p11Slot_t *slot);
+int generateRandom(struct p11Slot_t *slot, CK_BYTE_PTR pRandomData, CK_ULONG ulRandomLen);
 
 #endif /* ___TOKEN_H_INC___ */
@@ -34,6 +34,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <ctccid/ctapi.h>
 
@@ -598,6 +601,488 @@ int TestEjectICC(int ctn)
 
 
 
+/*
+ * Benchmark mode (-b or -r)
+ *
+ * Sends each APDU of a size series or of a replay file count times and reports APDUs
+ * per second and the latency distribution. The counters of CT_stats split the time into
+ * the layers: time in USB bulk OUT transfers, waiting for bulk IN, T=1 blocks per APDU
+ * and the transmission time of the bytes at the negotiated baudrate (11 etu per
+ * character). The card time is the bulk IN wait minus the transmission time.
+ *
+ * The size series write (UPDATE BINARY) and read (READ BINARY) the elementary file
+ * BENCH_FID, size 0 is VERIFY status. The replay file contains one command APDU in hex
+ * per line or the CT_data lines of a trace written with SC_HSM_TRACE, which are replayed
+ * as READ or UPDATE BINARY with the same command and response length.
+ */
+
+#define BENCH_FID       0xEF01
+#define BENCH_MAXSIZE   4000            /* largest size fitting into MAX_APDULEN */
+#define BENCH_READERS   16
+
+static int sizes[] = { 0, 16, 128, 255, 256, 512, 1024, 2048, 4000, -1 };
+
+typedef struct {
+	int len;
+	unsigned char apdu[MAX_APDULEN];
+	char name[24];
+} BenchAPDU_t;
+
+typedef struct {
+	int ctn;
+	int count;
+	int napdu;
+	BenchAPDU_t *apdus;
+	unsigned long sent;
+	unsigned long errors;
+} BenchReader_t;
+
+static pthread_mutex_t printLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+static unsigned long long Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+
+static int CompareUS(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+
+/*
+ * Build an APDU writing cmdlen bytes at offset, reading rsplen bytes or
+ * querying the PIN status if both are 0
+ */
+static int BuildAPDU(unsigned char *apdu, int cmdlen, int offset, int rsplen)
+{
+	unsigned char *po = apdu;
+	int lc;
+
+	*po++ = 0x00;
+
+	if (cmdlen > 0) {
+		lc = 4 + (cmdlen < 128 ? 2 : cmdlen < 256 ? 3 : 4) + cmdlen;
+		*po++ = 0xD7;
+		*po++ = BENCH_FID >> 8;
+		*po++ = BENCH_FID & 0xFF;
+		if (lc <= 255) {
+			*po++ = (unsigned char)lc;
+		} else {
+			*po++ = 0;
+			*po++ = (unsigned char)(lc >> 8);
+			*po++ = (unsigned char)lc;
+		}
+		*po++ = 0x54;
+		*po++ = 0x02;
+		*po++ = (unsigned char)(offset >> 8);
+		*po++ = (unsigned char)offset;
+		*po++ = 0x53;
+		if (cmdlen >= 256) {
+			*po++ = 0x82;
+			*po++ = (unsigned char)(cmdlen >> 8);
+		} else if (cmdlen >= 128) {
+			*po++ = 0x81;
+		}
+		*po++ = (unsigned char)cmdlen;
+		memset(po, 0x5A, cmdlen);
+		po += cmdlen;
+	} else if (rsplen > 0) {
+		*po++ = 0xB1;
+		*po++ = BENCH_FID >> 8;
+		*po++ = BENCH_FID & 0xFF;
+		if (rsplen <= 256) {
+			*po++ = 4;
+		} else {
+			*po++ = 0;
+			*po++ = 0;
+			*po++ = 4;
+		}
+		*po++ = 0x54;
+		*po++ = 0x02;
+		*po++ = (unsigned char)(offset >> 8);
+		*po++ = (unsigned char)offset;
+		if (rsplen > 256) {
+			*po++ = (unsigned char)(rsplen >> 8);
+		}
+		*po++ = (unsigned char)rsplen;
+	} else {
+		*po++ = 0x20;
+		*po++ = 0x00;
+		*po++ = 0x81;
+	}
+
+	return (int)(po - apdu);
+}
+
+
+
+/*
+ * Send a raw APDU, returns the length of the response or < 0 on error
+ */
+static int SendAPDU(int ctn, unsigned char *apdu, int len, unsigned char *rsp, int size)
+{
+	unsigned short lr = (unsigned short)size;
+	unsigned char dad = 0, sad = HOST;
+	int rc;
+
+	rc = CT_data((unsigned short)ctn, &dad, &sad, (unsigned short)len, apdu, &lr, rsp);
+
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (lr < 2) {
+		return -1;
+	}
+
+	return lr;
+}
+
+
+
+/*
+ * Build the APDUs of the size series, a write and a read per size
+ */
+static int SizeSeries(BenchAPDU_t **apdus)
+{
+	BenchAPDU_t *pa;
+	int i, n = 0;
+
+	for (i = 0; sizes[i] >= 0; i++)
+		n += sizes[i] ? 2 : 1;
+
+	pa = calloc(n, sizeof(BenchAPDU_t));
+	if (!pa)
+		return -1;
+	*apdus = pa;
+
+	for (i = 0; sizes[i] >= 0; i++) {
+		pa->len = BuildAPDU(pa->apdu, sizes[i], 0, 0);
+		sprintf(pa->name, sizes[i] ? "cmd %d" : "none %d", sizes[i]);
+		pa++;
+		if (sizes[i]) {
+			pa->len = BuildAPDU(pa->apdu, 0, 0, sizes[i]);
+			sprintf(pa->name, "rsp %d", sizes[i]);
+			pa++;
+		}
+	}
+
+	return n;
+}
+
+
+
+/*
+ * Read the replay file, see the description of the benchmark mode
+ */
+static int ReadReplay(char *file, BenchAPDU_t **apdus)
+{
+	FILE *fp;
+	BenchAPDU_t *pa = NULL, *npa;
+	char line[2 * MAX_APDULEN + 256], *p;
+	int n = 0, size = 0, lc, lr, hex;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		perror(file);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+			continue;
+
+		if (n == size) {
+			size = size ? 2 * size : 64;
+			npa = realloc(pa, size * sizeof(BenchAPDU_t));
+			if (!npa) {
+				n = -1;
+				break;
+			}
+			pa = npa;
+		}
+
+		p = strstr(line, "CT_data");
+		if (p) {
+			if (sscanf(p, "CT_data ctn=%*d lc=%d lr=%d", &lc, &lr) != 2 || lc < 4 || lr < 2)
+				continue;
+			/* header, extended Lc, offset and data object tags */
+			lc = lc > 4 + 3 + 8 ? lc - 4 - 3 - 8 : 0;
+			lr -= 2;
+			if (lc > BENCH_MAXSIZE)
+				lc = BENCH_MAXSIZE;
+			if (lr > BENCH_MAXSIZE)
+				lr = BENCH_MAXSIZE;
+			if (lr > 0)
+				lc = 0;
+			pa[n].len = BuildAPDU(pa[n].apdu, lc, 0, lr);
+			sprintf(pa[n].name, lr ? "rsp %d" : "cmd %d", lr ? lr : lc);
+			n++;
+			continue;
+		}
+
+		pa[n].len = 0;
+		for (p = line; *p && *p != '#' && pa[n].len < MAX_APDULEN; p++) {
+			if (isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1])) {
+				sscanf(p, "%2x", &hex);
+				pa[n].apdu[pa[n].len++] = (unsigned char)hex;
+				p++;
+			}
+		}
+		if (pa[n].len >= 4) {
+			sprintf(pa[n].name, "line %d", n + 1);
+			n++;
+		}
+	}
+
+	fclose(fp);
+
+	if (n <= 0) {
+		fprintf(stderr, "%s: no APDUs\n", file);
+		free(pa);
+		return -1;
+	}
+
+	*apdus = pa;
+	return n;
+}
+
+
+
+/*
+ * Prepare the reader: request the ICC, select the SmartCard-HSM, verify the PIN
+ * and fill BENCH_FID for the READ BINARY series
+ */
+static int BenchSetup(int ctn)
+{
+	unsigned char apdu[MAX_APDULEN], rsp[MAX_APDULEN];
+	unsigned short lr = sizeof(rsp);
+	unsigned char dad = 1, sad = HOST;
+	int rc, len, offset;
+
+	rc = CT_data((unsigned short)ctn, &dad, &sad, sizeof(requesticc), requesticc, &lr, rsp);
+
+	if (rc < 0 || lr < 2 || rsp[lr - 2] != 0x90) {
+		printf("ctn=%d: no card, rc=%d\n", ctn, rc);
+		return -1;
+	}
+
+	memcpy(apdu, "\x00\xA4\x04\x0C\x0B\xE8\x2B\x06\x01\x04\x01\x81\xC3\x1F\x02\x01", 16);
+	rc = SendAPDU(ctn, apdu, 16, rsp, sizeof(rsp));
+
+	if (rc < 0 || rsp[rc - 2] != 0x90) {
+		printf("ctn=%d: SELECT failed, rc=%d\n", ctn, rc);
+		return -1;
+	}
+
+	memcpy(apdu, "\x00\x20\x00\x81\x06", 5);
+	memcpy(apdu + 5, PIN, 6);
+	rc = SendAPDU(ctn, apdu, 11, rsp, sizeof(rsp));
+
+	if (rc < 0 || rsp[rc - 2] != 0x90) {
+		printf("ctn=%d: VERIFY PIN failed, rc=%d\n", ctn, rc);
+		return -1;
+	}
+
+	for (offset = 0; offset < BENCH_MAXSIZE; offset += 1024) {
+		len = BuildAPDU(apdu, BENCH_MAXSIZE - offset > 1024 ? 1024 : BENCH_MAXSIZE - offset, offset, 0);
+		rc = SendAPDU(ctn, apdu, len, rsp, sizeof(rsp));
+
+		if (rc < 0 || rsp[rc - 2] != 0x90) {
+			printf("ctn=%d: UPDATE BINARY at %d failed, rc=%d\n", ctn, offset, rc);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+
+/*
+ * Run all APDUs count times and print one line per APDU
+ */
+static void *BenchRun(void *arg)
+{
+	BenchReader_t *br = arg;
+	BenchAPDU_t *pa;
+	CT_stats_t st0, st1;
+	unsigned long long *lat, start, total, wire;
+	unsigned char rsp[MAX_APDULEN];
+	unsigned long n, errors;
+	int i, j, rc;
+
+	lat = calloc(br->count, sizeof(*lat));
+
+	if (!lat) {
+		return NULL;
+	}
+
+	for (i = 0; i < br->napdu; i++) {
+		pa = &br->apdus[i];
+		errors = 0;
+		total = 0;
+		CT_stats((unsigned short)br->ctn, &st0);
+
+		for (j = 0; j < br->count; j++) {
+			start = Now();
+			rc = SendAPDU(br->ctn, pa->apdu, pa->len, rsp, sizeof(rsp));
+			lat[j] = Now() - start;
+			total += lat[j];
+
+			if (rc < 0 || (rsp[rc - 2] != 0x90 && rsp[rc - 2] != 0x63)) {
+				errors++;
+			}
+		}
+
+		CT_stats((unsigned short)br->ctn, &st1);
+		qsort(lat, br->count, sizeof(*lat), CompareUS);
+
+		n = st1.apdus - st0.apdus;
+		if (n == 0)
+			n = 1;
+		wire = st1.baud > 0 ? (unsigned long long)(st1.bytes - st0.bytes) * 11 * 1000000 / st1.baud / n : 0;
+
+		pthread_mutex_lock(&printLock);
+		printf("%3d %-10s %8.1f %7llu %7llu %7llu %7llu %7llu %7llu %7llu %6.1f %7llu %7lld %5lu\n",
+			br->ctn, pa->name,
+			total ? br->count * 1e6 / total : 0.0,
+			total / br->count,
+			lat[br->count / 2], lat[(br->count * 95) / 100], lat[(br->count * 99) / 100], lat[br->count - 1],
+			(st1.write_us - st0.write_us) / n, (st1.read_us - st0.read_us) / n,
+			(double)(st1.blocks - st0.blocks) / n, wire,
+			(long long)((st1.read_us - st0.read_us) / n) - (long long)wire,
+			errors);
+		pthread_mutex_unlock(&printLock);
+
+		br->sent += br->count;
+		br->errors += errors;
+	}
+
+	free(lat);
+	return NULL;
+}
+
+
+
+static int Benchmark(int argc, char **argv)
+{
+	BenchReader_t br[BENCH_READERS];
+	pthread_t threads[BENCH_READERS];
+	BenchAPDU_t *apdus;
+	CT_stats_t st;
+	unsigned short pn[BENCH_READERS], count = BENCH_READERS;
+	unsigned long long start, elapsed;
+	unsigned long sent = 0, errors = 0;
+	char *replay = NULL;
+	int i, n, readers = 0, parallel = 0, repeat = 50;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-b")) {
+			continue;
+		} else if (!strcmp(argv[i], "-j")) {
+			parallel = 1;
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			repeat = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+			replay = argv[++i];
+		} else {
+			printf("Usage: ctccid-test [-b] [-n count] [-j] [-r replay-file]\n");
+			printf("  -b  benchmark with the command and response size series\n");
+			printf("  -n  APDUs sent per size or replay line (default 50)\n");
+			printf("  -j  benchmark all readers concurrently instead of one after another\n");
+			printf("  -r  replay the APDUs of a file instead of the size series\n");
+			return 1;
+		}
+	}
+
+	n = replay ? ReadReplay(replay, &apdus) : SizeSeries(&apdus);
+
+	if (n < 0) {
+		return 1;
+	}
+
+	if (CT_ports(pn, &count) < 0) {
+		count = 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (CT_init((unsigned short)i, pn[i]) < 0) {
+			printf("CT_init failed for port %d\n", pn[i]);
+			continue;
+		}
+
+		if (BenchSetup(i) < 0) {
+			CT_close((unsigned short)i);
+			continue;
+		}
+
+		CT_stats((unsigned short)i, &st);
+		printf("ctn=%d port=%d %s, %d baud\n", i, pn[i], st.apdu_level ? "APDU level exchange" : "T=1", st.baud);
+
+		memset(&br[readers], 0, sizeof(br[readers]));
+		br[readers].ctn = i;
+		br[readers].count = repeat;
+		br[readers].napdu = n;
+		br[readers].apdus = apdus;
+		readers++;
+	}
+
+	if (readers == 0) {
+		printf("No reader with a SmartCard-HSM found\n");
+		free(apdus);
+		return 1;
+	}
+
+	printf("\nTimes in us per APDU, usb-out/usb-in time in bulk transfers, wire estimated at the baudrate, card = usb-in - wire\n\n");
+	printf("ctn %-10s %8s %7s %7s %7s %7s %7s %7s %7s %6s %7s %7s %5s\n",
+		"apdu", "apdu/s", "avg", "p50", "p95", "p99", "max", "usb-out", "usb-in", "blocks", "wire", "card", "err");
+
+	start = Now();
+
+	for (i = 0; i < readers; i++) {
+		if (!parallel) {
+			BenchRun(&br[i]);
+		} else if (pthread_create(&threads[i], NULL, BenchRun, &br[i])) {
+			printf("Could not start thread for ctn=%d\n", br[i].ctn);
+			br[i].ctn = -1;
+		}
+	}
+
+	for (i = 0; i < readers; i++) {
+		if (parallel && br[i].ctn >= 0) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	elapsed = Now() - start;
+
+	for (i = 0; i < readers; i++) {
+		sent += br[i].sent;
+		errors += br[i].errors;
+		CT_close((unsigned short)br[i].ctn);
+	}
+
+	printf("\n%lu APDUs, %lu errors on %d reader(s) in %.3f s: %.1f APDUs/s\n",
+		sent, errors, readers, elapsed / 1e6, elapsed ? sent * 1e6 / elapsed : 0.0);
+
+	free(apdus);
+	return errors ? 2 : 0;
+}
+
+
+
 #define MAXPORT 2
 
 /*
@@ -615,6 +1100,10 @@ int main(int argc, char **argv)
 	unsigned int i;
 	int ctns[MAXPORT],rc;
 
+	if (argc > 1) {
+		return Benchmark(argc, argv);
+	}
+
 	for (i = 0; i < MAXPORT; i++) {
 		ctns[i] = -1;
 	}
@@ -0,0 +1,699 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file sc-hsm-pkcs11-bench.c
+ * @brief Throughput and latency benchmark for the PKCS#11 interface
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+
+
+/* Default PIN unless --pin is defined */
+#define PIN "123456"
+
+/* Latency samples kept per thread, further operations are counted but not sampled */
+#define MAX_SAMPLES		(1 << 18)
+
+#define MAX_THREADS		256
+#define MAX_SLOTS		64
+#define MAX_RUNS		16
+
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+
+#define LIB_HANDLE void*
+#define P11LIBNAME "libsc-hsm-pkcs11.so"
+
+#define THREAD_FUNC void*
+
+/* Monotonic time in nanoseconds */
+static unsigned long long now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#else /* _WIN32 */
+
+#include <windows.h>
+
+#define LIB_HANDLE HMODULE
+#define P11LIBNAME "sc-hsm-pkcs11.dll"
+
+#define dlopen(fn, flag) LoadLibrary(fn)
+#define dlclose(h) FreeLibrary(h)
+#define dlsym(h, n) GetProcAddress(h, n)
+
+#define THREAD_FUNC DWORD WINAPI
+
+#define pthread_t HANDLE
+#define pthread_create(t, a, f, p) (*t = CreateThread(0, 0, f, p, 0, 0), *t ? 0 : GetLastError())
+#define pthread_join(t, r) (WaitForSingleObject(t, INFINITE), CloseHandle(t) ? 0 : GetLastError())
+
+char* dlerror()
+{
+	char* msg = "UNKNOWN";
+	FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM, 0, GetLastError(), 0, (char*)&msg, 0, 0);
+	return msg;
+}
+
+/* Monotonic time in nanoseconds */
+static unsigned long long now()
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (unsigned long long)(count.QuadPart / freq.QuadPart * 1000000000 + count.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+}
+
+#endif /* _WIN32 */
+
+
+
+#include <pkcs11/cryptoki.h>
+
+/* Operations measured */
+#define OP_SIGN			1
+#define OP_FIND			2
+#define OP_OPEN			4
+
+/* Mechanisms used for OP_SIGN */
+struct mechanism_t {
+	char                *name;
+	CK_KEY_TYPE         keytype;
+	CK_MECHANISM_TYPE   mechanism;
+	int                 datalen;        /* Length of data passed to C_Sign */
+};
+
+static struct mechanism_t mechanisms[] = {
+	{ "rsa",       CKK_RSA,   CKM_SHA256_RSA_PKCS, 1024 },
+	{ "rsa-raw",   CKK_RSA,   CKM_RSA_PKCS,        51 },	/* SHA-256 DigestInfo */
+	{ "ecdsa",     CKK_ECDSA, CKM_ECDSA_SHA256,    1024 },
+	{ "ecdsa-raw", CKK_ECDSA, CKM_ECDSA,           32 },	/* SHA-256 hash */
+	{ NULL }
+};
+
+/* Latencies measured by a single thread */
+struct samples_t {
+	unsigned long long *value;
+	size_t count;
+	unsigned long ops;
+};
+
+/* Parameter and results of a thread */
+struct thread_data {
+	CK_FUNCTION_LIST_PTR p11;
+	int threadno;
+	int operation;
+	struct mechanism_t *mech;
+	CK_SESSION_HANDLE sessions[MAX_SLOTS];
+	CK_SLOT_ID sessionSlot[MAX_SLOTS];
+	int sessionCount;
+	unsigned long errors;
+	struct samples_t host;                  /* Part of the operation not involving the token */
+	struct samples_t total;                 /* Complete operation */
+};
+
+static char *p11libname = P11LIBNAME;
+
+static CK_UTF8CHAR *pin = (CK_UTF8CHAR *)PIN;
+static CK_ULONG pinlen = 6;
+
+static int optThreads[MAX_RUNS] = { 1, 2, 4, 8 };
+static int optThreadRuns = 4;
+static int optSessionsPerThread = 1;
+static int optSlots = 0;                    /* 0 means all slots with a token */
+static int optRunTime = 5000;               /* 5 seconds */
+static int optOperations = OP_SIGN | OP_FIND | OP_OPEN;
+static int optMechanisms = 0;               /* Bit mask into mechanisms[], 0 means all */
+
+static CK_SLOT_ID slots[MAX_SLOTS];
+static int slotCount;
+static CK_OBJECT_HANDLE keys[MAX_SLOTS][sizeof(mechanisms) / sizeof(mechanisms[0])];
+
+static volatile int startRun;
+static volatile int stopRun;
+static volatile int requestClose;
+
+
+
+static void addSample(struct samples_t *samples, unsigned long long value)
+{
+	samples->ops++;
+	if (samples->count < MAX_SAMPLES) {
+		samples->value[samples->count++] = value;
+	}
+}
+
+
+
+static int compareSamples(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+
+static unsigned long long percentile(unsigned long long *sorted, size_t count, double p)
+{
+	if (count == 0)
+		return 0;
+	return sorted[(size_t)((count - 1) * p)];
+}
+
+
+
+/**
+ * Merge the samples of all threads and print operations per second and latency percentiles
+ */
+static void report(char *name, char *mech, int threads, struct thread_data *td, int host, unsigned long long elapsed)
+{
+	unsigned long long *all;
+	struct samples_t *s;
+	unsigned long ops = 0;
+	size_t count = 0;
+	int i;
+
+	for (i = 0; i < threads; i++) {
+		s = host ? &td[i].host : &td[i].total;
+		count += s->count;
+		ops += s->ops;
+	}
+
+	all = (unsigned long long *)malloc((count + 1) * sizeof(unsigned long long));
+	assert(all);
+
+	count = 0;
+	for (i = 0; i < threads; i++) {
+		s = host ? &td[i].host : &td[i].total;
+		memcpy(all + count, s->value, s->count * sizeof(unsigned long long));
+		count += s->count;
+	}
+
+	qsort(all, count, sizeof(unsigned long long), compareSamples);
+
+	printf("%-20s %-10s %7d %8d %5d %9lu %9.1f %9.1f %9.1f %9.1f\n",
+		name, mech, threads, optSessionsPerThread, slotCount, ops,
+		elapsed ? ops * 1000000000.0 / elapsed : 0.0,
+		percentile(all, count, 0.5) / 1000.0, percentile(all, count, 0.99) / 1000.0, percentile(all, count, 0.999) / 1000.0);
+
+	free(all);
+}
+
+
+
+/**
+ * Sign with C_SignInit, a length query and C_Sign. Init and length query do not exchange
+ * APDUs with the token and are recorded as host part of the operation.
+ */
+static int sign(struct thread_data *td, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key)
+{
+	CK_FUNCTION_LIST_PTR p11 = td->p11;
+	CK_MECHANISM mech = { td->mech->mechanism, NULL, 0 };
+	static CK_BYTE data[1024];
+	CK_BYTE signature[512];
+	CK_ULONG len;
+	unsigned long long start, init;
+	CK_RV rc;
+
+	start = now();
+
+	rc = p11->C_SignInit(session, &mech, key);
+	if (rc != CKR_OK)
+		return rc;
+
+	len = sizeof(signature);
+	rc = p11->C_Sign(session, data, td->mech->datalen, NULL, &len);
+	if (rc != CKR_OK) {
+		return rc;
+	}
+
+	init = now();
+
+	len = sizeof(signature);
+	rc = p11->C_Sign(session, data, td->mech->datalen, signature, &len);
+	if (rc != CKR_OK)
+		return rc;
+
+	addSample(&td->host, init - start);
+	addSample(&td->total, now() - start);
+	return CKR_OK;
+}
+
+
+
+/**
+ * Search all private keys, which are held by the module after the first search
+ */
+static int find(struct thread_data *td, CK_SESSION_HANDLE session)
+{
+	CK_FUNCTION_LIST_PTR p11 = td->p11;
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) }
+	};
+	CK_OBJECT_HANDLE handles[64];
+	CK_ULONG count;
+	unsigned long long start;
+	CK_RV rc;
+
+	start = now();
+
+	rc = p11->C_FindObjectsInit(session, template, 1);
+	if (rc != CKR_OK)
+		return rc;
+
+	do	{
+		rc = p11->C_FindObjects(session, handles, sizeof(handles) / sizeof(handles[0]), &count);
+	} while (rc == CKR_OK && count == sizeof(handles) / sizeof(handles[0]));
+
+	p11->C_FindObjectsFinal(session);
+
+	if (rc != CKR_OK)
+		return rc;
+
+	addSample(&td->total, now() - start);
+	return CKR_OK;
+}
+
+
+
+/**
+ * Open and close a session
+ */
+static int openSession(struct thread_data *td, CK_SLOT_ID slotid)
+{
+	CK_FUNCTION_LIST_PTR p11 = td->p11;
+	CK_SESSION_HANDLE session;
+	unsigned long long start;
+	CK_RV rc;
+
+	start = now();
+
+	rc = p11->C_OpenSession(slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &session);
+	if (rc != CKR_OK)
+		return rc;
+
+	rc = p11->C_CloseSession(session);
+	if (rc != CKR_OK)
+		return rc;
+
+	addSample(&td->total, now() - start);
+	return CKR_OK;
+}
+
+
+
+static THREAD_FUNC benchThreadFunc(void *arg)
+{
+	struct thread_data *td = (struct thread_data *)arg;
+	int i, mechno = (int)(td->mech - mechanisms);
+	CK_RV rc;
+
+	while (!startRun)
+		;
+
+	for (i = 0; !stopRun; i = (i + 1) % td->sessionCount) {
+		switch(td->operation) {
+		case OP_SIGN:
+			rc = sign(td, td->sessions[i], keys[td->sessionSlot[i]][mechno]);
+			break;
+		case OP_FIND:
+			rc = find(td, td->sessions[i]);
+			break;
+		default:
+			rc = openSession(td, slots[td->sessionSlot[i]]);
+			break;
+		}
+		if (rc != CKR_OK)
+			td->errors++;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Run one operation with the given number of threads for optRunTime ms and report the results
+ */
+static void run(CK_FUNCTION_LIST_PTR p11, int operation, struct mechanism_t *mech, int threads)
+{
+	static struct thread_data td[MAX_THREADS];
+	pthread_t thread[MAX_THREADS];
+	unsigned long long start, elapsed;
+	unsigned long errors = 0;
+	int prepared = threads;
+	int i, j, s, mechno = mech ? (int)(mech - mechanisms) : 0;
+	CK_RV rc;
+
+	startRun = 0;
+	stopRun = 0;
+
+	for (i = 0; i < threads; i++) {
+		memset(&td[i], 0, sizeof(td[i]));
+		td[i].p11 = p11;
+		td[i].threadno = i;
+		td[i].operation = operation;
+		td[i].mech = mech ? mech : mechanisms;
+		td[i].host.value = (unsigned long long *)malloc(MAX_SAMPLES * sizeof(unsigned long long));
+		td[i].total.value = (unsigned long long *)malloc(MAX_SAMPLES * sizeof(unsigned long long));
+		assert(td[i].host.value && td[i].total.value);
+
+		for (j = 0; j < optSessionsPerThread; j++) {
+			s = (i * optSessionsPerThread + j) % slotCount;
+			if (operation == OP_SIGN && keys[s][mechno] == CK_INVALID_HANDLE)
+				continue;
+			if (operation != OP_OPEN) {
+				rc = p11->C_OpenSession(slots[s], CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &td[i].sessions[td[i].sessionCount]);
+				if (rc != CKR_OK) {
+					printf("C_OpenSession failed with 0x%lx\n", rc);
+					continue;
+				}
+			}
+			td[i].sessionSlot[td[i].sessionCount++] = s;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (td[i].sessionCount == 0) {
+			printf("No session with a matching key for %s\n", mech ? mech->name : "-");
+			goto cleanup;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		rc = pthread_create(&thread[i], 0, benchThreadFunc, &td[i]);
+		assert(!rc);
+	}
+
+	start = now();
+	startRun = 1;
+
+	while (!requestClose && now() - start < (unsigned long long)optRunTime * 1000000) {
+#ifndef _WIN32
+		struct timespec ts = { 0, 10000000 };
+		nanosleep(&ts, NULL);
+#else
+		Sleep(10);
+#endif
+	}
+
+	stopRun = 1;
+	elapsed = now() - start;
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(thread[i], NULL);
+		errors += td[i].errors;
+	}
+
+	switch(operation) {
+	case OP_SIGN:
+		report("C_Sign", mech->name, threads, td, FALSE, elapsed);
+		report("  host part", mech->name, threads, td, TRUE, elapsed);
+		break;
+	case OP_FIND:
+		report("C_FindObjects", "-", threads, td, FALSE, elapsed);
+		break;
+	default:
+		report("C_OpenSession", "-", threads, td, FALSE, elapsed);
+		break;
+	}
+
+	if (errors) {
+		printf("  %lu operations failed\n", errors);
+	}
+
+cleanup:
+	for (i = 0; i < prepared; i++) {
+		if (operation != OP_OPEN) {
+			for (j = 0; j < td[i].sessionCount; j++) {
+				p11->C_CloseSession(td[i].sessions[j]);
+			}
+		}
+		free(td[i].host.value);
+		free(td[i].total.value);
+	}
+}
+
+
+
+/**
+ * Find the first private key usable with each mechanism on each slot
+ */
+static void findKeys(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE *sessions)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keytype;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_KEY_TYPE, &keytype, sizeof(keytype) }
+	};
+	CK_ULONG count;
+	int i, m;
+
+	for (i = 0; i < slotCount; i++) {
+		for (m = 0; mechanisms[m].name; m++) {
+			keys[i][m] = CK_INVALID_HANDLE;
+			keytype = mechanisms[m].keytype;
+
+			if (p11->C_FindObjectsInit(sessions[i], template, 2) != CKR_OK)
+				continue;
+			if (p11->C_FindObjects(sessions[i], &keys[i][m], 1, &count) != CKR_OK || count == 0)
+				keys[i][m] = CK_INVALID_HANDLE;
+			p11->C_FindObjectsFinal(sessions[i]);
+		}
+	}
+}
+
+
+
+static void usage()
+{
+	printf("sc-hsm-pkcs11-bench [--module <p11-file>] [--pin <user-pin>] [options]\n");
+	printf("  --threads <n,n,...>        Thread counts to measure (default 1,2,4,8)\n");
+	printf("  --sessions <n>             Sessions per thread (default 1)\n");
+	printf("  --slots <n>                Number of tokens to use (default all)\n");
+	printf("  --mechanism <name>         One of rsa, rsa-raw, ecdsa or ecdsa-raw (default all), may be repeated\n");
+	printf("  --operation <name>         One of sign, find or open (default all), may be repeated\n");
+	printf("  --time <s>                 Run time per measurement in seconds (default 5 s)\n");
+	exit(1);
+}
+
+
+
+static void decodeArgs(int argc, char **argv)
+{
+	int operations = 0, m;
+	char *p;
+
+	argv++;
+	argc--;
+
+	for ( ; argc--; argv++) {
+		if (!strcmp(*argv, "--pin")) {
+			if (argc-- == 0)
+				usage();
+			pin = (CK_UTF8CHAR_PTR)*++argv;
+			pinlen = strlen((char *)pin);
+		} else if (!strcmp(*argv, "--module")) {
+			if (argc-- == 0)
+				usage();
+			p11libname = *++argv;
+		} else if (!strcmp(*argv, "--threads")) {
+			if (argc-- == 0)
+				usage();
+			optThreadRuns = 0;
+			for (p = strtok(*++argv, ","); p && optThreadRuns < MAX_RUNS; p = strtok(NULL, ",")) {
+				optThreads[optThreadRuns] = atoi(p);
+				if (optThreads[optThreadRuns] < 1 || optThreads[optThreadRuns] > MAX_THREADS)
+					usage();
+				optThreadRuns++;
+			}
+		} else if (!strcmp(*argv, "--sessions")) {
+			if (argc-- == 0)
+				usage();
+			optSessionsPerThread = atoi(*++argv);
+			if (optSessionsPerThread < 1 || optSessionsPerThread > MAX_SLOTS)
+				usage();
+		} else if (!strcmp(*argv, "--slots")) {
+			if (argc-- == 0)
+				usage();
+			optSlots = atoi(*++argv);
+		} else if (!strcmp(*argv, "--mechanism")) {
+			if (argc-- == 0)
+				usage();
+			argv++;
+			for (m = 0; mechanisms[m].name && strcmp(mechanisms[m].name, *argv); m++);
+			if (!mechanisms[m].name)
+				usage();
+			optMechanisms |= 1 << m;
+		} else if (!strcmp(*argv, "--operation")) {
+			if (argc-- == 0)
+				usage();
+			argv++;
+			if (!strcmp(*argv, "sign"))
+				operations |= OP_SIGN;
+			else if (!strcmp(*argv, "find"))
+				operations |= OP_FIND;
+			else if (!strcmp(*argv, "open"))
+				operations |= OP_OPEN;
+			else
+				usage();
+		} else if (!strcmp(*argv, "--time")) {
+			if (argc-- == 0)
+				usage();
+			optRunTime = atoi(*++argv) * 1000;
+		} else {
+			printf("Unknown argument %s\n", *argv);
+			usage();
+		}
+	}
+
+	if (operations)
+		optOperations = operations;
+}
+
+
+
+static void ctrlCHandler(int sig)
+{
+	requestClose = 1;
+	signal(SIGINT, 0); /* disable handler */
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	CK_FUNCTION_LIST_PTR p11;
+	CK_RV (*C_GetFunctionList)(CK_FUNCTION_LIST_PTR_PTR);
+	CK_C_INITIALIZE_ARGS initArgs;
+	CK_SESSION_HANDLE sessions[MAX_SLOTS];
+	CK_ULONG count;
+	LIB_HANDLE dlhandle;
+	CK_RV rc;
+	int i, m;
+
+	decodeArgs(argc, argv);
+
+	dlhandle = dlopen(p11libname, RTLD_NOW);
+
+	if (!dlhandle) {
+		printf("dlopen failed with %s\n", dlerror());
+		exit(1);
+	}
+
+	C_GetFunctionList = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR))dlsym(dlhandle, "C_GetFunctionList");
+
+	if (C_GetFunctionList == NULL) {
+		printf("C_GetFunctionList not found in %s\n", p11libname);
+		exit(1);
+	}
+
+	(*C_GetFunctionList)(&p11);
+
+	memset(&initArgs, 0, sizeof(initArgs));
+	initArgs.flags = CKF_OS_LOCKING_OK;
+
+	rc = p11->C_Initialize(&initArgs);
+
+	if (rc != CKR_OK) {
+		printf("C_Initialize failed with 0x%lx\n", rc);
+		exit(1);
+	}
+
+	count = MAX_SLOTS;
+	rc = p11->C_GetSlotList(TRUE, slots, &count);
+
+	if (rc != CKR_OK || count == 0) {
+		printf("No token found\n");
+		p11->C_Finalize(NULL);
+		exit(1);
+	}
+
+	slotCount = (int)count;
+	if (optSlots > 0 && optSlots < slotCount)
+		slotCount = optSlots;
+
+	/* keep a logged in session on each slot for the duration of the benchmark */
+	for (i = 0; i < slotCount; i++) {
+		rc = p11->C_OpenSession(slots[i], CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &sessions[i]);
+		if (rc != CKR_OK) {
+			printf("C_OpenSession(Slot=%lu) failed with 0x%lx\n", slots[i], rc);
+			exit(1);
+		}
+
+		rc = p11->C_Login(sessions[i], CKU_USER, pin, pinlen);
+		if (rc != CKR_OK && rc != CKR_USER_ALREADY_LOGGED_IN) {
+			printf("C_Login(Slot=%lu) failed with 0x%lx\n", slots[i], rc);
+			exit(1);
+		}
+	}
+
+	findKeys(p11, sessions);
+
+	signal(SIGINT, ctrlCHandler);
+
+	printf("%-20s %-10s %7s %8s %5s %9s %9s %9s %9s %9s\n",
+		"operation", "mechanism", "threads", "sessions", "slots", "ops", "ops/s", "p50 us", "p99 us", "p999 us");
+
+	for (i = 0; i < optThreadRuns && !requestClose; i++) {
+		if (optOperations & OP_SIGN) {
+			for (m = 0; mechanisms[m].name && !requestClose; m++) {
+				if (!optMechanisms || (optMechanisms & (1 << m)))
+					run(p11, OP_SIGN, &mechanisms[m], optThreads[i]);
+			}
+		}
+		if ((optOperations & OP_FIND) && !requestClose)
+			run(p11, OP_FIND, NULL, optThreads[i]);
+		if ((optOperations & OP_OPEN) && !requestClose)
+			run(p11, OP_OPEN, NULL, optThreads[i]);
+	}
+
+	for (i = 0; i < slotCount; i++) {
+		p11->C_CloseSession(sessions[i]);
+	}
+
+	p11->C_Finalize(NULL);
+	dlclose(dlhandle);
+	return 0;
+}
@@ -0,0 +1,414 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Signer Application
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file broker.h
+ */
+
+#ifndef _BROKER_H_
+#define _BROKER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ultralite/log.h>
+#include <ultralite/sc-hsm-ultralite.h>
+
+/*
+ * Token broker of the CTAPI build. CTAPI implementations must NOT allow
+ * simultaneous access to the token, so the instance which gets the lock
+ * (see create_lock) owns the token and serves the signing requests of
+ * the other instances over a local socket (a named pipe on Windows)
+ * instead of turning them away. Each client connection is served by a
+ * thread, the requests are signed one after the other in their order
+ * of arrival (ticket lock), so every client gets its turn. The token
+ * session and template stay open across the clients.
+ *
+ * The owner signs with its pin, the pin of a client is not used. The
+ * socket is only accessible by the user running the owner. When the
+ * owner exits, a client takes the lock itself or connects to the new
+ * owner and repeats the request.
+ */
+#ifdef _WIN32
+#define BROKER_NAME "\\\\.\\pipe\\sc-hsm-ultralite-signer"
+typedef HANDLE conn_t;
+#define CONN_NONE INVALID_HANDLE_VALUE
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#define BROKER_NAME "/var/lock/sc-hsm-ultralite-signer.sock"
+typedef int conn_t;
+#define CONN_NONE -1
+#endif
+
+#define BROKER_MAGIC     0x53484231 /* "SHB1" */
+#define BROKER_MAX_LABEL 256
+#define BROKER_MAX_HASH  64
+#define BROKER_MAX_CMS   0x4000
+
+/*
+ * Request, followed by the label and the hash
+ */
+typedef struct
+{
+	unsigned int magic;     /* BROKER_MAGIC */
+	unsigned int label_len; /* excl. null term */
+	unsigned int hash_len;
+} broker_req_t;
+
+/*
+ * Response, followed by the CMS document if rc > 0
+ */
+typedef struct
+{
+	int rc;                 /* CMS size or error (see sign_hash) */
+} broker_rsp_t;
+
+static void* broker_mutex = (void*)-1; /* lock of the owner */
+static conn_t broker_conn = CONN_NONE; /* connection of a client */
+static const char* broker_pin;
+static lock_t broker_lock;
+static cond_t broker_cond;
+static unsigned int broker_next;       /* next ticket */
+static unsigned int broker_serving;    /* ticket allowed to sign */
+static int broker_stopping;
+#ifndef _WIN32
+static int broker_listen = -1;
+#endif
+static unsigned char broker_cms[BROKER_MAX_CMS]; /* CMS of this instance */
+
+/**
+ * Read (out = 0) or write the specified number of bytes.
+ * Returns 0 on success.
+ */
+static int conn_io(conn_t c, void* buf, int size, int out)
+{
+	char* p = (char*)buf;
+	while (size > 0) {
+#ifdef _WIN32
+		DWORD n = 0;
+		if (!(out ? WriteFile(c, p, size, &n, 0) : ReadFile(c, p, size, &n, 0)) || n == 0)
+			return -1;
+#else
+		ssize_t n = out ? send(c, p, size, MSG_NOSIGNAL) : recv(c, p, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+#endif
+		p += n;
+		size -= (int)n;
+	}
+	return 0;
+}
+
+static void conn_close(conn_t c)
+{
+#ifdef _WIN32
+	CloseHandle(c);
+#else
+	close(c);
+#endif
+}
+
+/**
+ * Wait for the turn to use the token
+ */
+static void broker_enter(void)
+{
+	unsigned int ticket;
+	lock_enter(&broker_lock);
+	ticket = broker_next++;
+	while (ticket != broker_serving)
+		cond_wait(&broker_cond, &broker_lock);
+	lock_leave(&broker_lock);
+}
+
+static void broker_leave(void)
+{
+	lock_enter(&broker_lock);
+	broker_serving++;
+	cond_broadcast(&broker_cond);
+	lock_leave(&broker_lock);
+}
+
+/**
+ * Sign the hash with the token of this instance and copy the CMS
+ * document into the specified buffer before the next request.
+ * Returns the CMS size or error if <= 0.
+ */
+static int broker_sign_local(const char* pin, const char* label,
+	const unsigned char* hash, int hash_len, unsigned char* cms)
+{
+	const unsigned char* pCms = 0;
+	int rc;
+
+	broker_enter();
+	if (broker_stopping) {
+		rc = ERR_CARD;
+	} else {
+		rc = sign_hash(pin, label, hash, hash_len, &pCms);
+		if (rc > BROKER_MAX_CMS)
+			rc = ERR_MEMORY;
+		else if (rc > 0)
+			memcpy(cms, pCms, rc);
+	}
+	broker_leave();
+	return rc;
+}
+
+/**
+ * Serve the requests of one client
+ */
+static THREAD_FUNC broker_client(void* arg)
+{
+	conn_t c = (conn_t)(size_t)arg;
+	broker_req_t req;
+	broker_rsp_t rsp;
+	char label[BROKER_MAX_LABEL + 1];
+	unsigned char hash[BROKER_MAX_HASH];
+	unsigned char* cms = (unsigned char*)malloc(BROKER_MAX_CMS);
+
+	while (cms && conn_io(c, &req, sizeof(req), 0) == 0) {
+		if (req.magic != BROKER_MAGIC || req.label_len > BROKER_MAX_LABEL || req.hash_len > BROKER_MAX_HASH) {
+			log_err("invalid broker request");
+			break;
+		}
+		if (conn_io(c, label, req.label_len, 0) || conn_io(c, hash, req.hash_len, 0))
+			break;
+		label[req.label_len] = 0;
+		rsp.rc = broker_sign_local(broker_pin, label, hash, req.hash_len, cms);
+		if (rsp.rc <= 0 && broker_stopping)
+			break; /* the client repeats the request with the next owner */
+		if (conn_io(c, &rsp, sizeof(rsp), 1) || (rsp.rc > 0 && conn_io(c, cms, rsp.rc, 1)))
+			break;
+	}
+	free(cms);
+	conn_close(c);
+	return 0;
+}
+
+/**
+ * Accept the clients until the broker stops
+ */
+static THREAD_FUNC broker_accept(void* arg)
+{
+	for (;;) {
+		thread_t t;
+		conn_t c;
+#ifdef _WIN32
+		c = CreateNamedPipe(BROKER_NAME, PIPE_ACCESS_DUPLEX,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			PIPE_UNLIMITED_INSTANCES, BROKER_MAX_CMS, BROKER_MAX_CMS, 0, 0);
+		if (c == INVALID_HANDLE_VALUE) {
+			log_err("error creating pipe %s: %d", BROKER_NAME, GetLastError());
+			break;
+		}
+		if (!ConnectNamedPipe(c, 0) && GetLastError() != ERROR_PIPE_CONNECTED) {
+			CloseHandle(c);
+			continue;
+		}
+#else
+		c = accept(broker_listen, 0, 0);
+		if (c < 0 && errno == EINTR)
+			continue;
+		if (c < 0)
+			break; /* closed by broker_stop */
+#endif
+		if (broker_stopping) {
+			conn_close(c);
+			break;
+		}
+		if (thread_create(&t, broker_client, (void*)(size_t)c)) {
+			log_err("error creating broker thread");
+			conn_close(c);
+			continue;
+		}
+#ifdef _WIN32
+		CloseHandle(t);
+#else
+		pthread_detach(t);
+#endif
+	}
+	return 0;
+}
+
+/**
+ * Take the lock of the token and serve the other instances.
+ * Returns 0 if this instance owns the token now.
+ */
+static int broker_own(void)
+{
+	thread_t t;
+
+	broker_mutex = create_lock(MUTEX_KEY);
+	if ((int)(size_t)broker_mutex < 0)
+		return -1;
+#ifndef _WIN32
+	{
+		struct sockaddr_un addr;
+		mode_t mask;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, BROKER_NAME, sizeof(addr.sun_path) - 1);
+		unlink(BROKER_NAME); /* left by an owner which crashed */
+		broker_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+		mask = umask(077); /* only the same user may sign */
+		if (broker_listen < 0 || bind(broker_listen, (struct sockaddr*)&addr, sizeof(addr)) || listen(broker_listen, 16)) {
+			int e = errno;
+			log_wrn("error creating socket %s: %s; other instances cannot sign", BROKER_NAME, strerror(e));
+			if (broker_listen >= 0)
+				close(broker_listen);
+			broker_listen = -1;
+		}
+		umask(mask);
+		if (broker_listen < 0)
+			return 0;
+	}
+#endif
+	if (thread_create(&t, broker_accept, 0)) {
+		log_wrn("error creating broker thread; other instances cannot sign");
+		return 0;
+	}
+#ifdef _WIN32
+	CloseHandle(t);
+#else
+	pthread_detach(t);
+#endif
+	return 0;
+}
+
+/**
+ * Connect to the instance owning the token.
+ * Returns 0 on success.
+ */
+static int broker_connect(void)
+{
+#ifdef _WIN32
+	HANDLE h = CreateFile(BROKER_NAME, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
+	if (h == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipe(BROKER_NAME, 2000))
+		h = CreateFile(BROKER_NAME, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
+	if (h == INVALID_HANDLE_VALUE)
+		return -1;
+	broker_conn = h;
+#else
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, BROKER_NAME, sizeof(addr.sun_path) - 1);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	broker_conn = fd;
+#endif
+	log_inf("token owned by another instance; signing through it");
+	return 0;
+}
+
+/**
+ * Take the token or connect to the instance owning it.
+ * Returns 0 on success.
+ */
+static int broker_open(const char* pin)
+{
+	broker_pin = pin;
+	lock_init(&broker_lock);
+	cond_init(&broker_cond);
+	if (broker_own() == 0 || broker_connect() == 0)
+		return 0;
+	return -1;
+}
+
+/**
+ * Sign the hash (like sign_hash) with the token of this instance or
+ * through the instance owning it. The CMS document is valid until
+ * the next call.
+ */
+static int broker_sign_hash(const char* pin, const char* label,
+	const unsigned char* hash, int hash_len, const unsigned char** pCms)
+{
+	broker_req_t req;
+	broker_rsp_t rsp;
+	int i, len = (int)strlen(label);
+
+	if (len > BROKER_MAX_LABEL || hash_len > BROKER_MAX_HASH)
+		return ERR_INVALID;
+	*pCms = broker_cms;
+	for (i = 0; i < 50; i++) {
+		if (broker_conn == CONN_NONE) {
+			if ((int)(size_t)broker_mutex >= 0)
+				return broker_sign_local(pin, label, hash, hash_len, broker_cms);
+			/* The owner exited => take over or wait for the new owner */
+			if (broker_own() == 0)
+				log_inf("token owned by this instance now");
+			else if (broker_connect())
+#ifdef _WIN32
+				Sleep(100);
+#else
+				usleep(100000);
+#endif
+			continue;
+		}
+		req.magic = BROKER_MAGIC;
+		req.label_len = len;
+		req.hash_len = hash_len;
+		if (conn_io(broker_conn, &req, sizeof(req), 1) == 0 &&
+			conn_io(broker_conn, (void*)label, len, 1) == 0 &&
+			conn_io(broker_conn, (void*)hash, hash_len, 1) == 0 &&
+			conn_io(broker_conn, &rsp, sizeof(rsp), 0) == 0) {
+			if (rsp.rc > BROKER_MAX_CMS)
+				break;
+			if (rsp.rc <= 0 || conn_io(broker_conn, broker_cms, rsp.rc, 0) == 0)
+				return rsp.rc;
+		}
+		log_wrn("lost the connection to the instance owning the token");
+		conn_close(broker_conn);
+		broker_conn = CONN_NONE;
+	}
+	return ERR_READER;
+}
+
+/**
+ * Stop serving the other instances and wait for a running signature,
+ * before the template is released
+ */
+static void broker_stop(void)
+{
+	if ((int)(size_t)broker_mutex < 0)
+		return;
+#ifndef _WIN32
+	if (broker_listen >= 0) {
+		unlink(BROKER_NAME);
+		shutdown(broker_listen, SHUT_RDWR);
+		close(broker_listen);
+		broker_listen = -1;
+	}
+#endif
+	lock_enter(&broker_lock);
+	broker_stopping = 1;
+	lock_leave(&broker_lock);
+	broker_enter(); /* never left, waiting clients lose the connection at exit */
+}
+
+/**
+ * Release the token or close the connection to its owner
+ */
+static void broker_close(void)
+{
+	if ((int)(size_t)broker_mutex >= 0)
+		release_lock(broker_mutex);
+	if (broker_conn != CONN_NONE)
+		conn_close(broker_conn);
+	broker_mutex = (void*)-1;
+	broker_conn = CONN_NONE;
+}
+
+#endif /* _BROKER_H_ */
@@ -0,0 +1,435 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Signer Application
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file digest.h
+ */
+
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ultralite/log.h>
+#include <ultralite/sc-hsm-ultralite.h>
+
+#define DIGEST_MAGIC "SignerDigest001" /* digest file header */
+
+/*
+ * The digest cache (options -d and -D) remembers the sig files of the
+ * run by the identity of the signed file (device, inode, size and
+ * modification time) and by the SHA-256 of the content together with
+ * the key label. A hard link to a signed file continues the hash from
+ * the state in the metadata of the sig file of the other name, so only
+ * the last block is read. A copy is still hashed, but the CMS document
+ * of a sig file with the same hash and label is reused instead of
+ * signing again. Entries are only used after the metadata of their sig
+ * file was read and matches, so a stale entry costs a lookup.
+ * With -D the records are kept in an append-only log like the index
+ * (see index.h), shared by all directories and runs. A record without
+ * label only holds the identity of an unchanged file. A record of a
+ * sig file replaces the previous records of it, so the content of an
+ * appended file does not pile up.
+ */
+typedef struct
+{
+	unsigned char thumb[32]; /* sha-256 of the rest of the record and the strings */
+	unsigned int  len;       /* length of the label and the sig path incl. null terms */
+	unsigned int  label_len; /* length of the label incl. null term */
+	unsigned int  dev[2];    /* hi and lo words of the device */
+	unsigned int  ino[2];    /* hi and lo words of the inode */
+	unsigned int  size[2];   /* hi and lo words of the content length */
+	unsigned int  mtime[2];  /* hi and lo words of the modification time */
+	unsigned char hash[32];  /* sha-256 of the content, if label_len > 1 */
+} digest_rec_t;
+
+/**
+ * Identity of a file, size 0 if unknown (e.g. no inodes on Windows)
+ */
+typedef struct
+{
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned long long size;
+	long long mtime;
+} file_id_t;
+
+typedef struct
+{
+	digest_rec_t rec;
+	char* label;    /* the sig path follows in the same allocation */
+	char* sig_path;
+	int dead;       /* replaced by a later record of the sig file */
+} digest_entry_t;
+
+typedef struct
+{
+	char path[MAX_PATH];    /* of the digest file, "" in memory only */
+	FILE* fp;               /* opened for append */
+	digest_entry_t** entry; /* in the order recorded, replaced ones included */
+	int count;
+	int capacity;
+	int* by_id;             /* open addressing, entry + 1, buckets is a power of 2 */
+	int* by_hash;
+	int* by_path;
+	int buckets;
+	int records;            /* records in the file */
+} digest_cache_t;
+
+#define DIGEST_HI(v) ((unsigned int)((unsigned long long)(v) >> 32))
+#define DIGEST_LO(v) ((unsigned int)(v))
+
+static void digest_thumb(const digest_rec_t* rec, const char* strings, unsigned char thumb[32])
+{
+	sha256_context ctx;
+	sha256_starts(&ctx);
+	sha256_update(&ctx, (unsigned char*)&rec->len, (unsigned int)(sizeof(*rec) - sizeof(rec->thumb)));
+	sha256_update(&ctx, (unsigned char*)strings, rec->len);
+	sha256_finish(&ctx, thumb);
+}
+
+static unsigned int digest_id_hash(const digest_rec_t* rec)
+{
+	unsigned int h = 2166136261u; /* FNV-1a of the identity words */
+	const unsigned char* p = (const unsigned char*)rec->dev;
+	const unsigned char* end = (const unsigned char*)(rec->mtime + 2);
+	while (p < end)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+static unsigned int digest_content_hash(const unsigned char* hash, const char* label)
+{
+	return ((unsigned int)hash[0] << 24 | hash[1] << 16 | hash[2] << 8 | hash[3]) ^ index_hash(label);
+}
+
+static int digest_same_id(const digest_rec_t* a, const digest_rec_t* b)
+{
+	return memcmp(a->dev, b->dev, (char*)(a->mtime + 2) - (char*)a->dev) == 0;
+}
+
+/* Bucket of the entry with the identity of rec in by_id */
+static int* digest_id_slot(digest_cache_t* d, const digest_rec_t* rec)
+{
+	int i = digest_id_hash(rec) & (d->buckets - 1);
+	while (d->by_id[i] && !digest_same_id(&d->entry[d->by_id[i] - 1]->rec, rec))
+		i = (i + 1) & (d->buckets - 1);
+	return &d->by_id[i];
+}
+
+/* Bucket of the entry with the hash and label in by_hash */
+static int* digest_hash_slot(digest_cache_t* d, const unsigned char* hash, const char* label)
+{
+	int i = digest_content_hash(hash, label) & (d->buckets - 1);
+	while (d->by_hash[i]) {
+		digest_entry_t* e = d->entry[d->by_hash[i] - 1];
+		if (!memcmp(e->rec.hash, hash, sizeof(e->rec.hash)) && !strcmp(e->label, label))
+			break;
+		i = (i + 1) & (d->buckets - 1);
+	}
+	return &d->by_hash[i];
+}
+
+/* Bucket of the latest entry of the sig file in by_path */
+static int* digest_path_slot(digest_cache_t* d, const char* sig_path)
+{
+	int i = index_hash(sig_path) & (d->buckets - 1);
+	while (d->by_path[i] && strcmp(d->entry[d->by_path[i] - 1]->sig_path, sig_path))
+		i = (i + 1) & (d->buckets - 1);
+	return &d->by_path[i];
+}
+
+/* Add the entry to the tables, replacing an entry of the same identity, content or sig file */
+static void digest_link(digest_cache_t* d, int n)
+{
+	digest_entry_t* e = d->entry[n];
+	int* slot = digest_path_slot(d, e->sig_path);
+	if (*slot) {
+		/* A record without hash does not replace the content of the sig file */
+		digest_entry_t* old = d->entry[*slot - 1];
+		if (e->rec.label_len > 1 || old->rec.label_len <= 1) {
+			old->dead = 1;
+			*slot = n + 1;
+		}
+	} else {
+		*slot = n + 1;
+	}
+	if (e->rec.size[0] || e->rec.size[1])
+		*digest_id_slot(d, &e->rec) = n + 1;
+	if (e->rec.label_len > 1)
+		*digest_hash_slot(d, e->rec.hash, e->label) = n + 1;
+}
+
+/* Append an entry for rec and the strings, returns 0 on success */
+static int digest_insert(digest_cache_t* d, const digest_rec_t* rec, const char* strings)
+{
+	digest_entry_t* e;
+	int i;
+
+	if (d->count == d->capacity) {
+		int capacity = d->capacity ? 2 * d->capacity : 256;
+		digest_entry_t** entry = (digest_entry_t**)realloc(d->entry, capacity * sizeof(digest_entry_t*));
+		if (!entry)
+			return -1;
+		d->entry = entry;
+		d->capacity = capacity;
+	}
+	if (2 * (d->count + 1) > d->buckets) { /* grow at 50% load */
+		int buckets = d->buckets ? 2 * d->buckets : 512;
+		int* by_id = (int*)calloc(buckets, sizeof(int));
+		int* by_hash = (int*)calloc(buckets, sizeof(int));
+		int* by_path = (int*)calloc(buckets, sizeof(int));
+		if (!by_id || !by_hash || !by_path) {
+			free(by_id);
+			free(by_hash);
+			free(by_path);
+			return -1;
+		}
+		free(d->by_id);
+		free(d->by_hash);
+		free(d->by_path);
+		d->by_id = by_id;
+		d->by_hash = by_hash;
+		d->by_path = by_path;
+		d->buckets = buckets;
+		for (i = 0; i < d->count; i++)
+			digest_link(d, i);
+	}
+	e = (digest_entry_t*)malloc(sizeof(digest_entry_t) + rec->len);
+	if (!e)
+		return -1;
+	e->rec = *rec;
+	e->label = (char*)(e + 1);
+	memcpy(e->label, strings, rec->len);
+	e->sig_path = e->label + rec->label_len;
+	e->dead = 0;
+	d->entry[d->count] = e;
+	digest_link(d, d->count++);
+	return 0;
+}
+
+/* Write a record to the file stream, returns 0 on success */
+static int digest_write(FILE* fp, const digest_entry_t* e)
+{
+	return fwrite(&e->rec, sizeof(e->rec), 1, fp) == 1 && fwrite(e->label, e->rec.len, 1, fp) == 1 ? 0 : -1;
+}
+
+/**
+ * Create the digest cache, loaded from and recorded to the specified
+ * file (or 0 for memory only). Returns 0 if out of memory.
+ */
+static digest_cache_t* digest_open(const char* path)
+{
+	char magic[16], strings[MAX_PATH + 256];
+	digest_rec_t rec;
+	unsigned char thumb[32];
+	digest_cache_t* d;
+	int n, rewrite = 0;
+	FILE* fp;
+
+	d = (digest_cache_t*)calloc(1, sizeof(digest_cache_t));
+	if (!d || !path)
+		return d;
+	n = snprintf(d->path, sizeof(d->path), "%s", path);
+	if (n < 0 || n >= sizeof(d->path)) {
+		log_err("error building digest file path '%s'; digests kept in memory", path);
+		d->path[0] = 0;
+		return d;
+	}
+
+	/* Load the records, stop at the first damaged one (e.g. interrupted append) */
+	fp = fopen(d->path, "rb");
+	if (fp) {
+		if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, DIGEST_MAGIC, sizeof(magic))) {
+			log_wrn("digest file '%s' of other version or byte order; will be re-created", d->path);
+			rewrite = 1;
+		} else {
+			while ((n = (int)fread(&rec, 1, sizeof(rec), fp)) != 0) {
+				if (n != sizeof(rec) || rec.label_len < 1 || rec.len <= rec.label_len || rec.len > sizeof(strings)
+				|| fread(strings, rec.len, 1, fp) != 1
+				|| (digest_thumb(&rec, strings, thumb), memcmp(thumb, rec.thumb, sizeof(thumb)))
+				|| strings[rec.label_len - 1] || strings[rec.len - 1]) {
+					log_wrn("digest file '%s' damaged after %d records; will be re-created", d->path, d->records);
+					rewrite = 1;
+					break;
+				}
+				if (digest_insert(d, &rec, strings)) {
+					log_err("error loading digest file '%s': out of memory", d->path);
+					rewrite = 1;
+					break;
+				}
+				d->records++;
+			}
+		}
+		fclose(fp);
+	}
+
+	/* Re-create a damaged file, otherwise append */
+	d->fp = fopen(d->path, rewrite ? "wb" : "ab");
+	if (d->fp && rewrite) {
+		int i, err = fwrite(DIGEST_MAGIC, sizeof(magic), 1, d->fp) != 1;
+		for (i = 0; i < d->count && !err; i++)
+			err = digest_write(d->fp, d->entry[i]);
+		d->records = d->count;
+		rewrite = err;
+	} else if (d->fp && ftell(d->fp) == 0) {
+		fwrite(DIGEST_MAGIC, sizeof(magic), 1, d->fp);
+	}
+	if (!d->fp || rewrite) {
+		int e = errno;
+		log_wrn("error writing digest file '%s': %s; digests kept in memory", d->path, strerror(e));
+		if (d->fp)
+			fclose(d->fp);
+		d->fp = 0;
+	}
+	return d;
+}
+
+/**
+ * Get the latest entry of a file with the specified identity.
+ * Returns 0 if not found.
+ */
+static const digest_entry_t* digest_get_id(digest_cache_t* d, const file_id_t* id)
+{
+	digest_rec_t rec;
+	int* slot;
+	if (!d || !d->buckets || !id->size)
+		return 0;
+	rec.dev[0] = DIGEST_HI(id->dev);
+	rec.dev[1] = DIGEST_LO(id->dev);
+	rec.ino[0] = DIGEST_HI(id->ino);
+	rec.ino[1] = DIGEST_LO(id->ino);
+	rec.size[0] = DIGEST_HI(id->size);
+	rec.size[1] = DIGEST_LO(id->size);
+	rec.mtime[0] = DIGEST_HI(id->mtime);
+	rec.mtime[1] = DIGEST_LO(id->mtime);
+	slot = digest_id_slot(d, &rec);
+	return *slot && !d->entry[*slot - 1]->dead ? d->entry[*slot - 1] : 0;
+}
+
+/**
+ * Get the latest entry of content with the specified hash signed with
+ * the key of the specified label. Returns 0 if not found.
+ */
+static const digest_entry_t* digest_get_hash(digest_cache_t* d, const unsigned char* hash, const char* label)
+{
+	int* slot;
+	if (!d || !d->buckets)
+		return 0;
+	slot = digest_hash_slot(d, hash, label);
+	return *slot && !d->entry[*slot - 1]->dead ? d->entry[*slot - 1] : 0;
+}
+
+/**
+ * Record the sig file of a file with the specified identity (size 0
+ * if unknown) and, if hash != 0, its content hash and key label.
+ * An entry already recorded this way is not recorded again.
+ */
+static void digest_put(digest_cache_t* d, const file_id_t* id, const unsigned char* hash, const char* label, const char* sig_path)
+{
+	char strings[MAX_PATH + 256];
+	digest_rec_t rec;
+	const digest_entry_t* e;
+	size_t label_len = strlen(hash ? label : "") + 1, len = label_len + strlen(sig_path) + 1;
+
+	if (!d || (!id->size && !hash) || len > sizeof(strings))
+		return;
+	memset(&rec, 0, sizeof(rec));
+	rec.len = (unsigned int)len;
+	rec.label_len = (unsigned int)label_len;
+	if (id->size) {
+		rec.dev[0] = DIGEST_HI(id->dev);
+		rec.dev[1] = DIGEST_LO(id->dev);
+		rec.ino[0] = DIGEST_HI(id->ino);
+		rec.ino[1] = DIGEST_LO(id->ino);
+		rec.size[0] = DIGEST_HI(id->size);
+		rec.size[1] = DIGEST_LO(id->size);
+		rec.mtime[0] = DIGEST_HI(id->mtime);
+		rec.mtime[1] = DIGEST_LO(id->mtime);
+	}
+	if (hash)
+		memcpy(rec.hash, hash, sizeof(rec.hash));
+	memcpy(strings, hash ? label : "", label_len);
+	memcpy(strings + label_len, sig_path, len - label_len);
+
+	/* Skip a repeated record, e.g. of an unchanged file in every run;
+	   any sig file of a hard link serves a record without hash */
+	e = id->size ? digest_get_id(d, id) : digest_get_hash(d, hash, label);
+	if (e && !hash)
+		return;
+	if (e && e->rec.len == rec.len && !memcmp(e->label, strings, len)
+		&& !memcmp(e->rec.dev, rec.dev, (char*)(rec.hash + sizeof(rec.hash)) - (char*)rec.dev))
+		return;
+
+	digest_thumb(&rec, strings, rec.thumb);
+	if (digest_insert(d, &rec, strings))
+		return;
+	if (d->fp) {
+		if (digest_write(d->fp, d->entry[d->count - 1]) || fflush(d->fp)) {
+			log_wrn("error appending to digest file '%s'", d->path);
+			fclose(d->fp);
+			d->fp = 0;
+		}
+		d->records++;
+	}
+}
+
+/**
+ * Release the digest cache. The digest file is compacted to the live
+ * entries still found by identity or content when it holds more than
+ * twice as many records.
+ */
+static void digest_close(digest_cache_t* d)
+{
+	int i;
+	if (!d)
+		return;
+	if (d->fp) {
+		int live = 0;
+		char* used = (char*)calloc(d->count + 1, 1);
+		fclose(d->fp);
+		for (i = 0; used && i < d->buckets; i++)
+			used[d->by_id[i]] = used[d->by_hash[i]] = 1;
+		for (i = 1; used && i <= d->count; i++) {
+			used[i] &= !d->entry[i - 1]->dead;
+			live += used[i];
+		}
+		if (used && d->records > 2 * live + 64) {
+			char tmp[MAX_PATH + 4];
+			FILE* fp;
+			int err;
+			snprintf(tmp, sizeof(tmp), "%s.tmp", d->path);
+			fp = fopen(tmp, "wb");
+			err = !fp || fwrite(DIGEST_MAGIC, sizeof(DIGEST_MAGIC), 1, fp) != 1;
+			for (i = 0; i < d->count && !err; i++)
+				if (used[i + 1])
+					err = digest_write(fp, d->entry[i]);
+			if (fp)
+				err |= fclose(fp) != 0;
+#ifdef _WIN32
+			if (!err)
+				remove(d->path);
+#endif
+			if (err || rename(tmp, d->path)) {
+				log_wrn("error compacting digest file '%s'", d->path);
+				remove(tmp);
+			}
+		}
+		free(used);
+	}
+	for (i = 0; i < d->count; i++)
+		free(d->entry[i]);
+	free(d->entry);
+	free(d->by_id);
+	free(d->by_hash);
+	free(d->by_path);
+	free(d);
+}
+
+#endif /* _DIGEST_H_ */
@@ -0,0 +1,287 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Signer Application
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file index.h
+ */
+
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ultralite/log.h>
+#include <ultralite/sc-hsm-ultralite.h>
+
+#define INDEX_NAME  ".sc-hsm-ultralite-signer.idx" /* hidden => never signed */
+#define INDEX_MAGIC "SignerIndex0002" /* index file header */
+#define INDEX_ORDER 0x01020304        /* follows the magic in host byte order */
+
+/*
+ * The index is an append-only log of index_rec_t records, each followed
+ * by the file name, in the directory of the signed files. A record is
+ * appended whenever a file was signed, the last record of a name wins.
+ * Unchanged files (same size and modification time as recorded) are
+ * thus skipped without opening their sig files. The metadata_t at the
+ * end of the sig files stays authoritative, the index may be deleted
+ * at any time. The records are in host byte order, an index with a
+ * different byte order is detected by INDEX_ORDER and rebuilt.
+ */
+typedef struct
+{
+	unsigned char thumb[32]; /* sha-256 of the rest of the record and the name */
+	unsigned int  len;       /* length of the name incl. null term */
+	unsigned int  clh;       /* hi word of hashed content length */
+	unsigned int  cll;       /* lo word of hashed content length */
+	unsigned int  state[8];  /* sha256_context::state */
+	unsigned int  mtime_hi;  /* modification time of the file when signed */
+	unsigned int  mtime_lo;
+} index_rec_t;
+
+typedef struct
+{
+	char* name;
+	index_rec_t rec;
+} index_entry_t;
+
+typedef struct
+{
+	char path[MAX_PATH];  /* of the index file */
+	FILE* fp;             /* opened for append */
+	index_entry_t* entry; /* open addressing, capacity is a power of 2 */
+	int capacity;
+	int count;            /* live entries */
+	int records;          /* records in the file */
+	int rewrite;          /* file is damaged or of other byte order */
+} sign_index_t;
+
+static unsigned int index_hash(const char* name)
+{
+	unsigned int h = 2166136261u; /* FNV-1a */
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+static void index_thumb(const index_rec_t* rec, const char* name, unsigned char thumb[32])
+{
+	sha256_context ctx;
+	sha256_starts(&ctx);
+	sha256_update(&ctx, (unsigned char*)&rec->len, (unsigned int)(sizeof(*rec) - sizeof(rec->thumb)));
+	sha256_update(&ctx, (unsigned char*)name, rec->len);
+	sha256_finish(&ctx, thumb);
+}
+
+static index_entry_t* index_slot(sign_index_t* idx, const char* name)
+{
+	int i = index_hash(name) & (idx->capacity - 1);
+	while (idx->entry[i].name && strcmp(idx->entry[i].name, name))
+		i = (i + 1) & (idx->capacity - 1);
+	return &idx->entry[i];
+}
+
+/* Insert or replace the entry of rec->name in the table, returns 0 on success */
+static int index_insert(sign_index_t* idx, const index_rec_t* rec, const char* name)
+{
+	index_entry_t* e;
+	if (2 * (idx->count + 1) > idx->capacity) { /* grow at 50% load */
+		int i, capacity = idx->capacity ? 2 * idx->capacity : 256;
+		index_entry_t* old = idx->entry;
+		index_entry_t* entry = (index_entry_t*)calloc(capacity, sizeof(index_entry_t));
+		if (!entry)
+			return -1;
+		idx->entry = entry;
+		for (i = 0; i < idx->capacity; i++)
+			if (old[i].name)
+				*index_slot(idx, old[i].name) = old[i];
+		idx->capacity = capacity;
+		free(old);
+	}
+	e = index_slot(idx, name);
+	if (!e->name) {
+		e->name = (char*)malloc(rec->len);
+		if (!e->name)
+			return -1;
+		memcpy(e->name, name, rec->len);
+		idx->count++;
+	}
+	e->rec = *rec;
+	return 0;
+}
+
+/* Write the header to the file stream, returns 0 on success */
+static int index_write_header(FILE* fp)
+{
+	unsigned int order = INDEX_ORDER;
+	return fwrite(INDEX_MAGIC, sizeof(INDEX_MAGIC), 1, fp) == 1 && fwrite(&order, sizeof(order), 1, fp) == 1 ? 0 : -1;
+}
+
+/* Write a record to the file stream, returns 0 on success */
+static int index_write(FILE* fp, const index_rec_t* rec, const char* name)
+{
+	return fwrite(rec, sizeof(*rec), 1, fp) == 1 && fwrite(name, rec->len, 1, fp) == 1 ? 0 : -1;
+}
+
+/**
+ * Open (or create) the index of the specified directory.
+ * Returns 0 if the index cannot be used; signing then works without.
+ */
+static sign_index_t* sign_index_open(const char* dir)
+{
+	char magic[sizeof(INDEX_MAGIC)], name[MAX_PATH];
+	unsigned int order;
+	index_rec_t rec;
+	unsigned char thumb[32];
+	sign_index_t* idx;
+	FILE* fp;
+	int n;
+
+	idx = (sign_index_t*)calloc(1, sizeof(sign_index_t));
+	if (!idx)
+		return 0;
+	n = snprintf(idx->path, sizeof(idx->path), "%s/%s", dir, INDEX_NAME);
+	if (n < 0 || n >= sizeof(idx->path)) {
+		log_err("error building index path '%s/%s'", dir, INDEX_NAME);
+		free(idx);
+		return 0;
+	}
+
+	/* Load the records, stop at the first damaged one (e.g. interrupted append) */
+	fp = fopen(idx->path, "rb");
+	if (fp) {
+		if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, INDEX_MAGIC, sizeof(magic))
+		|| fread(&order, sizeof(order), 1, fp) != 1 || order != INDEX_ORDER) {
+			log_wrn("index '%s' of other version or byte order; will be re-created", idx->path);
+			idx->rewrite = 1;
+		} else {
+			while ((n = (int)fread(&rec, 1, sizeof(rec), fp)) != 0) {
+				if (n != sizeof(rec) || rec.len < 2 || rec.len > sizeof(name) || fread(name, rec.len, 1, fp) != 1
+				|| (index_thumb(&rec, name, thumb), memcmp(thumb, rec.thumb, sizeof(thumb)))
+				|| name[rec.len - 1]) {
+					log_wrn("index '%s' damaged after %d records; will be re-created", idx->path, idx->records);
+					idx->rewrite = 1;
+					break;
+				}
+				if (index_insert(idx, &rec, name)) {
+					log_err("error loading index '%s': out of memory", idx->path);
+					idx->rewrite = 1;
+					break;
+				}
+				idx->records++;
+			}
+		}
+		fclose(fp);
+	}
+
+	/* Re-create a damaged index, otherwise append */
+	idx->fp = fopen(idx->path, idx->rewrite ? "wb" : "ab");
+	if (idx->fp && idx->rewrite) {
+		int i, err = index_write_header(idx->fp);
+		for (i = 0; i < idx->capacity && !err; i++)
+			if (idx->entry[i].name)
+				err = index_write(idx->fp, &idx->entry[i].rec, idx->entry[i].name);
+		idx->records = idx->count;
+		idx->rewrite = err;
+	} else if (idx->fp && ftell(idx->fp) == 0) {
+		index_write_header(idx->fp);
+	}
+	if (!idx->fp || idx->rewrite) {
+		int e = errno;
+		log_wrn("error writing index '%s': %s; signing without index", idx->path, strerror(e));
+		/* The lookups are still valid, new records are lost */
+		if (idx->fp)
+			fclose(idx->fp);
+		idx->fp = 0;
+	}
+	return idx;
+}
+
+/**
+ * Get the record of the file with the specified name.
+ * Returns 0 if not found.
+ */
+static const index_rec_t* sign_index_get(sign_index_t* idx, const char* name)
+{
+	index_entry_t* e;
+	if (!idx || !idx->capacity)
+		return 0;
+	e = index_slot(idx, name);
+	return e->name ? &e->rec : 0;
+}
+
+/**
+ * Record the hash context and the modification time of the file with
+ * the specified name after it was signed.
+ */
+static void sign_index_put(sign_index_t* idx, const char* name, sha256_context* hash_ctx, long long mtime)
+{
+	index_rec_t rec;
+	size_t len = strlen(name) + 1;
+	if (!idx || len > MAX_PATH)
+		return;
+	memset(&rec, 0, sizeof(rec));
+	rec.len = (unsigned int)len;
+	rec.clh = hash_ctx->total[1];
+	rec.cll = hash_ctx->total[0];
+	memcpy(rec.state, hash_ctx->state, sizeof(rec.state));
+	rec.mtime_hi = (unsigned int)((unsigned long long)mtime >> 32);
+	rec.mtime_lo = (unsigned int)mtime;
+	index_thumb(&rec, name, rec.thumb);
+	if (index_insert(idx, &rec, name))
+		return;
+	if (idx->fp) {
+		if (index_write(idx->fp, &rec, name) || fflush(idx->fp)) {
+			log_wrn("error appending to index '%s'", idx->path);
+			fclose(idx->fp);
+			idx->fp = 0;
+		}
+		idx->records++;
+	}
+}
+
+/**
+ * Close the index of a directory. The log is compacted when it holds
+ * more than twice as many records as files.
+ */
+static void sign_index_close(sign_index_t* idx)
+{
+	int i;
+	if (!idx)
+		return;
+	if (idx->fp) {
+		fclose(idx->fp);
+		if (idx->records > 2 * idx->count + 64) {
+			char tmp[MAX_PATH + 4];
+			FILE* fp;
+			int err;
+			snprintf(tmp, sizeof(tmp), "%s.tmp", idx->path);
+			fp = fopen(tmp, "wb");
+			err = !fp || index_write_header(fp);
+			for (i = 0; i < idx->capacity && !err; i++)
+				if (idx->entry[i].name)
+					err = index_write(fp, &idx->entry[i].rec, idx->entry[i].name);
+			if (fp)
+				err |= fclose(fp) != 0;
+#ifdef _WIN32
+			if (!err)
+				remove(idx->path);
+#endif
+			if (err || rename(tmp, idx->path)) {
+				log_wrn("error compacting index '%s'", idx->path);
+				remove(tmp);
+			}
+		}
+	}
+	for (i = 0; i < idx->capacity; i++)
+		free(idx->entry[i].name);
+	free(idx->entry);
+	free(idx);
+}
+
+#endif /* _INDEX_H_ */
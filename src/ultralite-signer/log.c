@@ -14,11 +14,24 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <common/mutex.h>
+#include <ultralite/log.h>
 
-/* WARNING: These functions are NOT thread-safe. */
+/* The timestamp is formatted per thread. The date and time of day are only formatted again
+   when the second changes, each line takes the milliseconds from the clock. */
 
 #define ERR_TIMESTAMP "0000-00-00T00:00:00.000+00:00"
-static char timestamp[64];
+#ifdef _MSC_VER
+static __declspec(thread) char timestamp[64];
+static __declspec(thread) long long stamp_sec;
+static __declspec(thread) char stamp_strf[20], stamp_zone[16];
+#else
+static __thread char timestamp[64];
+static __thread long long stamp_sec;
+static __thread char stamp_strf[20], stamp_zone[16];
+#endif
 
 #ifdef _WIN32
 #include <stdlib.h>
@@ -43,25 +56,28 @@ const char* GetTimestamp()
 	time_t t64;
 	int seconds, millis;
 	long gmtoff;
-	char strf[20]; /* 20 => length of yyyy-mm-ddThh:mm:ss + null term */
 	GetSystemTimeAsFileTime((FILETIME*)&nowft);
 	if (unix_base == 0)
 		init_unix_base();
 	seconds = (int)((nowft - unix_base) / 10000000);
 	millis = (int)(nowft % 10000000 / 10000);
-	t64 = seconds;
-	err = _localtime64_s(&lt, &t64);
-	if (err)
-		return ERR_TIMESTAMP;
-	err = _get_timezone(&gmtoff);
-	if (err)
-		return ERR_TIMESTAMP;
-	if (lt.tm_isdst)
-		gmtoff -= 3600;
-	n = strftime(strf, sizeof(strf), "%Y-%m-%dT%H:%M:%S", &lt);
-	if (n == 0)
-		return ERR_TIMESTAMP;
-	n = _snprintf(timestamp, sizeof(timestamp), "%s.%03d%+03d:%02d", strf, millis, -gmtoff / 3600, abs(gmtoff) % 3600 / 60);
+	if (seconds != stamp_sec) {
+		t64 = seconds;
+		err = _localtime64_s(&lt, &t64);
+		if (err)
+			return ERR_TIMESTAMP;
+		err = _get_timezone(&gmtoff);
+		if (err)
+			return ERR_TIMESTAMP;
+		if (lt.tm_isdst)
+			gmtoff -= 3600;
+		n = strftime(stamp_strf, sizeof(stamp_strf), "%Y-%m-%dT%H:%M:%S", &lt); /* 20 => length of yyyy-mm-ddThh:mm:ss + null term */
+		if (n == 0)
+			return ERR_TIMESTAMP;
+		_snprintf(stamp_zone, sizeof(stamp_zone), "%+03d:%02d", -gmtoff / 3600, abs(gmtoff) % 3600 / 60);
+		stamp_sec = seconds;
+	}
+	n = _snprintf(timestamp, sizeof(timestamp), "%s.%03d%s", stamp_strf, millis, stamp_zone);
 	if (n < 0 || n >= sizeof(timestamp))
 		return ERR_TIMESTAMP;
 	return timestamp;
@@ -69,24 +85,27 @@ const char* GetTimestamp()
 #elif defined __linux__
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
 const char* GetTimestamp()
 {
-	time_t now;
 	struct timeval tv;
 	int n, err, gmtoff;
 	struct tm lt;
-	char strf[20]; /* 20 => length of yyyy-mm-ddThh:mm:ss + null term */
 	err = gettimeofday(&tv, 0);
 	if (err)
 		return ERR_TIMESTAMP;
-	localtime_r(&tv.tv_sec, &lt);
-	gmtoff = lt.tm_gmtoff;
-	if (lt.tm_isdst)
-		gmtoff -= 3600;
-	n = strftime(strf, sizeof(strf), "%Y-%m-%dT%H:%M:%S", &lt);
-	if (n == 0)
-		return ERR_TIMESTAMP;
-	n = snprintf(timestamp, sizeof(timestamp), "%s.%03d%+03d:%02d", strf, (int)tv.tv_usec / 1000, gmtoff / 3600, gmtoff % 3600 / 60);
+	if (tv.tv_sec != stamp_sec) {
+		localtime_r(&tv.tv_sec, &lt);
+		gmtoff = lt.tm_gmtoff;
+		if (lt.tm_isdst)
+			gmtoff -= 3600;
+		n = strftime(stamp_strf, sizeof(stamp_strf), "%Y-%m-%dT%H:%M:%S", &lt); /* 20 => length of yyyy-mm-ddThh:mm:ss + null term */
+		if (n == 0)
+			return ERR_TIMESTAMP;
+		snprintf(stamp_zone, sizeof(stamp_zone), "%+03d:%02d", gmtoff / 3600, gmtoff % 3600 / 60);
+		stamp_sec = tv.tv_sec;
+	}
+	n = snprintf(timestamp, sizeof(timestamp), "%s.%03d%s", stamp_strf, (int)tv.tv_usec / 1000, stamp_zone);
 	if (n < 0 || n >= sizeof(timestamp))
 		return ERR_TIMESTAMP;
 	return timestamp;
@@ -103,12 +122,169 @@ int GetPid()
 	return pid;
 }
 
+/* Lines queued for the background writer. Both streams share the queue, so the lines
+   keep their order if stdout and stderr are redirected to the same file. The writer
+   writes the queued lines of a stream with one call when an error or warning is queued,
+   the queue is half full or the first queued line is LOG_FLUSH_MS old. */
+
+#define LOG_QUEUE    (64 * 1024) /* bytes of queued lines */
+#define LOG_LINE     4096        /* longer lines are truncated */
+#define LOG_FLUSH_MS 100
+
+int log_level = LOG_LEVEL_INF;
+
+static struct {
+	CONDVAR cond;
+	char buffer[2][LOG_QUEUE];
+	char* queue;      /* lines queued, the other buffer is written */
+	int length;
+	int urgent;       /* error or warning queued */
+	int running;      /* the writer takes the lines */
+	int stop;
+	int started;      /* cond initialized, kept for the lines logged during log_stop */
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+} sink;
+
+/* stream of a line by its prefix, see log_line */
+static FILE* LineStream(const char* line)
+{
+	return line[1] == 'I' ? stdout : stderr;
+}
+
+/* write the lines with one call per run of lines of the same stream */
+static void WriteLines(const char* lines, int length)
+{
+	const char *run = lines, *end = lines + length, *p, *nl;
+	FILE* stream;
+	while (run < end) {
+		stream = LineStream(run);
+		for (p = run; p < end && LineStream(p) == stream; p = nl ? nl + 1 : end)
+			nl = memchr(p, '\n', end - p);
+		fwrite(run, 1, p - run, stream);
+		fflush(stream);
+		run = p;
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI Writer(void* arg)
+#else
+static void* Writer(void* arg)
+#endif
+{
+	char* lines;
+	int length;
+	condvar_lock(&sink.cond);
+	for (;;) {
+		while (!sink.length && !sink.stop)
+			condvar_wait(&sink.cond);
+		/* give the next lines the chance to go with the first one */
+		if (!sink.urgent && !sink.stop && sink.length < LOG_QUEUE / 2)
+			condvar_timedwait(&sink.cond, LOG_FLUSH_MS);
+		if (!sink.length && sink.stop)
+			break;
+		lines = sink.queue;
+		length = sink.length;
+		sink.queue = lines == sink.buffer[0] ? sink.buffer[1] : sink.buffer[0];
+		sink.length = 0;
+		sink.urgent = 0;
+		condvar_broadcast(&sink.cond);
+		condvar_unlock(&sink.cond);
+		WriteLines(lines, length);
+		condvar_lock(&sink.cond);
+	}
+	sink.running = 0;
+	condvar_broadcast(&sink.cond);
+	condvar_unlock(&sink.cond);
+	return 0;
+}
+
+int log_start(void)
+{
+	int rc;
+	if (sink.started)
+		return 0;
+	if (condvar_init(&sink.cond))
+		return -1;
+	sink.queue = sink.buffer[0];
+	sink.length = sink.urgent = sink.stop = 0;
+	sink.running = 1;
+#ifdef _WIN32
+	sink.thread = CreateThread(NULL, 0, Writer, NULL, 0, NULL);
+	rc = sink.thread == NULL;
+#else
+	rc = pthread_create(&sink.thread, NULL, Writer, NULL);
+#endif
+	if (rc) {
+		sink.running = 0;
+		condvar_destroy(&sink.cond);
+		return -1;
+	}
+	sink.started = 1;
+	/* the lines queued before a return from main are written as well */
+	atexit(log_stop);
+	return 0;
+}
+
+void log_stop(void)
+{
+	if (!sink.running)
+		return;
+	condvar_lock(&sink.cond);
+	sink.stop = 1;
+	condvar_broadcast(&sink.cond);
+	condvar_unlock(&sink.cond);
+#ifdef _WIN32
+	WaitForSingleObject(sink.thread, INFINITE);
+	CloseHandle(sink.thread);
+#else
+	pthread_join(sink.thread, NULL);
+#endif
+}
+
+/* format "@<tag> <timestamp> [<pid>]: <message>" and queue it, or write it without writer */
+static void log_line(char tag, const char* fmt, va_list args)
+{
+	char line[LOG_LINE];
+	int n, m, was;
+	n = snprintf(line, sizeof(line), "@%c %s [%d]: ", tag, GetTimestamp(), GetPid());
+	m = vsnprintf(line + n, sizeof(line) - n, fmt, args);
+	if (m > 0)
+		n += m;
+	if (n >= (int)sizeof(line)) {
+		n = sizeof(line) - 1;
+		line[n - 1] = '\n';
+	}
+	if (sink.running) {
+		condvar_lock(&sink.cond);
+		while (sink.running && sink.length + n > LOG_QUEUE)
+			condvar_wait(&sink.cond);
+		if (sink.running) {
+			was = sink.length;
+			memcpy(sink.queue + sink.length, line, n);
+			sink.length += n;
+			if (tag != 'I')
+				sink.urgent = 1;
+			/* the writer waits for the first line, an urgent one or half a queue */
+			if (was == 0 || tag != 'I' || sink.length >= LOG_QUEUE / 2)
+				condvar_broadcast(&sink.cond);
+			condvar_unlock(&sink.cond);
+			return;
+		}
+		condvar_unlock(&sink.cond);
+	}
+	fwrite(line, 1, n, LineStream(line));
+}
+
 void _log_err(const char* fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stderr, "@E %s [%d]: ", GetTimestamp(), GetPid());
-	vfprintf(stderr, fmt, args);
+	log_line('E', fmt, args);
 	va_end(args);
 }
 
@@ -116,8 +292,7 @@ void _log_wrn(const char* fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stderr, "@W %s [%d]: ", GetTimestamp(), GetPid());
-	vfprintf(stderr, fmt, args);
+	log_line('W', fmt, args);
 	va_end(args);
 }
 
@@ -125,7 +300,6 @@ void _log_inf(const char* fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stdout, "@I %s [%d]: ", GetTimestamp(), GetPid());
-	vfprintf(stdout, fmt, args);
+	log_line('I', fmt, args);
 	va_end(args);
 }
@@ -0,0 +1,177 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Signer Application
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file manifest.h
+ */
+
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ultralite/log.h>
+
+#define MANIFEST_NAME  ".sc-hsm-ultralite-signer.mf" /* hidden => never signed per file */
+#define MANIFEST_MAGIC "SignerManifest0001" /* first word of the header line */
+
+/*
+ * The manifest of a directory (option -M) is a text file listing the
+ * files of the directory sorted by name (strcmp), one line each:
+ *
+ *   <sha-256 of the content, 64 hex digits> <size> <name>\n
+ *
+ * after the header line "SignerManifest0001 <since>\n". Only the
+ * manifest is signed, its sig file covers every file listed. <since>
+ * is the modification time (see stat_mtime) before which the files of
+ * the same size were not changed when the manifest was written; the
+ * next run only hashes the other files again. Names containing a line
+ * break can not be listed.
+ */
+typedef struct
+{
+	char* name;
+	unsigned long long size;
+	unsigned char digest[32];
+} manifest_entry_t;
+
+typedef struct
+{
+	manifest_entry_t* entry; /* sorted by name after manifest_sort */
+	int count;
+	int capacity;
+	long long since;
+} manifest_t;
+
+static int manifest_compare(const void* a, const void* b)
+{
+	return strcmp(((const manifest_entry_t*)a)->name, ((const manifest_entry_t*)b)->name);
+}
+
+/* Append an entry, returns 0 on success */
+static int manifest_add(manifest_t* mf, const char* name, unsigned long long size, const unsigned char digest[32])
+{
+	manifest_entry_t* e;
+	if (mf->count == mf->capacity) {
+		int capacity = mf->capacity ? 2 * mf->capacity : 256;
+		manifest_entry_t* tmp = (manifest_entry_t*)realloc(mf->entry, capacity * sizeof(manifest_entry_t));
+		if (!tmp)
+			return -1;
+		mf->entry = tmp;
+		mf->capacity = capacity;
+	}
+	e = &mf->entry[mf->count];
+	e->name = (char*)malloc(strlen(name) + 1);
+	if (!e->name)
+		return -1;
+	strcpy(e->name, name);
+	e->size = size;
+	memcpy(e->digest, digest, sizeof(e->digest));
+	mf->count++;
+	return 0;
+}
+
+static void manifest_sort(manifest_t* mf)
+{
+	if (mf->count > 1)
+		qsort(mf->entry, mf->count, sizeof(manifest_entry_t), manifest_compare);
+}
+
+/**
+ * Get the entry of the file with the specified name in the sorted
+ * manifest. Returns 0 if not listed.
+ */
+static const manifest_entry_t* manifest_find(const manifest_t* mf, const char* name)
+{
+	manifest_entry_t key;
+	if (mf->count == 0)
+		return 0;
+	key.name = (char*)name;
+	return (const manifest_entry_t*)bsearch(&key, mf->entry, mf->count, sizeof(manifest_entry_t), manifest_compare);
+}
+
+static int manifest_hex(int c)
+{
+	return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/**
+ * Read the manifest at the specified path into mf (zeroed by the
+ * caller). Returns 0 on success, -1 if it does not exist or does not
+ * parse, mf then holds the entries before the damaged line.
+ */
+static int manifest_read(const char* path, manifest_t* mf)
+{
+	char line[MAX_PATH + 128];
+	unsigned char digest[32];
+	FILE* fp;
+	int err = 0;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -1;
+	if (!fgets(line, sizeof(line), fp) || strncmp(line, MANIFEST_MAGIC " ", sizeof(MANIFEST_MAGIC))) {
+		log_wrn("manifest '%s' of other version; will be re-created", path);
+		fclose(fp);
+		return -1;
+	}
+	mf->since = strtoll(line + sizeof(MANIFEST_MAGIC), 0, 10);
+	while (fgets(line, sizeof(line), fp)) {
+		char* p = line + 64, * end;
+		unsigned long long size;
+		int i, len = (int)strlen(line);
+		for (i = 0; i < 32 && !err; i++) {
+			int hi = manifest_hex(line[2 * i]), lo = hi < 0 ? -1 : manifest_hex(line[2 * i + 1]);
+			err = lo < 0;
+			digest[i] = (unsigned char)(hi << 4 | lo);
+		}
+		if (err || *p++ != ' ' || len < 68 || line[len - 1] != '\n') {
+			err = 1;
+			break;
+		}
+		size = strtoull(p, &end, 10);
+		line[len - 1] = 0;
+		if (end == p || *end != ' ' || !end[1] || manifest_add(mf, end + 1, size, digest)) {
+			err = 1;
+			break;
+		}
+	}
+	fclose(fp);
+	if (err) {
+		log_wrn("manifest '%s' damaged after %d files; will be re-created", path, mf->count);
+		return -1;
+	}
+	manifest_sort(mf);
+	return 0;
+}
+
+/* Write the sorted manifest to the file stream, returns 0 on success */
+static int manifest_print(FILE* fp, const manifest_t* mf)
+{
+	int i, j, err = fprintf(fp, "%s %lld\n", MANIFEST_MAGIC, mf->since) < 0;
+	for (i = 0; i < mf->count && !err; i++) {
+		const manifest_entry_t* e = &mf->entry[i];
+		char hex[65];
+		for (j = 0; j < 32; j++)
+			sprintf(hex + 2 * j, "%02x", e->digest[j]);
+		err = fprintf(fp, "%s %llu %s\n", hex, e->size, e->name) < 0;
+	}
+	return err ? -1 : 0;
+}
+
+static void manifest_free(manifest_t* mf)
+{
+	int i;
+	for (i = 0; i < mf->count; i++)
+		free(mf->entry[i].name);
+	free(mf->entry);
+	memset(mf, 0, sizeof(*mf));
+}
+
+#endif /* _MANIFEST_H_ */
@@ -20,7 +20,12 @@
 #include <ultralite/sc-hsm-ultralite.h>
 
 #define METADATA_MAGIC "EatZeroRedAnts!" /* metadata_t constant id value */
-#define METADATA_VERSION 104 /* metadata_t version number */
+#define METADATA_VERSION 105 /* metadata_t version number */
+#define METADATA_VERSION_CP 105 /* first version with checkpoints */
+#define METADATA_VERSION_MIN 104 /* oldest version still read */
+#define METADATA_VERSION_TREE 106 /* tree hash profile, see tree_t */
+
+#define METADATA_CHECKPOINTS 32 /* max. checkpoints saved with metadata_t */
 
 #define swap32(val) ( val >> 24 | (0x00FF0000 & val) >> 8 | (0x0000FF00 & val) << 8 | (0x000000FF & val) << 24 )
 
@@ -56,23 +61,77 @@ typedef struct
 } metadata_t;
 
 /**
- * Compute the thumbprint (SHA-256) of a metadata_t struct
+ * Hash state at an offset of the content (version 105). A list of
+ * checkpoints may be saved in front of the metadata_t, metadata_t::len
+ * includes it. The signer writes none, as resuming a shrunk file at a
+ * checkpoint misses changes before it; lists of earlier signers are
+ * still read.
  */
-static void get_thumb(metadata_t* md, unsigned char thumb[32]) /* 32 => 256-bit sha-256 */
+typedef struct
+{
+	unsigned int  state[8]; /* sha256_context::state at the offset */
+	unsigned int  clh;      /* hi word of the offset */
+	unsigned int  cll;      /* lo word of the offset */
+} checkpoint_t;
+
+typedef struct
+{
+	int count;
+	checkpoint_t cp[METADATA_CHECKPOINTS];
+} checkpoints_t;
+
+/**
+ * Tree hash profile (version 106, option -T). The content is split
+ * into leaves of 2^shift bytes and the digest signed is the Merkle
+ * tree hash of RFC 6962: SHA-256(0x00 || leaf) for the leaves and
+ * SHA-256(0x01 || left || right) for the nodes, the last leaf may be
+ * shorter. The roots of the perfect subtrees over the complete leaves
+ * (the right spine, largest first) are saved in front of the
+ * metadata_t instead of checkpoints, so after an append only the last
+ * and the new leaves are hashed. metadata_t::state is zero.
+ */
+#define TREE_SHIFT 22 /* 4 MiB leaves */
+#define TREE_PEAKS 64
+
+typedef struct
+{
+	unsigned int shift;                 /* leaf size 2^shift */
+	unsigned int count;                 /* roots in peak */
+	unsigned char peak[TREE_PEAKS][32];
+} tree_t;
+
+/**
+ * Compute the thumbprint (SHA-256) of a metadata_t struct and the
+ * checkpoints or tree_t (as stored, ext_len bytes) in front of it
+ */
+static void get_thumb(metadata_t* md, const void* ext, size_t ext_len, unsigned char thumb[32]) /* 32 => 256-bit sha-256 */
 {
 	sha256_context ctx;
 	sha256_starts(&ctx);
+	if (ext_len > 0)
+		sha256_update(&ctx, (unsigned char*)ext, (unsigned int)ext_len);
 	sha256_update(&ctx, (unsigned char*)&md->state, (unsigned int)((char*)(&md->ver + 1) - (char*)md->state));
 	sha256_finish(&ctx, thumb);
 }
 
 /**
- * Write a metadata_t to the specified file stream.
+ * Write the checkpoints (or 0) and a metadata_t to the specified file stream.
  */
-int write_metadata(FILE* fp, sha256_context* hash_ctx)
+int write_metadata(FILE* fp, sha256_context* hash_ctx, checkpoints_t* cps)
 {
-	int n;
+	int i, n, count = cps ? cps->count : 0;
+	unsigned int len = (unsigned int)(sizeof(metadata_t) + count * sizeof(checkpoint_t));
 	metadata_t md;
+	checkpoint_t cp[METADATA_CHECKPOINTS];
+
+	/* Store the offsets in the byte order of the metadata_t */
+	for (i = 0; i < count; i++) {
+		cp[i] = cps->cp[i];
+#ifdef LITTLE_ENDIAN
+		cp[i].clh = swap32(cp[i].clh);
+		cp[i].cll = swap32(cp[i].cll);
+#endif
+	}
 
 	/* Initialize the metadata_t struct with the specified values */
 	memset(&md, 0, sizeof(md));
@@ -81,20 +140,22 @@ int write_metadata(FILE* fp, sha256_context* hash_ctx)
 #ifdef LITTLE_ENDIAN
 	md.clh = swap32(hash_ctx->total[1]);
 	md.cll = swap32(hash_ctx->total[0]);
-	md.len = swap32(sizeof(md));
+	md.len = swap32(len);
 	md.ver = swap32(METADATA_VERSION);
 #else
 	md.clh = hash_ctx->total[1];
 	md.cll = hash_ctx->total[0];
-	md.len = sizeof(md);
+	md.len = len;
 	md.ver = METADATA_VERSION;
 #endif
 
 	/* Create & store a thumbprint of the metadata_t struct */
-	get_thumb(&md, md.thumb);
+	get_thumb(&md, cp, count * sizeof(checkpoint_t), md.thumb);
 
-	/* Write the metadata_t struct to the file stream */
-	n = fwrite(&md, sizeof(metadata_t), 1, fp);
+	/* Write the checkpoints and the metadata_t struct to the file stream */
+	n = count ? fwrite(cp, count * sizeof(checkpoint_t), 1, fp) : 1;
+	if (n == 1)
+		n = fwrite(&md, sizeof(metadata_t), 1, fp);
 	if (n != 1) {
 		int e = errno;
 		log_err("error writing metadata_t: %s", strerror(e));
@@ -105,13 +166,72 @@ int write_metadata(FILE* fp, sha256_context* hash_ctx)
 }
 
 /**
- * Read a metadata_t from the end of the specified path
+ * Write the tree_t and a metadata_t of the tree hash profile with the
+ * content length of hash_ctx to the specified file stream.
  */
-int read_metadata(const char* path, metadata_t* md)
+int write_metadata_tree(FILE* fp, sha256_context* hash_ctx, const tree_t* tree)
 {
-	int n, err, rv = -1;
+	metadata_t md;
+	tree_t t = *tree;
+	unsigned int len = (unsigned int)(sizeof(metadata_t) + sizeof(tree_t));
+
+	memset(&md, 0, sizeof(md));
+	memcpy(md.magic, METADATA_MAGIC, sizeof(md.magic));
+#ifdef LITTLE_ENDIAN
+	t.shift = swap32(t.shift);
+	t.count = swap32(t.count);
+	md.clh = swap32(hash_ctx->total[1]);
+	md.cll = swap32(hash_ctx->total[0]);
+	md.len = swap32(len);
+	md.ver = swap32(METADATA_VERSION_TREE);
+#else
+	md.clh = hash_ctx->total[1];
+	md.cll = hash_ctx->total[0];
+	md.len = len;
+	md.ver = METADATA_VERSION_TREE;
+#endif
+	get_thumb(&md, &t, sizeof(t), md.thumb);
+
+	if (fwrite(&t, sizeof(t), 1, fp) != 1 || fwrite(&md, sizeof(md), 1, fp) != 1) {
+		int e = errno;
+		log_err("error writing metadata_t: %s", strerror(e));
+		return e;
+	}
+	return 0;
+}
+
+/**
+ * Check for the magic value of a metadata_t at the end of the specified
+ * path, without logging (e.g. a signature made by another tool).
+ * Returns 1 if present; read_metadata_tree verifies the metadata_t.
+ */
+int has_metadata(const char* path)
+{
+	char magic[sizeof(METADATA_MAGIC)];
+	FILE* fp = fopen(path, "rb");
+	int rv = fp && fseek(fp, -32, SEEK_END) == 0 && fread(magic, sizeof(magic), 1, fp) == 1
+		&& memcmp(magic, METADATA_MAGIC, sizeof(magic)) == 0;
+	if (fp)
+		fclose(fp);
+	return rv;
+}
+
+/**
+ * Read a metadata_t and the checkpoints (if cps != 0) or the tree_t of
+ * the tree hash profile (if tree != 0) in front of it from the end of
+ * the specified path. md->ver tells the profile.
+ */
+int read_metadata_tree(const char* path, metadata_t* md, checkpoints_t* cps, tree_t* tree)
+{
+	int i, n, err, count = 0, rv = -1;
 	FILE* fp = 0;
 	unsigned char thumb[32]; /* 32 => 256-bit sha256 */
+	checkpoint_t cp[METADATA_CHECKPOINTS];
+	tree_t t;
+	unsigned int len, ver;
+
+	if (cps)
+		cps->count = 0;
 
 	/* Open the specified path for reading */
 	fp = fopen(path, "rb");
@@ -137,8 +257,34 @@ int read_metadata(const char* path, metadata_t* md)
 		goto read_metadata_cleanup;
 	}
 
+	/* Read the checkpoints or the tree_t in front of the metadata_t struct */
+	len = md->len;
+	ver = md->ver;
+#ifdef LITTLE_ENDIAN
+	len = swap32(len);
+	ver = swap32(ver);
+#endif
+	if (ver == METADATA_VERSION_TREE) {
+		if (len != sizeof(*md) + sizeof(t) || fseek(fp, -(int)len, SEEK_END) || fread(&t, sizeof(t), 1, fp) != 1) {
+			rv = errno;
+			log_err("error reading tree from '%s': %s", path, strerror(rv));
+			goto read_metadata_cleanup;
+		}
+	} else if (len > sizeof(*md) && (len - sizeof(*md)) % sizeof(checkpoint_t) == 0
+		&& (len - sizeof(*md)) / sizeof(checkpoint_t) <= METADATA_CHECKPOINTS) {
+		count = (int)((len - sizeof(*md)) / sizeof(checkpoint_t));
+		if (fseek(fp, -(int)len, SEEK_END) || fread(cp, count * sizeof(checkpoint_t), 1, fp) != 1) {
+			rv = errno;
+			log_err("error reading checkpoints from '%s': %s", path, strerror(rv));
+			goto read_metadata_cleanup;
+		}
+	}
+
 	/* Verify the thumbprint */
-	get_thumb(md, thumb);
+	if (ver == METADATA_VERSION_TREE)
+		get_thumb(md, &t, sizeof(t), thumb);
+	else
+		get_thumb(md, cp, count * sizeof(checkpoint_t), thumb);
 	if (memcmp(thumb, md->thumb, sizeof(thumb))) {
 		log_err("error reading metadata_t from '%s': thumbprint mismatch", path);
 		goto read_metadata_cleanup;
@@ -153,16 +299,17 @@ int read_metadata(const char* path, metadata_t* md)
 #endif
 
 	/* Verify the version */
-	if (md->ver != METADATA_VERSION) {
+	if ((md->ver < METADATA_VERSION_MIN || md->ver > METADATA_VERSION) && md->ver != METADATA_VERSION_TREE) {
 		log_err("error reading metadata_t from '%s': version exp: %d act: %d",
 			path, METADATA_VERSION, md->ver);
 		goto read_metadata_cleanup;
 	}
 
 	/* Verify the length */
-	if (md->len != sizeof(*md)) {
+	if (md->ver != METADATA_VERSION_TREE && (md->len != sizeof(*md) + count * sizeof(checkpoint_t)
+		|| (count && md->ver < METADATA_VERSION_CP))) {
 		log_err("error reading metadata_t from '%s': length exp: %d act: %d",
-			path, sizeof(*md), md->len);
+			path, sizeof(*md) + count * sizeof(checkpoint_t), md->len);
 		goto read_metadata_cleanup;
 	}
 
@@ -173,6 +320,26 @@ int read_metadata(const char* path, metadata_t* md)
 		goto read_metadata_cleanup;
 	}
 
+	/* Return the checkpoints */
+	for (i = 0; cps && i < count; i++) {
+		cps->cp[i] = cp[i];
+#ifdef LITTLE_ENDIAN
+		cps->cp[i].clh = swap32(cp[i].clh);
+		cps->cp[i].cll = swap32(cp[i].cll);
+#endif
+	}
+	if (cps)
+		cps->count = count;
+	if (tree && md->ver == METADATA_VERSION_TREE) {
+		*tree = t;
+#ifdef LITTLE_ENDIAN
+		tree->shift = swap32(t.shift);
+		tree->count = swap32(t.count);
+#endif
+		if (tree->count > TREE_PEAKS)
+			tree->count = 0; /* never valid, see tree_valid */
+	}
+
 	/* Success */
 	rv = 0;
 
@@ -189,4 +356,13 @@ read_metadata_cleanup:
 	return rv;
 }
 
+/**
+ * Read a metadata_t and the checkpoints in front of it (if cps != 0)
+ * from the end of the specified path
+ */
+int read_metadata(const char* path, metadata_t* md, checkpoints_t* cps)
+{
+	return read_metadata_tree(path, md, cps, 0);
+}
+
 #endif /* _METADATA_H_ */
@@ -0,0 +1,246 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Signer Application
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file metrics.h
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <ultralite/log.h>
+#include <ultralite/sc-hsm-ultralite.h>
+
+#define METRICS_MS 60000 /* period of the metrics file in the daemon modes */
+
+/*
+ * Counters of a run (option -m), written as JSON or, if the file name
+ * ends with ".prom", in the Prometheus text format (node exporter
+ * textfile collector) at the end of the run and every METRICS_MS in
+ * the daemon modes. The file is replaced atomically. The counters are
+ * cumulative since the start and updated lock free like the statistics
+ * of the library (see stats.c). The sign latency includes the broker
+ * round trip and uses the histogram buckets of the library
+ * (SC_STATS_BUCKETS), the percentiles are the upper bucket bounds.
+ */
+typedef struct
+{
+	unsigned long long scanned;      /* files checked */
+	unsigned long long unchanged;    /* skipped, sig file up to date */
+	unsigned long long new_files;    /* no sig file yet */
+	unsigned long long modified;     /* appended, hash resumed */
+	unsigned long long shrunk;       /* truncated, hashed from the beginning */
+	unsigned long long linked;       /* new, hash resumed from the sig file of a hard link */
+	unsigned long long reused;       /* signature of a copy reused, not signed again */
+	unsigned long long signed_files; /* sig files written */
+	unsigned long long failed;       /* token errors */
+	unsigned long long bytes_total;  /* content length of the signed files */
+	unsigned long long bytes_hashed; /* read and hashed, the rest was resumed */
+	unsigned long long hash_us;      /* time reading and hashing, summed over the threads */
+	unsigned long long sign_count;
+	unsigned long long sign_us;
+	unsigned long long sign_max_us;
+	unsigned long long sign_histogram[SC_STATS_BUCKETS];
+} metrics_t;
+
+#if defined(_WIN32)
+	#define METRICS_ADD(ptr, val) InterlockedExchangeAdd64((volatile LONGLONG*)(ptr), (LONGLONG)(val))
+	#define METRICS_CAS(ptr, old, val) (InterlockedCompareExchange64((volatile LONGLONG*)(ptr), (LONGLONG)(val), (LONGLONG)(old)) == (LONGLONG)(old))
+#elif defined(HAVE_SYNC_ADD_AND_FETCH)
+	#define METRICS_ADD(ptr, val) __sync_add_and_fetch((ptr), (val))
+	#define METRICS_CAS(ptr, old, val) __sync_bool_compare_and_swap((ptr), (old), (val))
+#else /* not thread-safe */
+	#define METRICS_ADD(ptr, val) (*(ptr) += (val))
+	#define METRICS_CAS(ptr, old, val) (*(ptr) = (val), 1)
+#endif
+
+#define metric_inc(name) METRICS_ADD(&metrics.name, 1)
+#define metric_add(name, val) METRICS_ADD(&metrics.name, (unsigned long long)(val))
+
+static metrics_t metrics;
+static const char* metrics_path;          /* option -m or 0 */
+static unsigned long long metrics_start;  /* us */
+static unsigned long long metrics_last;   /* us of the last write */
+
+/* Monotonic clock in us */
+static unsigned long long metrics_now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (unsigned long long)(count.QuadPart / freq.QuadPart * 1000000
+		+ count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Account a signature which took the specified time */
+static void metrics_sign(int rc, unsigned long long us)
+{
+	unsigned long long max;
+	int i;
+
+	if (rc <= 0) {
+		metric_inc(failed);
+		return;
+	}
+	for (i = 0; i < SC_STATS_BUCKETS - 1 && us >= 32ull << i; i++)
+		;
+	metric_inc(sign_count);
+	metric_add(sign_us, us);
+	metric_inc(sign_histogram[i]);
+	do {
+		max = metrics.sign_max_us;
+	} while (us > max && !METRICS_CAS(&metrics.sign_max_us, max, us));
+}
+
+/* Upper bound in us of the specified percentile of the sign latency */
+static unsigned long long metrics_percentile(const metrics_t* m, int percent)
+{
+	unsigned long long n = 0, rank = (m->sign_count * percent + 99) / 100;
+	int i;
+
+	if (m->sign_count == 0)
+		return 0;
+	for (i = 0; i < SC_STATS_BUCKETS - 1; i++) {
+		n += m->sign_histogram[i];
+		if (n >= rank)
+			return (32ull << i) < m->sign_max_us ? 32ull << i : m->sign_max_us;
+	}
+	return m->sign_max_us;
+}
+
+static void metrics_json(FILE* fp, const metrics_t* m, double elapsed)
+{
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"elapsed_s\": %.3f,\n", elapsed);
+	fprintf(fp, "  \"files\": {\"scanned\": %llu, \"unchanged\": %llu, \"new\": %llu, "
+		"\"modified\": %llu, \"shrunk\": %llu, \"linked\": %llu, \"reused\": %llu, "
+		"\"signed\": %llu, \"failed\": %llu},\n",
+		m->scanned, m->unchanged, m->new_files, m->modified, m->shrunk, m->linked, m->reused,
+		m->signed_files, m->failed);
+	fprintf(fp, "  \"bytes\": {\"total\": %llu, \"hashed\": %llu, \"resumed\": %llu},\n",
+		m->bytes_total, m->bytes_hashed, m->bytes_total - m->bytes_hashed);
+	fprintf(fp, "  \"hash_s\": %.3f,\n", m->hash_us / 1e6);
+	fprintf(fp, "  \"hash_mb_s\": %.1f,\n", m->hash_us ? m->bytes_hashed / (double)m->hash_us : 0.0);
+	fprintf(fp, "  \"sign\": {\"count\": %llu, \"total_s\": %.3f, \"avg_ms\": %.3f, "
+		"\"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}\n",
+		m->sign_count, m->sign_us / 1e6, m->sign_count ? m->sign_us / 1e3 / m->sign_count : 0.0,
+		metrics_percentile(m, 50) / 1e3, metrics_percentile(m, 95) / 1e3,
+		metrics_percentile(m, 99) / 1e3, m->sign_max_us / 1e3);
+	fprintf(fp, "}\n");
+}
+
+static void metrics_prom(FILE* fp, const metrics_t* m, double elapsed)
+{
+	static const int quantile[] = { 50, 95, 99 };
+	int i;
+
+	fprintf(fp, "# HELP sc_hsm_signer_elapsed_seconds Time since the start of the signer.\n");
+	fprintf(fp, "# TYPE sc_hsm_signer_elapsed_seconds gauge\n");
+	fprintf(fp, "sc_hsm_signer_elapsed_seconds %.3f\n", elapsed);
+	fprintf(fp, "# HELP sc_hsm_signer_files_total Files by the result of the check.\n");
+	fprintf(fp, "# TYPE sc_hsm_signer_files_total counter\n");
+	fprintf(fp, "sc_hsm_signer_files_total{state=\"scanned\"} %llu\n", m->scanned);
+	fprintf(fp, "sc_hsm_signer_files_total{state=\"unchanged\"} %llu\n", m->unchanged);
+	fprintf(fp, "sc_hsm_signer_files_total{state=\"new\"} %llu\n", m->new_files);
+	fprintf(fp, "sc_hsm_signer_files_total{state=\"modified\"} %llu\n", m->modified);
+	fprintf(fp, "sc_hsm_signer_files_total{state=\"shrunk\"} %llu\n", m->shrunk);
+	fprintf(fp, "sc_hsm_signer_files_total{state=\"linked\"} %llu\n", m->linked);
+	fprintf(fp, "sc_hsm_signer_files_total{state=\"reused\"} %llu\n", m->reused);
+	fprintf(fp, "sc_hsm_signer_files_total{state=\"signed\"} %llu\n", m->signed_files);
+	fprintf(fp, "sc_hsm_signer_files_total{state=\"failed\"} %llu\n", m->failed);
+	fprintf(fp, "# HELP sc_hsm_signer_bytes_total Content of the signed files, read and hashed or resumed from the metadata.\n");
+	fprintf(fp, "# TYPE sc_hsm_signer_bytes_total counter\n");
+	fprintf(fp, "sc_hsm_signer_bytes_total{kind=\"hashed\"} %llu\n", m->bytes_hashed);
+	fprintf(fp, "sc_hsm_signer_bytes_total{kind=\"resumed\"} %llu\n", m->bytes_total - m->bytes_hashed);
+	fprintf(fp, "# HELP sc_hsm_signer_hash_seconds_total Time reading and hashing, summed over the threads.\n");
+	fprintf(fp, "# TYPE sc_hsm_signer_hash_seconds_total counter\n");
+	fprintf(fp, "sc_hsm_signer_hash_seconds_total %.6f\n", m->hash_us / 1e6);
+	fprintf(fp, "# HELP sc_hsm_signer_sign_seconds Latency of the signatures (upper bucket bounds).\n");
+	fprintf(fp, "# TYPE sc_hsm_signer_sign_seconds summary\n");
+	for (i = 0; i < (int)(sizeof(quantile) / sizeof(quantile[0])); i++)
+		fprintf(fp, "sc_hsm_signer_sign_seconds{quantile=\"0.%d\"} %.6f\n", quantile[i], metrics_percentile(m, quantile[i]) / 1e6);
+	fprintf(fp, "sc_hsm_signer_sign_seconds_sum %.6f\n", m->sign_us / 1e6);
+	fprintf(fp, "sc_hsm_signer_sign_seconds_count %llu\n", m->sign_count);
+}
+
+/* Write the metrics file, replacing the previous one */
+static void metrics_write(void)
+{
+	char tmp_path[MAX_PATH];
+	metrics_t m = metrics;
+	double elapsed;
+	size_t len;
+	FILE* fp;
+	int n;
+
+	if (!metrics_path)
+		return;
+	metrics_last = metrics_now();
+	elapsed = (metrics_last - metrics_start) / 1e6;
+	n = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics_path);
+	if (n < 0 || n >= sizeof(tmp_path)) {
+		log_err("error building metrics file path '%s.tmp'", metrics_path);
+		return;
+	}
+	fp = fopen(tmp_path, "w");
+	if (!fp) {
+		int e = errno;
+		log_err("error creating metrics file '%s': %s", tmp_path, strerror(e));
+		return;
+	}
+	len = strlen(metrics_path);
+	if (len > 5 && strcmp(metrics_path + len - 5, ".prom") == 0)
+		metrics_prom(fp, &m, elapsed);
+	else
+		metrics_json(fp, &m, elapsed);
+	if (fclose(fp)) {
+		int e = errno;
+		log_err("error writing metrics file '%s': %s", tmp_path, strerror(e));
+		remove(tmp_path);
+		return;
+	}
+#ifdef _WIN32
+	if (!MoveFileEx(tmp_path, metrics_path, MOVEFILE_REPLACE_EXISTING)) {
+		log_err("error replacing metrics file '%s': %d", metrics_path, GetLastError());
+#else
+	if (rename(tmp_path, metrics_path)) {
+		int e = errno;
+		log_err("error replacing metrics file '%s': %s", metrics_path, strerror(e));
+#endif
+		remove(tmp_path);
+	}
+}
+
+/*
+ * Write the metrics file if METRICS_MS passed since the last write.
+ * Returns the ms until the next write or -1 without metrics file.
+ */
+static long metrics_tick(void)
+{
+	unsigned long long now;
+
+	if (!metrics_path)
+		return -1;
+	now = metrics_now();
+	if (now - metrics_last >= METRICS_MS * 1000ull) {
+		metrics_write();
+		now = metrics_last;
+	}
+	return (long)((metrics_last + METRICS_MS * 1000ull - now) / 1000);
+}
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,829 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Signer Application
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file net.h
+ */
+
+#ifndef _NET_H_
+#define _NET_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ultralite/log.h>
+#include <ultralite/sc-hsm-ultralite.h>
+
+/*
+ * Signing service (options -n and -N). The instances on the hosts
+ * without a token hash their files themselves and send only the
+ * SHA-256 hash and the key label to a server over TCP. For each label
+ * the server opens a pool of its tokens holding the key (see pool.c)
+ * with the first request. The requests of all connections are queued
+ * per label and signed in batches (sc_pool_sign_hashes), at most one
+ * batch per token of the pool at a time: while the tokens sign, the
+ * next requests queue up, so the batches grow with the load without
+ * delaying a single request.
+ *
+ * Client and server share a key (option -k) and authenticate each
+ * other with HMAC-SHA256 over the nonces of both sides. Each message
+ * carries a MAC with the session key over its sequence number, so it
+ * cannot be altered, replayed or reordered. The messages are not
+ * encrypted, hashes and signatures are not secret. The server signs
+ * with its pin, the pin of a client is not used.
+ */
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <wincrypt.h>
+typedef SOCKET sock_t;
+#define SOCK_NONE INVALID_SOCKET
+#define sock_close(s) closesocket(s)
+#define MSG_NOSIGNAL 0
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+typedef int sock_t;
+#define SOCK_NONE -1
+#define sock_close(s) close(s)
+#endif
+
+#define NET_MAGIC     0x53484e31 /* "SHN1" */
+#define NET_NONCE     16
+#define NET_MAC       32
+#define NET_HASH      32         /* SHA-256 only */
+#define NET_MAX_LABEL 256
+#define NET_MAX_CMS   0x4000
+#define NET_MAX_KEY   1024
+#define NET_BATCH     64         /* hashes per batch */
+#define NET_WORKERS   16         /* batches signed at a time over all labels */
+#define NET_AUTH_MS   10000      /* timeout of the authentication */
+#define NET_RETRIES   30         /* connection attempts of a client, one per second */
+
+/*
+ * Authentication, the server sends the hello, the client answers with
+ * its nonce and HMAC(key, "client" | nonces), the server confirms with
+ * HMAC(key, "server" | nonces). The session key is HMAC(key, "session" | nonces).
+ */
+typedef struct
+{
+	unsigned int magic;                 /* NET_MAGIC, network byte order */
+	unsigned char nonce[NET_NONCE];
+} net_hello_t;
+
+typedef struct
+{
+	unsigned char nonce[NET_NONCE];
+	unsigned char mac[NET_MAC];
+} net_auth_t;
+
+/*
+ * Request, followed by the label and the MAC
+ */
+typedef struct
+{
+	unsigned int label_len;             /* excl. null term, network byte order */
+	unsigned char hash[NET_HASH];
+} net_req_t;
+
+/*
+ * Response, followed by the CMS document if rc > 0 and the MAC
+ */
+typedef struct
+{
+	int rc;                             /* CMS size or error (see sign_hash), network byte order */
+} net_rsp_t;
+
+typedef struct
+{
+	sock_t s;
+	unsigned char key[NET_MAC];         /* session key */
+	unsigned int seq_in, seq_out;       /* messages received and sent */
+	char peer[64];
+} net_session_t;
+
+/*
+ * Request of a connection, queued for its label
+ */
+typedef struct net_call
+{
+	struct net_call* next;
+	const unsigned char* hash;
+	unsigned char* cms;                 /* NET_MAX_CMS bytes of the connection */
+	int rc;                             /* CMS size or error, 0 while not signed */
+	int done;
+	unsigned long long start;           /* us, queued */
+} net_call_t;
+
+typedef struct net_label
+{
+	struct net_label* next;
+	char* label;
+	sign_pool_t* pool;
+	int state;                          /* NET_CLOSED, NET_OPENING or NET_OPEN */
+	int running;                        /* batches being signed */
+	net_call_t* head;                   /* queued requests */
+	net_call_t** tail;
+} net_label_t;
+
+#define NET_CLOSED  0
+#define NET_OPENING 1
+#define NET_OPEN    2
+
+static unsigned char net_key[NET_MAX_KEY]; /* shared key */
+static int net_key_len;
+static const char* net_server;          /* option -N */
+static net_session_t net_session = { SOCK_NONE };
+static int net_rejected;                /* authentication failed, not retried */
+static unsigned char net_cms[NET_MAX_CMS]; /* CMS of this instance */
+static sock_t net_listen = SOCK_NONE;   /* option -n */
+static const char* net_pin;
+static net_label_t* net_labels;
+static lock_t net_lock;
+static cond_t net_work;                 /* requests queued or stopping */
+static cond_t net_done;                 /* requests signed */
+static int net_stopping;
+static thread_t net_worker[NET_WORKERS];
+static int net_workers;
+
+typedef struct
+{
+	sha256_context inner, outer;
+} net_hmac_t;
+
+static void net_hmac_init(net_hmac_t* h, const unsigned char* key, int len)
+{
+	unsigned char pad[64], k[32];
+	int i;
+
+	if (len > 64) {
+		sha256_starts(&h->inner);
+		sha256_update(&h->inner, (unsigned char*)key, len);
+		sha256_finish(&h->inner, k);
+		key = k;
+		len = sizeof(k);
+	}
+	for (i = 0; i < 64; i++)
+		pad[i] = (i < len ? key[i] : 0) ^ 0x36;
+	sha256_starts(&h->inner);
+	sha256_update(&h->inner, pad, 64);
+	for (i = 0; i < 64; i++)
+		pad[i] ^= 0x36 ^ 0x5c;
+	sha256_starts(&h->outer);
+	sha256_update(&h->outer, pad, 64);
+}
+
+static void net_hmac_update(net_hmac_t* h, const void* data, int len)
+{
+	sha256_update(&h->inner, (unsigned char*)data, len);
+}
+
+static void net_hmac_final(net_hmac_t* h, unsigned char mac[NET_MAC])
+{
+	unsigned char d[32];
+	sha256_finish(&h->inner, d);
+	sha256_update(&h->outer, d, sizeof(d));
+	sha256_finish(&h->outer, mac);
+}
+
+/* Compare in constant time, 1 if equal */
+static int net_equal(const unsigned char* a, const unsigned char* b, int len)
+{
+	unsigned char diff = 0;
+	while (len-- > 0)
+		diff |= *a++ ^ *b++;
+	return diff == 0;
+}
+
+/* HMAC with the shared key over the purpose and the nonces */
+static void net_derive(const char* purpose, const unsigned char* ns, const unsigned char* nc, unsigned char mac[NET_MAC])
+{
+	net_hmac_t h;
+	net_hmac_init(&h, net_key, net_key_len);
+	net_hmac_update(&h, purpose, (int)strlen(purpose) + 1);
+	net_hmac_update(&h, ns, NET_NONCE);
+	net_hmac_update(&h, nc, NET_NONCE);
+	net_hmac_final(&h, mac);
+}
+
+/* MAC of a message of the client (dir 'C') or server ('S') with the session key */
+static void net_mac(const net_session_t* ss, char dir, unsigned int seq,
+	const void* head, int head_len, const void* data, int len, unsigned char mac[NET_MAC])
+{
+	net_hmac_t h;
+	unsigned char b[5];
+	b[0] = dir;
+	b[1] = (unsigned char)(seq >> 24);
+	b[2] = (unsigned char)(seq >> 16);
+	b[3] = (unsigned char)(seq >> 8);
+	b[4] = (unsigned char)seq;
+	net_hmac_init(&h, ss->key, NET_MAC);
+	net_hmac_update(&h, b, sizeof(b));
+	net_hmac_update(&h, head, head_len);
+	net_hmac_update(&h, data, len);
+	net_hmac_final(&h, mac);
+}
+
+/* Nonce from the random source of the OS, 0 on success */
+static int net_random(unsigned char* buf, int len)
+{
+#ifdef _WIN32
+	HCRYPTPROV prov;
+	int rc = -1;
+	if (CryptAcquireContext(&prov, 0, 0, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT)) {
+		if (CryptGenRandom(prov, len, buf))
+			rc = 0;
+		CryptReleaseContext(prov, 0);
+	}
+#else
+	FILE* fp = fopen("/dev/urandom", "rb");
+	int rc = fp && fread(buf, 1, len, fp) == (size_t)len ? 0 : -1;
+	if (fp)
+		fclose(fp);
+#endif
+	if (rc)
+		log_err("error reading random nonce");
+	return rc;
+}
+
+/**
+ * Read the shared key from the specified file, a trailing line break is
+ * not part of the key. Returns 0 on success.
+ */
+static int net_load_key(const char* path)
+{
+	FILE* fp = fopen(path, "rb");
+	if (!fp) {
+		int e = errno;
+		log_err("error opening key file '%s': %s", path, strerror(e));
+		return -1;
+	}
+	net_key_len = (int)fread(net_key, 1, sizeof(net_key), fp);
+	fclose(fp);
+	while (net_key_len > 0 && (net_key[net_key_len - 1] == '\n' || net_key[net_key_len - 1] == '\r'))
+		net_key_len--;
+	if (net_key_len < 16) {
+		log_err("key file '%s' must hold at least 16 bytes", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int net_init(void)
+{
+#ifdef _WIN32
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa)) {
+		log_err("error initializing winsock: %d", WSAGetLastError());
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/**
+ * Read (out = 0) or write the specified number of bytes.
+ * Returns 0 on success.
+ */
+static int net_io(sock_t s, void* buf, int size, int out)
+{
+	char* p = (char*)buf;
+	while (size > 0) {
+		int n = (int)(out ? send(s, p, size, MSG_NOSIGNAL) : recv(s, p, size, 0));
+#ifndef _WIN32
+		if (n < 0 && errno == EINTR)
+			continue;
+#endif
+		if (n <= 0)
+			return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* Receive timeout in ms, 0 for none */
+static void net_timeout(sock_t s, int ms)
+{
+#ifdef _WIN32
+	DWORD t = ms;
+#else
+	struct timeval t;
+	t.tv_sec = ms / 1000;
+	t.tv_usec = ms % 1000 * 1000;
+#endif
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&t, sizeof(t));
+}
+
+/* Send the small requests and responses at once */
+static void net_nodelay(sock_t s)
+{
+	int one = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+}
+
+/**
+ * Addresses of "[host:]port", "[v6-addr]:port" for IPv6.
+ * Returns 0 on success, the list is freed with freeaddrinfo.
+ */
+static int net_addr(const char* spec, int passive, struct addrinfo** res)
+{
+	struct addrinfo hints;
+	char host[256];
+	const char* port = strrchr(spec, ':');
+	int len = port ? (int)(port - spec) : 0, rc;
+
+	if (len >= (int)sizeof(host))
+		return -1;
+	memcpy(host, spec, len);
+	host[len] = 0;
+	if (len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+		memmove(host, host + 1, len - 2);
+		host[len - 2] = 0;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	rc = getaddrinfo(host[0] ? host : 0, port ? port + 1 : spec, &hints, res);
+	if (rc) {
+		log_err("error resolving '%s': %s", spec, gai_strerror(rc));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Authenticate the client of a new connection.
+ * Returns 0 on success.
+ */
+static int net_accept_session(net_session_t* ss)
+{
+	net_hello_t hello;
+	net_auth_t auth;
+	unsigned char mac[NET_MAC];
+
+	hello.magic = htonl(NET_MAGIC);
+	if (net_random(hello.nonce, NET_NONCE) ||
+		net_io(ss->s, &hello, sizeof(hello), 1) ||
+		net_io(ss->s, &auth, sizeof(auth), 0))
+		return -1;
+	net_derive("client", hello.nonce, auth.nonce, mac);
+	if (!net_equal(mac, auth.mac, NET_MAC)) {
+		log_wrn("client %s rejected: wrong key", ss->peer);
+		return -1;
+	}
+	net_derive("server", hello.nonce, auth.nonce, mac);
+	net_derive("session", hello.nonce, auth.nonce, ss->key);
+	ss->seq_in = ss->seq_out = 0;
+	return net_io(ss->s, mac, NET_MAC, 1);
+}
+
+/**
+ * Authenticate the server of a new connection.
+ * Returns 0 on success.
+ */
+static int net_open_session(net_session_t* ss)
+{
+	net_hello_t hello;
+	net_auth_t auth;
+	unsigned char mac[NET_MAC], expected[NET_MAC];
+
+	if (net_io(ss->s, &hello, sizeof(hello), 0))
+		return -1;
+	if (ntohl(hello.magic) != NET_MAGIC) {
+		log_err("'%s' is no signing server", net_server);
+		net_rejected = 1;
+		return -1;
+	}
+	if (net_random(auth.nonce, NET_NONCE))
+		return -1;
+	net_derive("client", hello.nonce, auth.nonce, auth.mac);
+	if (net_io(ss->s, &auth, sizeof(auth), 1) || net_io(ss->s, mac, NET_MAC, 0)) {
+		log_err("signing server '%s' closed the connection, check the key", net_server);
+		net_rejected = 1;
+		return -1;
+	}
+	net_derive("server", hello.nonce, auth.nonce, expected);
+	if (!net_equal(mac, expected, NET_MAC)) {
+		log_err("signing server '%s' not authenticated: wrong key", net_server);
+		net_rejected = 1;
+		return -1;
+	}
+	net_derive("session", hello.nonce, auth.nonce, ss->key);
+	ss->seq_in = ss->seq_out = 0;
+	return 0;
+}
+
+/**
+ * Fail the queued requests of a label whose pool could not be opened
+ */
+static void net_fail_queued(net_label_t* l, int rc)
+{
+	net_call_t* c;
+	for (c = l->head; c; c = c->next) {
+		c->rc = rc;
+		c->done = 1;
+	}
+	l->head = 0;
+	l->tail = &l->head;
+	cond_broadcast(&net_done);
+}
+
+/* Copy the CMS of a batch into the buffer of the request */
+static int net_batch_signed(int index, const unsigned char* pCms, int cms_len, void* user_data)
+{
+	net_call_t* c = ((net_call_t**)user_data)[index];
+	if (cms_len > NET_MAX_CMS) {
+		c->rc = ERR_MEMORY;
+	} else {
+		memcpy(c->cms, pCms, cms_len);
+		c->rc = cms_len;
+	}
+	return 0;
+}
+
+/**
+ * Take the queued requests of a label with a token free, sign them in
+ * a batch and wake their connections
+ */
+static THREAD_FUNC net_sign_batches(void* arg)
+{
+	const unsigned char* hashes[NET_BATCH];
+	net_call_t* calls[NET_BATCH];
+	net_label_t* l;
+	unsigned long long now;
+	int i, n, rc;
+
+	lock_enter(&net_lock);
+	for (;;) {
+		for (l = net_labels; l; l = l->next)
+			if (l->head && (l->state == NET_CLOSED || l->state == NET_OPEN && l->running < sc_pool_size(l->pool)))
+				break;
+		if (!l) {
+			if (net_stopping)
+				break;
+			cond_wait(&net_work, &net_lock);
+			continue;
+		}
+		if (l->state == NET_CLOSED) {
+			l->state = NET_OPENING;
+			lock_leave(&net_lock);
+			rc = sc_pool_open(net_pin, l->label, SC_POOL_LEAST_OUTSTANDING, &l->pool);
+			lock_enter(&net_lock);
+			if (rc < 0) {
+				/* retried with the next request, e.g. once the token is attached */
+				log_err("error opening the tokens for label '%s': %d", l->label, rc);
+				l->state = NET_CLOSED;
+				net_fail_queued(l, rc);
+				continue;
+			}
+			log_inf("signing label '%s' on %d token(s)", l->label, rc);
+			l->state = NET_OPEN;
+			cond_broadcast(&net_work); /* a batch per token */
+		}
+		for (n = 0; n < NET_BATCH && l->head; n++) {
+			calls[n] = l->head;
+			l->head = l->head->next;
+			hashes[n] = calls[n]->hash;
+		}
+		if (!l->head)
+			l->tail = &l->head;
+		l->running++;
+		lock_leave(&net_lock);
+
+		rc = sc_pool_sign_hashes(l->pool, hashes, NET_HASH, n, net_batch_signed, calls);
+		now = metrics_now();
+
+		lock_enter(&net_lock);
+		l->running--;
+		for (i = 0; i < n; i++) {
+			if (calls[i]->rc == 0)
+				calls[i]->rc = rc < 0 ? rc : ERR_CARD;
+			calls[i]->done = 1;
+			metrics_sign(calls[i]->rc, now - calls[i]->start);
+		}
+		cond_broadcast(&net_done);
+	}
+	lock_leave(&net_lock);
+	return 0;
+}
+
+/**
+ * Queue the request for its label and wait until it is signed.
+ * Returns the CMS size or error if <= 0.
+ */
+static int net_sign_queued(const char* label, const unsigned char* hash, unsigned char* cms)
+{
+	net_call_t call;
+	net_label_t* l;
+
+	memset(&call, 0, sizeof(call));
+	call.hash = hash;
+	call.cms = cms;
+	call.start = metrics_now();
+	lock_enter(&net_lock);
+	if (net_stopping) {
+		lock_leave(&net_lock);
+		return ERR_CARD;
+	}
+	for (l = net_labels; l && strcmp(l->label, label); l = l->next)
+		;
+	if (!l) {
+		l = (net_label_t*)calloc(1, sizeof(net_label_t));
+		if (l && (l->label = (char*)malloc(strlen(label) + 1)) != 0)
+			strcpy(l->label, label);
+		if (!l || !l->label) {
+			free(l);
+			lock_leave(&net_lock);
+			return ERR_MEMORY;
+		}
+		l->tail = &l->head;
+		l->next = net_labels;
+		net_labels = l;
+	}
+	*l->tail = &call;
+	l->tail = &call.next;
+	cond_broadcast(&net_work);
+	while (!call.done)
+		cond_wait(&net_done, &net_lock);
+	lock_leave(&net_lock);
+	return call.rc;
+}
+
+/**
+ * Serve the requests of one client
+ */
+static THREAD_FUNC net_client(void* arg)
+{
+	net_session_t* ss = (net_session_t*)arg;
+	net_req_t req;
+	net_rsp_t rsp;
+	char label[NET_MAX_LABEL + 1];
+	unsigned char mac[NET_MAC], expected[NET_MAC];
+	unsigned char* cms = (unsigned char*)malloc(NET_MAX_CMS);
+	int len, rc;
+
+	net_timeout(ss->s, NET_AUTH_MS);
+	if (cms && net_accept_session(ss) == 0) {
+		net_timeout(ss->s, 0);
+		while (net_io(ss->s, &req, sizeof(req), 0) == 0) {
+			len = (int)ntohl(req.label_len);
+			if (len < 0 || len > NET_MAX_LABEL) {
+				log_err("invalid request of client %s", ss->peer);
+				break;
+			}
+			if (net_io(ss->s, label, len, 0) || net_io(ss->s, mac, NET_MAC, 0))
+				break;
+			net_mac(ss, 'C', ss->seq_in++, &req, sizeof(req), label, len, expected);
+			if (!net_equal(mac, expected, NET_MAC)) {
+				log_err("request of client %s with invalid MAC", ss->peer);
+				break;
+			}
+			label[len] = 0;
+			rc = net_sign_queued(label, req.hash, cms);
+			if (rc <= 0 && net_stopping)
+				break; /* the client repeats the request once the server is back */
+			rsp.rc = (int)htonl((unsigned int)rc);
+			net_mac(ss, 'S', ss->seq_out++, &rsp, sizeof(rsp), cms, rc > 0 ? rc : 0, mac);
+			if (net_io(ss->s, &rsp, sizeof(rsp), 1) ||
+				(rc > 0 && net_io(ss->s, cms, rc, 1)) ||
+				net_io(ss->s, mac, NET_MAC, 1))
+				break;
+		}
+	}
+	free(cms);
+	sock_close(ss->s);
+	free(ss);
+	return 0;
+}
+
+/**
+ * Accept the clients until the server stops
+ */
+static THREAD_FUNC net_accept(void* arg)
+{
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		net_session_t* ss;
+		thread_t t;
+		sock_t c;
+
+		c = accept(net_listen, (struct sockaddr*)&addr, &addr_len);
+#ifndef _WIN32
+		if (c < 0 && errno == EINTR)
+			continue;
+#endif
+		if (c == SOCK_NONE || net_stopping) {
+			if (c != SOCK_NONE)
+				sock_close(c);
+			break; /* closed by net_stop */
+		}
+		ss = (net_session_t*)calloc(1, sizeof(net_session_t));
+		if (!ss) {
+			sock_close(c);
+			continue;
+		}
+		ss->s = c;
+		if (getnameinfo((struct sockaddr*)&addr, addr_len, ss->peer, sizeof(ss->peer), 0, 0, NI_NUMERICHOST))
+			strcpy(ss->peer, "?");
+		net_nodelay(c);
+		if (thread_create(&t, net_client, ss)) {
+			log_err("error creating client thread");
+			sock_close(c);
+			free(ss);
+			continue;
+		}
+#ifdef _WIN32
+		CloseHandle(t);
+#else
+		pthread_detach(t);
+#endif
+	}
+	return 0;
+}
+
+/**
+ * Listen on "[addr:]port" and sign for the clients with the tokens of
+ * this instance. Returns 0 on success.
+ */
+static int net_serve(const char* spec, const char* pin)
+{
+	struct addrinfo* res, * ai;
+	thread_t t;
+	int one = 1;
+
+	net_pin = pin;
+	lock_init(&net_lock);
+	cond_init(&net_work);
+	cond_init(&net_done);
+	if (net_addr(spec, 1, &res))
+		return -1;
+	for (ai = res; ai && net_listen == SOCK_NONE; ai = ai->ai_next) {
+		net_listen = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (net_listen == SOCK_NONE)
+			continue;
+		setsockopt(net_listen, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+		if (bind(net_listen, ai->ai_addr, (int)ai->ai_addrlen) || listen(net_listen, 64)) {
+			sock_close(net_listen);
+			net_listen = SOCK_NONE;
+		}
+	}
+	freeaddrinfo(res);
+	if (net_listen == SOCK_NONE) {
+		log_err("error listening on '%s'", spec);
+		return -1;
+	}
+	for (net_workers = 0; net_workers < NET_WORKERS; net_workers++)
+		if (thread_create(&net_worker[net_workers], net_sign_batches, 0))
+			break;
+	if (net_workers == 0 || thread_create(&t, net_accept, 0)) {
+		log_err("error creating server threads");
+		return -1;
+	}
+#ifdef _WIN32
+	CloseHandle(t);
+#else
+	pthread_detach(t);
+#endif
+	log_inf("signing server listening on '%s'", spec);
+	return 0;
+}
+
+/**
+ * Stop accepting clients, sign the queued requests and close the pools
+ */
+static void net_stop(void)
+{
+	net_label_t* l;
+
+	if (net_listen != SOCK_NONE) {
+		lock_enter(&net_lock);
+		net_stopping = 1;
+		cond_broadcast(&net_work);
+		lock_leave(&net_lock);
+#ifndef _WIN32
+		shutdown(net_listen, SHUT_RDWR);
+#endif
+		sock_close(net_listen);
+		net_listen = SOCK_NONE;
+	}
+	while (net_workers > 0)
+		thread_join(net_worker[--net_workers]);
+	/* the connections still open are closed at exit */
+	while ((l = net_labels) != 0) {
+		net_labels = l->next;
+		sc_pool_close(l->pool);
+		free(l->label);
+		free(l);
+	}
+}
+
+/**
+ * Connect to the signing server of option -N.
+ * Returns 0 on success.
+ */
+static int net_connect(void)
+{
+	struct addrinfo* res, * ai;
+	sock_t s = SOCK_NONE;
+
+	if (net_addr(net_server, 0, &res))
+		return -1;
+	for (ai = res; ai && s == SOCK_NONE; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s != SOCK_NONE && connect(s, ai->ai_addr, (int)ai->ai_addrlen)) {
+			sock_close(s);
+			s = SOCK_NONE;
+		}
+	}
+	freeaddrinfo(res);
+	if (s == SOCK_NONE) {
+		log_wrn("error connecting to signing server '%s'", net_server);
+		return -1;
+	}
+	net_nodelay(s);
+	net_timeout(s, NET_AUTH_MS);
+	net_session.s = s;
+	if (net_open_session(&net_session)) {
+		sock_close(s);
+		net_session.s = SOCK_NONE;
+		return -1;
+	}
+	net_timeout(s, 0);
+	log_inf("signing on server '%s'", net_server);
+	return 0;
+}
+
+/**
+ * Sign the hash (like sign_hash) on the signing server of option -N or
+ * else with local_sign_hash. The CMS document is valid until the next call.
+ */
+static int net_sign_hash(const char* pin, const char* label,
+	const unsigned char* hash, int hash_len, const unsigned char** pCms)
+{
+	net_req_t req;
+	net_rsp_t rsp;
+	unsigned char mac[NET_MAC], expected[NET_MAC];
+	int i, rc, len;
+
+	if (!net_server)
+		return local_sign_hash(pin, label, hash, hash_len, pCms);
+	len = (int)strlen(label);
+	if (len > NET_MAX_LABEL || hash_len != NET_HASH)
+		return ERR_INVALID;
+	*pCms = net_cms;
+	for (i = 0; i < NET_RETRIES && !net_rejected; i++) {
+		if (net_session.s == SOCK_NONE && net_connect()) {
+#ifdef _WIN32
+			Sleep(1000);
+#else
+			sleep(1);
+#endif
+			continue;
+		}
+		req.label_len = htonl(len);
+		memcpy(req.hash, hash, NET_HASH);
+		net_mac(&net_session, 'C', net_session.seq_out++, &req, sizeof(req), label, len, mac);
+		if (net_io(net_session.s, &req, sizeof(req), 1) == 0 &&
+			net_io(net_session.s, (void*)label, len, 1) == 0 &&
+			net_io(net_session.s, mac, NET_MAC, 1) == 0 &&
+			net_io(net_session.s, &rsp, sizeof(rsp), 0) == 0) {
+			rc = (int)ntohl((unsigned int)rsp.rc);
+			if (rc <= NET_MAX_CMS &&
+				(rc <= 0 || net_io(net_session.s, net_cms, rc, 0) == 0) &&
+				net_io(net_session.s, mac, NET_MAC, 0) == 0) {
+				net_mac(&net_session, 'S', net_session.seq_in++, &rsp, sizeof(rsp), net_cms, rc > 0 ? rc : 0, expected);
+				if (net_equal(mac, expected, NET_MAC))
+					return rc;
+				log_err("response of signing server '%s' with invalid MAC", net_server);
+			}
+		}
+		log_wrn("lost the connection to signing server '%s'", net_server);
+		sock_close(net_session.s);
+		net_session.s = SOCK_NONE;
+	}
+	return ERR_READER;
+}
+
+/**
+ * Close the connection to the signing server
+ */
+static void net_close(void)
+{
+	if (net_session.s != SOCK_NONE)
+		sock_close(net_session.s);
+	net_session.s = SOCK_NONE;
+}
+
+#endif /* _NET_H_ */
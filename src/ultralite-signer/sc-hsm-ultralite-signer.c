@@ -14,13 +14,16 @@
 
 #ifdef __linux__
 #define _FILE_OFFSET_BITS 64 /* define before <stdio.h> etc. */
+#define _GNU_SOURCE /* O_DIRECT */
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
 #include <ultralite/log.h>
 #include <ultralite/sc-hsm-ultralite.h>
 #include "metadata.h"
@@ -30,6 +33,7 @@
 #include <crtdbg.h>
 #endif
 #include "ext-win/dirent.h"
+#include <io.h> /* _commit */
 typedef __int64 offset_t;
 /* define below after <stdio.h> */
 #define snprintf _snprintf
@@ -40,6 +44,14 @@ typedef __int64 offset_t;
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/sysmacros.h> /* major, minor */
+#define HAVE_INPUT_HINTS /* fadvise, mmap and O_DIRECT input */
+#define HAVE_OPENAT /* fstatat relative to the directory, nanosecond mtime */
 #define MAX_PATH PATH_MAX
 typedef off_t offset_t;
 #if !defined __USE_FILE_OFFSET64
@@ -55,6 +67,199 @@ typedef off_t offset_t;
 #error "Must implement dirent API and define offset_t for your OS."
 #endif
 
+/*
+ * Stat relative to an open directory (dfd; AT_FDCWD for none) where
+ * supported, the full path otherwise. The modification time is in ns
+ * with fstatat, else in seconds.
+ */
+#ifdef HAVE_OPENAT
+#define stat_at(dfd, name, path, st) fstatat(dfd, name, st, 0)
+#define stat_mtime(st) ((long long)(st)->st_mtim.tv_sec * 1000000000 + (st)->st_mtim.tv_nsec)
+#define dir_fd(dir) dirfd(dir)
+#else
+#define AT_FDCWD -1
+#define stat_at(dfd, name, path, st) stat(path, st)
+#define stat_mtime(st) ((long long)(st)->st_mtime)
+#define dir_fd(dir) AT_FDCWD
+#endif
+
+#include "index.h"
+#include "manifest.h"
+#include "verify.h"
+#include "digest.h"
+#include "metrics.h"
+
+/*
+ * Lock, condition variable and thread for the -j mode
+ */
+#ifdef _WIN32
+typedef CRITICAL_SECTION lock_t;
+typedef CONDITION_VARIABLE cond_t;
+typedef HANDLE thread_t;
+#define lock_init(l)      InitializeCriticalSection(l)
+#define lock_destroy(l)   DeleteCriticalSection(l)
+#define lock_enter(l)     EnterCriticalSection(l)
+#define lock_leave(l)     LeaveCriticalSection(l)
+#define cond_init(c)      InitializeConditionVariable(c)
+#define cond_destroy(c)
+#define cond_wait(c, l)   SleepConditionVariableCS(c, l, INFINITE)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#define THREAD_FUNC DWORD WINAPI
+static int thread_create(thread_t* t, LPTHREAD_START_ROUTINE func, void* arg)
+{
+	*t = CreateThread(0, 0, func, arg, 0, 0);
+	return *t ? 0 : -1;
+}
+static void thread_join(thread_t t)
+{
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+#else
+#include <pthread.h>
+typedef pthread_mutex_t lock_t;
+typedef pthread_cond_t cond_t;
+typedef pthread_t thread_t;
+#define lock_init(l)      pthread_mutex_init(l, 0)
+#define lock_destroy(l)   pthread_mutex_destroy(l)
+#define lock_enter(l)     pthread_mutex_lock(l)
+#define lock_leave(l)     pthread_mutex_unlock(l)
+#define cond_init(c)      pthread_cond_init(c, 0)
+#define cond_destroy(c)   pthread_cond_destroy(c)
+#define cond_wait(c, l)   pthread_cond_wait(c, l)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+#define THREAD_FUNC void*
+#define thread_create(t, func, arg) pthread_create(t, 0, func, arg)
+#define thread_join(t) pthread_join(t, 0)
+#endif
+
+#define MAX_THREADS 64
+
+static int use_index;     /* option -x */
+static int recursive;     /* option -r */
+static lock_t index_lock; /* serializes the index of the -j mode */
+static digest_cache_t* digests; /* option -d or -D */
+static lock_t digest_lock;      /* serializes the digest cache */
+
+/*
+ * Label rules of option -f: each line of the rules file holds a path
+ * glob and the label of the key for the matching files, separated by
+ * blanks (e.g. "/data/finance/report-*.pdf finance"). '*' matches
+ * any characters including '/', '?' a single character. The first
+ * matching rule wins, files matching no rule are not signed. Empty
+ * lines and lines starting with '#' are ignored.
+ */
+#define MAX_RULES 64
+
+typedef struct
+{
+	char* glob;
+	char* label;
+} rule_t;
+
+static rule_t rules[MAX_RULES];
+static int rule_count;
+
+#ifdef _WIN32
+#define glob_char(c) ((c) == '\\' ? '/' : tolower((unsigned char)(c)))
+#else
+#define glob_char(c) (c)
+#endif
+
+static int glob_match(const char* glob, const char* path)
+{
+	const char* star = 0, * retry = 0;
+
+	while (*path) {
+		if (*glob == '*') {
+			star = ++glob;
+			retry = path;
+		} else if (*glob && (*glob == '?' || glob_char(*glob) == glob_char(*path))) {
+			glob++;
+			path++;
+		} else if (star) { /* Let the last '*' match one more character */
+			glob = star;
+			path = ++retry;
+		} else {
+			return 0;
+		}
+	}
+	while (*glob == '*')
+		glob++;
+	return *glob == 0;
+}
+
+/**
+ * Read the label rules from the specified file (option -f).
+ * Returns 0 or -1 on error.
+ */
+static int load_rules(const char* file)
+{
+	char line[MAX_PATH + 256];
+	int n = 0;
+	FILE* fp = fopen(file, "r");
+
+	if (!fp) {
+		int e = errno;
+		log_err("error opening rules file '%s': %s", file, strerror(e));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		char* glob = line, * label, * end = line + strlen(line);
+
+		/* Strip the blanks around the line */
+		n++;
+		while (end > line && isspace((unsigned char)end[-1]))
+			*--end = 0;
+		while (isspace((unsigned char)*glob))
+			glob++;
+		if (*glob == 0 || *glob == '#')
+			continue;
+
+		/* Split the glob from the label */
+		label = glob + strcspn(glob, " \t");
+		if (*label)
+			*label++ = 0;
+		while (isspace((unsigned char)*label))
+			label++;
+		if (*label == 0 || rule_count == MAX_RULES) {
+			log_err("error in rules file '%s' line %d", file, n);
+			fclose(fp);
+			return -1;
+		}
+		rules[rule_count].glob = (char*)malloc(end - glob + 1);
+		if (!rules[rule_count].glob) {
+			log_err("error allocating rule for '%s'", glob);
+			fclose(fp);
+			return -1;
+		}
+		memcpy(rules[rule_count].glob, glob, end - glob + 1);
+		rules[rule_count].label = rules[rule_count].glob + (label - glob);
+		rule_count++;
+	}
+	fclose(fp);
+	if (rule_count == 0) {
+		log_err("no rules in rules file '%s'", file);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Label of the key for the file at the specified path: the label of
+ * the first matching rule (option -f), else the specified label.
+ * Returns 0 if the file is not to be signed.
+ */
+static const char* file_label(const char* path, const char* label)
+{
+	int i;
+
+	for (i = 0; i < rule_count; i++)
+		if (glob_match(rules[i].glob, path))
+			return rules[i].label;
+	return rule_count ? 0 : label;
+}
+
 #ifdef CTAPI
 #ifdef _WIN32
 #define MUTEX_KEY "Global\\sc-hsm-ultralite-signer-mutex"
@@ -80,6 +285,7 @@ void release_lock(void* hMutex)
 	CloseHandle((HANDLE)hMutex);
 }
 #elif defined __linux__
+#include <sys/file.h> /* flock */
 #define MUTEX_KEY "/var/lock/sc-hsm-ultralite-signer.lock"
 void* create_lock(const char* key)
 {
@@ -103,11 +309,11 @@ void* create_lock(const char* key)
 		}
 		return (void*)-1;
 	}
-	return (void*)fd;
+	return (void*)(size_t)fd;
 }
 void release_lock(void* _fd)
 {
-	int fd = (int)_fd;
+	int fd = (int)(size_t)_fd;
 	int err = flock(fd, LOCK_UN);
 	if (err) {
 		int e = errno;
@@ -122,105 +328,512 @@ void release_lock(void* _fd)
 #else
 #error "Must implement *_lock funcs for your OS. Dummy implementations OK if non-simultaneous token access guaranteed."
 #endif
+#include "broker.h"
+#define local_sign_hash broker_sign_hash /* signs through the owner of the token */
+#else
+#define local_sign_hash sign_hash
 #endif
+#include "net.h"
+#define token_sign_hash net_sign_hash /* signs on the server of option -N or locally */
+static lock_t token_lock; /* serializes token_sign_hash, e.g. of the devices of the -j mode */
 
 static char* sig_ext; /* either '.p7s' or ':p7s' */
 
+/*
+ * Input of the data files (option -i)
+ */
+#define IO_STDIO   0 /* fread into the caller's buffer (portable) */
+#define IO_FADVISE 1 /* large reads, sequential read-ahead and drop-behind hints */
+#define IO_MMAP    2 /* map windows of the file, the pages are hashed in place */
+#define IO_DIRECT  3 /* O_DIRECT reads bypassing the page cache */
+
+#define IO_BLOCK  0x100000  /* read size of IO_FADVISE and IO_DIRECT */
+#define IO_WINDOW 0x4000000 /* mapped window of IO_MMAP */
+#define IO_QUIET  60        /* seconds without change before IO_MMAP maps a file */
+
+static int io_mode = IO_STDIO;
+
 /**
- * Sign the file at the specified path using the private
- * key with the specified label on a token with the specified pin
- * and optionally with the beginning hash state saved in the
- * specified metadata_t from the previous signing.
+ * Data file being read
  */
-static void sign(const char* path, const char* pin, const char* label,
-	metadata_t* md)
+typedef struct
 {
-	int n, err, sig_size;
-	sha256_context ctx;
-	sha256_context ctx_cpy;
-	const unsigned char *pCms = 0;
-	unsigned char buf[0x10000], hash[32]; /* 32 => 256-bit sha256 */
-	char sig_path[MAX_PATH] = "";
-	FILE * fpi = 0, * fpo = 0;
+	FILE* fp;             /* IO_STDIO */
+	int fd;               /* other modes */
+	int err;              /* read error */
+	offset_t pos;         /* next offset to read */
+	offset_t limit;       /* reads end at this offset, if > pos */
+	offset_t size;        /* file size when opened */
+	unsigned char* buf;   /* aligned buffer of IO_FADVISE, IO_DIRECT and unmapped IO_MMAP */
+	unsigned char* map;   /* mapped window of IO_MMAP */
+	size_t map_len;
+} input_t;
 
-	/* Open the data file for reading */
-	fpi = fopen(path, "rb");
-	if (!fpi) {
+/**
+ * Open the data file at the specified path for reading.
+ * Returns 0 on success.
+ */
+static int input_open(input_t* in, const char* path)
+{
+	memset(in, 0, sizeof(*in));
+	in->fd = -1;
+#ifdef HAVE_INPUT_HINTS
+	if (io_mode != IO_STDIO) {
+		struct stat st;
+		int err = 0;
+		in->fd = open(path, O_RDONLY | (io_mode == IO_DIRECT ? O_DIRECT : 0));
+		if (in->fd < 0 && io_mode == IO_DIRECT && errno == EINVAL) /* e.g. tmpfs */
+			in->fd = open(path, O_RDONLY);
+		if (in->fd < 0) {
+			int e = errno;
+			log_err("error opening file '%s' for reading: %s", path, strerror(e));
+			return -1;
+		}
+		/* A truncated file raises SIGBUS on its mapped pages, so IO_MMAP
+		   reads a recently changed file that may still be written (e.g.
+		   a log rotated by copytruncate) like IO_FADVISE */
+		if (fstat(in->fd, &st))
+			err = errno;
+		else if ((io_mode != IO_MMAP || time(0) - st.st_mtime < IO_QUIET)
+			&& (err = posix_memalign((void**)&in->buf, 4096, IO_BLOCK)) != 0)
+			in->buf = 0;
+		if (err) {
+			log_err("error preparing file '%s' for reading: %s", path, strerror(err));
+			close(in->fd);
+			in->fd = -1;
+			return -1;
+		}
+		in->size = st.st_size;
+		posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		return 0;
+	}
+#endif
+	in->fp = fopen(path, "rb");
+	if (!in->fp) {
 		int e = errno;
 		log_err("error opening file '%s' for reading: %s", path, strerror(e));
-		goto sign_error;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Continue reading at the specified offset, if the file has at least
+ * pos bytes. Returns 0 on success.
+ */
+static int input_seek(input_t* in, offset_t pos)
+{
+	in->pos = pos;
+	if (in->fp && pos <= 0) /* Rewind */
+		return fseeko(in->fp, 0, SEEK_SET) ? -1 : 0;
+	if (in->fp) /* Seek to the position of pos minus one & verify last byte still exists */
+		return fseeko(in->fp, pos - 1, SEEK_SET) == 0 && getc(in->fp) >= 0 ? 0 : -1;
+	return pos <= in->size ? 0 : -1;
+}
+
+/**
+ * Read the next chunk of the file, either into the specified buffer
+ * or into a buffer/mapping of the input. Returns the number of bytes
+ * at *data, 0 at end of file or < 0 on error.
+ */
+static int input_read(input_t* in, unsigned char* buf, int size, unsigned char** data)
+{
+	int n;
+#ifdef HAVE_INPUT_HINTS
+	if (in->fd >= 0) {
+		offset_t beg;
+		/* Drop the pages hashed by the previous read, they are not read again */
+		if (in->map) {
+			munmap(in->map, in->map_len);
+			in->map = 0;
+		}
+		if (in->pos > 0)
+			posix_fadvise(in->fd, 0, in->pos, POSIX_FADV_DONTNEED);
+		if (in->pos >= in->size)
+			return 0;
+		/* Mappings and O_DIRECT reads start at a page boundary */
+		beg = in->pos & ~(offset_t)4095;
+		if (!in->buf) {
+			in->map_len = (size_t)(in->size - beg < IO_WINDOW ? in->size - beg : IO_WINDOW);
+			in->map = (unsigned char*)mmap(0, in->map_len, PROT_READ, MAP_SHARED, in->fd, beg);
+			if (in->map == MAP_FAILED) {
+				in->map = 0;
+				in->err = errno;
+				return -1;
+			}
+			madvise(in->map, in->map_len, MADV_SEQUENTIAL);
+			n = (int)(in->map_len - (in->pos - beg));
+			if (in->limit > in->pos && in->limit - in->pos < n)
+				n = (int)(in->limit - in->pos);
+			*data = in->map + (in->pos - beg);
+		} else {
+			n = (int)pread(in->fd, in->buf, IO_BLOCK, beg);
+			if (n < 0) {
+				in->err = errno;
+				return -1;
+			}
+			n -= (int)(in->pos - beg);
+			if (n <= 0)
+				return 0;
+			if (in->limit > in->pos && in->limit - in->pos < n)
+				n = (int)(in->limit - in->pos);
+			*data = in->buf + (in->pos - beg);
+		}
+		in->pos += n;
+		return n;
+	}
+#endif
+	if (in->limit > in->pos && in->limit - in->pos < size)
+		size = (int)(in->limit - in->pos);
+	n = fread(buf, 1, size, in->fp);
+	if (n <= 0) {
+		in->err = ferror(in->fp);
+		return in->err ? -1 : 0;
+	}
+	*data = buf;
+	in->pos += n;
+	return n;
+}
+
+/**
+ * Close the data file. Returns 0 if all reads and the close succeeded.
+ */
+static int input_close(input_t* in, const char* path)
+{
+	int err, rv = 0;
+	if (in->err) {
+		log_err("error reading file '%s'", path);
+		rv = -1;
+	}
+#ifdef HAVE_INPUT_HINTS
+	if (in->map)
+		munmap(in->map, in->map_len);
+	free(in->buf);
+	if (in->fd >= 0) {
+		err = close(in->fd);
+		in->fd = -1;
+		if (err) {
+			int e = errno;
+			log_err("error closing file '%s': %s", path, strerror(e));
+			rv = -1;
+		}
+	}
+#endif
+	if (in->fp) {
+		err = fclose(in->fp);
+		in->fp = 0;
+		if (err) {
+			int e = errno;
+			log_err("error closing file '%s': %s", path, strerror(e));
+			rv = -1;
+		}
 	}
+	return rv;
+}
+
+/**
+ * State of a file being hashed for signing
+ */
+typedef struct sign_job
+{
+	const char* path;
+	input_t in;
+	sha256_context ctx;
+	sign_index_t* idx;           /* index of the directory or 0 */
+	const char* label;           /* key label of the file */
+	long long mtime;             /* modification time before hashing */
+	file_id_t id;                /* identity for the digest cache */
+	const tree_t* tree;          /* right spine of the tree hash profile or 0 */
+	/* -j mode only */
+	struct sign_job* next;
+	char path_buf[MAX_PATH];
+	sha256_context ctx_cpy;      /* unfinalized hash context */
+	unsigned char hash[32];      /* 32 => 256-bit sha256 */
+	unsigned char* cms;          /* copy of the CMS document */
+	int cms_size;
+} sign_job_t;
+
+/**
+ * Open the data file at the specified path for hashing and
+ * start a new hash context or restore the beginning hash state
+ * saved in the specified metadata_t from the previous signing.
+ * Returns 0 on success.
+ */
+static int sign_begin(sign_job_t* job, const char* path, metadata_t* md)
+{
+	job->path = path;
+	job->tree = 0;
+
+	/* The tree hash profile (see sign_tree) saves no hash state */
+	if (md && md->ver == METADATA_VERSION_TREE)
+		md = 0;
+
+	/* Open the data file for reading */
+	if (input_open(&job->in, path))
+		return -1;
 
 	/* Get the saved hash context or start a new one */
 	if (!md) { /* No metadata */
 		/* Start a new hash context */
-		sha256_starts(&ctx);
+		sha256_starts(&job->ctx);
 	} else { /* Metadata exists */
 		/* Restore the saved hash context */
 		int ok;
 		/* Get the saved hashed content length (hcl) */
 		offset_t hcl = sizeof(hcl) == 4 ? md->cll : (offset_t)md->clh << 32 | md->cll;
 		/* Adjust the hcl back to the last block boundary */
-		hcl = hcl - hcl % sizeof(ctx.buffer);
+		hcl = hcl - hcl % sizeof(job->ctx.buffer);
 		/* Restore the "total" (hcl) field to the hash context */
-		ctx.total[0] = (unsigned int)hcl;
-		ctx.total[1] = (unsigned int)(hcl >> 32);
+		job->ctx.total[0] = (unsigned int)hcl;
+		job->ctx.total[1] = (unsigned int)(hcl >> 32);
 		/* Restore the state field to the hash context */
-		memcpy(&ctx.state, &md->state, sizeof(ctx.state));
-		/* Seek to the position of hcl minus one & verify last byte still exists */
-		ok = hcl <= 0 || fseeko(fpi, hcl - 1, SEEK_SET) == 0 && getc(fpi) >= 0;
+		memcpy(&job->ctx.state, &md->state, sizeof(job->ctx.state));
+		/* Seek to the position of hcl & verify the file still has hcl bytes */
+		ok = input_seek(&job->in, hcl) == 0;
 		if (!ok) {
 			if (sizeof(hcl) == 4) /* 32-bit hcl */
 				log_err("error seeking in '%s' to pos %d", path, (int)hcl);
 			else /* 64-bit hcl */
 				log_err("error seeking in '%s' to pos %lld", path, hcl);
-			goto sign_error;
+			input_close(&job->in, path);
+			return -1;
 		}
 	}
+	return 0;
+}
 
-	/* Create/Continue a SHA-256 hash of the file */
-	for (;;) {
-		int n = fread(buf, 1, sizeof(buf), fpi);
-		if (n <= 0)
-			break;
-		sha256_update(&ctx, buf, n);
-	}
+/**
+ * Read the next chunk of the file being hashed.
+ * Returns the size of the chunk at *data, 0 at the end or -1 on error.
+ */
+static int sign_read(sign_job_t* job, unsigned char* buf, int size, unsigned char** data)
+{
+	size = input_read(&job->in, buf, size, data);
+	if (size > 0)
+		metric_add(bytes_hashed, size);
+	return size;
+}
 
-	/* Check for error during read */
-	if (ferror(fpi)) {
-		log_err("error reading file '%s'", path);
-		goto sign_error;
-	}
+/**
+ * Finish the hash of a file after all its content was hashed.
+ * The unfinalized hash context is saved in ctx_cpy for the metadata.
+ * Closes the data file. Returns 0 on success.
+ */
+static int sign_hashed(sign_job_t* job)
+{
+	/* Check for error during read & close the data file */
+	if (input_close(&job->in, job->path))
+		return -1;
 
-	/* Close the data file */
-	err = fclose(fpi);
-	if (err) {
+	/* Clone the unfinalized hash context to save in the metadata */
+	memcpy(&job->ctx_cpy, &job->ctx, sizeof(job->ctx));
+	metric_add(bytes_total, (offset_t)job->ctx.total[1] << 32 | job->ctx.total[0]);
+
+	/* Finalize the hash for the current sig */
+	sha256_finish(&job->ctx, job->hash);
+	return 0;
+}
+
+/**
+ * Monotonic clock in ms
+ */
+static unsigned long long clock_ms(void)
+{
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/*
+ * Group commit of the sig files: a sig file is written to a hidden
+ * temporary file next to it (".<name>.p7s.tmp"), so a crash never
+ * leaves a truncated sig file which would force hashing the whole
+ * file again. The temporary files are synced and renamed into place
+ * in batches: after COMMIT_FILES files, with the first file queued
+ * COMMIT_MS after the batch began and at the end of each directory,
+ * followed by one sync of each directory. Until then the previous
+ * sig file stays valid. The index is updated after the rename.
+ */
+#define COMMIT_FILES 64
+#define COMMIT_MS    1000
+
+#ifdef _WIN32
+#define file_sync(fp) _commit(_fileno(fp))
+#else
+#define file_sync(fp) fsync(fileno(fp))
+#endif
+
+typedef struct
+{
+	FILE* fp;                /* temporary (or sig) file, synced at commit */
+	char tmp_path[MAX_PATH]; /* "" if written in place */
+	char sig_path[MAX_PATH];
+	sign_index_t* idx;       /* index of the directory or 0 */
+	sha256_context ctx;      /* unfinalized hash context */
+	long long mtime;
+	file_id_t id;            /* recorded in the digest cache */
+	unsigned char hash[32];
+	const char* label;
+} commit_t;
+
+static commit_t commit_file[COMMIT_FILES];
+static int commit_count;
+static unsigned long long commit_first; /* clock_ms of the first file */
+static lock_t commit_lock;              /* serializes the -j workers */
+
+/**
+ * Sync the directory of the specified path, so a rename persists
+ */
+static void commit_dir(const char* path)
+{
+#ifndef _WIN32
+	char dir[MAX_PATH];
+	const char* sep = strrchr(path, '/');
+	int fd;
+
+	if (!sep)
+		strcpy(dir, ".");
+	else if (sep == path)
+		strcpy(dir, "/");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int)(sep - path), path);
+	fd = open(dir, O_RDONLY);
+	if (fd < 0 || fsync(fd)) {
 		int e = errno;
-		log_err("error closing file '%s': %s", path, strerror(e));
-		goto sign_error;
+		log_wrn("error syncing directory '%s': %s", dir, strerror(e));
 	}
-	fpi = 0;
+	if (fd >= 0)
+		close(fd);
+#endif
+}
 
-	/* Clone the unfinalized hash context to save in the metadata */
-	memcpy(&ctx_cpy, &ctx, sizeof(ctx));
+/**
+ * Record a sig file in the digest cache (options -d and -D), see digest_put
+ */
+static void digest_record(const file_id_t* id, const unsigned char* hash, const char* label, const char* sig_path)
+{
+	if (!digests)
+		return;
+	lock_enter(&digest_lock);
+	digest_put(digests, id, hash, label, sig_path);
+	lock_leave(&digest_lock);
+}
 
-	/* Finalize the hash for the current sig */
-	sha256_finish(&ctx, hash);
+/**
+ * Sync the pending sig files, rename them into place, sync their
+ * directories and record them in the index. Requires commit_lock.
+ */
+static void commit_batch(void)
+{
+	int i, j, n = 0;
 
-	/* Sign the hash with the token; creates CMS document & puts ptr in pCMS
-	   WARNING: sign_hash is not re-entrant (see sc-hsm-ultralite.c) */
-	sig_size = sign_hash(pin, label, hash, sizeof(hash), &pCms);
-	if (sig_size <= 0) {
-		goto sign_error;
+	for (i = 0; i < commit_count; i++) {
+		commit_t* c = &commit_file[i];
+		int err = file_sync(c->fp);
+		if (err) {
+			int e = errno;
+			log_err("error syncing sig file '%s': %s", c->sig_path, strerror(e));
+		}
+		if (fclose(c->fp))
+			err = -1;
+		if (!err && c->tmp_path[0]) {
+#ifdef _WIN32
+			err = !MoveFileEx(c->tmp_path, c->sig_path, MOVEFILE_REPLACE_EXISTING);
+#else
+			err = rename(c->tmp_path, c->sig_path);
+#endif
+		}
+		if (err) {
+			log_err("error committing sig file '%s'", c->sig_path);
+			if (c->tmp_path[0])
+				remove(c->tmp_path);
+			continue;
+		}
+		/* Keep the committed files at the beginning */
+		if (n != i)
+			commit_file[n] = *c;
+		n++;
+	}
+
+	/* Sync each directory once */
+	for (i = 0; i < n; i++) {
+		const char* sep = strrchr(commit_file[i].sig_path, '/');
+		int len = sep ? (int)(sep - commit_file[i].sig_path) : 0;
+		for (j = 0; j < i; j++) {
+			sep = strrchr(commit_file[j].sig_path, '/');
+			if ((sep ? (int)(sep - commit_file[j].sig_path) : 0) == len
+				&& strncmp(commit_file[j].sig_path, commit_file[i].sig_path, len) == 0)
+				break;
+		}
+		if (j == i)
+			commit_dir(commit_file[i].sig_path);
+	}
+
+	for (i = 0; i < n; i++) {
+		commit_t* c = &commit_file[i];
+		/* Record the new hash state in the index */
+		if (c->idx) {
+			char name[MAX_PATH];
+			const char* base = strrchr(c->sig_path, '/') + 1;
+			snprintf(name, sizeof(name), "%.*s", (int)(strlen(base) - strlen(sig_ext)), base);
+			lock_enter(&index_lock);
+			sign_index_put(c->idx, name, &c->ctx, c->mtime);
+			lock_leave(&index_lock);
+		}
+		digest_record(&c->id, c->hash, c->label, c->sig_path);
+		log_inf("'%s' created", c->sig_path);
+		metric_inc(signed_files);
 	}
+	commit_count = 0;
+}
+
+/**
+ * Commit the pending sig files, e.g. before their index is closed
+ */
+static void commit_flush(void)
+{
+	lock_enter(&commit_lock);
+	commit_batch();
+	lock_leave(&commit_lock);
+}
+
+/**
+ * Write the CMS document and the metadata_t with the unfinalized
+ * hash state to the sig file associated with the hashed file.
+ * The sig file is committed with the next batch (see commit_batch).
+ */
+static void sign_write(sign_job_t* job, const unsigned char* pCms, int sig_size)
+{
+	int n, err;
+	char sig_path[MAX_PATH] = "";
+	char tmp_path[MAX_PATH] = "";
+	const char* name;
+	FILE * fpo = 0;
 
 	/* Open the new sig file for writing */
-	n = snprintf(sig_path, sizeof(sig_path), "%s%s", path, sig_ext);
+	n = snprintf(sig_path, sizeof(sig_path), "%s%s", job->path, sig_ext);
 	if (n < 0 || n >= sizeof(sig_path)) {
-		log_err("error building sig file path '%s%s'", path, sig_ext);
+		log_err("error building sig file path '%s%s'", job->path, sig_ext);
 		goto sign_error;
 	}
-	fpo = fopen(sig_path, "wb");
+	name = strrchr(job->path, '/') ? strrchr(job->path, '/') + 1 : job->path;
+#ifdef _WIN32
+	/* An alternate data stream cannot be renamed, write it in place */
+	if (sig_ext[0] != ':')
+#endif
+	{
+		n = snprintf(tmp_path, sizeof(tmp_path), "%.*s.%s%s.tmp",
+			(int)(name - job->path), job->path, name, sig_ext);
+		if (n < 0 || n >= sizeof(tmp_path)) {
+			log_err("error building sig file path '%s%s'", job->path, sig_ext);
+			goto sign_error;
+		}
+	}
+	fpo = fopen(tmp_path[0] ? tmp_path : sig_path, "wb");
 	if (!fpo) {
 		int e = errno;
 		log_err("error opening sig file '%s' for writing: %s",
@@ -235,230 +848,2894 @@ static void sign(const char* path, const char* pin, const char* label,
 		goto sign_error;
 	}
 
-	/* Save "total" (hcl) & unfinalized hash state at end of sig file */
-	err = write_metadata(fpo, &ctx_cpy);
+	/* Save "total" (hcl) & unfinalized hash state (or right spine) at end of sig file */
+	err = job->tree ? write_metadata_tree(fpo, &job->ctx_cpy, job->tree) : write_metadata(fpo, &job->ctx_cpy, 0);
 	if (err) {
 		log_err("error writing metadata to sig file '%s'", sig_path);
 		goto sign_error;
 	}
 
-	/* Close the sig file */
-	err = fclose(fpo);
-	if (err) {
-		log_err("error closing sig file '%s'", sig_path);
+	/* Write the buffered data, the file is closed at commit */
+	if (fflush(fpo)) {
+		log_err("error writing to sig file '%s'", sig_path);
 		goto sign_error;
 	}
-	fpo = 0;
-
-	/* Success */
-	log_inf("'%s' created", sig_path);
-	return;
 
-sign_error:
-	/* Close input file stream, if open */
-	if (fpi) {
-		err = fclose(fpi);
-		if (err) {
+#ifdef HAVE_OPENAT
+	/* Give the sig file the modification time of the signed content,
+	   so the next scan detects an unchanged file without reading the
+	   metadata (see check_file) */
+	if (job->mtime) {
+		struct timespec ts[2];
+		ts[0].tv_sec = 0;
+		ts[0].tv_nsec = UTIME_NOW;
+		ts[1].tv_sec = (time_t)(job->mtime / 1000000000);
+		ts[1].tv_nsec = (long)(job->mtime % 1000000000);
+		if (futimens(fileno(fpo), ts)) {
 			int e = errno;
-			log_err("error closing file '%s': %s",
-				path, strerror(e));
+			log_wrn("error setting time of sig file '%s': %s", sig_path, strerror(e));
 		}
 	}
+#endif
+
+	/* Queue the sig file for the next commit */
+	lock_enter(&commit_lock);
+	if (commit_count == 0)
+		commit_first = clock_ms();
+	commit_file[commit_count].fp = fpo;
+	strcpy(commit_file[commit_count].tmp_path, tmp_path);
+	strcpy(commit_file[commit_count].sig_path, sig_path);
+	commit_file[commit_count].idx = job->idx;
+	commit_file[commit_count].ctx = job->ctx_cpy;
+	commit_file[commit_count].id = job->id;
+	memcpy(commit_file[commit_count].hash, job->hash, sizeof(job->hash));
+	commit_file[commit_count].label = job->label;
+	commit_file[commit_count++].mtime = job->mtime;
+	if (commit_count == COMMIT_FILES || clock_ms() - commit_first >= COMMIT_MS)
+		commit_batch();
+	lock_leave(&commit_lock);
+	return;
+
+sign_error:
 	/* Close output file stream, if open */
 	if (fpo) {
 		err = fclose(fpo);
 		if (err) {
 			int e = errno;
 			log_err("error closing sig file '%s': %s",
-				sig_path, strerror(e));
+				tmp_path[0] ? tmp_path : sig_path, strerror(e));
 		}
 	}
+	/* Keep the previous sig file */
+	if (tmp_path[0])
+		remove(tmp_path);
 	return;
 }
 
 /**
- * Determine if the file at the specified path needs to be signed.
- * Signing only occurs if the file is new (i.e. not yet signed),
- * OR if the file has been appended since the last signing as
- * determined by reading the hcl ("total") from the metadata stored
- * at the end of the associated signature file and comparing with the
- * current size of the specified file.
- * If a new signature is necessary, the sign function above will be
- * called with the specified pin and label.
+ * Errors of sign_hash which may disappear once the token is back
+ * (the library reconnects by itself). A wrong pin is never retried.
  */
-void sign_file(const char* path, const char* pin, const char* label)
+static int token_retry(int rc)
 {
-	int n, err;
-	struct stat entry_info;
-	char sig_path[PATH_MAX] = "";
+	return rc != ERR_PIN && rc != ERR_INVALID && rc != ERR_MEMORY && rc != ERR_HASH && rc != ERR_TIME;
+}
+
+/**
+ * Get the CMS document of a sig file with the same content and key
+ * label as the hashed file from the digest cache (options -d and -D),
+ * so the token need not sign it again. The metadata of that sig file
+ * must hold the same content length and hash state.
+ * Returns the allocated document or 0.
+ */
+static unsigned char* digest_reuse(sign_job_t* job, int* cms_size)
+{
+	char sig_path[MAX_PATH];
+	const digest_entry_t* e;
+	unsigned char* cms = 0;
+	metadata_t md;
+	struct stat info;
+	offset_t size;
 	FILE* fp;
 
-	/* Stat the entry */
-	err = stat(path, &entry_info);
+	if (!digests)
+		return 0;
+	lock_enter(&digest_lock);
+	e = digest_get_hash(digests, job->hash, job->label);
+	if (e)
+		strcpy(sig_path, e->sig_path);
+	lock_leave(&digest_lock);
+	if (!e || stat(sig_path, &info) || read_metadata(sig_path, &md, 0)
+		|| md.clh != job->ctx_cpy.total[1] || md.cll != job->ctx_cpy.total[0]
+		|| memcmp(md.state, job->ctx_cpy.state, sizeof(md.state)))
+		return 0;
+
+	/* The CMS document is in front of the metadata */
+	size = (offset_t)info.st_size - md.len;
+	fp = fopen(sig_path, "rb");
+	if (fp && size > 0 && size < 0x100000) {
+		cms = (unsigned char*)malloc((size_t)size);
+		if (cms && fread(cms, (size_t)size, 1, fp) != 1) {
+			free(cms);
+			cms = 0;
+		}
+	}
+	if (fp)
+		fclose(fp);
+	if (!cms)
+		return 0;
+	log_inf("'%s' same content as '%s'", job->path, sig_path);
+	metric_inc(reused);
+	*cms_size = (int)size;
+	return cms;
+}
+
+/**
+ * Sign the finished hash of a file using the private key with the
+ * specified label on a token with the specified pin. The signature is
+ * written with the unfinalized hash state as metadata_t to the
+ * associated sig file.
+ * Returns 1 if signing failed and may succeed later (see token_retry).
+ */
+static int sign_digest(sign_job_t* job, const char* pin, const char* label)
+{
+	int sig_size;
+	const unsigned char *pCms = 0;
+	unsigned char* reused;
+	unsigned char* cms = 0;
+	unsigned long long start;
+
+	/* A copy of a signed file has the same signature */
+	reused = digest_reuse(job, &sig_size);
+	if (reused) {
+		sign_write(job, reused, sig_size);
+		free(reused);
+		return 0;
+	}
+
+	/* Sign the hash with the token; creates CMS document & puts ptr in pCMS
+	   WARNING: sign_hash is not re-entrant (see sc-hsm-ultralite.c), the
+	   CMS document is copied because the next sign_hash overwrites it */
+	lock_enter(&token_lock);
+	start = metrics_now();
+	sig_size = token_sign_hash(pin, label, job->hash, sizeof(job->hash), &pCms);
+	metrics_sign(sig_size, metrics_now() - start);
+	if (sig_size > 0) {
+		cms = (unsigned char*)malloc(sig_size);
+		if (cms)
+			memcpy(cms, pCms, sig_size);
+		else
+			log_err("error allocating CMS document for '%s'", job->path);
+	}
+	lock_leave(&token_lock);
+
+	/* Write outside the lock, a batch commit may sync many files */
+	if (cms) {
+		sign_write(job, cms, sig_size);
+		free(cms);
+	}
+
+	return sig_size <= 0 ? token_retry(sig_size) : 0;
+}
+
+/**
+ * Finish the hash of a file after all its content was hashed and
+ * sign it (see sign_digest).
+ * Returns 1 if signing failed and may succeed later (see token_retry).
+ */
+static int sign_end(sign_job_t* job, const char* pin, const char* label)
+{
+	if (sign_hashed(job))
+		return 0;
+	return sign_digest(job, pin, label);
+}
+
+/**
+ * Sign the file at the specified path using the private
+ * key with the specified label on a token with the specified pin
+ * and optionally with the beginning hash state saved in the
+ * specified metadata_t from the previous signing.
+ * The specified modification time and identity were taken before
+ * hashing (see check_file). Returns 1 if signing failed and may
+ * succeed later.
+ */
+static int sign(const char* path, const char* pin, const char* label,
+	metadata_t* md, long long mtime, const file_id_t* id)
+{
+	sign_job_t job;
+	unsigned char buf[0x10000];
+	unsigned long long start;
+
+	if (sign_begin(&job, path, md))
+		return 0;
+	job.idx = 0;
+	job.label = label;
+	job.mtime = mtime;
+	job.id = *id;
+
+	/* Create/Continue a SHA-256 hash of the file */
+	start = metrics_now();
+	for (;;) {
+		unsigned char* data;
+		int n = sign_read(&job, buf, sizeof(buf), &data);
+		if (n <= 0)
+			break;
+		sha256_update(&job.ctx, data, n);
+	}
+	metric_add(hash_us, metrics_now() - start);
+
+	return sign_end(&job, pin, label);
+}
+
+/*
+ * Tree hash profile (option -T, see tree_t): the leaves of a file of at
+ * least tree_min bytes are hashed by tree_threads threads, each reading
+ * the leaves it takes with its own input, then the right spine is
+ * extended in leaf order and the tree hash is signed. A file signed
+ * with the profile keeps it, an append continues from the saved spine.
+ */
+static offset_t tree_min;    /* option -T, 0 if off */
+static int tree_threads = 1;
+
+/* SHA-256(0x01 || left || right) into node, which may be right */
+static void tree_node(const unsigned char left[32], const unsigned char right[32], unsigned char node[32])
+{
+	sha256_context ctx;
+	unsigned char prefix = 0x01;
+	sha256_starts(&ctx);
+	sha256_update(&ctx, &prefix, 1);
+	sha256_update(&ctx, (unsigned char*)left, 32);
+	sha256_update(&ctx, (unsigned char*)right, 32);
+	sha256_finish(&ctx, node);
+}
+
+/**
+ * Add the hash of the complete leaf following the specified number of
+ * leaves to the right spine
+ */
+static void tree_push(tree_t* tree, unsigned long long leaves, const unsigned char leaf[32])
+{
+	unsigned char node[32];
+	memcpy(node, leaf, sizeof(node));
+	for (; leaves & 1; leaves >>= 1)
+		tree_node(tree->peak[--tree->count], node, node);
+	memcpy(tree->peak[tree->count++], node, sizeof(node));
+}
+
+/**
+ * Compute the tree hash from the right spine and the hash of the last,
+ * incomplete leaf (or 0)
+ */
+static void tree_root(const tree_t* tree, const unsigned char* last, unsigned char digest[32])
+{
+	int i = (int)tree->count;
+	if (last)
+		memcpy(digest, last, 32);
+	else if (i > 0)
+		memcpy(digest, tree->peak[--i], 32);
+	else { /* empty content */
+		sha256_context ctx;
+		sha256_starts(&ctx);
+		sha256_finish(&ctx, digest);
+	}
+	while (i > 0)
+		tree_node(tree->peak[--i], digest, digest);
+}
+
+/* The right spine is the one of the specified number of complete leaves */
+static int tree_valid(const tree_t* tree, unsigned long long leaves)
+{
+	unsigned int count = 0;
+	for (; leaves; leaves >>= 1)
+		count += (unsigned int)(leaves & 1);
+	return tree->shift == TREE_SHIFT && tree->count == count;
+}
+
+/* Number of online processors, at most MAX_THREADS */
+static int cpu_count(void)
+{
+	int n;
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	n = (int)si.dwNumberOfProcessors;
+#else
+	n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : n;
+}
+
+typedef struct
+{
+	lock_t lock;
+	const char* path;
+	offset_t size;             /* content length */
+	unsigned long long first;  /* first leaf to hash */
+	unsigned long long next;   /* next leaf to hash */
+	unsigned long long end;    /* leaves, the last may be incomplete */
+	unsigned char (*leaf)[32]; /* hashes of the leaves from first */
+	int err;
+} tree_work_t;
+
+/**
+ * Hash the leaf from pos to end of the input.
+ * Returns 0 on success, -1 if the file could not be read or is shorter.
+ */
+static int tree_leaf(input_t* in, offset_t pos, offset_t end, unsigned char* buf, unsigned char digest[32])
+{
+	sha256_context ctx;
+	unsigned char prefix = 0x00;
+
+	if (input_seek(in, pos))
+		return -1;
+	in->limit = end;
+	sha256_starts(&ctx);
+	sha256_update(&ctx, &prefix, 1);
+	while (in->pos < end) {
+		unsigned char* data;
+		int n = input_read(in, buf, 0x10000, &data);
+		if (n <= 0)
+			break;
+		sha256_update(&ctx, data, n);
+		metric_add(bytes_hashed, n);
+	}
+	sha256_finish(&ctx, digest);
+	return in->pos == end ? 0 : -1;
+}
+
+/**
+ * Thread of sign_tree hashing the next leaf until all are taken
+ */
+static THREAD_FUNC tree_worker(void* arg)
+{
+	tree_work_t* w = (tree_work_t*)arg;
+	unsigned char* buf = (unsigned char*)malloc(0x10000);
+	input_t in;
+	int opened = buf && input_open(&in, w->path) == 0, err = !opened;
+
+	while (!err) {
+		unsigned long long i;
+		offset_t pos, end;
+		lock_enter(&w->lock);
+		i = w->next++;
+		err = w->err;
+		lock_leave(&w->lock);
+		if (err || i >= w->end)
+			break;
+		pos = (offset_t)i << TREE_SHIFT;
+		end = pos + ((offset_t)1 << TREE_SHIFT) < w->size ? pos + ((offset_t)1 << TREE_SHIFT) : w->size;
+		err = tree_leaf(&in, pos, end, buf, w->leaf[i - w->first]);
+	}
+	if (opened && input_close(&in, w->path))
+		err = 1;
+	free(buf);
 	if (err) {
+		lock_enter(&w->lock);
+		w->err = 1;
+		lock_leave(&w->lock);
+	}
+	return 0;
+}
+
+/**
+ * Whether the file at the specified path is signed with the tree hash
+ * profile: it has at least tree_min bytes or was signed with it (md)
+ */
+static int tree_profile(const char* path, const metadata_t* md)
+{
+	struct stat info;
+
+	if (!tree_min)
+		return 0;
+	if (md && md->ver == METADATA_VERSION_TREE)
+		return 1;
+	return stat(path, &info) == 0 && (offset_t)info.st_size >= tree_min;
+}
+
+/**
+ * Sign the file at the specified path with the tree hash profile like
+ * sign, continuing from the right spine in its sig file if md is its
+ * metadata of the profile. The sig file is recorded in idx (or 0).
+ * Returns 1 if signing failed and may succeed later.
+ */
+static int sign_tree(const char* path, const char* pin, const char* label,
+	metadata_t* md, sign_index_t* idx, long long mtime, const file_id_t* id)
+{
+	char sig_path[MAX_PATH];
+	thread_t thread[MAX_THREADS];
+	unsigned char last[32];
+	unsigned long long i, start;
+	struct stat info;
+	tree_work_t w;
+	sign_job_t job;
+	metadata_t old;
+	tree_t tree;
+	int n, started = 0;
+
+	if (stat(path, &info)) {
 		int e = errno;
 		log_err("error accessing file '%s': %s", path, strerror(e));
-		return;
+		return 0;
+	}
+	memset(&w, 0, sizeof(w));
+	w.path = path;
+	w.size = info.st_size;
+	w.end = (unsigned long long)((w.size + ((offset_t)1 << TREE_SHIFT) - 1) >> TREE_SHIFT);
+	memset(&tree, 0, sizeof(tree));
+	tree.shift = TREE_SHIFT;
+
+	/* Continue after the complete leaves of the previous signature */
+	n = snprintf(sig_path, sizeof(sig_path), "%s%s", path, sig_ext);
+	if (md && md->ver == METADATA_VERSION_TREE && n > 0 && n < sizeof(sig_path)
+		&& read_metadata_tree(sig_path, &old, 0, &tree) == 0 && old.clh == md->clh && old.cll == md->cll) {
+		offset_t hcl = sizeof(hcl) == 4 ? old.cll : (offset_t)old.clh << 32 | old.cll;
+		w.first = (unsigned long long)(hcl >> TREE_SHIFT);
+		if (!tree_valid(&tree, w.first) || ((offset_t)w.first << TREE_SHIFT) > w.size) {
+			log_wrn("'%s' tree of sig file not usable; hashing from the beginning", path);
+			w.first = 0;
+		}
+	}
+	if (w.first == 0) {
+		memset(&tree, 0, sizeof(tree));
+		tree.shift = TREE_SHIFT;
+	}
+	w.next = w.first;
+	w.leaf = (unsigned char(*)[32])malloc((size_t)(w.end - w.first + 1) * 32);
+	if (!w.leaf) {
+		log_err("error allocating leaves of '%s'", path);
+		return 0;
+	}
+
+	/* Hash the new leaves, the last one again if it was incomplete */
+	start = metrics_now();
+	lock_init(&w.lock);
+	for (; started < tree_threads && (unsigned long long)started < w.end - w.first; started++)
+		if (thread_create(&thread[started], tree_worker, &w))
+			break;
+	if (!started)
+		tree_worker(&w);
+	while (started > 0)
+		thread_join(thread[--started]);
+	lock_destroy(&w.lock);
+	metric_add(hash_us, metrics_now() - start);
+	if (w.err) {
+		log_err("error hashing file '%s'", path);
+		free(w.leaf);
+		return 0;
+	}
+	for (i = w.first; i < w.end; i++)
+		if (((offset_t)(i + 1) << TREE_SHIFT) <= w.size)
+			tree_push(&tree, i, w.leaf[i - w.first]);
+		else
+			memcpy(last, w.leaf[i - w.first], sizeof(last));
+	if (w.first)
+		log_inf("'%s' resuming tree at leaf %llu of %llu", path, w.first, w.end);
+
+	memset(&job, 0, sizeof(job));
+	job.path = path;
+	job.idx = idx;
+	job.label = label;
+	job.mtime = mtime;
+	job.id = *id;
+	job.tree = &tree;
+	job.ctx_cpy.total[0] = (unsigned int)w.size;
+	job.ctx_cpy.total[1] = (unsigned int)((unsigned long long)w.size >> 32);
+	tree_root(&tree, (w.size & (((offset_t)1 << TREE_SHIFT) - 1)) ? last : 0, job.hash);
+	metric_add(bytes_total, w.size);
+	free(w.leaf);
+	return sign_digest(&job, pin, label);
+}
+
+/**
+ * Look up the sig file of another name of the file with the specified
+ * identity in the digest cache and read its metadata into md,
+ * so the hash continues from its state (i.e. only the last block).
+ * Returns 1 if the metadata covers the whole file, 0 otherwise.
+ */
+static int digest_resume(const file_id_t* id, const char* path, metadata_t* md)
+{
+	char sig_path[MAX_PATH];
+	const digest_entry_t* e;
+	struct stat info;
+
+	if (!digests || !id->size)
+		return 0;
+	lock_enter(&digest_lock);
+	e = digest_get_id(digests, id);
+	if (e)
+		strcpy(sig_path, e->sig_path);
+	lock_leave(&digest_lock);
+	if (!e || stat(sig_path, &info) || read_metadata(sig_path, md, 0)
+		|| ((unsigned long long)md->clh << 32 | md->cll) != id->size)
+		return 0;
+	log_inf("'%s' same file as '%s'", path, sig_path);
+	metric_inc(linked);
+	return 1;
+}
+
+/**
+ * Determine if the file at the specified path needs to be signed.
+ * Signing only occurs if the file is new (i.e. not yet signed),
+ * OR if the file has been appended since the last signing as
+ * determined by reading the hcl ("total") from the metadata stored
+ * at the end of the associated signature file and comparing with the
+ * current size of the specified file.
+ * With an index of the directory, an unchanged file is detected
+ * by its size and modification time without opening the sig file.
+ * Without, a sig file with the modification time of the file (set
+ * by sign_write) marks the file as unchanged before the metadata
+ * is read. The file and its sig file are stat'ed by name relative
+ * to the directory dfd (AT_FDCWD for the path), so an unchanged
+ * file costs two fstatat calls.
+ * A shrunk file is re-hashed from the beginning, a change before
+ * its new end cannot be ruled out without reading it.
+ * With the digest cache, a new file continues the hash from the sig
+ * file of a hard link with the same identity (see digest.h).
+ * Returns -1 if no new signature is necessary, 1 if the metadata
+ * read into md can be used to continue the hash, 0 otherwise.
+ * The modification time is returned in mtime, the identity in id.
+ */
+static int check_file(int dfd, const char* name, const char* path, metadata_t* md, sign_index_t* idx, long long* mtime, file_id_t* id)
+{
+	int n, err;
+	struct stat entry_info, sig_info;
+	char sig_path[MAX_PATH] = "";
+	char sig_name[MAX_PATH] = "";
+	long long file_mtime;
+
+	/* Stat the entry */
+	err = stat_at(dfd, name, path, &entry_info);
+	if (err) {
+		int e = errno;
+		log_err("error accessing file '%s': %s", path, strerror(e));
+		return -1;
 	}
 
 	/* Only sign files */
 	if (S_ISDIR(entry_info.st_mode))
-		return;
+		return -1;
+	metric_inc(scanned);
 
 	/* Skip empty files */
 	if (entry_info.st_size <= 0) {
 		log_inf("'%s' empty", path);
-		return;
+		return -1;
+	}
+
+	/* Build associated sig file path (i.e. <path>/<filename><sig_ext>) */
+	n = snprintf(sig_path, sizeof(sig_path), "%s%s", path, sig_ext);
+	if (n < 0 || n >= sizeof(sig_path)) {
+		log_err("error building sig file path '%s%s'", path, sig_ext);
+		return -1;
+	}
+	snprintf(sig_name, sizeof(sig_name), "%s%s", name, sig_ext);
+	file_mtime = stat_mtime(&entry_info);
+	*mtime = file_mtime;
+	id->dev = (unsigned long long)entry_info.st_dev;
+	id->ino = (unsigned long long)entry_info.st_ino;
+	id->size = entry_info.st_ino ? (unsigned long long)entry_info.st_size : 0;
+	id->mtime = file_mtime;
+#ifdef HAVE_OPENAT
+	{
+		/* A change within the timestamp granularity (coarse clock, 2 s
+		   on FAT) after the stat keeps the mtime; a recent mtime is thus
+		   recorded 1 ns off, so the next scan checks the metadata, and
+		   the identity is not recorded */
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if ((long long)now.tv_sec * 1000000000 + now.tv_nsec - file_mtime <= 2000000000LL) {
+			*mtime = file_mtime - 1;
+			id->size = 0;
+		}
+	}
+#endif
+
+	/* Stat the sig file to see if one exists yet */
+	errno = 0;
+	err = stat_at(dfd, sig_name, sig_path, &sig_info) ? errno : 0;
+
+	/* Look the file up in the index, the sig file must still exist */
+	if (idx && !err) {
+		index_rec_t rec;
+		const index_rec_t* found;
+		lock_enter(&index_lock);
+		found = sign_index_get(idx, name);
+		if (found)
+			rec = *found;
+		lock_leave(&index_lock);
+		if (found) {
+			offset_t hcl = sizeof(hcl) == 4 ? rec.cll : (offset_t)rec.clh << 32 | rec.cll;
+			long long rec_mtime = (long long)((unsigned long long)rec.mtime_hi << 32 | rec.mtime_lo);
+			if (entry_info.st_size == hcl && file_mtime == rec_mtime) {
+				/* Unmodified so skip */
+				digest_record(id, 0, 0, sig_path);
+				log_inf("'%s' unmodified", path);
+				metric_inc(unchanged);
+				return -1;
+			}
+			/* Appended, shrunk or rewritten in place, the sig file decides */
+		}
+	}
+
+	if (!err) { /* Sig file found => figure out if we need to re-create it */
+#ifdef HAVE_OPENAT
+		/* Same modification time as the file when it was signed */
+		if (!idx && stat_mtime(&sig_info) == file_mtime) {
+			digest_record(id, 0, 0, sig_path);
+			log_inf("'%s' unmodified", path);
+			metric_inc(unchanged);
+			return -1;
+		}
+#endif
+		/* Read the metadata from the sig file */
+		err = read_metadata(sig_path, md, 0);
+		if (err) {
+			log_err("error reading metadata from sig file '%s'; will be re-created", sig_path);
+		} else {
+			/* Figure out if we need to re-create the sig file */
+			offset_t hcl = sizeof(hcl) == 4 ? md->cll : (offset_t)md->clh << 32 | md->cll;
+			if (entry_info.st_size == hcl) {
+				/* Unmodified so skip, but record the new modification time */
+				if (idx) {
+					sha256_context ctx;
+					ctx.total[0] = md->cll;
+					ctx.total[1] = md->clh;
+					memcpy(ctx.state, md->state, sizeof(ctx.state));
+					lock_enter(&index_lock);
+					sign_index_put(idx, name, &ctx, *mtime);
+					lock_leave(&index_lock);
+				}
+#ifdef HAVE_OPENAT
+				else { /* e.g. touched, the next scan skips the metadata again */
+					struct timespec ts[2];
+					ts[0].tv_sec = 0;
+					ts[0].tv_nsec = UTIME_OMIT;
+					ts[1].tv_sec = (time_t)(*mtime / 1000000000);
+					ts[1].tv_nsec = (long)(*mtime % 1000000000);
+					utimensat(dfd, sig_name, ts, 0);
+				}
+#endif
+				digest_record(id, 0, 0, sig_path);
+				log_inf("'%s' unmodified", path);
+				metric_inc(unchanged);
+				return -1;
+			} else if (entry_info.st_size < hcl) {
+				/* Shrunk so re-sign from beginning of file */
+				log_wrn("'%s' shrunk", path);
+				metric_inc(shrunk);
+				err = 1;
+			} else {
+				/* Modified so re-sign the file using the hash state saved in the metatdata */
+				log_inf("'%s' modified", path);
+				metric_inc(modified);
+			}
+		}
+		/* Create/re-create sig file */
+		return err ? 0 : 1;
+	} else { /* No sig file found (or err reading it) => create/re-create */
+		int e = err;
+		metric_inc(new_files);
+		if (e == ENOENT) /* A sig file doesn't yet exist, assume file is new */
+			log_inf("'%s' not yet signed", path);
+		else /* Error accessing an existing sig file */
+			log_err("error accessing sig file '%s': %s; will be re-created", sig_path, strerror(e));
+		/* A hard link of a signed file continues from the state in its sig file */
+		if (digest_resume(id, path, md))
+			return 1;
+		/* Create/re-create sig file */
+		return 0;
+	}
+}
+
+/**
+ * Sign the file at the specified path if necessary (see check_file)
+ * with the specified pin and label.
+ * Returns 1 if signing failed and may succeed later.
+ */
+int sign_file(const char* path, const char* pin, const char* label)
+{
+	metadata_t md;
+	long long mtime;
+	file_id_t id;
+	int rc;
+
+	label = file_label(path, label);
+	if (!label)
+		return 0;
+	rc = check_file(AT_FDCWD, path, path, &md, 0, &mtime, &id);
+	if (rc >= 0 && tree_profile(path, rc > 0 ? &md : 0))
+		return sign_tree(path, pin, label, rc > 0 ? &md : 0, 0, mtime, &id);
+	return rc >= 0 ? sign(path, pin, label, rc > 0 ? &md : 0, mtime, &id) : 0;
+}
+
+/**
+ * Skip "./" "../", hidden files that begin with '.' and signatures
+ */
+static int skip_entry(const char* name)
+{
+	const char* ext;
+
+	if (name[0] == '.')
+		return 1;
+	ext = strrchr(name, '.');
+	if (ext && (strcmp(ext, ".p7s") == 0))
+		return 1;
+	ext = strrchr(name, ':');
+	if (ext && (strcmp(ext, ":p7s") == 0))
+		return 1;
+	return 0;
+}
+
+/**
+ * Names of the subdirectories found while scanning a directory (-r)
+ */
+typedef struct
+{
+	char** name;
+	int count;
+	int capacity;
+} subdirs_t;
+
+/**
+ * Classify a directory entry by its d_type, so directories are never
+ * stat'ed. A subdirectory is recorded in subs with option -r.
+ * Returns 1 if the entry may be a file to be signed.
+ */
+static int scan_entry(int dfd, const char* path, struct dirent* entry, subdirs_t* subs)
+{
+	int type = entry->d_type;
+
+	/* Skip "./" "../", hidden files and ".p7s" & ":p7s" files */
+	if (skip_entry(entry->d_name))
+		return 0;
+	if (type == DT_UNKNOWN && recursive) { /* e.g. some network file systems */
+		struct stat info;
+		char entry_path[MAX_PATH];
+		int n = snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+		if (n > 0 && n < sizeof(entry_path) && stat_at(dfd, entry->d_name, entry_path, &info) == 0)
+			type = S_ISDIR(info.st_mode) ? DT_DIR : DT_REG;
+	}
+	if (type != DT_DIR)
+		return 1;
+	if (recursive) {
+		char* name = (char*)malloc(strlen(entry->d_name) + 1);
+		if (subs->count == subs->capacity) {
+			int capacity = subs->capacity ? 2 * subs->capacity : 16;
+			char** tmp = (char**)realloc(subs->name, capacity * sizeof(char*));
+			if (tmp) {
+				subs->name = tmp;
+				subs->capacity = capacity;
+			}
+		}
+		if (!name || subs->count == subs->capacity) {
+			log_err("error allocating subdirectory '%s/%s'", path, entry->d_name);
+			free(name);
+			return 0;
+		}
+		strcpy(name, entry->d_name);
+		subs->name[subs->count++] = name;
+	}
+	return 0;
+}
+
+/**
+ * Path arguments of the -j mode on one device (st_dev). The devices
+ * are signed at the same time, each by a thread signing its paths in
+ * the order of the arguments (see sign_devices). A rotational disk is
+ * read by one worker at a time and the files of each directory in the
+ * order of their inodes, roughly the order of their data on the disk,
+ * so the head seeks less. Other devices (SSD, NVMe, network mounts)
+ * are read by all workers. The devices share the token (token_lock).
+ */
+typedef struct
+{
+	unsigned long long dev; /* st_dev of the paths */
+	int rotational;         /* see device_rotational */
+	int threads;            /* workers of each directory */
+	int readers;            /* workers hashing at the same time */
+	char** path;            /* path arguments on the device */
+	int* is_dir;            /* whether path[i] is a directory */
+	int count;
+	const char* pin;
+	const char* label;
+} device_t;
+
+void sign_files(const char* path, const char* pin, const char* label);
+void sign_files_parallel(const char* path, const char* pin, const char* label, const device_t* dev);
+
+/**
+ * Sign the files of the subdirectories found in the specified path,
+ * one directory after the other, and release the names. The files are
+ * signed with the workers of the device (-j mode) or with sign_files.
+ */
+static void sign_subdirs(const char* path, subdirs_t* subs, const char* pin, const char* label, const device_t* dev)
+{
+	int i;
+	for (i = 0; i < subs->count; i++) {
+		char sub_path[MAX_PATH];
+		int n = snprintf(sub_path, sizeof(sub_path), "%s/%s", path, subs->name[i]);
+		if (n < 0 || n >= sizeof(sub_path))
+			log_err("error building entry path '%s/%s'", path, subs->name[i]);
+		else if (dev)
+			sign_files_parallel(sub_path, pin, label, dev);
+		else
+			sign_files(sub_path, pin, label);
+		free(subs->name[i]);
+	}
+	free(subs->name);
+}
+
+/*
+ * Order of the files of a directory (option -o): as read (default),
+ * the newest or the oldest modification time first, or the smallest
+ * first. With an order the entries are read ahead and each file is
+ * stat'ed once more; in sign_files a file which hashed SIGN_SLICE
+ * bytes yields its lane while files are waiting, its hash state stays
+ * in memory and it is resumed once the directory is exhausted, so a
+ * large rehash does not hold back the files behind it.
+ */
+#define ORDER_DIR      0
+#define ORDER_NEWEST   1
+#define ORDER_OLDEST   2 /* the files waiting longest, i.e. earliest deadline */
+#define ORDER_SMALLEST 3
+
+#define SIGN_SLICE  0x4000000 /* bytes hashed before a lane yields */
+#define SIGN_PARKED 16        /* files waiting with open input and hash state */
+
+static int sign_order = ORDER_DIR;
+
+/**
+ * File of a directory read ahead, see read_entries
+ */
+typedef struct
+{
+	unsigned long long ino;
+	char* name;
+	long long mtime;         /* stat_mtime, if sign_order needs it */
+	unsigned long long size;
+} dir_entry_t;
+
+static int entry_compare(const void* a, const void* b)
+{
+	const dir_entry_t* x = (const dir_entry_t*)a, * y = (const dir_entry_t*)b;
+
+	if (sign_order == ORDER_NEWEST && x->mtime != y->mtime)
+		return x->mtime > y->mtime ? -1 : 1;
+	if (sign_order == ORDER_OLDEST && x->mtime != y->mtime)
+		return x->mtime < y->mtime ? -1 : 1;
+	if (sign_order == ORDER_SMALLEST && x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/**
+ * Read the entries of the directory at path ahead and sort the files
+ * to be signed by sign_order, else by their inode (d_ino), see
+ * device_t. Returns the entries (count in *count) or 0.
+ */
+static dir_entry_t* read_entries(DIR* dir, int dfd, const char* path, subdirs_t* subs, int* count)
+{
+	dir_entry_t* entries = 0;
+	struct dirent* entry;
+	int capacity = 0;
+
+	*count = 0;
+	while ((entry = readdir(dir)) != NULL) {
+		dir_entry_t* e;
+		char* name;
+		if (!scan_entry(dfd, path, entry, subs))
+			continue;
+		if (*count == capacity) {
+			int n = capacity ? 2 * capacity : 256;
+			dir_entry_t* tmp = (dir_entry_t*)realloc(entries, n * sizeof(dir_entry_t));
+			if (tmp) {
+				entries = tmp;
+				capacity = n;
+			}
+		}
+		name = (char*)malloc(strlen(entry->d_name) + 1);
+		if (!name || *count == capacity) {
+			log_err("error allocating entry '%s/%s'", path, entry->d_name);
+			free(name);
+			continue;
+		}
+		strcpy(name, entry->d_name);
+		e = &entries[(*count)++];
+		memset(e, 0, sizeof(*e));
+		e->ino = (unsigned long long)entry->d_ino;
+		e->name = name;
+		if (sign_order != ORDER_DIR) { /* a failed stat is reported by check_file */
+			struct stat info;
+			char entry_path[MAX_PATH];
+			int n = snprintf(entry_path, sizeof(entry_path), "%s/%s", path, name);
+			if (n > 0 && n < sizeof(entry_path) && stat_at(dfd, name, entry_path, &info) == 0) {
+				e->mtime = stat_mtime(&info);
+				e->size = (unsigned long long)info.st_size;
+			}
+		}
+	}
+	if (entries)
+		qsort(entries, *count, sizeof(dir_entry_t), entry_compare);
+	return entries;
+}
+
+/**
+ * Shared state of the -j mode and of the pipeline of sign_files.
+ * The workers (or the lanes of sign_files) scan the directory, hash
+ * the files and write the sig files, the token thread signs the hashes.
+ */
+typedef struct
+{
+	lock_t lock;
+	cond_t cond;          /* broadcast on every change of the state below */
+	const char* path;
+	const char* pin;
+	const char* label;
+	DIR* dir;             /* directory stream, 0 when exhausted */
+	int dfd;              /* descriptor of the directory */
+	subdirs_t subs;       /* subdirectories for option -r */
+	sign_index_t* idx;    /* index of the directory or 0 */
+	dir_entry_t* entries; /* files of the directory read ahead or 0, see read_entries */
+	int entry_count;
+	int entry_next;
+	int hashing;          /* files being hashed */
+	int readers;          /* workers wait before hashing more files at once */
+	int pending;          /* files hashed, but not yet written */
+	int max_pending;      /* workers wait before hashing more files */
+	sign_job_t* to_sign;  /* hashed files queued for the token thread */
+	sign_job_t* to_write; /* signed files queued for the workers */
+} work_t;
+
+/**
+ * Sign the queued hashes one after the other until all files are
+ * hashed (token thread). The queued hashes of the same key are signed
+ * back to back (option -f). The signed files are queued for writing.
+ */
+static void sign_queue(work_t* w)
+{
+	const char* label = 0; /* label of the last signature */
+
+	lock_enter(&w->lock);
+	while (w->to_sign || w->dir || w->hashing) {
+		sign_job_t* job, ** prev = &w->to_sign;
+		const unsigned char *pCms = 0;
+		unsigned long long start;
+
+		if (!w->to_sign) {
+			cond_wait(&w->cond, &w->lock);
+			continue;
+		}
+		if (label && rule_count) {
+			sign_job_t** p;
+			for (p = &w->to_sign; *p; p = &(*p)->next)
+				if (strcmp((*p)->label, label) == 0) {
+					prev = p;
+					break;
+				}
+		}
+		job = *prev;
+		*prev = job->next;
+		label = job->label;
+		lock_leave(&w->lock);
+
+		/* A copy of a signed file has the same signature */
+		job->cms = digest_reuse(job, &job->cms_size);
+
+		/* Sign the hash with the token; the CMS document is copied
+		   because the next sign_hash overwrites it */
+		if (!job->cms) {
+			lock_enter(&token_lock);
+			start = metrics_now();
+			job->cms_size = token_sign_hash(w->pin, job->label, job->hash, sizeof(job->hash), &pCms);
+			metrics_sign(job->cms_size, metrics_now() - start);
+			if (job->cms_size > 0) {
+				job->cms = (unsigned char*)malloc(job->cms_size);
+				if (job->cms)
+					memcpy(job->cms, pCms, job->cms_size);
+				else
+					log_err("error allocating CMS document for '%s'", job->path);
+			}
+			lock_leave(&token_lock);
+		}
+
+		lock_enter(&w->lock);
+		if (job->cms) {
+			job->next = w->to_write;
+			w->to_write = job;
+		} else {
+			free(job);
+			w->pending--;
+		}
+		cond_broadcast(&w->cond);
+	}
+	lock_leave(&w->lock);
+}
+
+static THREAD_FUNC sign_token(void* arg)
+{
+	sign_queue((work_t*)arg);
+	return 0;
+}
+
+/**
+ * Write the signed files of the pipeline of sign_files. Waits until
+ * less than max_pending files are pending (all == 0) or all files are
+ * written (all != 0). Requires w->lock.
+ */
+static void sign_drain(work_t* w, int all)
+{
+	for (;;) {
+		sign_job_t* job = w->to_write;
+		if (job) {
+			w->to_write = job->next;
+			lock_leave(&w->lock);
+			sign_write(job, job->cms, job->cms_size);
+			free(job->cms);
+			free(job);
+			lock_enter(&w->lock);
+			w->pending--;
+			continue;
+		}
+		if (w->pending == 0 || !all && w->pending < w->max_pending)
+			break;
+		cond_wait(&w->cond, &w->lock);
+	}
+}
+
+/**
+ * Scan through the specified (directory) path and sign each file
+ * that is not hidden nor a signature (.p7s), if necessary.
+ * Up to SHA256_MB_LANES files are hashed in parallel with
+ * sha256_mb_update; a file is signed as soon as its end is reached
+ * and the lane is refilled with the next file of the directory.
+ * The hashes are signed in a token thread meanwhile (pipeline): the
+ * next files are hashed while the token signs a file and the sig file
+ * of the previous one is written, so hashing hides the token latency.
+ * With option -o the files are taken in that order and a large file
+ * yields its lane after SIGN_SLICE bytes while others are waiting.
+ * With option -r the subdirectories are signed afterwards.
+ * The specified pin and label will be used for signing.
+ */
+void sign_files(const char* path, const char* pin, const char* label)
+{
+	static sign_job_t job[SHA256_MB_LANES];
+	static char job_path[SHA256_MB_LANES][MAX_PATH];
+	static unsigned char buf[SHA256_MB_LANES][0x4000];
+	static offset_t slice_end[SHA256_MB_LANES];
+	sha256_context* ctx[SHA256_MB_LANES];
+	unsigned char* input[SHA256_MB_LANES];
+	unsigned int length[SHA256_MB_LANES];
+	sign_job_t* parked[SIGN_PARKED];
+	int i, err, dfd, jobs = 0, pipeline, parked_count = 0, entry_count = 0, entry_next = 0;
+	unsigned long long start;
+	DIR* dir;
+	struct dirent* entry = 0;
+	dir_entry_t* entries = 0;
+	sign_index_t* idx = 0;
+	subdirs_t subs;
+	work_t w;
+	thread_t token;
+
+	/* Open directory stream */
+	dir = opendir(path);
+	if (dir == NULL) {
+		int e = errno;
+		log_err("error opening path '%s': %s", path, strerror(e));
+		return;
+	}
+	dfd = dir_fd(dir);
+	memset(&subs, 0, sizeof(subs));
+	if (use_index)
+		idx = sign_index_open(path);
+	if (sign_order != ORDER_DIR)
+		entries = read_entries(dir, dfd, path, &subs, &entry_count);
+
+	/* Start the token thread, hashing = 1 until all files are hashed */
+	memset(&w, 0, sizeof(w));
+	w.pin = pin;
+	w.label = label;
+	w.hashing = 1;
+	w.max_pending = (rule_count ? 16 : 2) * SHA256_MB_LANES; /* more room to group by key */
+	lock_init(&w.lock);
+	cond_init(&w.cond);
+	pipeline = thread_create(&token, sign_token, &w) == 0;
+	if (!pipeline)
+		log_wrn("error creating token thread; signing without pipeline");
+
+	for (;;) {
+		int lanes = 0;
+
+		/* Write the signed files, limit the hashed files waiting for the token */
+		if (pipeline) {
+			lock_enter(&w.lock);
+			sign_drain(&w, 0);
+			lock_leave(&w.lock);
+		}
+
+		/* Fill the free lanes with the next entries to be signed, then the parked files */
+		while (jobs < SHA256_MB_LANES) {
+			int n, rc;
+			char* entry_path = job_path[jobs];
+			const char* name = 0;
+			metadata_t md;
+			long long mtime;
+			file_id_t id;
+
+			if (entries) {
+				if (entry_next < entry_count)
+					name = entries[entry_next++].name;
+			} else if ((entry = readdir(dir)) != NULL) {
+				/* Skip directories, hidden files and ".p7s" & ":p7s" files */
+				if (!scan_entry(dfd, path, entry, &subs))
+					continue;
+				name = entry->d_name;
+			}
+			if (!name) {
+				/* Resume a parked file with its hash state */
+				if (parked_count == 0)
+					break;
+				job[jobs] = *parked[--parked_count];
+				free(parked[parked_count]);
+				strcpy(entry_path, job[jobs].path_buf);
+				job[jobs].path = entry_path;
+				slice_end[jobs++] = 0;
+				continue;
+			}
+
+			/* Create the full path to the entry */
+			n = snprintf(entry_path, MAX_PATH,
+				"%s/%s", path, name);
+			if (n < 0 || n >= MAX_PATH) {
+				log_err("error building entry path '%s/%s'", path, name);
+				continue;
+			}
+
+			/* Start hashing the file, if it needs to be signed */
+			job[jobs].label = file_label(entry_path, label);
+			rc = job[jobs].label ? check_file(dfd, name, entry_path, &md, idx, &mtime, &id) : -1;
+			if (rc >= 0 && tree_profile(entry_path, rc > 0 ? &md : 0)) {
+				sign_tree(entry_path, pin, job[jobs].label, rc > 0 ? &md : 0, idx, mtime, &id);
+				continue;
+			}
+			if (rc >= 0 && sign_begin(&job[jobs], entry_path, rc > 0 ? &md : 0) == 0) {
+				job[jobs].idx = idx;
+				job[jobs].mtime = mtime;
+				job[jobs].id = id;
+				slice_end[jobs] = entries ? job[jobs].in.pos + SIGN_SLICE : 0;
+				jobs++;
+			}
+		}
+		if (jobs == 0)
+			break;
+
+		/* Read the next chunk of each file, sign the files that are completely hashed */
+		start = metrics_now();
+		for (i = 0; i < jobs; ) {
+			int n;
+			/* A file which hashed its slice yields the lane to the waiting files */
+			if (slice_end[i] && job[i].in.pos >= slice_end[i] && entry_next < entry_count
+				&& parked_count < SIGN_PARKED) {
+				sign_job_t* p = (sign_job_t*)malloc(sizeof(sign_job_t));
+				if (p) {
+					*p = job[i];
+					strcpy(p->path_buf, job[i].path);
+					p->path = p->path_buf;
+					parked[parked_count++] = p;
+					if (i != --jobs) {
+						memcpy(job_path[i], job_path[jobs], MAX_PATH);
+						job[i] = job[jobs];
+						job[i].path = job_path[i];
+						slice_end[i] = slice_end[jobs];
+					}
+					continue;
+				}
+				slice_end[i] = 0;
+			}
+			n = sign_read(&job[i], buf[i], sizeof(buf[i]), &input[lanes]);
+			if (n <= 0) {
+				sign_job_t* queued;
+				if (!pipeline) {
+					sign_end(&job[i], pin, job[i].label);
+				} else if (sign_hashed(&job[i]) == 0) {
+					/* Queue a copy of the job for the token thread */
+					queued = (sign_job_t*)malloc(sizeof(sign_job_t));
+					if (!queued) {
+						log_err("error allocating job for '%s'", job[i].path);
+					} else {
+						*queued = job[i];
+						strcpy(queued->path_buf, job[i].path);
+						queued->path = queued->path_buf;
+						queued->cms = 0;
+						lock_enter(&w.lock);
+						queued->next = w.to_sign;
+						w.to_sign = queued;
+						w.pending++;
+						cond_broadcast(&w.cond);
+						lock_leave(&w.lock);
+					}
+				}
+				/* Move the last job into the free lane */
+				if (i != --jobs) {
+					memcpy(job_path[i], job_path[jobs], MAX_PATH);
+					job[i] = job[jobs];
+					job[i].path = job_path[i];
+					slice_end[i] = slice_end[jobs];
+				}
+				continue;
+			}
+			ctx[lanes] = &job[i].ctx;
+			length[lanes++] = n;
+			i++;
+		}
+
+		/* Create/Continue the SHA-256 hashes of the files */
+		sha256_mb_update(ctx, input, length, lanes);
+		metric_add(hash_us, metrics_now() - start);
+	}
+
+	/* Let the token thread finish and write the remaining files */
+	if (pipeline) {
+		lock_enter(&w.lock);
+		w.hashing = 0;
+		cond_broadcast(&w.cond);
+		sign_drain(&w, 1);
+		lock_leave(&w.lock);
+		thread_join(token);
+	}
+	cond_destroy(&w.cond);
+	lock_destroy(&w.lock);
+
+	/* Close the directory stream */
+	err = closedir(dir);
+	if (err) {
+		int e = errno;
+		log_err("error closing path '%s': %s", path, strerror(e));
+	}
+	commit_flush();
+	sign_index_close(idx);
+	for (i = 0; i < entry_count; i++)
+		free(entries[i].name);
+	free(entries);
+	sign_subdirs(path, &subs, pin, label, 0);
+}
+
+/**
+ * Get the name of the next file of the directory of the -j mode, which
+ * may need to be signed, the sorted entries first. Returns 0 once the
+ * directory is exhausted. Requires w->lock.
+ */
+static const char* next_entry(work_t* w)
+{
+	struct dirent* entry;
+
+	if (w->entries)
+		return w->entry_next < w->entry_count ? w->entries[w->entry_next++].name : 0;
+	while ((entry = readdir(w->dir)) != NULL)
+		if (scan_entry(w->dfd, w->path, entry, &w->subs))
+			return entry->d_name;
+	return 0;
+}
+
+/**
+ * Worker of the -j mode
+ */
+static THREAD_FUNC sign_worker(void* arg)
+{
+	work_t* w = (work_t*)arg;
+	unsigned char* buf = (unsigned char*)malloc(0x10000);
+
+	if (!buf) {
+		log_err("error allocating read buffer");
+		return 0;
+	}
+
+	lock_enter(&w->lock);
+	for (;;) {
+		sign_job_t* job;
+		const char* entry;
+		const char* name;
+		metadata_t md;
+		long long mtime;
+		file_id_t id;
+		int n, rc;
+
+		/* Write the signed files first to release their memory */
+		if (w->to_write) {
+			job = w->to_write;
+			w->to_write = job->next;
+			lock_leave(&w->lock);
+			sign_write(job, job->cms, job->cms_size);
+			free(job->cms);
+			free(job);
+			lock_enter(&w->lock);
+			w->pending--;
+			cond_broadcast(&w->cond);
+			continue;
+		}
+
+		/* Nothing left to write or to hash */
+		if (!w->dir && !w->pending)
+			break;
+
+		if (!w->dir || w->pending >= w->max_pending || w->hashing >= w->readers) {
+			cond_wait(&w->cond, &w->lock);
+			continue;
+		}
+
+		/* Get the next entry of the directory */
+		entry = next_entry(w);
+		if (entry == NULL) {
+			int err;
+			/* The hashing workers still stat relative to the directory */
+			if (w->hashing) {
+				cond_wait(&w->cond, &w->lock);
+				continue;
+			}
+			err = closedir(w->dir);
+			if (err) {
+				int e = errno;
+				log_err("error closing path '%s': %s", w->path, strerror(e));
+			}
+			w->dir = 0;
+			cond_broadcast(&w->cond);
+			continue;
+		}
+		job = (sign_job_t*)calloc(1, sizeof(sign_job_t));
+		if (!job) {
+			log_err("error allocating job for '%s/%s'", w->path, entry);
+			continue;
+		}
+		n = snprintf(job->path_buf, sizeof(job->path_buf),
+			"%s/%s", w->path, entry);
+		if (n < 0 || n >= sizeof(job->path_buf)) {
+			log_err("error building entry path '%s/%s'", w->path, entry);
+			free(job);
+			continue;
+		}
+		name = strrchr(job->path_buf, '/') + 1; /* entry is reused by the next readdir */
+		w->hashing++;
+		lock_leave(&w->lock);
+
+		/* Hash the file, if it needs to be signed */
+		job->label = file_label(job->path_buf, w->label);
+		rc = job->label ? check_file(w->dfd, name, job->path_buf, &md, w->idx, &mtime, &id) : -1;
+		if (rc >= 0 && tree_profile(job->path_buf, rc > 0 ? &md : 0)) {
+			sign_tree(job->path_buf, w->pin, job->label, rc > 0 ? &md : 0, w->idx, mtime, &id);
+			rc = -1;
+		} else if (rc >= 0 && sign_begin(job, job->path_buf, rc > 0 ? &md : 0) == 0) {
+			unsigned long long start = metrics_now();
+			job->idx = w->idx;
+			job->mtime = mtime;
+			job->id = id;
+			for (;;) {
+				unsigned char* data;
+				n = sign_read(job, buf, 0x10000, &data);
+				if (n <= 0)
+					break;
+				sha256_update(&job->ctx, data, n);
+			}
+			metric_add(hash_us, metrics_now() - start);
+			rc = sign_hashed(job);
+		} else {
+			rc = -1;
+		}
+
+		lock_enter(&w->lock);
+		w->hashing--;
+		if (rc == 0) {
+			job->next = w->to_sign;
+			w->to_sign = job;
+			w->pending++;
+		} else {
+			free(job);
+		}
+		cond_broadcast(&w->cond);
+	}
+	lock_leave(&w->lock);
+
+	free(buf);
+	return 0;
+}
+
+/**
+ * Sign the files of the specified (directory) path like sign_files
+ * with the worker threads of the device hashing the files and writing
+ * the sig files. The calling thread signs the hashes one after the
+ * other. With option -r the subdirectories are signed afterwards.
+ */
+void sign_files_parallel(const char* path, const char* pin, const char* label, const device_t* dev)
+{
+	work_t w;
+	thread_t thread[MAX_THREADS];
+	int i, started = 0;
+
+	memset(&w, 0, sizeof(w));
+	w.path = path;
+	w.pin = pin;
+	w.label = label;
+	w.readers = dev->readers;
+	w.max_pending = (rule_count ? 16 : 4) * dev->threads;
+	w.dir = opendir(path);
+	if (w.dir == NULL) {
+		int e = errno;
+		log_err("error opening path '%s': %s", path, strerror(e));
+		return;
+	}
+	w.dfd = dir_fd(w.dir);
+	if (use_index)
+		w.idx = sign_index_open(path);
+	if (dev->rotational || sign_order != ORDER_DIR)
+		w.entries = read_entries(w.dir, w.dfd, path, &w.subs, &w.entry_count);
+	lock_init(&w.lock);
+	cond_init(&w.cond);
+
+	for (i = 0; i < dev->threads; i++) {
+		if (thread_create(&thread[started], sign_worker, &w)) {
+			log_err("error creating worker thread %d", i);
+			continue;
+		}
+		started++;
+	}
+	if (!started) {
+		closedir(w.dir);
+		w.dir = 0;
+	}
+
+	/* Sign the hashed files until all are hashed */
+	sign_queue(&w);
+
+	/* The workers exit after writing the remaining sig files */
+	for (i = 0; i < started; i++)
+		thread_join(thread[i]);
+	cond_destroy(&w.cond);
+	lock_destroy(&w.lock);
+	commit_flush();
+	sign_index_close(w.idx);
+	for (i = 0; i < w.entry_count; i++)
+		free(w.entries[i].name);
+	free(w.entries);
+	sign_subdirs(path, &w.subs, pin, label, dev);
+}
+
+/**
+ * Whether the device is a rotational disk, as its queue (or the queue
+ * of the disk of the partition) reports in sysfs. Network file systems
+ * and devices without a queue, e.g. on Windows, are not rotational.
+ */
+static int device_rotational(unsigned long long dev)
+{
+	int c = EOF;
+#ifndef _WIN32
+	static const char* queue[] = {
+		"/sys/dev/block/%u:%u/queue/rotational",
+		"/sys/dev/block/%u:%u/../queue/rotational"
+	};
+	int i;
+
+	for (i = 0; i < 2 && c == EOF; i++) {
+		char path[64];
+		FILE* fp;
+		snprintf(path, sizeof(path), queue[i], major((dev_t)dev), minor((dev_t)dev));
+		fp = fopen(path, "r");
+		if (fp) {
+			c = fgetc(fp);
+			fclose(fp);
+		}
+	}
+#endif
+	return c == '1';
+}
+
+/**
+ * Add the path argument to its device, see device_t. Returns the
+ * device or 0 if out of memory.
+ */
+static device_t* device_add(device_t* devs, int* count, char* path, const struct stat* info, int args)
+{
+	device_t* dev;
+	int i;
+
+	for (i = 0; i < *count; i++)
+		if (devs[i].dev == (unsigned long long)info->st_dev)
+			break;
+	dev = &devs[i];
+	if (i == *count) {
+		dev->dev = (unsigned long long)info->st_dev;
+		dev->path = (char**)malloc(args * sizeof(char*));
+		dev->is_dir = (int*)malloc(args * sizeof(int));
+		if (!dev->path || !dev->is_dir) {
+			free(dev->path);
+			free(dev->is_dir);
+			dev->path = 0;
+			dev->is_dir = 0;
+			return 0;
+		}
+		(*count)++;
+	}
+	dev->path[dev->count] = path;
+	dev->is_dir[dev->count++] = S_ISDIR(info->st_mode);
+	return dev;
+}
+
+/**
+ * Sign the path arguments of a device one after the other
+ */
+static THREAD_FUNC sign_device(void* arg)
+{
+	device_t* dev = (device_t*)arg;
+	int i;
+
+	log_inf("%d path(s) on device %llx, %d reader(s)%s", dev->count, dev->dev,
+		dev->readers, dev->rotational ? " in inode order" : "");
+	for (i = 0; i < dev->count; i++)
+		if (dev->is_dir[i])
+			sign_files_parallel(dev->path[i], dev->pin, dev->label, dev);
+		else
+			sign_file(dev->path[i], dev->pin, dev->label);
+	return 0;
+}
+
+/**
+ * Sign the path arguments of the -j mode grouped by their devices,
+ * the devices at the same time (see device_t), and release them.
+ */
+static void sign_devices(device_t* devs, int count, const char* pin, const char* label, int threads)
+{
+	thread_t thread[MAX_THREADS];
+	int i, started = 0;
+
+	for (i = 0; i < count; i++) {
+		devs[i].rotational = device_rotational(devs[i].dev);
+		devs[i].threads = threads;
+		devs[i].readers = devs[i].rotational ? 1 : threads;
+		devs[i].pin = pin;
+		devs[i].label = label;
+	}
+
+	/* One thread per device, the last device in the calling thread */
+	for (i = 0; i < count - 1; i++) {
+		if (started < MAX_THREADS && thread_create(&thread[started], sign_device, &devs[i]) == 0) {
+			started++;
+			continue;
+		}
+		log_wrn("error creating device thread %d; signing its paths first", i);
+		sign_device(&devs[i]);
+	}
+	if (count)
+		sign_device(&devs[count - 1]);
+	for (i = 0; i < started; i++)
+		thread_join(thread[i]);
+	for (i = 0; i < count; i++) {
+		free(devs[i].path);
+		free(devs[i].is_dir);
+	}
+}
+
+/*
+ * Manifest mode (option -M): instead of a sig file per file, the
+ * SHA-256 of each file of a directory is listed in the manifest of the
+ * directory (see manifest.h), and only the manifest is signed. One
+ * token signature thus covers any number of small files, each of them
+ * keeps its own digest. Files not changed since the previous manifest
+ * (same size, older than its <since>) keep their digests, the others
+ * are hashed. The manifest and its sig file are only rewritten if a
+ * file was added, changed or removed. Option -V verifies the files
+ * against the manifest.
+ */
+
+/**
+ * Modification time (see stat_mtime) before which a file is known to
+ * be unchanged once the scan starts, less a margin for the coarse file
+ * system clock
+ */
+static long long manifest_since(void)
+{
+#ifdef HAVE_OPENAT
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (long long)now.tv_sec * 1000000000 + now.tv_nsec - 2000000000LL;
+#else
+	return (long long)time(0) - 2;
+#endif
+}
+
+/**
+ * Hash the content of the file at the specified path.
+ * Returns 0 on success.
+ */
+static int manifest_hash(const char* path, unsigned char digest[32])
+{
+	sign_job_t job;
+	unsigned char buf[0x10000];
+	unsigned long long start;
+
+	if (sign_begin(&job, path, 0))
+		return -1;
+	start = metrics_now();
+	for (;;) {
+		unsigned char* data;
+		int n = sign_read(&job, buf, sizeof(buf), &data);
+		if (n <= 0)
+			break;
+		sha256_update(&job.ctx, data, n);
+	}
+	metric_add(hash_us, metrics_now() - start);
+	if (sign_hashed(&job))
+		return -1;
+	memcpy(digest, job.hash, sizeof(job.hash));
+	return 0;
+}
+
+/**
+ * Check that the sig file of the manifest at the specified path holds
+ * the SHA-256 of the manifest as its messageDigest attribute, i.e. was
+ * created for this manifest. The signature itself is not verified.
+ * Returns 1 if so, 0 otherwise.
+ */
+static int manifest_signed(const char* path)
+{
+	/* OID 1.2.840.113549.1.9.4 (messageDigest), SET { OCTET STRING (32) } */
+	static const unsigned char attr[] = {
+		0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x09, 0x04, 0x31, 0x22, 0x04, 0x20
+	};
+	char sig_path[MAX_PATH];
+	unsigned char digest[32], * sig = 0, * p;
+	struct stat info;
+	FILE* fp;
+	size_t len = 0;
+	int n, found = 0;
+
+	n = snprintf(sig_path, sizeof(sig_path), "%s%s", path, sig_ext);
+	if (n < 0 || n >= sizeof(sig_path) || stat(sig_path, &info) || manifest_hash(path, digest))
+		return 0;
+	fp = fopen(sig_path, "rb");
+	if (fp) {
+		sig = (unsigned char*)malloc((size_t)info.st_size + 1);
+		if (sig)
+			len = fread(sig, 1, (size_t)info.st_size, fp);
+		fclose(fp);
+	}
+	for (p = sig; sig && p + sizeof(attr) + sizeof(digest) <= sig + len && !found; p++)
+		found = memcmp(p, attr, sizeof(attr)) == 0 && memcmp(p + sizeof(attr), digest, sizeof(digest)) == 0;
+	free(sig);
+	return found;
+}
+
+/**
+ * Write the manifest to a hidden temporary file next to it, sync it
+ * and rename it into place. Returns 0 on success.
+ */
+static int manifest_write(const char* path, const manifest_t* mf)
+{
+	char tmp_path[MAX_PATH];
+	const char* name = strrchr(path, '/') + 1;
+	FILE* fp;
+	int n, err;
+
+	n = snprintf(tmp_path, sizeof(tmp_path), "%.*s%s.tmp", (int)(name - path), path, name);
+	if (n < 0 || n >= sizeof(tmp_path))
+		return -1;
+	fp = fopen(tmp_path, "wb");
+	if (!fp)
+		return -1;
+	err = manifest_print(fp, mf) || fflush(fp) || file_sync(fp);
+	err |= fclose(fp) != 0;
+#ifdef _WIN32
+	err = err || !MoveFileEx(tmp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+	err = err || rename(tmp_path, path);
+#endif
+	if (err)
+		remove(tmp_path);
+	return err ? -1 : 0;
+}
+
+/**
+ * Hash the new and modified files of the directory at the specified
+ * path into its manifest and sign the manifest, then the manifests of
+ * the subdirectories with option -r. Returns 1 if signing failed and
+ * may succeed later.
+ */
+static int sign_manifest(const char* path, const char* pin, const char* label)
+{
+	char mf_path[MAX_PATH], entry_path[MAX_PATH];
+	manifest_t old, mf;
+	subdirs_t subs;
+	DIR* dir;
+	struct dirent* entry;
+	struct stat info;
+	file_id_t id;
+	int i, n, dfd, hashed = 0, reused = 0, rc = 0;
+
+	n = snprintf(mf_path, sizeof(mf_path), "%s/%s", path, MANIFEST_NAME);
+	if (n < 0 || n >= sizeof(mf_path)) {
+		log_err("error building manifest path '%s/%s'", path, MANIFEST_NAME);
+		return 0;
+	}
+	dir = opendir(path);
+	if (dir == NULL) {
+		int e = errno;
+		log_err("error opening path '%s': %s", path, strerror(e));
+		return 0;
+	}
+	dfd = dir_fd(dir);
+	memset(&subs, 0, sizeof(subs));
+	memset(&old, 0, sizeof(old));
+	memset(&mf, 0, sizeof(mf));
+	if (manifest_read(mf_path, &old))
+		manifest_free(&old);
+	mf.since = manifest_since();
+
+	while ((entry = readdir(dir)) != NULL) {
+		const manifest_entry_t* e;
+		unsigned char digest[32];
+
+		/* Skip directories, hidden files (i.e. the manifest) and ".p7s" & ":p7s" files */
+		if (!scan_entry(dfd, path, entry, &subs))
+			continue;
+		n = snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+		if (n < 0 || n >= sizeof(entry_path)) {
+			log_err("error building entry path '%s/%s'", path, entry->d_name);
+			continue;
+		}
+		if (stat_at(dfd, entry->d_name, entry_path, &info)) {
+			int e = errno;
+			log_err("error accessing file '%s': %s", entry_path, strerror(e));
+			continue;
+		}
+		if (!S_ISREG(info.st_mode))
+			continue;
+		if (strchr(entry->d_name, '\n')) {
+			log_wrn("'%s' has a line break in its name; not in manifest", entry_path);
+			continue;
+		}
+		metric_inc(scanned);
+
+		/* The digest of an unchanged file is kept, others are hashed */
+		e = manifest_find(&old, entry->d_name);
+		if (e && e->size == (unsigned long long)info.st_size && stat_mtime(&info) < old.since) {
+			memcpy(digest, e->digest, sizeof(digest));
+			metric_inc(unchanged);
+			reused++;
+		} else if (manifest_hash(entry_path, digest) == 0) {
+			/* Also rewritten if the content is the same, so the next run does not hash it again */
+			if (!e) {
+				log_inf("'%s' not yet in manifest", entry_path);
+				metric_inc(new_files);
+			} else if (memcmp(digest, e->digest, sizeof(digest)) || e->size != (unsigned long long)info.st_size) {
+				log_inf("'%s' modified", entry_path);
+				metric_inc(modified);
+			} else
+				metric_inc(unchanged);
+			hashed++;
+		} else
+			continue;
+		if (manifest_add(&mf, entry->d_name, (unsigned long long)info.st_size, digest)) {
+			log_err("error allocating manifest entry '%s'", entry_path);
+			rc = -1;
+			break;
+		}
+	}
+	if (closedir(dir)) {
+		int e = errno;
+		log_err("error closing path '%s': %s", path, strerror(e));
+	}
+
+	/* Sign the manifest if a file changed or its sig file is missing */
+	if (rc < 0) {
+		rc = 0;
+	} else if (mf.count == 0) {
+		log_inf("'%s' no files", path);
+	} else if (hashed == 0 && reused == old.count && manifest_signed(mf_path)) {
+		log_inf("'%s' unmodified", mf_path);
+	} else if ((hashed || reused != old.count) && (manifest_sort(&mf), manifest_write(mf_path, &mf))) {
+		int e = errno;
+		log_err("error writing manifest '%s': %s", mf_path, strerror(e));
+	} else if (stat(mf_path, &info) == 0) {
+		log_inf("'%s' %d file(s), %d hashed", mf_path, mf.count, hashed);
+		memset(&id, 0, sizeof(id)); /* not recorded in the digest cache */
+		rc = sign(mf_path, pin, label, 0, stat_mtime(&info), &id);
+		commit_flush();
+	}
+	manifest_free(&old);
+	manifest_free(&mf);
+
+	for (i = 0; i < subs.count; i++) {
+		n = snprintf(entry_path, sizeof(entry_path), "%s/%s", path, subs.name[i]);
+		if (n < 0 || n >= sizeof(entry_path))
+			log_err("error building entry path '%s/%s'", path, subs.name[i]);
+		else
+			rc |= sign_manifest(entry_path, pin, label);
+		free(subs.name[i]);
+	}
+	free(subs.name);
+	return rc;
+}
+
+/*
+ * Verify mode (option -V): the files are checked against the CMS of
+ * their sig files (see verify.h) or the signed manifest of their
+ * directory, without token. The content length in the metadata of the
+ * sig file delimits the signed content; a file appended since signing
+ * fails unless option -p accepts it, then its signed prefix is checked.
+ * With option -j the main thread walks the directories and queues the
+ * files for the worker threads hashing and verifying them.
+ */
+typedef struct verify_item
+{
+	struct verify_item* next;
+	int listed;                 /* in the manifest with size and digest */
+	unsigned long long size;
+	unsigned char digest[32];
+	char path[MAX_PATH];
+} verify_item_t;
+
+typedef struct
+{
+	lock_t lock;
+	cond_t cond;          /* broadcast on every change of the state below */
+	verify_item_t* head;  /* queued files */
+	verify_item_t* tail;
+	int queued;
+	int max_queued;
+	int done;             /* all files queued */
+	int failed;
+} verify_work_t;
+
+static int verify_prefix;                /* option -p */
+static verify_work_t* verify_w;          /* option -j */
+static unsigned char verify_buf[0x10000]; /* read buffer and RSA key of the main thread */
+static mont_t verify_key;
+
+/**
+ * Hash the first len bytes of the file at the specified path.
+ * Returns 0 on success, -1 if the file could not be read or is shorter.
+ */
+static int verify_hash(const char* path, offset_t len, unsigned char* buf, unsigned char digest[32])
+{
+	sha256_context ctx;
+	input_t in;
+	int n;
+
+	if (input_open(&in, path))
+		return -1;
+	in.limit = len;
+	sha256_starts(&ctx);
+	while (in.pos < len) {
+		unsigned char* data;
+		n = input_read(&in, buf, 0x10000, &data);
+		if (n <= 0)
+			break;
+		sha256_update(&ctx, data, n);
+	}
+	sha256_finish(&ctx, digest);
+	n = in.pos == len;
+	return input_close(&in, path) == 0 && n ? 0 : -1;
+}
+
+/**
+ * Compute the tree hash (see tree_t) of the first len bytes of the file
+ * at the specified path with leaves of 2^shift bytes.
+ * Returns 0 on success, -1 if the file could not be read or is shorter.
+ */
+static int verify_tree(const char* path, offset_t len, unsigned int shift, unsigned char* buf, unsigned char digest[32])
+{
+	unsigned char leaf[32];
+	unsigned long long i;
+	offset_t pos, size = (offset_t)1 << shift;
+	input_t in;
+	tree_t tree;
+	int err = 0;
+
+	if (input_open(&in, path))
+		return -1;
+	memset(&tree, 0, sizeof(tree));
+	for (pos = 0, i = 0; pos < len && !err; pos += size, i++) {
+		err = tree_leaf(&in, pos, len - pos > size ? pos + size : len, buf, leaf);
+		if (!err && len - pos >= size)
+			tree_push(&tree, i, leaf);
+	}
+	tree_root(&tree, len & (size - 1) ? leaf : 0, digest);
+	return input_close(&in, path) == 0 && !err ? 0 : -1;
+}
+
+/**
+ * Verify the file of the item against its sig file or manifest entry.
+ * key keeps the RSA modulus of the last call of the thread.
+ * Returns 0 if it verifies, 1 if not.
+ */
+static int verify_file(const verify_item_t* item, unsigned char* buf, mont_t* key)
+{
+	char sig_path[MAX_PATH];
+	unsigned char digest[32], * sig = 0;
+	struct stat info;
+	metadata_t md;
+	tree_t tree;
+	offset_t size, hcl;
+	size_t len = 0;
+	FILE* fp;
+	int n, rc;
+
+	if (stat(item->path, &info)) {
+		log_err("'%s' missing", item->path);
+		return 1;
+	}
+	size = info.st_size;
+	if (item->listed) {
+		if ((unsigned long long)size != item->size) {
+			log_err("'%s' size %lld, %llu in manifest", item->path, (long long)size, item->size);
+			return 1;
+		}
+		if (verify_hash(item->path, (offset_t)item->size, buf, digest) || memcmp(digest, item->digest, sizeof(digest))) {
+			log_err("'%s' content differs from manifest", item->path);
+			return 1;
+		}
+		return 0;
 	}
 
-	/* Build associated sig file path (i.e. <path>/<filename><sig_ext>) */
-	n = snprintf(sig_path, sizeof(sig_path), "%s%s", path, sig_ext);
+	/* The signed content length, all of the file without metadata */
+	n = snprintf(sig_path, sizeof(sig_path), "%s%s", item->path, sig_ext);
 	if (n < 0 || n >= sizeof(sig_path)) {
-		log_err("error building sig file path '%s%s'", path, sig_ext);
-		return;
+		log_err("error building sig file path '%s%s'", item->path, sig_ext);
+		return 1;
+	}
+	/* A signature made without the signer has no metadata_t and signs all of the file */
+	md.ver = 0;
+	hcl = has_metadata(sig_path) && read_metadata_tree(sig_path, &md, 0, &tree) == 0
+		? (sizeof(hcl) == 4 ? md.cll : (offset_t)md.clh << 32 | md.cll) : size;
+	if (size < hcl) {
+		log_err("'%s' size %lld, %lld signed", item->path, (long long)size, (long long)hcl);
+		return 1;
+	}
+	if (size > hcl && !verify_prefix) {
+		log_err("'%s' appended since signing, %lld of %lld bytes signed", item->path, (long long)hcl, (long long)size);
+		return 1;
 	}
 
-	/* Try to open the sig file to see if one exists yet */
 	fp = fopen(sig_path, "rb");
-	err = errno;
+	if (fp && fstat(fileno(fp), &info) == 0) {
+		sig = (unsigned char*)malloc((size_t)info.st_size + 1);
+		if (sig)
+			len = fread(sig, 1, (size_t)info.st_size, fp);
+	}
 	if (fp)
 		fclose(fp);
+	if (!sig || len == 0) {
+		int e = errno;
+		log_err("error reading sig file '%s': %s", sig_path, strerror(e));
+		free(sig);
+		return 1;
+	}
+	if (md.ver == METADATA_VERSION_TREE ? tree.shift < 12 || tree.shift > 40
+		|| verify_tree(item->path, hcl, tree.shift, buf, digest) : verify_hash(item->path, hcl, buf, digest)) {
+		free(sig);
+		return 1;
+	}
+	rc = cms_verify(key, sig, len, digest);
+	free(sig);
 
-	if (!err) { /* Sig file found => figure out if we need to re-create it */
-		/* Read the metadata from the sig file */
-		metadata_t md;
-		err = read_metadata(sig_path, &md);
-		if (err) {
-			log_err("error reading metadata from sig file '%s'; will be re-created", sig_path);
+	switch (rc) {
+	case VERIFY_OK:
+		if (size > hcl)
+			log_inf("'%s' verified, %lld of %lld bytes signed", item->path, (long long)hcl, (long long)size);
+		break;
+	case VERIFY_FORMAT:
+		log_err("'%s' no signature of the expected form", sig_path);
+		break;
+	case VERIFY_DIGEST:
+		log_err("'%s' content differs from signature", item->path);
+		break;
+	case VERIFY_SIGNATURE:
+		log_err("'%s' signature not valid for the certificates of '%s'", item->path, sig_path);
+		break;
+	case VERIFY_ALGORITHM:
+		log_err("'%s' signature algorithm not supported", sig_path);
+		break;
+	}
+	return rc == VERIFY_OK ? 0 : 1;
+}
+
+/**
+ * Worker of the -V mode with option -j
+ */
+static THREAD_FUNC verify_worker(void* arg)
+{
+	verify_work_t* w = (verify_work_t*)arg;
+	unsigned char* buf = (unsigned char*)malloc(0x10000);
+	mont_t* key = (mont_t*)calloc(1, sizeof(mont_t));
+
+	if (!buf || !key) {
+		log_err("error allocating read buffer");
+		free(buf);
+		free(key);
+		return 0;
+	}
+
+	lock_enter(&w->lock);
+	for (;;) {
+		verify_item_t* item = w->head;
+		int failed;
+		if (!item) {
+			if (w->done)
+				break;
+			cond_wait(&w->cond, &w->lock);
+			continue;
+		}
+		w->head = item->next;
+		if (!w->head)
+			w->tail = 0;
+		w->queued--;
+		cond_broadcast(&w->cond);
+		lock_leave(&w->lock);
+
+		failed = verify_file(item, buf, key);
+		free(item);
+
+		lock_enter(&w->lock);
+		w->failed += failed;
+	}
+	lock_leave(&w->lock);
+
+	free(key);
+	free(buf);
+	return 0;
+}
+
+/**
+ * Verify the file of the item, or queue it for the workers of option
+ * -j. Takes ownership of the item. Returns the number of failures.
+ */
+static int verify_submit(verify_item_t* item)
+{
+	verify_work_t* w = verify_w;
+	int failed;
+
+	if (!w) {
+		failed = verify_file(item, verify_buf, &verify_key);
+		free(item);
+		return failed;
+	}
+	lock_enter(&w->lock);
+	while (w->queued >= w->max_queued)
+		cond_wait(&w->cond, &w->lock);
+	if (w->tail)
+		w->tail->next = item;
+	else
+		w->head = item;
+	w->tail = item;
+	w->queued++;
+	cond_broadcast(&w->cond);
+	lock_leave(&w->lock);
+	return 0;
+}
+
+/**
+ * Allocate the item of the file name in the directory at path, or of
+ * the file at path if name is 0. Returns 0 on error.
+ */
+static verify_item_t* verify_item(const char* path, const char* name)
+{
+	verify_item_t* item = (verify_item_t*)calloc(1, sizeof(verify_item_t));
+	int n;
+
+	if (!item) {
+		log_err("error allocating item of '%s'", path);
+		return 0;
+	}
+	n = name ? snprintf(item->path, sizeof(item->path), "%s/%s", path, name)
+		: snprintf(item->path, sizeof(item->path), "%s", path);
+	if (n < 0 || n >= sizeof(item->path)) {
+		log_err("error building entry path '%s/%s'", path, name ? name : "");
+		free(item);
+		return 0;
+	}
+	return item;
+}
+
+/**
+ * Verify the files of the directory at the specified path (option -V),
+ * then the subdirectories with option -r. The files of the manifest,
+ * if there is one, are checked against the signed manifest, the others
+ * against their sig files. A file of the manifest which is missing, of
+ * other size or content fails, files without signature are reported.
+ * A file path is verified against its sig file. Returns the number of
+ * failures found by the calling thread.
+ */
+static int verify_dir(const char* path)
+{
+	char mf_path[MAX_PATH], sig_path[MAX_PATH];
+	manifest_t mf;
+	subdirs_t subs;
+	DIR* dir;
+	struct dirent* entry;
+	struct stat info;
+	verify_item_t* item;
+	int i, n, dfd, failed = 0;
+
+	if (stat(path, &info) == 0 && S_ISREG(info.st_mode)) {
+		item = verify_item(path, 0);
+		return item ? verify_submit(item) : 1;
+	}
+
+	/* The manifest is verified first, then its files against the digests in it */
+	memset(&mf, 0, sizeof(mf));
+	memset(&subs, 0, sizeof(subs));
+	n = snprintf(mf_path, sizeof(mf_path), "%s/%s", path, MANIFEST_NAME);
+	if (n > 0 && n < sizeof(mf_path) && manifest_read(mf_path, &mf) == 0) {
+		item = verify_item(mf_path, 0);
+		if (!item || verify_file(item, verify_buf, &verify_key)) {
+			log_err("'%s' not signed by '%s%s'", mf_path, mf_path, sig_ext);
+			manifest_free(&mf);
+			failed++;
 		} else {
-			/* Figure out if we need to re-create the sig file */
-			offset_t hcl = sizeof(hcl) == 4 ? md.cll : (offset_t)md.clh << 32 | md.cll;
-			if (entry_info.st_size == hcl) {
-				/* Unmodified so skip */
-				log_inf("'%s' unmodified", path);
-				return;
-			} else if (entry_info.st_size < hcl) {
-				/* Shrunk so re-sign */
-				log_wrn("'%s' shrunk", path);
-				err = 1; /* force re-sign from beginning of file */
-			} else {
-				/* Modified so re-sign the file using the hash state saved in the metatdata */
-				log_inf("'%s' modified", path);
+			for (i = 0; i < mf.count; i++) {
+				verify_item_t* listed = verify_item(path, mf.entry[i].name);
+				if (!listed) {
+					failed++;
+					continue;
+				}
+				listed->listed = 1;
+				listed->size = mf.entry[i].size;
+				memcpy(listed->digest, mf.entry[i].digest, sizeof(listed->digest));
+				failed += verify_submit(listed);
 			}
+			log_inf("'%s' %d file(s)", mf_path, mf.count);
 		}
-		/* Create/re-create sig file */
-		sign(path, pin, label, err ? 0 : &md);
-	} else { /* No sig file found (or err reading it) => create/re-create */
+		free(item);
+	}
+
+	/* The other files, collect the subdirectories */
+	dir = opendir(path);
+	if (dir == NULL) {
 		int e = errno;
-		if (e == ENOENT) /* A sig file doesn't yet exist, assume file is new */
-			log_inf("'%s' not yet signed", path);
-		else /* Error accessing an existing sig file */
-			log_err("error accessing sig file '%s': %s; will be re-created", sig_path, strerror(e));
-		/* Create/re-create sig file */
-		sign(path, pin, label, 0);
+		log_err("error opening path '%s': %s", path, strerror(e));
+		manifest_free(&mf);
+		return failed + 1;
+	}
+	dfd = dir_fd(dir);
+	while ((entry = readdir(dir)) != NULL) {
+		if (!scan_entry(dfd, path, entry, &subs) || manifest_find(&mf, entry->d_name))
+			continue;
+		item = verify_item(path, entry->d_name);
+		if (!item) {
+			failed++;
+			continue;
+		}
+		n = snprintf(sig_path, sizeof(sig_path), "%s%s", item->path, sig_ext);
+		if (stat_at(dfd, entry->d_name, item->path, &info) || !S_ISREG(info.st_mode)) {
+			free(item);
+		} else if (n < 0 || n >= sizeof(sig_path) || stat(sig_path, &info)) {
+			if (mf.count)
+				log_wrn("'%s' not in manifest", item->path);
+			else
+				log_wrn("'%s' not signed", item->path);
+			free(item);
+		} else
+			failed += verify_submit(item);
+	}
+	closedir(dir);
+	manifest_free(&mf);
+
+	for (i = 0; i < subs.count; i++) {
+		n = snprintf(mf_path, sizeof(mf_path), "%s/%s", path, subs.name[i]);
+		if (n < 0 || n >= sizeof(mf_path))
+			log_err("error building entry path '%s/%s'", path, subs.name[i]);
+		else
+			failed += verify_dir(mf_path);
+		free(subs.name[i]);
+	}
+	free(subs.name);
+	return failed;
+}
+
+/*
+ * Watch mode (option -w): after the initial scan, the directories are
+ * watched for written, moved in and growing files (inotify on Linux,
+ * ReadDirectoryChangesW on Windows). A changed file is signed once no
+ * further change was seen for the debounce period, so a growing log is
+ * signed at a quiet point and a copied file only after it is complete.
+ *
+ * Resident mode (option -s): a spool directory is watched as well. Each
+ * request file moved (or written) into it lists files or directories to
+ * be signed, one path per line, and is deleted once processed. Writers
+ * should create the request under a hidden name (e.g. ".req.tmp") and
+ * rename it, hidden files are ignored. The token session and template
+ * stay open between the requests. Files failing because the token is
+ * missing are retried every WATCH_RETRY ms while the library reconnects.
+ */
+#define WATCH_RETRY 10000
+typedef struct
+{
+	char path[MAX_PATH];
+	unsigned long long due; /* ms of the monotonic clock */
+} watch_file_t;
+
+static watch_file_t* watch_file;
+static int watch_count, watch_capacity;
+static volatile int watch_stop;
+
+#ifdef _WIN32
+static BOOL WINAPI watch_signal(DWORD type)
+{
+	watch_stop = 1;
+	return TRUE;
+}
+#else
+static void watch_signal(int sig)
+{
+	watch_stop = 1;
+}
+#endif
+
+/**
+ * Keep serving the other instances (option -b) or the clients of the
+ * signing server (option -n) until SIGINT/SIGTERM
+ */
+static void watch_idle(const char* what)
+{
+#ifdef _WIN32
+	SetConsoleCtrlHandler(watch_signal, TRUE);
+	while (!watch_stop) {
+		metrics_tick();
+		Sleep(200);
+	}
+#else
+	signal(SIGINT, watch_signal);
+	signal(SIGTERM, watch_signal);
+	while (!watch_stop) {
+		metrics_tick();
+		usleep(200000);
 	}
+#endif
+	log_inf("%s stopped", what);
 }
 
 /**
- * Scan through the specified (directory) path and call sign_file on
- * each file that is not hidden nor a signature (.p7s).
- * The specified pin and label will be used for signing, if necessary.
+ * Queue the changed file with the specified name in the specified
+ * directory or postpone it, if already queued.
  */
-void sign_files(const char* path, const char* pin, const char* label)
+static void watch_queue_path(const char* path, unsigned long long due)
 {
-	int err;
-    DIR* dir;
-    struct dirent* entry;
-	const char* ext;
+	int i;
+
+	if (strlen(path) >= MAX_PATH)
+		return;
+	for (i = 0; i < watch_count; i++) {
+		if (strcmp(watch_file[i].path, path) == 0) {
+			watch_file[i].due = due;
+			return;
+		}
+	}
+	if (watch_count == watch_capacity) {
+		int capacity = watch_capacity ? 2 * watch_capacity : 64;
+		watch_file_t* file = (watch_file_t*)realloc(watch_file, capacity * sizeof(watch_file_t));
+		if (!file) {
+			log_err("error queuing '%s': out of memory", path);
+			return;
+		}
+		watch_file = file;
+		watch_capacity = capacity;
+	}
+	strcpy(watch_file[watch_count].path, path);
+	watch_file[watch_count++].due = due;
+}
+
+static void watch_queue(const char* dir, const char* name, unsigned long long due)
+{
+	int n;
+	char path[MAX_PATH];
+
+	if (skip_entry(name))
+		return;
+	n = snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (n < 0 || n >= sizeof(path)) {
+		log_err("error building entry path '%s/%s'", dir, name);
+		return;
+	}
+	watch_queue_path(path, due);
+}
+
+/**
+ * Sign the files and directories listed in the request file with the
+ * specified name in the spool directory, then delete the request.
+ */
+static void spool_request(const char* spool, const char* name, const char* pin, const char* label)
+{
+	char path[MAX_PATH], line[MAX_PATH + 2];
+	struct stat info;
+	FILE* fp;
+	int n;
 
-    /* Open directory stream */
-    dir = opendir(path);
-    if (dir == NULL) {
+	if (skip_entry(name))
+		return;
+	n = snprintf(path, sizeof(path), "%s/%s", spool, name);
+	if (n < 0 || n >= sizeof(path)) {
+		log_err("error building request path '%s/%s'", spool, name);
+		return;
+	}
+	fp = fopen(path, "rb");
+	if (!fp) {
 		int e = errno;
-		log_err("error opening path '%s': %s", path, strerror(e));
+		if (e != ENOENT) /* ENOENT is ok => already processed */
+			log_err("error opening request '%s': %s", path, strerror(e));
 		return;
 	}
+	log_inf("request '%s'", path);
+	while (fgets(line, sizeof(line), fp)) {
+		n = strlen(line);
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+			line[--n] = 0;
+		while (n > 0 && (line[n - 1] == '/' || line[n - 1] == '\\'))
+			line[--n] = 0;
+		if (n == 0)
+			continue;
+		if (stat(line, &info) == 0 && S_ISDIR(info.st_mode))
+			sign_files(line, pin, label);
+		else if (sign_file(line, pin, label) > 0) {
+			/* Token failure => retry later */
+			log_wrn("'%s' will be retried in %d s", line, WATCH_RETRY / 1000);
+			watch_queue_path(line, clock_ms() + WATCH_RETRY);
+		}
+	}
+	fclose(fp);
+	commit_flush();
+	if (remove(path)) {
+		int e = errno;
+		log_err("error deleting request '%s': %s", path, strerror(e));
+	}
+}
 
-	/* Loop through each entry in the specified path */
-    while ((entry = readdir(dir)) != NULL) {
-		int n;
-		char entry_path[MAX_PATH];
+/**
+ * Process the requests waiting in the spool directory
+ */
+static void spool_scan(const char* spool, const char* pin, const char* label)
+{
+	DIR* dir;
+	struct dirent* entry;
+	char (*name)[MAX_PATH] = 0;
+	int i, count = 0, capacity = 0;
 
-		/* Skip "./" "../" and hidden files that begin with '.' */
-		if (entry->d_name[0] == '.')
+	dir = opendir(spool);
+	if (dir == NULL) {
+		int e = errno;
+		log_err("error opening spool '%s': %s", spool, strerror(e));
+		return;
+	}
+	/* Collect the names first, the requests are deleted while processed */
+	while ((entry = readdir(dir)) != NULL) {
+		if (skip_entry(entry->d_name) || strlen(entry->d_name) >= MAX_PATH)
 			continue;
+		if (count == capacity) {
+			char (*tmp)[MAX_PATH];
+			capacity = capacity ? 2 * capacity : 16;
+			tmp = (char (*)[MAX_PATH])realloc(name, capacity * sizeof(*name));
+			if (!tmp)
+				break;
+			name = tmp;
+		}
+		strcpy(name[count++], entry->d_name);
+	}
+	closedir(dir);
+	for (i = 0; i < count; i++)
+		spool_request(spool, name[i], pin, label);
+	free(name);
+}
+
+/**
+ * Sign the queued files which are due (all files if flush is set)
+ * and write the metrics file when due (see metrics_tick).
+ * Returns the ms until the next file or the next metrics file is due
+ * or -1 if none.
+ */
+static long watch_sign(const char* pin, const char* label, int flush)
+{
+	unsigned long long now = clock_ms(), next = 0;
+	long wait;
+	int i;
+
+	for (i = 0; i < watch_count; ) {
+		if (flush || watch_file[i].due <= now) {
+			if (sign_file(watch_file[i].path, pin, label) > 0 && !flush) {
+				/* Token failure => retry later */
+				log_wrn("'%s' will be retried in %d s", watch_file[i].path, WATCH_RETRY / 1000);
+				watch_file[i].due = now + WATCH_RETRY;
+			} else {
+				watch_file[i] = watch_file[--watch_count];
+				continue;
+			}
+		}
+		if (!next || watch_file[i].due < next)
+			next = watch_file[i].due;
+		i++;
+	}
+	commit_flush();
+	wait = metrics_tick();
+	if (next && (wait < 0 || next - now < (unsigned long long)wait))
+		wait = (long)(next - now);
+	return wait;
+}
+
+/**
+ * Watch the specified directories and sign the changed files after
+ * the specified debounce period (seconds) and the requests of the
+ * specified spool directory (or 0) until SIGINT/SIGTERM
+ * (Ctrl-C/Ctrl-Break on Windows).
+ */
+static void watch_dirs(char** dirs, int count, const char* spool, const char* pin, const char* label, int debounce)
+{
+#ifdef _WIN32
+	HANDLE handle[MAXIMUM_WAIT_OBJECTS], event[MAXIMUM_WAIT_OBJECTS];
+	OVERLAPPED overlapped[MAXIMUM_WAIT_OBJECTS];
+	static DWORD buf[MAXIMUM_WAIT_OBJECTS][0x1000]; /* DWORD aligned FILE_NOTIFY_INFORMATION */
+	const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE;
+	const char* dir[MAXIMUM_WAIT_OBJECTS];
+	int i, n = 0, spool_n = -1;
 
-		/* Skip ".p7s" & ":p7s" files */
-		ext = strrchr(entry->d_name, '.');
-		if (ext && (strcmp(ext, ".p7s") == 0))
+	/* The spool directory is watched as the last one */
+	for (i = 0; i <= count && n < MAXIMUM_WAIT_OBJECTS; i++) {
+		struct stat info;
+		const char* path = i < count ? dirs[i] : spool;
+		if (!path || stat(path, &info) || !S_ISDIR(info.st_mode))
 			continue;
-		ext = strrchr(entry->d_name, ':');
-		if (ext && (strcmp(ext, ":p7s") == 0))
+		if (i == count)
+			spool_n = n;
+		handle[n] = CreateFile(path, FILE_LIST_DIRECTORY,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, 0);
+		if (handle[n] == INVALID_HANDLE_VALUE) {
+			log_err("error watching path '%s': %d", path, GetLastError());
+			spool_n = i == count ? -1 : spool_n;
+			continue;
+		}
+		event[n] = CreateEvent(0, TRUE, FALSE, 0);
+		memset(&overlapped[n], 0, sizeof(overlapped[n]));
+		overlapped[n].hEvent = event[n];
+		if (!event[n] || !ReadDirectoryChangesW(handle[n], buf[n], sizeof(buf[n]), FALSE, filter, 0, &overlapped[n], 0)) {
+			log_err("error watching path '%s': %d", path, GetLastError());
+			if (event[n])
+				CloseHandle(event[n]);
+			CloseHandle(handle[n]);
+			spool_n = i == count ? -1 : spool_n;
 			continue;
+		}
+		dir[n++] = path;
+	}
+	if (n == 0) {
+		log_err("no directory to watch");
+		return;
+	}
+	SetConsoleCtrlHandler(watch_signal, TRUE);
+	log_inf("watching %d directories, debounce %d s", n, debounce);
+	if (spool_n >= 0)
+		spool_scan(spool, pin, label);
 
-		/* Create the full path to the entry */
-		n = snprintf(entry_path, sizeof(entry_path),
-			"%s/%s", path, entry->d_name);
-		if (n < 0 || n >= sizeof(entry_path)) {
-			log_err("error building entry path '%s/%s'", path, entry->d_name);
+	while (!watch_stop) {
+		DWORD bytes, rc;
+		long wait = watch_sign(pin, label, 0);
+		/* wake up at least every second to notice a stop */
+		rc = WaitForMultipleObjects(n, event, FALSE, wait < 0 || wait > 1000 ? 1000 : wait);
+		if (rc == WAIT_TIMEOUT)
 			continue;
+		if (rc >= WAIT_OBJECT_0 + n) {
+			log_err("error waiting for changes: %d", GetLastError());
+			break;
+		}
+		i = rc - WAIT_OBJECT_0;
+		if (!GetOverlappedResult(handle[i], &overlapped[i], &bytes, FALSE) || bytes == 0) {
+			/* Buffer overflow, changes are lost => scan the whole directory */
+			log_wrn("changes in '%s' lost; scanning directory", dir[i]);
+			if (i == spool_n)
+				spool_scan(dir[i], pin, label);
+			else
+				sign_files(dir[i], pin, label);
+		} else {
+			FILE_NOTIFY_INFORMATION* fni = (FILE_NOTIFY_INFORMATION*)buf[i];
+			for (;;) {
+				if (fni->Action == FILE_ACTION_ADDED || fni->Action == FILE_ACTION_MODIFIED
+				|| fni->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+					char name[MAX_PATH];
+					int len = WideCharToMultiByte(CP_ACP, 0, fni->FileName, fni->FileNameLength / sizeof(WCHAR),
+						name, sizeof(name) - 1, 0, 0);
+					if (len > 0) {
+						name[len] = 0;
+						if (i == spool_n && fni->Action != FILE_ACTION_MODIFIED)
+							spool_request(dir[i], name, pin, label);
+						else if (i != spool_n)
+							watch_queue(dir[i], name, clock_ms() + debounce * 1000ull);
+					}
+				}
+				if (!fni->NextEntryOffset)
+					break;
+				fni = (FILE_NOTIFY_INFORMATION*)((char*)fni + fni->NextEntryOffset);
+			}
+		}
+		ResetEvent(event[i]);
+		if (!ReadDirectoryChangesW(handle[i], buf[i], sizeof(buf[i]), FALSE, filter, 0, &overlapped[i], 0)) {
+			log_err("error watching path '%s': %d", dir[i], GetLastError());
+			break;
 		}
+	}
 
-		/* Sign the file */
-		sign_file(entry_path, pin, label);
-    }
+	for (i = 0; i < n; i++) {
+		CancelIo(handle[i]);
+		CloseHandle(event[i]);
+		CloseHandle(handle[i]);
+	}
+#else
+	char buf[0x4000] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char** dir;
+	int i, n = 0, max_wd = 0, fd, spool_wd = -1;
 
-	/* Close the directory stream */
-    err = closedir(dir);
-	if (err) {
+	fd = inotify_init();
+	if (fd < 0) {
 		int e = errno;
-		log_err("error closing path '%s': %s", path, strerror(e));
+		log_err("error initializing inotify: %s", strerror(e));
+		return;
+	}
+	/* watch descriptors are small numbers, map them to the directories */
+	dir = (const char**)calloc(count + 1, sizeof(char*));
+	/* The spool directory is watched as the last one */
+	for (i = 0; dir && i <= count; i++) {
+		struct stat info;
+		const char* path = i < count ? dirs[i] : spool;
+		int wd;
+		if (!path || stat(path, &info) || !S_ISDIR(info.st_mode))
+			continue;
+		wd = inotify_add_watch(fd, path, i < count ? IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY : IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd < 0) {
+			int e = errno;
+			log_err("error watching path '%s': %s", path, strerror(e));
+			continue;
+		}
+		if (wd > max_wd) {
+			const char** tmp = (const char**)realloc(dir, (wd + 1) * sizeof(char*));
+			if (!tmp) {
+				inotify_rm_watch(fd, wd);
+				continue;
+			}
+			memset(tmp + max_wd + 1, 0, (wd - max_wd) * sizeof(char*));
+			dir = tmp;
+			max_wd = wd;
+		}
+		dir[wd] = path;
+		if (i == count)
+			spool_wd = wd;
+		n++;
+	}
+	if (n == 0) {
+		log_err("no directory to watch");
+		free(dir);
+		close(fd);
+		return;
+	}
+	signal(SIGINT, watch_signal);
+	signal(SIGTERM, watch_signal);
+	log_inf("watching %d directories, debounce %d s", n, debounce);
+	if (spool_wd >= 0)
+		spool_scan(spool, pin, label);
+
+	while (!watch_stop) {
+		struct pollfd pfd;
+		long wait = watch_sign(pin, label, 0);
+		int rc, len;
+		char* p;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		rc = poll(&pfd, 1, wait < 0 ? -1 : (int)wait);
+		if (rc < 0 && errno != EINTR) {
+			int e = errno;
+			log_err("error waiting for changes: %s", strerror(e));
+			break;
+		}
+		if (rc <= 0)
+			continue;
+		len = (int)read(fd, buf, sizeof(buf));
+		for (p = buf; len > 0 && p < buf + len; ) {
+			struct inotify_event* ev = (struct inotify_event*)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* Changes are lost => scan all directories */
+				log_wrn("changes lost; scanning directories");
+				for (i = 0; i <= max_wd; i++)
+					if (i == spool_wd)
+						spool_scan(dir[i], pin, label);
+					else if (dir[i])
+						sign_files(dir[i], pin, label);
+			} else if (ev->len && !(ev->mask & IN_ISDIR) && ev->wd == spool_wd) {
+				spool_request(dir[ev->wd], ev->name, pin, label);
+			} else if (ev->len && !(ev->mask & IN_ISDIR) && ev->wd <= max_wd && dir[ev->wd]) {
+				watch_queue(dir[ev->wd], ev->name, clock_ms() + debounce * 1000ull);
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
 	}
 
+	free(dir);
+	close(fd);
+#endif
+	/* Sign the files changed before the stop */
+	watch_sign(pin, label, 1);
+	free(watch_file);
+	watch_file = 0;
+	watch_count = watch_capacity = 0;
+	log_inf("watch stopped");
 }
 
-int main(int argc, char** argv)
+static int usage()
 {
-	int i, usealt;
-	const char * pin, * label;
+	fprintf(stderr, "Usage: [-l level] [-a] [-c cache-dir] [-j threads] [-i io] [-o order] [-T size] [-b] [-r] [-x] [-d | -D digest-file] [-w seconds] [-s spool-dir] [-m metrics-file] [-N host:port -k key-file] pin label path...\n");
+	fprintf(stderr, "       [options] -f rules-file pin path...\n");
+	fprintf(stderr, "       [-a] [-c cache-dir] [-r] [-m metrics-file] [-N host:port -k key-file] -M pin label path...\n");
+	fprintf(stderr, "       [-a] [-r] [-j threads] [-i io] [-p] -V path...\n");
+	fprintf(stderr, "       [-m metrics-file] -n [addr:]port -k key-file pin\n");
+	fprintf(stderr, "Signs the specified file(s) and/or files within the specified directory(ies).\n");
+	fprintf(stderr, "  -l  log 'error', 'warning' or 'info' (default) messages and above\n");
+	fprintf(stderr, "  -a  use :p7s instead of .p7s extension (alternate data stream on Windows)\n");
+	fprintf(stderr, "  -c  keep the token templates in cache-dir to speed up the next start\n");
+	fprintf(stderr, "  -j  hash and write the files of a directory in threads, one thread signs\n");
+	fprintf(stderr, "  -w  keep watching the directories, sign changed files after 'seconds' without change\n");
+	fprintf(stderr, "  -s  keep running and sign the paths listed in the request files of spool-dir\n");
+	fprintf(stderr, "  -r  sign the files in the subdirectories of the directories as well\n");
+	fprintf(stderr, "  -o  sign the files of a directory 'newest', 'oldest' or 'smallest' first\n");
+	fprintf(stderr, "  -T  sign files of at least 'size' MiB with a tree hash of 4 MiB leaves,\n");
+	fprintf(stderr, "      hashed on all cores (or -j threads); not verifiable as plain CMS\n");
 #ifdef CTAPI
-	void* mutex;
+	fprintf(stderr, "  -b  keep running and sign for the other instances (token broker)\n");
+#endif
+	fprintf(stderr, "  -f  sign with the key labels of the 'path-glob label' lines of rules-file\n");
+	fprintf(stderr, "  -M  sign one manifest of the file digests per directory (%s)\n", MANIFEST_NAME);
+	fprintf(stderr, "  -V  verify the files against their sig files or manifests, without token\n");
+	fprintf(stderr, "  -p  with -V, accept files appended since signing, verify the signed part\n");
+	fprintf(stderr, "  -m  write the run metrics to metrics-file (JSON, Prometheus text if *.prom)\n");
+	fprintf(stderr, "  -x  keep an index of the signed files in each directory (%s)\n", INDEX_NAME);
+	fprintf(stderr, "  -d  reuse the hash of hard links and the signature of copies of signed files\n");
+	fprintf(stderr, "  -D  like -d, remembers the signed files in digest-file for the next runs\n");
+	fprintf(stderr, "  -n  keep running and sign the hashes of the -N clients with the local tokens\n");
+	fprintf(stderr, "  -N  sign on the server host:port of option -n instead of the local token\n");
+	fprintf(stderr, "  -k  key shared by the signing server and its clients\n");
+#ifdef HAVE_INPUT_HINTS
+	fprintf(stderr, "  -i  read the files with 'stdio' (default), 'fadvise' (large reads, no\n");
+	fprintf(stderr, "      page cache pollution), 'mmap' (hash mapped pages) or 'direct' (O_DIRECT)\n");
 #endif
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	int i, first, usealt = 0, threads = 0, debounce = -1, broker = 0, dev_count = 0;
+	device_t* devs = 0;
+	const char * pin, * label = 0, * cache_dir = 0, * spool = 0, * rules_file = 0, * digest_file = 0;
+	const char * net_spec = 0, * key_file = 0;
+	int use_digests = 0, manifest = 0, verify = 0, rc = 0;
 
 	/* Check args */
-	if (argc < 4) {
-		fprintf(stderr, "Usage: [-a] pin label path...\n");
-		fprintf(stderr, "Signs the specified file(s) and/or files within the specified directory(ies).\n");
-		fprintf(stderr, "  -a  use :p7s instead of .p7s extension (alternate data stream on Windows)\n");
-		return 1;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-a") == 0)
+			usealt = 1;
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			cache_dir = argv[++i];
+		else if (strcmp(argv[i], "-x") == 0)
+			use_index = 1;
+		else if (strcmp(argv[i], "-d") == 0)
+			use_digests = 1;
+		else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc) {
+			digest_file = argv[++i];
+			use_digests = 1;
+		}
+		else if (strcmp(argv[i], "-r") == 0)
+			recursive = 1;
+		else if (strcmp(argv[i], "-M") == 0)
+			manifest = 1;
+		else if (strcmp(argv[i], "-V") == 0)
+			verify = 1;
+		else if (strcmp(argv[i], "-p") == 0)
+			verify_prefix = 1;
+#ifdef CTAPI
+		else if (strcmp(argv[i], "-b") == 0)
+			broker = 1;
+#endif
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			spool = argv[++i];
+		else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			rules_file = argv[++i];
+		else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			metrics_path = argv[++i];
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			net_spec = argv[++i];
+		else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc)
+			net_server = argv[++i];
+		else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+			key_file = argv[++i];
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			debounce = atoi(argv[++i]);
+			if (debounce < 0)
+				return usage();
+		}
+		else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			const char* level = argv[++i];
+			if (strcmp(level, "error") == 0)
+				log_level = LOG_LEVEL_ERR;
+			else if (strcmp(level, "warning") == 0)
+				log_level = LOG_LEVEL_WRN;
+			else if (strcmp(level, "info") == 0)
+				log_level = LOG_LEVEL_INF;
+			else
+				return usage();
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			const char* order = argv[++i];
+			if (strcmp(order, "newest") == 0)
+				sign_order = ORDER_NEWEST;
+			else if (strcmp(order, "oldest") == 0)
+				sign_order = ORDER_OLDEST;
+			else if (strcmp(order, "smallest") == 0)
+				sign_order = ORDER_SMALLEST;
+			else
+				return usage();
+		}
+		else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+			tree_min = (offset_t)atoi(argv[++i]) << 20;
+			if (tree_min <= 0)
+				return usage();
+		}
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+			if (threads <= 0 || threads > MAX_THREADS)
+				return usage();
+		}
+#ifdef HAVE_INPUT_HINTS
+		else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			const char* io = argv[++i];
+			if (strcmp(io, "stdio") == 0)
+				io_mode = IO_STDIO;
+			else if (strcmp(io, "fadvise") == 0)
+				io_mode = IO_FADVISE;
+			else if (strcmp(io, "mmap") == 0)
+				io_mode = IO_MMAP;
+			else if (strcmp(io, "direct") == 0)
+				io_mode = IO_DIRECT;
+			else
+				return usage();
+		}
+#endif
+		else
+			return usage();
+	}
+
+	/* Verify the signatures and manifests of the paths, no token needed */
+	if (verify_prefix && !verify)
+		return usage();
+	if (verify) {
+		verify_work_t w;
+		thread_t thread[MAX_THREADS];
+		int started = 0;
+
+		if (i == argc || manifest || rules_file || spool || debounce >= 0 || broker || net_spec || net_server)
+			return usage();
+		sig_ext = !usealt ? ".p7s"  : ":p7s";
+		setvbuf(stdout, NULL, _IONBF, 0);
+		setvbuf(stderr, NULL, _IONBF, 0);
+		log_start();
+		memset(&w, 0, sizeof(w));
+		if (threads) {
+			w.max_queued = 4 * threads;
+			lock_init(&w.lock);
+			cond_init(&w.cond);
+			for (; started < threads; started++)
+				if (thread_create(&thread[started], verify_worker, &w)) {
+					log_err("error creating worker thread %d", started);
+					break;
+				}
+			if (started)
+				verify_w = &w;
+		}
+		for (; i < argc; i++) {
+			char* path = argv[i];
+			int j = strlen(path);
+			while (--j >= 0 && (path[j] == '/' || path[j] == '\\'))
+				path[j] = 0;
+			rc += verify_dir(path);
+		}
+		if (threads) {
+			lock_enter(&w.lock);
+			w.done = 1;
+			cond_broadcast(&w.cond);
+			lock_leave(&w.lock);
+			while (started > 0)
+				thread_join(thread[--started]);
+			cond_destroy(&w.cond);
+			lock_destroy(&w.lock);
+			rc += w.failed;
+		}
+		log_inf("%d failure(s)", rc);
+		return rc ? 1 : 0;
 	}
-	usealt  = strcmp(argv[1], "-a") == 0;
-	pin     = !usealt ? argv[1] : argv[2];
-	label   = !usealt ? argv[2] : argv[3];
+	/* A manifest covers a directory, i.e. one label and one pass */
+	if (manifest && (threads || rules_file || spool || debounce >= 0 || broker || net_spec))
+		return usage();
+	if (argc - i < (spool || broker ? 1 : 2) + !rules_file && !net_spec)
+		return usage();
+	/* The server signs for the clients only */
+	if (net_spec && (argc - i != 1 || net_server || rules_file || spool || debounce >= 0 || broker))
+		return usage();
+	if ((net_spec || net_server) && !key_file)
+		return usage();
+	pin     = argv[i++];
+	if (!rules_file)
+		label = argv[i++];
+	else if (load_rules(rules_file))
+		return 1;
 	sig_ext = !usealt ? ".p7s"  : ":p7s";
+	metrics_start = metrics_last = metrics_now();
+	if (tree_min)
+		tree_threads = threads ? threads : cpu_count();
+	if (use_index)
+		lock_init(&index_lock);
+	lock_init(&commit_lock);
+	lock_init(&token_lock);
+	if (use_digests) {
+		lock_init(&digest_lock);
+		digests = digest_open(digest_file);
+		if (!digests)
+			log_wrn("error allocating digest cache; signing without");
+	}
+
+	if ((net_spec || net_server) && (net_load_key(key_file) || net_init()))
+		return 1;
+
+	if (cache_dir && set_template_cache_dir(cache_dir) < 0) {
+		log_err("error setting template cache directory '%s'", cache_dir);
+		return 1;
+	}
 
 	/* Disable buffering on stdout/stderr to prevent mixing the order of
-	   messages to stdout/stderr when redirected to the same log file */
+	   messages to stdout/stderr when redirected to the same log file.
+	   The log lines of both go through the queue of one writer thread,
+	   which writes the queued lines of a stream with one call (see log.c) */
 	setvbuf(stdout, NULL, _IONBF, 0);
 	setvbuf(stderr, NULL, _IONBF, 0);
+	if (log_start())
+		log_wrn("error starting the log writer; logging directly");
 
 	/* Log the args */
-	log_inf("pin=****; label='%s'", label);
+	if (rules_file)
+		log_inf("pin=****; rules='%s' (%d)", rules_file, rule_count);
+	else
+		log_inf("pin=****; label='%s'", label);
 
 #ifdef CTAPI
 	/* Create a mutex/sem/lock for controlling access to token.
-	   CTAPI implementations must NOT allow simultaneous access to token. */
-	mutex = create_lock(MUTEX_KEY);
-	if ((int)mutex < 0) {
+	   CTAPI implementations must NOT allow simultaneous access to token.
+	   If another instance owns the token, sign through it (see broker.h).
+	   The pools of the signing server open the token themselves, the
+	   clients of a signing server need no token. */
+	if (net_spec) {
+		broker_mutex = create_lock(MUTEX_KEY);
+		if ((int)(size_t)broker_mutex < 0) {
+			log_err("the token is owned by another instance");
+			return -1;
+		}
+	} else if (!net_server && broker_open(pin)) {
 		log_wrn(
 			"couldn't create mutex; another inst. of '%s' is likely running", argv[0]);
 		return -1;
 	}
+	if (broker && (int)(size_t)broker_mutex < 0) {
+		log_err("the token is owned by another instance");
+		broker_close();
+		return -1;
+	}
 #endif
 
 	/* For each path arg, sign either the specified file
-	   or all the files in the specified directory */
-	for (i = !usealt ? 3 : 4; i < argc; i++) {
+	   or all the files in the specified directory; with -j the
+	   paths are grouped by device and signed afterwards */
+	if (threads && i < argc) {
+		devs = (device_t*)calloc(argc - i, sizeof(device_t));
+		if (!devs)
+			log_wrn("error allocating devices; signing the paths one after the other");
+	}
+	for (first = i; i < argc; i++) {
 		int err;
 		struct stat info;
 		char* path = argv[i];
@@ -479,22 +3756,66 @@ int main(int argc, char** argv)
 			continue;
 		}
 
+		if (devs && device_add(devs, &dev_count, path, &info, argc - first))
+			continue;
 		if (S_ISDIR(info.st_mode)) /* DIRECTORY */
-			sign_files(path, pin, label); /* Sign all files in the specified directory */
+			if (manifest)
+				sign_manifest(path, pin, label); /* Sign the manifest of the files in the specified directory */
+			else if (threads) {
+				device_t dev;
+				memset(&dev, 0, sizeof(dev));
+				dev.threads = dev.readers = threads;
+				sign_files_parallel(path, pin, label, &dev); /* Sign all files in the specified directory */
+			} else
+				sign_files(path, pin, label); /* Sign all files in the specified directory */
 		else /* FILE */
 			sign_file(path, pin, label);  /* Sign the specified file */
 	}
+	if (devs) {
+		sign_devices(devs, dev_count, pin, label, threads);
+		free(devs);
+	}
+	commit_flush();
+
+	/* Sign the files of the directories as they change */
+	if (debounce >= 0 || spool)
+		watch_dirs(argv + first, argc - first, spool, pin, label, debounce >= 0 ? debounce : 0);
+	else if (net_spec) {
+		if (net_serve(net_spec, pin) == 0)
+			watch_idle("server");
+		else
+			rc = 1;
+	}
+#ifdef CTAPI
+	else if (broker)
+		watch_idle("broker");
+#endif
 
 	/* Clean up */
+	net_stop();
+	net_close();
+#ifdef CTAPI
+	if (!net_spec)
+		broker_stop();
+#endif
+	metrics_write();
 	release_template();
+	if (use_index)
+		lock_destroy(&index_lock);
+	lock_destroy(&commit_lock);
+	lock_destroy(&token_lock);
+	if (use_digests) {
+		digest_close(digests);
+		lock_destroy(&digest_lock);
+	}
 
 #ifdef CTAPI
 	/* Release mutex/sem/lock here. */
-	release_lock(mutex);
+	broker_close();
 #endif
 
 #if defined(_WIN32) && defined(DEBUG)
 	_CrtDumpMemoryLeaks();
 #endif
-	return 0;
+	return rc;
 }
@@ -32,6 +32,9 @@
 # ./sc-hsm-ultralite-signer 123456 sign0 d:\data\2013-10\xxxx-2013-10-01.dat
 # ./sc-hsm-ultralite-signer 123456 sign0 d:\data\2013-10\xxxx-2013-10-01.log
 # ./sc-hsm-ultralite-signer 123456 sign0 d:\data\2013-09\xxxx-2013-09-30.dat
+#
+# Set CACHE_DIR (e.g. /var/cache/sc-hsm-ultralite) to let the signer keep
+# the token templates on disk between runs (option -c).
 
 # Verify arg count
 if [[ $# -ne 3 ]]; then
@@ -44,6 +47,7 @@ EXE=${0%.*} # strip extension
 PIN=${1}
 LABEL=${2}
 BASE_PATH=${3%/} # strip trailing '/'
+OPTS=${CACHE_DIR:+-c ${CACHE_DIR}}
 
 # Calculate path to current & previous month folder in format "YYYY-mm"
     CUR_DAY=$(date                            +%Y-%m-%d)
@@ -53,11 +57,11 @@ PRV_DAY_MTH=$(date --date="${PRV_DAY}"        +%Y-%m)
 
 # Run sc-hsm-ultralite-signer
 # if [ -d ${BASE_PATH} ]; then
-#    find ${BASE_PATH} -maxdepth 1 -type f \( -name \*${CUR_DAY}\* \! -name \*.p7s -or -name \*${PRV_DAY}\* \! -name \*.p7s \) -exec ${EXE} ${PIN} ${LABEL} '{}' ';'
+#    find ${BASE_PATH} -maxdepth 1 -type f \( -name \*${CUR_DAY}\* \! -name \*.p7s -or -name \*${PRV_DAY}\* \! -name \*.p7s \) -exec ${EXE} ${OPTS} ${PIN} ${LABEL} '{}' ';'
 # fi
 if [ -d ${BASE_PATH}/${CUR_DAY_MTH} ]; then
-    find ${BASE_PATH}/${CUR_DAY_MTH} -maxdepth 1 -type f \( -name \*${CUR_DAY}\* \! -name \*.p7s \) -exec ${EXE} ${PIN} ${LABEL} '{}' ';'
+    find ${BASE_PATH}/${CUR_DAY_MTH} -maxdepth 1 -type f \( -name \*${CUR_DAY}\* \! -name \*.p7s \) -exec ${EXE} ${OPTS} ${PIN} ${LABEL} '{}' ';'
 fi
 if [ -d ${BASE_PATH}/${PRV_DAY_MTH} ]; then
-    find ${BASE_PATH}/${PRV_DAY_MTH} -maxdepth 1 -type f \( -name \*${PRV_DAY}\* \! -name \*.p7s \) -exec ${EXE} ${PIN} ${LABEL} '{}' ';'
+    find ${BASE_PATH}/${PRV_DAY_MTH} -maxdepth 1 -type f \( -name \*${PRV_DAY}\* \! -name \*.p7s \) -exec ${EXE} ${OPTS} ${PIN} ${LABEL} '{}' ';'
 fi
@@ -0,0 +1,636 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Signer Application
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file verify.h
+ */
+
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include <string.h>
+#include <ultralite/sc-hsm-ultralite.h>
+
+/*
+ * Check of a sig file without token (option -V): the CMS document of
+ * the template (SignedData with one SignerInfo and the certificates)
+ * is parsed, the messageDigest attribute compared with the SHA-256 of
+ * the file and the signature of the signed attributes checked with the
+ * public key of the certificates in the document: RSA (PKCS#1 v1.5,
+ * up to 4096 bit) or ECDSA on P-256, the keys of the SmartCard-HSM
+ * templates signing SHA-256 hashes. The certificates themselves (chain,
+ * validity, revocation) are not checked.
+ */
+#define VERIFY_OK          0
+#define VERIFY_FORMAT     -1 /* not a SignedData of the expected form */
+#define VERIFY_DIGEST     -2 /* messageDigest differs from the content */
+#define VERIFY_SIGNATURE  -3 /* no certificate verifies the signature */
+#define VERIFY_ALGORITHM  -4 /* digest or key of other algorithm */
+
+/* ASN.1 tags and object identifiers (DER content octets) */
+#define DER_INTEGER    0x02
+#define DER_BIT_STRING 0x03
+#define DER_OCTET      0x04
+#define DER_OID        0x06
+#define DER_SEQUENCE   0x30
+#define DER_SET        0x31
+#define DER_CONTEXT_0  0xA0
+#define DER_CONTEXT_1  0xA1
+
+static const unsigned char oid_sha256[]         = { 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01 };
+static const unsigned char oid_message_digest[] = { 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x09, 0x04 };
+static const unsigned char oid_rsa[]            = { 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x01 };
+static const unsigned char oid_ec_public_key[]  = { 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01 };
+static const unsigned char oid_prime256v1[]     = { 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07 };
+
+/**
+ * Element of DER encoded data
+ */
+typedef struct
+{
+	int tag;
+	const unsigned char* beg; /* first octet of the element */
+	const unsigned char* val; /* content octets */
+	size_t len;               /* number of content octets */
+	const unsigned char* end; /* first octet after the element */
+} der_t;
+
+/**
+ * Decode the element at p (before end) into e.
+ * Returns 0 on success, -1 if it is malformed or exceeds end.
+ */
+static int der_get(const unsigned char* p, const unsigned char* end, der_t* e)
+{
+	size_t len;
+	int n;
+
+	if (!p || end - p < 2)
+		return -1;
+	e->beg = p;
+	e->tag = *p++;
+	len = *p++;
+	if (len & 0x80) {
+		n = (int)(len & 0x7F);
+		if (n == 0 || n > 4 || end - p < n)
+			return -1;
+		for (len = 0; n > 0; n--)
+			len = len << 8 | *p++;
+	}
+	if ((size_t)(end - p) < len)
+		return -1;
+	e->val = p;
+	e->len = len;
+	e->end = p + len;
+	return 0;
+}
+
+/* Decode the first element in the content of parent, expecting the tag */
+static int der_first(const der_t* parent, int tag, der_t* e)
+{
+	return der_get(parent->val, parent->end, e) || e->tag != tag ? -1 : 0;
+}
+
+/* Decode the element after prev (in the content of parent), expecting the tag */
+static int der_next(const der_t* parent, const der_t* prev, int tag, der_t* e)
+{
+	return der_get(prev->end, parent->end, e) || e->tag != tag ? -1 : 0;
+}
+
+static int der_is_oid(const der_t* e, const unsigned char* oid, size_t len)
+{
+	return e->tag == DER_OID && e->len == len && memcmp(e->val, oid, len) == 0;
+}
+
+/* The OID of the AlgorithmIdentifier e is oid */
+static int der_algorithm(const der_t* e, const unsigned char* oid, size_t len)
+{
+	der_t o;
+	return e->tag == DER_SEQUENCE && der_first(e, DER_OID, &o) == 0 && der_is_oid(&o, oid, len);
+}
+
+/*
+ * Big numbers for the public key operations, at most 4096 bit in
+ * 32-bit words, least significant first. The arithmetic is done in
+ * the Montgomery form of an odd modulus.
+ */
+#define BN_WORDS 128
+
+typedef struct
+{
+	unsigned int w[BN_WORDS];
+} bn_t;
+
+typedef struct
+{
+	bn_t m;          /* modulus */
+	int n;           /* words of the modulus */
+	unsigned int k;  /* -m^-1 mod 2^32 */
+	bn_t rr;         /* R^2 mod m, R = 2^(32 n) */
+} mont_t;
+
+/**
+ * Set a to the big-endian unsigned number of len octets, in n words.
+ * Returns 0 on success, -1 if the number does not fit.
+ */
+static int bn_read(bn_t* a, const unsigned char* p, size_t len, int n)
+{
+	size_t i;
+	while (len > 0 && *p == 0) {
+		p++;
+		len--;
+	}
+	if (len > (size_t)n * 4)
+		return -1;
+	memset(a, 0, sizeof(*a));
+	for (i = 0; i < len; i++)
+		a->w[i / 4] |= (unsigned int)p[len - 1 - i] << (8 * (i % 4));
+	return 0;
+}
+
+/* Write the n words of a to len octets, big-endian */
+static void bn_write(const bn_t* a, int n, unsigned char* p, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		p[len - 1 - i] = i / 4 < (size_t)n ? (unsigned char)(a->w[i / 4] >> (8 * (i % 4))) : 0;
+}
+
+static int bn_cmp(const bn_t* a, const bn_t* b, int n)
+{
+	while (--n >= 0)
+		if (a->w[n] != b->w[n])
+			return a->w[n] < b->w[n] ? -1 : 1;
+	return 0;
+}
+
+static int bn_is_zero(const bn_t* a, int n)
+{
+	while (--n >= 0)
+		if (a->w[n])
+			return 0;
+	return 1;
+}
+
+/* r = a - b, returns the borrow */
+static unsigned int bn_sub(bn_t* r, const bn_t* a, const bn_t* b, int n)
+{
+	unsigned long long t, borrow = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		t = (unsigned long long)a->w[i] - b->w[i] - borrow;
+		r->w[i] = (unsigned int)t;
+		borrow = (t >> 32) & 1;
+	}
+	return (unsigned int)borrow;
+}
+
+/* r = a + b, returns the carry */
+static unsigned int bn_add(bn_t* r, const bn_t* a, const bn_t* b, int n)
+{
+	unsigned long long t = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		t += (unsigned long long)a->w[i] + b->w[i];
+		r->w[i] = (unsigned int)t;
+		t >>= 32;
+	}
+	return (unsigned int)t;
+}
+
+/* r = a + b mod m for a, b < m */
+static void mod_add(const mont_t* mt, bn_t* r, const bn_t* a, const bn_t* b)
+{
+	if (bn_add(r, a, b, mt->n) || bn_cmp(r, &mt->m, mt->n) >= 0)
+		bn_sub(r, r, &mt->m, mt->n);
+}
+
+/* r = a - b mod m for a, b < m */
+static void mod_sub(const mont_t* mt, bn_t* r, const bn_t* a, const bn_t* b)
+{
+	if (bn_sub(r, a, b, mt->n))
+		bn_add(r, r, &mt->m, mt->n);
+}
+
+/* r = a b R^-1 mod m for a, b < m (CIOS), r may be a or b */
+static void mont_mul(const mont_t* mt, bn_t* r, const bn_t* a, const bn_t* b)
+{
+	unsigned int t[BN_WORDS + 2];
+	unsigned long long c;
+	unsigned int q;
+	int i, j, n = mt->n;
+	bn_t s;
+
+	memset(t, 0, (n + 2) * sizeof(t[0]));
+	for (i = 0; i < n; i++) {
+		c = 0;
+		for (j = 0; j < n; j++) {
+			c += t[j] + (unsigned long long)a->w[j] * b->w[i];
+			t[j] = (unsigned int)c;
+			c >>= 32;
+		}
+		c += t[n];
+		t[n] = (unsigned int)c;
+		t[n + 1] = (unsigned int)(c >> 32);
+		q = t[0] * mt->k;
+		c = (t[0] + (unsigned long long)q * mt->m.w[0]) >> 32;
+		for (j = 1; j < n; j++) {
+			c += t[j] + (unsigned long long)q * mt->m.w[j];
+			t[j - 1] = (unsigned int)c;
+			c >>= 32;
+		}
+		c += t[n];
+		t[n - 1] = (unsigned int)c;
+		t[n] = t[n + 1] + (unsigned int)(c >> 32);
+	}
+	memcpy(s.w, t, n * sizeof(t[0]));
+	if (t[n] || bn_cmp(&s, &mt->m, n) >= 0)
+		bn_sub(&s, &s, &mt->m, n);
+	memcpy(r->w, s.w, n * sizeof(s.w[0]));
+}
+
+/**
+ * Prepare the Montgomery arithmetic for the odd modulus of len octets.
+ * Returns 0 on success, -1 if the modulus is even or too large.
+ */
+static int mont_init(mont_t* mt, const unsigned char* p, size_t len)
+{
+	unsigned int k = 1;
+	int i, n;
+
+	while (len > 0 && *p == 0) {
+		p++;
+		len--;
+	}
+	n = (int)((len + 3) / 4);
+	if (n == 0 || n > BN_WORDS || bn_read(&mt->m, p, len, n) || !(mt->m.w[0] & 1))
+		return -1;
+	mt->n = n;
+	for (i = 0; i < 5; i++) /* Newton iteration for m^-1 mod 2^32 */
+		k *= 2 - mt->m.w[0] * k;
+	mt->k = 0 - k;
+	/* R^2 mod m by doubling 1 for 2 * 32 n times */
+	memset(&mt->rr, 0, sizeof(mt->rr));
+	mt->rr.w[0] = 1;
+	for (i = 0; i < 64 * n; i++)
+		mod_add(mt, &mt->rr, &mt->rr, &mt->rr);
+	return 0;
+}
+
+/* r = a b mod m for a, b < m */
+static void mod_mul(const mont_t* mt, bn_t* r, const bn_t* a, const bn_t* b)
+{
+	mont_mul(mt, r, a, b);
+	mont_mul(mt, r, r, &mt->rr);
+}
+
+/* r = a^e mod m for a < m, e of len octets (big-endian) */
+static void mod_exp(const mont_t* mt, bn_t* r, const bn_t* a, const unsigned char* e, size_t len)
+{
+	bn_t x, one;
+	size_t i;
+	int bit;
+
+	memset(&one, 0, sizeof(one));
+	one.w[0] = 1;
+	mont_mul(mt, &x, a, &mt->rr);   /* a R */
+	mont_mul(mt, r, &one, &mt->rr); /* R */
+	for (i = 0; i < len; i++)
+		for (bit = 7; bit >= 0; bit--) {
+			mont_mul(mt, r, r, r);
+			if (e[i] >> bit & 1)
+				mont_mul(mt, r, r, &x);
+		}
+	mont_mul(mt, r, r, &one);
+}
+
+/*
+ * RSA signature (PKCS#1 v1.5) of the SHA-256 hash with the public key
+ * of modulus and exponent, returns 0 if it verifies. The arithmetic of
+ * the modulus in mt is reused if it is the same as for the last call.
+ */
+static int rsa_verify(mont_t* mt, const der_t* modulus, const der_t* exponent,
+	const unsigned char* sig, size_t sig_len, const unsigned char hash[32])
+{
+	static const unsigned char digest_info[] = { /* DigestInfo of SHA-256 */
+		0x30, 0x31, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20
+	};
+	unsigned char em[BN_WORDS * 4];
+	size_t k, i;
+	bn_t s, m;
+
+	if ((mt->n == 0 || bn_read(&m, modulus->val, modulus->len, mt->n) || bn_cmp(&m, &mt->m, mt->n))
+		&& mont_init(mt, modulus->val, modulus->len)) {
+		mt->n = 0;
+		return -1;
+	}
+	k = (size_t)(mt->n * 4);
+	while (k > 0 && (mt->m.w[(k - 1) / 4] >> (8 * ((k - 1) % 4)) & 0xFF) == 0) /* octets of the modulus */
+		k--;
+	if (sig_len > k || bn_read(&s, sig, sig_len, mt->n) || bn_cmp(&s, &mt->m, mt->n) >= 0
+		|| k < sizeof(digest_info) + 32 + 11)
+		return -1;
+	mod_exp(mt, &m, &s, exponent->val, exponent->len);
+	bn_write(&m, mt->n, em, k);
+	/* EM = 00 01 FF .. FF 00 DigestInfo hash */
+	if (em[0] != 0x00 || em[1] != 0x01)
+		return -1;
+	for (i = 2; i < k - sizeof(digest_info) - 33; i++)
+		if (em[i] != 0xFF)
+			return -1;
+	return em[i] == 0 && memcmp(em + i + 1, digest_info, sizeof(digest_info)) == 0
+		&& memcmp(em + k - 32, hash, 32) == 0 ? 0 : -1;
+}
+
+/*
+ * P-256 with Jacobian coordinates in the Montgomery form of p, for the
+ * verification only (no side channel protection needed)
+ */
+static const unsigned char p256_p[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+static const unsigned char p256_n[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xBC, 0xE6, 0xFA, 0xAD, 0xA7, 0x17, 0x9E, 0x84, 0xF3, 0xB9, 0xCA, 0xC2, 0xFC, 0x63, 0x25, 0x51
+};
+static const unsigned char p256_gx[] = {
+	0x6B, 0x17, 0xD1, 0xF2, 0xE1, 0x2C, 0x42, 0x47, 0xF8, 0xBC, 0xE6, 0xE5, 0x63, 0xA4, 0x40, 0xF2,
+	0x77, 0x03, 0x7D, 0x81, 0x2D, 0xEB, 0x33, 0xA0, 0xF4, 0xA1, 0x39, 0x45, 0xD8, 0x98, 0xC2, 0x96
+};
+static const unsigned char p256_gy[] = {
+	0x4F, 0xE3, 0x42, 0xE2, 0xFE, 0x1A, 0x7F, 0x9B, 0x8E, 0xE7, 0xEB, 0x4A, 0x7C, 0x0F, 0x9E, 0x16,
+	0x2B, 0xCE, 0x33, 0x57, 0x6B, 0x31, 0x5E, 0xCE, 0xCB, 0xB6, 0x40, 0x68, 0x37, 0xBF, 0x51, 0xF5
+};
+
+typedef struct
+{
+	bn_t x, y, z;
+	int inf; /* point at infinity */
+} p256_point_t;
+
+/* r = 2 r (a = -3) */
+static void p256_double(const mont_t* mt, p256_point_t* r)
+{
+	bn_t delta, gamma, beta, alpha, t, u;
+
+	if (r->inf || bn_is_zero(&r->y, mt->n)) {
+		r->inf = 1;
+		return;
+	}
+	mont_mul(mt, &delta, &r->z, &r->z);
+	mont_mul(mt, &gamma, &r->y, &r->y);
+	mont_mul(mt, &beta, &r->x, &gamma);
+	mod_sub(mt, &t, &r->x, &delta);
+	mod_add(mt, &u, &r->x, &delta);
+	mont_mul(mt, &alpha, &t, &u);
+	mod_add(mt, &t, &alpha, &alpha);
+	mod_add(mt, &alpha, &alpha, &t);        /* 3 (x - delta) (x + delta) */
+	mod_add(mt, &r->z, &r->y, &r->z);
+	mont_mul(mt, &r->z, &r->z, &r->z);
+	mod_sub(mt, &r->z, &r->z, &gamma);
+	mod_sub(mt, &r->z, &r->z, &delta);      /* (y + z)^2 - gamma - delta */
+	mod_add(mt, &beta, &beta, &beta);
+	mod_add(mt, &beta, &beta, &beta);       /* 4 beta */
+	mont_mul(mt, &r->x, &alpha, &alpha);
+	mod_sub(mt, &r->x, &r->x, &beta);
+	mod_sub(mt, &r->x, &r->x, &beta);       /* alpha^2 - 8 beta */
+	mod_sub(mt, &t, &beta, &r->x);
+	mont_mul(mt, &r->y, &alpha, &t);
+	mont_mul(mt, &gamma, &gamma, &gamma);
+	mod_add(mt, &gamma, &gamma, &gamma);
+	mod_add(mt, &gamma, &gamma, &gamma);
+	mod_add(mt, &gamma, &gamma, &gamma);    /* 8 gamma^2 */
+	mod_sub(mt, &r->y, &r->y, &gamma);      /* alpha (4 beta - x) - 8 gamma^2 */
+}
+
+/* r = r + (x, y), the affine point (x, y) is not infinity */
+static void p256_add(const mont_t* mt, p256_point_t* r, const bn_t* x, const bn_t* y, const bn_t* one)
+{
+	bn_t zz, u, s, h, rr, hh, hhh, v;
+
+	if (r->inf) {
+		r->x = *x;
+		r->y = *y;
+		r->z = *one;
+		r->inf = 0;
+		return;
+	}
+	mont_mul(mt, &zz, &r->z, &r->z);
+	mont_mul(mt, &u, x, &zz);
+	mont_mul(mt, &s, &r->z, &zz);
+	mont_mul(mt, &s, y, &s);
+	mod_sub(mt, &h, &u, &r->x);
+	mod_sub(mt, &rr, &s, &r->y);
+	if (bn_is_zero(&h, mt->n)) {
+		if (bn_is_zero(&rr, mt->n))
+			p256_double(mt, r);
+		else
+			r->inf = 1;
+		return;
+	}
+	mont_mul(mt, &hh, &h, &h);
+	mont_mul(mt, &hhh, &h, &hh);
+	mont_mul(mt, &v, &r->x, &hh);
+	mont_mul(mt, &r->x, &rr, &rr);
+	mod_sub(mt, &r->x, &r->x, &hhh);
+	mod_sub(mt, &r->x, &r->x, &v);
+	mod_sub(mt, &r->x, &r->x, &v);          /* rr^2 - hhh - 2 v */
+	mont_mul(mt, &hhh, &r->y, &hhh);
+	mod_sub(mt, &v, &v, &r->x);
+	mont_mul(mt, &r->y, &rr, &v);
+	mod_sub(mt, &r->y, &r->y, &hhh);        /* rr (v - x) - y hhh */
+	mont_mul(mt, &r->z, &r->z, &h);
+}
+
+/*
+ * ECDSA signature (r, s) on P-256 of the SHA-256 hash with the public
+ * key point (uncompressed), returns 0 if it verifies
+ */
+static int ecdsa_verify(const unsigned char* point, size_t point_len,
+	const der_t* sig_r, const der_t* sig_s, const unsigned char hash[32])
+{
+	mont_t mp, mn;
+	bn_t r, s, e, w, u1, u2, one, gx, gy, qx, qy, t;
+	unsigned char exp[32];
+	p256_point_t acc;
+	int i;
+
+	if (point_len != 65 || point[0] != 0x04)
+		return -1;
+	mont_init(&mp, p256_p, sizeof(p256_p));
+	mont_init(&mn, p256_n, sizeof(p256_n));
+	if (bn_read(&r, sig_r->val, sig_r->len, 8) || bn_read(&s, sig_s->val, sig_s->len, 8)
+		|| bn_is_zero(&r, 8) || bn_is_zero(&s, 8) || bn_cmp(&r, &mn.m, 8) >= 0 || bn_cmp(&s, &mn.m, 8) >= 0)
+		return -1;
+
+	/* w = s^-1 = s^(n - 2), u1 = e w, u2 = r w (mod n) */
+	bn_read(&e, hash, 32, 8);
+	if (bn_cmp(&e, &mn.m, 8) >= 0)
+		bn_sub(&e, &e, &mn.m, 8);
+	memset(&t, 0, sizeof(t));
+	t.w[0] = 2;
+	bn_sub(&t, &mn.m, &t, 8);
+	bn_write(&t, 8, exp, sizeof(exp));
+	mod_exp(&mn, &w, &s, exp, sizeof(exp));
+	mod_mul(&mn, &u1, &e, &w);
+	mod_mul(&mn, &u2, &r, &w);
+
+	/* u1 G + u2 Q, the coordinates in Montgomery form */
+	memset(&one, 0, sizeof(one));
+	one.w[0] = 1;
+	mont_mul(&mp, &one, &one, &mp.rr);
+	bn_read(&t, p256_gx, 32, 8);
+	mont_mul(&mp, &gx, &t, &mp.rr);
+	bn_read(&t, p256_gy, 32, 8);
+	mont_mul(&mp, &gy, &t, &mp.rr);
+	if (bn_read(&t, point + 1, 32, 8) || bn_cmp(&t, &mp.m, 8) >= 0)
+		return -1;
+	mont_mul(&mp, &qx, &t, &mp.rr);
+	if (bn_read(&t, point + 33, 32, 8) || bn_cmp(&t, &mp.m, 8) >= 0)
+		return -1;
+	mont_mul(&mp, &qy, &t, &mp.rr);
+	memset(&acc, 0, sizeof(acc));
+	acc.inf = 1;
+	for (i = 255; i >= 0; i--) {
+		p256_double(&mp, &acc);
+		if (u1.w[i / 32] >> (i % 32) & 1)
+			p256_add(&mp, &acc, &gx, &gy, &one);
+		if (u2.w[i / 32] >> (i % 32) & 1)
+			p256_add(&mp, &acc, &qx, &qy, &one);
+	}
+	if (acc.inf)
+		return -1;
+
+	/* x = X / Z^2 mod p, compared with r mod n */
+	memset(&t, 0, sizeof(t));
+	t.w[0] = 1;
+	mont_mul(&mp, &acc.z, &acc.z, &t);     /* Z */
+	mont_mul(&mp, &acc.x, &acc.x, &t);     /* X */
+	t.w[0] = 2;
+	bn_sub(&t, &mp.m, &t, 8);
+	bn_write(&t, 8, exp, sizeof(exp));
+	mod_exp(&mp, &w, &acc.z, exp, sizeof(exp));
+	mod_mul(&mp, &w, &w, &w);
+	mod_mul(&mp, &w, &acc.x, &w);
+	if (bn_cmp(&w, &mn.m, 8) >= 0)
+		bn_sub(&w, &w, &mn.m, 8);
+	return bn_cmp(&w, &r, 8) == 0 ? 0 : -1;
+}
+
+/*
+ * Check the signature of the hash of the signed attributes with the
+ * key of the certificate cert, returns 0 if it verifies, -1 if not and
+ * VERIFY_ALGORITHM if the key is of another algorithm
+ */
+static int cert_verify(mont_t* mt, const der_t* cert, const unsigned char* sig, size_t sig_len, const unsigned char hash[32])
+{
+	der_t tbs, e, alg, key, o;
+
+	/* Certificate: tbsCertificate [version] serial signature issuer validity subject subjectPublicKeyInfo */
+	if (cert->tag != DER_SEQUENCE || der_first(cert, DER_SEQUENCE, &tbs) || der_get(tbs.val, tbs.end, &e))
+		return -1;
+	if (e.tag == DER_CONTEXT_0 && der_next(&tbs, &e, DER_INTEGER, &e))
+		return -1;
+	if (e.tag != DER_INTEGER || der_next(&tbs, &e, DER_SEQUENCE, &e) || der_next(&tbs, &e, DER_SEQUENCE, &e)
+		|| der_next(&tbs, &e, DER_SEQUENCE, &e) || der_next(&tbs, &e, DER_SEQUENCE, &e) || der_next(&tbs, &e, DER_SEQUENCE, &e)
+		|| der_first(&e, DER_SEQUENCE, &alg) || der_next(&e, &alg, DER_BIT_STRING, &key) || key.len < 2 || key.val[0] != 0)
+		return -1;
+	if (der_algorithm(&alg, oid_rsa, sizeof(oid_rsa))) {
+		der_t rsa_key, modulus, exponent;
+		if (der_get(key.val + 1, key.end, &rsa_key) || rsa_key.tag != DER_SEQUENCE
+			|| der_first(&rsa_key, DER_INTEGER, &modulus) || der_next(&rsa_key, &modulus, DER_INTEGER, &exponent))
+			return -1;
+		return rsa_verify(mt, &modulus, &exponent, sig, sig_len, hash);
+	}
+	if (der_algorithm(&alg, oid_ec_public_key, sizeof(oid_ec_public_key))) {
+		der_t ecdsa_sig, r, s;
+		if (der_first(&alg, DER_OID, &o) || der_next(&alg, &o, DER_OID, &o) || !der_is_oid(&o, oid_prime256v1, sizeof(oid_prime256v1)))
+			return VERIFY_ALGORITHM;
+		if (der_get(sig, sig + sig_len, &ecdsa_sig) || ecdsa_sig.tag != DER_SEQUENCE
+			|| der_first(&ecdsa_sig, DER_INTEGER, &r) || der_next(&ecdsa_sig, &r, DER_INTEGER, &s))
+			return -1;
+		return ecdsa_verify(key.val + 1, key.len - 1, &r, &s, hash);
+	}
+	return VERIFY_ALGORITHM;
+}
+
+/**
+ * Verify the CMS document (sig file, trailing metadata allowed) for
+ * the SHA-256 digest of the signed content. key keeps the arithmetic
+ * of the last RSA modulus of the caller, initially zeroed.
+ * Returns VERIFY_OK or an error if < 0.
+ */
+static int cms_verify(mont_t* key, const unsigned char* cms, size_t cms_len, const unsigned char digest[32])
+{
+	der_t ci, sd, sdc, e, certs, si, sic, attrs, attr, o, v, sig;
+	const unsigned char* end = cms + cms_len;
+	unsigned char hash[32], tag = DER_SET;
+	int found = 0, rc = VERIFY_SIGNATURE;
+	sha256_context ctx;
+
+	/* ContentInfo { contentType, [0] SignedData } */
+	if (der_get(cms, end, &ci) || ci.tag != DER_SEQUENCE || der_first(&ci, DER_OID, &e)
+		|| der_next(&ci, &e, DER_CONTEXT_0, &sd) || der_first(&sd, DER_SEQUENCE, &sdc))
+		return VERIFY_FORMAT;
+	/* SignedData { version, digestAlgorithms, encapContentInfo, [0] certificates, [1] crls, signerInfos } */
+	if (der_first(&sdc, DER_INTEGER, &e) || der_next(&sdc, &e, DER_SET, &e) || der_next(&sdc, &e, DER_SEQUENCE, &e)
+		|| der_get(e.end, sdc.end, &e) || e.tag != DER_CONTEXT_0)
+		return VERIFY_FORMAT;
+	certs = e;
+	if (der_get(e.end, sdc.end, &e))
+		return VERIFY_FORMAT;
+	if (e.tag == DER_CONTEXT_1 && der_get(e.end, sdc.end, &e))
+		return VERIFY_FORMAT;
+	/* The first SignerInfo { version, sid, digestAlgorithm, [0] signedAttrs, signatureAlgorithm, signature } */
+	if (e.tag != DER_SET)
+		return VERIFY_FORMAT;
+	si = e;
+	if (der_first(&si, DER_SEQUENCE, &sic) || der_first(&sic, DER_INTEGER, &e) || der_get(e.end, sic.end, &e)
+		|| der_next(&sic, &e, DER_SEQUENCE, &e))
+		return VERIFY_FORMAT;
+	if (!der_algorithm(&e, oid_sha256, sizeof(oid_sha256)))
+		return VERIFY_ALGORITHM;
+	if (der_next(&sic, &e, DER_CONTEXT_0, &attrs) || der_next(&sic, &attrs, DER_SEQUENCE, &e)
+		|| der_next(&sic, &e, DER_OCTET, &sig))
+		return VERIFY_FORMAT;
+
+	/* messageDigest */
+	for (attr.end = attrs.val; !found && attr.end < attrs.end; ) {
+		if (der_get(attr.end, attrs.end, &attr) || attr.tag != DER_SEQUENCE || der_first(&attr, DER_OID, &o))
+			return VERIFY_FORMAT;
+		if (der_is_oid(&o, oid_message_digest, sizeof(oid_message_digest))) {
+			if (der_next(&attr, &o, DER_SET, &o) || der_first(&o, DER_OCTET, &v) || v.len != 32)
+				return VERIFY_FORMAT;
+			if (memcmp(v.val, digest, 32))
+				return VERIFY_DIGEST;
+			found = 1;
+		}
+	}
+	if (!found)
+		return VERIFY_FORMAT;
+
+	/* The signature is over the DER encoding of the signed attributes as SET */
+	sha256_starts(&ctx);
+	sha256_update(&ctx, &tag, 1);
+	sha256_update(&ctx, (unsigned char*)attrs.beg + 1, (unsigned int)(attrs.end - attrs.beg - 1));
+	sha256_finish(&ctx, hash);
+
+	/* Any certificate of the document whose key verifies the signature */
+	for (e.end = certs.val; e.end < certs.end && rc != VERIFY_OK; ) {
+		int cert_rc;
+		if (der_get(e.end, certs.end, &e))
+			return VERIFY_FORMAT;
+		cert_rc = cert_verify(key, &e, sig.val, sig.len, hash);
+		if (cert_rc == VERIFY_OK || (rc == VERIFY_SIGNATURE && cert_rc == VERIFY_ALGORITHM))
+			rc = cert_rc;
+	}
+	return rc;
+}
+
+#endif /* _VERIFY_H_ */
@@ -136,5 +136,20 @@ int main(int argc, char **argv)
 	}
 	release_template();
 
+	{
+		static const char *phases[SC_STATS_PHASES] = {
+			"open", "get fids", "load template", "revalidate", "patch attributes", "sign"
+		};
+		struct sc_stats stats;
+		get_sign_stats(&stats);
+		for (i = 0; i < SC_STATS_PHASES; i++) {
+			const struct sc_stats_phase *p = &stats.phase[i];
+			if (p->count)
+				log_inf("%-16s: %4llu x, avg %7llu us, max %7llu us", phases[i],
+					p->count, p->totalUs / p->count, p->maxUs);
+		}
+		log_inf("apdus: %llu, bytes out: %llu, bytes in: %llu", stats.apdus, stats.bytesOut, stats.bytesIn);
+	}
+
 	return rv;
 }
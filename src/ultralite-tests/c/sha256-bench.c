@@ -0,0 +1,277 @@
+/**
+ * SmartCard-HSM Ultra-Light Library SHA-256 Benchmark
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file sha256-bench.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ultralite/log.h>
+#include <ultralite/sc-hsm-ultralite.h>
+#include <ultralite-signer/metadata.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <sys/time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HAVE_TSC /* the time stamp counter runs at the nominal clock of the cpu */
+#endif
+
+/* known answer tests of FIPS 180-2 */
+static const struct {
+	const char *msg;
+	int repeat;
+	const char *digest;
+} Kat[] = {
+	{ "", 1,
+	  "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+	{ "abc", 1,
+	  "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+	  "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+	{ "a", 1000000,
+	  "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+};
+
+#define KATS ((int)(sizeof(Kat) / sizeof(Kat[0])))
+
+static const int Sizes[] = { 64, 4096, 65536, 1048576 };
+
+#define SIZES ((int)(sizeof(Sizes) / sizeof(Sizes[0])))
+
+/* bytes hashed per measurement */
+#define BENCH_BYTES (64 << 20)
+
+static double Now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / freq.QuadPart;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+
+static unsigned long long Cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void ToHex(const unsigned char digest[32], char hex[65])
+{
+	int i;
+	for (i = 0; i < 32; i++)
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+/* message of the known answer test k in chunks of 1000 bytes to cross the block boundaries */
+static int Chunk(int k, int pos, unsigned char *buf)
+{
+	int len = (int)strlen(Kat[k].msg), total = len * Kat[k].repeat, n, i;
+	n = total - pos < 1000 ? total - pos : 1000;
+	for (i = 0; i < n; i++)
+		buf[i] = Kat[k].msg[(pos + i) % len];
+	return n;
+}
+
+/* checks the current backend with sha256_update and sha256_mb_update, returns the number of failures */
+static int CheckKat(const char *backend)
+{
+	static unsigned char buf[SHA256_MB_LANES + 1][1000];
+	sha256_context ctx[SHA256_MB_LANES + 1], *pctx[SHA256_MB_LANES + 1];
+	unsigned char *input[SHA256_MB_LANES + 1], digest[32];
+	unsigned int length[SHA256_MB_LANES + 1];
+	int pos[SHA256_MB_LANES + 1];
+	int lanes = SHA256_MB_LANES + 1, i, k, n, more, failed = 0;
+	char hex[65];
+
+	/* single stream */
+	for (k = 0; k < KATS; k++) {
+		sha256_starts(&ctx[0]);
+		for (i = 0; (n = Chunk(k, i, buf[0])) > 0; i += n)
+			sha256_update(&ctx[0], buf[0], n);
+		sha256_finish(&ctx[0], digest);
+		ToHex(digest, hex);
+		if (strcmp(hex, Kat[k].digest)) {
+			log_err("%s: known answer test %d failed: %s", backend, k, hex);
+			failed++;
+		}
+	}
+
+	/* all tests in parallel, more lanes than processed by one group */
+	for (i = 0; i < lanes; i++) {
+		sha256_starts(&ctx[i]);
+		pctx[i] = &ctx[i];
+		input[i] = buf[i];
+		pos[i] = 0;
+	}
+	do {
+		for (i = more = 0; i < lanes; i++) {
+			length[i] = Chunk(i % KATS, pos[i], buf[i]);
+			pos[i] += length[i];
+			more |= length[i] != 0;
+		}
+		sha256_mb_update(pctx, input, length, lanes);
+	} while (more);
+	for (i = 0; i < lanes; i++) {
+		sha256_finish(&ctx[i], digest);
+		ToHex(digest, hex);
+		if (strcmp(hex, Kat[i % KATS].digest)) {
+			log_err("%s: known answer test %d failed in lane %d: %s", backend, i % KATS, i, hex);
+			failed++;
+		}
+	}
+	return failed;
+}
+
+static void Report(const char *backend, const char *mode, int size, double sec, unsigned long long cycles)
+{
+	double bytes = (double)(BENCH_BYTES / size) * size;
+	if (cycles)
+		printf("%-10s %-6s %8d %10.1f %8.2f\n", backend, mode, size, bytes / sec / 1e6, cycles / bytes);
+	else
+		printf("%-10s %-6s %8d %10.1f %8s\n", backend, mode, size, bytes / sec / 1e6, "-");
+}
+
+/* throughput of the current backend in MB/s for the buffer size, starts/update/finish per buffer */
+static double Bench(const char *backend, unsigned char *data, int size)
+{
+	sha256_context ctx;
+	unsigned char digest[32];
+	unsigned long long c0;
+	double t0, sec;
+	int i, n = BENCH_BYTES / size;
+
+	t0 = Now();
+	c0 = Cycles();
+	for (i = 0; i < n; i++) {
+		sha256_starts(&ctx);
+		sha256_update(&ctx, data, size);
+		sha256_finish(&ctx, digest);
+	}
+	sec = Now() - t0;
+	Report(backend, "single", size, sec, Cycles() - c0);
+	return (double)n * size / sec / 1e6;
+}
+
+/* aggregate throughput of SHA256_MB_LANES streams hashed with sha256_mb_update */
+static void BenchMultiBuffer(const char *backend, unsigned char *data, int size)
+{
+	sha256_context ctx[SHA256_MB_LANES], *pctx[SHA256_MB_LANES];
+	unsigned char *input[SHA256_MB_LANES], digest[32];
+	unsigned int length[SHA256_MB_LANES];
+	unsigned long long c0;
+	double t0;
+	int i, j, n = BENCH_BYTES / size / SHA256_MB_LANES;
+
+	if (n == 0)
+		return;
+	for (j = 0; j < SHA256_MB_LANES; j++) {
+		pctx[j] = &ctx[j];
+		input[j] = data + (size_t)j * size;
+		length[j] = size;
+	}
+	t0 = Now();
+	c0 = Cycles();
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < SHA256_MB_LANES; j++)
+			sha256_starts(&ctx[j]);
+		sha256_mb_update(pctx, input, length, SHA256_MB_LANES);
+		for (j = 0; j < SHA256_MB_LANES; j++)
+			sha256_finish(&ctx[j], digest);
+	}
+	Report(backend, "multi", size, Now() - t0, Cycles() - c0);
+}
+
+/* cost of get_thumb, computed for every metadata_t written or read by the signer */
+static void BenchThumb(void)
+{
+	metadata_t md;
+	unsigned char thumb[32];
+	double t0, sec;
+	int i, n = 1000000;
+
+	memset(&md, 0, sizeof(md));
+	t0 = Now();
+	for (i = 0; i < n; i++) {
+		md.cll = i;
+		get_thumb(&md, 0, 0, thumb);
+	}
+	sec = Now() - t0;
+	printf("get_thumb: %.0f ns per metadata_t\n", sec / n * 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char *data;
+	const char *backend;
+	double min = argc >= 2 ? atof(argv[1]) : 0, mbs = 0;
+	int b, s, failed = 0;
+
+	if (argc >= 2 && min <= 0) {
+		fprintf(stderr, "Usage: [min-MB/s]\n");
+		fprintf(stderr, "Checks and benchmarks all SHA-256 backends of this cpu.\n");
+		fprintf(stderr, "If 'min-MB/s' is specified, fails if the automatically selected backend\n");
+		fprintf(stderr, "hashes 64 KiB buffers slower than 'min-MB/s'.\n");
+		return 1;
+	}
+
+	data = (unsigned char*)malloc((size_t)Sizes[SIZES - 1] * SHA256_MB_LANES);
+	if (data == 0) {
+		log_err("out of memory");
+		return ENOMEM;
+	}
+	for (s = 0; s < Sizes[SIZES - 1] * SHA256_MB_LANES; s++)
+		data[s] = (unsigned char)(s * 7 + 1);
+
+	printf("%-10s %-6s %8s %10s %8s\n", "backend", "mode", "bytes", "MB/s", "cyc/byte");
+	for (b = 0; (backend = sha256_use_backend(b)) != 0; b++) {
+		failed += CheckKat(backend);
+		for (s = 0; s < SIZES; s++)
+			Bench(backend, data, Sizes[s]);
+		for (s = 0; s < SIZES; s++)
+			BenchMultiBuffer(backend, data, Sizes[s]);
+	}
+
+	/* automatic selection as used by the library */
+	sha256_use_backend(-1);
+	failed += CheckKat("auto");
+	mbs = Bench("auto", data, 65536);
+	BenchThumb();
+	free(data);
+
+	if (failed) {
+		log_err("%d known answer tests failed", failed);
+		return 1;
+	}
+	if (mbs < min) {
+		log_err("throughput %.1f MB/s below %.1f MB/s", mbs, min);
+		return 1;
+	}
+	log_inf("bench ok");
+	return 0;
+}
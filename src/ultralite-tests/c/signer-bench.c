@@ -0,0 +1,606 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Signer Benchmark
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file signer-bench.c
+ */
+
+/*
+	End-to-end benchmark of sc-hsm-ultralite-signer. A synthetic tree of month folders
+	(YYYY-MM, the newest is the current month) is generated in the work directory and the
+	signer is run three times against it:
+
+		initial  all files are new
+		rescan   no file changed
+		update   a share of the files was appended or rewritten shorter
+
+	Each run writes its metrics (option -m of the signer), which give the files scanned,
+	the bytes hashed and the signatures. The token is the emulator of common/emulator.h with
+	a RSA-2048 key and template labelled "bench" in <dir>/token, or with -t a real token.
+	The emulator latency can be set with SC_HSM_EMULATOR_LATENCY as usual.
+
+	With -S the system calls of the signer and its threads are counted with ptrace (Linux),
+	the times then include the tracing overhead. The files, the sig files and the log of
+	the signer (signer.log) stay in the work directory until the next run.
+*/
+
+#define _GNU_SOURCE /* nftw, __WALL */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/ptrace.h>
+#endif
+
+#define MARKER      ".signer-bench" /* marks a work directory which may be wiped */
+#define LABEL       "bench"
+#define EMU_PIN     "648219"        /* default PIN of the emulator */
+#define SIG_SIZE    256             /* RSA-2048 */
+#define CHUNK       (64 << 10)
+
+static const char *Dir = "signer-bench.dir";
+static int Files = 1000;
+static long long MinSize = 4 << 10, MaxSize = 1 << 20;
+static int Months = 12;
+static int AppendPct = 10, RewritePct = 1;
+static int Syscalls;
+static const char *Pin = EMU_PIN, *Label = LABEL;
+
+static unsigned long long Seed = 0x9E3779B97F4A7C15ull;
+
+static unsigned long long Random(void)
+{
+	Seed ^= Seed << 13;
+	Seed ^= Seed >> 7;
+	Seed ^= Seed << 17;
+	return Seed;
+}
+
+static double Now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* <number>[K|M|G] */
+static long long ParseSize(const char *s)
+{
+	char *end;
+	long long n = strtoll(s, &end, 10);
+	switch (*end) {
+	case 'K': case 'k': n <<= 10; end++; break;
+	case 'M': case 'm': n <<= 20; end++; break;
+	case 'G': case 'g': n <<= 30; end++; break;
+	}
+	return (*end && *end != ':') || n < 0 ? -1 : n;
+}
+
+/* log-uniform in [MinSize, MaxSize], many small and some large files */
+static long long FileSize(void)
+{
+	double r = (Random() >> 11) / 9007199254740992.0;
+	if (MaxSize <= MinSize)
+		return MinSize;
+	return (long long)((MinSize + 1) * exp(r * log((double)(MaxSize + 1) / (MinSize + 1)))) - 1;
+}
+
+static int WriteData(int fd, long long len)
+{
+	static unsigned long long buf[CHUNK / 8];
+	while (len > 0) {
+		int i, n = len < CHUNK ? (int)len : CHUNK;
+		for (i = 0; i < (n + 7) / 8; i++)
+			buf[i] = Random();
+		if (write(fd, buf, n) != n)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static void FilePath(char *path, size_t size, int i)
+{
+	time_t now = time(NULL);
+	struct tm tm = *localtime(&now);
+	int month = tm.tm_year * 12 + tm.tm_mon - i % Months;
+	snprintf(path, size, "%s/data/%04d-%02d/file%07d.dat", Dir, 1900 + month / 12, month % 12 + 1, i);
+}
+
+static int WriteFile(const char *path, const char *data, size_t len)
+{
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL)
+		return -1;
+	if (fwrite(data, 1, len, fp) != len) {
+		fclose(fp);
+		return -1;
+	}
+	return fclose(fp);
+}
+
+/*
+	DER elements are built from the inside out at the end of the buffer: the content of the
+	element is at buf + *off up to end, its tag and length are put in front of it
+*/
+static void Wrap(unsigned char *buf, int *off, int end, unsigned char tag)
+{
+	int len = end - *off, n = 0;
+	unsigned char hdr[4];
+	if (len >= 256)
+		hdr[n++] = 0x82, hdr[n++] = (unsigned char)(len >> 8), hdr[n++] = (unsigned char)len;
+	else if (len >= 128)
+		hdr[n++] = 0x81, hdr[n++] = (unsigned char)len;
+	else
+		hdr[n++] = (unsigned char)len;
+	*off -= n;
+	memcpy(buf + *off, hdr, n);
+	buf[--*off] = tag;
+}
+
+static void Put(unsigned char *buf, int *off, const void *data, int len)
+{
+	*off -= len;
+	memcpy(buf + *off, data, len);
+}
+
+/*
+	Token of the emulator with the key and the template of Label: key descriptor C401,
+	key CC01, data descriptor C901 and the template CD01, a SignedData with a SKI signer id
+	and the signed attributes content type, signing time and message digest
+*/
+static int WriteToken(void)
+{
+	static const unsigned char oidData[] = { 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x07, 0x01 };
+	static const unsigned char oidSignedData[] = { 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x07, 0x02 };
+	static const unsigned char algSha256[] = { 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00 };
+	static const unsigned char algRsa[] = { 0x30, 0x0D, 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x01, 0x05, 0x00 };
+	static const unsigned char attrContentType[] = { 0x30, 0x18, 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x09, 0x03,
+		0x31, 0x0B, 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x07, 0x01 };
+	static const unsigned char attrSigningTime[] = { 0x30, 0x1C, 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x09, 0x05,
+		0x31, 0x0F, 0x17, 0x0D };
+	static const unsigned char attrMessageDigest[] = { 0x30, 0x2F, 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x09, 0x04,
+		0x31, 0x22, 0x04, 0x20 };
+	static const unsigned char version3[] = { 0x02, 0x01, 0x03 };
+	unsigned char buf[1024], tpl[1024], zero[SIG_SIZE], ski[32];
+	unsigned char desc[2 + 2 + 2 + sizeof(LABEL) - 1];
+	int off, end, sig, sa, saEnd, md, st, certId, len, i;
+	char path[1024];
+
+	memset(zero, 0, sizeof(zero));
+	for (i = 0; i < (int)sizeof(ski); i++)
+		ski[i] = (unsigned char)(0xB0 + i);
+
+	end = off = sizeof(buf);
+	/* SignerInfo */
+	Put(buf, &off, zero, SIG_SIZE);
+	sig = off;
+	Wrap(buf, &off, end, 0x04);
+	Put(buf, &off, algRsa, sizeof(algRsa));
+	saEnd = off;
+	Put(buf, &off, zero, 32);
+	md = off;
+	Put(buf, &off, attrMessageDigest, sizeof(attrMessageDigest));
+	Put(buf, &off, "130101000000Z", 13);
+	st = off;
+	Put(buf, &off, attrSigningTime, sizeof(attrSigningTime));
+	Put(buf, &off, attrContentType, sizeof(attrContentType));
+	Wrap(buf, &off, saEnd, 0xA0);
+	sa = off;
+	Put(buf, &off, algSha256, sizeof(algSha256));
+	len = off;
+	Put(buf, &off, ski, sizeof(ski));
+	certId = off;
+	Wrap(buf, &off, len, 0x80);
+	Put(buf, &off, version3, sizeof(version3));
+	Wrap(buf, &off, end, 0x30);
+	Wrap(buf, &off, end, 0x31);
+	/* SignedData */
+	len = off;
+	Put(buf, &off, oidData, sizeof(oidData));
+	Wrap(buf, &off, len, 0x30);
+	len = off;
+	Put(buf, &off, algSha256, sizeof(algSha256));
+	Wrap(buf, &off, len, 0x31);
+	Put(buf, &off, version3, sizeof(version3));
+	Wrap(buf, &off, end, 0x30);
+	Wrap(buf, &off, end, 0xA0);
+	Put(buf, &off, oidSignedData, sizeof(oidSignedData));
+	Wrap(buf, &off, end, 0x30);
+	len = end - off;
+
+	/* header of the template, big endian, offsets relative to the CMS */
+#define U16(p, v) ((p)[0] = (unsigned char)((v) >> 8), (p)[1] = (unsigned char)(v))
+	memset(tpl, 0, 20);
+	tpl[1] = 20;
+	U16(tpl + 2, 32);
+	U16(tpl + 4, certId - off);
+	U16(tpl + 6, sa - off);
+	U16(tpl + 8, saEnd - sa);
+	U16(tpl + 10, st - off);
+	U16(tpl + 12, md - off);
+	U16(tpl + 14, sig - off);
+	U16(tpl + 16, SIG_SIZE);
+	U16(tpl + 18, len);
+#undef U16
+	memcpy(tpl + 20, buf + off, len);
+
+	/* descriptor SEQUENCE { SEQUENCE { UTF8String label } } as read by the library */
+	desc[0] = 0x30;
+	desc[1] = sizeof(desc) - 2;
+	desc[2] = 0x30;
+	desc[3] = sizeof(desc) - 4;
+	desc[4] = 0x0C;
+	desc[5] = sizeof(desc) - 6;
+	memcpy(desc + 6, LABEL, sizeof(desc) - 6);
+
+	snprintf(path, sizeof(path), "%s/token", Dir);
+	if (mkdir(path, 0777))
+		return -1;
+	snprintf(path, sizeof(path), "%s/token/CC01", Dir);
+	if (WriteFile(path, "rsa 2048", 8))
+		return -1;
+	snprintf(path, sizeof(path), "%s/token/C401", Dir);
+	if (WriteFile(path, (const char *)desc, sizeof(desc)))
+		return -1;
+	snprintf(path, sizeof(path), "%s/token/C901", Dir);
+	if (WriteFile(path, (const char *)desc, sizeof(desc)))
+		return -1;
+	snprintf(path, sizeof(path), "%s/token/CD01", Dir);
+	return WriteFile(path, (const char *)tpl, 20 + len);
+}
+
+static int Remove(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* wipes the work directory of a previous run, refuses other directories */
+static int PrepareDir(void)
+{
+	char path[1024];
+	struct stat st;
+
+	if (stat(Dir, &st) == 0) {
+		snprintf(path, sizeof(path), "%s/%s", Dir, MARKER);
+		if (stat(path, &st)) {
+			fprintf(stderr, "'%s' exists and is no work directory of signer-bench\n", Dir);
+			return -1;
+		}
+		if (nftw(Dir, Remove, 16, FTW_DEPTH | FTW_PHYS)) {
+			fprintf(stderr, "removing '%s' failed: %s\n", Dir, strerror(errno));
+			return -1;
+		}
+	}
+	if (mkdir(Dir, 0777)) {
+		fprintf(stderr, "creating '%s' failed: %s\n", Dir, strerror(errno));
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/%s", Dir, MARKER);
+	return WriteFile(path, "", 0);
+}
+
+/* month folders with Files files, the mtime is a past day of the month of the folder */
+static int Generate(long long *total)
+{
+	char path[1024];
+	time_t now = time(NULL);
+	struct tm tm = *localtime(&now);
+	int i, fd;
+
+	snprintf(path, sizeof(path), "%s/data", Dir);
+	if (mkdir(path, 0777))
+		return -1;
+	for (i = 0; i < Months && i < Files; i++) {
+		FilePath(path, sizeof(path), i);
+		*strrchr(path, '/') = 0;
+		if (mkdir(path, 0777))
+			return -1;
+	}
+	*total = 0;
+	for (i = 0; i < Files; i++) {
+		long long size = FileSize();
+		struct tm day = tm;
+		struct timeval tv[2];
+
+		FilePath(path, sizeof(path), i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0 || WriteData(fd, size)) {
+			fprintf(stderr, "writing '%s' failed: %s\n", path, strerror(errno));
+			return -1;
+		}
+		close(fd);
+		*total += size;
+
+		day.tm_mon -= i % Months;
+		day.tm_mday = 1 + i / Months % (i % Months ? 28 : tm.tm_mday);
+		day.tm_hour = 12;
+		day.tm_isdst = -1;
+		tv[0].tv_sec = tv[1].tv_sec = mktime(&day) - (i % Months ? 0 : 86400);
+		tv[0].tv_usec = tv[1].tv_usec = 0;
+		utimes(path, tv);
+	}
+	return 0;
+}
+
+/* appends to AppendPct and shortens RewritePct percent of the files, the others stay */
+static int Mutate(int *appended, int *rewritten, long long *bytes)
+{
+	char path[1024];
+	struct stat st;
+	int i, fd;
+
+	*appended = *rewritten = 0;
+	*bytes = 0;
+	for (i = 0; i < Files; i++) {
+		int r = (int)(Random() % 100);
+		long long len;
+
+		FilePath(path, sizeof(path), i);
+		if (r < AppendPct) {
+			if (stat(path, &st))
+				return -1;
+			len = 1 + (long long)(Random() % (st.st_size / 4 + 1));
+			fd = open(path, O_WRONLY | O_APPEND);
+			(*appended)++;
+		} else if (r < AppendPct + RewritePct) {
+			if (stat(path, &st))
+				return -1;
+			len = st.st_size / 2;
+			fd = open(path, O_WRONLY | O_TRUNC);
+			(*rewritten)++;
+		} else {
+			continue;
+		}
+		if (fd < 0 || WriteData(fd, len)) {
+			fprintf(stderr, "writing '%s' failed: %s\n", path, strerror(errno));
+			return -1;
+		}
+		close(fd);
+		*bytes += len;
+	}
+	return 0;
+}
+
+#ifdef __linux__
+/*
+	Counts the system calls of the traced child and of its threads until all of them exited.
+	Each system call stops the thread at the entry and at the exit. Returns the exit code.
+*/
+static int Trace(pid_t pid, unsigned long long *syscalls)
+{
+	unsigned long long stops = 0;
+	int status, rc = -1;
+	pid_t tid;
+
+	/* the child stops after its execve */
+	if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status))
+		return -1;
+	ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE
+		| PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK);
+	ptrace(PTRACE_SYSCALL, pid, 0, 0);
+	while ((tid = waitpid(-1, &status, __WALL)) > 0) {
+		int sig = 0;
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (tid == pid)
+				rc = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+			continue;
+		}
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+			stops++;
+		else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP) /* new threads start stopped */
+			sig = WSTOPSIG(status);
+		ptrace(PTRACE_SYSCALL, tid, 0, sig);
+	}
+	*syscalls = stops / 2;
+	return rc;
+}
+#endif
+
+/* runs the signer with its options and -r -m metrics pin label <dir>/data */
+static int RunSigner(char **signer, int count, unsigned long long *syscalls)
+{
+	char metrics[1024], data[1024], log[1024];
+	char **argv;
+	int status, fd, i;
+	pid_t pid;
+
+	snprintf(metrics, sizeof(metrics), "%s/metrics.json", Dir);
+	snprintf(data, sizeof(data), "%s/data", Dir);
+	snprintf(log, sizeof(log), "%s/signer.log", Dir);
+	remove(metrics);
+
+	argv = (char **)calloc(count + 7, sizeof(char *));
+	if (argv == NULL)
+		return -1;
+	for (i = 0; i < count; i++)
+		argv[i] = signer[i];
+	argv[i++] = "-r";
+	argv[i++] = "-m";
+	argv[i++] = metrics;
+	argv[i++] = (char *)Pin;
+	argv[i++] = (char *)Label;
+	argv[i++] = data;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0666);
+		if (fd >= 0) {
+			dup2(fd, 1);
+			dup2(fd, 2);
+			close(fd);
+		}
+#ifdef __linux__
+		if (Syscalls)
+			ptrace(PTRACE_TRACEME, 0, 0, 0);
+#endif
+		execvp(argv[0], argv);
+		fprintf(stderr, "starting '%s' failed: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	free(argv);
+	if (pid < 0)
+		return -1;
+	*syscalls = 0;
+#ifdef __linux__
+	if (Syscalls)
+		return Trace(pid, syscalls);
+#endif
+	if (waitpid(pid, &status, 0) != pid)
+		return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* value of the first "key": number in the metrics */
+static unsigned long long Metric(const char *json, const char *key)
+{
+	char name[64];
+	const char *p;
+	snprintf(name, sizeof(name), "\"%s\": ", key);
+	p = strstr(json, name);
+	return p ? strtoull(p + strlen(name), NULL, 10) : 0;
+}
+
+static int Pass(const char *name, char **signer, int count)
+{
+	char path[1024], json[4096];
+	unsigned long long syscalls, scanned, hashed, signs;
+	double start, sec;
+	size_t len;
+	FILE *fp;
+	int rc;
+
+	start = Now();
+	rc = RunSigner(signer, count, &syscalls);
+	sec = Now() - start;
+	if (rc) {
+		snprintf(path, sizeof(path), "%s/signer.log", Dir);
+		fprintf(stderr, "%s: signer exit code %d, see '%s'\n", name, rc, path);
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/metrics.json", Dir);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: no metrics in '%s'\n", name, path);
+		return -1;
+	}
+	len = fread(json, 1, sizeof(json) - 1, fp);
+	json[len] = 0;
+	fclose(fp);
+	scanned = Metric(json, "scanned");
+	hashed = Metric(json, "hashed");
+	signs = Metric(json, "count");
+
+	printf("%-8s %8llu %8llu %9.3f %9.0f %10.1f %8.1f", name, scanned, Metric(json, "signed"),
+		sec, scanned / sec, hashed / sec / 1e6, signs / sec);
+	if (Syscalls)
+		printf(" %9.1f", scanned ? (double)syscalls / scanned : 0.0);
+	printf("\n");
+	return 0;
+}
+
+static int Usage(void)
+{
+	fprintf(stderr, "Usage: [-n files] [-s min[:max]] [-m months] [-A percent] [-R percent] [-d dir] [-S] [-t pin label] signer [signer-options]\n");
+	fprintf(stderr, "Generates a tree of month folders in 'dir' (default %s) and measures the\n", Dir);
+	fprintf(stderr, "signer with its options on all files new, no file changed and after changes.\n");
+	fprintf(stderr, "  -n  number of files (default %d)\n", Files);
+	fprintf(stderr, "  -s  file sizes, log-uniform between min and max, K, M or G suffix (default 4K:1M)\n");
+	fprintf(stderr, "  -m  number of month folders (default %d)\n", Months);
+	fprintf(stderr, "  -A  percentage of files appended by up to a quarter of their size (default %d)\n", AppendPct);
+	fprintf(stderr, "  -R  percentage of files rewritten to half their size (default %d)\n", RewritePct);
+	fprintf(stderr, "  -S  count the system calls of the signer (Linux, ptrace)\n");
+	fprintf(stderr, "  -t  sign with a real token instead of the emulator\n");
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	char path[1024];
+	long long total, bytes;
+	int i, appended, rewritten, emulator = 1;
+	double start;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			Files = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			const char *max = strchr(argv[++i], ':');
+			MinSize = ParseSize(argv[i]);
+			MaxSize = max ? ParseSize(max + 1) : MinSize;
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			Months = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc)
+			AppendPct = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+			RewritePct = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+			Dir = argv[++i];
+		else if (strcmp(argv[i], "-S") == 0)
+			Syscalls = 1;
+		else if (strcmp(argv[i], "-t") == 0 && i + 2 < argc) {
+			Pin = argv[++i];
+			Label = argv[++i];
+			emulator = 0;
+		} else
+			return Usage();
+	}
+	if (i >= argc || Files <= 0 || Months <= 0 || MinSize < 0 || MaxSize < MinSize
+		|| AppendPct < 0 || RewritePct < 0 || AppendPct + RewritePct > 100)
+		return Usage();
+#ifndef __linux__
+	if (Syscalls) {
+		fprintf(stderr, "counting system calls needs Linux\n");
+		return 1;
+	}
+#endif
+
+	if (PrepareDir())
+		return 1;
+	if (emulator) {
+		if (WriteToken()) {
+			fprintf(stderr, "writing the emulator token failed: %s\n", strerror(errno));
+			return 1;
+		}
+		snprintf(path, sizeof(path), "%s/token", Dir);
+		setenv("SC_HSM_EMULATOR", path, 1);
+		if (getenv("SC_HSM_EMULATOR_PIN") && strcmp(Pin, EMU_PIN) == 0)
+			Pin = getenv("SC_HSM_EMULATOR_PIN");
+	}
+
+	start = Now();
+	if (Generate(&total))
+		return 1;
+	printf("generated %d files, %.1f MB in %d month folders of '%s/data' in %.1f s\n",
+		Files, total / 1e6, Months < Files ? Months : Files, Dir, Now() - start);
+	printf("%-8s %8s %8s %9s %9s %10s %8s%s\n", "pass", "files", "signed", "seconds",
+		"files/s", "hash MB/s", "signs/s", Syscalls ? " sys/file" : "");
+
+	if (Pass("initial", argv + i, argc - i) || Pass("rescan", argv + i, argc - i))
+		return 1;
+	if (Mutate(&appended, &rewritten, &bytes))
+		return 1;
+	if (Pass("update", argv + i, argc - i))
+		return 1;
+	printf("update: %d files appended, %d rewritten, %.1f MB written\n", appended, rewritten, bytes / 1e6);
+	return 0;
+}
@@ -18,6 +18,7 @@ using System.IO;
 using System.Runtime.InteropServices;
 using System.Security.Cryptography;
 using System.Threading;
+using System.Threading.Tasks;
 
 class Program
 {	
@@ -27,6 +28,19 @@ class Program
 	[DllImport("sc-hsm-ultralite.dll", CharSet=CharSet.Ansi, CallingConvention=CallingConvention.Cdecl)]
 	static extern int release_template();
 
+	[DllImport("sc-hsm-ultralite.dll", CharSet=CharSet.Ansi, CallingConvention=CallingConvention.Cdecl)]
+	static extern int sc_ctx_open(string reader, string pin, out IntPtr ctx);
+
+	[DllImport("sc-hsm-ultralite.dll", CharSet=CharSet.Ansi, CallingConvention=CallingConvention.Cdecl)]
+	static extern void sc_ctx_close(IntPtr ctx);
+
+	[UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+	delegate void SignHashAsyncCallback(int rc, IntPtr userData);
+
+	[DllImport("sc-hsm-ultralite.dll", CharSet=CharSet.Ansi, CallingConvention=CallingConvention.Cdecl)]
+	static extern int sc_ctx_sign_hash_async(IntPtr ctx, string label, byte[] hash, int hashLen,
+		IntPtr output, int outSize, SignHashAsyncCallback callback, IntPtr userData);
+
 	[DllImport("sc-hsm-ultralite.dll", CharSet=CharSet.Ansi, CallingConvention=CallingConvention.Cdecl)]
 	static extern void sha256_starts(byte[] ctx);
 
@@ -36,6 +50,58 @@ class Program
 	[DllImport("sc-hsm-ultralite.dll", CharSet=CharSet.Ansi, CallingConvention=CallingConvention.Cdecl)]
 	static extern void sha256_finish(byte[] ctx, byte[] digest);
 
+	// Pending sc_ctx_sign_hash_async request, the output buffer stays pinned until the callback
+	class SignRequest
+	{
+		public TaskCompletionSource<int> Result = new TaskCompletionSource<int>();
+		public GCHandle Output;
+	}
+
+	// One delegate for all requests, it must not be collected while requests are queued
+	static readonly SignHashAsyncCallback signHashCompleted = SignHashCompleted;
+
+	// Called from the worker thread of the context, completes the task of the request
+	static void SignHashCompleted(int rc, IntPtr userData)
+	{
+		GCHandle handle = GCHandle.FromIntPtr(userData);
+		SignRequest request = (SignRequest)handle.Target;
+		handle.Free();
+		request.Output.Free();
+		if (rc > 0)
+			request.Result.SetResult(rc);
+		else
+			request.Result.SetException(new IOException("sc_ctx_sign_hash_async returned " + rc));
+	}
+
+	// Sign the hash on the worker thread of the context into the caller buffer,
+	// the task returns the size of the CMS written at output.Offset
+	static Task<int> SignHashAsync(IntPtr ctx, string label, byte[] hash, ArraySegment<byte> output)
+	{
+		SignRequest request = new SignRequest();
+		request.Output = GCHandle.Alloc(output.Array, GCHandleType.Pinned);
+		GCHandle handle = GCHandle.Alloc(request);
+		IntPtr p = new IntPtr(request.Output.AddrOfPinnedObject().ToInt64() + output.Offset);
+		int rc = sc_ctx_sign_hash_async(ctx, label, hash, hash.Length, p, output.Count,
+			signHashCompleted, GCHandle.ToIntPtr(handle));
+		if (rc < 0) { // not queued, no callback
+			handle.Free();
+			request.Output.Free();
+			request.Result.SetException(new IOException("sc_ctx_sign_hash_async returned " + rc));
+		}
+		return request.Result.Task;
+	}
+
+	// Same as above with a buffer of maxCms bytes, the task returns the CMS
+	static Task<byte[]> SignHashAsync(IntPtr ctx, string label, byte[] hash, int maxCms)
+	{
+		byte[] output = new byte[maxCms];
+		return SignHashAsync(ctx, label, hash, new ArraySegment<byte>(output)).ContinueWith(t => {
+			byte[] cms = new byte[t.Result];
+			Array.Copy(output, cms, cms.Length);
+			return cms;
+		}, TaskContinuationOptions.ExecuteSynchronously);
+	}
+
 	static void Main(string[] args)
 	{
 		try {
@@ -52,7 +118,8 @@ class Program
 
 		// Check args
 		if (args.Length < 2) {
-			Console.WriteLine("Usage: pin label [count [wait-in-milliseconds]]\r\nSign this executable ({0}).", argv0);
+			Console.WriteLine("Usage: pin label [count [wait-in-milliseconds [async]]]\r\nSign this executable ({0}).\r\n" +
+				"With async all count signatures are queued at once (sc_ctx_sign_hash_async).", argv0);
 			return;
 		}
 
@@ -76,7 +143,12 @@ class Program
 		sha256_finish(ctx, hash);
 #endif
 
-		// Sign the hash of this executable n times, where n = count
+		if (args.Length >= 5 && args[4] == "async") {
+			SignAsync(args[0], args[1], hash, count, argv0);
+			return;
+		}
+
+		// Sign the hash of this executable n times, where n = count
 		try {
 			for (int i = 0; i < count; i++) {
 				if (i > 0 && count > 1) {
@@ -98,5 +170,31 @@ class Program
 			release_template();
 		}
 	}
+
+	// Queue count signatures on one context and wait for all of them
+	static void SignAsync(string pin, string label, byte[] hash, int count, string argv0)
+	{
+		IntPtr ctx;
+		int rc = sc_ctx_open(null, pin, out ctx);
+		if (rc < 0) {
+			Console.WriteLine("sc_ctx_open returned: {0}", rc);
+			return;
+		}
+		try {
+			Task<byte[]>[] tasks = new Task<byte[]>[count];
+			long start = Environment.TickCount;
+			for (int i = 0; i < count; i++)
+				tasks[i] = SignHashAsync(ctx, label, hash, 8192);
+			Task.WaitAll(tasks);
+			long end = Environment.TickCount;
+			Console.WriteLine("{0} signatures, time used: {1} ms", count, end - start);
+			if (count > 0)
+				File.WriteAllBytes(argv0 + ".p7s", tasks[count - 1].Result);
+		} catch (AggregateException ex) {
+			Console.WriteLine("sign failed: " + ex.InnerException.Message);
+		} finally {
+			sc_ctx_close(ctx); // completes the queued requests
+		}
+	}
 }
 
@@ -22,6 +22,51 @@
 #include <crtdbg.h>
 #endif
 
+/*
+ * Threads of the fleet mode (one per token) and of the key backup
+ * pipeline (card transfers overlapping the archive I/O).
+ */
+#ifdef _WIN32
+typedef CRITICAL_SECTION lock_t;
+typedef CONDITION_VARIABLE cond_t;
+typedef HANDLE thread_t;
+#define lock_init(l)      InitializeCriticalSection(l)
+#define lock_destroy(l)   DeleteCriticalSection(l)
+#define lock_enter(l)     EnterCriticalSection(l)
+#define lock_leave(l)     LeaveCriticalSection(l)
+#define cond_init(c)      InitializeConditionVariable(c)
+#define cond_destroy(c)
+#define cond_wait(c, l)   SleepConditionVariableCS(c, l, INFINITE)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#define THREAD_FUNC DWORD WINAPI
+static int thread_create(thread_t* t, LPTHREAD_START_ROUTINE func, void* arg)
+{
+	*t = CreateThread(0, 0, func, arg, 0, 0);
+	return *t ? 0 : -1;
+}
+static void thread_join(thread_t t)
+{
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+#else
+#include <pthread.h>
+typedef pthread_mutex_t lock_t;
+typedef pthread_cond_t cond_t;
+typedef pthread_t thread_t;
+#define lock_init(l)      pthread_mutex_init(l, 0)
+#define lock_destroy(l)   pthread_mutex_destroy(l)
+#define lock_enter(l)     pthread_mutex_lock(l)
+#define lock_leave(l)     pthread_mutex_unlock(l)
+#define cond_init(c)      pthread_cond_init(c, 0)
+#define cond_destroy(c)   pthread_cond_destroy(c)
+#define cond_wait(c, l)   pthread_cond_wait(c, l)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+#define THREAD_FUNC void*
+#define thread_create(t, func, arg) pthread_create(t, 0, func, arg)
+#define thread_join(t) pthread_join(t, 0)
+#endif
+
 int Hex2Bin(const char* hex, int len, uint8* bin)
 {
 	int i;
@@ -51,25 +96,17 @@ int Hex2Bin(const char* hex, int len, uint8* bin)
 	return 0;
 }
 
-int GetPinStatus()
+int GetPinStatus(SC_Card_t *card, const char *reader)
 {
-	uint16 sw1sw2;
-	int rc = SC_Open(0, 0);
-	if (rc < 0)
-		return rc;
-	/* - SmartCard-HSM: VERIFY */
-	rc = SC_ProcessAPDU(
-		0, 0x00,0x20,0x00,0x81,
-		NULL, 0,
-		NULL, 0,
-		&sw1sw2);
-	SC_Close();
+	int rc = SC_Open(card, 0, reader);
 	if (rc < 0)
 		return rc;
-	return sw1sw2;
+	rc = SC_GetPinStatus(card);
+	SC_Close(card);
+	return rc;
 }
 
-int InitializeToken(const char *pin, const char *sopin, int dkeksCount, uint8 *dkeks)
+int InitializeToken(SC_Card_t *card, const char *reader, const char *pin, const char *sopin, int dkeksCount, uint8 *dkeks)
 {
 	uint16 sw1sw2;
 	int rc, i;
@@ -105,37 +142,37 @@ int InitializeToken(const char *pin, const char *sopin, int dkeksCount, uint8 *d
 		*p++ = 0x92; *p++ = 0x01; *p++ = dkeksCount;
 	}
 
-	rc = SC_Open(0, 0);
+	rc = SC_Open(card, 0, reader);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: INITIALIZE DEVICE */
 	rc = SC_ProcessAPDU(
-		0, 0x80,0x50,0x00,0x00,
+		card, 0, 0x80,0x50,0x00,0x00,
 		data, (int)(p - data),
 		NULL, 0,
 		&sw1sw2);
 	if (rc < 0) {
-		SC_Close();
+		SC_Close(card);
 		return rc;
 	}
 	if (sw1sw2 != 0x9000) {
-		SC_Close();
+		SC_Close(card);
 		return sw1sw2;
 	}
 	for (i = 0, p = dkeks; i < dkeksCount; i++, p += 0x20) {
 		uint8 buf[10];
 		/* - SmartCard-HSM: IMPORT DKEK SHARE */
 		rc = SC_ProcessAPDU(
-			0, 0x80,0x52,0x00,0x00,
+			card, 0, 0x80,0x52,0x00,0x00,
 			p, 0x20,
 			buf, 10,
 			&sw1sw2);
 		if (rc < 0) {
-			SC_Close();
+			SC_Close(card);
 			return rc;
 		}
 		if (sw1sw2 != 0x9000) {
-			SC_Close();
+			SC_Close(card);
 			return sw1sw2;
 		}
 		printf("total shares: %d, outstanding shares: %d, key check value: %02x%02x%02x%02x%02x%02x%02x%02x\n",
@@ -143,11 +180,11 @@ int InitializeToken(const char *pin, const char *sopin, int dkeksCount, uint8 *d
 			buf[1],
 			buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8], buf[9]);
 	}
-	SC_Close();
+	SC_Close(card);
 	return sw1sw2;
 }
 
-int UnlockPin(const char *sopin)
+int UnlockPin(SC_Card_t *card, const char *reader, const char *sopin)
 {
 	uint16 sw1sw2;
 	int rc;
@@ -159,22 +196,22 @@ int UnlockPin(const char *sopin)
 	rc = Hex2Bin(sopin, 16, so_pin);
 	if (rc)
 		return rc;
-	rc = SC_Open(0, 0);
+	rc = SC_Open(card, 0, reader);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: RESET RETRY COUNTER */
 	rc = SC_ProcessAPDU(
-		0, 0x00,0x2C,0x01,0x81,
+		card, 0, 0x00,0x2C,0x01,0x81,
 		so_pin, 8,
 		NULL, 0,
 		&sw1sw2);
-	SC_Close();
+	SC_Close(card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
 }
 
-int SetPin(const char *pin, const char *sopin)
+int SetPin(SC_Card_t *card, const char *reader, const char *pin, const char *sopin)
 {
 	uint16 sw1sw2;
 	int rc;
@@ -196,22 +233,22 @@ int SetPin(const char *pin, const char *sopin)
 			return rc;
 	}
 	memcpy(so_pin_pin + 8, pin, pin_len); /* no 0 terminator */
-	rc = SC_Open(0, 0);
+	rc = SC_Open(card, 0, reader);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: RESET RETRY COUNTER */
 	rc = SC_ProcessAPDU(
-		0, 0x00,0x2C,0x00,0x81,
+		card, 0, 0x00,0x2C,0x00,0x81,
 		so_pin_pin, 8 + pin_len,
 		NULL, 0,
 		&sw1sw2);
-	SC_Close();
+	SC_Close(card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
 }
 
-int ChangePin(const char *oldpin, const char *newpin)
+int ChangePin(SC_Card_t *card, const char *reader, const char *oldpin, const char *newpin)
 {
 	uint16 sw1sw2;
 	int rc, old_len, new_len;
@@ -228,22 +265,22 @@ int ChangePin(const char *oldpin, const char *newpin)
 	}
 	memcpy(pins,           oldpin, old_len); /* no 0 terminator */
 	memcpy(pins + old_len, newpin, new_len); /* no 0 terminator */
-	rc = SC_Open(0, 0);
+	rc = SC_Open(card, 0, reader);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: CHANGE REFERENCE DATA */
 	rc = SC_ProcessAPDU(
-		0, 0x00,0x24,0x00,0x81,
+		card, 0, 0x00,0x24,0x00,0x81,
 		pins, old_len + new_len,
 		NULL, 0,
 		&sw1sw2);
-	SC_Close();
+	SC_Close(card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
 }
 
-int ChangeSoPin(const char *oldsopin, const char *newsopin)
+int ChangeSoPin(SC_Card_t *card, const char *reader, const char *oldsopin, const char *newsopin)
 {
 	uint16 sw1sw2;
 	int rc;
@@ -262,22 +299,22 @@ int ChangeSoPin(const char *oldsopin, const char *newsopin)
 	rc = Hex2Bin(newsopin, 16, so_pin_so_pin + 8);
 	if (rc)
 		return rc;
-	rc = SC_Open(0, 0);
+	rc = SC_Open(card, 0, reader);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: CHANGE REFERENCE DATA */
 	rc = SC_ProcessAPDU(
-		0, 0x00,0x24,0x00,0x88,
+		card, 0, 0x00,0x24,0x00,0x88,
 		so_pin_so_pin, 8 + 8,
 		NULL, 0,
 		&sw1sw2);
-	SC_Close();
+	SC_Close(card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
 }
 
-int WrapKey(const char *pin, int keyid, const char* filename)
+int WrapKey(SC_Card_t *card, const char *reader, const char *pin, int keyid, const char* filename)
 {
 	uint16 sw1sw2;
 	uint8 wrapped[1024];
@@ -286,28 +323,30 @@ int WrapKey(const char *pin, int keyid, const char* filename)
 		printf("keyid (%d) must be between 1 and 127\n", keyid);
 		return ERR_INVALID;
 	}
-	rc = SC_Open(pin, 0);
+	rc = SC_Open(card, pin, reader);
 	if (rc < 0)
 		return rc;
 	/* - SmartCard-HSM: WRAP KEY */
 	rc = SC_ProcessAPDU(
-		0, 0x80,0x72,keyid,0x92,
+		card, 0, 0x80,0x72,keyid,0x92,
 		NULL, 0,
 		wrapped, sizeof(wrapped),
 		&sw1sw2);
-	SC_Close();
-	if (rc <= 0)
+	SC_Close(card);
+	if (rc < 0)
 		return rc;
+	if (sw1sw2 != 0x9000)
+		return sw1sw2;
 	SaveToFile(filename, wrapped, rc);
 	return sw1sw2;
 }
 
-int UnwrapKey(const char *pin, int keyid, const char* filename)
+int UnwrapKey(SC_Card_t *card, const char *reader, const char *pin, int keyid, const char* filename)
 {
 	uint16 sw1sw2;
 	uint8 *pWrapped;
 	int len;
-	int rc = SC_Open(pin, 0);
+	int rc = SC_Open(card, pin, reader);
 	if (rc < 0)
 		return rc;
 	if (!(1 <= keyid && keyid <= 127)) {
@@ -326,51 +365,358 @@ int UnwrapKey(const char *pin, int keyid, const char* filename)
 	}
 	/* - SmartCard-HSM: UNWRAP KEY */
 	rc = SC_ProcessAPDU(
-		0, 0x80,0x74,keyid,0x93,
+		card, 0, 0x80,0x74,keyid,0x93,
 		pWrapped, len,
 		NULL, 0,
 		&sw1sw2);
 	free(pWrapped);
-	SC_Close();
+	SC_Close(card);
 	if (rc < 0)
 		return rc;
 	return sw1sw2;
 }
 
-int DumpAllFiles(const char *pin)
+/*
+ * Key archive of --backup-keys and --restore-keys: the magic KEY_MAGIC
+ * followed by one record per key, the key id (1 byte), the length of the
+ * wrapped key (2 bytes, big endian) and the wrapped key as returned by
+ * WRAP KEY.
+ */
+#define KEY_MAGIC "SC-HSM-KEYS\001"
+#define KEY_MAGIC_LEN 12
+
+/*
+ * Bounded queue of wrapped keys between the card and the archive, so
+ * that the next key is transferred while the previous one is written
+ * to (or read from) the archive. Slots hold card->MaxData bytes.
+ */
+#define PIPE_SLOTS 2
+
+typedef struct {
+	uint8 keyid;
+	int len;
+	uint8 *data;
+} Blob_t;
+
+typedef struct {
+	lock_t lock;
+	cond_t cond;
+	Blob_t slot[PIPE_SLOTS];
+	int size;       /* size of slot data */
+	int head, tail; /* number of slots filled and drained */
+	int eof;        /* producer done */
+	int abort;      /* consumer failed */
+	FILE *f;        /* archive of the I/O thread */
+	int rc;         /* result of the I/O thread */
+} Pipe_t;
+
+static int PipeInit(Pipe_t *pipe, int size, FILE *f)
+{
+	int i;
+	memset(pipe, 0, sizeof(*pipe));
+	for (i = 0; i < PIPE_SLOTS; i++) {
+		pipe->slot[i].data = (uint8*)malloc(size);
+		if (pipe->slot[i].data == NULL) {
+			while (i--)
+				free(pipe->slot[i].data);
+			return ERR_MEMORY;
+		}
+	}
+	pipe->size = size;
+	pipe->f = f;
+	lock_init(&pipe->lock);
+	cond_init(&pipe->cond);
+	return 0;
+}
+
+static void PipeFree(Pipe_t *pipe)
+{
+	int i;
+	for (i = 0; i < PIPE_SLOTS; i++)
+		free(pipe->slot[i].data);
+	cond_destroy(&pipe->cond);
+	lock_destroy(&pipe->lock);
+}
+
+/* next free slot of the producer, NULL if the consumer aborted */
+static Blob_t *PipePutBegin(Pipe_t *pipe)
+{
+	Blob_t *b = NULL;
+	lock_enter(&pipe->lock);
+	while (pipe->head - pipe->tail == PIPE_SLOTS && !pipe->abort)
+		cond_wait(&pipe->cond, &pipe->lock);
+	if (!pipe->abort)
+		b = &pipe->slot[pipe->head % PIPE_SLOTS];
+	lock_leave(&pipe->lock);
+	return b;
+}
+
+static void PipePutEnd(Pipe_t *pipe)
+{
+	lock_enter(&pipe->lock);
+	pipe->head++;
+	cond_broadcast(&pipe->cond);
+	lock_leave(&pipe->lock);
+}
+
+/* next filled slot of the consumer, NULL if the producer is done */
+static Blob_t *PipeGetBegin(Pipe_t *pipe)
+{
+	Blob_t *b = NULL;
+	lock_enter(&pipe->lock);
+	while (pipe->head == pipe->tail && !pipe->eof)
+		cond_wait(&pipe->cond, &pipe->lock);
+	if (pipe->head != pipe->tail)
+		b = &pipe->slot[pipe->tail % PIPE_SLOTS];
+	lock_leave(&pipe->lock);
+	return b;
+}
+
+static void PipeGetEnd(Pipe_t *pipe)
+{
+	lock_enter(&pipe->lock);
+	pipe->tail++;
+	cond_broadcast(&pipe->cond);
+	lock_leave(&pipe->lock);
+}
+
+/* producer (eof) or consumer (abort) done */
+static void PipeClose(Pipe_t *pipe, int abort)
+{
+	lock_enter(&pipe->lock);
+	if (abort)
+		pipe->abort = 1;
+	else
+		pipe->eof = 1;
+	cond_broadcast(&pipe->cond);
+	lock_leave(&pipe->lock);
+}
+
+/* I/O thread of BackupKeys: append the wrapped keys to the archive */
+static THREAD_FUNC ArchiveWriter(void *arg)
+{
+	Pipe_t *pipe = (Pipe_t*)arg;
+	Blob_t *b;
+	while ((b = PipeGetBegin(pipe)) != NULL) {
+		uint8 hdr[3];
+		hdr[0] = b->keyid;
+		hdr[1] = (uint8)(b->len >> 8);
+		hdr[2] = (uint8)b->len;
+		if (fwrite(hdr, 1, 3, pipe->f) != 3 || fwrite(b->data, 1, b->len, pipe->f) != (size_t)b->len) {
+			pipe->rc = ERR_INVALID;
+			PipeClose(pipe, 1);
+			break;
+		}
+		PipeGetEnd(pipe);
+	}
+	return 0;
+}
+
+/* I/O thread of RestoreKeys: read the wrapped keys from the archive */
+static THREAD_FUNC ArchiveReader(void *arg)
+{
+	Pipe_t *pipe = (Pipe_t*)arg;
+	Blob_t *b;
+	while ((b = PipePutBegin(pipe)) != NULL) {
+		uint8 hdr[3];
+		size_t n = fread(hdr, 1, 3, pipe->f);
+		if (n == 0 && feof(pipe->f))
+			break;
+		if (n != 3) {
+			pipe->rc = ERR_INVALID;
+			break;
+		}
+		b->keyid = hdr[0];
+		b->len = hdr[1] << 8 | hdr[2];
+		if (b->len == 0 || b->len > pipe->size) {
+			pipe->rc = ERR_INVALID;
+			break;
+		}
+		if (fread(b->data, 1, b->len, pipe->f) != (size_t)b->len) {
+			pipe->rc = ERR_INVALID;
+			break;
+		}
+		PipePutEnd(pipe);
+	}
+	PipeClose(pipe, 0);
+	return 0;
+}
+
+int BackupKeys(SC_Card_t *card, const char *reader, const char *pin, const char *filename)
+{
+	uint8 list[2 * 128];
+	uint16 sw1sw2;
+	Pipe_t pipe;
+	thread_t writer;
+	FILE *f;
+	int rc, n, i, count = 0, result = 0x9000;
+	rc = SC_Open(card, pin, reader);
+	if (rc < 0)
+		return rc;
+	/* - SmartCard-HSM: ENUMERATE OBJECTS */
+	rc = SC_ProcessAPDU(
+		card, 0, 0x80,0x58,0x00,0x00,
+		NULL, 0,
+		list, sizeof(list),
+		&sw1sw2);
+	if (rc < 0) {
+		SC_Close(card);
+		return rc;
+	}
+	n = rc;
+	f = fopen(filename, "wb");
+	if (f == NULL) {
+		SC_Close(card);
+		printf("cant create file '%s'\n", filename);
+		return ERR_INVALID;
+	}
+	if (fwrite(KEY_MAGIC, 1, KEY_MAGIC_LEN, f) != KEY_MAGIC_LEN
+		|| (rc = PipeInit(&pipe, card->MaxData, f)) < 0) {
+		fclose(f);
+		SC_Close(card);
+		return rc < 0 ? rc : ERR_INVALID;
+	}
+	if (thread_create(&writer, ArchiveWriter, &pipe)) {
+		PipeFree(&pipe);
+		fclose(f);
+		SC_Close(card);
+		return ERR_INVALID;
+	}
+	for (i = 0; i < n; i += 2) {
+		Blob_t *b;
+		int len;
+		uint8 keyid = list[i + 1];
+		if (list[i] != 0xcc || keyid == 0) /* keys only, except the device key */
+			continue;
+		b = PipePutBegin(&pipe);
+		if (b == NULL)
+			break;
+		/* - SmartCard-HSM: WRAP KEY */
+		len = SC_ProcessAPDU(
+			card, 0, 0x80,0x72,keyid,0x92,
+			NULL, 0,
+			b->data, pipe.size,
+			&sw1sw2);
+		if (len <= 0 || sw1sw2 != 0x9000) {
+			printf("key %d not wrapped: %d 0x%4x\n", keyid, len, sw1sw2);
+			result = len < 0 ? len : sw1sw2 != 0x9000 ? sw1sw2 : ERR_INVALID;
+			continue;
+		}
+		b->keyid = keyid;
+		b->len = len;
+		PipePutEnd(&pipe);
+		count++;
+	}
+	PipeClose(&pipe, 0);
+	thread_join(writer);
+	SC_Close(card);
+	if (fclose(f) || pipe.rc) {
+		printf("write error file '%s'\n", filename);
+		result = ERR_INVALID;
+	}
+	PipeFree(&pipe);
+	printf("%d keys written to '%s'\n", count, filename);
+	return result;
+}
+
+int RestoreKeys(SC_Card_t *card, const char *reader, const char *pin, const char *filename)
+{
+	uint8 magic[KEY_MAGIC_LEN];
+	uint16 sw1sw2;
+	Pipe_t pipe;
+	thread_t rdr;
+	Blob_t *b;
+	FILE *f;
+	int rc, count = 0, result = 0x9000;
+	f = fopen(filename, "rb");
+	if (f == NULL) {
+		printf("file '%s' not found\n", filename);
+		return ERR_INVALID;
+	}
+	if (fread(magic, 1, KEY_MAGIC_LEN, f) != KEY_MAGIC_LEN || memcmp(magic, KEY_MAGIC, KEY_MAGIC_LEN)) {
+		fclose(f);
+		printf("file '%s' is no key archive\n", filename);
+		return ERR_INVALID;
+	}
+	rc = SC_Open(card, pin, reader);
+	if (rc < 0) {
+		fclose(f);
+		return rc;
+	}
+	rc = PipeInit(&pipe, card->MaxData, f);
+	if (rc < 0) {
+		SC_Close(card);
+		fclose(f);
+		return rc;
+	}
+	if (thread_create(&rdr, ArchiveReader, &pipe)) {
+		PipeFree(&pipe);
+		SC_Close(card);
+		fclose(f);
+		return ERR_INVALID;
+	}
+	while ((b = PipeGetBegin(&pipe)) != NULL) {
+		/* - SmartCard-HSM: UNWRAP KEY */
+		rc = SC_ProcessAPDU(
+			card, 0, 0x80,0x74,b->keyid,0x93,
+			b->data, b->len,
+			NULL, 0,
+			&sw1sw2);
+		if (rc < 0 || sw1sw2 != 0x9000) {
+			printf("key %d not unwrapped: %d 0x%4x\n", b->keyid, rc, sw1sw2);
+			result = rc < 0 ? rc : sw1sw2;
+		} else {
+			count++;
+		}
+		PipeGetEnd(&pipe);
+	}
+	thread_join(rdr);
+	SC_Close(card);
+	fclose(f);
+	if (pipe.rc) {
+		printf("file '%s' is corrupt\n", filename);
+		result = ERR_INVALID;
+	}
+	PipeFree(&pipe);
+	printf("%d keys restored from '%s'\n", count, filename);
+	return result;
+}
+
+int DumpAllFiles(SC_Card_t *card, const char *reader, const char *pin, const char *prefix)
 {
 	uint8 list[2 * 128];
+	char name[64];
 	uint16 sw1sw2;
 	int rc, i;
-	rc = SC_Open(pin, 0);
+	rc = SC_Open(card, pin, reader);
 	if (rc < 0)
 		return rc;
 
 	/* - SmartCard-HSM: ENUMERATE OBJECTS */
 	rc = SC_ProcessAPDU(
-		0, 0x80,0x58,0x00,0x00,
+		card, 0, 0x80,0x58,0x00,0x00,
 		NULL, 0,
 		list, sizeof(list),
 		&sw1sw2);
 	if (rc < 0) {
-		SC_Close();
+		SC_Close(card);
 		return rc;
 	}
 	/* save dir and all files */
-	printf("write 'dir.hsm'\n");
-	SaveToFile("dir.hsm", list, rc);
+	sprintf(name, "%sdir.hsm", prefix);
+	printf("write '%s'\n", name);
+	SaveToFile(name, list, rc);
 	for (i = 0; i < rc; i += 2) {
 		uint8 buf[8192], *p;
-		char name[10];
 		int rc, off;
 		uint16 fid = list[i] << 8 | list[i + 1];
 		if (list[i] == 0xcc) /* never readable */
 			continue;
 		for (p = buf, off = 0; off < sizeof(buf); p += rc) {
 			int l = sizeof(buf) - off;
-			if (l > MAX_OUT_IN)
-				l = MAX_OUT_IN;
-			rc = SC_ReadFile(fid, off, p, l);
+			if (l > card->MaxData)
+				l = card->MaxData;
+			rc = SC_ReadFile(card, fid, off, p, l);
 			if (rc < 0)
 				break;
 			off += rc;
@@ -378,19 +724,70 @@ int DumpAllFiles(const char *pin)
 				break;
 		}
 		if (rc >= 0) {
-			sprintf(name, "%04X.asn", fid);
+			sprintf(name, "%s%04X.asn", prefix, fid);
 			printf("write '%s'\n", name);
 			SaveToFile(name, buf, off);
 		}
 	}
-	SC_Close();
+	SC_Close(card);
+	return 0;
+}
+
+int RestoreFiles(SC_Card_t *card, const char *reader, const char *pin, int count, char **names)
+{
+	int i, rc = SC_Open(card, pin, reader);
+	if (rc < 0)
+		return rc;
+	for (i = 0; i < count; i++) {
+		const char *name = names[i];
+		int dataLen, off;
+		uint8 *pData;
+		uint8 afid[2];
+		uint16 fid;
+		if (strlen(name) != 8 || strcmp(name + 4, ".asn") || Hex2Bin(name, 4, afid)) {
+			printf("filename '%s' must be 'abcd.asn' where abcd is a valid hex number\n", name);
+			continue;
+		}
+		fid = afid[0] << 8 | afid[1];
+		if (fid == 0x2f02) {
+			printf("filename '%s' skipped, EF_DevAut is readonly\n", name);
+			continue;
+		}
+		ReadFromFile(name, pData, dataLen);
+		if (pData == NULL) {
+			printf("cant read file '%s'\n", name);
+			continue;
+		}
+		if (dataLen == 0) {
+			free(pData);
+			printf("file '%s' empty\n", name);
+			continue;
+		}
+		rc = 0;
+		for (off = 0; off < dataLen;) {
+			int len = dataLen - off;
+			if (len > MAX_OUT_IN - 6)
+				len = MAX_OUT_IN - 6;
+			rc = SC_WriteFile(card, fid, off, pData + off, len);
+			if (rc < 0)
+				break;
+			off += len;
+		}
+		free(pData);
+		if (rc < 0) {
+			printf("write error %d file '%s'\n", rc, name);
+			continue;
+		}
+		printf("file '%s' successfully restored\n", name);
+	}
+	SC_Close(card);
 	return 0;
 }
 
 int Usage()
 {
 	printf("\
-Usage: action args...\n\n\
+Usage: [--all-readers | --readers=name,...] action args...\n\n\
   --get-pin-status \n\
   --save-files [pin] (write all token elementary files to disk)\n\
   --restore-files pin abcd.asn ... (restore the specified elementary files)\n\
@@ -400,152 +797,267 @@ Usage: action args...\n\n\
   --change-pin old-pin new-pin\n\
   --change-so-pin old-so-pin new-so-pin\n\
   --wrap-key pin key-id file-name\n\
-  --unwrap-key pin key-id file-name\n");
+  --unwrap-key pin key-id file-name\n\
+  --backup-keys pin file-name (write all wrapped keys to one archive)\n\
+  --restore-keys pin file-name (unwrap all keys of an archive)\n\n\
+With --all-readers or --readers the action runs on the tokens of all (or the\n\
+given) readers in parallel. Files written by --save-files, --wrap-key and\n\
+--backup-keys get the prefix 'n-', n being the number of the reader in the\n\
+list.\n");
 	return 1;
 }
 
-
-int main(int argc, char **argv)
+/*
+ * Run the action of argv[0] on the token in reader (0 selects the first
+ * token). tag prefixes the result message, prefix the names of the files
+ * written. Returns the exit code of the tool.
+ */
+int RunAction(SC_Card_t *card, const char *reader, const char *tag, const char *prefix, int argc, char **argv)
 {
-	int i, rc;
-#if defined(_WIN32) && defined(_DEBUG)
-	atexit((void(*)(void))_CrtDumpMemoryLeaks);
-#endif
-	if (argc < 2)
-		return Usage();
+	char name[256];
+	int rc;
 
-	if (strcmp(argv[1], "--get-pin-status") == 0) {
-		rc = GetPinStatus();
-		printf("get-pin-status returns: 0x%4x\n", rc);
-		return 0;
+	if (strcmp(argv[0], "--get-pin-status") == 0) {
+		rc = GetPinStatus(card, reader);
+		printf("%sget-pin-status returns: 0x%4x\n", tag, rc);
+		return rc < 0 ? rc : 0;
 	}
-	if (strcmp(argv[1], "--save-files") == 0) {
-		DumpAllFiles(argc >= 3 ? argv[2] : 0);
-		return 0;
+	if (strcmp(argv[0], "--save-files") == 0) {
+		return DumpAllFiles(card, reader, argc >= 2 ? argv[1] : 0, prefix);
 	}
-	if (argc < 3)
+	if (argc < 2)
 		return Usage();
 
-	if (strcmp(argv[1], "--restore-files") == 0) {
-		int rc = SC_Open(argv[2], 0);
-		if (rc < 0)
-			return rc;
-		for (i = 3; i < argc; i++) {
-			const char *name = argv[i];
-			int dataLen, off;
-			uint8 *pData;
-			uint8 afid[2];
-			uint16 fid;
-			if (strlen(name) != 8 || strcmp(name + 4, ".asn") || Hex2Bin(name, 4, afid)) {
-				printf("filename '%s' must be 'abcd.asn' where abcd is a valid hex number\n", name);
-				continue;
-			}
-			fid = afid[0] << 8 | afid[1];
-			if (fid == 0x2f02) {
-				printf("filename '%s' skipped, EF_DevAut is readonly\n", name);
-				continue;
-			}
-			ReadFromFile(name, pData, dataLen);
-			if (pData == NULL) {
-				printf("cant read file '%s'\n", name);
-				continue;
-			}
-			if (dataLen == 0) {
-				free(pData);
-				printf("file '%s' empty\n", name);
-				continue;
-			}
-			rc = 0;
-			for (off = 0; off < dataLen;) {
-				int len = dataLen - off;
-				if (len > MAX_OUT_IN - 6)
-					len = MAX_OUT_IN - 6;
-				rc = SC_WriteFile(fid, off, pData + off, len);
-				if (rc < 0)
-					break;
-				off += len;
-			}
-			free(pData);
-			if (rc < 0) {
-				printf("write error %d file '%s'\n", rc, name);
-				continue;
-			}
-			printf("file '%s' successfully restored\n", name);
-		}
-		SC_Close();
-		return 0;
-	}
-	if (strcmp(argv[1], "--init-token") == 0) {
+	if (strcmp(argv[0], "--restore-files") == 0)
+		return RestoreFiles(card, reader, argv[1], argc - 2, argv + 2);
+	if (strcmp(argv[0], "--init-token") == 0) {
 		int len;
 		uint8* buf;
 		switch (argc) {
 		default:
 			return Usage();
+		case 2:
+			rc = InitializeToken(card, reader, argv[1], NULL, 0, NULL);
+			break;
 		case 3:
-			rc = InitializeToken(argv[2], NULL, 0, NULL);
+			rc = InitializeToken(card, reader, argv[1], argv[2], 0, NULL);
 			break;
 		case 4:
-			rc = InitializeToken(argv[2], argv[3], 0, NULL);
-			break;
-		case 5:
-			ReadFromFile(argv[4], buf, len);
+			ReadFromFile(argv[3], buf, len);
 			if (buf == NULL) {
-				printf("file '%s' not found\n", argv[4]);
+				printf("file '%s' not found\n", argv[3]);
 				return ERR_INVALID;
 			}
 			if (len < 32 || (len & 31)) {
 				free(buf);
-				printf("file length of '%s' must be a positive multiple of 32\n", argv[4]);
+				printf("file length of '%s' must be a positive multiple of 32\n", argv[3]);
 				return ERR_INVALID;
 			}
-			rc = InitializeToken(argv[2], argv[3], len / 32, buf);
+			rc = InitializeToken(card, reader, argv[1], argv[2], len / 32, buf);
 			free(buf);
 			break;
 		}
-		printf("init-token returns: 0x%4x\n", rc);
+		printf("%sinit-token returns: 0x%4x\n", tag, rc);
+		return rc == 0x9000 ? 0 : rc;
+	}
+	if (strcmp(argv[0], "--unlock-pin") == 0) {
+		if (!(2 <= argc && argc <= 2))
+			return Usage();
+		rc = UnlockPin(card, reader, argv[1]);
+		printf("%sunlock-pin returns: 0x%4x\n", tag, rc);
+		return rc == 0x9000 ? 0 : rc;
+	}
+	if (strcmp(argv[0], "--set-pin") == 0) {
+		if (!(2 <= argc && argc <= 3))
+			return Usage();
+		rc = SetPin(card, reader, argv[1], argc == 2 ? NULL : argv[2]);
+		printf("%sset-pin returns: 0x%4x\n", tag, rc);
 		return rc == 0x9000 ? 0 : rc;
 	}
-	if (strcmp(argv[1], "--unlock-pin") == 0) {
+	if (strcmp(argv[0], "--change-pin") == 0) {
 		if (!(3 <= argc && argc <= 3))
 			return Usage();
-		rc = UnlockPin(argv[2]);
-		printf("unlock-pin returns: 0x%4x\n", rc);
+		rc = ChangePin(card, reader, argv[1], argv[2]);
+		printf("%schange-pin returns: 0x%4x\n", tag, rc);
 		return rc == 0x9000 ? 0 : rc;
 	}
-	if (strcmp(argv[1], "--set-pin") == 0) {
-		if (!(3 <= argc && argc <= 4))
+	if (strcmp(argv[0], "--change-so-pin") == 0) {
+		if (!(3 <= argc && argc <= 3))
 			return Usage();
-		rc = SetPin(argv[2], argc == 3 ? NULL : argv[3]);
-		printf("set-pin returns: 0x%4x\n", rc);
+		rc = ChangeSoPin(card, reader, argv[1], argv[2]);
+		printf("%schange-pin returns: 0x%4x\n", tag, rc);
 		return rc == 0x9000 ? 0 : rc;
 	}
-	if (strcmp(argv[1], "--change-pin") == 0) {
+	if (strcmp(argv[0], "--wrap-key") == 0) {
 		if (!(4 <= argc && argc <= 4))
 			return Usage();
-		rc = ChangePin(argv[2], argv[3]);
-		printf("change-pin returns: 0x%4x\n", rc);
+		snprintf(name, sizeof(name), "%s%s", prefix, argv[3]);
+		rc = WrapKey(card, reader, argv[1], atoi(argv[2]), name);
+		printf("%swrap-key returns: 0x%4x\n", tag, rc);
 		return rc == 0x9000 ? 0 : rc;
 	}
-	if (strcmp(argv[1], "--change-so-pin") == 0) {
+	if (strcmp(argv[0], "--unwrap-key") == 0) {
 		if (!(4 <= argc && argc <= 4))
 			return Usage();
-		rc = ChangeSoPin(argv[2], argv[3]);
-		printf("change-pin returns: 0x%4x\n", rc);
+		rc = UnwrapKey(card, reader, argv[1], atoi(argv[2]), argv[3]);
+		printf("%sunwrap-key returns: 0x%4x\n", tag, rc);
 		return rc == 0x9000 ? 0 : rc;
 	}
-	if (strcmp(argv[1], "--wrap-key") == 0) {
-		if (!(5 <= argc && argc <= 5))
+	if (strcmp(argv[0], "--backup-keys") == 0) {
+		if (!(3 <= argc && argc <= 3))
 			return Usage();
-		rc = WrapKey(argv[2], atoi(argv[3]), argv[4]);
-		printf("wrap-key returns: 0x%4x\n", rc);
+		snprintf(name, sizeof(name), "%s%s", prefix, argv[2]);
+		rc = BackupKeys(card, reader, argv[1], name);
+		printf("%sbackup-keys returns: 0x%4x\n", tag, rc);
 		return rc == 0x9000 ? 0 : rc;
 	}
-	if (strcmp(argv[1], "--unwrap-key") == 0) {
-		if (!(5 <= argc && argc <= 5))
+	if (strcmp(argv[0], "--restore-keys") == 0) {
+		if (!(3 <= argc && argc <= 3))
 			return Usage();
-		rc = UnwrapKey(argv[2], atoi(argv[3]), argv[4]);
-		printf("unwrap-key returns: 0x%4x\n", rc);
+		rc = RestoreKeys(card, reader, argv[1], argv[2]);
+		printf("%srestore-keys returns: 0x%4x\n", tag, rc);
 		return rc == 0x9000 ? 0 : rc;
 	}
 	return Usage();
 }
+
+/* one worker of the fleet mode (--all-readers, --readers), see RunFleet */
+typedef struct {
+	const char *reader;
+	char tag[128];
+	char prefix[16];
+	int argc;
+	char **argv;
+	int rc;
+} Worker_t;
+
+static lock_t progress_lock; /* serializes the progress messages */
+static int progress_done, progress_count;
+
+static THREAD_FUNC FleetWorker(void *arg)
+{
+	Worker_t *w = (Worker_t*)arg;
+	SC_Card_t card;
+	memset(&card, 0, sizeof(card));
+	w->rc = RunAction(&card, w->reader, w->tag, w->prefix, w->argc, w->argv);
+	lock_enter(&progress_lock);
+	progress_done++;
+	printf("[%d/%d] %s%s\n", progress_done, progress_count, w->tag, w->rc == 0 ? "done" : "failed");
+	lock_leave(&progress_lock);
+	return 0;
+}
+
+/*
+ * Run the action on the tokens of the readers in the multi string
+ * readers (as returned by SC_ListReaders) concurrently and print the
+ * results per token. Returns 0 if the action succeeded on all tokens.
+ */
+int RunFleet(char *readers, int count, int argc, char **argv)
+{
+	Worker_t *workers;
+	thread_t *threads;
+	char *reader;
+	int i, started, failed;
+
+	if (count <= 0) {
+		printf("no reader found\n");
+		return ERR_READER;
+	}
+	workers = (Worker_t*)calloc(count, sizeof(Worker_t));
+	threads = (thread_t*)calloc(count, sizeof(thread_t));
+	if (workers == NULL || threads == NULL) {
+		free(workers);
+		free(threads);
+		return ERR_MEMORY;
+	}
+	lock_init(&progress_lock);
+	progress_done = 0;
+	progress_count = count;
+	for (i = 0, reader = readers; i < count; i++, reader += strlen(reader) + 1) {
+		Worker_t *w = &workers[i];
+		w->reader = reader;
+		snprintf(w->tag, sizeof(w->tag), "%s: ", reader);
+		snprintf(w->prefix, sizeof(w->prefix), "%d-", i + 1);
+		w->argc = argc;
+		w->argv = argv;
+		w->rc = ERR_READER;
+	}
+	for (started = 0; started < count; started++) {
+		if (thread_create(&threads[started], FleetWorker, &workers[started])) {
+			printf("%scould not start worker\n", workers[started].tag);
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		thread_join(threads[i]);
+	lock_destroy(&progress_lock);
+
+	printf("\nresults:\n");
+	for (i = 0, failed = 0; i < count; i++) {
+		int rc = workers[i].rc;
+		if (rc == 0)
+			printf("  %d %s ok\n", i + 1, workers[i].reader);
+		else if (rc < 0)
+			printf("  %d %s failed (%d)\n", i + 1, workers[i].reader, rc);
+		else
+			printf("  %d %s failed (0x%4x)\n", i + 1, workers[i].reader, rc);
+		if (rc)
+			failed++;
+	}
+	printf("%d of %d tokens succeeded\n", count - failed, count);
+	free(threads);
+	free(workers);
+	return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	SC_Card_t card;
+	char *readers, *p;
+	int rc, count;
+#if defined(_WIN32) && defined(_DEBUG)
+	atexit((void(*)(void))_CrtDumpMemoryLeaks);
+#endif
+	if (argc < 2)
+		return Usage();
+
+	if (strcmp(argv[1], "--all-readers") == 0) {
+		if (argc < 3)
+			return Usage();
+		count = SC_ListReaders(&readers);
+		if (count < 0) {
+			printf("no reader found\n");
+			return count;
+		}
+		rc = RunFleet(readers, count, argc - 2, argv + 2);
+		free(readers);
+		return rc;
+	}
+	if (strncmp(argv[1], "--readers=", 10) == 0) {
+		if (argc < 3 || argv[1][10] == 0)
+			return Usage();
+		/* turn the comma separated list into a multi string */
+		readers = (char*)malloc(strlen(argv[1] + 10) + 2);
+		if (readers == NULL)
+			return ERR_MEMORY;
+		strcpy(readers, argv[1] + 10);
+		for (p = readers, count = 1; *p; p++) {
+			if (*p == ',') {
+				*p = 0;
+				count++;
+			}
+		}
+		p[1] = 0;
+		for (p = readers, rc = 0; *p; p += strlen(p) + 1)
+			rc++;
+		if (rc != count) { /* empty reader name */
+			free(readers);
+			return Usage();
+		}
+		rc = RunFleet(readers, count, argc - 2, argv + 2);
+		free(readers);
+		return rc;
+	}
+	memset(&card, 0, sizeof(card));
+	return RunAction(&card, 0, "", "", argc - 1, argv + 1);
+}
@@ -12,6 +12,14 @@
  * @author Keith Morgan
  */
 
+#include "log.h"
+
+int log_level = LOG_LEVEL_INF;
+
+/* The lines are written directly, see ultralite-signer/log.c for the background writer */
+int log_start(void) { return 0; }
+void log_stop(void) {}
+
 #if defined(NO_LOG) /* No Logging */
 
 void _log_err(const char* fmt, ...) {}
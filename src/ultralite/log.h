@@ -24,6 +24,17 @@ void _log_err(const char* fmt, ...);
 void _log_wrn(const char* fmt, ...);
 void _log_inf(const char* fmt, ...);
 
+/* Messages above log_level are dropped before they are formatted. */
+#define LOG_LEVEL_ERR 0
+#define LOG_LEVEL_WRN 1
+#define LOG_LEVEL_INF 2
+extern int log_level;
+
+/* Queue the lines for a background writer until log_stop (ultralite-signer/log.c),
+   the library writes them directly. log_stop writes the lines still queued. */
+int log_start(void);
+void log_stop(void);
+
 #if defined(_DEBUG) || defined(DEBUG)
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
@@ -32,8 +43,8 @@ void _log_inf(const char* fmt, ...);
 #else
 #define log_err(fmt, ...) _log_err(fmt   "\n", ##__VA_ARGS__)
 #endif
-#define log_wrn(fmt, ...) _log_wrn(fmt   "\n", ##__VA_ARGS__)
-#define log_inf(fmt, ...) _log_inf(fmt   "\n", ##__VA_ARGS__) 
+#define log_wrn(fmt, ...) do { if (log_level >= LOG_LEVEL_WRN) _log_wrn(fmt "\n", ##__VA_ARGS__); } while (0)
+#define log_inf(fmt, ...) do { if (log_level >= LOG_LEVEL_INF) _log_inf(fmt "\n", ##__VA_ARGS__); } while (0)
 
 #ifdef __cplusplus
 }
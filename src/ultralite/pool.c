@@ -0,0 +1,389 @@
+/**
+ * SmartCard-HSM Ultra-Light Library
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file pool.c
+ * @brief Pool of tokens holding the same key (label) with load balancing
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/mutex.h>
+
+#include "log.h"
+#include "utils.h"
+#include "sc-hsm-ultralite.h"
+
+/*
+	A pool opens a signing context for every token which holds a key and template with
+	the requested label. Each signature is dispatched to one token:
+
+	SC_POOL_ROUND_ROBIN        the tokens are used in turn
+	SC_POOL_LEAST_OUTSTANDING  the token with the fewest waiting or running requests is used
+
+	A token that fails (e.g. pulled from the reader) is skipped and the request is retried
+	on the next token (failover). Failed tokens are tried again as soon as no healthy token is left,
+	the context reopens the session itself once the token is back.
+
+	With the CT-API driver the pool also listens for readers attached or detached (SC_WatchReaders):
+	the token of a detached reader is marked failed at once instead of after a failed request,
+	it is healthy again when the reader is back, and readers attached later are added to the pool
+	by the next request, as far as they hold the key.
+
+	The pool functions are thread safe, requests for different tokens run in parallel.
+	The signature is always written into a caller buffer (see sign_hash_into), or passed
+	to a callback for a batch of hashes (see sign_hashes). A batch is signed on one token,
+	the hashes left unsigned by a failing token are signed on the next one.
+*/
+
+#define SC_POOL_MAX_TOKENS 64 /* ports of the CT-API reader registry, bits of tried */
+
+typedef struct {
+	sign_ctx_t *Ctx;
+	MUTEX Mutex;      /* serializes the use of Ctx */
+	int Outstanding;  /* waiting or running requests, protected by the pool mutex */
+	int Failed;       /* last request failed, protected by the pool mutex */
+	int Port;         /* reader port for SC_WatchReaders (CT-API), -1 otherwise */
+} PoolToken_t;
+
+struct sign_pool {
+	MUTEX Mutex;
+	int Policy;
+	int Count;
+	int Next;         /* next token for round robin */
+	char *Label;
+	char *Pin;
+	int Watching;     /* SC_WatchReaders succeeded */
+	int Attached;     /* a reader not in the pool was attached, protected by the pool mutex */
+	int Adding;       /* a request adds the tokens of attached readers, protected by the pool mutex */
+	int KeepWarm;     /* interval of sc_pool_keep_warm for tokens attached later, protected by the pool mutex */
+	PoolToken_t Token[SC_POOL_MAX_TOKENS];
+};
+
+/* batch of sc_pool_sign_hashes on one token */
+typedef struct {
+	sign_hashes_callback_t Callback;
+	void *UserData;
+	int Offset;       /* index of the 1st hash of the batch */
+	int Done;         /* signatures passed to the callback */
+	int Abort;        /* negative return value of the callback */
+} PoolBatch_t;
+
+/* errors which are not caused by the token, no failover */
+static int IsRequestError(int rc)
+{
+	return rc == ERR_INVALID || rc == ERR_MEMORY || rc == ERR_HASH || rc == ERR_TIME;
+}
+
+/* select a token not yet tried for this request, -1 if none is left */
+static int SelectToken(sign_pool_t *pool, unsigned long long tried)
+{
+	int i, j, best = -1, pass;
+	/* 1st pass: healthy tokens only, 2nd pass: also failed tokens */
+	for (pass = 0; pass < 2 && best < 0; pass++) {
+		for (j = 0; j < pool->Count; j++) {
+			i = (pool->Next + j) % pool->Count;
+			if (tried & 1ull << i || pool->Token[i].Failed && pass == 0)
+				continue;
+			if (best < 0) {
+				best = i;
+				if (pool->Policy == SC_POOL_ROUND_ROBIN)
+					break;
+			} else if (pool->Token[i].Outstanding < pool->Token[best].Outstanding) {
+				best = i;
+			}
+		}
+	}
+	if (best >= 0)
+		pool->Next = (best + 1) % pool->Count;
+	return best;
+}
+
+/* open the token in the specified reader if it holds the key and template, 0 on success */
+static int OpenToken(sign_pool_t *pool, PoolToken_t *t, const char *reader)
+{
+	if (sc_ctx_open(reader, pool->Pin, &t->Ctx) < 0)
+		return -1;
+	if (sc_ctx_load_template(t->Ctx, pool->Label) < 0 || mutex_init(&t->Mutex)) {
+		sc_ctx_close(t->Ctx);
+		t->Ctx = 0;
+		return -1;
+	}
+	t->Port = pool->Watching ? atoi(reader) : -1;
+	mutex_lock(&pool->Mutex);
+	if (pool->KeepWarm)
+		sc_ctx_keep_warm(t->Ctx, pool->KeepWarm);
+	mutex_unlock(&pool->Mutex);
+	return 0;
+}
+
+/* reader event (see SC_WatchReaders), called from the USB event thread */
+static void ReaderEvent(unsigned short port, int attached, void *arg)
+{
+	sign_pool_t *pool = (sign_pool_t*)arg;
+	int i, found = 0;
+	mutex_lock(&pool->Mutex);
+	for (i = 0; i < pool->Count; i++) {
+		/* the slots of a multi-slot reader share the port in the low byte */
+		if (pool->Token[i].Port % 256 == port) {
+			pool->Token[i].Failed = !attached;
+			found = 1;
+		}
+	}
+	if (attached && !found)
+		pool->Attached = 1;
+	mutex_unlock(&pool->Mutex);
+}
+
+/* add the tokens of the readers attached since the last call, by one request at a time */
+static void AddTokens(sign_pool_t *pool)
+{
+	char *readers, *reader;
+	int i;
+	mutex_lock(&pool->Mutex);
+	if (!pool->Attached || pool->Adding) {
+		mutex_unlock(&pool->Mutex);
+		return;
+	}
+	pool->Attached = 0;
+	pool->Adding = 1;
+	mutex_unlock(&pool->Mutex);
+	if (SC_ListReaders(&readers) >= 0) {
+		for (reader = readers; *reader && pool->Count < SC_POOL_MAX_TOKENS; reader += strlen(reader) + 1) {
+			/* only this request appends tokens, Count is stable */
+			for (i = 0; i < pool->Count && pool->Token[i].Port != atoi(reader); i++)
+				;
+			if (i < pool->Count || OpenToken(pool, &pool->Token[pool->Count], reader) < 0)
+				continue;
+			log_inf("pool '%s': token %d in reader '%s' attached", pool->Label, pool->Count, reader);
+			mutex_lock(&pool->Mutex);
+			pool->Count++;
+			mutex_unlock(&pool->Mutex);
+		}
+		free(readers);
+	}
+	mutex_lock(&pool->Mutex);
+	pool->Adding = 0;
+	mutex_unlock(&pool->Mutex);
+}
+
+/*
+ *  Open all tokens holding the key and template with the specified label
+ *
+ *  pin         : smartcard pin (same for all tokens)
+ *  label       : key and template label
+ *  policy      : SC_POOL_ROUND_ROBIN or SC_POOL_LEAST_OUTSTANDING
+ *  pPool       : returns the pool in *pPool
+ *
+ *  Returns : number of tokens in the pool or error if < 0
+ */
+int EXPORT_FUNC sc_pool_open(const char *pin, const char *label, int policy, sign_pool_t **pPool)
+{
+	sign_pool_t *pool;
+	char *readers, *reader;
+	int rc;
+	*pPool = 0;
+	if (label == 0 || policy != SC_POOL_ROUND_ROBIN && policy != SC_POOL_LEAST_OUTSTANDING)
+		return ERR_INVALID;
+	pool = (sign_pool_t*)calloc(1, sizeof(sign_pool_t));
+	if (pool == 0)
+		return ERR_MEMORY;
+	pool->Policy = policy;
+	pool->Label = (char*)malloc(strlen(label) + 1);
+	pool->Pin = pin ? (char*)malloc(strlen(pin) + 1) : 0;
+	if (pool->Label == 0 || pin && pool->Pin == 0 || mutex_init(&pool->Mutex)) {
+		free(pool->Label);
+		free(pool->Pin);
+		free(pool);
+		return ERR_MEMORY;
+	}
+	strcpy(pool->Label, label);
+	if (pin)
+		strcpy(pool->Pin, pin);
+	/* before the reader list, a reader attached in between is added by the next request */
+	pool->Watching = SC_WatchReaders(ReaderEvent, pool) == 0;
+	rc = SC_ListReaders(&readers);
+	if (rc < 0) {
+		sc_pool_close(pool);
+		return rc;
+	}
+	for (reader = readers; *reader && pool->Count < SC_POOL_MAX_TOKENS; reader += strlen(reader) + 1) {
+		if (OpenToken(pool, &pool->Token[pool->Count], reader) < 0)
+			continue;
+		log_inf("pool '%s': token %d in reader '%s'", label, pool->Count, reader);
+		mutex_lock(&pool->Mutex);
+		pool->Count++;
+		mutex_unlock(&pool->Mutex);
+	}
+	free(readers);
+	if (pool->Count == 0) {
+		log_err("pool '%s': no token found", label);
+		sc_pool_close(pool);
+		return ERR_CARD;
+	}
+	*pPool = pool;
+	return pool->Count;
+}
+
+int EXPORT_FUNC sc_pool_size(sign_pool_t *pool)
+{
+	return pool ? pool->Count : 0;
+}
+
+/*
+ *  Signature of specified hash on one of the tokens of the pool
+ *
+ *  Returns : CMS size or error if <= 0 (see sign_hash_into)
+ */
+int EXPORT_FUNC sc_pool_sign_hash_into(sign_pool_t *pool,
+	const unsigned char *hash, int hashLen,
+	unsigned char *out, int outSize)
+{
+	PoolToken_t *t;
+	unsigned long long tried = 0;
+	int rc = ERR_CARD, i;
+	if (pool == 0)
+		return ERR_INVALID;
+	if (pool->Attached)
+		AddTokens(pool);
+	for (;;) {
+		mutex_lock(&pool->Mutex);
+		i = SelectToken(pool, tried);
+		if (i < 0) {
+			mutex_unlock(&pool->Mutex);
+			return rc; /* all tokens tried, return the last error */
+		}
+		t = &pool->Token[i];
+		t->Outstanding++;
+		mutex_unlock(&pool->Mutex);
+
+		mutex_lock(&t->Mutex);
+		rc = sc_ctx_sign_hash_into(t->Ctx, pool->Label, hash, hashLen, out, outSize);
+		mutex_unlock(&t->Mutex);
+
+		mutex_lock(&pool->Mutex);
+		t->Outstanding--;
+		t->Failed = rc <= 0 && !IsRequestError(rc);
+		mutex_unlock(&pool->Mutex);
+
+		if (rc > 0 || IsRequestError(rc))
+			return rc;
+		log_wrn("pool '%s': token %d failed with %d, trying next token", pool->Label, i, rc);
+		tried |= 1ull << i;
+	}
+}
+
+/* pass the signature with the index in the whole batch */
+static int BatchCallback(int index, const unsigned char *pCMS, int cmsLen, void *userData)
+{
+	PoolBatch_t *b = (PoolBatch_t*)userData;
+	int rc = b->Callback(b->Offset + index, pCMS, cmsLen, b->UserData);
+	if (rc < 0)
+		b->Abort = rc;
+	else
+		b->Done++;
+	return rc;
+}
+
+/*
+ *  Signature of a batch of hashes on one of the tokens of the pool
+ *
+ *  The callback is called for each signature as with sign_hashes. If the token fails,
+ *  the hashes not signed yet are signed on the next token, so each index is passed once.
+ *
+ *  Returns : number of signatures or error if < 0
+ */
+int EXPORT_FUNC sc_pool_sign_hashes(sign_pool_t *pool,
+	const unsigned char *hashes[], int hashLen, int count,
+	sign_hashes_callback_t callback, void *userData)
+{
+	PoolToken_t *t;
+	PoolBatch_t b;
+	unsigned long long tried = 0;
+	int rc = ERR_CARD, i, n;
+	if (pool == 0 || count < 0 || count > 0 && (hashes == 0 || callback == 0))
+		return ERR_INVALID;
+	if (pool->Attached)
+		AddTokens(pool);
+	b.Callback = callback;
+	b.UserData = userData;
+	b.Offset = 0;
+	b.Abort = 0;
+	while (b.Offset < count) {
+		n = count - b.Offset;
+		mutex_lock(&pool->Mutex);
+		i = SelectToken(pool, tried);
+		if (i < 0) {
+			mutex_unlock(&pool->Mutex);
+			return rc; /* all tokens tried, return the last error */
+		}
+		t = &pool->Token[i];
+		t->Outstanding += n; /* a batch weighs as its hashes */
+		mutex_unlock(&pool->Mutex);
+
+		b.Done = 0;
+		mutex_lock(&t->Mutex);
+		rc = sc_ctx_sign_hashes(t->Ctx, pool->Label, hashes + b.Offset, hashLen, n, BatchCallback, &b);
+		mutex_unlock(&t->Mutex);
+		if (rc >= 0 && b.Done < n)
+			rc = ERR_CARD;
+
+		mutex_lock(&pool->Mutex);
+		t->Outstanding -= n;
+		t->Failed = rc < 0 && !b.Abort && !IsRequestError(rc);
+		mutex_unlock(&pool->Mutex);
+
+		b.Offset += b.Done;
+		if (b.Abort)
+			return b.Abort;
+		if (rc >= 0 || IsRequestError(rc))
+			return rc >= 0 ? count : rc;
+		log_wrn("pool '%s': token %d failed with %d after %d of %d signatures, trying next token",
+			pool->Label, i, rc, b.Done, n);
+		tried |= 1ull << i;
+	}
+	return count;
+}
+
+/*
+ *  Keep all tokens of the pool warm while they are idle (see sc_ctx_keep_warm)
+ *
+ *  Returns : 0 or error if < 0
+ */
+int EXPORT_FUNC sc_pool_keep_warm(sign_pool_t *pool, int intervalMs)
+{
+	int i, rc = 0;
+	if (pool == 0)
+		return ERR_INVALID;
+	mutex_lock(&pool->Mutex);
+	pool->KeepWarm = intervalMs;
+	for (i = 0; i < pool->Count && rc == 0; i++)
+		rc = sc_ctx_keep_warm(pool->Token[i].Ctx, intervalMs);
+	mutex_unlock(&pool->Mutex);
+	return rc;
+}
+
+void EXPORT_FUNC sc_pool_close(sign_pool_t *pool)
+{
+	int i;
+	if (pool == 0)
+		return;
+	if (pool->Watching)
+		SC_UnwatchReaders(ReaderEvent, pool);
+	for (i = 0; i < pool->Count; i++) {
+		sc_ctx_close(pool->Token[i].Ctx);
+		mutex_destroy(&pool->Token[i].Mutex);
+	}
+	mutex_destroy(&pool->Mutex);
+	free(pool->Label);
+	free(pool->Pin);
+	free(pool);
+}
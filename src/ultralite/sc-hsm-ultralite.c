@@ -10,8 +10,8 @@
  *
  * @file sc-hsm-ultralite.c
  * @author Christoph Brunhuber
- * @brief Functions for RSA-2k signing of SHA-256
- *                  ECDSA-prime256 signing of SHA-256
+ * @brief Functions for RSA-2k/3k/4k signing of SHA-256, SHA-384, SHA-512
+ *                  ECDSA-prime256 signing of SHA-256, SHA-384, SHA-512
  *                  Card Devices, Version 1.0
  */
 
@@ -22,8 +22,19 @@
 
 #include "log.h"
 #include "utils.h"
+#include "stats.h"
 #include "sc-hsm-ultralite.h"
 
+#if (defined(_WIN32) || defined(__linux__)) && !defined(SC_STATIC_MEMORY)
+#define ASYNC_WORKER /* worker thread for sc_ctx_sign_hash_async, otherwise it signs synchronously */
+#include <common/mutex.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
 /*
 	This code implements "template-based" signing.
 	A detached CMS signature file (Cryptographic Message Syntax, RFC 5652) is an ASN.1
@@ -39,10 +50,11 @@
 	Specifically the MessageDigest, the SigningTime and the Signature itself are the dynamic
 	fields, all other fields are static. Because a RSA signature from the same key always has
 	the same size, the CMS signature file can be produced from a template by simply patching the 3
-	fields. The needed cryptographic ciphers are, hashing (here SHA256) and the RSA private key
-	operation. The RSA operation is actually running on the token (no crypto code required).
+	fields. The needed cryptographic ciphers are, hashing (SHA-256, SHA-384 or SHA-512, as given by the
+	hash length of the template) and the RSA private key operation. The RSA operation is actually running
+	on the token (no crypto code required).
 	In this specific case the raw RSA private key operation is used, so the PKCS#1.5 padding is also
-	implemented here (trivial).
+	implemented here (trivial). The padded block is built once per template, only the hash is filled in.
 	The template itself is a small header + a valid CMS signature file (for an arbitrary document). It is stored as PKCS11 data on the token.
 	The link between a private key and a template is the label.
 	The template contains also a patch plan (offset of the fields which need to be changed).
@@ -62,16 +74,36 @@
 	The functions sign_hash and release_template are not thread safe. Further the signature passed back from sign_hash
 	is invalidated by another sign_hash call. In other words, the caller must use the result or copy the result before
 	calling sign_hash again. The sign_hash call and the usage of the signature data must be mutually exclusive.
+	Multi-threaded callers should use the context functions (sc_ctx_open, sc_ctx_sign_hash, sc_ctx_close) instead.
+	Each context owns its own token session, template cache and signature buffer, so threads using distinct contexts
+	(and distinct tokens) can sign in parallel. A single context must not be used by two threads at the same time.
+	The exception is sc_ctx_sign_hash_async, which any thread may call: the requests of a context are queued and
+	signed one after the other by a worker thread of the context, which invokes the callback of each request.
+	The same thread sends the keep-warm ticks of an idle context (see sc_ctx_keep_warm), it never runs in
+	parallel with a call of the context.
+	The functions sign_hash and sign_hash2 use an internal default context.
 	The function release_template should be called at the very end. Calling release_template is mandatory on an OS where 
 	you do not have isolated processes and the OS does not automatically release task-allocated memory after task
 	termination (e.g. WIN16)
 
-	For performance reasons, sign_hash internally caches the last used template. If you need to sign multiple files with
-	different keys (labels) you should sign the files with the first key, then the files with the second key
-	and so on. Otherwise the template has to be loaded from the token for each file. The function sign_hash is robust against
-	token changes.
+	For performance reasons, sign_hash internally caches the last TEMPLATE_CACHE_SIZE used templates (least recently used
+	entry is evicted first) and keeps the token session open across label switches. Signing files with different keys
+	(labels) in any order therefore only loads each template once, as long as no more than TEMPLATE_CACHE_SIZE
+	different labels are in use. The function sign_hash is robust against token changes: the reader status
+	(PC/SC card handle state and ATR, CT-API ICC status) is checked before each signature and only a reported
+	card event triggers a new session and a comparison of the cert id stored in the template.
 
 	The exposed hash functions are thread safe as long as you use distinct contexts.
+
+	STATIC MEMORY PROFILE:
+
+	Compiled with SC_STATIC_MEMORY the library does not use the heap after sc_ctx_open (sign_hash and its
+	variants not at all, the default context is static). The templates are loaded into TEMPLATE_CACHE_SIZE + 1
+	slots of the context, each sized by TEMPLATE_MAX_CMS, TEMPLATE_MAX_SIGNATURE and TEMPLATE_MAX_LABEL, the
+	object index holds OBJECT_INDEX_SIZE labels and the APDUs are built in the buffer of MAX_OUT_IN data bytes
+	of SC_Card_t instead of the stack. A template or label exceeding its maximum is rejected. The persistent
+	template cache and the worker thread of sc_ctx_sign_hash_async are not available, the USB library
+	(ctccid) allocates its reader context in CT_init.
 */
 
 /*******************************************************************************
@@ -82,16 +114,16 @@
  *******************************************************************************
  ******************************************************************************
 
-/* Warning: case sensitive */
-static int FindLabel(const char *label, const uint8* buf, int len)
+/* returns the length of the label in the descriptor buf and the label in *pLabel or -1 if none */
+static int GetLabel(const uint8* buf, int len, const uint8 **pLabel)
 {
 	int val, ix = 0;
 
 #define ReturnIfTagIsNot(tag1, tag2)\
 	if (ix >= len || buf[ix] != tag1 && buf[ix] != tag2)\
-		return 0;\
+		return -1;\
 	if (++ix >= len)\
-		return 0;\
+		return -1;\
 	val = buf[ix++];\
 	if (val >= 0x80)\
 		ix += 1 + (val & 0x7f); /* skip over length bytes */
@@ -103,28 +135,161 @@ static int FindLabel(const char *label, const uint8* buf, int len)
 /*     UTF8String */
 	ReturnIfTagIsNot(0x0c, 0x0c);
 	if (val >= 0x80)
-		return 0;  /* assume length < 128 */
-	val += ix; /* end of UTF8String */
-	if (val > len)
-		return 0;
-	/* compare passed label with label of file */
-	while (ix < val && *label) {
-		if (*label++ != buf[ix++]) /* case sensitive */
-			return 0;
-	}
-	return ix == val && *label == 0;
+		return -1;  /* assume length < 128 */
+	if (ix + val > len)
+		return -1;
+	*pLabel = buf + ix;
+	return val;
 
 #undef ReturnIfTagIsNot
 }
 
-static int FindFid(uint8 hi, uint8 lo, const uint8* buf, int len)
+/*
+	Label index of the token objects, built once per session by a single ENUMERATE OBJECTS
+	and one READ BINARY per descriptor. Maps the label (case sensitive) to the key fid and the
+	template fid in an open addressing hash table.
+*/
+#ifndef SC_STATIC_MEMORY
+#define OBJECT_INDEX_SIZE 256 /* power of 2, ENUMERATE OBJECTS returns up to 128 fids */
+#else
+#ifndef OBJECT_INDEX_SIZE
+#define OBJECT_INDEX_SIZE 32 /* power of 2, labels of a full index are skipped */
+#endif
+#ifndef TEMPLATE_MAX_LABEL
+#define TEMPLATE_MAX_LABEL 31
+#endif
+#endif
+
+typedef struct {
+	char *Label;
+	uint16 KeyFid;
+	uint16 TemplateFid;
+#ifdef SC_STATIC_MEMORY
+	char LabelBuf[TEMPLATE_MAX_LABEL + 1]; /* storage of Label */
+#endif
+} ObjectEntry_t;
+
+typedef struct {
+	ObjectEntry_t Entry[OBJECT_INDEX_SIZE];
+} ObjectIndex_t;
+
+static void FreeObjectIndex(ObjectIndex_t *index)
 {
+#ifndef SC_STATIC_MEMORY
 	int i;
-	for (i = 0; i < len; i += 2) {
-		if (buf[i] == hi && buf[i + 1] == lo)
-			return i;
+	if (index == 0)
+		return;
+	for (i = 0; i < OBJECT_INDEX_SIZE; i++)
+		free(index->Entry[i].Label);
+	free(index);
+#endif
+}
+
+/* returns the entry of label, a new entry if insert is set or NULL */
+static ObjectEntry_t *LookupObject(ObjectIndex_t *index, const char *label, int len, int insert)
+{
+	ObjectEntry_t *e = 0;
+	unsigned int i, n, h = 2166136261u; /* FNV-1a */
+	for (i = 0; i < (unsigned int)len; i++)
+		h = (h ^ (uint8)label[i]) * 16777619u;
+	/* at most 128 entries, there is always a free slot unless the index is smaller (SC_STATIC_MEMORY) */
+	for (i = h & (OBJECT_INDEX_SIZE - 1), n = 0;; i = (i + 1) & (OBJECT_INDEX_SIZE - 1)) {
+		if (n++ == OBJECT_INDEX_SIZE)
+			return 0;
+		e = &index->Entry[i];
+		if (e->Label == 0)
+			break;
+		if ((int)strlen(e->Label) == len && memcmp(e->Label, label, len) == 0)
+			return e;
+	}
+	if (!insert)
+		return 0;
+#ifdef SC_STATIC_MEMORY
+	if (len > TEMPLATE_MAX_LABEL)
+		return 0;
+	e->Label = e->LabelBuf;
+#else
+	e->Label = (char*)malloc(len + 1);
+	if (e->Label == 0)
+		return 0;
+#endif
+	memcpy(e->Label, label, len);
+	e->Label[len] = 0;
+	return e;
+}
+
+#define FID_KEY               0x01 /* 0xCCxx */
+#define FID_KEY_DESCRIPTOR    0x02 /* 0xC4xx */
+#define FID_DATA              0x04 /* 0xCDxx */
+#define FID_DATA_DESCRIPTOR   0x08 /* 0xC9xx */
+
+/* slot: storage of the index with SC_STATIC_MEMORY, unused otherwise */
+static int BuildObjectIndex(SC_Card_t *card, ObjectIndex_t *slot, ObjectIndex_t **pIndex)
+{
+	ObjectIndex_t *index;
+	uint8 list[2 * 128], types[256];
+	uint16 sw1sw2;
+	int rc, i;
+	*pIndex = 0;
+	/* - SmartCard-HSM: ENUMERATE OBJECTS */
+	rc = SC_ProcessAPDU(
+		card, 0, 0x80,0x58,0x00,0x00,
+		0, 0,
+		list, sizeof(list),
+		&sw1sw2);
+	if (rc < 0)
+		return rc;
+	if (sw1sw2 != 0x9000 && sw1sw2 != 0x6282)
+		return ERR_APDU;
+#ifdef SC_STATIC_MEMORY
+	index = slot;
+	memset(index, 0, sizeof(ObjectIndex_t));
+#else
+	index = (ObjectIndex_t*)calloc(1, sizeof(ObjectIndex_t));
+	if (index == 0)
+		return ERR_MEMORY;
+#endif
+	/* file types by name (lower 8 bits), avoids searching the list for the associated file */
+	memset(types, 0, sizeof(types));
+	for (i = 0; i + 1 < rc; i += 2) {
+		switch (list[i]) {
+		case 0xCC: types[list[i + 1]] |= FID_KEY; break;
+		case 0xC4: types[list[i + 1]] |= FID_KEY_DESCRIPTOR; break;
+		case 0xCD: types[list[i + 1]] |= FID_DATA; break;
+		case 0xC9: types[list[i + 1]] |= FID_DATA_DESCRIPTOR; break;
+		}
+	}
+	/* the 1st key and the 1st template with a label win */
+	for (i = 0; i + 1 < rc; i += 2) {
+		uint8 lo = list[i + 1], buf[256];
+		const uint8 *label;
+		ObjectEntry_t *e;
+		int len;
+		if (list[i] == 0xCC && (types[lo] & FID_KEY_DESCRIPTOR))
+			len = SC_ReadFile(card, 0xC400 | lo, 0, buf, sizeof(buf));
+		else if (list[i] == 0xCD && (types[lo] & FID_DATA_DESCRIPTOR))
+			len = SC_ReadFile(card, 0xC900 | lo, 0, buf, sizeof(buf));
+		else
+			continue;
+		if (len <= 0 || (len = GetLabel(buf, len, &label)) < 0)
+			continue;
+		e = LookupObject(index, (const char*)label, len, 1);
+		if (e == 0) {
+#ifdef SC_STATIC_MEMORY
+			log_wrn("label '%.*s' skipped, object index full or label too long", len, (const char*)label);
+			continue;
+#else
+			FreeObjectIndex(index);
+			return ERR_MEMORY;
+#endif
+		}
+		if (list[i] == 0xCC && e->KeyFid == 0)
+			e->KeyFid = 0xCC00 | lo;
+		else if (list[i] == 0xCD && e->TemplateFid == 0)
+			e->TemplateFid = 0xCD00 | lo;
 	}
-	return -1;
+	*pIndex = index;
+	return 0;
 }
 
 /*
@@ -158,57 +323,42 @@ static int FindFid(uint8 hi, uint8 lo, const uint8* buf, int len)
 	If found: enumerate through all 0xCDjj files and open the associated 0xC9jj descriptor file.
 	Check if it has the same label.
 	In case of success we have found a template associates with a key.
+	All labels are read once into the object index of the session (see BuildObjectIndex), the
+	index is rebuilt if the label is missing, e.g. the key or template was created since.
 	Templates could be also used with PKCS11 without a crypto library.
 	The approach in this library is much simpler, you do not even need a PKCS11 library, here it is managed
 	on a lower level, but specific to the SC-HSM (CardContact) card.
 */
-static int GetFids(const char *label, uint16 *pKeyFid, uint16 *pTemplateFid)
+static int GetFids(SC_Card_t *card, ObjectIndex_t *slot, ObjectIndex_t **pIndex, const char *label, uint16 *pKeyFid, uint16 *pTemplateFid)
 {
-	uint8 list[2 * 128];
-	uint16 sw1sw2;
-	int rc, i;
+	ObjectEntry_t *e;
+	int rc, built = 0;
 	*pKeyFid = 0;
 	*pTemplateFid = 0;
-	/* - SmartCard-HSM: ENUMERATE OBJECTS */
-	rc = SC_ProcessAPDU(
-		0, 0x80,0x58,0x00,0x00,
-		0, 0,
-		list, sizeof(list),
-		&sw1sw2);
-	if (rc < 0)
-		return rc;
-	if (sw1sw2 != 0x9000 && sw1sw2 != 0x6282)
-		return ERR_APDU;
-	/* find key file id */
-	for (i = 0; i < rc; i += 2) {
-		if (list[i] == 0xCC && FindFid(0xC4, list[i + 1], list, rc) >= 0) {
-			uint8 buf[256];
-			int rc = SC_ReadFile(0xC400 | list[i + 1], 0, buf, sizeof(buf));
-			if (rc > 0 && FindLabel(label, buf, rc)) {
-				*pKeyFid = 0xCC00 | list[i + 1];
-				break;
-			}
+	for (;;) {
+		if (*pIndex == 0) {
+			rc = BuildObjectIndex(card, slot, pIndex);
+			if (rc < 0)
+				return rc;
+			built = 1;
 		}
+		e = LookupObject(*pIndex, label, strlen(label), 0);
+		if (e && e->KeyFid && e->TemplateFid || built)
+			break;
+		/* not in the index of an earlier call, the objects may have been created since */
+		FreeObjectIndex(*pIndex);
+		*pIndex = 0;
 	}
-	if (*pKeyFid == 0) {
+	if (e == 0 || e->KeyFid == 0) {
 		log_err("key '%s' not found", label);
 		return ERR_KEY;
 	}
-	/* find template file id */
-	for (i = 0; i < rc; i += 2) {
-		if (list[i] == 0xCD && FindFid(0xC9, list[i + 1], list, rc) >= 0) {
-			uint8 buf[256];
-			int rc = SC_ReadFile(0xC900 | list[i + 1], 0, buf, sizeof(buf));
-			if (rc > 0 && FindLabel(label, buf, rc)) {
-				*pTemplateFid = 0xCD00 | list[i + 1];
-				break;
-			}
-		}
-	}
-	if (*pTemplateFid == 0) {
+	if (e->TemplateFid == 0) {
 		log_err("template '%s' not found", label);
 		return ERR_TEMPLATE;
 	}
+	*pKeyFid = e->KeyFid;
+	*pTemplateFid = e->TemplateFid;
 	return 0;
 }
 
@@ -220,6 +370,29 @@ static int GetFids(const char *label, uint16 *pKeyFid, uint16 *pTemplateFid)
  *******************************************************************************
  ******************************************************************************/
 
+/*
+	The ECDSA signature returned by the token is 70, 71 or 72 bytes long, 6 length fields of the
+	enclosing ASN.1 elements depend on it. A layout holds the values for one signature size.
+*/
+#define ECDSA_LEN_FIELDS (6)
+
+typedef struct {
+	uint16 CMSLen;
+	uint16 Len[ECDSA_LEN_FIELDS];
+} ECDSALayout_t;
+
+#define TEMPLATE_VERSION (0)
+#define TEMPLATE_HEADER_LENGTH (20)
+
+#ifdef SC_STATIC_MEMORY /* size of the template slots */
+#ifndef TEMPLATE_MAX_CMS
+#define TEMPLATE_MAX_CMS 2048
+#endif
+#ifndef TEMPLATE_MAX_SIGNATURE
+#define TEMPLATE_MAX_SIGNATURE 512 /* RSA-4k, 256 for RSA-2k and ECDSA */
+#endif
+#endif
+
 typedef struct {
 	uint8 Version;
 	uint8 HeaderLength;
@@ -236,41 +409,242 @@ typedef struct {
 	uint16 KeyFid;
 	uint16 TemplateFid;
 	uint8 *pCms;
+	union {
+		sha256_context Sha256;
+		sha512_context Sha512; /* SHA-384 and SHA-512 */
+	} Midstate; /* hash state after the constant prefix of the signed attributes */
+	uint16 MidstateLen; /* length of the prefix, multiple of the block size of the hash */
+	uint8 *Frame; /* RSA only: PKCS#1 v1.5 block 00 01 FF .. FF 00 DigestInfo hash, see PrepareRSAFrame */
+	uint16 LenOff[ECDSA_LEN_FIELDS]; /* ECDSA only: offsets of the length fields depending on the signature size */
+	uint8 LenSize[ECDSA_LEN_FIELDS]; /* 1 or 2 bytes */
+	ECDSALayout_t Layout[3]; /* ECDSA only: layouts for 70, 71 and 72 bytes signatures */
+	uint8 Header[TEMPLATE_HEADER_LENGTH]; /* raw header as read from the token */
+#ifdef SC_STATIC_MEMORY
+	uint8 CmsBuf[TEMPLATE_MAX_CMS + 2]; /* storage of pCms and Frame */
+	uint8 FrameBuf[TEMPLATE_MAX_SIGNATURE];
+	char Label[TEMPLATE_MAX_LABEL + 1];
+#else
 	char Label[1]; /* space for the 0 terminator, need calloc(1, sizeof(Template_t) + strlen(label)) */
+#endif
 } Template_t;
 
-static Template_t *This; /* current template (singleton) */
+#ifndef TEMPLATE_CACHE_SIZE
+#if defined(_WIN32) || defined(__linux__)
+#define TEMPLATE_CACHE_SIZE 8
+#else /* save heap space on systems with limited memory */
+#define TEMPLATE_CACHE_SIZE 1
+#endif
+#endif
 
-#define TEMPLATE_VERSION (0)
-#define TEMPLATE_HEADER_LENGTH (20)
+#ifdef ASYNC_WORKER
+/* queued request of sc_ctx_sign_hash_async */
+typedef struct AsyncRequest {
+	struct AsyncRequest *Next;
+	uint8 Hash[64];
+	int HashLen;
+	uint8 *Out;
+	int OutSize;
+	sign_hash_async_callback_t Callback;
+	void *UserData;
+	char Label[1]; /* space for the 0 terminator, need malloc(sizeof(AsyncRequest_t) + strlen(label)) */
+} AsyncRequest_t;
+
+typedef struct {
+	CONDVAR Cond; /* protects the queue and Started/Stop */
+	AsyncRequest_t *Head, *Tail;
+	int Started; /* thread running, see StartWorker */
+	int Stop; /* sc_ctx_close: finish the queue and exit */
+	int KeepWarm; /* keep-warm interval in ms or 0, see sc_ctx_keep_warm */
+	int Hold; /* copy of sign_ctx.Hold for the thread */
+	int Held; /* PC/SC transaction held, released Hold ms after LastUse */
+	unsigned long long LastUse; /* StatsNow() after the last use of the token */
+	MUTEX Busy; /* serializes the calls of the context and the keep-warm ticks */
+#ifdef _WIN32
+	HANDLE Thread;
+#else
+	pthread_t Thread;
+#endif
+} AsyncWorker_t;
+#endif
+
+struct sign_ctx {
+	SC_Card_t Card;
+	int SessionOpen; /* token session open (SC_Open succeeded) */
+	int SessionSuspect; /* last signature failed, recover the session before the next use */
+	Template_t *Cache[TEMPLATE_CACHE_SIZE]; /* cached templates, most recently used first */
+	ObjectIndex_t *Index; /* label index of the token objects or NULL */
+#ifdef SC_STATIC_MEMORY
+	Template_t Slot[TEMPLATE_CACHE_SIZE + 1]; /* storage of the cached templates and the one being loaded */
+	ObjectIndex_t IndexSlot; /* storage of Index */
+#define INDEX_SLOT(ctx) (&(ctx)->IndexSlot)
+#else
+#define INDEX_SLOT(ctx) 0
+#endif
+	char *Reader; /* only used via sc_ctx_open */
+	char *Pin;
+	char *CacheDir; /* directory of the persistent template cache or NULL */
+	time_t SigningTimeSec; /* time of the cached SigningTime string */
+	char SigningTime[16];
+	int Hold; /* hold time of the PC/SC transaction in ms or 0, see sc_ctx_hold_card */
+	int CardHeld; /* transaction held after the last operation */
+#ifdef ASYNC_WORKER
+	AsyncWorker_t *Worker; /* only used via sc_ctx_open */
+#endif
+};
 
-static int LoadTemplate(const char *label)
+static sign_ctx_t DefaultCtx; /* used by sign_hash, sign_hash2 and release_template */
+
+
+/* returns a new template for label, or 0 if the label is too long or out of memory */
+static Template_t *NewTemplate(sign_ctx_t *ctx, const char *label)
 {
-	uint8 *pCms;
-	int rc, end, off, labelLen;
-	if (label == 0)
-		return ERR_INVALID;
-	labelLen = strlen(label);
-	This = (Template_t*)calloc(1, sizeof(Template_t) + labelLen);
-	if (This == 0)
-		return ERR_MEMORY;
-	memcpy(This->Label, label, labelLen + 1); /* include 0 terminator */
-	rc = GetFids(label, &This->KeyFid, &This->TemplateFid);
-	if (rc < 0)
-		goto error;
-	/* read template header */
-	rc = SC_ReadFile(This->TemplateFid, 0, (uint8*)This, TEMPLATE_HEADER_LENGTH);
-	if (rc < 0)
-		goto error;
-	if (rc != TEMPLATE_HEADER_LENGTH) {
-		log_err("template '%s' invalid header length", label);
-		rc = ERR_TEMPLATE;
-		goto error;
+	Template_t *t;
+	int labelLen = strlen(label);
+#ifdef SC_STATIC_MEMORY
+	int i, j;
+	if (labelLen > TEMPLATE_MAX_LABEL) {
+		log_err("label '%s' longer than %d", label, TEMPLATE_MAX_LABEL);
+		return 0;
 	}
-	if (This->Version != TEMPLATE_VERSION || This->HeaderLength != TEMPLATE_HEADER_LENGTH) {
-		rc = ERR_VERSION;
-		goto error;
+	/* one of the slots is not in the cache */
+	for (i = 0; i < TEMPLATE_CACHE_SIZE; i++) {
+		for (j = 0; j < TEMPLATE_CACHE_SIZE && ctx->Cache[j] != &ctx->Slot[i]; j++)
+			;
+		if (j == TEMPLATE_CACHE_SIZE)
+			break;
+	}
+	t = &ctx->Slot[i];
+	memset(t, 0, sizeof(Template_t));
+	t->pCms = t->CmsBuf;
+	t->Frame = t->FrameBuf;
+#else
+	t = (Template_t*)calloc(1, sizeof(Template_t) + labelLen);
+	if (t == 0)
+		return 0;
+#endif
+	memcpy(t->Label, label, labelLen + 1); /* include 0 terminator */
+	return t;
+}
+
+/* the slot of a template (SC_STATIC_MEMORY) is reused as soon as it is not in the cache */
+static void FreeTemplate(Template_t *t)
+{
+#ifndef SC_STATIC_MEMORY
+	if (t == 0)
+		return;
+	free(t->pCms);
+	free(t->Frame);
+	free(t);
+#endif
+}
+
+/* RSA-2k, RSA-3k or RSA-4k */
+static int IsRSATemplate(const Template_t *t)
+{
+	return t->SignatureSize == 256 || t->SignatureSize == 384 || t->SignatureSize == 512;
+}
+
+/* returns the cached template for label and moves it to the front, 0 if not cached */
+static Template_t *FindTemplate(sign_ctx_t *ctx, const char *label)
+{
+	Template_t *t;
+	int i, j;
+	for (i = 0; i < TEMPLATE_CACHE_SIZE && ctx->Cache[i]; i++) {
+		if (strcmp(ctx->Cache[i]->Label, label) == 0) {
+			t = ctx->Cache[i];
+			for (j = i; j > 0; j--)
+				ctx->Cache[j] = ctx->Cache[j - 1];
+			ctx->Cache[0] = t;
+			return t;
+		}
+	}
+	return 0;
+}
+
+/* inserts the template at the front, evicts the least recently used template if the cache is full */
+static void InsertTemplate(sign_ctx_t *ctx, Template_t *t)
+{
+	int i = TEMPLATE_CACHE_SIZE - 1;
+	FreeTemplate(ctx->Cache[i]);
+	for (; i > 0; i--)
+		ctx->Cache[i] = ctx->Cache[i - 1];
+	ctx->Cache[0] = t;
+}
+
+/*
+	Walk the ASN.1 structure of an ECDSA template once and prebuild the layouts for all signature sizes:
+	SEQUENCE                      // ContentInfo, length field 0
+		OID
+		CONT [0]                  // length field 1
+			SEQUENCE              // SignedData, length field 2
+				INTEGER version
+				SET digestAlgorithms
+				SEQUENCE encapContentInfo
+				CONT [0] certificates
+				SET                   // SignerInfos, length field 3
+					SEQUENCE          // SignerInfo, length field 4
+						...
+						OCTET STRING  // signature, length field 5
+*/
+static int PrepareECDSALayouts(Template_t *This)
+{
+	const uint8 *p = This->pCms;
+	const uint8 *end = This->pCms + This->SignatureOff;
+	int i, n = 0, delta;
+
+#define ReturnIfNot(cond) if (p + 4 > end || !(cond)) return ERR_TEMPLATE;
+#define AddLenField(size) This->LenOff[n] = (uint16)(p - This->pCms + 2); This->LenSize[n++] = size;
+
+	ReturnIfNot(p[0] == 0x30 && p[1] == 0x82) // SEQUENCE
+	AddLenField(2)
+	p += 4;
+	ReturnIfNot(p[0] == 0x06) // OID
+	p += 2 + p[1]; // skip OID
+	ReturnIfNot(p[0] == 0xA0 && p[1] == 0x82) // CONT [0]
+	AddLenField(2)
+	p += 4;
+	ReturnIfNot(p[0] == 0x30 && p[1] == 0x82) // SEQUENCE
+	AddLenField(2)
+	p += 4;
+	ReturnIfNot(p[0] == 0x02) // INTEGER version
+	p += 2 + p[1]; // skip
+	ReturnIfNot(p[0] == 0x31) // SET
+	p += 2 + p[1]; // skip
+	ReturnIfNot(p[0] == 0x30) // SEQUENCE
+	p += 2 + p[1]; // skip
+	ReturnIfNot(p[0] == 0xA0 && p[1] == 0x82) // CONT [0]
+	p += 4 + (p[2] << 8 | p[3]); // skip
+	ReturnIfNot(p[0] == 0x31 && p[1] == 0x81) // SET
+	This->LenOff[n] = (uint16)(p - This->pCms + 2); This->LenSize[n++] = 1;
+	p += 3;
+	ReturnIfNot(p[0] == 0x30 && p[1] == 0x81) // SEQUENCE
+	This->LenOff[n] = (uint16)(p - This->pCms + 2); This->LenSize[n++] = 1;
+	// OCTET string containing the signature
+	// works because the the length is 70, 71 or 72
+	if (This->SignatureOff < 2 || This->pCms[This->SignatureOff - 2] != 0x04)
+		return ERR_TEMPLATE;
+	This->LenOff[n] = This->SignatureOff - 1; This->LenSize[n++] = 1;
+
+#undef AddLenField
+#undef ReturnIfNot
+
+	for (delta = 0; delta < 3; delta++) {
+		ECDSALayout_t *l = &This->Layout[2 - delta]; /* signature size 72 - delta */
+		l->CMSLen = This->CMSLen - delta;
+		for (i = 0; i < ECDSA_LEN_FIELDS; i++) {
+			p = This->pCms + This->LenOff[i];
+			l->Len[i] = (This->LenSize[i] == 2 ? p[0] << 8 | p[1] : p[0]) - delta;
+		}
 	}
+	return 0;
+}
+
+/* copy the raw (big endian) template header to This and check it */
+static int ParseTemplateHeader(Template_t *This, const uint8 *header, const char *label)
+{
+	memcpy(This, header, TEMPLATE_HEADER_LENGTH);
+	if (This->Version != TEMPLATE_VERSION || This->HeaderLength != TEMPLATE_HEADER_LENGTH)
+		return ERR_VERSION;
 #ifdef LITTLE_ENDIAN
 #define swap16(field) This->field = This->field >> 8 | This->field << 8;
 	swap16(HashLen)
@@ -287,179 +661,462 @@ static int LoadTemplate(const char *label)
 	/*
 		Sanity checks
 	*/
-	if (This->HashLen != 32) {
-		log_err("currently only SHA256 supported");
-		rc = ERR_SANITY;
-		goto error;
+	if (This->HashLen != 32 && This->HashLen != 48 && This->HashLen != 64) {
+		log_err("only SHA-256, SHA-384 and SHA-512 supported");
+		return ERR_SANITY;
+	}
+	if (!IsRSATemplate(This) && This->SignatureSize != 72) {
+		log_err("signature size %d not supported", This->SignatureSize);
+		return ERR_SANITY;
 	}
 	if (!(0 < This->SignedAttributesOff && This->SignedAttributesOff + This->SignedAttributesLen < This->SignatureOff)) {
 		log_err("signed attributes offset/length invalid");
-		rc = ERR_SANITY;
-		goto error;
+		return ERR_SANITY;
 	}
 	if (!(This->SignedAttributesOff < This->SigningTimeOff
 		&& This->SigningTimeOff + 13 <= This->SignedAttributesOff + This->SignedAttributesLen)) {
 		log_err("signing time offset invalid");
-		rc = ERR_SANITY;
-		goto error;
+		return ERR_SANITY;
 	}
 	if (!(This->SignedAttributesOff < This->MessageDigestOff
 		&& This->MessageDigestOff + This->HashLen <= This->SignedAttributesOff + This->SignedAttributesLen)) {
 		log_err("MessageDigest-Offset missing or invalid");
-		rc = ERR_SANITY;
-		goto error;
+		return ERR_SANITY;
 	}
 	if (!(0 < This->SignatureOff && This->SignatureOff + This->SignatureSize <= This->CMSLen)) {
 		log_err("Signature-Offset missing or invalid");
-		rc = ERR_SANITY;
+		return ERR_SANITY;
+	}
+	if (This->CertIdOff + 32 > This->CMSLen) {
+		log_err("CertId-Offset invalid");
+		return ERR_SANITY;
+	}
+#ifdef SC_STATIC_MEMORY
+	if (This->CMSLen > TEMPLATE_MAX_CMS || IsRSATemplate(This) && This->SignatureSize > TEMPLATE_MAX_SIGNATURE) {
+		log_err("template '%s' exceeds TEMPLATE_MAX_CMS or TEMPLATE_MAX_SIGNATURE", label);
+		return ERR_MEMORY;
+	}
+#endif
+	return 0;
+}
+
+/*
+	DigestInfo of the PKCS#1 v1.5 signature block without the hash:
+
+		SEQUENCE
+			SEQUENCE
+				OID of hash
+				NULL
+			OCTETSTRING hash
+*/
+static const uint8 *GetDigestInfo(int hashLen, int *encLen)
+{
+	static const uint8 encSHA256[] =
+		"\x30\x31\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x01\x05\x00\x04\x20";
+	static const uint8 encSHA384[] =
+		"\x30\x41\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x02\x05\x00\x04\x30";
+	static const uint8 encSHA512[] =
+		"\x30\x51\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x03\x05\x00\x04\x40";
+	switch (hashLen) {
+	case 32:          /* SHA-256 */
+		*encLen = sizeof(encSHA256) - 1;
+		return encSHA256;
+	case 48:          /* SHA-384 */
+		*encLen = sizeof(encSHA384) - 1;
+		return encSHA384;
+	case 64:          /* SHA-512 */
+		*encLen = sizeof(encSHA512) - 1;
+		return encSHA512;
+	}
+	return 0;
+}
+
+/*
+	Build 0x00, 0x01, 0xff, ... , 0xff, 0x00, DigestInfo, hash once per template.
+	The total size must match exactly the RSA modulus size (e.g. RSA2k: 2048 bits == 256 bytes),
+	the hash at the end is filled in before each signature (see PatchRSATemplate).
+*/
+static int PrepareRSAFrame(Template_t *This)
+{
+	const uint8 *enc;
+	int ix, encLen;
+	enc = GetDigestInfo(This->HashLen, &encLen);
+	if (enc == 0)
+		return ERR_HASH;
+#ifndef SC_STATIC_MEMORY
+	This->Frame = (uint8*)calloc(1, This->SignatureSize);
+	if (This->Frame == 0)
+		return ERR_MEMORY;
+#endif
+	ix = This->SignatureSize - This->HashLen;
+	memcpy(This->Frame + (ix -= encLen), enc, encLen);
+	This->Frame[ix -= 1] = 0;
+	memset(This->Frame + 2, -1, ix - 2);
+	This->Frame[1] = 1;
+	This->Frame[0] = 0;
+	return 0;
+}
+
+/* precomputations after the template body has been read */
+static int PrepareTemplate(Template_t *This, const char *label)
+{
+	uint8 *pCms, oldTag;
+	int rc, end, block = This->HashLen == 32 ? 64 : 128;
+	/*
+		Everything before the first dynamic field (SigningTime or MessageDigest) is constant,
+		precompute the hash state of the complete blocks (64 or 128 bytes) of that prefix
+	*/
+	end = This->SigningTimeOff < This->MessageDigestOff ? This->SigningTimeOff : This->MessageDigestOff;
+	This->MidstateLen = (end - This->SignedAttributesOff) & ~(block - 1);
+	pCms = This->pCms + This->SignedAttributesOff;
+	oldTag = pCms[0];
+	pCms[0] = 0x31; /* change from CONT [0] to SET tag */
+	if (This->HashLen == 32) {
+		sha256_starts(&This->Midstate.Sha256);
+		sha256_update(&This->Midstate.Sha256, pCms, This->MidstateLen);
+	} else {
+		if (This->HashLen == 48)
+			sha384_starts(&This->Midstate.Sha512);
+		else
+			sha512_starts(&This->Midstate.Sha512);
+		sha512_update(&This->Midstate.Sha512, pCms, This->MidstateLen);
+	}
+	pCms[0] = oldTag; /* restore CONT [0] */
+	if (This->SignatureSize == 72) { /* ECDSA */
+		rc = PrepareECDSALayouts(This);
+		if (rc < 0) {
+			log_err("template '%s' invalid ECDSA structure", label);
+			return rc;
+		}
+	} else {
+		rc = PrepareRSAFrame(This);
+		if (rc < 0) {
+			log_err("template '%s' RSA block not built", label);
+			return rc;
+		}
+	}
+	return 0;
+}
+
+static int LoadTemplate(sign_ctx_t *ctx, const char *label, Template_t **ppTemplate)
+{
+	SC_Card_t *card = &ctx->Card;
+	Template_t *This;
+	uint8 *pCms;
+	unsigned long long start;
+	int rc, end, off;
+	*ppTemplate = 0;
+	if (label == 0)
+		return ERR_INVALID;
+	This = NewTemplate(ctx, label);
+	if (This == 0)
+		return ERR_MEMORY;
+	start = StatsNow();
+	rc = GetFids(card, INDEX_SLOT(ctx), &ctx->Index, label, &This->KeyFid, &This->TemplateFid);
+	StatsAddPhase(SC_STATS_GET_FIDS, start);
+	if (rc < 0)
+		goto error;
+	/* read template header */
+	rc = SC_ReadFile(card, This->TemplateFid, 0, This->Header, TEMPLATE_HEADER_LENGTH);
+	if (rc < 0)
+		goto error;
+	if (rc != TEMPLATE_HEADER_LENGTH) {
+		log_err("template '%s' invalid header length", label);
+		rc = ERR_TEMPLATE;
 		goto error;
 	}
-	This->pCms = (uint8*)calloc(1, This->CMSLen);
+	rc = ParseTemplateHeader(This, This->Header, label);
+	if (rc < 0)
+		goto error;
+	/* 2 spare bytes, so that each portion is received in place (see SC_ReadBinary) */
+#ifndef SC_STATIC_MEMORY
+	This->pCms = (uint8*)calloc(1, This->CMSLen + 2);
 	if (This->pCms == 0) {
 		rc = ERR_MEMORY;
 		goto error;
 	}
-	/* read template body in MAX_OUT_IN bytes portions */
+#endif
+	/* read template body in portions of the maximum data length of the reader, usually one READ BINARY */
 	off = TEMPLATE_HEADER_LENGTH;
 	end = off + This->CMSLen;
 	pCms = This->pCms;
 	while (off < end) {
 		int len = end - off;
-		if (len > MAX_OUT_IN)
-			len = MAX_OUT_IN;
-		rc = SC_ReadFile(This->TemplateFid, off, pCms, len);
+		if (len > card->MaxData)
+			len = card->MaxData;
+		rc = SC_ReadBinary(card, This->TemplateFid, off, pCms, len, end - off + 2);
 		if (rc != len) {
-			log_err("template '%s' SC_ReadFile(.., %d, .., %d) returned %d", label, off, len, rc);
+			log_err("template '%s' SC_ReadBinary(.., %d, .., %d) returned %d", label, off, len, rc);
 			rc = ERR_TEMPLATE;
 			goto error;
 		}
 		off += len;
 		pCms += len;
 	}
+	rc = PrepareTemplate(This, label);
+	if (rc < 0)
+		goto error;
+	*ppTemplate = This;
 	return 0;
 error:
-	if (This->pCms)
-		free(This->pCms);
-	free(This);
-	This = 0;
+	FreeTemplate(This);
 	return rc;
 }
 
 /*******************************************************************************
  *******************************************************************************
  *******************************************************************************
- ************************** Signature Functions ********************************
+ ************************ Template Cache File Functions ************************
  *******************************************************************************
  *******************************************************************************
  ******************************************************************************/
 
-static int PatchSignedAttributes(
-	const uint8 *hash, int hashLen,
-	uint8 *hashToSign, int hashToSignLen)
+/*
+	Optional persistent template cache (see set_template_cache_dir).
+	One file per label with the following layout:
+		magic "SCHSMTPL"
+		KeyFid, TemplateFid (big endian)
+		label length (1 byte), label
+		raw template header and CMS body as stored on the token
+	A cached template is only used if the cert id stored on the token matches the cert id in the
+	cached CMS, which replaces ENUMERATE OBJECTS, the descriptor reads and the template body read
+	by a single READ BINARY. Files are written to a temporary name and renamed, so concurrent
+	processes never see a partial file. Not available with SC_STATIC_MEMORY.
+*/
+#ifndef SC_STATIC_MEMORY
+#define TEMPLATE_CACHE_MAGIC "SCHSMTPL"
+
+static char *GetCacheFileName(const char *dir, const char *label)
 {
-	time_t now;
-	struct tm t;
-	char signingTime[16];
-	uint8 oldTag;
-	sha256_context ctx;
-	/* patch signing time */
-	time(&now);
-	t = *gmtime(&now);
-	if (!(2013 - 1900 <= t.tm_year && t.tm_year < 2050 - 1900))
-		return ERR_TIME;
-	sprintf(signingTime,
-			"%02d%02d%02d%02d%02d%02dZ",
-			t.tm_year - 100, 1 + t.tm_mon, t.tm_mday,
-			t.tm_hour, t.tm_min, t.tm_sec);
-	memcpy(This->pCms + This->SigningTimeOff, signingTime, 13);
-	/* patch MessageDigest */
-	memcpy(This->pCms + This->MessageDigestOff, hash, hashLen);
-	/* calculate hash of signed attributes */
-	oldTag = This->pCms[This->SignedAttributesOff]; /* save old tag */
-	This->pCms[This->SignedAttributesOff] = 0x31; /* change from CONT [0] to SET tag */
-	/* todo additional support of at least SHA1 */
-	sha256_starts(&ctx);
-	sha256_update(&ctx, This->pCms + This->SignedAttributesOff, This->SignedAttributesLen);
-	sha256_finish(&ctx, hashToSign);
-	This->pCms[This->SignedAttributesOff] = oldTag; /* restore CONT [0] */
-	return 0;
+	char *name, *p;
+	name = (char*)malloc(strlen(dir) + strlen(label) + 32);
+	if (name == 0)
+		return 0;
+	p = name + sprintf(name, "%s/", dir);
+	for (; *label; label++) /* keep the file name portable */
+		*p++ = (*label >= '0' && *label <= '9' || *label >= 'A' && *label <= 'Z'
+			|| *label >= 'a' && *label <= 'z' || *label == '-' || *label == '_') ? *label : '_';
+	strcpy(p, ".sc-hsm-template");
+	return name;
 }
 
-static int PatchRSATemplate(const uint8 *hash, int hashLen)
+static int LoadCachedTemplate(SC_Card_t *card, const char *dir, const char *label, Template_t **ppTemplate)
 {
-	/*
-	const ASN1 headers to build the asn1 enclosed hash:
-
-		SEQUENCE
-			SEQUENCE
-				OID of hash
-				NULL
-			OCTETSTRING hash
-	*/
-	static const uint8 encSHA256[] =
-		"\x30\x31\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x01\x05\x00\x04\x20";
-#if 0
-	static const uint8 encSHA1[] =
-		"\x30\x21\x30\x09\x06\x05\x2b\x0e\x03\x02\x1a\x05\x00\x04\x14";
-	static const uint8 encSHA384[] =
-		"\x30\x41\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x02\x05\x00\x04\x30";
-	static const uint8 encSHA512[] =
-		"\x30\x51\x30\x0d\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x03\x05\x00\x04\x40";
+	Template_t *This = 0;
+	uint8 buf[8 + 2 + 2 + 1 + 255], certId[32];
+	char *name;
+	FILE *f;
+	int rc = ERR_TEMPLATE, labelLen;
+	*ppTemplate = 0;
+	labelLen = strlen(label);
+	if (labelLen > 255)
+		return ERR_INVALID;
+	name = GetCacheFileName(dir, label);
+	if (name == 0)
+		return ERR_MEMORY;
+	f = fopen(name, "rb");
+	free(name);
+	if (f == 0)
+		return ERR_TEMPLATE;
+	if (fread(buf, 1, 13 + labelLen, f) != 13 + labelLen
+		|| memcmp(buf, TEMPLATE_CACHE_MAGIC, 8)
+		|| buf[12] != labelLen
+		|| memcmp(buf + 13, label, labelLen))
+		goto error;
+	This = (Template_t*)calloc(1, sizeof(Template_t) + labelLen);
+	if (This == 0) {
+		rc = ERR_MEMORY;
+		goto error;
+	}
+	memcpy(This->Label, label, labelLen + 1); /* include 0 terminator */
+	This->KeyFid = buf[8] << 8 | buf[9];
+	This->TemplateFid = buf[10] << 8 | buf[11];
+	if (fread(This->Header, 1, TEMPLATE_HEADER_LENGTH, f) != TEMPLATE_HEADER_LENGTH)
+		goto error;
+	rc = ParseTemplateHeader(This, This->Header, label);
+	if (rc < 0)
+		goto error;
+	rc = ERR_TEMPLATE;
+	This->pCms = (uint8*)calloc(1, This->CMSLen);
+	if (This->pCms == 0) {
+		rc = ERR_MEMORY;
+		goto error;
+	}
+	if (fread(This->pCms, 1, This->CMSLen, f) != This->CMSLen)
+		goto error;
+	fclose(f);
+	f = 0;
+	/* still the same token and template? */
+	rc = SC_ReadFile(card, This->TemplateFid, TEMPLATE_HEADER_LENGTH + This->CertIdOff, certId, sizeof(certId));
+	if (rc != sizeof(certId) || memcmp(certId, This->pCms + This->CertIdOff, sizeof(certId))) {
+		log_wrn("cached template '%s' outdated", label);
+		rc = ERR_TEMPLATE;
+		goto error;
+	}
+	rc = PrepareTemplate(This, label);
+	if (rc < 0)
+		goto error;
+	*ppTemplate = This;
+	return 0;
+error:
+	if (f)
+		fclose(f);
+	FreeTemplate(This);
+	return rc;
+}
+
+static void SaveCachedTemplate(const char *dir, Template_t *This)
+{
+	uint8 buf[8 + 2 + 2 + 1];
+	char *name, *tmpName;
+	FILE *f;
+	int ok, labelLen = strlen(This->Label);
+	if (labelLen > 255)
+		return;
+	name = GetCacheFileName(dir, This->Label);
+	if (name == 0)
+		return;
+	tmpName = (char*)malloc(strlen(name) + 8);
+	if (tmpName == 0) {
+		free(name);
+		return;
+	}
+	sprintf(tmpName, "%s.tmp", name);
+	memcpy(buf, TEMPLATE_CACHE_MAGIC, 8);
+	buf[8] = This->KeyFid >> 8;
+	buf[9] = (uint8)This->KeyFid;
+	buf[10] = This->TemplateFid >> 8;
+	buf[11] = (uint8)This->TemplateFid;
+	buf[12] = (uint8)labelLen;
+	f = fopen(tmpName, "wb");
+	ok = f != 0
+		&& fwrite(buf, 1, sizeof(buf), f) == sizeof(buf)
+		&& fwrite(This->Label, 1, labelLen, f) == labelLen
+		&& fwrite(This->Header, 1, TEMPLATE_HEADER_LENGTH, f) == TEMPLATE_HEADER_LENGTH
+		&& fwrite(This->pCms, 1, This->CMSLen, f) == This->CMSLen;
+	if (f && fclose(f))
+		ok = 0;
+	if (ok) {
+#ifdef _WIN32
+		remove(name); /* rename does not replace existing files */
 #endif
-	int ix, encLen;
-	const uint8 *enc;
-	uint8 *sig;
-	int rc;
-	uint8 hashToSign[32];
-	rc = PatchSignedAttributes(hash, hashLen, hashToSign, sizeof(hashToSign));
+		ok = rename(tmpName, name) == 0;
+	}
+	if (!ok) {
+		log_wrn("could not write template cache file '%s'", name);
+		remove(tmpName);
+	}
+	free(tmpName);
+	free(name);
+}
+#else
+#define LoadCachedTemplate(card, dir, label, ppTemplate) ERR_TEMPLATE
+#define SaveCachedTemplate(dir, This)
+#endif
+
+/*******************************************************************************
+ *******************************************************************************
+ *******************************************************************************
+ ************************** Signature Functions ********************************
+ *******************************************************************************
+ *******************************************************************************
+ ******************************************************************************/
+
+/* returns the current UTC time as 13 characters "YYMMDDhhmmssZ", formatted only once per second */
+static int GetSigningTime(sign_ctx_t *ctx, const char **pSigningTime)
+{
+	time_t now;
+	struct tm t;
+	time(&now);
+	if (now != ctx->SigningTimeSec || ctx->SigningTime[0] == 0) {
+#ifdef _WIN32
+		if (gmtime_s(&t, &now))
+			return ERR_TIME;
+#else
+		if (gmtime_r(&now, &t) == 0)
+			return ERR_TIME;
+#endif
+		if (!(2013 - 1900 <= t.tm_year && t.tm_year < 2050 - 1900))
+			return ERR_TIME;
+		sprintf(ctx->SigningTime,
+				"%02d%02d%02d%02d%02d%02dZ",
+				t.tm_year - 100, 1 + t.tm_mon, t.tm_mday,
+				t.tm_hour, t.tm_min, t.tm_sec);
+		ctx->SigningTimeSec = now;
+	}
+	*pSigningTime = ctx->SigningTime;
+	return 0;
+}
+
+static int PatchSignedAttributes(sign_ctx_t *ctx, Template_t *This, uint8 *cms,
+	const uint8 *hash, int hashLen,
+	uint8 *hashToSign, int hashToSignLen)
+{
+	const char *signingTime;
+	uint8 oldTag, *p;
+	int rc, len;
+	/* patch signing time */
+	rc = GetSigningTime(ctx, &signingTime);
 	if (rc < 0)
 		return rc;
-	switch (hashLen) {
-	case 32:          /* SHA-256 */
-		enc = encSHA256;
-		encLen = sizeof(encSHA256) - 1;
-		break;
-#if 0
-	case 20:          /* SHA1 */
-		enc = encSHA1;
-		encLen = sizeof(encSHA1) - 1;
-		break;
-	case 48:          /* SHA-384 */
-		enc = encSHA384;
-		encLen = sizeof(encSHA384) - 1;
-		break;
-	case 64:          /* SHA-512 */
-		enc = encSHA512;
-		encLen = sizeof(encSHA512) - 1;
-		break;
-#endif
-	default:
-		return ERR_HASH;
+	memcpy(cms + This->SigningTimeOff, signingTime, 13);
+	/* patch MessageDigest */
+	memcpy(cms + This->MessageDigestOff, hash, hashLen);
+	/* calculate hash of signed attributes, resume after the precomputed constant prefix */
+	oldTag = cms[This->SignedAttributesOff]; /* save old tag */
+	cms[This->SignedAttributesOff] = 0x31; /* change from CONT [0] to SET tag */
+	p = cms + This->SignedAttributesOff + This->MidstateLen;
+	len = This->SignedAttributesLen - This->MidstateLen;
+	if (This->HashLen == 32) {
+		sha256_context sha = This->Midstate.Sha256;
+		sha256_update(&sha, p, len);
+		sha256_finish(&sha, hashToSign);
+	} else {
+		sha512_context sha = This->Midstate.Sha512;
+		uint8 digest[64];
+		sha512_update(&sha, p, len);
+		sha512_finish(&sha, digest);
+		memcpy(hashToSign, digest, This->HashLen);
 	}
+	cms[This->SignedAttributesOff] = oldTag; /* restore CONT [0] */
+	return 0;
+}
+
+static int PatchRSATemplate(sign_ctx_t *ctx, Template_t *This, uint8 *cms, const uint8 *hash, int hashLen)
+{
+	unsigned long long start;
+	int rc;
 	/*
-		Build 0x00, 0x01, 0xff, ... , 0xff, 0x00, asn1-enclosed-hash.
-		The total size must match exactly the RSA modulus size (RSA2k: 2048 bits == 256 bytes).
-		Use space of p->Signature !!!
+		The hash of the signed attributes goes straight into the prebuilt block (see PrepareRSAFrame),
+		the token returns the signature into the signature field of the CMS.
 	*/
-	sig = This->pCms + This->SignatureOff;
-	ix = This->SignatureSize;
-	memcpy(sig + (ix -= hashLen), hashToSign, hashLen);
-	memcpy(sig + (ix -= encLen), enc, encLen);
-	sig[ix -= 1] = 0;
-	memset(sig + 2, -1, ix - 2);
-	sig[1] = 1;
-	sig[0] = 0;
-	return SC_Sign(0x20, (uint8)This->KeyFid, sig, This->SignatureSize, sig, This->SignatureSize);
+	start = StatsNow();
+	rc = PatchSignedAttributes(ctx, This, cms, hash, hashLen,
+		This->Frame + This->SignatureSize - This->HashLen, This->HashLen);
+	StatsAddPhase(SC_STATS_PATCH, start);
+	if (rc < 0)
+		return rc;
+	start = StatsNow();
+	rc = SC_Sign(&ctx->Card, 0x20, (uint8)This->KeyFid, This->Frame, This->SignatureSize,
+		cms + This->SignatureOff, This->SignatureSize);
+	StatsAddPhase(SC_STATS_SIGN, start);
+	return rc;
 }
 
-static int PatchECDSATemplate(const uint8 *hash, int hashLen)
+static int PatchECDSATemplate(sign_ctx_t *ctx, Template_t *This, uint8 *cms, const uint8 *hash, int hashLen)
 {
-	int rc;
-	uint8 hashToSign[32];
-	rc = PatchSignedAttributes(hash, hashLen, hashToSign, sizeof(hashToSign));
+	ECDSALayout_t *l;
+	unsigned long long start;
+	int rc, i;
+	uint8 hashToSign[64];
+	start = StatsNow();
+	rc = PatchSignedAttributes(ctx, This, cms, hash, hashLen, hashToSign, sizeof(hashToSign));
+	StatsAddPhase(SC_STATS_PATCH, start);
 	if (rc < 0)
 		return rc;
-	rc = SC_Sign(0x70, (uint8)This->KeyFid, hashToSign, hashLen, This->pCms + This->SignatureOff, This->SignatureSize);
+	start = StatsNow();
+	rc = SC_Sign(&ctx->Card, 0x70, (uint8)This->KeyFid, hashToSign, This->HashLen, cms + This->SignatureOff, This->SignatureSize);
+	StatsAddPhase(SC_STATS_SIGN, start);
 	if (rc < 0)
 		return rc;
 	/*
@@ -469,63 +1126,15 @@ static int PatchECDSATemplate(const uint8 *hash, int hashLen)
 			r INTEGER // length: ... 32 or 33 if MSBit set
 			s INTEGER // length: ... 32 or 33 if MSBit set
 	*/
-	int delta = 72 - rc;
-	int l;
-	if (delta > 0) { /* patch the length fields of the containing ASN.1 elements */
-		This->CMSLen -= delta;
-		uint8* p = This->pCms;
-		if (p[0] != 0x30 || p[1] != 0x82) // SEQUENCE
-			return ERR_TEMPLATE;
-		l = p[2] << 8 | p[3];
-		l -= delta;
-		p[2] = l >> 8; p[3] = l; // adjust length
-		p += 4;
-
-		if (p[0] != 0x06) // OID
-			return ERR_TEMPLATE;
-		p += 2 + p[1]; // skip OID
-		if (p[0] != 0xA0 || p[1] != 0x82) // CONT [0]
-			return ERR_TEMPLATE;
-		l = p[2] << 8 | p[3];
-		l -= delta;
-		p[2] = l >> 8; p[3] = l; // adjust length
-		p += 4;
-
-		if (p[0] != 0x30 || p[1] != 0x82) // SEQUENCE
-			return ERR_TEMPLATE;
-		l = p[2] << 8 | p[3];
-		l -= delta;
-		p[2] = l >> 8; p[3] = l; // adjust length
-		p += 4;
-
-		if (p[0] != 0x02) // INTERGER version
-			return ERR_TEMPLATE;
-		p += 2 + p[1]; // skip
-		if (p[0] != 0x31) // SET 
-			return ERR_TEMPLATE;
-		p += 2 + p[1]; // skip
-		if (p[0] != 0x30) // SEQUENCE
-			return ERR_TEMPLATE;
-		p += 2 + p[1]; // skip
-		if (p[0] != 0xA0 || p[1] != 0x82) // CONT [0]
-			return ERR_TEMPLATE;
-		p += 4 + (p[2] << 8 | p[3]); // skip
-		if (p[0] != 0x31 || p[1] != 0x81) // SET
-			return ERR_TEMPLATE;
-		l = p[2];
-		l -= delta;
-		p[2] = l; // adjust length
-		p += 3;
-
-		if (p[0] != 0x30 || p[1] != 0x81) // SEQUENCE
-			return ERR_TEMPLATE;
-		l = p[2];
-		l -= delta;
-		p[2] = l; // adjust length
-
-		// OCTET string containing the signature
-		// works because the the length is 70, 71 or 72
-		This->pCms[This->SignatureOff - 1] -= delta; // adjust length
+	if (rc < 70 || rc > 72)
+		return rc;
+	/* set the length fields of the containing ASN.1 elements from the prebuilt layout */
+	l = &This->Layout[rc - 70];
+	for (i = 0; i < ECDSA_LEN_FIELDS; i++) {
+		uint8 *p = cms + This->LenOff[i];
+		if (This->LenSize[i] == 2)
+			*p++ = l->Len[i] >> 8;
+		*p = (uint8)l->Len[i];
 	}
 	return rc;
 }
@@ -539,13 +1148,261 @@ static int PatchECDSATemplate(const uint8 *hash, int hashLen)
  *******************************************************************************
  *******************************************************************************
  ******************************************************************************/
+/*
+	Releases all cached templates and the object index of the context, e.g. after a token change.
+	ReleaseContext also closes the token session, the context itself stays valid and
+	reopens the session on the next signature.
+*/
+static void ReleaseIndex(sign_ctx_t *ctx)
+{
+	FreeObjectIndex(ctx->Index);
+	ctx->Index = 0;
+}
+
+static void ReleaseTemplates(sign_ctx_t *ctx)
+{
+	int i;
+	for (i = 0; i < TEMPLATE_CACHE_SIZE; i++) {
+		FreeTemplate(ctx->Cache[i]);
+		ctx->Cache[i] = 0;
+	}
+	ReleaseIndex(ctx);
+}
+
+static void ReleaseContext(sign_ctx_t *ctx)
+{
+	ReleaseTemplates(ctx);
+	if (ctx->SessionOpen) {
+		SC_Close(&ctx->Card);
+		ctx->SessionOpen = 0;
+	}
+	ctx->SessionSuspect = 0;
+}
+
+static int OpenSession(sign_ctx_t *ctx, const char *reader, const char *pin)
+{
+	unsigned long long start = StatsNow();
+	int rc = SC_Open(&ctx->Card, pin, reader);
+	StatsAddPhase(SC_STATS_OPEN, start);
+	if (rc < 0) {
+		log_err("SC_Open returned %d", rc);
+		return rc;
+	}
+	ctx->SessionOpen = 1;
+	return 0;
+}
+
+/*
+	Recovery ladder after a card event or a failed signature:
+	1. reconnect the card handle (PC/SC) or reset the card (CT-API) and select the application again
+	2. full SC_Close/SC_Open, i.e. new context, reader list, connect, select and verify
+	The cached templates are kept, the caller checks the cert id to decide if they can be reused.
+	Without a template to check the caller releases the object index, it may be of another token.
+*/
+static int RecoverSession(sign_ctx_t *ctx, const char *reader, const char *pin)
+{
+	int rc;
+	ctx->SessionSuspect = 0;
+	if (ctx->SessionOpen) {
+		rc = SC_Reconnect(&ctx->Card, pin);
+		if (rc >= 0)
+			return 0;
+		if (rc == ERR_PIN)
+			return rc; /* SC_Open would only verify the wrong PIN again */
+		log_wrn("SC_Reconnect returned %d, reopening session", rc);
+		SC_Close(&ctx->Card);
+		ctx->SessionOpen = 0;
+	}
+	return OpenSession(ctx, reader, pin);
+}
+
+/*
+	Scope of an operation on the token, see SC_BeginTransaction. The transaction is only held
+	after the operation if the worker thread of the context releases it (sc_ctx_hold_card).
+*/
+static void BeginOperation(sign_ctx_t *ctx)
+{
+	SC_BeginTransaction(&ctx->Card);
+}
+
+static void EndOperation(sign_ctx_t *ctx)
+{
+	ctx->CardHeld = SC_EndTransaction(&ctx->Card, ctx->Hold);
+}
+
+/*
+	Returns in *ppTemplate the validated template for label, (re)opens the token session and
+	loads the template if needed. The template is only valid until the next call on the context.
+*/
+static int GetTemplate(sign_ctx_t *ctx,
+	const char *reader, const char *pin, const char *label,
+	Template_t **ppTemplate)
+{
+	Template_t *This;
+	int rc;
+	*ppTemplate = 0;
+	if (label == 0)
+		return ERR_INVALID;
+	This = ctx->SessionOpen ? FindTemplate(ctx, label) : 0;
+	/*
+		A stable token (no card event reported by the reader) keeps the session and the templates,
+		no APDU needed. After a card event or a failed signature recover the session and compare
+		the cert id to decide if the cached templates still belong to the token.
+	*/
+	if (ctx->SessionOpen && (ctx->SessionSuspect || SC_CardChanged(&ctx->Card))) {
+		Template_t *t = This ? This : ctx->Cache[0];
+		uint8 certId[32];
+		rc = RecoverSession(ctx, reader, pin);
+		if (rc < 0) {
+			ReleaseContext(ctx);
+			return rc;
+		}
+		if (t) { /* try to reuse templates */
+			unsigned long long start = StatsNow();
+			rc = SC_ReadFile(&ctx->Card, t->TemplateFid, TEMPLATE_HEADER_LENGTH + t->CertIdOff, certId, sizeof(certId));
+			StatsAddPhase(SC_STATS_REVALIDATE, start);
+			if (rc != sizeof(certId) || memcmp(certId, t->pCms + t->CertIdOff, sizeof(certId))) {
+				ReleaseTemplates(ctx); /* token changed, do not reuse any template, release rescources */
+				This = 0;
+			}
+		} else {
+			ReleaseIndex(ctx); /* kept after an unknown label, the cert id was not checked */
+		}
+	}
+	if (This == 0) { // start over
+		unsigned long long start;
+		if (!ctx->SessionOpen) {
+			rc = OpenSession(ctx, reader, pin);
+			if (rc < 0)
+				return rc;
+		}
+		start = StatsNow();
+		rc = ctx->CacheDir ? LoadCachedTemplate(&ctx->Card, ctx->CacheDir, label, &This) : ERR_TEMPLATE;
+		if (rc < 0) {
+			rc = LoadTemplate(ctx, label, &This);
+			if (rc < 0) {
+				log_err("LoadTemplate('%s') returned %d", label, rc);
+				if (rc != ERR_KEY && rc != ERR_TEMPLATE)
+					ReleaseContext(ctx); /* keep session and object index if only the label is unknown */
+				return rc;
+			}
+			if (ctx->CacheDir)
+				SaveCachedTemplate(ctx->CacheDir, This);
+		}
+		StatsAddPhase(SC_STATS_LOAD, start);
+		InsertTemplate(ctx, This);
+	}
+	*ppTemplate = This;
+	return 0;
+}
+
+/*
+	Sign with an already validated template, the CMS is patched in place in cms.
+	cms is either the template buffer or a copy of it (see sign_hash_into).
+*/
+static int SignWithTemplate(sign_ctx_t *ctx, Template_t *This, uint8 *cms,
+	const uint8 *hash, int hashLen)
+{
+	int rc = 0;
+	if (hashLen != This->HashLen) {
+		log_err("Template '%s' expects a hash of %d bytes, not %d", This->Label, This->HashLen, hashLen);
+		return ERR_HASH;
+	}
+	if (IsRSATemplate(This))
+		rc = PatchRSATemplate(ctx, This, cms, hash, hashLen);
+	else if (This->SignatureSize == 72)
+		rc = PatchECDSATemplate(ctx, This, cms, hash, hashLen);
+	if (This->SignatureSize == 72 && (rc == 70 || rc == 71 || rc == 72))
+		return This->Layout[rc - 70].CMSLen; // OK
+	if (rc == This->SignatureSize)
+		return This->CMSLen; // OK
+	/* error case */
+	log_err("Template '%s' invalid signature size %d", This->Label, rc);
+	if (rc >= 0) {
+		ReleaseContext(ctx);
+		return ERR_KEY_SIZE;
+	}
+	/* keep the templates, the next call recovers the session (see RecoverSession) */
+	ctx->SessionSuspect = 1;
+	return rc;
+}
+
+static int SignHash(sign_ctx_t *ctx,
+	const char *reader, const char *pin, const char *label,
+	const uint8 *hash, int hashLen,
+	const uint8 **ppCms)
+{
+	Template_t *This;
+	int rc;
+	*ppCms = 0;
+	BeginOperation(ctx);
+	rc = GetTemplate(ctx, reader, pin, label, &This);
+	if (rc >= 0) {
+		rc = SignWithTemplate(ctx, This, This->pCms, hash, hashLen);
+		if (rc > 0)
+			*ppCms = This->pCms;
+	}
+	EndOperation(ctx);
+	return rc;
+}
+
+static int SignHashInto(sign_ctx_t *ctx,
+	const char *reader, const char *pin, const char *label,
+	const uint8 *hash, int hashLen,
+	uint8 *out, int outSize)
+{
+	Template_t *This;
+	int rc;
+	BeginOperation(ctx);
+	rc = GetTemplate(ctx, reader, pin, label, &This);
+	if (rc >= 0) {
+		if (out == 0)
+			rc = This->CMSLen; /* maximum size needed */
+		else if (outSize < This->CMSLen)
+			rc = ERR_MEMORY;
+		else {
+			memcpy(out, This->pCms, This->CMSLen);
+			rc = SignWithTemplate(ctx, This, out, hash, hashLen);
+		}
+	}
+	EndOperation(ctx);
+	return rc;
+}
+
+/*
+	The template is validated once for the whole batch, followed by back-to-back SIGN APDUs,
+	all within one PC/SC transaction.
+	A token change in the middle of a batch makes the SIGN APDU fail and aborts the batch.
+*/
+static int SignHashes(sign_ctx_t *ctx,
+	const char *reader, const char *pin, const char *label,
+	const uint8 *hashes[], int hashLen, int count,
+	sign_hashes_callback_t callback, void *userData)
+{
+	Template_t *This;
+	int rc, i;
+	if (count < 0 || count > 0 && (hashes == 0 || callback == 0))
+		return ERR_INVALID;
+	BeginOperation(ctx);
+	rc = GetTemplate(ctx, reader, pin, label, &This);
+	for (i = 0; rc >= 0 && i < count; i++) {
+		rc = SignWithTemplate(ctx, This, This->pCms, hashes[i], hashLen);
+		if (rc > 0)
+			rc = callback(i, This->pCms, rc, userData);
+		else if (rc == 0)
+			break;
+	}
+	EndOperation(ctx);
+	return rc < 0 || i < count ? rc : count;
+}
+
 /*
  *  Signature of specified hash
  *
  *  pin         : smartcard pin
  *  label       : key and template label
  *  hash        : Hash to be signed
- *  hashLen     : Length of hash (20, 32, 48 or 64)
+ *  hashLen     : Length of hash (32, 48 or 64, as the hash of the template)
  *  ppCms       : returns the CMS data in *ppCms
  *
  *  Returns : CMS size or error if <= 0
@@ -562,54 +1419,579 @@ int EXPORT_FUNC sign_hash2(
 	const char *reader, const char *pin, const char *label,
 	const uint8 *hash, int hashLen,
 	const uint8 **ppCms)
+{
+	return SignHash(&DefaultCtx, reader, pin, label, hash, hashLen, ppCms);
+}
+
+/*
+ *  Signature of specified hash, the CMS is written into a caller buffer
+ *
+ *  reader      : reader name or NULL for the 1st token found
+ *  pin         : smartcard pin
+ *  label       : key and template label
+ *  hash        : Hash to be signed
+ *  hashLen     : Length of hash (32, 48 or 64, as the hash of the template)
+ *  out         : buffer for the CMS data, if NULL the maximum CMS size is returned
+ *  outSize     : size of out
+ *
+ *  The buffer stays valid after subsequent calls, so several signatures can be kept without copying.
+ *
+ *  Returns : CMS size or error if <= 0, ERR_MEMORY if out is too small
+ */
+int EXPORT_FUNC sign_hash_into(
+	const char *reader, const char *pin, const char *label,
+	const uint8 *hash, int hashLen,
+	uint8 *out, int outSize)
+{
+	return SignHashInto(&DefaultCtx, reader, pin, label, hash, hashLen, out, outSize);
+}
+
+/*
+ *  Signature of a batch of hashes with the same key
+ *
+ *  reader      : reader name or NULL for the 1st token found
+ *  pin         : smartcard pin
+ *  label       : key and template label
+ *  hashes      : Hashes to be signed
+ *  hashLen     : Length of each hash (32, 48 or 64, as the hash of the template)
+ *  count       : Number of hashes
+ *  callback    : called with index, CMS data and CMS size for each signature, CMS data is
+ *                only valid during the callback. A negative return value aborts the batch.
+ *  userData    : passed to the callback
+ *
+ *  Returns : number of signatures or error if < 0
+ */
+int EXPORT_FUNC sign_hashes(
+	const char *reader, const char *pin, const char *label,
+	const uint8 *hashes[], int hashLen, int count,
+	sign_hashes_callback_t callback, void *userData)
+{
+	return SignHashes(&DefaultCtx, reader, pin, label, hashes, hashLen, count, callback, userData);
+}
+
+void EXPORT_FUNC release_template()
+{
+	ReleaseContext(&DefaultCtx);
+}
+
+static char *StrDup(const char *str)
+{
+	char *p;
+	if (str == 0)
+		return 0;
+	p = (char*)malloc(strlen(str) + 1);
+	if (p)
+		strcpy(p, str);
+	return p;
+}
+
+static int SetTemplateCacheDir(sign_ctx_t *ctx, const char *dir)
+{
+#ifdef SC_STATIC_MEMORY
+	if (dir) {
+		log_err("no template cache with SC_STATIC_MEMORY");
+		return ERR_INVALID;
+	}
+#endif
+	free(ctx->CacheDir);
+	ctx->CacheDir = StrDup(dir);
+	if (dir && ctx->CacheDir == 0)
+		return ERR_MEMORY;
+	return 0;
+}
+
+/*
+ *  Enable the persistent template cache (one file per label) in the specified directory
+ *
+ *  dir         : existing writable directory or NULL to disable the cache
+ *
+ *  Returns : 0 or error if < 0
+ */
+int EXPORT_FUNC set_template_cache_dir(const char *dir)
+{
+	return SetTemplateCacheDir(&DefaultCtx, dir);
+}
+
+#ifdef ASYNC_WORKER
+static void EnterContext(sign_ctx_t *ctx)
+{
+	if (ctx->Worker)
+		mutex_lock(&ctx->Worker->Busy);
+}
+
+static void LeaveContext(sign_ctx_t *ctx)
+{
+	AsyncWorker_t *w = ctx->Worker;
+	if (w == 0)
+		return;
+	condvar_lock(&w->Cond);
+	w->LastUse = StatsNow();
+	if (ctx->CardHeld && !w->Held)
+		condvar_broadcast(&w->Cond); /* the worker releases the transaction */
+	w->Held = ctx->CardHeld;
+	condvar_unlock(&w->Cond);
+	mutex_unlock(&w->Busy);
+}
+
+/*
+	Keep-warm tick of an idle context. VERIFY without data (PIN status) is a cheap APDU which keeps
+	the reader from suspending and the ICC powered and selected. After a card event or a lost PIN
+	status the session is recovered and the most recent template revalidated right away, so the
+	next signature does not pay for it.
+*/
+static int KeepWarm(sign_ctx_t *ctx)
+{
+	Template_t *This;
+	char *label;
+	int rc;
+	if (ctx->SessionOpen && !ctx->SessionSuspect) {
+		rc = SC_GetPinStatus(&ctx->Card);
+		if (rc < 0 || ctx->Pin && rc != 0x9000)
+			ctx->SessionSuspect = 1;
+	}
+	if (ctx->Cache[0] == 0) {
+		if (ctx->SessionOpen && !ctx->SessionSuspect)
+			return 0;
+		ReleaseIndex(ctx); /* no template to check the cert id of the recovered token */
+		return RecoverSession(ctx, ctx->Reader, ctx->Pin);
+	}
+	/* GetTemplate may release the cached template holding the label */
+	label = StrDup(ctx->Cache[0]->Label);
+	if (label == 0)
+		return ERR_MEMORY;
+	rc = GetTemplate(ctx, ctx->Reader, ctx->Pin, label, &This);
+	free(label);
+	return rc;
+}
+#else
+#define EnterContext(ctx)
+#define LeaveContext(ctx)
+#endif
+
+/*
+ *  Open a signing context with its own token session and template cache
+ *
+ *  reader      : reader name (PC/SC: part of the name, CT-API: port) or NULL for the 1st token found
+ *  pin         : smartcard pin
+ *  pCtx        : returns the context in *pCtx
+ *
+ *  Returns : 0 or error if < 0
+ */
+int EXPORT_FUNC sc_ctx_open(const char *reader, const char *pin, sign_ctx_t **pCtx)
+{
+	sign_ctx_t *ctx;
+	const char *keepWarm, *hold;
+	int rc;
+	*pCtx = 0;
+	ctx = (sign_ctx_t*)calloc(1, sizeof(sign_ctx_t));
+	if (ctx == 0)
+		return ERR_MEMORY;
+	ctx->Reader = StrDup(reader);
+	ctx->Pin = StrDup(pin);
+	if (reader && ctx->Reader == 0 || pin && ctx->Pin == 0) {
+		sc_ctx_close(ctx);
+		return ERR_MEMORY;
+	}
+#ifdef ASYNC_WORKER
+	ctx->Worker = (AsyncWorker_t*)calloc(1, sizeof(AsyncWorker_t));
+	if (ctx->Worker == 0 || condvar_init(&ctx->Worker->Cond)) {
+		free(ctx->Worker);
+		ctx->Worker = 0;
+		sc_ctx_close(ctx);
+		return ERR_MEMORY;
+	}
+	if (mutex_init(&ctx->Worker->Busy)) {
+		condvar_destroy(&ctx->Worker->Cond);
+		free(ctx->Worker);
+		ctx->Worker = 0;
+		sc_ctx_close(ctx);
+		return ERR_MEMORY;
+	}
+#endif
+	rc = OpenSession(ctx, reader, pin);
+	if (rc < 0) {
+		sc_ctx_close(ctx);
+		return rc;
+	}
+	keepWarm = getenv("SC_HSM_KEEP_WARM");
+	if (keepWarm && atoi(keepWarm) > 0 && sc_ctx_keep_warm(ctx, atoi(keepWarm)) < 0)
+		log_wrn("SC_HSM_KEEP_WARM ignored");
+	hold = getenv("SC_HSM_PCSC_HOLD");
+	if (hold && atoi(hold) > 0 && sc_ctx_hold_card(ctx, atoi(hold)) < 0)
+		log_wrn("SC_HSM_PCSC_HOLD ignored");
+	*pCtx = ctx;
+	return 0;
+}
+
+/*
+ *  Signature of specified hash using the token of the context
+ *
+ *  The returned CMS data is owned by the context and invalidated by the next
+ *  sc_ctx_sign_hash call on the same context. Different contexts may sign in parallel.
+ *
+ *  Returns : CMS size or error if <= 0
+ */
+int EXPORT_FUNC sc_ctx_sign_hash(sign_ctx_t *ctx, const char *label,
+	const uint8 *hash, int hashLen,
+	const uint8 **ppCms)
 {
 	int rc;
-	*ppCms = 0;
-	if (This) { /* try to reuse template */
-		if (strcmp(This->Label, label)) { /* This->Label != label */
-			release_template();
-		} else {
-			uint8 certId[32];
-			rc = SC_ReadFile(This->TemplateFid, TEMPLATE_HEADER_LENGTH + This->CertIdOff, certId, sizeof(certId));
-			if (rc != sizeof(certId) || memcmp(certId, This->pCms + This->CertIdOff, sizeof(certId)))
-				release_template(); /* do not reuse, release rescources */
-		}
+	if (ctx == 0) {
+		*ppCms = 0;
+		return ERR_INVALID;
 	}
-	if (This == 0) { // start over
-		rc = SC_Open(pin, reader);
-		if (rc < 0) {
-			log_err("SC_Open returned %d", rc);
-			return rc;
+	EnterContext(ctx);
+	rc = SignHash(ctx, ctx->Reader, ctx->Pin, label, hash, hashLen, ppCms);
+	LeaveContext(ctx);
+	return rc;
+}
+
+int EXPORT_FUNC sc_ctx_sign_hash_into(sign_ctx_t *ctx, const char *label,
+	const uint8 *hash, int hashLen,
+	uint8 *out, int outSize)
+{
+	int rc;
+	if (ctx == 0)
+		return ERR_INVALID;
+	EnterContext(ctx);
+	rc = SignHashInto(ctx, ctx->Reader, ctx->Pin, label, hash, hashLen, out, outSize);
+	LeaveContext(ctx);
+	return rc;
+}
+
+int EXPORT_FUNC sc_ctx_sign_hashes(sign_ctx_t *ctx, const char *label,
+	const uint8 *hashes[], int hashLen, int count,
+	sign_hashes_callback_t callback, void *userData)
+{
+	int rc;
+	if (ctx == 0)
+		return ERR_INVALID;
+	EnterContext(ctx);
+	rc = SignHashes(ctx, ctx->Reader, ctx->Pin, label, hashes, hashLen, count, callback, userData);
+	LeaveContext(ctx);
+	return rc;
+}
+
+#ifdef ASYNC_WORKER
+#ifdef _WIN32
+static DWORD WINAPI AsyncWorker(void *arg)
+#else
+static void *AsyncWorker(void *arg)
+#endif
+{
+	sign_ctx_t *ctx = (sign_ctx_t*)arg;
+	AsyncWorker_t *w = ctx->Worker;
+	AsyncRequest_t *r;
+	unsigned long long now, due;
+	int rc, release;
+	for (;;) {
+		condvar_lock(&w->Cond);
+		while (w->Head == 0 && !w->Stop) {
+			if (w->KeepWarm == 0 && !w->Held) {
+				condvar_wait(&w->Cond);
+				continue;
+			}
+			now = StatsNow();
+			due = w->KeepWarm ? w->LastUse + w->KeepWarm * 1000ull : ~0ull;
+			if (w->Held && w->LastUse + w->Hold * 1000ull < due)
+				due = w->LastUse + w->Hold * 1000ull;
+			if (now >= due)
+				break;
+			condvar_timedwait(&w->Cond, (int)((due - now + 999) / 1000));
 		}
-		rc = LoadTemplate(label);
-		if (rc < 0) {
-			log_err("LoadTemplate('%s') returned %d", label, rc);
-			SC_Close();
-			return rc;
+		r = w->Head;
+		if (r) {
+			w->Head = r->Next;
+			if (w->Head == 0)
+				w->Tail = 0;
+		}
+		rc = r == 0 && !w->Stop; /* keep-warm tick or release of the transaction due */
+		condvar_unlock(&w->Cond);
+		if (rc) {
+			mutex_lock(&w->Busy);
+			condvar_lock(&w->Cond);
+			now = StatsNow();
+			release = w->Held && now >= w->LastUse + w->Hold * 1000ull; /* still idle */
+			rc = w->KeepWarm && now >= w->LastUse + w->KeepWarm * 1000ull;
+			condvar_unlock(&w->Cond);
+			if (release) {
+				SC_ReleaseTransaction(&ctx->Card);
+				ctx->CardHeld = 0;
+			}
+			if (rc) {
+				BeginOperation(ctx);
+				rc = KeepWarm(ctx);
+				ctx->CardHeld = SC_EndTransaction(&ctx->Card, 0); /* the idle token is not held */
+			}
+			if (rc < 0)
+				log_wrn("keep-warm tick returned %d", rc);
+			condvar_lock(&w->Cond);
+			w->Held = ctx->CardHeld;
+			w->LastUse = StatsNow();
+			if (rc == ERR_PIN) {
+				log_err("PIN rejected, keep-warm stopped");
+				w->KeepWarm = 0; /* do not burn the retry counter */
+			}
+			condvar_unlock(&w->Cond);
+			mutex_unlock(&w->Busy);
+			continue;
 		}
+		if (r == 0)
+			break; /* stopped and queue empty */
+		EnterContext(ctx);
+		rc = SignHashInto(ctx, ctx->Reader, ctx->Pin, r->Label, r->Hash, r->HashLen, r->Out, r->OutSize);
+		LeaveContext(ctx);
+		r->Callback(rc, r->UserData);
+		free(r);
 	}
-	if (This->SignatureSize == 256) /* RSA */
-		rc = PatchRSATemplate(hash, hashLen);
-	else if (This->SignatureSize == 72)
-		rc = PatchECDSATemplate(hash, hashLen);
-	if (rc == 70 || rc == 71 || rc == 72 || rc == 256) {
-		*ppCms = This->pCms;
-		return This->CMSLen; // OK
+	return 0;
+}
+
+/* start the worker thread with the first request, called with the worker lock held */
+static int StartWorker(sign_ctx_t *ctx)
+{
+	AsyncWorker_t *w = ctx->Worker;
+	if (w->Started)
+		return 0;
+#ifdef _WIN32
+	w->Thread = CreateThread(NULL, 0, AsyncWorker, ctx, 0, NULL);
+	if (w->Thread == NULL)
+		return ERR_MEMORY;
+#else
+	if (pthread_create(&w->Thread, NULL, AsyncWorker, ctx))
+		return ERR_MEMORY;
+#endif
+	w->Started = 1;
+	return 0;
+}
+
+/* finish the queued requests and stop the worker thread */
+static void StopWorker(sign_ctx_t *ctx)
+{
+	AsyncWorker_t *w = ctx->Worker;
+	int started;
+	condvar_lock(&w->Cond);
+	w->Stop = 1;
+	started = w->Started;
+	condvar_broadcast(&w->Cond);
+	condvar_unlock(&w->Cond);
+	if (started) {
+#ifdef _WIN32
+		WaitForSingleObject(w->Thread, INFINITE);
+		CloseHandle(w->Thread);
+#else
+		pthread_join(w->Thread, NULL);
+#endif
 	}
-	/* error case */
-	log_err("Template '%s' invalid signature size %d", label, rc);
-	release_template();
-	if (rc >= 0) 
-		rc = ERR_KEY_SIZE;
+	condvar_destroy(&w->Cond);
+	mutex_destroy(&w->Busy);
+	free(w);
+	ctx->Worker = 0;
+}
+#endif
+
+/*
+ *  Keep the token of the context warm while it is idle
+ *
+ *  ctx         : context opened with sc_ctx_open
+ *  intervalMs  : idle time in ms after which a keep-warm tick is sent, 0 to stop
+ *
+ *  Each tick sends a cheap APDU (PIN status), so neither the reader suspends nor the ICC
+ *  is powered down, and the applet stays selected. If the tick finds a card event or the
+ *  PIN status lost, the session is recovered and the most recent template revalidated then,
+ *  not by the next signature. Call sc_ctx_load_template ahead of a scheduled workload to
+ *  open the session and load the template before the first request.
+ *  The ticks stop if the PIN is rejected. sc_ctx_open applies SC_HSM_KEEP_WARM (ms) if set.
+ *  The CMS returned by sc_ctx_sign_hash is only valid until the next tick, use sc_ctx_sign_hash_into.
+ *
+ *  Returns : 0 or error if < 0 (ERR_INVALID without thread support)
+ */
+int EXPORT_FUNC sc_ctx_keep_warm(sign_ctx_t *ctx, int intervalMs)
+{
+#ifdef ASYNC_WORKER
+	AsyncWorker_t *w;
+	int rc;
+#endif
+	if (ctx == 0 || intervalMs < 0)
+		return ERR_INVALID;
+#ifdef ASYNC_WORKER
+	w = ctx->Worker;
+	if (w == 0) /* the default context of sign_hash has no worker */
+		return ERR_INVALID;
+	condvar_lock(&w->Cond);
+	rc = w->Stop ? ERR_INVALID : intervalMs ? StartWorker(ctx) : 0;
+	if (rc == 0) {
+		w->KeepWarm = intervalMs;
+		w->LastUse = StatsNow();
+		condvar_broadcast(&w->Cond);
+	}
+	condvar_unlock(&w->Cond);
 	return rc;
+#else
+	return intervalMs ? ERR_INVALID : 0;
+#endif
 }
 
-void EXPORT_FUNC release_template()
+/*
+ *  Hold the PC/SC transaction of the context between operations
+ *
+ *  ctx         : context opened with sc_ctx_open
+ *  holdMs      : time in ms the transaction is held after the last operation, 0 to release it at once
+ *
+ *  Every operation (template load, signature, batch) runs within a PC/SC transaction, so other
+ *  applications sharing the token can not interleave APDUs. With a hold time a burst of
+ *  signatures shares one transaction, the worker thread of the context ends it once the
+ *  context was idle for holdMs. Other applications wait for the token up to holdMs longer.
+ *  No effect with CT-API, which opens the port exclusively. sc_ctx_open applies
+ *  SC_HSM_PCSC_HOLD (ms) if set.
+ *
+ *  Returns : 0 or error if < 0 (ERR_INVALID without thread support)
+ */
+int EXPORT_FUNC sc_ctx_hold_card(sign_ctx_t *ctx, int holdMs)
 {
-	if (This == 0)
+#ifdef ASYNC_WORKER
+	AsyncWorker_t *w;
+	int rc;
+#endif
+	if (ctx == 0 || holdMs < 0)
+		return ERR_INVALID;
+#ifdef ASYNC_WORKER
+	w = ctx->Worker;
+	if (w == 0) /* the default context of sign_hash has no worker */
+		return ERR_INVALID;
+	mutex_lock(&w->Busy);
+	condvar_lock(&w->Cond);
+	rc = w->Stop ? ERR_INVALID : holdMs ? StartWorker(ctx) : 0;
+	if (rc == 0) {
+		ctx->Hold = holdMs;
+		w->Hold = holdMs;
+		if (holdMs == 0) {
+			SC_ReleaseTransaction(&ctx->Card);
+			ctx->CardHeld = 0;
+			w->Held = 0;
+		}
+		condvar_broadcast(&w->Cond);
+	}
+	condvar_unlock(&w->Cond);
+	mutex_unlock(&w->Busy);
+	return rc;
+#else
+	return holdMs ? ERR_INVALID : 0;
+#endif
+}
+
+/*
+ *  Queue the signature of specified hash for the worker thread of the context
+ *
+ *  ctx         : context opened with sc_ctx_open
+ *  label       : key and template label
+ *  hash        : Hash to be signed, copied
+ *  hashLen     : Length of hash (at most 64)
+ *  out         : buffer for the CMS data, must stay valid until the callback
+ *  outSize     : size of out
+ *  callback    : called from the worker thread with the result of sc_ctx_sign_hash_into
+ *                (CMS size or error if <= 0) and userData, after out is written
+ *  userData    : passed to the callback
+ *
+ *  Requests are signed in the order queued. sc_ctx_close completes the queued requests
+ *  before it returns. Without thread support the hash is signed before this function returns.
+ *
+ *  Returns : 0 if the request was queued (the callback is called exactly once) or error if < 0
+ *            (the callback is not called)
+ */
+int EXPORT_FUNC sc_ctx_sign_hash_async(sign_ctx_t *ctx, const char *label,
+	const uint8 *hash, int hashLen,
+	uint8 *out, int outSize,
+	sign_hash_async_callback_t callback, void *userData)
+{
+#ifdef ASYNC_WORKER
+	AsyncWorker_t *w;
+	AsyncRequest_t *r;
+	int rc;
+#endif
+	if (ctx == 0 || label == 0 || out == 0 || callback == 0)
+		return ERR_INVALID;
+	if (hash == 0 || hashLen < 0 || hashLen > 64)
+		return ERR_HASH;
+#ifdef ASYNC_WORKER
+	w = ctx->Worker;
+	if (w == 0) /* the default context of sign_hash has no worker */
+		return ERR_INVALID;
+	r = (AsyncRequest_t*)malloc(sizeof(AsyncRequest_t) + strlen(label));
+	if (r == 0)
+		return ERR_MEMORY;
+	r->Next = 0;
+	memcpy(r->Hash, hash, hashLen);
+	r->HashLen = hashLen;
+	r->Out = out;
+	r->OutSize = outSize;
+	r->Callback = callback;
+	r->UserData = userData;
+	strcpy(r->Label, label);
+	condvar_lock(&w->Cond);
+	rc = w->Stop ? ERR_INVALID : StartWorker(ctx);
+	if (rc == 0) {
+		if (w->Tail)
+			w->Tail->Next = r;
+		else
+			w->Head = r;
+		w->Tail = r;
+		condvar_broadcast(&w->Cond);
+	}
+	condvar_unlock(&w->Cond);
+	if (rc < 0)
+		free(r);
+	return rc;
+#else
+	callback(SignHashInto(ctx, ctx->Reader, ctx->Pin, label, hash, hashLen, out, outSize), userData);
+	return 0;
+#endif
+}
+
+/*
+ *  Load (or revalidate) the template for label, e.g. to check if the token of the context holds the key
+ *
+ *  Returns : 0 or error if < 0
+ */
+int EXPORT_FUNC sc_ctx_load_template(sign_ctx_t *ctx, const char *label)
+{
+	Template_t *This;
+	int rc;
+	if (ctx == 0)
+		return ERR_INVALID;
+	EnterContext(ctx);
+	BeginOperation(ctx);
+	rc = GetTemplate(ctx, ctx->Reader, ctx->Pin, label, &This);
+	EndOperation(ctx);
+	LeaveContext(ctx);
+	return rc;
+}
+
+int EXPORT_FUNC sc_ctx_set_template_cache_dir(sign_ctx_t *ctx, const char *dir)
+{
+	int rc;
+	if (ctx == 0)
+		return ERR_INVALID;
+	EnterContext(ctx);
+	rc = SetTemplateCacheDir(ctx, dir);
+	LeaveContext(ctx);
+	return rc;
+}
+
+void EXPORT_FUNC sc_ctx_close(sign_ctx_t *ctx)
+{
+	if (ctx == 0)
 		return;
-	SC_Close();
-	free(This->pCms);
-	free(This);
-	This = 0;
+#ifdef ASYNC_WORKER
+	if (ctx->Worker)
+		StopWorker(ctx);
+#endif
+	ReleaseContext(ctx);
+	if (ctx->Pin) {
+		memset(ctx->Pin, 0, strlen(ctx->Pin));
+		free(ctx->Pin);
+	}
+	free(ctx->Reader);
+	free(ctx->CacheDir);
+	free(ctx);
 }
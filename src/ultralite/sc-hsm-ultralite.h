@@ -10,7 +10,7 @@
  *
  * @file sc-hsm-ultralite.h
  * @author Christoph Brunhuber
- * @brief Functions for RSA-2k signing of SHA1, SHA-256, SHA-384, SHA-512
+ * @brief Functions for RSA-2k/3k/4k signing of SHA-256, SHA-384, SHA-512
  *                  ECDSA-prime256 signing of SHA1, SHA-256
  *                  Card Devices, Version 1.0
  */
@@ -66,8 +66,108 @@ int EXPORT_FUNC sign_hash2(const char *reader, const char *pin, const char *labe
 	const unsigned char *hash, int hashLen,
 	const unsigned char **ppCMS);
 
+int EXPORT_FUNC sign_hash_into(const char *reader, const char *pin, const char *label,
+	const unsigned char *hash, int hashLen,
+	unsigned char *out, int outSize);
+
+typedef int (*sign_hashes_callback_t)(int index,
+	const unsigned char *pCMS, int cmsLen, void *userData);
+
+int EXPORT_FUNC sign_hashes(const char *reader, const char *pin, const char *label,
+	const unsigned char *hashes[], int hashLen, int count,
+	sign_hashes_callback_t callback, void *userData);
+
 void EXPORT_FUNC release_template();
 
+int EXPORT_FUNC set_template_cache_dir(const char *dir);
+
+typedef struct sign_ctx sign_ctx_t;
+
+int EXPORT_FUNC sc_ctx_open(const char *reader, const char *pin, sign_ctx_t **pCtx);
+
+int EXPORT_FUNC sc_ctx_sign_hash(sign_ctx_t *ctx, const char *label,
+	const unsigned char *hash, int hashLen,
+	const unsigned char **ppCMS);
+
+int EXPORT_FUNC sc_ctx_sign_hash_into(sign_ctx_t *ctx, const char *label,
+	const unsigned char *hash, int hashLen,
+	unsigned char *out, int outSize);
+
+int EXPORT_FUNC sc_ctx_sign_hashes(sign_ctx_t *ctx, const char *label,
+	const unsigned char *hashes[], int hashLen, int count,
+	sign_hashes_callback_t callback, void *userData);
+
+/* called with the result of sc_ctx_sign_hash_async (CMS size or error if <= 0) from the worker thread of the context */
+typedef void (*sign_hash_async_callback_t)(int rc, void *userData);
+
+int EXPORT_FUNC sc_ctx_sign_hash_async(sign_ctx_t *ctx, const char *label,
+	const unsigned char *hash, int hashLen,
+	unsigned char *out, int outSize,
+	sign_hash_async_callback_t callback, void *userData);
+
+int EXPORT_FUNC sc_ctx_load_template(sign_ctx_t *ctx, const char *label);
+
+int EXPORT_FUNC sc_ctx_keep_warm(sign_ctx_t *ctx, int intervalMs);
+
+int EXPORT_FUNC sc_ctx_hold_card(sign_ctx_t *ctx, int holdMs);
+
+int EXPORT_FUNC sc_ctx_set_template_cache_dir(sign_ctx_t *ctx, const char *dir);
+
+void EXPORT_FUNC sc_ctx_close(sign_ctx_t *ctx);
+
+typedef struct sign_pool sign_pool_t;
+
+/* token selection policies of a pool */
+#define SC_POOL_ROUND_ROBIN       0
+#define SC_POOL_LEAST_OUTSTANDING 1
+
+int EXPORT_FUNC sc_pool_open(const char *pin, const char *label, int policy, sign_pool_t **pPool);
+
+int EXPORT_FUNC sc_pool_size(sign_pool_t *pool);
+
+int EXPORT_FUNC sc_pool_sign_hash_into(sign_pool_t *pool,
+	const unsigned char *hash, int hashLen,
+	unsigned char *out, int outSize);
+
+int EXPORT_FUNC sc_pool_sign_hashes(sign_pool_t *pool,
+	const unsigned char *hashes[], int hashLen, int count,
+	sign_hashes_callback_t callback, void *userData);
+
+int EXPORT_FUNC sc_pool_keep_warm(sign_pool_t *pool, int intervalMs);
+
+void EXPORT_FUNC sc_pool_close(sign_pool_t *pool);
+
+/* phases of the signing statistics */
+#define SC_STATS_OPEN        0 /* SC_Open: context, reader list, connect, select, verify */
+#define SC_STATS_GET_FIDS    1 /* label lookup, ENUMERATE OBJECTS and descriptor reads */
+#define SC_STATS_LOAD        2 /* template load incl. label lookup, from token or cache file */
+#define SC_STATS_REVALIDATE  3 /* cert id check of cached templates after a card event */
+#define SC_STATS_PATCH       4 /* PatchSignedAttributes, host CPU only */
+#define SC_STATS_SIGN        5 /* SIGN APDU, mostly card time */
+#define SC_STATS_PHASES      6
+
+/* histogram bucket i counts durations < (32 << i) us, the last bucket all longer ones */
+#define SC_STATS_BUCKETS     20
+
+struct sc_stats_phase {
+	unsigned long long count;
+	unsigned long long totalUs;
+	unsigned long long maxUs;
+	unsigned long long histogram[SC_STATS_BUCKETS];
+};
+
+struct sc_stats {
+	struct sc_stats_phase phase[SC_STATS_PHASES];
+	unsigned long long apdus;    /* APDUs sent to the token */
+	unsigned long long bytesOut; /* command APDU bytes, host to token */
+	unsigned long long bytesIn;  /* response APDU bytes incl. sw1sw2, token to host */
+};
+
+/* cumulative statistics of all contexts and threads since start or reset_sign_stats */
+void EXPORT_FUNC get_sign_stats(struct sc_stats *stats);
+
+void EXPORT_FUNC reset_sign_stats(void);
+
 typedef struct {
 	unsigned int total[2];
 	unsigned int state[8];
@@ -78,4 +178,27 @@ void EXPORT_FUNC sha256_starts(sha256_context *ctx);
 void EXPORT_FUNC sha256_update(sha256_context *ctx, unsigned char *input, unsigned int length);
 void EXPORT_FUNC sha256_finish(sha256_context *ctx, unsigned char digest[32]);
 
+typedef struct {
+	unsigned long long total[2];
+	unsigned long long state[8];
+	unsigned char buffer[128];
+	int is384;
+} sha512_context;
+
+void EXPORT_FUNC sha384_starts(sha512_context *ctx);
+void EXPORT_FUNC sha512_starts(sha512_context *ctx);
+void EXPORT_FUNC sha512_update(sha512_context *ctx, unsigned char *input, unsigned int length);
+/* writes 48 bytes after sha384_starts and 64 bytes after sha512_starts */
+void EXPORT_FUNC sha512_finish(sha512_context *ctx, unsigned char digest[64]);
+
+/* streams hashed together by one sha256_mb_update call, more lanes are processed in groups */
+#define SHA256_MB_LANES 8
+
+/* same as sha256_update(ctx[i], input[i], length[i]) for i < lanes, hashing the streams in parallel */
+void EXPORT_FUNC sha256_mb_update(sha256_context *ctx[], unsigned char *input[], unsigned int length[], int lanes);
+
+/* selects the n-th backend available on this cpu (for tests and benchmarks),
+   returns its name or 0 if n is out of range, n < 0 restores the automatic selection */
+const char* EXPORT_FUNC sha256_use_backend(int n);
+
 #endif /* _sc_hsm_ultralite_h_ */
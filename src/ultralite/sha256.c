@@ -24,6 +24,70 @@
 typedef unsigned char uint8;
 typedef unsigned int uint32;
 
+/*
+ *  Backends processing whole 64 byte blocks, selected at first use:
+ *
+ *  x86/x64 with SHA extensions (SHA-NI)       sha256_blocks_shani
+ *  ARMv8 with cryptography extensions         sha256_blocks_armv8
+ *  all others                                 sha256_blocks_c (portable)
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || defined(__GNUC__) && __GNUC__ >= 5)
+#define SHA256_SHANI
+#define SHANI_TARGET __attribute__((target("sha,sse4.1")))
+#include <immintrin.h>
+#include <cpuid.h>
+#elif (defined(_M_X64) || defined(_M_IX86)) && defined(_MSC_VER) && _MSC_VER >= 1900
+#define SHA256_SHANI
+#define SHANI_TARGET
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+#if defined(__aarch64__) && (defined(__clang__) || defined(__GNUC__) && __GNUC__ >= 6)
+#define SHA256_ARMV8
+#ifdef __clang__
+#define ARMV8_TARGET __attribute__((target("crypto")))
+#else
+#define ARMV8_TARGET __attribute__((target("+crypto")))
+#endif
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#elif defined(_M_ARM64) && defined(_MSC_VER)
+#define SHA256_ARMV8
+#define ARMV8_TARGET
+#include <windows.h>
+#include <arm64_neon.h>
+#endif
+
+/*
+ *  Multi-buffer backends processing whole blocks of several streams in parallel,
+ *  one stream per vector lane, used by sha256_mb_update without SHA instructions:
+ *
+ *  x86/x64 with AVX2                          sha256_mb_blocks_avx2 (8 lanes)
+ *  ARMv8 (NEON)                               sha256_mb_blocks_neon (4 lanes)
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || defined(__GNUC__) && __GNUC__ >= 5)
+#define SHA256_MB_AVX2
+#define AVX2_TARGET __attribute__((target("avx2")))
+#elif (defined(_M_X64) || defined(_M_IX86)) && defined(_MSC_VER) && _MSC_VER >= 1900
+#define SHA256_MB_AVX2
+#define AVX2_TARGET
+#endif
+
+#if defined(__aarch64__) && (defined(__clang__) || defined(__GNUC__) && __GNUC__ >= 6) || defined(_M_ARM64) && defined(_MSC_VER)
+#define SHA256_MB_NEON
+#endif
+
+typedef void (*sha256_blocks_t)( sha256_context *ctx, uint8 *data, uint32 blocks );
+typedef void (*sha256_mb_blocks_t)( sha256_context **ctx, uint8 **data, uint32 blocks );
+
+static sha256_blocks_t sha256_blocks;
+static sha256_mb_blocks_t sha256_mb_blocks;
+static int sha256_mb_lanes;
+
 #define GET_UINT32(n,b,i)                       \
 {                                               \
     (n) = ( (uint32) (b)[(i)    ] << 24 )       \
@@ -186,8 +250,426 @@ void sha256_process( sha256_context *ctx, uint8 data[64] )
     ctx->state[7] += H;
 }
 
+static void sha256_blocks_c( sha256_context *ctx, uint8 *data, uint32 blocks )
+{
+    while( blocks-- )
+    {
+        sha256_process( ctx, data );
+        data += 64;
+    }
+}
+
+#if defined(SHA256_SHANI) || defined(SHA256_ARMV8) || defined(SHA256_MB_AVX2) || defined(SHA256_MB_NEON)
+static const uint32 K256[64] =
+{
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+#endif
+
+#ifdef SHA256_SHANI
+static int sha256_has_shani( void )
+{
+    /* CPUID.1:ECX.SSSE3[bit 9], CPUID.1:ECX.SSE4.1[bit 19], CPUID.7.0:EBX.SHA[bit 29] */
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid( r, 0 );
+    if( r[0] < 7 ) return( 0 );
+    __cpuid( r, 1 );
+    if( ( r[2] & ( 1 << 9 ) ) == 0 || ( r[2] & ( 1 << 19 ) ) == 0 ) return( 0 );
+    __cpuidex( r, 7, 0 );
+    return( ( r[1] & ( 1 << 29 ) ) != 0 );
+#else
+    unsigned int a, b, c, d;
+    if( __get_cpuid_max( 0, 0 ) < 7 ) return( 0 );
+    __cpuid( 1, a, b, c, d );
+    if( ( c & ( 1 << 9 ) ) == 0 || ( c & ( 1 << 19 ) ) == 0 ) return( 0 );
+    __cpuid_count( 7, 0, a, b, c, d );
+    return( ( b & ( 1 << 29 ) ) != 0 );
+#endif
+}
+
+/*
+ *  The SHA-NI instructions keep the state as ABEF and CDGH, each sha256rnds2 performs
+ *  two rounds, sha256msg1/sha256msg2 compute four words of the message schedule.
+ */
+SHANI_TARGET
+static void sha256_blocks_shani( sha256_context *ctx, uint8 *data, uint32 blocks )
+{
+    __m128i STATE0, STATE1, ABEF, CDGH, MSG, TMP, M[4];
+    const __m128i MASK = _mm_set_epi64x( 0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL );
+    int g;
+
+    TMP    = _mm_loadu_si128( (const __m128i *) &ctx->state[0] );   /* ABCD */
+    STATE1 = _mm_loadu_si128( (const __m128i *) &ctx->state[4] );   /* EFGH */
+    TMP    = _mm_shuffle_epi32( TMP, 0xB1 );                        /* CDAB */
+    STATE1 = _mm_shuffle_epi32( STATE1, 0x1B );                     /* EFGH -> HGFE */
+    STATE0 = _mm_alignr_epi8( TMP, STATE1, 8 );                     /* ABEF */
+    STATE1 = _mm_blend_epi16( STATE1, TMP, 0xF0 );                  /* CDGH */
+
+    while( blocks-- )
+    {
+        ABEF = STATE0;
+        CDGH = STATE1;
+
+        for( g = 0; g < 4; g++ )
+            M[g] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) ( data + 16 * g ) ), MASK );
+
+        /* 16 groups of 4 rounds, M[g & 3] holds W[4g .. 4g + 3] */
+        for( g = 0; g < 16; g++ )
+        {
+            MSG = _mm_add_epi32( M[g & 3], _mm_loadu_si128( (const __m128i *) &K256[4 * g] ) );
+            STATE1 = _mm_sha256rnds2_epu32( STATE1, STATE0, MSG );
+            if( g >= 3 && g < 15 )
+            {
+                TMP = _mm_alignr_epi8( M[g & 3], M[( g - 1 ) & 3], 4 );
+                M[( g + 1 ) & 3] = _mm_add_epi32( M[( g + 1 ) & 3], TMP );
+                M[( g + 1 ) & 3] = _mm_sha256msg2_epu32( M[( g + 1 ) & 3], M[g & 3] );
+            }
+            MSG = _mm_shuffle_epi32( MSG, 0x0E );
+            STATE0 = _mm_sha256rnds2_epu32( STATE0, STATE1, MSG );
+            if( g >= 1 && g < 13 )
+                M[( g - 1 ) & 3] = _mm_sha256msg1_epu32( M[( g - 1 ) & 3], M[g & 3] );
+        }
+
+        STATE0 = _mm_add_epi32( STATE0, ABEF );
+        STATE1 = _mm_add_epi32( STATE1, CDGH );
+        data += 64;
+    }
+
+    TMP    = _mm_shuffle_epi32( STATE0, 0x1B );                     /* FEBA */
+    STATE1 = _mm_shuffle_epi32( STATE1, 0xB1 );                     /* DCHG */
+    STATE0 = _mm_blend_epi16( TMP, STATE1, 0xF0 );                  /* DCBA */
+    STATE1 = _mm_alignr_epi8( STATE1, TMP, 8 );                     /* ABEF -> HGFE */
+    _mm_storeu_si128( (__m128i *) &ctx->state[0], STATE0 );
+    _mm_storeu_si128( (__m128i *) &ctx->state[4], STATE1 );
+}
+#endif /* SHA256_SHANI */
+
+#ifdef SHA256_ARMV8
+static int sha256_has_armv8( void )
+{
+#if defined(_M_ARM64)
+    return( IsProcessorFeaturePresent( PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE ) != 0 );
+#elif defined(__APPLE__)
+    return( 1 );
+#elif defined(__linux__) && defined(HWCAP_SHA2)
+    return( ( getauxval( AT_HWCAP ) & HWCAP_SHA2 ) != 0 );
+#else
+    return( 0 );
+#endif
+}
+
+/*
+ *  vsha256hq/vsha256h2q perform four rounds on ABCD/EFGH,
+ *  vsha256su0q/vsha256su1q compute four words of the message schedule.
+ */
+ARMV8_TARGET
+static void sha256_blocks_armv8( sha256_context *ctx, uint8 *data, uint32 blocks )
+{
+    uint32x4_t STATE0, STATE1, ABCD, EFGH, MSG, TMP, M[4];
+    int g;
+
+    STATE0 = vld1q_u32( &ctx->state[0] );
+    STATE1 = vld1q_u32( &ctx->state[4] );
+
+    while( blocks-- )
+    {
+        ABCD = STATE0;
+        EFGH = STATE1;
+
+        for( g = 0; g < 4; g++ )
+            M[g] = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + 16 * g ) ) );
+
+        /* 16 groups of 4 rounds, M[g & 3] holds W[4g .. 4g + 3] */
+        for( g = 0; g < 16; g++ )
+        {
+            MSG = vaddq_u32( M[g & 3], vld1q_u32( &K256[4 * g] ) );
+            if( g < 12 )
+                M[g & 3] = vsha256su1q_u32( vsha256su0q_u32( M[g & 3], M[( g + 1 ) & 3] ),
+                                            M[( g + 2 ) & 3], M[( g + 3 ) & 3] );
+            TMP = STATE0;
+            STATE0 = vsha256hq_u32( STATE0, STATE1, MSG );
+            STATE1 = vsha256h2q_u32( STATE1, TMP, MSG );
+        }
+
+        STATE0 = vaddq_u32( STATE0, ABCD );
+        STATE1 = vaddq_u32( STATE1, EFGH );
+        data += 64;
+    }
+
+    vst1q_u32( &ctx->state[0], STATE0 );
+    vst1q_u32( &ctx->state[4], STATE1 );
+}
+#endif /* SHA256_ARMV8 */
+
+#if defined(SHA256_MB_AVX2) || defined(SHA256_MB_NEON)
+static uint32 sha256_be32( const uint8 *b )
+{
+    uint32 n;
+    GET_UINT32( n, b, 0 );
+    return( n );
+}
+#endif
+
+#ifdef SHA256_MB_AVX2
+static int sha256_has_avx2( void )
+{
+    /* CPUID.1:ECX.OSXSAVE[bit 27], CPUID.1:ECX.AVX[bit 28], XCR0 YMM|XMM, CPUID.7.0:EBX.AVX2[bit 5] */
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid( r, 0 );
+    if( r[0] < 7 ) return( 0 );
+    __cpuid( r, 1 );
+    if( ( r[2] & ( 3 << 27 ) ) != ( 3 << 27 ) || ( _xgetbv( 0 ) & 6 ) != 6 ) return( 0 );
+    __cpuidex( r, 7, 0 );
+    return( ( r[1] & ( 1 << 5 ) ) != 0 );
+#else
+    unsigned int a, b, c, d;
+    if( __get_cpuid_max( 0, 0 ) < 7 ) return( 0 );
+    __cpuid( 1, a, b, c, d );
+    if( ( c & ( 3 << 27 ) ) != ( 3 << 27 ) ) return( 0 );
+    __asm__( "xgetbv" : "=a" (a), "=d" (d) : "c" (0) );
+    if( ( a & 6 ) != 6 ) return( 0 );
+    __cpuid_count( 7, 0, a, b, c, d );
+    return( ( b & ( 1 << 5 ) ) != 0 );
+#endif
+}
+
+#define MB_ADD(x,y)   _mm256_add_epi32( x, y )
+#define MB_ROTR(x,n)  _mm256_or_si256( _mm256_srli_epi32( x, n ), _mm256_slli_epi32( x, 32 - n ) )
+#define MB_S0(x)      _mm256_xor_si256( _mm256_xor_si256( MB_ROTR( x,  7 ), MB_ROTR( x, 18 ) ), _mm256_srli_epi32( x,  3 ) )
+#define MB_S1(x)      _mm256_xor_si256( _mm256_xor_si256( MB_ROTR( x, 17 ), MB_ROTR( x, 19 ) ), _mm256_srli_epi32( x, 10 ) )
+#define MB_S2(x)      _mm256_xor_si256( _mm256_xor_si256( MB_ROTR( x,  2 ), MB_ROTR( x, 13 ) ), MB_ROTR( x, 22 ) )
+#define MB_S3(x)      _mm256_xor_si256( _mm256_xor_si256( MB_ROTR( x,  6 ), MB_ROTR( x, 11 ) ), MB_ROTR( x, 25 ) )
+#define MB_F0(x,y,z)  _mm256_or_si256( _mm256_and_si256( x, y ), _mm256_and_si256( z, _mm256_or_si256( x, y ) ) )
+#define MB_F1(x,y,z)  _mm256_xor_si256( z, _mm256_and_si256( x, _mm256_xor_si256( y, z ) ) )
+
+/*
+ *  Eight streams, word i of the state and of the message schedule of lane l is kept in lane l of a vector.
+ */
+AVX2_TARGET
+static void sha256_mb_blocks_avx2( sha256_context **ctx, uint8 **data, uint32 blocks )
+{
+    __m256i S[8], V[8], W[16], T1, T2;
+    uint32 out[8], o = 0;
+    int i, t;
+
+    for( i = 0; i < 8; i++ )
+        S[i] = _mm256_set_epi32( ctx[7]->state[i], ctx[6]->state[i], ctx[5]->state[i], ctx[4]->state[i],
+                                 ctx[3]->state[i], ctx[2]->state[i], ctx[1]->state[i], ctx[0]->state[i] );
+
+    while( blocks-- )
+    {
+        for( i = 0; i < 8; i++ )
+            V[i] = S[i];
+
+        for( t = 0; t < 64; t++ )
+        {
+            if( t < 16 )
+                W[t] = _mm256_set_epi32( sha256_be32( data[7] + o + 4 * t ), sha256_be32( data[6] + o + 4 * t ),
+                                         sha256_be32( data[5] + o + 4 * t ), sha256_be32( data[4] + o + 4 * t ),
+                                         sha256_be32( data[3] + o + 4 * t ), sha256_be32( data[2] + o + 4 * t ),
+                                         sha256_be32( data[1] + o + 4 * t ), sha256_be32( data[0] + o + 4 * t ) );
+            else
+                W[t & 15] = MB_ADD( MB_ADD( MB_S1( W[( t - 2 ) & 15] ), W[( t - 7 ) & 15] ),
+                                    MB_ADD( MB_S0( W[( t - 15 ) & 15] ), W[t & 15] ) );
+
+            T1 = MB_ADD( MB_ADD( MB_ADD( V[7], MB_S3( V[4] ) ), MB_F1( V[4], V[5], V[6] ) ),
+                         MB_ADD( _mm256_set1_epi32( K256[t] ), W[t & 15] ) );
+            T2 = MB_ADD( MB_S2( V[0] ), MB_F0( V[0], V[1], V[2] ) );
+            V[7] = V[6]; V[6] = V[5]; V[5] = V[4]; V[4] = MB_ADD( V[3], T1 );
+            V[3] = V[2]; V[2] = V[1]; V[1] = V[0]; V[0] = MB_ADD( T1, T2 );
+        }
+
+        for( i = 0; i < 8; i++ )
+            S[i] = MB_ADD( S[i], V[i] );
+        o += 64;
+    }
+
+    for( i = 0; i < 8; i++ )
+    {
+        _mm256_storeu_si256( (__m256i *) out, S[i] );
+        for( t = 0; t < 8; t++ )
+            ctx[t]->state[i] = out[t];
+    }
+}
+
+#undef MB_ADD
+#undef MB_ROTR
+#undef MB_S0
+#undef MB_S1
+#undef MB_S2
+#undef MB_S3
+#undef MB_F0
+#undef MB_F1
+#endif /* SHA256_MB_AVX2 */
+
+#ifdef SHA256_MB_NEON
+#define MB_ADD(x,y)   vaddq_u32( x, y )
+#define MB_ROTR(x,n)  vorrq_u32( vshrq_n_u32( x, n ), vshlq_n_u32( x, 32 - n ) )
+#define MB_S0(x)      veorq_u32( veorq_u32( MB_ROTR( x,  7 ), MB_ROTR( x, 18 ) ), vshrq_n_u32( x,  3 ) )
+#define MB_S1(x)      veorq_u32( veorq_u32( MB_ROTR( x, 17 ), MB_ROTR( x, 19 ) ), vshrq_n_u32( x, 10 ) )
+#define MB_S2(x)      veorq_u32( veorq_u32( MB_ROTR( x,  2 ), MB_ROTR( x, 13 ) ), MB_ROTR( x, 22 ) )
+#define MB_S3(x)      veorq_u32( veorq_u32( MB_ROTR( x,  6 ), MB_ROTR( x, 11 ) ), MB_ROTR( x, 25 ) )
+#define MB_F0(x,y,z)  vorrq_u32( vandq_u32( x, y ), vandq_u32( z, vorrq_u32( x, y ) ) )
+#define MB_F1(x,y,z)  veorq_u32( z, vandq_u32( x, veorq_u32( y, z ) ) )
+
+/*
+ *  Four streams, word i of the state and of the message schedule of lane l is kept in lane l of a vector.
+ */
+static void sha256_mb_blocks_neon( sha256_context **ctx, uint8 **data, uint32 blocks )
+{
+    uint32x4_t S[8], V[8], W[16], T1, T2;
+    uint32 tmp[4], o = 0;
+    int i, t;
+
+    for( i = 0; i < 8; i++ )
+    {
+        for( t = 0; t < 4; t++ )
+            tmp[t] = ctx[t]->state[i];
+        S[i] = vld1q_u32( tmp );
+    }
+
+    while( blocks-- )
+    {
+        for( i = 0; i < 8; i++ )
+            V[i] = S[i];
+
+        for( t = 0; t < 64; t++ )
+        {
+            if( t < 16 )
+            {
+                for( i = 0; i < 4; i++ )
+                    tmp[i] = sha256_be32( data[i] + o + 4 * t );
+                W[t] = vld1q_u32( tmp );
+            }
+            else
+                W[t & 15] = MB_ADD( MB_ADD( MB_S1( W[( t - 2 ) & 15] ), W[( t - 7 ) & 15] ),
+                                    MB_ADD( MB_S0( W[( t - 15 ) & 15] ), W[t & 15] ) );
+
+            T1 = MB_ADD( MB_ADD( MB_ADD( V[7], MB_S3( V[4] ) ), MB_F1( V[4], V[5], V[6] ) ),
+                         MB_ADD( vdupq_n_u32( K256[t] ), W[t & 15] ) );
+            T2 = MB_ADD( MB_S2( V[0] ), MB_F0( V[0], V[1], V[2] ) );
+            V[7] = V[6]; V[6] = V[5]; V[5] = V[4]; V[4] = MB_ADD( V[3], T1 );
+            V[3] = V[2]; V[2] = V[1]; V[1] = V[0]; V[0] = MB_ADD( T1, T2 );
+        }
+
+        for( i = 0; i < 8; i++ )
+            S[i] = MB_ADD( S[i], V[i] );
+        o += 64;
+    }
+
+    for( i = 0; i < 8; i++ )
+    {
+        vst1q_u32( tmp, S[i] );
+        for( t = 0; t < 4; t++ )
+            ctx[t]->state[i] = tmp[t];
+    }
+}
+
+#undef MB_ADD
+#undef MB_ROTR
+#undef MB_S0
+#undef MB_S1
+#undef MB_S2
+#undef MB_S3
+#undef MB_F0
+#undef MB_F1
+#endif /* SHA256_MB_NEON */
+
+/* the same backend is selected by all threads, a concurrent first use is harmless */
+static sha256_blocks_t sha256_select( void )
+{
+    sha256_blocks_t blocks = sha256_blocks_c;
+#ifdef SHA256_SHANI
+    if( sha256_has_shani() )
+        blocks = sha256_blocks_shani;
+#endif
+#ifdef SHA256_ARMV8
+    if( sha256_has_armv8() )
+        blocks = sha256_blocks_armv8;
+#endif
+    /* the SHA instructions hash a single stream faster than the portable code hashes several */
+    if( blocks == sha256_blocks_c )
+    {
+#ifdef SHA256_MB_AVX2
+        if( sha256_has_avx2() )
+        {
+            sha256_mb_lanes = 8;
+            sha256_mb_blocks = sha256_mb_blocks_avx2;
+        }
+#endif
+#ifdef SHA256_MB_NEON
+        sha256_mb_lanes = 4;
+        sha256_mb_blocks = sha256_mb_blocks_neon;
+#endif
+    }
+    sha256_blocks = blocks;
+    return( blocks );
+}
+
+/* all compiled backends in the order of preference, for tests and benchmarks */
+static const struct
+{
+    const char *name;
+    sha256_blocks_t blocks;
+    sha256_mb_blocks_t mb_blocks;
+    int mb_lanes;
+    int (*available)( void );
+}
+sha256_backends[] =
+{
+    { "c",        sha256_blocks_c,     0,                     0, 0 },
+#ifdef SHA256_MB_AVX2
+    { "c+avx2x8", sha256_blocks_c,     sha256_mb_blocks_avx2, 8, sha256_has_avx2 },
+#endif
+#ifdef SHA256_MB_NEON
+    { "c+neonx4", sha256_blocks_c,     sha256_mb_blocks_neon, 4, 0 },
+#endif
+#ifdef SHA256_SHANI
+    { "sha-ni",   sha256_blocks_shani, 0,                     0, sha256_has_shani },
+#endif
+#ifdef SHA256_ARMV8
+    { "armv8",    sha256_blocks_armv8, 0,                     0, sha256_has_armv8 },
+#endif
+};
+
+const char *sha256_use_backend( int n )
+{
+    int i;
+
+    if( n < 0 )
+    {
+        sha256_mb_blocks = 0;
+        sha256_mb_lanes = 0;
+        sha256_select();
+        return( 0 );
+    }
+
+    for( i = 0; i < (int) ( sizeof( sha256_backends ) / sizeof( sha256_backends[0] ) ); i++ )
+    {
+        if( sha256_backends[i].available && ! sha256_backends[i].available() )
+            continue;
+        if( n-- )
+            continue;
+        sha256_mb_blocks = sha256_backends[i].mb_blocks;
+        sha256_mb_lanes  = sha256_backends[i].mb_lanes;
+        sha256_blocks    = sha256_backends[i].blocks;
+        return( sha256_backends[i].name );
+    }
+    return( 0 );
+}
+
 void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
 {
+    sha256_blocks_t blocks = sha256_blocks ? sha256_blocks : sha256_select();
     uint32 left, fill;
 
     if( ! length ) return;
@@ -205,17 +687,18 @@ void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
     {
         memcpy( (void *) (ctx->buffer + left),
                 (void *) input, fill );
-        sha256_process( ctx, ctx->buffer );
+        blocks( ctx, ctx->buffer, 1 );
         length -= fill;
         input  += fill;
         left = 0;
     }
 
-    while( length >= 64 )
+    /* whole blocks straight from the caller's buffer */
+    if( length >= 64 )
     {
-        sha256_process( ctx, input );
-        length -= 64;
-        input  += 64;
+        blocks( ctx, input, length / 64 );
+        input  += length & ~0x3F;
+        length &= 0x3F;
     }
 
     if( length )
@@ -225,6 +708,94 @@ void sha256_update( sha256_context *ctx, uint8 *input, uint32 length )
     }
 }
 
+/* adds length to the hashed content length of ctx */
+static void sha256_count( sha256_context *ctx, uint32 length )
+{
+    ctx->total[0] += length;
+    ctx->total[0] &= 0xFFFFFFFF;
+
+    if( ctx->total[0] < length )
+        ctx->total[1]++;
+}
+
+/*
+ *  Same as sha256_update( ctx[i], input[i], length[i] ) for each of the lanes,
+ *  the whole blocks of the streams are hashed in parallel by the multi-buffer backend.
+ */
+void sha256_mb_update( sha256_context *ctx[], uint8 *input[], uint32 length[], int lanes )
+{
+    sha256_blocks_t blocks = sha256_blocks ? sha256_blocks : sha256_select();
+    sha256_context *c[SHA256_MB_LANES], dummy;
+    uint8 *in[SHA256_MB_LANES], *p[SHA256_MB_LANES];
+    uint32 len[SHA256_MB_LANES], left, n;
+    int i, j, k, m, lane[SHA256_MB_LANES];
+
+    sha256_starts( &dummy );
+
+    for( k = 0; k < lanes; k += SHA256_MB_LANES )
+    {
+        m = lanes - k < SHA256_MB_LANES ? lanes - k : SHA256_MB_LANES;
+
+        /* complete the buffered partial block, then each lane starts on a block boundary */
+        for( i = 0; i < m; i++ )
+        {
+            in[i]  = input[k + i];
+            len[i] = length[k + i];
+            left = ctx[k + i]->total[0] & 0x3F;
+            if( left && len[i] )
+            {
+                n = 64 - left < len[i] ? 64 - left : len[i];
+                sha256_update( ctx[k + i], in[i], n );
+                in[i]  += n;
+                len[i] -= n;
+            }
+            sha256_count( ctx[k + i], len[i] );
+        }
+
+        /* whole blocks of at least half the backend lanes in parallel, unused lanes hash dummy */
+        while( sha256_mb_blocks )
+        {
+            n = 0xFFFFFFFF;
+            for( i = j = 0; i < m && j < sha256_mb_lanes; i++ )
+            {
+                if( len[i] < 64 )
+                    continue;
+                if( len[i] / 64 < n )
+                    n = len[i] / 64;
+                c[j] = ctx[k + i];
+                p[j] = in[i];
+                lane[j++] = i;
+            }
+            if( j < 2 || j < sha256_mb_lanes / 2 )
+                break;
+            for( i = j; i < sha256_mb_lanes; i++ )
+            {
+                c[i] = &dummy;
+                p[i] = p[0];
+            }
+            sha256_mb_blocks( c, p, n );
+            for( i = 0; i < j; i++ )
+            {
+                in[lane[i]]  += n * 64;
+                len[lane[i]] -= n * 64;
+            }
+        }
+
+        /* the remaining blocks lane by lane */
+        for( i = 0; i < m; i++ )
+        {
+            if( len[i] >= 64 )
+            {
+                blocks( ctx[k + i], in[i], len[i] / 64 );
+                in[i]  += len[i] & ~0x3F;
+                len[i] &= 0x3F;
+            }
+            if( len[i] )
+                memcpy( (void *) ctx[k + i]->buffer, (void *) in[i], len[i] );
+        }
+    }
+}
+
 static uint8 sha256_padding[64] =
 {
  0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
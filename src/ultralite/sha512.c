@@ -0,0 +1,212 @@
+/**
+ * SmartCard-HSM Ultra-Light Library
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file sha512.c
+ * @brief FIPS-180-2 compliant SHA-384 and SHA-512, portable C
+ */
+
+#include <string.h>
+#include "sc-hsm-ultralite.h"
+
+typedef unsigned char uint8;
+typedef unsigned int uint32;
+typedef unsigned long long uint64;
+
+static const uint64 K[80] =
+{
+    0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL, 0xE9B5DBA58189DBBCULL,
+    0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL, 0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL,
+    0xD807AA98A3030242ULL, 0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+    0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL, 0xC19BF174CF692694ULL,
+    0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL, 0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL,
+    0x2DE92C6F592B0275ULL, 0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+    0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL, 0xBF597FC7BEEF0EE4ULL,
+    0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL, 0x06CA6351E003826FULL, 0x142929670A0E6E70ULL,
+    0x27B70A8546D22FFCULL, 0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+    0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL, 0x92722C851482353BULL,
+    0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL, 0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL,
+    0xD192E819D6EF5218ULL, 0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+    0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL, 0x34B0BCB5E19B48A8ULL,
+    0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL, 0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL,
+    0x748F82EE5DEFB2FCULL, 0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+    0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL, 0xC67178F2E372532BULL,
+    0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL, 0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL,
+    0x06F067AA72176FBAULL, 0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+    0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL, 0x431D67C49C100D4CULL,
+    0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL, 0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL
+};
+
+#define GET_UINT64(n,b,i)                       \
+{                                               \
+    (n) = ( (uint64) (b)[(i)    ] << 56 )       \
+        | ( (uint64) (b)[(i) + 1] << 48 )       \
+        | ( (uint64) (b)[(i) + 2] << 40 )       \
+        | ( (uint64) (b)[(i) + 3] << 32 )       \
+        | ( (uint64) (b)[(i) + 4] << 24 )       \
+        | ( (uint64) (b)[(i) + 5] << 16 )       \
+        | ( (uint64) (b)[(i) + 6] <<  8 )       \
+        | ( (uint64) (b)[(i) + 7]       );      \
+}
+
+#define PUT_UINT64(n,b,i)                       \
+{                                               \
+    (b)[(i)    ] = (uint8) ( (n) >> 56 );       \
+    (b)[(i) + 1] = (uint8) ( (n) >> 48 );       \
+    (b)[(i) + 2] = (uint8) ( (n) >> 40 );       \
+    (b)[(i) + 3] = (uint8) ( (n) >> 32 );       \
+    (b)[(i) + 4] = (uint8) ( (n) >> 24 );       \
+    (b)[(i) + 5] = (uint8) ( (n) >> 16 );       \
+    (b)[(i) + 6] = (uint8) ( (n) >>  8 );       \
+    (b)[(i) + 7] = (uint8) ( (n)       );       \
+}
+
+void sha512_starts( sha512_context *ctx )
+{
+    ctx->total[0] = 0;
+    ctx->total[1] = 0;
+    ctx->is384 = 0;
+
+    ctx->state[0] = 0x6A09E667F3BCC908ULL;
+    ctx->state[1] = 0xBB67AE8584CAA73BULL;
+    ctx->state[2] = 0x3C6EF372FE94F82BULL;
+    ctx->state[3] = 0xA54FF53A5F1D36F1ULL;
+    ctx->state[4] = 0x510E527FADE682D1ULL;
+    ctx->state[5] = 0x9B05688C2B3E6C1FULL;
+    ctx->state[6] = 0x1F83D9ABFB41BD6BULL;
+    ctx->state[7] = 0x5BE0CD19137E2179ULL;
+}
+
+void sha384_starts( sha512_context *ctx )
+{
+    ctx->total[0] = 0;
+    ctx->total[1] = 0;
+    ctx->is384 = 1;
+
+    ctx->state[0] = 0xCBBB9D5DC1059ED8ULL;
+    ctx->state[1] = 0x629A292A367CD507ULL;
+    ctx->state[2] = 0x9159015A3070DD17ULL;
+    ctx->state[3] = 0x152FECD8F70E5939ULL;
+    ctx->state[4] = 0x67332667FFC00B31ULL;
+    ctx->state[5] = 0x8EB44A8768581511ULL;
+    ctx->state[6] = 0xDB0C2E0D64F98FA7ULL;
+    ctx->state[7] = 0x47B5481DBEFA4FA4ULL;
+}
+
+#define  SHR(x,n) ((x) >> (n))
+#define ROTR(x,n) (SHR(x,n) | ((x) << (64 - (n))))
+
+#define S0(x) (ROTR(x, 1) ^ ROTR(x, 8) ^  SHR(x, 7))
+#define S1(x) (ROTR(x,19) ^ ROTR(x,61) ^  SHR(x, 6))
+
+#define S2(x) (ROTR(x,28) ^ ROTR(x,34) ^ ROTR(x,39))
+#define S3(x) (ROTR(x,14) ^ ROTR(x,18) ^ ROTR(x,41))
+
+#define F0(x,y,z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define F1(x,y,z) ((z) ^ ((x) & ((y) ^ (z))))
+
+static void sha512_process( sha512_context *ctx, const uint8 data[128] )
+{
+    uint64 temp1, temp2, W[80];
+    uint64 A[8];
+    int i;
+
+    for( i = 0; i < 16; i++ )
+        GET_UINT64( W[i], data, i << 3 );
+
+    for( ; i < 80; i++ )
+        W[i] = S1(W[i - 2]) + W[i - 7] + S0(W[i - 15]) + W[i - 16];
+
+    memcpy( A, ctx->state, sizeof( A ) );
+
+    for( i = 0; i < 80; i++ )
+    {
+        temp1 = A[7] + S3(A[4]) + F1(A[4],A[5],A[6]) + K[i] + W[i];
+        temp2 = S2(A[0]) + F0(A[0],A[1],A[2]);
+        A[7] = A[6];
+        A[6] = A[5];
+        A[5] = A[4];
+        A[4] = A[3] + temp1;
+        A[3] = A[2];
+        A[2] = A[1];
+        A[1] = A[0];
+        A[0] = temp1 + temp2;
+    }
+
+    for( i = 0; i < 8; i++ )
+        ctx->state[i] += A[i];
+}
+
+void sha512_update( sha512_context *ctx, unsigned char *input, unsigned int length )
+{
+    uint32 left, fill;
+
+    if( ! length ) return;
+
+    left = (uint32) ( ctx->total[0] & 0x7F );
+    fill = 128 - left;
+
+    ctx->total[0] += length;
+
+    if( ctx->total[0] < length )
+        ctx->total[1]++;
+
+    if( left && length >= fill )
+    {
+        memcpy( (void *) (ctx->buffer + left),
+                (void *) input, fill );
+        sha512_process( ctx, ctx->buffer );
+        length -= fill;
+        input  += fill;
+        left = 0;
+    }
+
+    while( length >= 128 )
+    {
+        sha512_process( ctx, input );
+        length -= 128;
+        input  += 128;
+    }
+
+    if( length )
+    {
+        memcpy( (void *) (ctx->buffer + left),
+                (void *) input, length );
+    }
+}
+
+static uint8 sha512_padding[128] =
+{
+ 0x80
+};
+
+/* writes 64 bytes for SHA-512 and 48 bytes for a context started with sha384_starts */
+void sha512_finish( sha512_context *ctx, unsigned char digest[64] )
+{
+    uint32 last, padn;
+    uint64 high, low;
+    uint8 msglen[16];
+    int i;
+
+    high = ( ctx->total[0] >> 61 )
+         | ( ctx->total[1] <<  3 );
+    low  = ( ctx->total[0] <<  3 );
+
+    PUT_UINT64( high, msglen, 0 );
+    PUT_UINT64( low,  msglen, 8 );
+
+    last = (uint32) ( ctx->total[0] & 0x7F );
+    padn = ( last < 112 ) ? ( 112 - last ) : ( 240 - last );
+
+    sha512_update( ctx, sha512_padding, padn );
+    sha512_update( ctx, msglen, 16 );
+
+    for( i = 0; i < ( ctx->is384 ? 6 : 8 ); i++ )
+        PUT_UINT64( ctx->state[i], digest, i << 3 );
+}
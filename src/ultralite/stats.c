@@ -0,0 +1,93 @@
+/**
+ * SmartCard-HSM Ultra-Light Library
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file stats.c
+ * @brief Cumulative latency statistics of the signing phases
+ */
+
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "sc-hsm-ultralite.h"
+#include "stats.h"
+
+/*
+	The counters are updated lock free, so the statistics do not serialize signing threads.
+	A snapshot taken while signing may combine a count with the time of the previous update.
+*/
+#if defined(_WIN32)
+	#define STATS_ADD(ptr, val) InterlockedExchangeAdd64((volatile LONGLONG*)(ptr), (LONGLONG)(val))
+	#define STATS_CAS(ptr, old, val) (InterlockedCompareExchange64((volatile LONGLONG*)(ptr), (LONGLONG)(val), (LONGLONG)(old)) == (LONGLONG)(old))
+#elif defined(HAVE_SYNC_ADD_AND_FETCH)
+	#define STATS_ADD(ptr, val) __sync_add_and_fetch((ptr), (val))
+	#define STATS_CAS(ptr, old, val) __sync_bool_compare_and_swap((ptr), (old), (val))
+#else /* not thread-safe */
+	#define STATS_ADD(ptr, val) (*(ptr) += (val))
+	#define STATS_CAS(ptr, old, val) (*(ptr) = (val), 1)
+#endif
+
+static struct sc_stats Stats;
+
+unsigned long long StatsNow(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (unsigned long long)(count.QuadPart / freq.QuadPart * 1000000
+		+ count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	return (unsigned long long)clock() * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+void StatsAddPhase(int phase, unsigned long long start)
+{
+	struct sc_stats_phase *p;
+	unsigned long long us = StatsNow() - start, max;
+	int i;
+	if (phase < 0 || phase >= SC_STATS_PHASES)
+		return;
+	p = &Stats.phase[phase];
+	for (i = 0; i < SC_STATS_BUCKETS - 1 && us >= 32ull << i; i++)
+		;
+	STATS_ADD(&p->count, 1);
+	STATS_ADD(&p->totalUs, us);
+	STATS_ADD(&p->histogram[i], 1);
+	do {
+		max = p->maxUs;
+	} while (us > max && !STATS_CAS(&p->maxUs, max, us));
+}
+
+void StatsAddAPDU(int bytesOut, int bytesIn)
+{
+	STATS_ADD(&Stats.apdus, 1);
+	STATS_ADD(&Stats.bytesOut, bytesOut);
+	STATS_ADD(&Stats.bytesIn, bytesIn);
+}
+
+void EXPORT_FUNC get_sign_stats(struct sc_stats *stats)
+{
+	if (stats)
+		memcpy(stats, &Stats, sizeof(Stats));
+}
+
+void EXPORT_FUNC reset_sign_stats(void)
+{
+	memset(&Stats, 0, sizeof(Stats));
+}
@@ -0,0 +1,32 @@
+/**
+ * SmartCard-HSM Ultra-Light Library
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file stats.h
+ * @brief Internal use only.
+ */
+
+#ifndef __stats_h__
+#define __stats_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* monotonic time in us, start value for StatsAddPhase */
+unsigned long long StatsNow(void);
+/* account the time since start to phase (SC_STATS_*) */
+void StatsAddPhase(int phase, unsigned long long start);
+/* account one APDU exchange */
+void StatsAddAPDU(int bytesOut, int bytesIn);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __stats_h__ */
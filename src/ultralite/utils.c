@@ -18,7 +18,10 @@
 
 #include "log.h"
 #include "utils.h"
+#include "stats.h"
 #include "sc-hsm-ultralite.h"
+#include <common/apdu.h>
+#include <common/emulator.h>
 
 /*******************************************************************************
  *******************************************************************************
@@ -28,132 +31,495 @@
  *******************************************************************************
  ******************************************************************************/
 
+static int SC_VerifyPin(SC_Card_t *card, const char *pin);
+
+/*
+	With SC_HSM_EMULATOR set the readers of the emulator replace the CT-API or PC/SC readers,
+	see common/emulator.h. Each function of the reader interface starts with the emulator case.
+*/
+
+/* reader: (part of) the emulator reader name or NULL for the 1st reader */
+static int SC_EmuOpen(SC_Card_t *card, const char *pin, const char *reader)
+{
+	char name[64];
+	int rc, i, count;
+	count = emu_readers();
+	for (i = 0; i < count; i++) {
+		sprintf(name, "%s %d", EMU_READER_NAME, i);
+		if (reader == 0 || strstr(name, reader))
+			break;
+	}
+	if (i == count) {
+		log_err("no card found");
+		return ERR_CARD;
+	}
+	memset(card, 0, sizeof(*card));
+	card->EmuReader = i;
+	card->MaxData = MAX_APDU_DATA;
+	emu_reset(i);
+	rc = SC_Logon(card, pin);
+	if (rc < 0)
+		return ERR_PIN;
+	return 0;
+}
+
+static int SC_EmuListReaders(char **pReaders)
+{
+	char *p;
+	int i, count;
+	count = emu_readers();
+	*pReaders = p = (char*)malloc(count * (sizeof(EMU_READER_NAME) + 4) + 1);
+	if (p == 0)
+		return ERR_MEMORY;
+	for (i = 0; i < count; i++)
+		p += sprintf(p, "%s %d", EMU_READER_NAME, i) + 1;
+	*p = 0;
+	return count;
+}
+
 #ifdef CTAPI /* via libusb */
 #include <ctccid/ctapi.h>
 
-static uint16 Ctn;
-
-/* used only for SC_Open */
-static int SC_Init()
+/* used by SC_Open and SC_Reconnect */
+static int SC_Init(SC_Card_t *card)
 {
 	uint8 dad = 1;   /* Reader */
 	uint8 sad = 2;   /* Host   */
 	uint8 buf[260];
 	uint16 len = sizeof(buf);
 	/* - REQUEST ICC */
-	int rc = CT_data(Ctn, &dad, &sad, 5, (uint8*)"\x20\x12\x00\x01\x00", &len, buf);
+	int rc = CT_data(card->Ctn, &dad, &sad, 5, (uint8*)"\x20\x12\x00\x01\x00", &len, buf);
 	if (rc < 0 || buf[0] == 0x64 || buf[0] == 0x62)
 		return ERR_CARD;
 	return buf[len - 1] == 0x00 ? 1 : 2;  /* Memory or processor card ? */
 }
 
-#define MAXPORT 2
+#define MAXPORT 64
 
-int SC_Open(const char *pin, const char *reader)
+/* ports of the readers attached, see CT_ports */
+static int SC_Ports(uint16 *ports)
 {
-	int rc;
-	uint16 i;
+	uint16 count = MAXPORT;
+	if (CT_ports(ports, &count) < 0)
+		return 0;
+	return count;
+}
+
+/* reader: port number as decimal string or NULL for the 1st available card */
+int SC_Open(SC_Card_t *card, const char *pin, const char *reader)
+{
+	int rc, i, count;
+	uint16 ports[MAXPORT];
+	if (emu_active())
+		return SC_EmuOpen(card, pin, reader);
+	if (reader) {
+		ports[0] = (uint16)atoi(reader);
+		count = 1;
+	} else {
+		count = SC_Ports(ports);
+	}
+	card->Open = 0;
 	/* find 1st available card */
-	for (i = 0; i < MAXPORT; i++) {
-		if (CT_init(i, i) < 0)
+	for (i = 0; i < count; i++) {
+		if (CT_init(ports[i], ports[i]) < 0)
 			continue;
-		Ctn = i;
-		if (SC_Init() < 0) {
-			CT_close(i);
+		card->Ctn = ports[i];
+		if (SC_Init(card) < 0) {
+			CT_close(ports[i]);
 			continue;
 		}
 		break;
 	}
-	if (Ctn == MAXPORT) {
+	if (i == count) {
 		log_err("no card found");
 		return ERR_CARD;
 	}
-	rc = SC_Logon(pin);
+	card->Open = 1;
+	/* ctccid chains longer APDUs (T=1 or extended APDU level exchange) */
+	card->MaxData = MAX_APDU_DATA;
+	rc = SC_Logon(card, pin);
 	if (rc < 0) {
-		CT_close(Ctn);
+		SC_Close(card);
 		return ERR_PIN;
 	}
 	return 0;
 }
 
-int SC_Close()
+/* returns the ports of the readers attached as decimal strings "0\0" "1\0" .. "\0" in *pReaders, free with free() */
+int SC_ListReaders(char **pReaders)
+{
+	uint16 ports[MAXPORT];
+	char *p;
+	int i, count;
+	if (emu_active())
+		return SC_EmuListReaders(pReaders);
+	count = SC_Ports(ports);
+	*pReaders = p = (char*)malloc(count * 6 + 1);
+	if (p == 0)
+		return ERR_MEMORY;
+	for (i = 0; i < count; i++)
+		p += sprintf(p, "%d", ports[i]) + 1;
+	*p = 0;
+	return count;
+}
+
+/* listener for readers attached or detached, see CT_watch */
+int SC_WatchReaders(SC_ReaderEvent_t listener, void *arg)
+{
+	if (emu_active())
+		return ERR_READER;
+	return CT_watch(listener, arg) < 0 ? ERR_READER : 0;
+}
+
+void SC_UnwatchReaders(SC_ReaderEvent_t listener, void *arg)
+{
+	if (emu_active())
+		return;
+	CT_unwatch(listener, arg);
+}
+
+int SC_Close(SC_Card_t *card)
+{
+	if (emu_active())
+		return 0;
+	if (!card->Open)
+		return 0;
+	card->Open = 0;
+	return CT_close(card->Ctn);
+}
+
+/*
+	Resets the card of the open port and selects the application again (see SC_LogonSession).
+	Cheaper than SC_Close/SC_Open, the port stays initialized.
+	A card which was removed and reinserted is not active yet and is activated by REQUEST ICC.
+*/
+int SC_Reconnect(SC_Card_t *card, const char *pin)
+{
+	uint8 dad = 1;   /* Reader */
+	uint8 sad = 2;   /* Host   */
+	uint8 buf[260];
+	uint16 len = sizeof(buf);
+	int rc;
+	if (emu_active()) {
+		emu_reset(card->EmuReader);
+		return SC_LogonSession(card, pin);
+	}
+	if (!card->Open)
+		return ERR_CARD;
+	/* - RESET ICC (return complete ATR) */
+	rc = CT_data(card->Ctn, &dad, &sad, 5, (uint8*)"\x20\x11\x01\x01\x00", &len, buf);
+	if ((rc < 0 || len < 2 || buf[len - 2] != 0x90) && SC_Init(card) < 0)
+		return ERR_CARD;
+	return SC_LogonSession(card, pin);
+}
+
+/*
+	Returns 0 if the card is still powered since SC_Open, 1 if it may have been removed or reset.
+	A (re)inserted card stays inactive until the next REQUEST ICC, so "card in, CVCC on" proves
+	that the session established by SC_Open is still valid.
+*/
+int SC_CardChanged(SC_Card_t *card)
+{
+	uint8 dad = 1;   /* Reader */
+	uint8 sad = 2;   /* Host   */
+	uint8 buf[16];
+	uint16 len = sizeof(buf);
+	int rc;
+	if (emu_active())
+		return 0;
+	if (!card->Open)
+		return 1;
+	/* - GET STATUS (ICC status DO) */
+	rc = CT_data(card->Ctn, &dad, &sad, 4, (uint8*)"\x20\x13\x01\x80", &len, buf);
+	if (rc < 0 || len < 5 || buf[0] != 0x80 || buf[len - 2] != 0x90)
+		return 1;
+	return (buf[2] & 0x05) == 0x05 ? 0 : 1;
+}
+
+/* the CT-API port is opened exclusively by SC_Open, no transactions needed */
+int SC_BeginTransaction(SC_Card_t *card)
+{
+	return 0;
+}
+
+int SC_EndTransaction(SC_Card_t *card, int keep)
+{
+	return 0;
+}
+
+void SC_ReleaseTransaction(SC_Card_t *card)
 {
-	return CT_close(Ctn);
 }
 
 #else /* via PCSC */
 #ifndef _WIN32
-#include <pcsclite.h>
+#include <reader.h> /* SCARD_ATTR_MAXINPUT */
 #endif
-#include <winscard.h>
 
-static SCARDCONTEXT hContext;
-static SCARDHANDLE hCard;
+/*
+	Maximum data length of one response. Readers with an extended APDU buffer report its size
+	as SCARD_ATTR_MAXINPUT. Readers with TPDU exchange report the CCID message size although
+	the driver chains longer APDUs, so the reported size never lowers the default MAX_OUT_IN.
+*/
+static int SC_GetMaxData(SC_Card_t *card)
+{
+	int maxData = MAX_OUT_IN;
+#ifdef SCARD_ATTR_MAXINPUT
+	uint8 attr[4];
+	DWORD attrLen = sizeof(attr);
+	if (SCardGetAttrib(card->hCard, SCARD_ATTR_MAXINPUT, attr, &attrLen) == SCARD_S_SUCCESS && attrLen == 4) {
+		int maxInput = attr[0] | attr[1] << 8 | attr[2] << 16 | attr[3] << 24; /* DWORD, little endian */
+		if (maxInput - 2 > maxData) /* sw1sw2 */
+			maxData = maxInput - 2 < MAX_APDU_DATA ? maxInput - 2 : MAX_APDU_DATA;
+	}
+#endif
+	return maxData;
+}
 
-int SC_Open(const char *pin, const char* notused)
+/* begin the PC/SC transaction of the card handle, a failure only costs the exclusive access */
+static void SC_LockCard(SC_Card_t *card)
+{
+	int rc = SCardBeginTransaction(card->hCard);
+	if (rc != SCARD_S_SUCCESS) {
+		log_wrn("SCardBeginTransaction returned 0x%x", rc);
+		return;
+	}
+	card->TxActive = 1;
+}
+
+static void SC_UnlockCard(SC_Card_t *card)
+{
+	if (!card->TxActive)
+		return;
+	card->TxActive = 0;
+	SCardEndTransaction(card->hCard, SCARD_LEAVE_CARD);
+}
+
+/* reader: (part of) the PC/SC reader name or NULL for the 1st token found */
+int SC_Open(SC_Card_t *card, const char *pin, const char *reader)
 {
 	int rc, len, found;
 	LPSTR readerNames, readerName;
 	DWORD readersLen;
-	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+	if (emu_active())
+		return SC_EmuOpen(card, pin, reader);
+	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &card->hContext);
 	if (rc != SCARD_S_SUCCESS) {
 		log_err("could not establish pcsc context");
+		card->hContext = 0;
 		return ERR_CONTEXT;
 	}
 	readersLen = SCARD_AUTOALLOCATE;
-	rc = SCardListReaders(hContext, 0, (LPTSTR)&readerNames, &readersLen);
+	rc = SCardListReaders(card->hContext, 0, (LPTSTR)&readerNames, &readersLen);
 	if (rc != SCARD_S_SUCCESS || readerNames == NULL/*avoid compiler warning*/) {
 		log_err("no reader found");
-		rc = SCardReleaseContext(hContext);
+		rc = SCardReleaseContext(card->hContext);
+		card->hContext = 0;
 		return ERR_READER;
 	}
-	hCard = 0;
+	card->hCard = 0;
 	found = 0;
 	// find 1st token which supports the CardContact application (see SC_Logon)
 	for (readerName = readerNames; readerName[0] != 0; readerName += len) {
 		DWORD proto;
 		len = strlen(readerName) + 1;
-		rc = SCardConnect(hContext, readerName, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard, &proto);
+		if (reader && !strstr(readerName, reader))
+			continue;
+		rc = SCardConnect(card->hContext, readerName, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &card->hCard, &proto);
 		if (rc == SCARD_S_SUCCESS) {
-			if (SC_Logon(NULL) == 0) {
+			SC_LockCard(card); /* no other application between SELECT and VERIFY */
+			if (SC_Logon(card, NULL) == 0) {
 				found = 1;
 				break;
 			} else {
-				SCardDisconnect(hCard, SCARD_LEAVE_CARD);
-				hCard = 0;
+				SCardDisconnect(card->hCard, SCARD_LEAVE_CARD);
+				card->hCard = 0;
+				card->TxActive = 0;
 			}
 		}
 	}
-	SCardFreeMemory(hContext, readerNames);
+	SCardFreeMemory(card->hContext, readerNames);
 	if (!found) {
 		log_err("no card found");
-		SC_Close();
+		SC_Close(card);
 		return ERR_CARD;
 	}
-	rc = SC_Logon(pin);
+	card->AtrLen = sizeof(card->Atr);
+	if (SCardStatus(card->hCard, NULL, NULL, NULL, NULL, card->Atr, &card->AtrLen) != SCARD_S_SUCCESS)
+		card->AtrLen = 0;
+	card->MaxData = SC_GetMaxData(card);
+	/* the application is already selected by the probe, only one SELECT per reader */
+	rc = pin ? SC_VerifyPin(card, pin) : 0;
 	if (rc < 0) {
-		SC_Close();
+		SC_Close(card);
 		return ERR_PIN;
 	}
+	if (card->TxDepth == 0) /* else opened within SC_BeginTransaction */
+		SC_UnlockCard(card);
 	return 0;
 }
 
-int SC_Close()
+/* returns the reader names as multi-string "name0\0" "name1\0" .. "\0" in *pReaders, free with free() */
+int SC_ListReaders(char **pReaders)
 {
-	int rc;
-	rc = SCardDisconnect(hCard, SCARD_LEAVE_CARD);
-	hCard = 0;
-	rc = SCardReleaseContext(hContext);
-	hContext = 0;
+	SCARDCONTEXT hContext;
+	LPSTR readerNames, readerName;
+	DWORD readersLen;
+	int rc, n = 0;
+	if (emu_active())
+		return SC_EmuListReaders(pReaders);
+	*pReaders = 0;
+	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+	if (rc != SCARD_S_SUCCESS) {
+		log_err("could not establish pcsc context");
+		return ERR_CONTEXT;
+	}
+	readersLen = SCARD_AUTOALLOCATE;
+	rc = SCardListReaders(hContext, 0, (LPTSTR)&readerNames, &readersLen);
+	if (rc != SCARD_S_SUCCESS || readerNames == NULL/*avoid compiler warning*/) {
+		log_err("no reader found");
+		SCardReleaseContext(hContext);
+		return ERR_READER;
+	}
+	for (readerName = readerNames; readerName[0] != 0; readerName += strlen(readerName) + 1)
+		n++;
+	*pReaders = (char*)malloc(readerName - readerNames + 1);
+	if (*pReaders)
+		memcpy(*pReaders, readerNames, readerName - readerNames + 1);
+	SCardFreeMemory(hContext, readerNames);
+	SCardReleaseContext(hContext);
+	return *pReaders ? n : ERR_MEMORY;
+}
+
+/* PC/SC reports reader events only via SCardGetStatusChange, not supported */
+int SC_WatchReaders(SC_ReaderEvent_t listener, void *arg)
+{
+	return ERR_READER;
+}
+
+void SC_UnwatchReaders(SC_ReaderEvent_t listener, void *arg)
+{
+}
+
+int SC_Close(SC_Card_t *card)
+{
+	int rc = 0;
+	if (emu_active())
+		return 0;
+	if (card->hCard)
+		rc = SCardDisconnect(card->hCard, SCARD_LEAVE_CARD);
+	card->hCard = 0;
+	if (card->hContext)
+		rc = SCardReleaseContext(card->hContext);
+	card->hContext = 0;
+	card->AtrLen = 0;
+	card->TxActive = 0; /* ended by the disconnect, TxDepth stays for SC_EndTransaction */
+	return rc;
+}
+
+/*
+	Reconnects the card handle of SC_Open and selects the application again (see SC_LogonSession).
+	Cheaper than SC_Close/SC_Open, the PC/SC context and the reader stay the same.
+	The 1st attempt only acknowledges a reset or reinsertion, if the card still does not
+	respond to SELECT it is reset. A failing VERIFY is not retried to save the PIN retry counter.
+*/
+int SC_Reconnect(SC_Card_t *card, const char *pin)
+{
+	static const DWORD dispositions[] = { SCARD_LEAVE_CARD, SCARD_RESET_CARD };
+	DWORD proto;
+	int rc = ERR_CARD, i;
+	if (emu_active()) {
+		emu_reset(card->EmuReader);
+		return SC_LogonSession(card, pin);
+	}
+	if (!card->hCard)
+		return ERR_CARD;
+	SC_UnlockCard(card); /* fails after a reset, begun again below */
+	for (i = 0; i < 2; i++) {
+		rc = SCardReconnect(card->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, dispositions[i], &proto);
+		if (rc != SCARD_S_SUCCESS) {
+			log_err("SCardReconnect returned 0x%x", rc);
+			return ERR_CARD;
+		}
+		card->AtrLen = sizeof(card->Atr);
+		if (SCardStatus(card->hCard, NULL, NULL, NULL, NULL, card->Atr, &card->AtrLen) != SCARD_S_SUCCESS)
+			card->AtrLen = 0;
+		if (card->TxDepth > 0 && !card->TxActive)
+			SC_LockCard(card);
+		rc = SC_LogonSession(card, pin);
+		if (rc >= 0 || rc == ERR_PIN)
+			break;
+	}
 	return rc;
 }
 
+/*
+	Returns 0 if the card handle is still valid and the ATR unchanged, 1 if it may have been removed or reset.
+	PC/SC reports a removal or a reset (e.g. by another application sharing the card) as
+	SCARD_W_REMOVED_CARD or SCARD_W_RESET_CARD on the handle of SC_Open until it is reconnected.
+*/
+int SC_CardChanged(SC_Card_t *card)
+{
+	uint8 atr[sizeof(card->Atr)];
+	DWORD atrLen = sizeof(atr), state, proto, readerLen = 0;
+	int rc;
+	if (emu_active())
+		return 0;
+	if (!card->hCard || card->AtrLen == 0)
+		return 1;
+	rc = SCardStatus(card->hCard, NULL, &readerLen, &state, &proto, atr, &atrLen);
+	if (rc != SCARD_S_SUCCESS)
+		return 1;
+	if (atrLen != card->AtrLen || memcmp(atr, card->Atr, atrLen))
+		return 1;
+	return 0;
+}
+
+/*
+	Scope of a logical operation (template load, batch of signatures, object enumeration).
+	In SCARD_SHARE_SHARED mode another application may send APDUs between ours, e.g. SELECT
+	its own applet or reset the card, and every SCardTransmit has to check the sharing state.
+	Within the scope the card handle holds a PC/SC transaction, so the sequence is exclusive.
+	Scopes nest. A card opened or reconnected within a scope begins the transaction then.
+	Returns 0, the operation continues without transaction if it can not be begun.
+*/
+int SC_BeginTransaction(SC_Card_t *card)
+{
+	if (emu_active())
+		return 0;
+	if (card->TxDepth++ == 0 && !card->TxActive && card->hCard) /* else nested, held or no handle yet */
+		SC_LockCard(card);
+	return 0;
+}
+
+/*
+	Ends the scope of SC_BeginTransaction. With keep nonzero the transaction of the outermost
+	scope is held for the next one, which saves the begin and end round trips to the resource
+	manager, and has to be released with SC_ReleaseTransaction while the caller is idle.
+	Returns 1 if the transaction is held, else 0.
+*/
+int SC_EndTransaction(SC_Card_t *card, int keep)
+{
+	if (emu_active() || card->TxDepth > 0 && --card->TxDepth > 0)
+		return 0;
+	if (!keep)
+		SC_UnlockCard(card);
+	return card->TxActive;
+}
+
+/* end a transaction held by SC_EndTransaction, other applications may use the card again */
+void SC_ReleaseTransaction(SC_Card_t *card)
+{
+	if (card->TxDepth == 0)
+		SC_UnlockCard(card);
+}
+
 #endif /* !CTAPI */
 
-int SC_Logon(const char *pin)
+static int SC_SelectApplication(SC_Card_t *card)
 {
 	uint16 sw1sw2;
-	int rc, pinLen;
+	int rc;
 /*
 The SELECT APDU allows the terminal to select the SmartCard-HSM application on the
 device. The application is identified by the application identifier:
@@ -167,7 +533,7 @@ CardContact(24991) iso7816(2) smartcardhsm(1)
 	};
 	/* - SmartCard-HSM: SELECT APPLICATION */
 	rc = SC_ProcessAPDU(
-		0, 0x00,0xA4,0x04,0x0C,
+		card, 0, 0x00,0xA4,0x04,0x0C,
 		aid, sizeof(aid),
 		NULL, 0,
 		&sw1sw2);
@@ -179,13 +545,17 @@ CardContact(24991) iso7816(2) smartcardhsm(1)
 		log_err("select applet returned 0x%x", sw1sw2);
 		return ERR_APDU;
 	}
+	return rc;
+}
 
-	if (pin == 0)
-		return rc;
+static int SC_VerifyPin(SC_Card_t *card, const char *pin)
+{
+	uint16 sw1sw2;
+	int rc, pinLen;
 	pinLen = strlen(pin);
 	/* - SmartCard-HSM: VERIFY PIN */
 	rc = SC_ProcessAPDU(
-		0, 0x00,0x20,0x00,0x81,
+		card, 0, 0x00,0x20,0x00,0x81,
 		(uint8*)pin, pinLen,
 		NULL, 0,
 		&sw1sw2);
@@ -213,63 +583,118 @@ CardContact(24991) iso7816(2) smartcardhsm(1)
 	return rc;
 }
 
-int SC_ReadFile(uint16 fid, int off, uint8 *data, int dataLen)
+/*
+ *  PIN status of the selected application (VERIFY without data)
+ *
+ *  Returns : < 0 Error else sw1sw2, 0x9000 authenticated, 0x63Cx not authenticated (x tries left)
+ */
+int SC_GetPinStatus(SC_Card_t *card)
 {
 	uint16 sw1sw2;
 	int rc;
+	/* - SmartCard-HSM: VERIFY */
+	rc = SC_ProcessAPDU(
+		card, 0, 0x00,0x20,0x00,0x81,
+		NULL, 0,
+		NULL, 0,
+		&sw1sw2);
+	if (rc < 0)
+		return rc;
+	return sw1sw2;
+}
+
+/* SELECT and, if pin != NULL, VERIFY PIN */
+int SC_Logon(SC_Card_t *card, const char *pin)
+{
+	int rc = SC_SelectApplication(card);
+	if (rc < 0 || pin == 0)
+		return rc;
+	return SC_VerifyPin(card, pin);
+}
+
+/*
+	Logon for an existing session (reconnect, pool warm-up): SELECT, then VERIFY PIN only
+	if the token is not authenticated any more. Saves the round trip and the PIN check
+	of the card if the authentication survived, e.g. a reconnect without card reset.
+*/
+int SC_LogonSession(SC_Card_t *card, const char *pin)
+{
+	int rc = SC_SelectApplication(card);
+	if (rc < 0 || pin == 0)
+		return rc;
+	if (SC_GetPinStatus(card) == 0x9000)
+		return rc;
+	return SC_VerifyPin(card, pin);
+}
+
+int SC_ReadFile(SC_Card_t *card, uint16 fid, int off, uint8 *data, int dataLen)
+{
+	return SC_ReadBinary(card, fid, off, data, dataLen, dataLen);
+}
+
+/*
+	SC_ReadFile into a buffer of dataSize bytes. With dataSize >= dataLen + 2 the response
+	is received in place, the 2 bytes after the data are overwritten with sw1sw2.
+*/
+int SC_ReadBinary(SC_Card_t *card, uint16 fid, int off, uint8 *data, int dataLen, int dataSize)
+{
+	struct apdu apdu;
+	int rc;
 	uint8 offset[4];
+	if (dataLen < 0 || dataLen > 0x10000 || dataSize < dataLen || dataLen > 0 && !data)
+		return ERR_MEMORY;
 	offset[0] = 0x54;
 	offset[1] = 0x02;
 	offset[2] = off >> 8;
 	offset[3] = off >> 0;
 	/* - SmartCard-HSM: READ BINARY */
-	rc = SC_ProcessAPDU(
-		0, 0x00,
+	apdu_init(&apdu, 0x00,
 		0xB1,      /* READ BINARY */
 		fid >> 8,  /* MSB(fid) */
-		fid >> 0,  /* LSB(fid) */
-		offset, 4,
-		data, dataLen,
-		&sw1sw2);
+		fid >> 0); /* LSB(fid) */
+	apdu_add(&apdu, offset, 4);
+	apdu.ne = dataLen;
+	apdu.extended = dataLen > 256;
+	apdu.data = data;
+	apdu.size = dataSize;
+	rc = SC_TransmitAPDU(card, 0, &apdu);
 	if (rc < 0)
 		return rc;
-	if (sw1sw2 != 0x9000 && sw1sw2 != 0x6282)
+	if (apdu.sw1sw2 != 0x9000 && apdu.sw1sw2 != 0x6282)
 		return ERR_APDU;
 	return rc;
 }
 
-int SC_WriteFile(uint16 fid, int off, uint8 *data, int dataLen)
+int SC_WriteFile(SC_Card_t *card, uint16 fid, int off, uint8 *data, int dataLen)
 {
-	uint16 sw1sw2;
+	struct apdu apdu;
 	int rc;
-	uint8 buf[MAX_OUT_IN];
-	if (dataLen > MAX_OUT_IN - 6)
+	uint8 hdr[6];
+	if (dataLen < 0 || dataLen > MAX_OUT_IN - 6 || dataLen > 0 && !data)
 		return ERR_MEMORY;
-	buf[0] = 0x54;
-	buf[1] = 0x02;
-	buf[2] = off >> 8;
-	buf[3] = off >> 0;
-	buf[4] = 0x53;
-	buf[5] = 0;
-	memcpy(buf + 6, data, dataLen);
-
-	/* - SmartCard-HSM: UPDATE BINARY */
-	rc = SC_ProcessAPDU(
-		0, 0x00,
+	hdr[0] = 0x54;
+	hdr[1] = 0x02;
+	hdr[2] = off >> 8;
+	hdr[3] = off >> 0;
+	hdr[4] = 0x53;
+	hdr[5] = 0;
+
+	/* - SmartCard-HSM: UPDATE BINARY, the data follows the header without a copy */
+	apdu_init(&apdu, 0x00,
 		0xD7,      /* UPDATE BINARY */
 		fid >> 8,  /* MSB(fid) */
-		fid >> 0,  /* LSB(fid) */
-		buf, 6 + dataLen,
-		NULL, 0,
-		&sw1sw2);
+		fid >> 0); /* LSB(fid) */
+	apdu_add(&apdu, hdr, sizeof(hdr));
+	apdu_add(&apdu, data, dataLen);
+	rc = SC_TransmitAPDU(card, 0, &apdu);
 	if (rc < 0)
 		return rc;
-	if (sw1sw2 != 0x9000)
+	if (apdu.sw1sw2 != 0x9000)
 		return ERR_APDU;
 	return rc;
 }
 
-int SC_Sign(uint8 op, uint8 keyFid,
+int SC_Sign(SC_Card_t *card, uint8 op, uint8 keyFid,
 	uint8 *outBuf, int outLen,
 	uint8 *inBuf, int inSize)
 {
@@ -277,7 +702,7 @@ int SC_Sign(uint8 op, uint8 keyFid,
 	int rc;
 	/* - SmartCard-HSM: SIGN */
 	rc = SC_ProcessAPDU(
-		0, 0x80,
+		card, 0, 0x80,
 		0x68, /* SIGN */
 		keyFid,
 		op, /* Plain RSA(0x20) or ECDSA(0x70) signature */
@@ -291,9 +716,102 @@ int SC_Sign(uint8 op, uint8 keyFid,
 	return rc;
 }
 
+/*
+ *  Process a command described by apdu with the underlying terminal hardware.
+ *
+ *  card    : Card connection opened with SC_Open
+ *  todad   : Destination address (0 card, 1 reader)
+ *  apdu    : Command, see common/apdu.h. apdu->ne is the maximum response length,
+ *            apdu->data and apdu->size the buffer for the response data.
+ *
+ *  The command data parts are gathered into the transmit buffer. The response is received
+ *  straight into apdu->data if it has room for SW1SW2 after apdu->ne bytes, otherwise
+ *  into the transmit buffer and copied. The emulator needs neither.
+ *
+ *  Returns : < 0 Error >= 0 Bytes read, SW1SW2 in apdu->sw1sw2
+ */
+int SC_TransmitAPDU(SC_Card_t *card, int todad, struct apdu *apdu)
+{
+#ifdef SC_STATIC_MEMORY
+	uint8 *buf = card->Apdu;
+#else
+	uint8 buf[4 + 5 + MAX_OUT_IN];
+#endif
+	const int bufSize = 4 + 5 + MAX_OUT_IN;
+	uint8 *scr = buf, *rsp;
+	int rc, scrSize, cmdLen, inPlace;
+#ifdef CTAPI
+	uint16 len;
+#else
+	DWORD len;
+#endif
+	uint8 dad, sad;
+
+	/* Reset status word */
+	apdu->sw1sw2 = 0x0000;
+
+	if (apdu->ne > 0x10000 || apdu_nc(apdu) > 0x10000 /* crazy - invalid lengths */
+		|| apdu->ne > 0 && (!apdu->data || apdu->size < apdu->ne)) /* no in buffer */
+		return ERR_MEMORY;
+
+	if (emu_active()) {
+		rc = emu_transmit(card->EmuReader, apdu);
+		if (rc < 0)
+			return rc;
+		StatsAddAPDU((int)apdu_length(apdu), rc + 2);
+	} else {
+		/* worst case: long APDU and in and out, need space for sw1sw2 unless received in place */
+		inPlace = apdu_in_place(apdu);
+		cmdLen = (int)apdu_length(apdu);
+		scrSize = inPlace || cmdLen > (int)apdu->ne + 2 ? cmdLen : (int)apdu->ne + 2;
+		if (scrSize > 4 + 5 + MAX_APDU_DATA)
+			return ERR_MEMORY;
+		if (scrSize > bufSize) { /* large transfers (see SC_Card_t.MaxData) use a heap buffer */
+#ifdef SC_STATIC_MEMORY
+			return ERR_MEMORY; /* not reached, MAX_APDU_DATA is MAX_OUT_IN */
+#else
+			scr = (uint8*)malloc(scrSize);
+			if (scr == 0)
+				return ERR_MEMORY;
+#endif
+		} else {
+			scrSize = bufSize;
+		}
+		apdu_encode(apdu, scr, scrSize);
+		rsp = inPlace ? apdu->data : scr;
+		sad = HOST;
+		dad = todad;
+		len = inPlace ? (int)apdu->size : scrSize;
+#ifdef CTAPI
+		rc = CT_data(card->Ctn, &dad, &sad, (unsigned short)cmdLen, scr, &len, rsp);
+#else
+		rc = SCardTransmit(card->hCard, SCARD_PCI_T1, scr, (unsigned)cmdLen, 0, rsp, &len);
+#endif
+		if (rc < 0)
+			goto done;
+		StatsAddAPDU(cmdLen, (int)len);
+		rc = ERR_INVALID;
+		if (len < 2) /* sw1sw2 missing? */
+			goto done;
+		if (len - 2 > apdu->ne) /* never truncate */
+			goto done;
+		apdu_response(apdu, rsp, len);
+	}
+	rc = ERR_MEMORY;
+	if (apdu->sw1sw2 >> 8 == 0x6C) /* not enough buffer supplied */
+		goto done;
+	rc = (int)apdu->len;
+done:
+	if (scr != buf)
+		free(scr);
+	return rc;
+}
+
 /*
  *  Process an ISO 7816 APDU with the underlying terminal hardware.
  *
+ *  card    : Card connection opened with SC_Open
+ *  todad   : Destination address (0 card, 1 reader)
  *  cla     : Class byte of instruction
  *  ins     : Instruction byte
  *  p1      : Parameter P1
@@ -307,85 +825,36 @@ int SC_Sign(uint8 op, uint8 keyFid,
  *  Returns : < 0 Error >= 0 Bytes read
  */
 int SC_ProcessAPDU(
-	int todad,
+	SC_Card_t *card, int todad,
 	uint8 cla, uint8 ins, uint8 p1, uint8 p2,
 	uint8 *outData, int outLen,
 	uint8 *inData, int inLen,
 	uint16 *sw1sw2)
 {
-	uint8 scr[4 + 5 + MAX_OUT_IN];
+	struct apdu apdu;
 	int rc;
-#ifdef CTAPI
-	uint16 len;
-#else
-	DWORD len;
-#endif
-	uint8 dad, sad;
-	uint8 *p;
 
 	/* Reset status word */
 	*sw1sw2 = 0x0000;
 
-	if (!scr
-		|| 4 + 5 + outLen > sizeof(scr)        /* worst case: long APDU and in and out */
-		|| inLen + 2 > sizeof(scr)             /* need space for sw1sw2 */
-		|| !(0 <= inLen  && inLen  <= 0x10000) /* crazy - invalid in length */
+	if (!(0 <= inLen  && inLen  <= 0x10000)    /* crazy - invalid in length */
 		|| !(0 <= outLen && outLen <= 0x10000) /* crazy - invalid out length */
 		|| outLen > 0 && !outData              /* no out buffer */
 		|| inLen  > 0 && !inData               /* no in buffer */
 	)
 		return ERR_MEMORY;
 
-	p = scr;
-	*p++ = cla;
-	*p++ = ins;
-	*p++ = p1;
-	*p++ = p2;
+	apdu_init(&apdu, cla, ins, p1, p2);
+	apdu_add(&apdu, outData, outLen);
+	apdu.ne = inLen;
+	apdu.data = inData;
+	apdu.size = inLen;
 	/* if Lc not present use long APDU for inLen == 256 */
 	/* outLen == 0 && inLen == 256 => ambiguous b/c first byte 0 should mean extended APDU */
-	if (outLen <= 255
-		&& (inLen <= 255 || outLen > 0 && inLen == 256))
-	{                                    /* use short APDU */
-		if (outLen > 0) {                /* Lc present */
-			*p++ = (uint8)outLen;
-			memcpy(p, outData, outLen);
-			p += outLen;
-		}
-		if (inLen > 0)                   /* Le present */
-			*p++ = (uint8)inLen;         /* (uint8)256 == 0 */
-	} else {                             /* use long APDU */
-		*p++ = 0;                        /* indicate long APDU */
-		if (outLen > 0) {                /* Lc present */
-			*p++ = (uint8)(outLen >> 8);
-			*p++ = (uint8)(outLen     );
-			memcpy(p, outData, outLen);
-			p += outLen;
-		}
-		if (inLen > 0) {                 /* Le present */
-			*p++ = (uint8)(inLen >> 8);
-			*p++ = (uint8)(inLen     );
-		}
-	}
-	sad = HOST;
-	dad = todad;
-	len = sizeof(scr);
-#ifdef CTAPI
-	rc = CT_data(Ctn, &dad, &sad, (unsigned short)(p - scr), scr, &len, scr);
-#else
-	rc = SCardTransmit(hCard, SCARD_PCI_T1, scr, (unsigned)(p - scr), 0, scr, &len);
-#endif
-	if (rc < 0)
-		return rc;
-	if (len < 2) /* sw1sw2 missing? */
-		return ERR_INVALID;
-	if (len - 2 > inLen) /* never truncate */
-		return ERR_INVALID;
-	if (scr[len - 2] == 0x6C) /* not enough buffer supplied */
-		return ERR_MEMORY;
-	rc = len - 2;
-	if (inLen > 0)
-		memcpy(inData, scr, rc);
-	*sw1sw2 = scr[len - 2] << 8 | scr[len - 1];
+	apdu.extended = !(outLen <= 255
+		&& (inLen <= 255 || outLen > 0 && inLen == 256));
+
+	rc = SC_TransmitAPDU(card, todad, &apdu);
+	*sw1sw2 = apdu.sw1sw2;
 	return rc;
 }
-
@@ -16,31 +16,83 @@
 #ifndef __utils_h__
 #define __utils_h__
 
-#if defined(_WIN32) || defined(__linux__)
+#if defined(SC_STATIC_MEMORY) /* no heap after init, see sc-hsm-ultralite.c */
+#ifndef MAX_OUT_IN
+#define MAX_OUT_IN 512 /* RSA-4k signature */
+#endif
+/* the transmit buffer of the card (see SC_Card_t) bounds every transfer */
+#define MAX_APDU_DATA MAX_OUT_IN
+#elif defined(_WIN32) || defined(__linux__)
 #define MAX_OUT_IN 8192
+/* longer transfers use a heap buffer, a multiple of 256 which fits 16 bit lengths incl. header and sw1sw2 */
+#define MAX_APDU_DATA 0xFF00
 #else /* save stack space on systems with limited memory */
 #define MAX_OUT_IN 256
+#define MAX_APDU_DATA MAX_OUT_IN
 #endif
 
 typedef unsigned char uint8;
 typedef unsigned short uint16;
 
+#ifndef CTAPI
+#ifndef _WIN32
+#include <pcsclite.h>
+#endif
+#include <winscard.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* card connection, one per token session */
+typedef struct {
+#ifdef CTAPI
+	uint16 Ctn;
+	int Open;
+#else
+	SCARDCONTEXT hContext;
+	SCARDHANDLE hCard;
+	uint8 Atr[33];
+	DWORD AtrLen;
+	int TxDepth; /* nesting of SC_BeginTransaction */
+	int TxActive; /* PC/SC transaction begun, held after the outermost SC_EndTransaction with keep */
+#endif
+	int MaxData; /* maximum data length of one READ BINARY, see SC_Open */
+	int EmuReader; /* reader of the emulator (see common/emulator.h), if SC_HSM_EMULATOR is set */
+#ifdef SC_STATIC_MEMORY
+	uint8 Apdu[4 + 5 + MAX_OUT_IN]; /* transmit buffer of SC_TransmitAPDU instead of the stack */
+#endif
+} SC_Card_t;
+
+/* listener for readers attached (attached nonzero) or detached, called from the USB event thread (CTAPI only) */
+typedef void (*SC_ReaderEvent_t)(unsigned short port, int attached, void *arg);
+
 /* utility functions */
 
-int SC_Open(const char *pin, const char *reader);
-int SC_Close();
-int SC_Logon(const char *pin);
-int SC_ReadFile(uint16 fid, int off, uint8 *data, int dataLen);
-int SC_WriteFile(uint16 fid, int off, uint8 *data, int dataLen);
-int SC_Sign(uint8 op, uint8 keyFid,
+int SC_Open(SC_Card_t *card, const char *pin, const char *reader);
+int SC_Close(SC_Card_t *card);
+int SC_ListReaders(char **pReaders);
+int SC_WatchReaders(SC_ReaderEvent_t listener, void *arg);
+void SC_UnwatchReaders(SC_ReaderEvent_t listener, void *arg);
+int SC_Reconnect(SC_Card_t *card, const char *pin);
+int SC_CardChanged(SC_Card_t *card);
+int SC_BeginTransaction(SC_Card_t *card);
+int SC_EndTransaction(SC_Card_t *card, int keep);
+void SC_ReleaseTransaction(SC_Card_t *card);
+int SC_Logon(SC_Card_t *card, const char *pin);
+int SC_LogonSession(SC_Card_t *card, const char *pin);
+int SC_GetPinStatus(SC_Card_t *card);
+int SC_ReadFile(SC_Card_t *card, uint16 fid, int off, uint8 *data, int dataLen);
+int SC_ReadBinary(SC_Card_t *card, uint16 fid, int off, uint8 *data, int dataLen, int dataSize);
+int SC_WriteFile(SC_Card_t *card, uint16 fid, int off, uint8 *data, int dataLen);
+int SC_Sign(SC_Card_t *card, uint8 op, uint8 keyFid,
 	uint8 *outBuf, int outLen,
 	uint8 *inBuf, int inSize);
+struct apdu;
+int SC_TransmitAPDU(SC_Card_t *card, int todad, struct apdu *apdu);
 int SC_ProcessAPDU(
-	int todad,
+	SC_Card_t *card, int todad,
 	uint8 cla, uint8 ins, uint8 p1, uint8 p2,
 	uint8 *outData, int outLen,
 	uint8 *inData, int inLen,